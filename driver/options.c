@@ -38,6 +38,12 @@ WNBD_OPTION WnbdDriverOptions[] = {
     WNBD_DEF_OPT(L"RemoveStaleConnections", Bool, TRUE),
     WNBD_DEF_OPT(L"StaleReqTimeoutMs", Int64, WNBD_DEFAULT_STALE_REQ_TIMEOUT_MS),
     WNBD_DEF_OPT(L"StaleConnTimeoutMs", Int64, WNBD_DEFAULT_STALE_CONN_TIMEOUT_MS),
+    WNBD_DEF_OPT(L"PrioritySchedulingEnabled", Bool, FALSE),
+    WNBD_DEF_OPT(L"LatencyClassWeight", Int64, WNBD_DEFAULT_SCHED_LATENCY_WEIGHT),
+    WNBD_DEF_OPT(L"BulkClassWeight", Int64, WNBD_DEFAULT_SCHED_BULK_WEIGHT),
+    WNBD_DEF_OPT(L"SmallIoMaxBytes", Int64, WNBD_DEFAULT_SCHED_SMALL_IO_MAX_BYTES),
+    WNBD_DEF_OPT(L"AdaptiveQueueDepth", Bool, FALSE),
+    WNBD_DEF_OPT(L"AdaptiveQueueDepthMin", Int64, WNBD_DEFAULT_QDEPTH_MIN),
 };
 DWORD WnbdOptionsCount = sizeof(WnbdDriverOptions) / sizeof(WNBD_OPTION);
 
@@ -44,6 +44,12 @@ typedef enum {
     OptRemoveStaleConnections,
     OptStaleReqTimeoutMs,
     OptStaleConnTimeoutMs,
+    OptPrioritySchedulingEnabled,
+    OptLatencyClassWeight,
+    OptBulkClassWeight,
+    OptSmallIoMaxBytes,
+    OptAdaptiveQueueDepth,
+    OptAdaptiveQueueDepthMin,
 } WNBD_OPT_KEY;
 
 extern WNBD_OPTION WnbdDriverOptions[];
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "qos.h"
+#include "debug.h"
+
+// The interrupt time uses 100ns units.
+#define QOS_TIME_UNITS_PER_SEC 10000000ULL
+
+static VOID QosSetBucketLimit(
+    PWNBD_QOS_BUCKET Bucket,
+    PWNBD_QOS_LIMIT Limit)
+{
+    InterlockedExchange64(&Bucket->Rate, 0);
+    InterlockedExchange64(
+        &Bucket->Burst, Limit->Burst ? Limit->Burst : Limit->Rate);
+    InterlockedExchange64(&Bucket->FullTimestamp, 0);
+    InterlockedExchange64(&Bucket->Rate, Limit->Rate);
+}
+
+static NTSTATUS QosValidateLimit(PWNBD_QOS_LIMIT Limit)
+{
+    if (Limit->Rate > WNBD_MAX_QOS_LIMIT ||
+            Limit->Burst > WNBD_MAX_QOS_LIMIT) {
+        WNBD_LOG_WARN("Invalid QoS limit. Rate: %llu, burst: %llu.",
+                      Limit->Rate, Limit->Burst);
+        return STATUS_INVALID_PARAMETER;
+    }
+    return STATUS_SUCCESS;
+}
+
+// Returns the time until the bucket gets refilled enough to admit
+// requests, 0 if there are tokens left.
+static UINT64 QosGetBucketDelay(
+    PWNBD_QOS_BUCKET Bucket,
+    UINT64 Rate,
+    UINT64 TimeNow)
+{
+    UINT64 FullTimestamp = (UINT64) Bucket->FullTimestamp;
+    // The time needed to refill the whole bucket.
+    UINT64 Tolerance = (UINT64) Bucket->Burst * QOS_TIME_UNITS_PER_SEC / Rate;
+
+    if (FullTimestamp < TimeNow + Tolerance) {
+        return 0;
+    }
+    return FullTimestamp - TimeNow - Tolerance + 1;
+}
+
+static VOID QosChargeBucket(
+    PWNBD_QOS_BUCKET Bucket,
+    UINT64 Rate,
+    UINT64 Tokens,
+    UINT64 TimeNow)
+{
+    UINT64 Interval = Tokens * QOS_TIME_UNITS_PER_SEC / Rate;
+    LONG64 FullTimestamp, NewFullTimestamp;
+
+    do {
+        FullTimestamp = Bucket->FullTimestamp;
+        NewFullTimestamp = (LONG64) (
+            max((UINT64) FullTimestamp, TimeNow) + Interval);
+    } while (InterlockedCompareExchange64(
+        &Bucket->FullTimestamp, NewFullTimestamp,
+        FullTimestamp) != FullTimestamp);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdQosInitialize(PWNBD_QOS_STATE Qos,
+                  PWNBD_QOS_LIMITS Limits)
+{
+    WnbdQosSetLimits(Qos, Limits);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+WnbdQosValidateLimits(PWNBD_QOS_LIMITS Limits)
+{
+    NTSTATUS Status = QosValidateLimit(&Limits->ReadIops);
+    if (!Status) {
+        Status = QosValidateLimit(&Limits->WriteIops);
+    }
+    if (!Status) {
+        Status = QosValidateLimit(&Limits->ReadBandwidth);
+    }
+    if (!Status) {
+        Status = QosValidateLimit(&Limits->WriteBandwidth);
+    }
+    return Status;
+}
+
+_Use_decl_annotations_
+VOID
+WnbdQosSetLimits(PWNBD_QOS_STATE Qos,
+                 PWNBD_QOS_LIMITS Limits)
+{
+    // The rates are cleared first, so that concurrent dispatchers don't
+    // use the new rates along with the previous burst values.
+    QosSetBucketLimit(&Qos->ReadIops, &Limits->ReadIops);
+    QosSetBucketLimit(&Qos->WriteIops, &Limits->WriteIops);
+    QosSetBucketLimit(&Qos->ReadBandwidth, &Limits->ReadBandwidth);
+    QosSetBucketLimit(&Qos->WriteBandwidth, &Limits->WriteBandwidth);
+}
+
+_Use_decl_annotations_
+UINT64
+WnbdQosAdmitRequest(PWNBD_QOS_STATE Qos,
+                    WnbdRequestType RequestType,
+                    UINT32 DataLength)
+{
+    PWNBD_QOS_BUCKET IopsBucket = NULL;
+    PWNBD_QOS_BUCKET BandwidthBucket = NULL;
+
+    switch (RequestType) {
+    case WnbdReqTypeRead:
+        IopsBucket = &Qos->ReadIops;
+        BandwidthBucket = &Qos->ReadBandwidth;
+        break;
+    case WnbdReqTypeWrite:
+        IopsBucket = &Qos->WriteIops;
+        BandwidthBucket = &Qos->WriteBandwidth;
+        break;
+    default:
+        return 0;
+    }
+
+    UINT64 IopsRate = (UINT64) IopsBucket->Rate;
+    UINT64 BandwidthRate = (UINT64) BandwidthBucket->Rate;
+    if (!IopsRate && !BandwidthRate) {
+        return 0;
+    }
+
+    ULONG64 QpcTimestamp;
+    UINT64 TimeNow = KeQueryInterruptTimePrecise(&QpcTimestamp);
+    UINT64 Delay = 0;
+    if (IopsRate) {
+        Delay = QosGetBucketDelay(IopsBucket, IopsRate, TimeNow);
+    }
+    if (BandwidthRate) {
+        Delay = max(
+            Delay, QosGetBucketDelay(BandwidthBucket, BandwidthRate, TimeNow));
+    }
+    if (Delay) {
+        return Delay;
+    }
+
+    // Concurrent dispatchers may admit requests based on the same
+    // tokens, in which case the buckets go into debt and the subsequent
+    // requests wait longer.
+    if (IopsRate) {
+        QosChargeBucket(IopsBucket, IopsRate, 1, TimeNow);
+    }
+    if (BandwidthRate) {
+        QosChargeBucket(BandwidthBucket, BandwidthRate, DataLength, TimeNow);
+    }
+    return 0;
+}
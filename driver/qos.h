@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef QOS_H
+#define QOS_H 1
+
+#include "common.h"
+#include "wnbd_ioctl.h"
+
+// Token bucket using the generic cell rate algorithm (GCRA). Instead of
+// a token count, the bucket tracks the moment in which it would become
+// full again, so that admitting a request only takes one compare and
+// swap operation.
+typedef struct
+{
+    // Tokens per second, 0 if the limit is disabled.
+    volatile LONG64 Rate;
+    volatile LONG64 Burst;
+    // Interrupt time (100ns units).
+    volatile LONG64 FullTimestamp;
+} WNBD_QOS_BUCKET, *PWNBD_QOS_BUCKET;
+
+typedef struct
+{
+    WNBD_QOS_BUCKET ReadIops;
+    WNBD_QOS_BUCKET WriteIops;
+    WNBD_QOS_BUCKET ReadBandwidth;
+    WNBD_QOS_BUCKET WriteBandwidth;
+} WNBD_QOS_STATE, *PWNBD_QOS_STATE;
+
+VOID
+WnbdQosInitialize(_In_ PWNBD_QOS_STATE Qos,
+                  _In_ PWNBD_QOS_LIMITS Limits);
+
+NTSTATUS
+WnbdQosValidateLimits(_In_ PWNBD_QOS_LIMITS Limits);
+
+// Replaces the limits, refilling the buckets. May be called while
+// requests are being dispatched.
+VOID
+WnbdQosSetLimits(_In_ PWNBD_QOS_STATE Qos,
+                 _In_ PWNBD_QOS_LIMITS Limits);
+
+// Lock-free. Consumes the request tokens and returns 0 if the request
+// may be submitted, otherwise returns the time (100ns units) after which
+// the request should be retried.
+UINT64
+WnbdQosAdmitRequest(_In_ PWNBD_QOS_STATE Qos,
+                    _In_ WnbdRequestType RequestType,
+                    _In_ UINT32 DataLength);
+
+#endif
@@ -129,6 +129,7 @@ WnbdHwFindAdapter(PVOID DeviceExtension,
     }
 
     ConfigInfo->InitialLunQueueDepth = ConfigInfo->MaxIOsPerLun;
+    Ext->MaxIOsPerLun = ConfigInfo->MaxIOsPerLun;
 
     ConfigInfo->NumberOfPhysicalBreaks = SP_UNINITIALIZED_VALUE;
     ConfigInfo->AlignmentMask = FILE_BYTE_ALIGNMENT;
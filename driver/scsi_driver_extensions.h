@@ -8,6 +8,9 @@
 #define SCSI_DRIVER_EXTENSIONS_H 1
 
 #include "common.h"
+#include "qos.h"
+#include "wnbd_qdepth.h"
+#include "wnbd_sched.h"
 #include "wnbd_ioctl.h"
 
 typedef struct _WNBD_EXTENSION {
@@ -19,6 +22,8 @@ typedef struct _WNBD_EXTENSION {
 
     EX_RUNDOWN_REF                    RundownProtection;
     KEVENT                            GlobalDeviceRemovalEvent;
+    // The Storport queue depth, set when the adapter starts.
+    ULONG                             MaxIOsPerLun;
 } WNBD_EXTENSION, *PWNBD_EXTENSION;
 
 typedef struct _WNBD_DISK_DEVICE
@@ -40,13 +45,21 @@ typedef struct _WNBD_DISK_DEVICE
 
     PINQUIRYDATA                InquiryData;
 
-    LIST_ENTRY                  PendingReqListHead;
+    // Requests that weren't fetched by userspace yet.
+    WNBD_SCHEDULER              PendingReqs;
     KSPIN_LOCK                  PendingReqListLock;
 
     LIST_ENTRY                  SubmittedReqListHead;
     KSPIN_LOCK                  SubmittedReqListLock;
 
     KSEMAPHORE                  DeviceEvent;
+    // Pendable fetch requests that are waiting for IO requests, served
+    // by the device monitor thread.
+    IO_CSQ                      FetchIrpQueue;
+    LIST_ENTRY                  FetchIrpListHead;
+    KSPIN_LOCK                  FetchIrpListLock;
+    // Signaled while there are queued fetch requests.
+    KEVENT                      FetchIrpEvent;
     PVOID                       DeviceMonitorThread;
     BOOLEAN                     HardRemoveDevice;
     KEVENT                      DeviceRemovalEvent;
@@ -56,10 +69,30 @@ typedef struct _WNBD_DISK_DEVICE
     EX_RUNDOWN_REF              RundownProtection;
 
     WNBD_DRV_STATS              Stats;
+    WNBD_LATENCY_STATS          LatencyStats;
+    WNBD_QOS_STATE              Qos;
+    // Fires once the tokens needed by the throttled requests become
+    // available, returning the "DeviceEvent" units held by the throttled
+    // dispatchers.
+    KTIMER                      QosTimer;
+    KDPC                        QosDpc;
+    volatile LONG               QosHeldEvents;
+
+    // Adaptive queue depth, limiting the submitted requests. Only used
+    // if the "AdaptiveQueueDepth" option was set when mapping the disk.
+    BOOLEAN                     QueueDepthEnabled;
+    WNBD_QDEPTH_CONTROLLER      QueueDepth;
+    KSPIN_LOCK                  QueueDepthLock;
+    // Signaled while the limit allows submitting requests.
+    KEVENT                      QueueDepthEvent;
+    BOOLEAN                     QueueDepthAvailable;
 } WNBD_DISK_DEVICE, *PWNBD_DISK_DEVICE;
 
 typedef struct _SRB_QUEUE_ELEMENT {
+    // Used by the submitted request list.
     LIST_ENTRY Link;
+    // Used while the request is pending.
+    WNBD_SCHED_ENTRY SchedEntry;
     PVOID Srb;
     UINT64 StartingLbn;
     ULONG DataLength;
@@ -70,6 +103,13 @@ typedef struct _SRB_QUEUE_ELEMENT {
     BOOLEAN Completed;
     // Retrieved using KeQueryInterruptTime.
     UINT64 ReqTimestamp;
+    // Set when the request is passed to userspace, retrieved using
+    // KeQueryInterruptTimePrecise.
+    UINT64 FetchTimestamp;
+    // Set when the request first gets delayed by the QoS limits,
+    // retrieved using KeQueryInterruptTimePrecise.
+    UINT64 ThrottleTimestamp;
+    WnbdRequestType RequestType;
 } SRB_QUEUE_ELEMENT, * PSRB_QUEUE_ELEMENT;
 
 SCSI_ADAPTER_CONTROL_STATUS
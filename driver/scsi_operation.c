@@ -6,6 +6,7 @@
 
 #include "common.h"
 #include "debug.h"
+#include "options.h"
 #include "scsi_operation.h"
 #include "scsi_function.h"
 #include "scsi_trace.h"
@@ -569,6 +570,46 @@ WnbdReportLuns(_In_ PVOID Srb) {
     return SRB_STATUS_SUCCESS;
 }
 
+// Flushes, FUA requests, small reads and writes as well as persistent
+// reservations are dispatched before bulk requests, unless priority
+// scheduling is disabled.
+static VOID
+WnbdGetSchedClass(_In_ PVOID Srb,
+                  _In_ ULONG DataLength,
+                  _In_ BOOLEAN FUA,
+                  _Out_ PUINT32 SchedClass,
+                  _Out_ PUINT32 PayloadSize)
+{
+    PCDB Cdb = SrbGetCdb(Srb);
+    WnbdRequestType RequestType = WnbdReqTypeUnknown;
+    if (Cdb) {
+        RequestType = ScsiOpToWnbdReqType(Cdb->AsByte[0]);
+    }
+
+    *SchedClass = WNBD_SCHED_CLASS_LATENCY;
+    *PayloadSize = 0;
+
+    switch (RequestType) {
+    case WnbdReqTypeRead:
+    case WnbdReqTypeWrite:
+        *PayloadSize = DataLength;
+        if (!FUA && (UINT64) DataLength > (UINT64)
+                WnbdDriverOptions[OptSmallIoMaxBytes].Value.Data.AsInt64) {
+            *SchedClass = WNBD_SCHED_CLASS_BULK;
+        }
+        break;
+    case WnbdReqTypeUnmap:
+        *SchedClass = WNBD_SCHED_CLASS_BULK;
+        break;
+    default:
+        break;
+    }
+
+    if (!WnbdDriverOptions[OptPrioritySchedulingEnabled].Value.Data.AsBool) {
+        *SchedClass = WNBD_SCHED_CLASS_BULK;
+    }
+}
+
 NTSTATUS
 WnbdPendElement(_In_ PWNBD_EXTENSION DeviceExtension,
                 _In_ PWNBD_DISK_DEVICE Device,
@@ -599,7 +640,11 @@ WnbdPendElement(_In_ PWNBD_EXTENSION DeviceExtension,
     Element->Aborted = 0;
     Element->Completed = 0;
     Element->FUA = FUA;
-    ExInterlockedInsertTailList(&Device->PendingReqListHead, &Element->Link, &Device->PendingReqListLock);
+
+    UINT32 SchedClass = WNBD_SCHED_CLASS_BULK;
+    UINT32 PayloadSize = 0;
+    WnbdGetSchedClass(Srb, (ULONG)DataLength, FUA, &SchedClass, &PayloadSize);
+    WnbdInsertPendingElement(Device, Element, SchedClass, PayloadSize);
     KeReleaseSemaphore(&Device->DeviceEvent, 0, 1, FALSE);
     Status = STATUS_PENDING;
 
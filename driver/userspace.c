@@ -91,12 +91,8 @@ WnbdDeviceMonitorThread(_In_ PVOID Context)
     ASSERT(Device->DeviceExtension);
 
     PWNBD_EXTENSION DeviceExtension = Device->DeviceExtension;
-    PVOID WaitObjects[2];
-    WaitObjects[0] = &DeviceExtension->GlobalDeviceRemovalEvent;
-    WaitObjects[1] = &Device->DeviceRemovalEvent;
-    KeWaitForMultipleObjects(
-        2, WaitObjects, WaitAny, Executive, KernelMode,
-        FALSE, NULL, NULL);
+    // Returns once the device gets removed.
+    WnbdServeFetchRequests(Device);
 
     WNBD_LOG_INFO("Cleaning up device connection: %s.",
                   Device->Properties.InstanceName);
@@ -106,6 +102,9 @@ WnbdDeviceMonitorThread(_In_ PVOID Context)
     Device->HardRemoveDevice = TRUE;
     KeSetEvent(&Device->DeviceRemovalEvent, IO_NO_INCREMENT, FALSE);
 
+    // The queued fetch requests hold device references.
+    WnbdFailFetchRequests(Device);
+
     // Ensure that the device isn't currently being accessed.
     WNBD_LOG_INFO("Waiting for pending device requests: %s.",
                   Device->Properties.InstanceName);
@@ -116,6 +115,10 @@ WnbdDeviceMonitorThread(_In_ PVOID Context)
     DrainDeviceQueue(Device, FALSE, FALSE);
     DrainDeviceQueue(Device, TRUE, FALSE);
 
+    // The dispatchers no longer arm the QoS timer at this point.
+    KeCancelTimer(&Device->QosTimer);
+    KeFlushQueuedDpcs();
+
     // After acquiring the device spinlock, we should return as quickly as possible.
     KIRQL Irql = { 0 };
     KeEnterCriticalRegion();
@@ -147,6 +150,53 @@ WnbdDeviceMonitorThread(_In_ PVOID Context)
     KeLeaveCriticalRegion();
 }
 
+static UINT32
+WnbdGetSchedWeight(WNBD_OPT_KEY OptKey, UINT32 DefaultWeight)
+{
+    INT64 Weight = WnbdDriverOptions[OptKey].Value.Data.AsInt64;
+    if (0 < Weight && Weight <= WNBD_MAX_SCHED_WEIGHT) {
+        return (UINT32) Weight;
+    }
+
+    WNBD_LOG_WARN("Unsupported %ls value: %lld. "
+                  "Minimum: 1. Maximum: %d. "
+                  "Falling back to default value: %d.",
+                  WnbdDriverOptions[OptKey].Name, Weight,
+                  WNBD_MAX_SCHED_WEIGHT, DefaultWeight);
+    return DefaultWeight;
+}
+
+static VOID
+WnbdInitializeQueueDepth(_In_ PWNBD_DISK_DEVICE Device)
+{
+    UINT32 MaxLimit = Device->DeviceExtension->MaxIOsPerLun;
+    if (!MaxLimit) {
+        MaxLimit = WNBD_DEFAULT_MAX_IO_REQ_PER_LUN;
+    }
+
+    INT64 MinLimit =
+        WnbdDriverOptions[OptAdaptiveQueueDepthMin].Value.Data.AsInt64;
+    if (MinLimit <= 0 || MinLimit > MaxLimit) {
+        WNBD_LOG_WARN("Unsupported AdaptiveQueueDepthMin value: %lld. "
+                      "Minimum: 1. Maximum: %d. "
+                      "Falling back to: %d.",
+                      MinLimit, MaxLimit,
+                      min(WNBD_DEFAULT_QDEPTH_MIN, MaxLimit));
+        MinLimit = min(WNBD_DEFAULT_QDEPTH_MIN, MaxLimit);
+    }
+
+    Device->QueueDepthEnabled =
+        WnbdDriverOptions[OptAdaptiveQueueDepth].Value.Data.AsBool;
+    WnbdQdepthInitialize(&Device->QueueDepth, (UINT32) MinLimit, MaxLimit);
+    KeInitializeSpinLock(&Device->QueueDepthLock);
+    KeInitializeEvent(&Device->QueueDepthEvent, NotificationEvent, TRUE);
+    Device->QueueDepthAvailable = TRUE;
+
+    if (Device->QueueDepthEnabled) {
+        Device->Stats.QueueDepthLimit = Device->QueueDepth.Limit;
+    }
+}
+
 NTSTATUS
 WnbdInitializeDevice(_In_ PWNBD_DISK_DEVICE Device)
 {
@@ -154,13 +204,21 @@ WnbdInitializeDevice(_In_ PWNBD_DISK_DEVICE Device)
     ASSERT(Device);
     NTSTATUS Status = STATUS_SUCCESS;
 
-    InitializeListHead(&Device->PendingReqListHead);
+    UINT32 SchedWeights[WNBD_SCHED_CLASS_COUNT] = { 0 };
+    SchedWeights[WNBD_SCHED_CLASS_LATENCY] = WnbdGetSchedWeight(
+        OptLatencyClassWeight, WNBD_DEFAULT_SCHED_LATENCY_WEIGHT);
+    SchedWeights[WNBD_SCHED_CLASS_BULK] = WnbdGetSchedWeight(
+        OptBulkClassWeight, WNBD_DEFAULT_SCHED_BULK_WEIGHT);
+    WnbdSchedInitialize(&Device->PendingReqs, SchedWeights);
     KeInitializeSpinLock(&Device->PendingReqListLock);
     InitializeListHead(&Device->SubmittedReqListHead);
     KeInitializeSpinLock(&Device->SubmittedReqListLock);
     ExInitializeRundownProtection(&Device->RundownProtection);
     KeInitializeSemaphore(&Device->DeviceEvent, 0, 1 << 30);
     KeInitializeEvent(&Device->DeviceRemovalEvent, NotificationEvent, FALSE);
+    WnbdInitializeFetchQueue(Device);
+    WnbdInitializeQueueDepth(Device);
+    WnbdInitializeThrottling(Device);
 
     HANDLE monitor_thread_handle;
     Status = PsCreateSystemThread(&monitor_thread_handle, (ACCESS_MASK)0L, NULL,
@@ -226,6 +284,7 @@ WnbdCreateConnection(PWNBD_EXTENSION DeviceExtension,
     }
 
     RtlCopyMemory(&Device->Properties, Properties, sizeof(WNBD_PROPERTIES));
+    WnbdQosInitialize(&Device->Qos, &Device->Properties.QosLimits);
 
     Device->DeviceExtension = DeviceExtension;
 
@@ -526,6 +585,11 @@ WnbdParseUserIOCTL(PWNBD_EXTENSION DeviceExtension,
             Status = STATUS_INVALID_PARAMETER;
             break;
         }
+        Status = WnbdQosValidateLimits(&Props.QosLimits);
+        if (Status) {
+            WNBD_LOG_WARN("IOCTL_WNBD_CREATE: Invalid QoS limits.");
+            break;
+        }
 
         KeEnterCriticalRegion();
         ExAcquireResourceSharedLite(&DeviceExtension->DeviceCreationLock, TRUE);
@@ -703,6 +767,95 @@ WnbdParseUserIOCTL(PWNBD_EXTENSION DeviceExtension,
         Status = STATUS_SUCCESS;
         break;
 
+    case IOCTL_WNBD_LATENCY_STATS:
+        WNBD_LOG_DEBUG("WNBD_LATENCY_STATS");
+        PWNBD_IOCTL_LATENCY_STATS_COMMAND LatencyCmd =
+            (PWNBD_IOCTL_LATENCY_STATS_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+
+        if (!LatencyCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_LATENCY_STATS_COMMAND)) {
+            WNBD_LOG_WARN("WNBD_LATENCY_STATS: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        LatencyCmd->InstanceName[WNBD_MAX_NAME_LENGTH - 1] = '\0';
+        if (!strlen((PSTR) &LatencyCmd->InstanceName)) {
+            WNBD_LOG_WARN("WNBD_LATENCY_STATS: Invalid instance name");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        if (CHECK_O_LOCATION(IoLocation, WNBD_LATENCY_STATS)) {
+            WNBD_LOG_ERROR("WNBD_LATENCY_STATS: Bad output buffer");
+            Status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        Device = WnbdFindDeviceByInstanceName(
+            DeviceExtension, LatencyCmd->InstanceName, TRUE);
+        if (!Device) {
+            Status = STATUS_OBJECT_NAME_NOT_FOUND;
+            WNBD_LOG_DEBUG("WNBD_LATENCY_STATS: Connection does not exist");
+            break;
+        }
+
+        // The input and output share the same system buffer. The counters
+        // may be updated while being copied, which is acceptable.
+        RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer,
+                      &Device->LatencyStats, sizeof(WNBD_LATENCY_STATS));
+        WnbdReleaseDevice(Device);
+
+        Irp->IoStatus.Information = sizeof(WNBD_LATENCY_STATS);
+        Status = STATUS_SUCCESS;
+        break;
+
+    case IOCTL_WNBD_SET_QOS_LIMITS:
+        WNBD_LOG_DEBUG("IOCTL_WNBD_SET_QOS_LIMITS");
+        PWNBD_IOCTL_SET_QOS_LIMITS_COMMAND QosCmd =
+            (PWNBD_IOCTL_SET_QOS_LIMITS_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+
+        if (!QosCmd ||
+                CHECK_I_LOCATION(IoLocation, WNBD_IOCTL_SET_QOS_LIMITS_COMMAND)) {
+            WNBD_LOG_WARN("IOCTL_WNBD_SET_QOS_LIMITS: Bad input buffer");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        QosCmd->InstanceName[WNBD_MAX_NAME_LENGTH - 1] = '\0';
+        if (!strlen((PSTR) &QosCmd->InstanceName)) {
+            WNBD_LOG_WARN("IOCTL_WNBD_SET_QOS_LIMITS: Invalid instance name");
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        Status = WnbdQosValidateLimits(&QosCmd->Limits);
+        if (Status) {
+            WNBD_LOG_WARN("IOCTL_WNBD_SET_QOS_LIMITS: Invalid QoS limits");
+            break;
+        }
+
+        Device = WnbdFindDeviceByInstanceName(
+            DeviceExtension, QosCmd->InstanceName, TRUE);
+        if (!Device) {
+            Status = STATUS_OBJECT_NAME_NOT_FOUND;
+            WNBD_LOG_DEBUG("IOCTL_WNBD_SET_QOS_LIMITS: Connection does not exist");
+            break;
+        }
+
+        // The connection info is retrieved without locking, concurrent
+        // readers may get a mix of the old and new limits.
+        RtlCopyMemory(&Device->Properties.QosLimits, &QosCmd->Limits,
+                      sizeof(WNBD_QOS_LIMITS));
+        WnbdQosSetLimits(&Device->Qos, &QosCmd->Limits);
+        // The throttled requests are retried using the new limits.
+        WnbdReleaseThrottledRequests(Device);
+        WnbdReleaseDevice(Device);
+
+        WNBD_LOG_INFO("Updated QoS limits: %s.", QosCmd->InstanceName);
+        Status = STATUS_SUCCESS;
+        break;
+
     case IOCTL_WNBD_FETCH_REQ:
         // TODO: consider moving out individual command handling.
         WNBD_LOG_DEBUG("IOCTL_WNBD_FETCH_REQ");
@@ -727,7 +880,19 @@ WnbdParseUserIOCTL(PWNBD_EXTENSION DeviceExtension,
             break;
         }
 
-        Status = WnbdDispatchRequest(Irp, Device, ReqCmd);
+        if (ReqCmd->Pendable && !ReqCmd->NoWait) {
+            // Pend the IRP if there are no requests available, keeping
+            // the device reference until it gets completed.
+            ReqCmd->NoWait = TRUE;
+            Status = WnbdDispatchRequest(Irp, Device, ReqCmd);
+            if (STATUS_IO_TIMEOUT == Status) {
+                WNBD_LOG_DEBUG("Pending fetch request.");
+                Status = WnbdPendFetchRequest(Irp, Device);
+                break;
+            }
+        } else {
+            Status = WnbdDispatchRequest(Irp, Device, ReqCmd);
+        }
         Irp->IoStatus.Information = sizeof(WNBD_IOCTL_FETCH_REQ_COMMAND);
         WNBD_LOG_DEBUG("Request dispatch status: %d. Request type: %d Request handle: %llx",
                        Status, ReqCmd->Request.RequestType, ReqCmd->Request.RequestHandle);
@@ -25,17 +25,6 @@ VOID DrainDeviceQueue(_In_ PWNBD_DISK_DEVICE Device,
 {
     PLIST_ENTRY Request;
     PSRB_QUEUE_ELEMENT Element;
-    PLIST_ENTRY ListHead;
-    PKSPIN_LOCK ListLock;
-
-    if (SubmittedRequests) {
-        ListHead = &Device->SubmittedReqListHead;
-        ListLock = &Device->SubmittedReqListLock;
-    }
-    else {
-        ListHead = &Device->PendingReqListHead;
-        ListLock = &Device->PendingReqListLock;
-    }
 
     UINT64 TimeNow = KeQueryInterruptTime();
 
@@ -43,8 +32,22 @@ VOID DrainDeviceQueue(_In_ PWNBD_DISK_DEVICE Device,
     BOOLEAN RemoveStaleConnections =
         WnbdDriverOptions[OptRemoveStaleConnections].Value.Data.AsBool;
 
-    while ((Request = ExInterlockedRemoveHeadList(ListHead, ListLock)) != NULL) {
-        Element = CONTAINING_RECORD(Request, SRB_QUEUE_ELEMENT, Link);
+    for (;;) {
+        if (SubmittedRequests) {
+            Request = ExInterlockedRemoveHeadList(
+                &Device->SubmittedReqListHead,
+                &Device->SubmittedReqListLock);
+            if (!Request) {
+                break;
+            }
+            Element = CONTAINING_RECORD(Request, SRB_QUEUE_ELEMENT, Link);
+            WnbdQueueDepthComplete(Device, 0);
+        } else {
+            Element = WnbdRemovePendingElement(Device);
+            if (!Element) {
+                break;
+            }
+        }
         SrbSetDataTransferLength(Element->Srb, 0);
         SrbSetSrbStatus(Element->Srb, SRB_STATUS_ABORTED);
         if (!Element->Aborted) {
@@ -125,7 +128,7 @@ BOOLEAN HasPendingAsyncRequests(_In_ PWNBD_DISK_DEVICE Device)
         WNBD_LOG_DEBUG("no pending submitted requests");
     }
 
-    if (!IsListEmpty(&Device->PendingReqListHead)) {
+    if (!WnbdSchedIsEmpty(&Device->PendingReqs)) {
         WNBD_LOG_DEBUG("pending unsubmitted requests");
         HasRequests = TRUE;
     } else {
@@ -138,6 +141,100 @@ BOOLEAN HasPendingAsyncRequests(_In_ PWNBD_DISK_DEVICE Device)
     return HasRequests;
 }
 
+_Use_decl_annotations_
+VOID
+WnbdInsertPendingElement(PWNBD_DISK_DEVICE Device,
+                         PSRB_QUEUE_ELEMENT Element,
+                         UINT32 SchedClass,
+                         UINT32 PayloadSize)
+{
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&Device->PendingReqListLock, &Irql);
+    WnbdSchedInsertTail(
+        &Device->PendingReqs, &Element->SchedEntry, SchedClass, PayloadSize);
+    KeReleaseSpinLock(&Device->PendingReqListLock, Irql);
+}
+
+_Use_decl_annotations_
+PSRB_QUEUE_ELEMENT
+WnbdRemovePendingElement(PWNBD_DISK_DEVICE Device)
+{
+    KIRQL Irql = { 0 };
+    PWNBD_SCHED_ENTRY Entry = NULL;
+
+    KeAcquireSpinLock(&Device->PendingReqListLock, &Irql);
+    Entry = WnbdSchedRemoveNext(&Device->PendingReqs);
+    KeReleaseSpinLock(&Device->PendingReqListLock, Irql);
+
+    if (!Entry) {
+        return NULL;
+    }
+    return CONTAINING_RECORD(Entry, SRB_QUEUE_ELEMENT, SchedEntry);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdRequeuePendingElement(PWNBD_DISK_DEVICE Device,
+                          PSRB_QUEUE_ELEMENT Element)
+{
+    KIRQL Irql = { 0 };
+
+    KeAcquireSpinLock(&Device->PendingReqListLock, &Irql);
+    WnbdSchedInsertHead(&Device->PendingReqs, &Element->SchedEntry);
+    KeReleaseSpinLock(&Device->PendingReqListLock, Irql);
+}
+
+// Must be called with the queue depth lock held.
+static VOID
+WnbdUpdateQueueDepthEvent(_In_ PWNBD_DISK_DEVICE Device)
+{
+    BOOLEAN Available = WnbdQdepthCanSubmit(&Device->QueueDepth);
+    if (Available == Device->QueueDepthAvailable) {
+        return;
+    }
+
+    Device->QueueDepthAvailable = Available;
+    if (Available) {
+        KeSetEvent(&Device->QueueDepthEvent, IO_NO_INCREMENT, FALSE);
+    } else {
+        KeClearEvent(&Device->QueueDepthEvent);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+WnbdQueueDepthSubmit(PWNBD_DISK_DEVICE Device)
+{
+    KIRQL Irql = { 0 };
+
+    if (!Device->QueueDepthEnabled) {
+        return;
+    }
+
+    KeAcquireSpinLock(&Device->QueueDepthLock, &Irql);
+    WnbdQdepthSubmit(&Device->QueueDepth);
+    WnbdUpdateQueueDepthEvent(Device);
+    KeReleaseSpinLock(&Device->QueueDepthLock, Irql);
+}
+
+_Use_decl_annotations_
+VOID
+WnbdQueueDepthComplete(PWNBD_DISK_DEVICE Device, UINT64 LatencyUs)
+{
+    KIRQL Irql = { 0 };
+
+    if (!Device->QueueDepthEnabled) {
+        return;
+    }
+
+    KeAcquireSpinLock(&Device->QueueDepthLock, &Irql);
+    WnbdQdepthComplete(&Device->QueueDepth, LatencyUs);
+    Device->Stats.QueueDepthLimit = Device->QueueDepth.Limit;
+    WnbdUpdateQueueDepthEvent(Device);
+    KeReleaseSpinLock(&Device->QueueDepthLock, Irql);
+}
+
 VOID
 WnbdCleanupAllDevices(_In_ PWNBD_EXTENSION DeviceExtension)
 {
@@ -22,6 +22,32 @@ CompleteRequest(_In_ PWNBD_DISK_DEVICE Device,
 BOOLEAN
 HasPendingAsyncRequests(_In_ PWNBD_DISK_DEVICE Device);
 
+// The pending requests are dispatched in the order determined by the
+// request scheduler (wnbd_sched.h).
+VOID
+WnbdInsertPendingElement(_In_ PWNBD_DISK_DEVICE Device,
+                         _In_ PSRB_QUEUE_ELEMENT Element,
+                         _In_ UINT32 SchedClass,
+                         _In_ UINT32 PayloadSize);
+// Returns NULL if there are no pending requests.
+PSRB_QUEUE_ELEMENT
+WnbdRemovePendingElement(_In_ PWNBD_DISK_DEVICE Device);
+// Puts back a request retrieved using WnbdRemovePendingElement, which
+// will be the next one dispatched from its class.
+VOID
+WnbdRequeuePendingElement(_In_ PWNBD_DISK_DEVICE Device,
+                          _In_ PSRB_QUEUE_ELEMENT Element);
+
+// Adaptive queue depth accounting (wnbd_qdepth.h), no-op unless enabled.
+// The "QueueDepthEvent" device event is signaled while the limit allows
+// submitting requests.
+VOID
+WnbdQueueDepthSubmit(_In_ PWNBD_DISK_DEVICE Device);
+// A zero latency can be used for requests that didn't receive a reply.
+VOID
+WnbdQueueDepthComplete(_In_ PWNBD_DISK_DEVICE Device,
+                       _In_ UINT64 LatencyUs);
+
 VOID
 WnbdCleanupAllDevices(_In_ PWNBD_EXTENSION DeviceExtension);
 
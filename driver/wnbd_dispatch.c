@@ -66,6 +66,70 @@ NTSTATUS LockUsermodeBuffer(
     return Status;
 }
 
+static KDEFERRED_ROUTINE WnbdQosTimerDpc;
+
+_Use_decl_annotations_
+static VOID WnbdQosTimerDpc(
+    PKDPC Dpc,
+    PVOID DeferredContext,
+    PVOID SystemArgument1,
+    PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    WnbdReleaseThrottledRequests((PWNBD_DISK_DEVICE) DeferredContext);
+}
+
+VOID WnbdInitializeThrottling(PWNBD_DISK_DEVICE Device)
+{
+    KeInitializeTimer(&Device->QosTimer);
+    KeInitializeDpc(&Device->QosDpc, WnbdQosTimerDpc, Device);
+    Device->QosHeldEvents = 0;
+}
+
+VOID WnbdReleaseThrottledRequests(PWNBD_DISK_DEVICE Device)
+{
+    KeCancelTimer(&Device->QosTimer);
+
+    LONG HeldEvents = InterlockedExchange(&Device->QosHeldEvents, 0);
+    if (HeldEvents) {
+        KeReleaseSemaphore(&Device->DeviceEvent, 0, HeldEvents, FALSE);
+    }
+}
+
+// Puts the throttled request back at the head of the queue and arms the
+// QoS timer, which wakes up the dispatchers once the tokens become
+// available. The "DeviceEvent" unit acquired when picking up the request
+// is held until then, otherwise the other dispatchers would keep retrieving
+// the same request.
+//
+// The request remains visible to the abort and drain handlers in the
+// meantime. Its original timestamp is preserved and Storport keeps
+// tracking its timeout, so the throttled time counts towards both the
+// Storport timeouts and the stale request detection.
+static VOID WnbdThrottleRequest(
+    PWNBD_DISK_DEVICE Device,
+    PSRB_QUEUE_ELEMENT Element,
+    UINT64 Delay)
+{
+    ULONG64 QpcTimestamp;
+
+    if (!Element->ThrottleTimestamp) {
+        Element->ThrottleTimestamp = KeQueryInterruptTimePrecise(&QpcTimestamp);
+    }
+    WnbdRequeuePendingElement(Device, Element);
+
+    InterlockedIncrement(&Device->QosHeldEvents);
+    // Relative due time, expressed in 100ns units. The concurrent
+    // dispatchers get the same deadline from the token buckets, so
+    // resetting the timer doesn't postpone the wake up.
+    LARGE_INTEGER DueTime = { 0 };
+    DueTime.QuadPart = -(LONGLONG) Delay;
+    KeSetTimer(&Device->QosTimer, DueTime, &Device->QosDpc);
+}
+
 NTSTATUS WnbdDispatchRequest(
     PIRP Irp,
     PWNBD_DISK_DEVICE Device,
@@ -95,18 +159,61 @@ NTSTATUS WnbdDispatchRequest(
 
     static UINT64 RequestHandle = 0;
 
+    LARGE_INTEGER Timeout = { 0 };
+    PLARGE_INTEGER TimeoutPtr = NULL;
+    if (Command->NoWait) {
+        // A zero timeout only checks the wait objects.
+        TimeoutPtr = &Timeout;
+    } else if (Command->TimeoutMs) {
+        // Relative timeout, expressed in 100ns units.
+        Timeout.QuadPart = -((LONGLONG)Command->TimeoutMs * 10000);
+        TimeoutPtr = &Timeout;
+    }
+
     // We're looping through the requests until we manage to dispatch one.
     // Unsupported requests as well as most errors will be hidden from the caller.
     while (!Device->HardRemoveDevice) {
         PVOID WaitObjects[2];
+        NTSTATUS WaitResult = STATUS_SUCCESS;
+
+        // Requests exceeding the adaptive queue depth limit are held in
+        // the pending queue until a submitted request completes.
+        if (!Device->QueueDepthAvailable) {
+            InterlockedIncrement64(&Device->Stats.QueueDepthWaits);
+            WaitObjects[0] = &Device->QueueDepthEvent;
+            WaitObjects[1] = &Device->DeviceRemovalEvent;
+            WaitResult = KeWaitForMultipleObjects(
+                2, WaitObjects, WaitAny, Executive, KernelMode,
+                TRUE, TimeoutPtr, NULL);
+            if (STATUS_WAIT_1 == WaitResult)
+                break;
+
+            if (STATUS_TIMEOUT == WaitResult) {
+                Status = STATUS_IO_TIMEOUT;
+                break;
+            }
+
+            if (STATUS_ALERTED == WaitResult) {
+                WNBD_LOG_INFO("Wait alterted, terminating.");
+                KeSetEvent(&Device->DeviceRemovalEvent, IO_NO_INCREMENT, FALSE);
+                break;
+            }
+        }
+
         WaitObjects[0] = &Device->DeviceEvent;
         WaitObjects[1] = &Device->DeviceRemovalEvent;
-        NTSTATUS WaitResult = KeWaitForMultipleObjects(
+        WaitResult = KeWaitForMultipleObjects(
             2, WaitObjects, WaitAny, Executive, KernelMode,
-            TRUE, NULL, NULL);
+            TRUE, TimeoutPtr, NULL);
         if (STATUS_WAIT_1  == WaitResult)
             break;
 
+        if (STATUS_TIMEOUT == WaitResult) {
+            // No request available, the caller may retry.
+            Status = STATUS_IO_TIMEOUT;
+            break;
+        }
+
         if (STATUS_ALERTED == WaitResult) {
             // This happens when the calling thread is terminating.
             // TODO: ensure that we haven't been alerted for some other reason.
@@ -115,27 +222,36 @@ NTSTATUS WnbdDispatchRequest(
             break;
         }
 
-        PLIST_ENTRY RequestEntry = ExInterlockedRemoveHeadList(
-            &Device->PendingReqListHead,
-            &Device->PendingReqListLock);
+        PSRB_QUEUE_ELEMENT Element = WnbdRemovePendingElement(Device);
 
         if (Device->HardRemoveDevice) {
             break;
         }
-        if (!RequestEntry) {
+        if (!Element) {
             continue;
         }
 
-        PSRB_QUEUE_ELEMENT Element = CONTAINING_RECORD(RequestEntry, SRB_QUEUE_ELEMENT, Link);
-        Element->Tag = InterlockedIncrement64(&(LONG64)RequestHandle);
-        SrbSetDataTransferLength(Element->Srb, 0);
         PCDB Cdb = SrbGetCdb(Element->Srb);
-
-        RtlZeroMemory(Request, sizeof(WNBD_IO_REQUEST));
         WnbdRequestType RequestType = WnbdReqTypeUnknown;
         if (Cdb) {
             RequestType = ScsiOpToWnbdReqType(Cdb->AsByte[0]);
         }
+
+        UINT64 QosDelay = WnbdQosAdmitRequest(
+            &Device->Qos, RequestType, Element->DataLength);
+        if (QosDelay) {
+            WnbdThrottleRequest(Device, Element, QosDelay);
+            if (Command->NoWait) {
+                Status = STATUS_IO_TIMEOUT;
+                break;
+            }
+            // Wait for other requests or for the QoS timer.
+            continue;
+        }
+
+        Element->Tag = InterlockedIncrement64(&(LONG64)RequestHandle);
+        SrbSetDataTransferLength(Element->Srb, 0);
+        RtlZeroMemory(Request, sizeof(WNBD_IO_REQUEST));
         WNBD_LOG_DEBUG("Processing request. Address: %p Tag: 0x%llx Type: %d",
                        Element->Srb, Element->Tag, RequestType);
 
@@ -248,11 +364,23 @@ NTSTATUS WnbdDispatchRequest(
             break;
         }
 
+        ULONG64 QpcTimestamp;
+        Element->RequestType = RequestType;
+        Element->FetchTimestamp = KeQueryInterruptTimePrecise(&QpcTimestamp);
+        if (Element->ThrottleTimestamp &&
+                Element->ThrottleTimestamp < Element->FetchTimestamp) {
+            InterlockedIncrement64(&Device->Stats.ThrottledIORequests);
+            InterlockedAdd64(
+                &Device->Stats.ThrottleWaitUs,
+                (LONG64) (Element->FetchTimestamp - Element->ThrottleTimestamp) / 10);
+        }
+
+        WnbdQueueDepthSubmit(Device);
         ExInterlockedInsertTailList(
             &Device->SubmittedReqListHead,
             &Element->Link, &Device->SubmittedReqListLock);
 
-        Device->Stats.LastSubmittedReqTimestamp = KeQueryInterruptTime();
+        Device->Stats.LastSubmittedReqTimestamp = Element->FetchTimestamp;
         InterlockedIncrement64(&Device->Stats.TotalSubmittedIORequests);
         InterlockedIncrement64(&Device->Stats.PendingSubmittedIORequests);
         InterlockedDecrement64(&Device->Stats.UnsubmittedIORequests);
@@ -277,6 +405,216 @@ Exit:
     return Status;
 }
 
+static IO_CSQ_INSERT_IRP WnbdFetchCsqInsertIrp;
+static IO_CSQ_REMOVE_IRP WnbdFetchCsqRemoveIrp;
+static IO_CSQ_PEEK_NEXT_IRP WnbdFetchCsqPeekNextIrp;
+static IO_CSQ_ACQUIRE_LOCK WnbdFetchCsqAcquireLock;
+static IO_CSQ_RELEASE_LOCK WnbdFetchCsqReleaseLock;
+static IO_CSQ_COMPLETE_CANCELED_IRP WnbdFetchCsqCompleteCanceledIrp;
+
+_Use_decl_annotations_
+static VOID WnbdFetchCsqInsertIrp(PIO_CSQ Csq, PIRP Irp)
+{
+    PWNBD_DISK_DEVICE Device = CONTAINING_RECORD(
+        Csq, WNBD_DISK_DEVICE, FetchIrpQueue);
+    InsertTailList(&Device->FetchIrpListHead, &Irp->Tail.Overlay.ListEntry);
+    KeSetEvent(&Device->FetchIrpEvent, IO_NO_INCREMENT, FALSE);
+}
+
+_Use_decl_annotations_
+static VOID WnbdFetchCsqRemoveIrp(PIO_CSQ Csq, PIRP Irp)
+{
+    PWNBD_DISK_DEVICE Device = CONTAINING_RECORD(
+        Csq, WNBD_DISK_DEVICE, FetchIrpQueue);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    if (IsListEmpty(&Device->FetchIrpListHead)) {
+        KeClearEvent(&Device->FetchIrpEvent);
+    }
+}
+
+_Use_decl_annotations_
+static PIRP WnbdFetchCsqPeekNextIrp(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext)
+{
+    UNREFERENCED_PARAMETER(PeekContext);
+
+    PWNBD_DISK_DEVICE Device = CONTAINING_RECORD(
+        Csq, WNBD_DISK_DEVICE, FetchIrpQueue);
+    PLIST_ENTRY Next = Irp ?
+        Irp->Tail.Overlay.ListEntry.Flink : Device->FetchIrpListHead.Flink;
+    if (Next == &Device->FetchIrpListHead) {
+        return NULL;
+    }
+    return CONTAINING_RECORD(Next, IRP, Tail.Overlay.ListEntry);
+}
+
+_Use_decl_annotations_
+static VOID WnbdFetchCsqAcquireLock(PIO_CSQ Csq, PKIRQL Irql)
+{
+    PWNBD_DISK_DEVICE Device = CONTAINING_RECORD(
+        Csq, WNBD_DISK_DEVICE, FetchIrpQueue);
+    KeAcquireSpinLock(&Device->FetchIrpListLock, Irql);
+}
+
+_Use_decl_annotations_
+static VOID WnbdFetchCsqReleaseLock(PIO_CSQ Csq, KIRQL Irql)
+{
+    PWNBD_DISK_DEVICE Device = CONTAINING_RECORD(
+        Csq, WNBD_DISK_DEVICE, FetchIrpQueue);
+    KeReleaseSpinLock(&Device->FetchIrpListLock, Irql);
+}
+
+static VOID WnbdCompleteFetchRequest(
+    PWNBD_DISK_DEVICE Device,
+    PIRP Irp,
+    NTSTATUS Status)
+{
+    Irp->IoStatus.Status = Status;
+    Irp->IoStatus.Information = NT_SUCCESS(Status) ?
+        sizeof(WNBD_IOCTL_FETCH_REQ_COMMAND) : 0;
+    StorPortCompleteServiceIrp(Device->DeviceExtension, Irp);
+    WnbdReleaseDevice(Device);
+}
+
+_Use_decl_annotations_
+static VOID WnbdFetchCsqCompleteCanceledIrp(PIO_CSQ Csq, PIRP Irp)
+{
+    PWNBD_DISK_DEVICE Device = CONTAINING_RECORD(
+        Csq, WNBD_DISK_DEVICE, FetchIrpQueue);
+    WnbdCompleteFetchRequest(Device, Irp, STATUS_CANCELLED);
+}
+
+VOID WnbdInitializeFetchQueue(PWNBD_DISK_DEVICE Device)
+{
+    InitializeListHead(&Device->FetchIrpListHead);
+    KeInitializeSpinLock(&Device->FetchIrpListLock);
+    KeInitializeEvent(&Device->FetchIrpEvent, NotificationEvent, FALSE);
+    IoCsqInitialize(
+        &Device->FetchIrpQueue,
+        WnbdFetchCsqInsertIrp,
+        WnbdFetchCsqRemoveIrp,
+        WnbdFetchCsqPeekNextIrp,
+        WnbdFetchCsqAcquireLock,
+        WnbdFetchCsqReleaseLock,
+        WnbdFetchCsqCompleteCanceledIrp);
+}
+
+static BOOLEAN WnbdIsRemovingDevice(PWNBD_DISK_DEVICE Device)
+{
+    return Device->HardRemoveDevice ||
+        KeReadStateEvent(&Device->DeviceRemovalEvent);
+}
+
+NTSTATUS WnbdPendFetchRequest(
+    PIRP Irp,
+    PWNBD_DISK_DEVICE Device)
+{
+    IoCsqInsertIrp(&Device->FetchIrpQueue, Irp, NULL);
+    // The monitor thread might have already failed the queued requests.
+    if (WnbdIsRemovingDevice(Device)) {
+        WnbdFailFetchRequests(Device);
+    }
+    return STATUS_PENDING;
+}
+
+// Called by the device monitor thread, which serves the queued fetch
+// requests. The IO request retrieval is retried using the IRP context.
+static VOID WnbdServeFetchRequest(
+    PWNBD_DISK_DEVICE Device,
+    PIRP Irp)
+{
+    PWNBD_IOCTL_FETCH_REQ_COMMAND Command =
+        (PWNBD_IOCTL_FETCH_REQ_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+    KAPC_STATE ApcState;
+
+    // The data buffer belongs to the requesting process.
+    KeStackAttachProcess(IoGetRequestorProcess(Irp), &ApcState);
+    NTSTATUS Status = WnbdDispatchRequest(Irp, Device, Command);
+    KeUnstackDetachProcess(&ApcState);
+
+    if (STATUS_IO_TIMEOUT == Status) {
+        // Other dispatchers retrieved the request or it was throttled.
+        IoCsqInsertIrp(&Device->FetchIrpQueue, Irp, NULL);
+        return;
+    }
+    WnbdCompleteFetchRequest(Device, Irp, Status);
+}
+
+VOID WnbdServeFetchRequests(PWNBD_DISK_DEVICE Device)
+{
+    PVOID WaitObjects[3];
+    WaitObjects[1] = &Device->DeviceRemovalEvent;
+    WaitObjects[2] = &Device->DeviceExtension->GlobalDeviceRemovalEvent;
+
+    while (!Device->HardRemoveDevice) {
+        WaitObjects[0] = &Device->FetchIrpEvent;
+        NTSTATUS WaitResult = KeWaitForMultipleObjects(
+            3, WaitObjects, WaitAny, Executive, KernelMode,
+            FALSE, NULL, NULL);
+        if (STATUS_WAIT_0 != WaitResult) {
+            break;
+        }
+
+        if (!Device->QueueDepthAvailable) {
+            WaitObjects[0] = &Device->QueueDepthEvent;
+            WaitResult = KeWaitForMultipleObjects(
+                3, WaitObjects, WaitAny, Executive, KernelMode,
+                FALSE, NULL, NULL);
+            if (STATUS_WAIT_0 != WaitResult) {
+                break;
+            }
+        }
+
+        WaitObjects[0] = &Device->DeviceEvent;
+        WaitResult = KeWaitForMultipleObjects(
+            3, WaitObjects, WaitAny, Executive, KernelMode,
+            FALSE, NULL, NULL);
+        if (STATUS_WAIT_0 != WaitResult) {
+            break;
+        }
+        // The semaphore unit is acquired again by WnbdDispatchRequest,
+        // which takes care of the QoS limits and unsupported requests.
+        KeReleaseSemaphore(&Device->DeviceEvent, 0, 1, FALSE);
+
+        PIRP Irp = IoCsqRemoveNextIrp(&Device->FetchIrpQueue, NULL);
+        if (Irp) {
+            WnbdServeFetchRequest(Device, Irp);
+        }
+    }
+}
+
+VOID WnbdFailFetchRequests(PWNBD_DISK_DEVICE Device)
+{
+    PIRP Irp = NULL;
+    while ((Irp = IoCsqRemoveNextIrp(&Device->FetchIrpQueue, NULL))) {
+        PWNBD_IOCTL_FETCH_REQ_COMMAND Command =
+            (PWNBD_IOCTL_FETCH_REQ_COMMAND) Irp->AssociatedIrp.SystemBuffer;
+        RtlZeroMemory(&Command->Request, sizeof(WNBD_IO_REQUEST));
+        Command->Request.RequestType = WnbdReqTypeDisconnect;
+        WnbdCompleteFetchRequest(Device, Irp, STATUS_SUCCESS);
+    }
+}
+
+// Lock-free, the cost is limited to a couple of interlocked operations.
+static VOID RecordRequestLatency(
+    PWNBD_DISK_DEVICE Device,
+    PSRB_QUEUE_ELEMENT Element,
+    UINT64 TimeNow)
+{
+    if ((UINT32) Element->RequestType >= WNBD_LATENCY_REQ_TYPE_COUNT ||
+            !Element->FetchTimestamp ||
+            TimeNow < Element->FetchTimestamp) {
+        return;
+    }
+
+    // The interrupt time uses 100ns units.
+    UINT64 LatencyUs = (TimeNow - Element->FetchTimestamp) / 10;
+    PWNBD_LATENCY_HISTOGRAM Histogram =
+        &Device->LatencyStats.Histograms[Element->RequestType];
+    InterlockedIncrement64(
+        (PLONG64) &Histogram->Buckets[WnbdLatencyBucketIndex(LatencyUs)]);
+    InterlockedAdd64((PLONG64) &Histogram->TotalUs, LatencyUs);
+}
+
 NTSTATUS WnbdHandleResponse(
     PIRP Irp,
     PWNBD_DISK_DEVICE Device,
@@ -288,6 +626,8 @@ NTSTATUS WnbdHandleResponse(
     PMDL Mdl = NULL;
     BOOLEAN BufferLocked = FALSE;
     PWNBD_IO_RESPONSE Response = &Command->Response;
+    ULONG64 QpcTimestamp = 0;
+    UINT64 TimeNow = 0;
 
     if ((ULONG)Device->Properties.Pid != IoGetRequestorProcessId(Irp)) {
         WNBD_LOG_DEBUG("Invalid pid: %d != %u.",
@@ -392,7 +732,14 @@ NTSTATUS WnbdHandleResponse(
     }
 
 Exit:
-    Device->Stats.LastReplyTimestamp = KeQueryInterruptTime();
+    TimeNow = KeQueryInterruptTimePrecise(&QpcTimestamp);
+    RecordRequestLatency(Device, Element, TimeNow);
+    WnbdQueueDepthComplete(
+        Device,
+        Element->FetchTimestamp && Element->FetchTimestamp < TimeNow ?
+            max(1, (TimeNow - Element->FetchTimestamp) / 10) : 0);
+
+    Device->Stats.LastReplyTimestamp = TimeNow;
     InterlockedIncrement64(&Device->Stats.TotalReceivedIOReplies);
     InterlockedDecrement64(&Device->Stats.PendingSubmittedIORequests);
 
@@ -15,11 +15,33 @@ NTSTATUS LockUsermodeBuffer(
     PVOID Buffer, UINT32 BufferSize, BOOLEAN Writeable,
     PVOID* OutBuffer, PMDL* OutMdl, BOOLEAN* Locked);
 
+VOID WnbdInitializeThrottling(PWNBD_DISK_DEVICE Device);
+
+// Wakes up the dispatchers after throttling requests, cancelling the
+// QoS timer. Callable at DISPATCH_LEVEL.
+VOID WnbdReleaseThrottledRequests(PWNBD_DISK_DEVICE Device);
+
 NTSTATUS WnbdDispatchRequest(
     PIRP Irp,
     PWNBD_DISK_DEVICE Device,
     PWNBD_IOCTL_FETCH_REQ_COMMAND Command);
 
+VOID WnbdInitializeFetchQueue(PWNBD_DISK_DEVICE Device);
+
+// Queues a pendable fetch request that couldn't retrieve an IO request
+// right away. The device reference acquired by the caller is released
+// when completing the IRP.
+NTSTATUS WnbdPendFetchRequest(
+    PIRP Irp,
+    PWNBD_DISK_DEVICE Device);
+
+// Completes the queued fetch requests as IO requests become available,
+// returning once the device gets removed.
+VOID WnbdServeFetchRequests(PWNBD_DISK_DEVICE Device);
+
+// Completes the queued fetch requests using disconnect requests.
+VOID WnbdFailFetchRequests(PWNBD_DISK_DEVICE Device);
+
 NTSTATUS WnbdHandleResponse(
     PIRP Irp,
     PWNBD_DISK_DEVICE Device,
@@ -25,7 +25,30 @@ extern "C" {
 
 #define WNBD_MIN_DISPATCHER_THREAD_COUNT 1
 #define WNBD_MAX_DISPATCHER_THREAD_COUNT 255
+#define WNBD_DEFAULT_DISPATCHER_FETCH_THREADS 1
+#define WNBD_MAX_DISPATCHER_QUEUE_DEPTH 1024
+#define WNBD_DEFAULT_ELASTIC_INTERVAL_MS 200
+#define WNBD_DEFAULT_POLL_BUDGET_US 50
+#define WNBD_MAX_POLL_BUDGET_US 100000
 #define WNBD_LOG_MESSAGE_MAX_SIZE 4096
+#define WNBD_DEFAULT_ASYNC_LOG_RING_SIZE 256
+#define WNBD_DEFAULT_ASYNC_LOG_FLUSH_INTERVAL_MS 100
+#define WNBD_DEFAULT_IO_TRACE_FILE_SIZE (64ULL << 20)
+#define WNBD_MIN_IO_TRACE_FILE_SIZE (1ULL << 20)
+#define WNBD_DEFAULT_IO_TRACE_FILE_COUNT 4
+#define WNBD_DEFAULT_FILE_QUEUE_DEPTH 64
+#define WNBD_DEFAULT_FILE_COMPLETION_THREADS 2
+#define WNBD_DEFAULT_OVERLAY_CLUSTER_SIZE (64 * 1024)
+#define WNBD_MIN_OVERLAY_CLUSTER_SIZE 4096
+#define WNBD_MAX_OVERLAY_CLUSTER_SIZE (1024 * 1024)
+#define WNBD_MAX_NBD_MEMBERS 32
+#define WNBD_DEFAULT_STRIPE_SIZE (64 * 1024)
+#define WNBD_MIN_STRIPE_SIZE 4096
+#define WNBD_MAX_STRIPE_SIZE (16 * 1024 * 1024)
+#define WNBD_MAX_ENCRYPTION_KEY_SIZE 64
+#define WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE (64 * 1024)
+#define WNBD_MIN_COMPRESSION_CLUSTER_SIZE 4096
+#define WNBD_MAX_COMPRESSION_CLUSTER_SIZE (256 * 1024)
 #define WNBD_DEFAULT_RM_TIMEOUT_MS 30 * 1000
 #define WNBD_DEFAULT_RM_RETRY_INTERVAL_MS 2000
 
@@ -67,7 +90,16 @@ typedef struct _WNBD_USR_STATS
     UINT64 TotalWrittenBlocks;
     UINT64 PersistResInErrors;
     UINT64 PersistResOutErrors;
-    BYTE Reserved[128];
+    // Busy polling (see WNBD_DISPATCHER_FLAGS.BusyPoll). The poll time
+    // is spent spinning on a processor, so it reflects the extra CPU
+    // usage. Also covers the NBD reply thread.
+    UINT64 PollCount;
+    UINT64 PolledRequests;
+    UINT64 PollTimeUs;
+    // Written blocks sent as NBD_CMD_WRITE_ZEROES instead of data, see
+    // NBD_CONNECTION_FLAGS.DetectZeroes.
+    UINT64 ZeroedWriteBlocks;
+    BYTE Reserved[96];
 } WNBD_USR_STATS, *PWNBD_USR_STATS;
 WNBD_ASSERT_SZ_EQ(WNBD_USR_STATS, 256);
 
@@ -89,6 +121,327 @@ typedef struct
 } WNBD_REMOVE_OPTIONS, *PWNBD_REMOVE_OPTIONS;
 WNBD_ASSERT_SZ_EQ(WNBD_REMOVE_OPTIONS, 76);
 
+typedef enum
+{
+    // Each dispatcher thread fetches a request from the driver and passes
+    // it to the IO callbacks before fetching the next one.
+    WnbdDispatcherModeThreaded = 0,
+    // Fetch threads retrieve requests from the driver and queue them to
+    // an IO completion port. A pool of worker threads dequeues and passes
+    // them to the IO callbacks.
+    WnbdDispatcherModeCompletionPort = 1,
+} WnbdDispatcherMode;
+
+typedef struct
+{
+    // Threaded mode only. Adjust the number of dispatcher threads
+    // based on the disk activity, within the specified bounds.
+    UINT32 Elastic:1;
+    // Pin the dispatcher threads to the processors specified by
+    // WNBD_DISPATCHER_OPTIONS.AffinityMask and ProcessorGroup.
+    // Request buffers are allocated on the NUMA node of the first
+    // processor, unless UseNumaNode is set.
+    UINT32 UseAffinity:1;
+    // Allocate request buffers on the NUMA node specified by
+    // WNBD_DISPATCHER_OPTIONS.NumaNode. Unless UseAffinity is set,
+    // the dispatcher threads are pinned to the processors of this node.
+    UINT32 UseNumaNode:1;
+    // Spin fetching requests for up to WNBD_DISPATCHER_OPTIONS.PollBudgetUs
+    // before falling back to a blocking fetch, avoiding the wakeup latency
+    // at the expense of CPU usage. Meant for dedicated processors,
+    // not supported by elastic dispatchers.
+    UINT32 BusyPoll:1;
+    UINT32 Reserved:28;
+} WNBD_DISPATCHER_FLAGS, *PWNBD_DISPATCHER_FLAGS;
+WNBD_ASSERT_SZ_EQ(WNBD_DISPATCHER_FLAGS, 4);
+
+typedef struct
+{
+    // AES-XTS key: the data key followed by the tweak key. 32 bytes for
+    // AES-128-XTS or 64 bytes for AES-256-XTS.
+    BYTE Key[WNBD_MAX_ENCRYPTION_KEY_SIZE];
+    UINT32 KeySize;
+    // The encryption data unit (sector) size, 512 or 4096. The data unit
+    // number is used as tweak. Must not exceed the disk block size,
+    // defaults to the disk block size if 0.
+    UINT32 DataUnitSize;
+    BYTE Reserved[32];
+} WNBD_ENCRYPTION_OPTIONS, *PWNBD_ENCRYPTION_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_ENCRYPTION_OPTIONS, 104);
+
+typedef struct
+{
+    // Optional sidecar file persisting the checksums across runs,
+    // created if missing. The checksums are only kept in memory
+    // otherwise.
+    CHAR SidecarPath[MAX_PATH];
+    BYTE Reserved[32];
+} WNBD_INTEGRITY_OPTIONS, *PWNBD_INTEGRITY_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_INTEGRITY_OPTIONS, 292);
+
+typedef struct
+{
+    // Read blocks that matched their checksum.
+    UINT64 VerifiedBlocks;
+    // Read blocks without a known checksum: blocks that weren't written
+    // since enabling the checks or that had concurrent writes.
+    UINT64 UnverifiedBlocks;
+    // Read blocks that didn't match their checksum.
+    UINT64 ChecksumErrors;
+    // The number of blocks that currently have a known checksum.
+    UINT64 TrackedBlocks;
+    BYTE Reserved[32];
+} WNBD_INTEGRITY_STATS, *PWNBD_INTEGRITY_STATS;
+WNBD_ASSERT_SZ_EQ(WNBD_INTEGRITY_STATS, 64);
+
+typedef struct
+{
+    WnbdDispatcherMode Mode;
+    // The number of threads that invoke the IO callbacks. In elastic
+    // mode, this is the initial thread count.
+    UINT32 ThreadCount;
+    // Ignored, the completion port mode no longer uses fetch threads.
+    UINT32 FetchThreadCount;
+    // Completion port mode only, the number of fetch requests that are
+    // kept pending in the driver, which is also the maximum number of
+    // fetched requests processed at a time. Each one uses a request
+    // buffer. Defaults to twice the thread count if 0.
+    UINT32 QueueDepth;
+    WNBD_DISPATCHER_FLAGS Flags;
+    // Elastic mode only, the thread count bounds. Default to
+    // WNBD_MIN_DISPATCHER_THREAD_COUNT and WNBD_MAX_DISPATCHER_THREAD_COUNT
+    // respectively if 0.
+    UINT32 MinThreadCount;
+    UINT32 MaxThreadCount;
+    // Elastic mode only, how often the thread count gets reevaluated.
+    // Defaults to WNBD_DEFAULT_ELASTIC_INTERVAL_MS if 0.
+    UINT32 ElasticIntervalMs;
+    // Used along with the UseAffinity flag.
+    UINT64 AffinityMask;
+    UINT32 ProcessorGroup;
+    // Used along with the UseNumaNode flag.
+    UINT32 NumaNode;
+    // Used along with the BusyPoll flag. Defaults to
+    // WNBD_DEFAULT_POLL_BUDGET_US if 0.
+    UINT32 PollBudgetUs;
+    // Optional, see WnbdEnableEncryption. Only used while starting
+    // the dispatcher.
+    PWNBD_ENCRYPTION_OPTIONS Encryption;
+    // Optional, see WnbdEnableIntegrity. Only used while starting
+    // the dispatcher.
+    PWNBD_INTEGRITY_OPTIONS Integrity;
+    BYTE Reserved[8];
+} WNBD_DISPATCHER_OPTIONS, *PWNBD_DISPATCHER_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_DISPATCHER_OPTIONS, 80);
+
+typedef struct
+{
+    // The number of messages that can be queued by each thread, must be
+    // a power of two. Defaults to WNBD_DEFAULT_ASYNC_LOG_RING_SIZE if 0.
+    // Messages are dropped when the ring is full.
+    UINT32 RingSize;
+    // How often the queued messages are passed to the logger. Defaults to
+    // WNBD_DEFAULT_ASYNC_LOG_FLUSH_INTERVAL_MS if 0.
+    UINT32 FlushIntervalMs;
+    BYTE Reserved[32];
+} WNBD_ASYNC_LOG_OPTIONS, *PWNBD_ASYNC_LOG_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_ASYNC_LOG_OPTIONS, 40);
+
+typedef struct
+{
+    // The maximum trace file size, including the header. Defaults to
+    // WNBD_DEFAULT_IO_TRACE_FILE_SIZE if 0.
+    UINT64 MaxFileSize;
+    // The number of rotated trace files to keep: "<Path>.1" being the
+    // most recent one, up to "<Path>.<MaxFileCount>". Defaults to
+    // WNBD_DEFAULT_IO_TRACE_FILE_COUNT if 0.
+    UINT32 MaxFileCount;
+    CHAR Path[MAX_PATH];
+    BYTE Reserved[32];
+} WNBD_IO_TRACE_OPTIONS, *PWNBD_IO_TRACE_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_IO_TRACE_OPTIONS, 304);
+
+typedef struct
+{
+    // Use the system file cache. Unbuffered IO is used by default,
+    // falling back to buffered IO if the file sector size is larger than
+    // the disk block size.
+    UINT32 BufferedIo:1;
+    UINT32 Reserved:31;
+} WNBD_FILE_FLAGS, *PWNBD_FILE_FLAGS;
+WNBD_ASSERT_SZ_EQ(WNBD_FILE_FLAGS, 4);
+
+typedef enum
+{
+    WnbdCompressionNone = 0,
+    // LZ77 based codec (XPRESS), favoring speed.
+    WnbdCompressionFast = 1,
+    // LZ77 with Huffman coding (XPRESS Huffman), providing a better
+    // compression ratio at a higher CPU cost.
+    WnbdCompressionHigh = 2,
+} WnbdCompressionCodec;
+
+typedef struct
+{
+    // Clusters are compressed using the specified codec. Zero clusters
+    // only take up an index entry while clusters that don't shrink by
+    // at least 1/8 are stored uncompressed.
+    WnbdCompressionCodec Codec;
+    // Compression unit, must be a power of two between
+    // WNBD_MIN_COMPRESSION_CLUSTER_SIZE and
+    // WNBD_MAX_COMPRESSION_CLUSTER_SIZE. Larger clusters compress better
+    // but smaller writes have to recompress the whole cluster. Existing
+    // compressed images keep their cluster size. Defaults to
+    // WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE if 0.
+    UINT32 ClusterSize;
+    BYTE Reserved[32];
+} WNBD_COMPRESSION_OPTIONS, *PWNBD_COMPRESSION_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_COMPRESSION_OPTIONS, 40);
+
+typedef struct
+{
+    UINT64 ClusterSize;
+    UINT64 ClusterCount;
+    // Clusters that only hold zeroes, which aren't stored.
+    UINT64 ZeroClusters;
+    // Clusters stored uncompressed.
+    UINT64 RawClusters;
+    UINT64 CompressedClusters;
+    // The size of the stored clusters, excluding the cluster index
+    // and the allocation overhead.
+    UINT64 StoredBytes;
+    BYTE Reserved[32];
+} WNBD_COMPRESSION_STATS, *PWNBD_COMPRESSION_STATS;
+WNBD_ASSERT_SZ_EQ(WNBD_COMPRESSION_STATS, 80);
+
+typedef struct
+{
+    // Raw image, sparse file or block device (e.g. "\\.\PhysicalDrive2").
+    CHAR Path[MAX_PATH];
+    WNBD_FILE_FLAGS Flags;
+    // The maximum number of file operations submitted at a time.
+    // Defaults to WNBD_DEFAULT_FILE_QUEUE_DEPTH if 0.
+    UINT32 QueueDepth;
+    // The number of threads handling the IO completions. Defaults to
+    // WNBD_DEFAULT_FILE_COMPLETION_THREADS if 0.
+    UINT32 CompletionThreadCount;
+    // Optional. If set and the codec isn't WnbdCompressionNone, the file
+    // is used as a compressed image instead of a raw image. Block
+    // devices are not supported.
+    PWNBD_COMPRESSION_OPTIONS Compression;
+    BYTE Reserved[24];
+} WNBD_FILE_OPTIONS, *PWNBD_FILE_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_FILE_OPTIONS, 304);
+
+typedef struct
+{
+    // Local file that receives the writes, created if missing. It holds
+    // the dirty clusters along with a persistent allocation bitmap.
+    CHAR DeltaPath[MAX_PATH];
+    // Read-only base image. The NBD export specified through the disk
+    // properties is used as base if not set.
+    CHAR BasePath[MAX_PATH];
+    // Copy-on-write granularity, must be a power of two between
+    // WNBD_MIN_OVERLAY_CLUSTER_SIZE and WNBD_MAX_OVERLAY_CLUSTER_SIZE.
+    // Existing delta files keep their cluster size. Defaults to
+    // WNBD_DEFAULT_OVERLAY_CLUSTER_SIZE if 0.
+    UINT32 ClusterSize;
+    BYTE Reserved[32];
+} WNBD_OVERLAY_OPTIONS, *PWNBD_OVERLAY_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_OVERLAY_OPTIONS, 556);
+
+typedef struct
+{
+    // Must be a power of two between WNBD_MIN_STRIPE_SIZE and
+    // WNBD_MAX_STRIPE_SIZE. Defaults to WNBD_DEFAULT_STRIPE_SIZE if 0.
+    UINT32 StripeSize;
+    BYTE Reserved[32];
+} WNBD_STRIPE_OPTIONS, *PWNBD_STRIPE_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_STRIPE_OPTIONS, 36);
+
+typedef enum
+{
+    // Reads are sent to the replica with the fewest pending requests.
+    WnbdMirrorReadLeastPending = 0,
+    // Reads are sent to the replica with the lowest expected latency,
+    // based on the average read latency and the pending requests.
+    WnbdMirrorReadLowestLatency = 1,
+} WnbdMirrorReadPolicy;
+
+typedef struct
+{
+    // The number of replicas that must complete a write, flush or unmap
+    // request before it's acknowledged. If 0, all the healthy replicas
+    // are awaited and the request succeeds as long as one of them does.
+    UINT32 WriteQuorum;
+    WnbdMirrorReadPolicy ReadPolicy;
+    // Optional state file, created if missing, tracking the replicas
+    // that are out of sync across runs. Stale replicas are resynced
+    // before the disk is exposed. Without a state file, the replicas
+    // are expected to be in sync when the mirror is opened.
+    CHAR StatePath[MAX_PATH];
+    BYTE Reserved[32];
+} WNBD_MIRROR_OPTIONS, *PWNBD_MIRROR_OPTIONS;
+WNBD_ASSERT_SZ_EQ(WNBD_MIRROR_OPTIONS, 300);
+
+// "WNBDTRC1"
+#define WNBD_IO_TRACE_MAGIC 0x3143525444424E57ULL
+#define WNBD_IO_TRACE_VERSION 1
+
+// IO trace file layout: a WNBD_IO_TRACE_HEADER structure followed by
+// WNBD_IO_TRACE_RECORD entries, in completion order.
+typedef struct
+{
+    UINT64 Magic;
+    UINT32 Version;
+    UINT32 HeaderSize;
+    UINT32 RecordSize;
+    UINT32 BlockSize;
+    // Updated as records get written, covering the highest written record.
+    // Records that have the request type set to WnbdReqTypeUnknown must
+    // be skipped, e.g. records that were still being written when the
+    // process crashed. Older trace files that weren't closed properly
+    // have this set to 0, in which case all the records must be scanned.
+    UINT64 RecordCount;
+    UINT64 BlockCount;
+    // Record timestamps are performance counter values
+    // (QueryPerformanceCounter).
+    UINT64 TimestampFrequency;
+    // The performance counter value and the system time (UTC FILETIME)
+    // at which the trace file was created.
+    UINT64 StartTimestamp;
+    UINT64 StartTime;
+    CHAR InstanceName[WNBD_MAX_NAME_LENGTH];
+    BYTE Reserved[192];
+} WNBD_IO_TRACE_HEADER, *PWNBD_IO_TRACE_HEADER;
+WNBD_ASSERT_SZ_EQ(WNBD_IO_TRACE_HEADER, 512);
+
+#define WNBD_IO_TRACE_FLAG_FUA 1
+
+typedef struct
+{
+    UINT64 RequestHandle;
+    // Unmap requests: the first unmap descriptor.
+    UINT64 BlockAddress;
+    UINT64 FetchTimestamp;
+    UINT64 CompleteTimestamp;
+    UINT32 BlockCount;
+    // WnbdRequestType
+    UINT8 RequestType;
+    UINT8 Flags;
+    UINT8 ScsiStatus;
+    UINT8 SenseKey;
+} WNBD_IO_TRACE_RECORD, *PWNBD_IO_TRACE_RECORD;
+WNBD_ASSERT_SZ_EQ(WNBD_IO_TRACE_RECORD, 40);
+
+// Receives the IO responses of disks created using WnbdCreateOffline.
+// The data buffer is only valid for the duration of the call.
+typedef VOID (*OfflineResponseFunc)(
+    PVOID ResponseContext,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize);
+
 typedef struct _WNBD_INTERFACE WNBD_INTERFACE;
 // This should be handled as an opaque structure by library consumers.
 typedef struct _WNBD_DISK
@@ -103,7 +456,37 @@ typedef struct _WNBD_DISK
     BOOLEAN Started;
     HANDLE* DispatcherThreads;
     UINT32 DispatcherThreadsCount;
+    // Deprecated: the userspace counters are sharded per processor, this
+    // is merely a snapshot that gets refreshed by WnbdGetUserspaceStats.
+    // Use the counters returned by WnbdGetUserspaceStats instead.
     WNBD_USR_STATS Stats;
+    // Request buffer pool used by the dispatcher.
+    PVOID BufferPool;
+    // Set when using WnbdSetCompletionPort.
+    HANDLE CompletionPort;
+    // Internal state used by the completion port and elastic
+    // dispatcher modes.
+    PVOID DispatcherContext;
+    // Dispatcher thread affinity, the mask is 0 if not set.
+    GROUP_AFFINITY DispatcherAffinity;
+    // Per processor userspace stats.
+    PVOID UsrStats;
+    // Set by WnbdStartIoTrace.
+    PVOID IoTrace;
+    // Offline disks only, see WnbdCreateOffline.
+    OfflineResponseFunc OfflineResponse;
+    PVOID OfflineResponseContext;
+    // Dispatcher busy polling budget, 0 if disabled.
+    UINT32 PollBudgetUs;
+    // Set by WnbdEnableEncryption.
+    PVOID Crypt;
+    // Set by WnbdEnableIntegrity.
+    PVOID Integrity;
+    // Used by the coroutine layer (see wnbd_coro.h), queuing the
+    // responses of the requests that complete asynchronously. Zeroed
+    // when the disk is created.
+    SLIST_HEADER CoroResponses;
+    volatile LONG64 CoroResponseState;
 } WNBD_DISK, *PWNBD_DISK;
 
 typedef VOID (*ReadFunc)(
@@ -169,9 +552,181 @@ DWORD WnbdCreate(
     const PWNBD_INTERFACE Interface,
     PVOID Context,
     PWNBD_DISK* PDisk);
+// Creates a disk that isn't exposed through the WNBD driver, which is
+// not required in this case. The requests passed to WnbdSubmitRequest
+// are handled by the IO callbacks, while the responses are passed to
+// the specified response function. Meant for testing and benchmarking
+// backends. The dispatcher functions may not be used with offline disks
+// and the IO callbacks cannot lease request buffers.
+DWORD WnbdCreateOffline(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_INTERFACE Interface,
+    PVOID Context,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk);
+// Passes the request to the IO callbacks of an offline disk. The buffer
+// contains the write payload or the unmap descriptors and must be large
+// enough to hold the read payload. It must remain valid until the
+// response is received.
+DWORD WnbdSubmitRequest(
+    PWNBD_DISK Disk,
+    PWNBD_IO_REQUEST Request,
+    PVOID Buffer);
+// Connects to the NBD server and returns an offline disk that uses the
+// NBD client IO callbacks. Requests must be submitted from a single
+// thread. WSAStartup must be called first.
+DWORD WnbdCreateOfflineNbd(
+    const PWNBD_PROPERTIES Properties,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk);
+// Closes the NBD connection and releases the disk.
+VOID WnbdCloseOfflineNbd(PWNBD_DISK Disk);
 // Starts an NBD client daemon in blocking mode. Make sure to call
 // WSAStartup first.
 DWORD WnbdRunNbdDaemon(const PWNBD_PROPERTIES Properties);
+// NBD mappings use a single dispatcher thread, only the affinity
+// options are used. The NBD reply thread uses the same affinity as the
+// dispatcher, keeping the submit and reply paths on the same NUMA node.
+// The IO trace options are optional, see WnbdStartIoTrace.
+DWORD WnbdRunNbdDaemonEx(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions);
+// Exposes a local file or block device, using overlapped IO. Files that
+// don't exist are created as sparse files if the disk size is specified
+// (BlockCount * BlockSize), otherwise the file size is used. Unmap
+// requests deallocate the specified ranges of sparse files. The block
+// count, flush, FUA and unmap properties are set based on the file.
+// If compression is enabled, the file holds a compressed image (see
+// WNBD_COMPRESSION_OPTIONS), created if missing and if the disk size is
+// specified. The dispatcher and IO trace options are optional.
+DWORD WnbdRunFileDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_FILE_OPTIONS FileOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions);
+// Opens the file and returns an offline disk that uses the file backend,
+// see WnbdCreateOffline. Meant for testing and measuring the WNBD
+// overhead apart from the driver.
+DWORD WnbdCreateOfflineFile(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_FILE_OPTIONS FileOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk);
+// Waits for the pending IO, closes the file and releases the disk.
+VOID WnbdCloseOfflineFile(PWNBD_DISK Disk);
+// Exposes a sparse in-memory disk of the specified size (BlockCount *
+// BlockSize). Memory is allocated in chunks when first written, using
+// large pages if SeLockMemoryPrivilege is held. All-zero writes don't
+// allocate memory and release the chunks that they fully cover. The
+// data is discarded when the disk is removed.
+DWORD WnbdRunRamDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions);
+// Returns an offline RAM disk, see WnbdRunRamDaemon and
+// WnbdCreateOffline.
+DWORD WnbdCreateOfflineRam(
+    const PWNBD_PROPERTIES Properties,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk);
+VOID WnbdCloseOfflineRam(PWNBD_DISK Disk);
+// Exposes an in-memory disk that compresses each cluster separately, see
+// WNBD_COMPRESSION_OPTIONS. Memory is allocated for each stored cluster
+// based on its compressed size, zero clusters not taking up any space
+// apart from the cluster index entry (8 bytes per cluster). The data is
+// discarded when the disk is removed.
+DWORD WnbdRunCompressedRamDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_COMPRESSION_OPTIONS CompressionOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions);
+// Returns an offline compressed RAM disk, see WnbdRunCompressedRamDaemon
+// and WnbdCreateOffline.
+DWORD WnbdCreateOfflineCompressedRam(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_COMPRESSION_OPTIONS CompressionOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk);
+VOID WnbdCloseOfflineCompressedRam(PWNBD_DISK Disk);
+// Retrieves the compression counters of offline disks created using
+// WnbdCreateOfflineCompressedRam or WnbdCreateOfflineFile with
+// compression enabled. Returns ERROR_NOT_SUPPORTED for the other
+// offline disks created by the built-in backends.
+DWORD WnbdGetCompressionStats(
+    PWNBD_DISK Disk,
+    PWNBD_COMPRESSION_STATS Stats);
+// Exposes a copy-on-write overlay on top of a read-only base image or NBD
+// export. Reads of unmodified clusters are served by the base while
+// writes go to the local delta file, so that multiple disks can share
+// the same base. Local base images are accessed through the system
+// file cache, which is shared by all the disks using them. Make sure
+// to call WSAStartup first when using an NBD base.
+DWORD WnbdRunOverlayDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_OVERLAY_OPTIONS OverlayOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions);
+// Returns an offline overlay disk, see WnbdRunOverlayDaemon and
+// WnbdCreateOffline.
+DWORD WnbdCreateOfflineOverlay(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_OVERLAY_OPTIONS OverlayOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk);
+VOID WnbdCloseOfflineOverlay(PWNBD_DISK Disk);
+// Stripes the disk across multiple NBD exports (RAID-0), using one
+// connection per export. The NBD connection details from the disk
+// properties are ignored. When skipping NBD negotiation, the disk
+// properties specify the size of each export. Make sure to call
+// WSAStartup first.
+DWORD WnbdRunStripeDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_STRIPE_OPTIONS StripeOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions);
+// Returns an offline striped disk, see WnbdRunStripeDaemon and
+// WnbdCreateOffline.
+DWORD WnbdCreateOfflineStripe(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_STRIPE_OPTIONS StripeOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk);
+VOID WnbdCloseOfflineStripe(PWNBD_DISK Disk);
+// Mirrors the disk across multiple NBD exports (RAID-1), using one
+// connection per export. Failed reads are retried using the other
+// replicas. Replicas that fail writes or keep failing reads are dropped
+// while the disk keeps running. The NBD connection details from the
+// disk properties are ignored. Make sure to call WSAStartup first.
+DWORD WnbdRunMirrorDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_MIRROR_OPTIONS MirrorOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions);
+// Returns an offline mirrored disk, see WnbdRunMirrorDaemon and
+// WnbdCreateOffline.
+DWORD WnbdCreateOfflineMirror(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_MIRROR_OPTIONS MirrorOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk);
+VOID WnbdCloseOfflineMirror(PWNBD_DISK Disk);
 // Remove the disk. The existing dispatchers will continue running until all
 // the driver IO requests are completed unless the "HardRemove" flag is set.
 DWORD WnbdRemove(
@@ -183,6 +738,11 @@ DWORD WnbdRemoveEx(
 DWORD WnbdSetDiskSize(
     PWNBD_DISK Disk,
     UINT64 BlockCount);
+// Replaces the QoS limits of the specified disk, taking effect right
+// away. See WNBD_QOS_LIMITS.
+DWORD WnbdSetQosLimits(
+    const char* InstanceName,
+    PWNBD_QOS_LIMITS Limits);
 // Cleanup the PWNBD_DISK structure. This should be called after stopping
 // the IO dispatchers.
 VOID WnbdClose(PWNBD_DISK Disk);
@@ -215,6 +775,18 @@ DWORD WnbdGetUserContext(
 DWORD WnbdGetDriverStats(
     const char* InstanceName,
     PWNBD_DRV_STATS Stats);
+// Per request type latency histograms, recorded by the driver.
+DWORD WnbdGetLatencyStats(
+    const char* InstanceName,
+    PWNBD_LATENCY_STATS Stats);
+// Returns the estimated latency percentile in microseconds, using the
+// upper bound of the matching histogram bucket. The percentile must
+// be between 0 and 100. Returns 0 if the histogram is empty.
+UINT64 WnbdGetLatencyPercentile(
+    const PWNBD_LATENCY_HISTOGRAM Histogram,
+    DOUBLE Percentile);
+// Returns the number of requests recorded by the specified histogram.
+UINT64 WnbdGetLatencyCount(const PWNBD_LATENCY_HISTOGRAM Histogram);
 DWORD WnbdGetConnectionInfo(
     PWNBD_DISK Disk,
     PWNBD_CONNECTION_INFO ConnectionInfo);
@@ -222,6 +794,61 @@ DWORD WnbdGetConnectionInfo(
 // libwnbd logger
 VOID WnbdSetLogger(LogMessageFunc Logger);
 VOID WnbdSetLogLevel(WnbdLogLevel LogLevel);
+// Defers formatting log messages and invoking the logger to a background
+// thread, keeping it out of the IO path. The logger will be called from
+// that thread. Options may be NULL, in which case the defaults are used.
+DWORD WnbdEnableAsyncLogging(PWNBD_ASYNC_LOG_OPTIONS Options);
+// Flushes the queued messages and stops the log thread. This must be
+// called before unloading libwnbd. Messages logged while this call is in
+// progress may be lost.
+VOID WnbdDisableAsyncLogging();
+// The number of log messages dropped so far because of a full log ring.
+UINT64 WnbdGetAsyncLogDropCount();
+
+// Records the requests passed to the IO callbacks along with their
+// completion status and timing, using a memory mapped, rotating trace
+// file. Request payloads are not recorded. May be called while the
+// dispatchers are running, in which case requests that are already
+// in flight are not recorded.
+DWORD WnbdStartIoTrace(
+    PWNBD_DISK Disk,
+    PWNBD_IO_TRACE_OPTIONS Options);
+// Stops tracing and closes the trace file. Called by WnbdClose.
+VOID WnbdStopIoTrace(PWNBD_DISK Disk);
+// Encrypts the data before it leaves the host using AES-XTS, the
+// data unit number being used as tweak. Write payloads are encrypted
+// in place before being passed to the IO callbacks, read payloads being
+// decrypted in place by WnbdSendResponse. Requires AES-NI.
+//
+// Must be called before the dispatcher starts (or before submitting
+// requests to offline disks), it can't be disabled afterwards. Also
+// enabled by WnbdStartDispatcherEx if WNBD_DISPATCHER_OPTIONS.Encryption
+// is set. The key is copied, the caller may clear it afterwards.
+DWORD WnbdEnableEncryption(
+    PWNBD_DISK Disk,
+    PWNBD_ENCRYPTION_OPTIONS Options);
+// Detects silent data corruption using a CRC32C checksum for each
+// block. The checksums are computed when writing and verified by
+// WnbdSendResponse when reading, blocks that don't match being failed
+// with a medium error. Encrypted disks are checksummed after encryption.
+// Requires SSE4.2 and PCLMULQDQ.
+//
+// The checksums are kept in memory, which takes 4 bytes per written
+// block, and can be persisted using a sidecar file. The sidecar file is
+// only written when closing the disk, the checksums being discarded if
+// the disk wasn't closed cleanly. Blocks that weren't written since
+// enabling the checks or that were unmapped aren't verified.
+//
+// Must be called before the dispatcher starts (or before submitting
+// requests to offline disks), it can't be disabled afterwards. Also
+// enabled by WnbdStartDispatcherEx if WNBD_DISPATCHER_OPTIONS.Integrity
+// is set.
+DWORD WnbdEnableIntegrity(
+    PWNBD_DISK Disk,
+    PWNBD_INTEGRITY_OPTIONS Options);
+DWORD WnbdGetIntegrityStats(
+    PWNBD_DISK Disk,
+    PWNBD_INTEGRITY_STATS Stats);
 
 // Get libwnbd version.
 DWORD WnbdGetLibVersion(PWNBD_VERSION Version);
@@ -237,6 +864,9 @@ void WnbdSetSenseEx(
 void WnbdSetSense(PWNBD_STATUS Status, UINT8 SenseKey, UINT8 Asc);
 
 DWORD WnbdStartDispatcher(PWNBD_DISK Disk, DWORD ThreadCount);
+DWORD WnbdStartDispatcherEx(
+    PWNBD_DISK Disk,
+    PWNBD_DISPATCHER_OPTIONS Options);
 DWORD WnbdStopDispatcher(PWNBD_DISK Disk, PWNBD_REMOVE_OPTIONS RemoveOptions);
 DWORD WnbdWaitDispatcher(PWNBD_DISK Disk);
 // Must be called after an IO request completes, notifying the driver about
@@ -254,6 +884,60 @@ DWORD WnbdSendResponseEx(
     UINT32 DataBufferSize,
     LPOVERLAPPED Overlapped);
 
+/**
+* Take ownership of the request buffer received by an IO callback.
+*
+* The dispatcher reuses its request buffer as soon as the IO callback
+* returns. Asynchronous backends may lease the buffer instead of copying
+* its content, in which case the dispatcher switches to a different
+* buffer from the per-disk pool.
+*
+* Leased buffers are returned to the pool by WnbdSendResponse(Ex) once
+* the request completes. If WnbdSendResponseEx returns ERROR_IO_PENDING,
+* the caller must use WnbdReleaseRequestBuffer after the overlapped
+* operation completes.
+*
+* \param Disk The disk that the request belongs to
+* \param RequestHandle The request handle
+* \param Buffer The buffer received by the IO callback
+* \return a non-zero error code in case of failure. This function must
+*         be called from the IO callback, otherwise ERROR_INVALID_PARAMETER
+*         is returned.
+*/
+DWORD WnbdLeaseRequestBuffer(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle,
+    PVOID Buffer);
+// Return a leased request buffer to the pool.
+DWORD WnbdReleaseRequestBuffer(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle);
+
+/**
+* Associate the disk handle with an IO completion port.
+*
+* Asynchronous requests submitted through this disk, for example using
+* WnbdSendResponseEx, will then be completed through the specified
+* port instead of the overlapped event. Requests that complete
+* synchronously aren't queued, so a completion packet is only received
+* when ERROR_IO_PENDING is returned.
+*
+* Synchronous requests (NULL overlapped structure) aren't affected.
+* The same applies to overlapped structures that have the low-order bit
+* of the event handle set.
+*
+* \param Disk The disk, which must be created but not necessarily started
+* \param CompletionPort The completion port. The caller retains ownership
+*                       and must keep it open while the disk is in use.
+* \param CompletionKey The completion key included in each packet
+* \return a non-zero error code in case of failure. A handle may only
+*         be associated with a single completion port.
+*/
+DWORD WnbdSetCompletionPort(
+    PWNBD_DISK Disk,
+    HANDLE CompletionPort,
+    ULONG_PTR CompletionKey);
+
 /**
 * Retrieve a specific WNBD option.
 *
@@ -360,6 +1044,11 @@ DWORD WnbdIoctlStats(
     const char* InstanceName,
     PWNBD_DRV_STATS Stats,
     LPOVERLAPPED Overlapped);
+DWORD WnbdIoctlLatencyStats(
+    HANDLE Adapter,
+    const char* InstanceName,
+    PWNBD_LATENCY_STATS Stats,
+    LPOVERLAPPED Overlapped);
 // Reload the persistent settings provided through registry keys.
 DWORD WnbdIoctlReloadConfig(
     HANDLE Adapter,
@@ -401,11 +1090,48 @@ DWORD WnbdIoctlFetchRequest(
     PVOID DataBuffer,
     UINT32 DataBufferSize,
     LPOVERLAPPED Overlapped);
+// Returns ERROR_SEM_TIMEOUT if no request becomes available within the
+// specified timeout. Older drivers ignore the timeout.
+DWORD WnbdIoctlFetchRequestEx(
+    HANDLE Adapter,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IO_REQUEST Request,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    UINT32 TimeoutMs,
+    LPOVERLAPPED Overlapped);
+// Returns ERROR_SEM_TIMEOUT right away if there are no pending requests.
+// Older drivers ignore the flag, waiting until a request becomes available.
+DWORD WnbdIoctlPollRequest(
+    HANDLE Adapter,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IO_REQUEST Request,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    LPOVERLAPPED Overlapped);
+// Leaves the fetch request pending in the driver until a request becomes
+// available instead of blocking the calling thread, which allows
+// completing it through a completion port. The request is retrieved
+// from Command->Request, the command and the overlapped structure must
+// remain valid until the operation completes. Older drivers ignore the
+// flag, blocking the calling thread.
+DWORD WnbdIoctlQueueFetchRequest(
+    HANDLE Adapter,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IOCTL_FETCH_REQ_COMMAND Command,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    LPOVERLAPPED Overlapped);
 DWORD WnbdIoctlSetDiskSize(
     HANDLE Adapter,
     WNBD_CONNECTION_ID ConnectionId,
     UINT64 BlockCount,
     LPOVERLAPPED Overlapped);
+DWORD WnbdIoctlSetQosLimits(
+    HANDLE Adapter,
+    const char* InstanceName,
+    PWNBD_QOS_LIMITS Limits,
+    LPOVERLAPPED Overlapped);
 DWORD WnbdIoctlSendResponse(
     HANDLE Adapter,
     WNBD_CONNECTION_ID ConnectionId,
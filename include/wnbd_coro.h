@@ -0,0 +1,744 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#ifndef __cplusplus
+#error "wnbd_coro.h requires C++20."
+#endif
+
+#include <windows.h>
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <utility>
+
+#include "wnbd.h"
+
+// Header-only C++20 coroutine layer on top of WNBD_INTERFACE.
+//
+// Backends implement the IO operations as coroutines instead of
+// completing requests through WnbdSendResponse:
+//
+//     class MyBackend
+//     {
+//     public:
+//         wnbd::Task<WNBD_STATUS> Read(
+//             PVOID Buffer, UINT64 BlockAddress,
+//             UINT32 BlockCount, BOOLEAN ForceUnitAccess);
+//         wnbd::Task<WNBD_STATUS> Write(
+//             PVOID Buffer, UINT64 BlockAddress,
+//             UINT32 BlockCount, BOOLEAN ForceUnitAccess);
+//         // Optional
+//         wnbd::Task<WNBD_STATUS> Flush(
+//             UINT64 BlockAddress, UINT32 BlockCount);
+//         wnbd::Task<WNBD_STATUS> Unmap(
+//             PWNBD_UNMAP_DESCRIPTOR Descriptors, UINT32 Count);
+//     };
+//
+//     MyBackend Backend;
+//     WnbdCreate(
+//         &Props, (PWNBD_INTERFACE) &wnbd::CoroInterface<MyBackend>::Interface,
+//         &Backend, &Disk);
+//
+// The request state (handle, type, buffer) lives in the coroutine frame,
+// so backends don't need pending request tables. Asynchronous operations
+// can be awaited using wnbd::Completion, whose address may be used as a
+// lookup key when the completion is received (e.g. NBD request handles).
+//
+// Coroutine frames are recycled through wnbd::FramePool, so no heap
+// allocations take place per request once the pool warms up.
+//
+// Request buffers are leased (see WnbdLeaseRequestBuffer) when the
+// backend suspends, allowing the dispatcher to keep fetching requests.
+// Asynchronous completions are queued per disk and sent by the first
+// completing thread, which drains a bounded number of queued responses
+// while other threads return to the backend right away.
+namespace wnbd {
+
+// Recycles coroutine frames using lock-free lists, one per power of two
+// size class. Frames are kept until the process exits, so the pool size
+// is given by the peak number of outstanding requests.
+class FramePool
+{
+public:
+    static constexpr size_t MinFrameSize = 128;
+    static constexpr size_t SizeClassCount = 7;
+
+    static void* Allocate(size_t Size)
+    {
+        size_t SizeClass = GetSizeClass(Size);
+        if (SizeClass >= SizeClassCount) {
+            return ::operator new(Size);
+        }
+
+        PSLIST_ENTRY Entry = InterlockedPopEntrySList(
+            &Get().FreeFrames[SizeClass]);
+        if (Entry) {
+            return Entry;
+        }
+
+        void* Frame = _aligned_malloc(
+            MinFrameSize << SizeClass, MEMORY_ALLOCATION_ALIGNMENT);
+        if (!Frame) {
+            throw std::bad_alloc();
+        }
+        return Frame;
+    }
+
+    static void Free(void* Frame, size_t Size)
+    {
+        size_t SizeClass = GetSizeClass(Size);
+        if (SizeClass >= SizeClassCount) {
+            ::operator delete(Frame);
+            return;
+        }
+
+        InterlockedPushEntrySList(
+            &Get().FreeFrames[SizeClass], (PSLIST_ENTRY) Frame);
+    }
+
+private:
+    SLIST_HEADER FreeFrames[SizeClassCount];
+
+    FramePool()
+    {
+        for (auto& Head : FreeFrames) {
+            InitializeSListHead(&Head);
+        }
+    }
+
+    ~FramePool()
+    {
+        for (auto& Head : FreeFrames) {
+            PSLIST_ENTRY Entry;
+            while ((Entry = InterlockedPopEntrySList(&Head))) {
+                _aligned_free(Entry);
+            }
+        }
+    }
+
+    static FramePool& Get()
+    {
+        static FramePool Pool;
+        return Pool;
+    }
+
+    static size_t GetSizeClass(size_t Size)
+    {
+        size_t SizeClass = 0;
+        while (SizeClass < SizeClassCount &&
+                (MinFrameSize << SizeClass) < Size) {
+            SizeClass++;
+        }
+        return SizeClass;
+    }
+};
+
+// Coroutine promises deriving from this class get pooled frames.
+struct PooledPromise
+{
+    static void* operator new(size_t Size)
+    {
+        return FramePool::Allocate(Size);
+    }
+
+    static void operator delete(void* Frame, size_t Size)
+    {
+        FramePool::Free(Frame, Size);
+    }
+};
+
+namespace detail {
+
+template <typename T>
+struct TaskResult
+{
+    T Value{};
+
+    void return_value(T Result) { Value = std::move(Result); }
+    T TakeResult() { return std::move(Value); }
+};
+
+template <>
+struct TaskResult<void>
+{
+    void return_void() {}
+    void TakeResult() {}
+};
+
+} // namespace detail
+
+// Lazily started coroutine, which runs when awaited and resumes the
+// awaiting coroutine once done.
+template <typename T = void>
+class Task
+{
+public:
+    struct promise_type : PooledPromise, detail::TaskResult<T>
+    {
+        std::coroutine_handle<> Continuation;
+        std::exception_ptr Exception;
+
+        Task get_return_object()
+        {
+            return Task(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<promise_type> Handle) noexcept
+            {
+                std::coroutine_handle<> Continuation =
+                    Handle.promise().Continuation;
+                if (Continuation) {
+                    return Continuation;
+                }
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception()
+        {
+            Exception = std::current_exception();
+        }
+    };
+
+    Task(Task&& Other) noexcept
+        : Handle(std::exchange(Other.Handle, nullptr))
+    {
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        if (Handle) {
+            Handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> Continuation) noexcept
+    {
+        Handle.promise().Continuation = Continuation;
+        return Handle;
+    }
+
+    T await_resume()
+    {
+        if (Handle.promise().Exception) {
+            std::rethrow_exception(Handle.promise().Exception);
+        }
+        return Handle.promise().TakeResult();
+    }
+
+private:
+    std::coroutine_handle<promise_type> Handle;
+
+    explicit Task(std::coroutine_handle<promise_type> _Handle)
+        : Handle(_Handle)
+    {
+    }
+};
+
+// Single use awaitable, completed by a different thread or callback.
+// The awaiting coroutine is resumed by Complete, on the calling thread.
+// The object is usually part of the awaiting coroutine frame, so it
+// must not be accessed after Complete.
+template <typename T>
+class Completion
+{
+public:
+    bool await_ready() noexcept
+    {
+        return State.load(std::memory_order_acquire) == this;
+    }
+
+    bool await_suspend(std::coroutine_handle<> Handle) noexcept
+    {
+        void* Expected = nullptr;
+        // Resume right away if the operation completed in the meantime.
+        return State.compare_exchange_strong(
+            Expected, Handle.address(), std::memory_order_acq_rel);
+    }
+
+    T await_resume() { return std::move(Value); }
+
+    void Complete(T Result)
+    {
+        Value = std::move(Result);
+        void* Waiter = State.exchange(this, std::memory_order_acq_rel);
+        if (Waiter) {
+            std::coroutine_handle<>::from_address(Waiter).resume();
+        }
+    }
+
+private:
+    // nullptr: pending, this: completed, otherwise the awaiting coroutine.
+    std::atomic<void*> State = nullptr;
+    T Value{};
+};
+
+namespace detail {
+
+// Sense codes used for requests failing with an exception.
+constexpr UINT8 SenseMediumError = 0x03;
+constexpr UINT8 AdSenseUnrecoveredError = 0x11;
+
+enum class RequestState : LONG
+{
+    // Started by the IO callback, which hasn't returned yet.
+    Running,
+    // The IO callback returned, the request buffer being leased.
+    // The response will be sent by the completing thread.
+    Detached,
+    // The IO callback is waiting for the request to complete, the request
+    // buffer couldn't be leased.
+    Waiting,
+    Done,
+};
+
+class RequestTask;
+
+// Per request coroutine, driving the backend operation and sending
+// the response.
+struct RequestPromise : PooledPromise
+{
+    // Used by the response queue.
+    SLIST_ENTRY QueueEntry;
+
+    PWNBD_DISK Disk = nullptr;
+    WNBD_IO_RESPONSE Response = { 0 };
+    PVOID DataBuffer = nullptr;
+    UINT32 DataBufferSize = 0;
+
+    std::atomic<RequestState> State = RequestState::Running;
+    HANDLE CompletionEvent = NULL;
+
+    RequestTask get_return_object();
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        void await_suspend(
+            std::coroutine_handle<RequestPromise> Handle) noexcept;
+        void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void return_value(WNBD_STATUS Status)
+    {
+        Response.Status = Status;
+    }
+
+    void unhandled_exception()
+    {
+        WnbdSetSense(
+            &Response.Status, SenseMediumError, AdSenseUnrecoveredError);
+    }
+};
+
+using RequestHandle = std::coroutine_handle<RequestPromise>;
+
+class RequestTask
+{
+public:
+    using promise_type = RequestPromise;
+
+    explicit RequestTask(RequestHandle _Handle) : Handle(_Handle) {}
+
+    RequestHandle Handle;
+};
+
+inline RequestTask RequestPromise::get_return_object()
+{
+    return RequestTask(RequestHandle::from_promise(*this));
+}
+
+inline void SendResponse(RequestHandle Handle)
+{
+    RequestPromise& Request = Handle.promise();
+
+    PVOID DataBuffer = nullptr;
+    UINT32 DataBufferSize = 0;
+    if (Request.Response.RequestType == WnbdReqTypeRead &&
+            !Request.Response.Status.ScsiStatus) {
+        DataBuffer = Request.DataBuffer;
+        DataBufferSize = Request.DataBufferSize;
+    }
+
+    WnbdSendResponse(
+        Request.Disk, &Request.Response, DataBuffer, DataBufferSize);
+    Handle.destroy();
+}
+
+// Responses of the requests completed asynchronously, using the queue
+// of the disk. The driver receives one response per IOCTL, so the first
+// completing thread sends its response inline and then takes care of the
+// responses queued in the meantime, while the other threads return to
+// the backend right away.
+//
+// A thread that sent "BatchLimit" queued responses asks the next
+// completing thread to take over, so that a single thread doesn't end up
+// sending responses for as long as the disk stays busy.
+class ResponseQueue
+{
+public:
+    static constexpr UINT32 BatchLimit = 32;
+
+    explicit ResponseQueue(PWNBD_DISK Disk)
+        : Pending(&Disk->CoroResponses)
+        , State(&Disk->CoroResponseState)
+    {}
+
+    void Push(RequestHandle Handle)
+    {
+        LONG64 Owner = TryAcquire();
+        if (Owner) {
+            // Nothing to batch with.
+            SendResponse(Handle);
+            Drain(Owner);
+            return;
+        }
+
+        InterlockedPushEntrySList(Pending, &Handle.promise().QueueEntry);
+        // The queue may have been released before our entry was seen.
+        Owner = TryAcquire();
+        if (Owner) {
+            Drain(Owner);
+        }
+    }
+
+private:
+    // The state holds the mode in the low bits, the upper bits being
+    // incremented each time the queue changes owner.
+    static constexpr LONG64 ModeMask = 3;
+    static constexpr LONG64 ModeIdle = 0;
+    static constexpr LONG64 ModeDraining = 1;
+    static constexpr LONG64 ModeHandOff = 2;
+
+    PSLIST_HEADER Pending;
+    volatile LONG64* State;
+
+    // Returns the owner state, or 0 if another thread is draining
+    // the queue.
+    LONG64 TryAcquire()
+    {
+        LONG64 Curr = *State;
+        while ((Curr & ModeMask) != ModeDraining) {
+            LONG64 Owner = ((Curr & ~ModeMask) + ModeMask + 1) | ModeDraining;
+            LONG64 Prev = InterlockedCompareExchange64(State, Owner, Curr);
+            if (Prev == Curr) {
+                return Owner;
+            }
+            Curr = Prev;
+        }
+        return 0;
+    }
+
+    void Drain(LONG64 Owner)
+    {
+        UINT32 Sent = 0;
+        while (true) {
+            PSLIST_ENTRY Entries = InterlockedFlushSList(Pending);
+            if (Entries) {
+                Sent += SendResponses(Entries);
+                if (Sent >= BatchLimit && (Owner & ModeMask) == ModeDraining) {
+                    // Only the owner changes the state while draining.
+                    LONG64 HandOff = (Owner & ~ModeMask) | ModeHandOff;
+                    InterlockedExchange64(State, HandOff);
+                    Owner = HandOff;
+                }
+                if (*State != Owner) {
+                    // Taken over by another thread.
+                    return;
+                }
+                continue;
+            }
+
+            LONG64 Idle = (Owner & ~ModeMask) | ModeIdle;
+            if (InterlockedCompareExchange64(State, Idle, Owner) != Owner) {
+                return;
+            }
+            // Responses pushed before the queue was released.
+            if (!QueryDepthSList(Pending)) {
+                return;
+            }
+            Owner = TryAcquire();
+            if (!Owner) {
+                return;
+            }
+            Sent = 0;
+        }
+    }
+
+    static UINT32 SendResponses(PSLIST_ENTRY Entries)
+    {
+        // The list is LIFO, restore the completion order.
+        PSLIST_ENTRY Ordered = nullptr;
+        while (Entries) {
+            PSLIST_ENTRY Next = Entries->Next;
+            Entries->Next = Ordered;
+            Ordered = Entries;
+            Entries = Next;
+        }
+
+        UINT32 Count = 0;
+        while (Ordered) {
+            PSLIST_ENTRY Next = Ordered->Next;
+            SendResponse(RequestHandle::from_promise(
+                *CONTAINING_RECORD(Ordered, RequestPromise, QueueEntry)));
+            Ordered = Next;
+            Count++;
+        }
+        return Count;
+    }
+};
+
+inline void RequestPromise::FinalAwaiter::await_suspend(
+    std::coroutine_handle<RequestPromise> Handle) noexcept
+{
+    RequestPromise& Request = Handle.promise();
+
+    switch (Request.State.exchange(RequestState::Done)) {
+    case RequestState::Detached:
+        ResponseQueue(Request.Disk).Push(Handle);
+        break;
+    case RequestState::Waiting:
+        // The IO callback sends the response once woken up.
+        SetEvent(Request.CompletionEvent);
+        break;
+    default:
+        // Completed synchronously, the IO callback sends the response.
+        break;
+    }
+}
+
+template <typename Backend>
+concept FlushBackend = requires (
+        Backend& B, UINT64 BlockAddress, UINT32 BlockCount) {
+    B.Flush(BlockAddress, BlockCount);
+};
+
+template <typename Backend>
+concept UnmapBackend = requires (
+        Backend& B, PWNBD_UNMAP_DESCRIPTOR Descriptors, UINT32 Count) {
+    B.Unmap(Descriptors, Count);
+};
+
+} // namespace detail
+
+// Static WNBD_INTERFACE adapter. The disk context must point to
+// the backend instance.
+template <typename Backend>
+class CoroInterface
+{
+private:
+    static Backend* GetBackend(PWNBD_DISK Disk)
+    {
+        return (Backend*) Disk->Context;
+    }
+
+    static detail::RequestTask ReadRequest(
+        Backend* B, PVOID Buffer, UINT64 BlockAddress,
+        UINT32 BlockCount, BOOLEAN ForceUnitAccess)
+    {
+        co_return co_await B->Read(
+            Buffer, BlockAddress, BlockCount, ForceUnitAccess);
+    }
+
+    static detail::RequestTask WriteRequest(
+        Backend* B, PVOID Buffer, UINT64 BlockAddress,
+        UINT32 BlockCount, BOOLEAN ForceUnitAccess)
+    {
+        co_return co_await B->Write(
+            Buffer, BlockAddress, BlockCount, ForceUnitAccess);
+    }
+
+    static detail::RequestTask FlushRequest(
+        Backend* B, UINT64 BlockAddress, UINT32 BlockCount)
+    {
+        co_return co_await B->Flush(BlockAddress, BlockCount);
+    }
+
+    static detail::RequestTask UnmapRequest(
+        Backend* B, PWNBD_UNMAP_DESCRIPTOR Descriptors, UINT32 Count)
+    {
+        co_return co_await B->Unmap(Descriptors, Count);
+    }
+
+    static void Read(
+        PWNBD_DISK Disk, UINT64 RequestHandle, PVOID Buffer,
+        UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN ForceUnitAccess)
+    {
+        Dispatch(
+            Disk, RequestHandle, WnbdReqTypeRead, Buffer,
+            BlockCount * Disk->Properties.BlockSize,
+            [&]() {
+                return ReadRequest(
+                    GetBackend(Disk), Buffer, BlockAddress,
+                    BlockCount, ForceUnitAccess);
+            });
+    }
+
+    static void Write(
+        PWNBD_DISK Disk, UINT64 RequestHandle, PVOID Buffer,
+        UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN ForceUnitAccess)
+    {
+        Dispatch(
+            Disk, RequestHandle, WnbdReqTypeWrite, Buffer, 0,
+            [&]() {
+                return WriteRequest(
+                    GetBackend(Disk), Buffer, BlockAddress,
+                    BlockCount, ForceUnitAccess);
+            });
+    }
+
+    static void Flush(
+        PWNBD_DISK Disk, UINT64 RequestHandle,
+        UINT64 BlockAddress, UINT32 BlockCount)
+    {
+        Dispatch(
+            Disk, RequestHandle, WnbdReqTypeFlush, nullptr, 0,
+            [&]() {
+                return FlushRequest(
+                    GetBackend(Disk), BlockAddress, BlockCount);
+            });
+    }
+
+    static void Unmap(
+        PWNBD_DISK Disk, UINT64 RequestHandle,
+        PWNBD_UNMAP_DESCRIPTOR Descriptors, UINT32 Count)
+    {
+        Dispatch(
+            Disk, RequestHandle, WnbdReqTypeUnmap, Descriptors, 0,
+            [&]() {
+                return UnmapRequest(GetBackend(Disk), Descriptors, Count);
+            });
+    }
+
+    // The buffer is the one received by the IO callback, DataBufferSize
+    // being the size of the read response.
+    template <typename Factory>
+    static void Dispatch(
+        PWNBD_DISK Disk, UINT64 RequestHandle, WnbdRequestType RequestType,
+        PVOID Buffer, UINT32 DataBufferSize, Factory&& CreateRequest)
+    {
+        detail::RequestHandle Handle;
+        try {
+            Handle = CreateRequest().Handle;
+        }
+        catch (const std::bad_alloc&) {
+            WNBD_IO_RESPONSE Response = { 0 };
+            Response.RequestHandle = RequestHandle;
+            Response.RequestType = RequestType;
+            WnbdSetSense(
+                &Response.Status, detail::SenseMediumError,
+                detail::AdSenseUnrecoveredError);
+            WnbdSendResponse(Disk, &Response, NULL, 0);
+            return;
+        }
+
+        detail::RequestPromise& Request = Handle.promise();
+        Request.Disk = Disk;
+        Request.Response.RequestHandle = RequestHandle;
+        Request.Response.RequestType = RequestType;
+        Request.DataBuffer = Buffer;
+        Request.DataBufferSize = DataBufferSize;
+
+        Handle.resume();
+
+        if (Request.State.load() == detail::RequestState::Done) {
+            detail::SendResponse(Handle);
+            return;
+        }
+
+        // Offline disks own the buffers until the response is sent.
+        if (Buffer && !Disk->OfflineResponse &&
+                WnbdLeaseRequestBuffer(Disk, RequestHandle, Buffer)) {
+            WaitRequest(Handle);
+            return;
+        }
+
+        // The completing thread sends the response unless the request
+        // completed in the meantime.
+        if (Request.State.exchange(detail::RequestState::Detached) ==
+                detail::RequestState::Done) {
+            detail::SendResponse(Handle);
+        }
+    }
+
+    // Blocks the IO callback until the request completes, used when the
+    // request buffer can't be leased.
+    static void WaitRequest(detail::RequestHandle Handle)
+    {
+        detail::RequestPromise& Request = Handle.promise();
+
+        Request.CompletionEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        if (!Request.CompletionEvent) {
+            while (Request.State.load() != detail::RequestState::Done) {
+                SwitchToThread();
+            }
+        }
+        else {
+            if (Request.State.exchange(detail::RequestState::Waiting) !=
+                    detail::RequestState::Done) {
+                WaitForSingleObject(Request.CompletionEvent, INFINITE);
+            }
+            CloseHandle(Request.CompletionEvent);
+        }
+
+        detail::SendResponse(Handle);
+    }
+
+    static constexpr FlushFunc GetFlushFunc()
+    {
+        if constexpr (detail::FlushBackend<Backend>) {
+            return Flush;
+        }
+        else {
+            return nullptr;
+        }
+    }
+
+    static constexpr UnmapFunc GetUnmapFunc()
+    {
+        if constexpr (detail::UnmapBackend<Backend>) {
+            return Unmap;
+        }
+        else {
+            return nullptr;
+        }
+    }
+
+public:
+    // Persistent reservations aren't supported by this layer.
+    static constexpr WNBD_INTERFACE Interface = {
+        Read,
+        Write,
+        GetFlushFunc(),
+        GetUnmapFunc(),
+    };
+};
+
+} // namespace wnbd
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef WNBD_FETCH_H
+#define WNBD_FETCH_H
+
+// Fetch slot state machine, used by the completion port dispatcher.
+//
+// Each slot owns a request buffer and keeps one overlapped fetch request
+// pending in the driver. Whichever worker retrieves the completion
+// handles the fetched request, after which the slot gets rearmed. The
+// number of slots bounds the number of requests that are fetched or
+// processed at a time, regardless of the number of workers.
+//
+// Once stopping, the slots are no longer rearmed and the pending fetch
+// requests have to be cancelled. The fetched requests are still
+// dispatched, the driver expecting a reply. After all the slots become
+// idle, no more fetch completions can be queued, so the workers may exit
+// and the slot buffers may be released.
+//
+// Header only, depending solely on the basic integer types so that it
+// can be tested without a driver. The callers are responsible for
+// locking.
+
+typedef enum
+{
+    // No fetch request pending, the slot isn't in use.
+    WnbdFetchSlotIdle,
+    // A fetch request is pending in the driver.
+    WnbdFetchSlotFetching,
+    // The fetched request is being handled by a worker.
+    WnbdFetchSlotDispatching,
+} WNBD_FETCH_SLOT_STATE;
+
+typedef enum
+{
+    WnbdFetchActionNone,
+    // Submit a fetch request using the slot.
+    WnbdFetchActionArm,
+    // Pass the fetched request to the IO callbacks.
+    WnbdFetchActionDispatch,
+    // Stopping, the pending fetch requests must be cancelled.
+    WnbdFetchActionCancel,
+    // Stopped, all the slots are idle. Returned only once.
+    WnbdFetchActionDrained,
+} WNBD_FETCH_ACTION;
+
+typedef struct
+{
+    UINT32 SlotCount;
+    // The number of slots in the Fetching and Dispatching states.
+    UINT32 Fetching;
+    UINT32 Dispatching;
+    BOOLEAN Stopping;
+    BOOLEAN Drained;
+} WNBD_FETCH_RING, *PWNBD_FETCH_RING;
+
+// All the slots start idle.
+static inline void WnbdFetchInitialize(
+    PWNBD_FETCH_RING Ring,
+    UINT32 SlotCount)
+{
+    memset(Ring, 0, sizeof(WNBD_FETCH_RING));
+    Ring->SlotCount = SlotCount;
+}
+
+static inline WNBD_FETCH_ACTION WnbdFetchCheckDrained(PWNBD_FETCH_RING Ring)
+{
+    if (!Ring->Stopping || Ring->Drained ||
+            Ring->Fetching || Ring->Dispatching) {
+        return WnbdFetchActionNone;
+    }
+    Ring->Drained = TRUE;
+    return WnbdFetchActionDrained;
+}
+
+// Returns WnbdFetchActionCancel if there are pending fetch requests,
+// WnbdFetchActionDrained if all the slots are already idle.
+static inline WNBD_FETCH_ACTION WnbdFetchStop(PWNBD_FETCH_RING Ring)
+{
+    if (Ring->Stopping) {
+        return WnbdFetchActionNone;
+    }
+    Ring->Stopping = TRUE;
+    if (Ring->Fetching) {
+        return WnbdFetchActionCancel;
+    }
+    return WnbdFetchCheckDrained(Ring);
+}
+
+// Used when starting the dispatcher, the idle slots are left alone
+// once stopping.
+static inline WNBD_FETCH_ACTION WnbdFetchArm(
+    PWNBD_FETCH_RING Ring,
+    WNBD_FETCH_SLOT_STATE* State)
+{
+    if (Ring->Stopping || *State != WnbdFetchSlotIdle) {
+        return WnbdFetchActionNone;
+    }
+    *State = WnbdFetchSlotFetching;
+    Ring->Fetching++;
+    return WnbdFetchActionArm;
+}
+
+// Called when a fetch request completes, including the ones that fail
+// right away. Failures stop the dispatcher.
+static inline WNBD_FETCH_ACTION WnbdFetchCompleted(
+    PWNBD_FETCH_RING Ring,
+    WNBD_FETCH_SLOT_STATE* State,
+    BOOLEAN Success)
+{
+    WNBD_FETCH_ACTION Action = WnbdFetchActionNone;
+
+    if (*State != WnbdFetchSlotFetching) {
+        return WnbdFetchActionNone;
+    }
+    Ring->Fetching--;
+
+    if (Success) {
+        *State = WnbdFetchSlotDispatching;
+        Ring->Dispatching++;
+        return WnbdFetchActionDispatch;
+    }
+
+    *State = WnbdFetchSlotIdle;
+    Action = WnbdFetchStop(Ring);
+    if (Action != WnbdFetchActionNone) {
+        return Action;
+    }
+    return WnbdFetchCheckDrained(Ring);
+}
+
+// Called after handling the fetched request. The slot gets rearmed
+// unless stopping.
+static inline WNBD_FETCH_ACTION WnbdFetchDispatched(
+    PWNBD_FETCH_RING Ring,
+    WNBD_FETCH_SLOT_STATE* State)
+{
+    if (*State != WnbdFetchSlotDispatching) {
+        return WnbdFetchActionNone;
+    }
+    Ring->Dispatching--;
+
+    if (!Ring->Stopping) {
+        *State = WnbdFetchSlotFetching;
+        Ring->Fetching++;
+        return WnbdFetchActionArm;
+    }
+
+    *State = WnbdFetchSlotIdle;
+    return WnbdFetchCheckDrained(Ring);
+}
+
+#endif // WNBD_FETCH_H
@@ -32,6 +32,8 @@
 #define IOCTL_WNBD_RESET_DRV_OPT 13
 #define IOCTL_WNBD_LIST_DRV_OPT 14
 #define IOCTL_WNBD_SET_DISK_SIZE 15
+#define IOCTL_WNBD_LATENCY_STATS 16
+#define IOCTL_WNBD_SET_QOS_LIMITS 17
 
 static const GUID WNBD_GUID = {
     0x949dd17c,
@@ -65,6 +67,21 @@ static const GUID WNBD_GUID = {
 #define WNBD_DEFAULT_STALE_REQ_TIMEOUT_MS 15000
 #define WNBD_DEFAULT_STALE_CONN_TIMEOUT_MS 60000
 
+// Request scheduling weights, see wnbd_sched.h.
+#define WNBD_DEFAULT_SCHED_LATENCY_WEIGHT 4
+#define WNBD_DEFAULT_SCHED_BULK_WEIGHT 1
+#define WNBD_MAX_SCHED_WEIGHT 64
+// Larger reads and writes are considered bulk requests, unless FUA is set.
+#define WNBD_DEFAULT_SCHED_SMALL_IO_MAX_BYTES (16 * 1024)
+
+// The lower bound of the adaptive queue depth, see wnbd_qdepth.h. The
+// upper bound is the Storport queue depth (MaxIOReqPerLun).
+#define WNBD_DEFAULT_QDEPTH_MIN 4
+
+// The maximum QoS rate and burst values, avoiding overflows when
+// converting them to time intervals.
+#define WNBD_MAX_QOS_LIMIT (1ULL << 40)
+
 // Only used for NBD connections, in which case the block size is optional.
 #define WNBD_DEFAULT_BLOCK_SIZE 512
 
@@ -106,7 +123,10 @@ typedef struct {
     // block count or NBD server capabilities will have to be provided
     // through WNBD_PROPERTIES.
     UINT32 SkipNegotiation:1;
-    UINT32 Reserved:31;
+    // Send the all-zero parts of write requests as NBD_CMD_WRITE_ZEROES,
+    // if supported by the server, which may deallocate them.
+    UINT32 DetectZeroes:1;
+    UINT32 Reserved:30;
 } NBD_CONNECTION_FLAGS, *PNBD_CONNECTION_FLAGS;
 WNBD_ASSERT_SZ_EQ(NBD_CONNECTION_FLAGS, 4);
 
@@ -142,6 +162,32 @@ typedef struct {
     BYTE data[WNBD_NAA_ID_LENGTH];
 } WNBD_NAA_ID, *PWNBD_NAA_ID;
 
+// Token bucket limit. The bucket gets refilled at "Rate" tokens per
+// second and holds up to "Burst" tokens, defaulting to one second worth
+// of tokens. A zero rate disables the limit.
+typedef struct
+{
+    UINT64 Rate;
+    UINT64 Burst;
+} WNBD_QOS_LIMIT, *PWNBD_QOS_LIMIT;
+WNBD_ASSERT_SZ_EQ(WNBD_QOS_LIMIT, 16);
+
+// Per disk IO limits, applied by the driver before passing read and
+// write requests to userspace. Throttled requests are kept in the driver
+// queue until enough tokens become available. Requests are admitted as
+// long as the buckets aren't depleted, so the burst may be exceeded by
+// one request. Other request types are not throttled.
+typedef struct
+{
+    WNBD_QOS_LIMIT ReadIops;
+    WNBD_QOS_LIMIT WriteIops;
+    // Bytes per second.
+    WNBD_QOS_LIMIT ReadBandwidth;
+    WNBD_QOS_LIMIT WriteBandwidth;
+    BYTE Reserved[64];
+} WNBD_QOS_LIMITS, *PWNBD_QOS_LIMITS;
+WNBD_ASSERT_SZ_EQ(WNBD_QOS_LIMITS, 128);
+
 typedef struct
 {
     // Unique disk identifier
@@ -166,7 +212,9 @@ typedef struct
     // from the driver to libwnbd.
     NBD_CONNECTION_PROPERTIES NbdProperties;
     WNBD_NAA_ID NaaIdentifier;
-    BYTE Reserved[240];
+    // May be changed at runtime using IOCTL_WNBD_SET_QOS_LIMITS.
+    WNBD_QOS_LIMITS QosLimits;
+    BYTE Reserved[112];
 } WNBD_PROPERTIES, *PWNBD_PROPERTIES;
 WNBD_ASSERT_SZ_EQ(WNBD_PROPERTIES, 1368);
 
@@ -216,14 +264,92 @@ typedef struct
     // The following timestamps are retrieved using KeQueryInterruptTime.
     // We aren't using QPC since 15ms precision is enough in our case
     // and we want to avoid the potential overhead that may occur if
-    // QPC can't leverage TSC.
+    // QPC can't leverage TSC. The last submitted request and last reply
+    // timestamps reuse the precise timestamps recorded for the latency
+    // histograms, using the same unit.
     UINT64 LastReceivedReqTimestamp;
     UINT64 LastSubmittedReqTimestamp;
     UINT64 LastReplyTimestamp;
-    INT64 Reserved[12];
+    // Read and write requests delayed by the QoS limits.
+    INT64 ThrottledIORequests;
+    // The time spent by the throttled requests waiting for QoS tokens,
+    // in microseconds.
+    INT64 ThrottleWaitUs;
+    // The current adaptive queue depth limit, 0 if disabled.
+    INT64 QueueDepthLimit;
+    // The number of times that request dispatching had to wait for the
+    // adaptive queue depth limit.
+    INT64 QueueDepthWaits;
+    INT64 Reserved[8];
 } WNBD_DRV_STATS, *PWNBD_DRV_STATS;
 WNBD_ASSERT_SZ_EQ(WNBD_DRV_STATS, 192);
 
+// Request latency histograms, using log-linear (HDR style) buckets.
+// Latencies below WNBD_LATENCY_SUB_BUCKET_COUNT microseconds get a bucket
+// each, while every subsequent power of two range is split into
+// WNBD_LATENCY_SUB_BUCKET_COUNT linear buckets. This keeps the relative
+// error below 1 / WNBD_LATENCY_SUB_BUCKET_COUNT.
+#define WNBD_LATENCY_SUB_BUCKET_BITS 3
+#define WNBD_LATENCY_SUB_BUCKET_COUNT (1 << WNBD_LATENCY_SUB_BUCKET_BITS)
+// Latencies above 2^32 microseconds (about 71 minutes) are recorded
+// in the last bucket.
+#define WNBD_LATENCY_MAX_BITS 32
+#define WNBD_LATENCY_BUCKET_COUNT \
+    ((WNBD_LATENCY_MAX_BITS - WNBD_LATENCY_SUB_BUCKET_BITS + 1) * \
+     WNBD_LATENCY_SUB_BUCKET_COUNT)
+// One histogram per WnbdRequestType.
+#define WNBD_LATENCY_REQ_TYPE_COUNT 8
+
+typedef struct
+{
+    // The sum of the recorded latencies, in microseconds.
+    UINT64 TotalUs;
+    UINT64 Buckets[WNBD_LATENCY_BUCKET_COUNT];
+} WNBD_LATENCY_HISTOGRAM, *PWNBD_LATENCY_HISTOGRAM;
+WNBD_ASSERT_SZ_EQ(WNBD_LATENCY_HISTOGRAM, 1928);
+
+typedef struct
+{
+    // The time elapsed between the moment in which a request is fetched
+    // by the userspace dispatcher and the moment in which the driver
+    // receives the response, indexed by WnbdRequestType.
+    WNBD_LATENCY_HISTOGRAM Histograms[WNBD_LATENCY_REQ_TYPE_COUNT];
+    BYTE Reserved[64];
+} WNBD_LATENCY_STATS, *PWNBD_LATENCY_STATS;
+WNBD_ASSERT_SZ_EQ(WNBD_LATENCY_STATS, 15488);
+
+static inline UINT32 WnbdLatencyBucketIndex(UINT64 LatencyUs)
+{
+    ULONG Msb = 0;
+    UINT32 Shift = 0;
+
+    if (LatencyUs < WNBD_LATENCY_SUB_BUCKET_COUNT) {
+        return (UINT32) LatencyUs;
+    }
+    if (LatencyUs >> WNBD_LATENCY_MAX_BITS) {
+        return WNBD_LATENCY_BUCKET_COUNT - 1;
+    }
+
+    BitScanReverse64(&Msb, LatencyUs);
+    Shift = Msb - WNBD_LATENCY_SUB_BUCKET_BITS;
+    return (Shift + 1) * WNBD_LATENCY_SUB_BUCKET_COUNT +
+        (UINT32) ((LatencyUs >> Shift) & (WNBD_LATENCY_SUB_BUCKET_COUNT - 1));
+}
+
+// The lowest latency (in microseconds) recorded by the specified bucket.
+static inline UINT64 WnbdLatencyBucketLowerBound(UINT32 Index)
+{
+    UINT32 Shift = 0;
+
+    if (Index < WNBD_LATENCY_SUB_BUCKET_COUNT) {
+        return Index;
+    }
+
+    Shift = Index / WNBD_LATENCY_SUB_BUCKET_COUNT - 1;
+    return (UINT64) (WNBD_LATENCY_SUB_BUCKET_COUNT +
+                     Index % WNBD_LATENCY_SUB_BUCKET_COUNT) << Shift;
+}
+
 typedef struct
 {
     UINT64 BlockAddress;
@@ -389,6 +515,23 @@ typedef struct
 } WNBD_IOCTL_STATS_COMMAND, *PWNBD_IOCTL_STATS_COMMAND;
 WNBD_ASSERT_SZ_EQ(WNBD_IOCTL_STATS_COMMAND, 292);
 
+typedef struct
+{
+    ULONG IoControlCode;
+    CHAR InstanceName[WNBD_MAX_NAME_LENGTH];
+    BYTE Reserved[32];
+} WNBD_IOCTL_LATENCY_STATS_COMMAND, *PWNBD_IOCTL_LATENCY_STATS_COMMAND;
+WNBD_ASSERT_SZ_EQ(WNBD_IOCTL_LATENCY_STATS_COMMAND, 292);
+
+typedef struct
+{
+    ULONG IoControlCode;
+    CHAR InstanceName[WNBD_MAX_NAME_LENGTH];
+    WNBD_QOS_LIMITS Limits;
+    BYTE Reserved[32];
+} WNBD_IOCTL_SET_QOS_LIMITS_COMMAND, *PWNBD_IOCTL_SET_QOS_LIMITS_COMMAND;
+WNBD_ASSERT_SZ_EQ(WNBD_IOCTL_SET_QOS_LIMITS_COMMAND, 424);
+
 typedef struct
 {
     ULONG IoControlCode;
@@ -404,7 +547,17 @@ typedef struct
     WNBD_CONNECTION_ID ConnectionId;
     PVOID DataBuffer;
     UINT32 DataBufferSize;
-    BYTE Reserved[32];
+    // Fail with STATUS_IO_TIMEOUT if no request becomes available within
+    // the specified interval. 0 means no timeout.
+    UINT32 TimeoutMs;
+    // Fail with STATUS_IO_TIMEOUT right away if there are no pending
+    // requests, used for busy polling. Takes precedence over TimeoutMs.
+    BOOLEAN NoWait;
+    // Pend the IRP if there are no pending requests instead of blocking
+    // the calling thread, so that it can be completed through a
+    // completion port. The timeout is ignored, NoWait takes precedence.
+    BOOLEAN Pendable;
+    BYTE Reserved[26];
 } WNBD_IOCTL_FETCH_REQ_COMMAND, *PWNBD_IOCTL_FETCH_REQ_COMMAND;
 WNBD_ASSERT_SZ_EQ(WNBD_IOCTL_FETCH_REQ_COMMAND, 128);
 
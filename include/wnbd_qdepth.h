@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef WNBD_QDEPTH_H
+#define WNBD_QDEPTH_H
+
+// Adaptive queue depth controller, limiting the number of requests that
+// are in flight based on the observed completion latency, similar to
+// TCP Vegas.
+//
+// The completion latency is averaged over windows of roughly one
+// request per allowed slot. The lowest window averages provide the
+// no-load latency estimate, which allows estimating the number of
+// requests that are waiting in the server queues:
+//
+//     Queued = InFlight * (1 - MinLatency * Tolerance / Latency)
+//
+// The limit grows while the estimated queue is small, exponentially at
+// first, and decreases towards the estimated server capacity when the
+// queue grows. Requests with different sizes and the server load can
+// change the no-load latency, which is why it gets measured again
+// periodically by briefly lowering the limit below the estimated
+// capacity.
+//
+// Header only, depending solely on the basic integer types so that it
+// can be tested outside the driver. The callers are responsible for
+// locking.
+
+#define WNBD_QDEPTH_MIN_WINDOW 8
+#define WNBD_QDEPTH_MAX_WINDOW 128
+// The number of windows between no-load latency measurements.
+#define WNBD_QDEPTH_PROBE_INTERVAL 64
+// Latency increases below this percentage are considered noise.
+#define WNBD_QDEPTH_TOLERANCE_PCT 10
+
+typedef enum
+{
+    WnbdQdepthStateSlowStart,
+    WnbdQdepthStateAvoidance,
+    // Waiting for the in flight requests to drop below the probe limit.
+    WnbdQdepthStateProbeDrain,
+    // Measuring the no-load latency.
+    WnbdQdepthStateProbe,
+} WNBD_QDEPTH_STATE;
+
+typedef struct
+{
+    UINT32 MinLimit;
+    UINT32 MaxLimit;
+    UINT32 Limit;
+    UINT32 InFlight;
+    WNBD_QDEPTH_STATE State;
+
+    UINT32 WindowSamples;
+    UINT32 WindowMaxInFlight;
+    UINT64 WindowLatencySum;
+    // Completions that are ignored by the current window, used while
+    // probing in order to skip requests submitted before the limit
+    // was lowered.
+    UINT32 SkipSamples;
+
+    // The estimated no-load latency, in microseconds.
+    UINT64 MinLatencyUs;
+    UINT64 LastLatencyUs;
+    UINT32 WindowsSinceProbe;
+    // The limit to restore after probing.
+    UINT32 SavedLimit;
+} WNBD_QDEPTH_CONTROLLER, *PWNBD_QDEPTH_CONTROLLER;
+
+// The limit starts at "MinLimit", MaxLimit must be at least as large.
+static inline void WnbdQdepthInitialize(
+    PWNBD_QDEPTH_CONTROLLER Ctrl,
+    UINT32 MinLimit,
+    UINT32 MaxLimit)
+{
+    memset(Ctrl, 0, sizeof(WNBD_QDEPTH_CONTROLLER));
+    Ctrl->MinLimit = MinLimit ? MinLimit : 1;
+    Ctrl->MaxLimit = MaxLimit > Ctrl->MinLimit ? MaxLimit : Ctrl->MinLimit;
+    Ctrl->Limit = Ctrl->MinLimit;
+    Ctrl->State = WnbdQdepthStateSlowStart;
+}
+
+static inline BOOLEAN WnbdQdepthCanSubmit(PWNBD_QDEPTH_CONTROLLER Ctrl)
+{
+    return Ctrl->InFlight < Ctrl->Limit;
+}
+
+// The limit is enforced by the callers, which may go slightly over it
+// when submitting requests concurrently.
+static inline void WnbdQdepthSubmit(PWNBD_QDEPTH_CONTROLLER Ctrl)
+{
+    Ctrl->InFlight++;
+    if (Ctrl->InFlight > Ctrl->WindowMaxInFlight) {
+        Ctrl->WindowMaxInFlight = Ctrl->InFlight;
+    }
+}
+
+// max(1, floor(log10(Value)))
+static inline UINT32 WnbdQdepthLog10(UINT32 Value)
+{
+    UINT32 Log = 0;
+    while (Value >= 10) {
+        Value /= 10;
+        Log++;
+    }
+    return Log ? Log : 1;
+}
+
+static inline UINT32 WnbdQdepthClampLimit(
+    PWNBD_QDEPTH_CONTROLLER Ctrl,
+    UINT64 Limit)
+{
+    if (Limit < Ctrl->MinLimit) {
+        return Ctrl->MinLimit;
+    }
+    if (Limit > Ctrl->MaxLimit) {
+        return Ctrl->MaxLimit;
+    }
+    return (UINT32) Limit;
+}
+
+static inline void WnbdQdepthResetWindow(PWNBD_QDEPTH_CONTROLLER Ctrl)
+{
+    Ctrl->WindowSamples = 0;
+    Ctrl->WindowLatencySum = 0;
+    Ctrl->WindowMaxInFlight = Ctrl->InFlight;
+}
+
+static inline UINT32 WnbdQdepthWindowSize(PWNBD_QDEPTH_CONTROLLER Ctrl)
+{
+    if (Ctrl->Limit < WNBD_QDEPTH_MIN_WINDOW) {
+        return WNBD_QDEPTH_MIN_WINDOW;
+    }
+    if (Ctrl->Limit > WNBD_QDEPTH_MAX_WINDOW) {
+        return WNBD_QDEPTH_MAX_WINDOW;
+    }
+    return Ctrl->Limit;
+}
+
+static inline void WnbdQdepthUpdateLimit(
+    PWNBD_QDEPTH_CONTROLLER Ctrl,
+    UINT64 LatencyUs)
+{
+    UINT64 MaxInFlight = Ctrl->WindowMaxInFlight;
+    UINT64 Capacity = 0;
+    UINT64 Queued = 0;
+    UINT64 Target = 0;
+    UINT64 Decrease = 0;
+    UINT32 Log = WnbdQdepthLog10(Ctrl->Limit);
+    UINT32 Alpha = 3 * Log;
+    UINT32 Beta = 6 * Log;
+    // Don't grow the limit unless it's actually being used.
+    BOOLEAN Saturated = MaxInFlight * 2 >= Ctrl->Limit;
+
+    // Lower window averages are partially taken into account, which
+    // avoids being too sensitive to outliers.
+    if (!Ctrl->MinLatencyUs) {
+        Ctrl->MinLatencyUs = LatencyUs;
+    } else if (LatencyUs < Ctrl->MinLatencyUs) {
+        Ctrl->MinLatencyUs -= (Ctrl->MinLatencyUs - LatencyUs + 3) / 4;
+    }
+
+    Capacity = MaxInFlight * Ctrl->MinLatencyUs *
+        (100 + WNBD_QDEPTH_TOLERANCE_PCT) / 100 / LatencyUs;
+    if (Capacity > MaxInFlight) {
+        Capacity = MaxInFlight;
+    }
+    Queued = MaxInFlight - Capacity;
+
+    if (Queued <= Log) {
+        if (!Saturated) {
+            return;
+        }
+        if (Ctrl->State == WnbdQdepthStateSlowStart) {
+            Ctrl->Limit = WnbdQdepthClampLimit(Ctrl, (UINT64) Ctrl->Limit * 2);
+        } else {
+            Ctrl->Limit = WnbdQdepthClampLimit(Ctrl, (UINT64) Ctrl->Limit + Beta);
+        }
+        return;
+    }
+
+    Ctrl->State = WnbdQdepthStateAvoidance;
+    if (Queued < Alpha) {
+        if (Saturated) {
+            Ctrl->Limit = WnbdQdepthClampLimit(Ctrl, (UINT64) Ctrl->Limit + Log);
+        }
+    } else if (Queued > Beta) {
+        // Move halfway towards the estimated capacity.
+        Target = Capacity + Alpha;
+        Decrease = Log;
+        if (Ctrl->Limit > Target && (Ctrl->Limit - Target) / 2 > Decrease) {
+            Decrease = (Ctrl->Limit - Target) / 2;
+        }
+        Ctrl->Limit = WnbdQdepthClampLimit(
+            Ctrl, Ctrl->Limit > Decrease ? Ctrl->Limit - Decrease : 0);
+    }
+}
+
+static inline void WnbdQdepthStartProbe(PWNBD_QDEPTH_CONTROLLER Ctrl)
+{
+    UINT64 Capacity = Ctrl->WindowMaxInFlight;
+
+    if (Ctrl->LastLatencyUs) {
+        Capacity = Capacity * Ctrl->MinLatencyUs / Ctrl->LastLatencyUs;
+    }
+
+    Ctrl->SavedLimit = Ctrl->Limit;
+    Ctrl->Limit = WnbdQdepthClampLimit(Ctrl, Capacity / 2);
+    Ctrl->State = WnbdQdepthStateProbeDrain;
+}
+
+// Records the completion of a request, using a latency of 0 for requests
+// that didn't complete normally (e.g. aborted requests without a reply),
+// in which case the latency isn't taken into account.
+static inline void WnbdQdepthComplete(
+    PWNBD_QDEPTH_CONTROLLER Ctrl,
+    UINT64 LatencyUs)
+{
+    UINT64 WindowLatencyUs = 0;
+
+    if (Ctrl->InFlight) {
+        Ctrl->InFlight--;
+    }
+    if (!LatencyUs) {
+        return;
+    }
+
+    if (Ctrl->State == WnbdQdepthStateProbeDrain) {
+        if (Ctrl->InFlight > Ctrl->Limit) {
+            return;
+        }
+        // The remaining requests were submitted before lowering the limit.
+        Ctrl->State = WnbdQdepthStateProbe;
+        Ctrl->SkipSamples = Ctrl->InFlight;
+        WnbdQdepthResetWindow(Ctrl);
+        return;
+    }
+    if (Ctrl->SkipSamples) {
+        Ctrl->SkipSamples--;
+        return;
+    }
+
+    Ctrl->WindowSamples++;
+    Ctrl->WindowLatencySum += LatencyUs;
+    if (Ctrl->WindowSamples < WnbdQdepthWindowSize(Ctrl)) {
+        return;
+    }
+
+    WindowLatencyUs = Ctrl->WindowLatencySum / Ctrl->WindowSamples;
+    if (!WindowLatencyUs) {
+        WindowLatencyUs = 1;
+    }
+
+    if (Ctrl->State == WnbdQdepthStateProbe) {
+        Ctrl->MinLatencyUs = WindowLatencyUs;
+        Ctrl->Limit = Ctrl->SavedLimit;
+        Ctrl->State = WnbdQdepthStateAvoidance;
+        Ctrl->WindowsSinceProbe = 0;
+    } else {
+        WnbdQdepthUpdateLimit(Ctrl, WindowLatencyUs);
+        Ctrl->LastLatencyUs = WindowLatencyUs;
+        if (++Ctrl->WindowsSinceProbe >= WNBD_QDEPTH_PROBE_INTERVAL) {
+            WnbdQdepthStartProbe(Ctrl);
+        }
+    }
+
+    WnbdQdepthResetWindow(Ctrl);
+}
+
+#endif // WNBD_QDEPTH_H
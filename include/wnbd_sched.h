@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#ifndef WNBD_SCHED_H
+#define WNBD_SCHED_H
+
+// Priority aware request queue, used by the driver for the requests that
+// weren't fetched by userspace yet. Each request class gets its own FIFO
+// queue, the queues being served using weighted deficit round robin
+// (DRR). Under contention, the classes get a share of the dispatched
+// bytes that is proportional to their weight, while a single backlogged
+// class may use the whole bandwidth.
+//
+// Header only, depending solely on the basic integer types so that it
+// can be tested outside the driver. The callers are responsible for
+// locking.
+
+// Flushes, FUA and small reads or writes, persistent reservations.
+#define WNBD_SCHED_CLASS_LATENCY 0
+// Large reads and writes, unmap requests.
+#define WNBD_SCHED_CLASS_BULK 1
+#define WNBD_SCHED_CLASS_COUNT 2
+
+// Added to the payload size when computing the request cost, so that
+// requests without payload aren't free.
+#define WNBD_SCHED_REQUEST_COST 4096
+// The number of bytes that a queue may dispatch in one round, for each
+// weight unit.
+#define WNBD_SCHED_QUANTUM (128 * 1024)
+
+// Embedded in the queued requests.
+typedef struct _WNBD_SCHED_ENTRY
+{
+    struct _WNBD_SCHED_ENTRY* Next;
+    UINT32 Class;
+    UINT32 Cost;
+} WNBD_SCHED_ENTRY, *PWNBD_SCHED_ENTRY;
+
+typedef struct
+{
+    PWNBD_SCHED_ENTRY Head;
+    PWNBD_SCHED_ENTRY Tail;
+    UINT64 Count;
+    UINT64 Quantum;
+    // The number of bytes that may still be dispatched in the current
+    // round, reset when the queue becomes empty.
+    UINT64 Deficit;
+} WNBD_SCHED_QUEUE, *PWNBD_SCHED_QUEUE;
+
+typedef struct
+{
+    WNBD_SCHED_QUEUE Queues[WNBD_SCHED_CLASS_COUNT];
+    // The queue that is currently being served.
+    UINT32 Current;
+    // Set once the current queue received its quantum for this round.
+    BOOLEAN QuantumGranted;
+    UINT64 Count;
+} WNBD_SCHEDULER, *PWNBD_SCHEDULER;
+
+// Weights are indexed by request class, 0 is treated as 1.
+static inline void WnbdSchedInitialize(
+    PWNBD_SCHEDULER Sched,
+    const UINT32* Weights)
+{
+    UINT32 Class = 0;
+
+    memset(Sched, 0, sizeof(WNBD_SCHEDULER));
+    for (Class = 0; Class < WNBD_SCHED_CLASS_COUNT; Class++) {
+        Sched->Queues[Class].Quantum = (UINT64) (
+            Weights[Class] ? Weights[Class] : 1) * WNBD_SCHED_QUANTUM;
+    }
+}
+
+static inline BOOLEAN WnbdSchedIsEmpty(PWNBD_SCHEDULER Sched)
+{
+    return !Sched->Count;
+}
+
+// Invalid classes are treated as bulk.
+static inline void WnbdSchedInsertTail(
+    PWNBD_SCHEDULER Sched,
+    PWNBD_SCHED_ENTRY Entry,
+    UINT32 Class,
+    UINT32 PayloadSize)
+{
+    PWNBD_SCHED_QUEUE Queue = NULL;
+
+    if (Class >= WNBD_SCHED_CLASS_COUNT) {
+        Class = WNBD_SCHED_CLASS_BULK;
+    }
+    Queue = &Sched->Queues[Class];
+
+    Entry->Next = NULL;
+    Entry->Class = Class;
+    Entry->Cost = PayloadSize + WNBD_SCHED_REQUEST_COST;
+    if (Entry->Cost < PayloadSize) {
+        Entry->Cost = 0xffffffff;
+    }
+
+    if (Queue->Tail) {
+        Queue->Tail->Next = Entry;
+    } else {
+        Queue->Head = Entry;
+    }
+    Queue->Tail = Entry;
+    Queue->Count++;
+    Sched->Count++;
+}
+
+// Puts back a request that was retrieved using WnbdSchedRemoveNext but
+// couldn't be dispatched, refunding its cost.
+static inline void WnbdSchedInsertHead(
+    PWNBD_SCHEDULER Sched,
+    PWNBD_SCHED_ENTRY Entry)
+{
+    PWNBD_SCHED_QUEUE Queue = &Sched->Queues[Entry->Class];
+
+    Entry->Next = Queue->Head;
+    Queue->Head = Entry;
+    if (!Queue->Tail) {
+        Queue->Tail = Entry;
+    }
+    Queue->Deficit += Entry->Cost;
+    Queue->Count++;
+    Sched->Count++;
+}
+
+static inline void WnbdSchedNextQueue(PWNBD_SCHEDULER Sched)
+{
+    Sched->Current = (Sched->Current + 1) % WNBD_SCHED_CLASS_COUNT;
+    Sched->QuantumGranted = FALSE;
+}
+
+// Returns NULL if there are no queued requests.
+static inline PWNBD_SCHED_ENTRY WnbdSchedRemoveNext(PWNBD_SCHEDULER Sched)
+{
+    PWNBD_SCHED_QUEUE Queue = NULL;
+    PWNBD_SCHED_ENTRY Entry = NULL;
+
+    if (!Sched->Count) {
+        return NULL;
+    }
+
+    // Each round increases the deficit of the non-empty queues, so this
+    // takes at most (maximum cost / quantum + 1) rounds.
+    for (;;) {
+        Queue = &Sched->Queues[Sched->Current];
+        Entry = Queue->Head;
+        if (!Entry) {
+            Queue->Deficit = 0;
+            WnbdSchedNextQueue(Sched);
+            continue;
+        }
+
+        if (!Sched->QuantumGranted) {
+            Queue->Deficit += Queue->Quantum;
+            Sched->QuantumGranted = TRUE;
+        }
+        if (Entry->Cost > Queue->Deficit) {
+            WnbdSchedNextQueue(Sched);
+            continue;
+        }
+
+        Queue->Deficit -= Entry->Cost;
+        Queue->Head = Entry->Next;
+        Queue->Count--;
+        Sched->Count--;
+        if (!Queue->Head) {
+            Queue->Tail = NULL;
+            Queue->Deficit = 0;
+            WnbdSchedNextQueue(Sched);
+        }
+
+        Entry->Next = NULL;
+        return Entry;
+    }
+}
+
+#endif // WNBD_SCHED_H
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "aes_xts.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+#include <intrin.h>
+#include <immintrin.h>
+
+// The number of blocks processed at a time, enough to keep the AES
+// units busy while waiting for the previous rounds.
+#define XTS_PARALLEL_BLOCKS 8
+
+static __m128i ExpandKeyStep(__m128i Key, __m128i Assist)
+{
+    Key = _mm_xor_si128(Key, _mm_slli_si128(Key, 4));
+    Key = _mm_xor_si128(Key, _mm_slli_si128(Key, 4));
+    Key = _mm_xor_si128(Key, _mm_slli_si128(Key, 4));
+    return _mm_xor_si128(Key, Assist);
+}
+
+// _mm_aeskeygenassist_si128 expects the round constant to be an
+// immediate value.
+#define EXPAND_KEY_128(Keys, Index, Rcon) \
+    Keys[Index] = ExpandKeyStep( \
+        Keys[Index - 1], \
+        _mm_shuffle_epi32( \
+            _mm_aeskeygenassist_si128(Keys[Index - 1], Rcon), 0xff))
+
+#define EXPAND_KEY_256(Keys, Index, Rcon) \
+    Keys[Index] = ExpandKeyStep( \
+        Keys[Index - 2], \
+        _mm_shuffle_epi32( \
+            _mm_aeskeygenassist_si128(Keys[Index - 1], Rcon), 0xff)); \
+    Keys[Index + 1] = ExpandKeyStep( \
+        Keys[Index - 1], \
+        _mm_shuffle_epi32( \
+            _mm_aeskeygenassist_si128(Keys[Index], 0x00), 0xaa))
+
+static void ExpandKey128(const BYTE* Key, __m128i* Keys)
+{
+    Keys[0] = _mm_loadu_si128((const __m128i*) Key);
+    EXPAND_KEY_128(Keys, 1, 0x01);
+    EXPAND_KEY_128(Keys, 2, 0x02);
+    EXPAND_KEY_128(Keys, 3, 0x04);
+    EXPAND_KEY_128(Keys, 4, 0x08);
+    EXPAND_KEY_128(Keys, 5, 0x10);
+    EXPAND_KEY_128(Keys, 6, 0x20);
+    EXPAND_KEY_128(Keys, 7, 0x40);
+    EXPAND_KEY_128(Keys, 8, 0x80);
+    EXPAND_KEY_128(Keys, 9, 0x1b);
+    EXPAND_KEY_128(Keys, 10, 0x36);
+}
+
+static void ExpandKey256(const BYTE* Key, __m128i* Keys)
+{
+    Keys[0] = _mm_loadu_si128((const __m128i*) Key);
+    Keys[1] = _mm_loadu_si128((const __m128i*) (Key + AES_BLOCK_SIZE));
+    EXPAND_KEY_256(Keys, 2, 0x01);
+    EXPAND_KEY_256(Keys, 4, 0x02);
+    EXPAND_KEY_256(Keys, 6, 0x04);
+    EXPAND_KEY_256(Keys, 8, 0x08);
+    EXPAND_KEY_256(Keys, 10, 0x10);
+    EXPAND_KEY_256(Keys, 12, 0x20);
+    Keys[14] = ExpandKeyStep(
+        Keys[12],
+        _mm_shuffle_epi32(_mm_aeskeygenassist_si128(Keys[13], 0x40), 0xff));
+}
+
+template <bool Encrypt>
+static __m128i AesRound(__m128i Block, __m128i Key)
+{
+    if constexpr (Encrypt) {
+        return _mm_aesenc_si128(Block, Key);
+    } else {
+        return _mm_aesdec_si128(Block, Key);
+    }
+}
+
+template <bool Encrypt>
+static __m128i AesLastRound(__m128i Block, __m128i Key)
+{
+    if constexpr (Encrypt) {
+        return _mm_aesenclast_si128(Block, Key);
+    } else {
+        return _mm_aesdeclast_si128(Block, Key);
+    }
+}
+
+template <bool Encrypt>
+static __m256i AesRoundVaes(__m256i Blocks, __m256i Key)
+{
+    if constexpr (Encrypt) {
+        return _mm256_aesenc_epi128(Blocks, Key);
+    } else {
+        return _mm256_aesdec_epi128(Blocks, Key);
+    }
+}
+
+template <bool Encrypt>
+static __m256i AesLastRoundVaes(__m256i Blocks, __m256i Key)
+{
+    if constexpr (Encrypt) {
+        return _mm256_aesenclast_epi128(Blocks, Key);
+    } else {
+        return _mm256_aesdeclast_epi128(Blocks, Key);
+    }
+}
+
+template <bool Encrypt>
+static __m128i CryptBlock(const __m128i* Keys, UINT32 Rounds, __m128i Block)
+{
+    Block = _mm_xor_si128(Block, Keys[0]);
+    for (UINT32 Round = 1; Round < Rounds; Round++) {
+        Block = AesRound<Encrypt>(Block, Keys[Round]);
+    }
+    return AesLastRound<Encrypt>(Block, Keys[Rounds]);
+}
+
+// Multiplies the tweak by x (alpha) in GF(2^128), using the
+// x^128 + x^7 + x^2 + x + 1 polynomial. The tweak is little endian.
+static __m128i NextTweak(__m128i Tweak)
+{
+    // Sign extends bit 127 into the low dword and bit 63 into the
+    // third dword, selecting the reduction and the qword carry.
+    const __m128i Poly = _mm_set_epi64x(1, 0x87);
+    __m128i Carry = _mm_srai_epi32(_mm_shuffle_epi32(Tweak, 0x13), 31);
+    Carry = _mm_and_si128(Carry, Poly);
+    return _mm_xor_si128(_mm_add_epi64(Tweak, Tweak), Carry);
+}
+
+template <bool Encrypt>
+static void CryptBlocks(
+    const __m128i* Keys, UINT32 Rounds, PBYTE Data, const __m128i* Tweaks)
+{
+    __m128i* Blocks = (__m128i*) Data;
+    __m128i State[XTS_PARALLEL_BLOCKS];
+    for (int Index = 0; Index < XTS_PARALLEL_BLOCKS; Index++) {
+        State[Index] = _mm_xor_si128(
+            _mm_xor_si128(_mm_loadu_si128(Blocks + Index), Tweaks[Index]),
+            Keys[0]);
+    }
+    // The independent blocks are interleaved, hiding the
+    // AES instruction latency.
+    for (UINT32 Round = 1; Round < Rounds; Round++) {
+        __m128i Key = Keys[Round];
+        for (int Index = 0; Index < XTS_PARALLEL_BLOCKS; Index++) {
+            State[Index] = AesRound<Encrypt>(State[Index], Key);
+        }
+    }
+    for (int Index = 0; Index < XTS_PARALLEL_BLOCKS; Index++) {
+        State[Index] = AesLastRound<Encrypt>(State[Index], Keys[Rounds]);
+        _mm_storeu_si128(
+            Blocks + Index, _mm_xor_si128(State[Index], Tweaks[Index]));
+    }
+}
+
+template <bool Encrypt>
+static void CryptBlocksVaes(
+    const __m128i* Keys, UINT32 Rounds, PBYTE Data, const __m128i* Tweaks)
+{
+    const int Count = XTS_PARALLEL_BLOCKS / 2;
+    __m256i* Blocks = (__m256i*) Data;
+    __m256i BlockTweaks[Count];
+    __m256i State[Count];
+    __m256i Key = _mm256_broadcastsi128_si256(Keys[0]);
+    for (int Index = 0; Index < Count; Index++) {
+        BlockTweaks[Index] = _mm256_set_m128i(
+            Tweaks[Index * 2 + 1], Tweaks[Index * 2]);
+        State[Index] = _mm256_xor_si256(
+            _mm256_xor_si256(
+                _mm256_loadu_si256(Blocks + Index), BlockTweaks[Index]),
+            Key);
+    }
+    for (UINT32 Round = 1; Round < Rounds; Round++) {
+        Key = _mm256_broadcastsi128_si256(Keys[Round]);
+        for (int Index = 0; Index < Count; Index++) {
+            State[Index] = AesRoundVaes<Encrypt>(State[Index], Key);
+        }
+    }
+    Key = _mm256_broadcastsi128_si256(Keys[Rounds]);
+    for (int Index = 0; Index < Count; Index++) {
+        State[Index] = AesLastRoundVaes<Encrypt>(State[Index], Key);
+        _mm256_storeu_si256(
+            Blocks + Index,
+            _mm256_xor_si256(State[Index], BlockTweaks[Index]));
+    }
+}
+
+static bool IsVaesSupported()
+{
+    if (!IsAvx2Supported()) {
+        return false;
+    }
+    int CpuInfo[4] = { 0 };
+    __cpuidex(CpuInfo, 7, 0);
+    return CpuInfo[2] & (1 << 9);
+}
+
+AesXts::~AesXts()
+{
+    SecureZeroMemory(EncryptKeys, sizeof(EncryptKeys));
+    SecureZeroMemory(DecryptKeys, sizeof(DecryptKeys));
+    SecureZeroMemory(TweakKeys, sizeof(TweakKeys));
+}
+
+bool AesXts::IsSupported()
+{
+    int CpuInfo[4] = { 0 };
+    __cpuid(CpuInfo, 1);
+    return CpuInfo[2] & (1 << 25);
+}
+
+DWORD AesXts::SetKey(const BYTE* Key, UINT32 KeySize)
+{
+    if (KeySize != 32 && KeySize != 64) {
+        LogError("Invalid AES-XTS key size: %d. "
+                 "Expecting 32 or 64 bytes.", KeySize);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (!IsSupported()) {
+        LogError("AES-XTS encryption requires a processor "
+                 "that supports AES-NI.");
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    UINT32 HalfSize = KeySize / 2;
+    if (!memcmp(Key, Key + HalfSize, HalfSize)) {
+        LogWarning("The AES-XTS data and tweak keys are identical.");
+    }
+
+    if (KeySize == 32) {
+        Rounds = 10;
+        ExpandKey128(Key, EncryptKeys);
+        ExpandKey128(Key + HalfSize, TweakKeys);
+    } else {
+        Rounds = 14;
+        ExpandKey256(Key, EncryptKeys);
+        ExpandKey256(Key + HalfSize, TweakKeys);
+    }
+
+    // Equivalent inverse cipher key schedule, used by AESDEC.
+    DecryptKeys[0] = EncryptKeys[Rounds];
+    for (UINT32 Round = 1; Round < Rounds; Round++) {
+        DecryptKeys[Round] = _mm_aesimc_si128(EncryptKeys[Rounds - Round]);
+    }
+    DecryptKeys[Rounds] = EncryptKeys[0];
+
+    UseVaes = IsVaesSupported();
+    LogDebug("Using AES-%d-XTS. VAES: %d.", KeySize * 4, UseVaes);
+    return 0;
+}
+
+template <bool Encrypt>
+void AesXts::ProcessDataUnits(
+    PBYTE Data, UINT32 DataUnitSize, UINT32 DataUnitCount, UINT64 DataUnit)
+{
+    const __m128i* Keys = Encrypt ? EncryptKeys : DecryptKeys;
+    const UINT32 ChunkSize = XTS_PARALLEL_BLOCKS * AES_BLOCK_SIZE;
+
+    for (UINT32 Unit = 0; Unit < DataUnitCount; Unit++, DataUnit++) {
+        // The tweak is the encrypted data unit number, even when
+        // decrypting.
+        __m128i Tweak = CryptBlock<true>(
+            TweakKeys, Rounds, _mm_set_epi64x(0, (INT64) DataUnit));
+
+        PBYTE End = Data + DataUnitSize;
+        for (; Data + ChunkSize <= End; Data += ChunkSize) {
+            __m128i Tweaks[XTS_PARALLEL_BLOCKS];
+            Tweaks[0] = Tweak;
+            for (int Index = 1; Index < XTS_PARALLEL_BLOCKS; Index++) {
+                Tweaks[Index] = NextTweak(Tweaks[Index - 1]);
+            }
+            Tweak = NextTweak(Tweaks[XTS_PARALLEL_BLOCKS - 1]);
+
+            if (UseVaes) {
+                CryptBlocksVaes<Encrypt>(Keys, Rounds, Data, Tweaks);
+            } else {
+                CryptBlocks<Encrypt>(Keys, Rounds, Data, Tweaks);
+            }
+        }
+        for (; Data < End; Data += AES_BLOCK_SIZE) {
+            __m128i Block = _mm_xor_si128(
+                _mm_loadu_si128((const __m128i*) Data), Tweak);
+            Block = CryptBlock<Encrypt>(Keys, Rounds, Block);
+            _mm_storeu_si128((__m128i*) Data, _mm_xor_si128(Block, Tweak));
+            Tweak = NextTweak(Tweak);
+        }
+    }
+
+    if (UseVaes) {
+        // Avoid AVX-SSE transition penalties in the caller.
+        _mm256_zeroupper();
+    }
+}
+
+void AesXts::Encrypt(
+    PVOID Data, UINT32 DataUnitSize, UINT32 DataUnitCount, UINT64 DataUnit)
+{
+    ProcessDataUnits<true>(
+        (PBYTE) Data, DataUnitSize, DataUnitCount, DataUnit);
+}
+
+void AesXts::Decrypt(
+    PVOID Data, UINT32 DataUnitSize, UINT32 DataUnitCount, UINT64 DataUnit)
+{
+    ProcessDataUnits<false>(
+        (PBYTE) Data, DataUnitSize, DataUnitCount, DataUnit);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <wmmintrin.h>
+
+#define AES_BLOCK_SIZE 16
+#define AES_MAX_ROUNDS 14
+
+// AES-XTS (IEEE 1619) using AES-NI, processing 8 blocks at a time so
+// that the AES round latency is hidden. VAES is used when available,
+// handling two blocks per instruction.
+//
+// The data is processed in place, one data unit (sector) at a time,
+// the data unit number being used as tweak. Data units must be a
+// multiple of the AES block size, so ciphertext stealing isn't needed.
+class AesXts
+{
+private:
+    __m128i EncryptKeys[AES_MAX_ROUNDS + 1];
+    __m128i DecryptKeys[AES_MAX_ROUNDS + 1];
+    __m128i TweakKeys[AES_MAX_ROUNDS + 1];
+    UINT32 Rounds = 0;
+    bool UseVaes = false;
+
+    template <bool Encrypt>
+    void ProcessDataUnits(
+        PBYTE Data, UINT32 DataUnitSize, UINT32 DataUnitCount,
+        UINT64 DataUnit);
+
+public:
+    ~AesXts();
+
+    static bool IsSupported();
+
+    // The key is the concatenation of the data key and the tweak key,
+    // 32 bytes for AES-128-XTS or 64 bytes for AES-256-XTS.
+    DWORD SetKey(const BYTE* Key, UINT32 KeySize);
+
+    void Encrypt(
+        PVOID Data, UINT32 DataUnitSize, UINT32 DataUnitCount,
+        UINT64 DataUnit);
+    void Decrypt(
+        PVOID Data, UINT32 DataUnitSize, UINT32 DataUnitCount,
+        UINT64 DataUnit);
+};
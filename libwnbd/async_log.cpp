@@ -0,0 +1,716 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "async_log.h"
+#include "wnbd_log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <ctype.h>
+#include <string.h>
+
+#define ASYNC_LOG_MAX_ARGS 16
+#define ASYNC_LOG_MAX_SPEC_LENGTH 32
+#define ASYNC_LOG_STRING_DATA_SIZE 320
+#define ASYNC_LOG_MIN_RING_SIZE 16
+#define ASYNC_LOG_MAX_RING_SIZE 65536
+
+// Captured printf argument. The type is inferred from the conversion
+// specification, which is parsed again when formatting the message.
+union AsyncLogArg
+{
+    INT64 Int;
+    UINT64 UInt;
+    double Float;
+    const void* Ptr;
+};
+
+// Binary log record. The message gets formatted by the log thread using
+// the arguments captured when emitting the message. String arguments are
+// copied since they may not outlive the log call.
+struct AsyncLogRecord
+{
+    // System time (UTC), as returned by GetSystemTimePreciseAsFileTime.
+    UINT64 Timestamp;
+    WnbdLogLevel LogLevel;
+    UINT32 Line;
+    const char* FileName;
+    const char* FunctionName;
+    const char* Format;
+    AsyncLogArg Args[ASYNC_LOG_MAX_ARGS];
+    char StringData[ASYNC_LOG_STRING_DATA_SIZE];
+};
+
+// Single producer, single consumer record ring. Each thread that emits
+// log messages gets its own ring, the log thread being the only consumer.
+class AsyncLogRing
+{
+private:
+    std::vector<AsyncLogRecord> Records;
+    UINT64 Mask;
+    alignas(64) std::atomic<UINT64> Head = 0;
+    alignas(64) std::atomic<UINT64> Tail = 0;
+
+public:
+    // Set when the owning thread exits, the ring is released once drained.
+    std::atomic<bool> Orphaned = false;
+
+    AsyncLogRing(UINT32 Size)
+        : Records(Size)
+        , Mask(Size - 1)
+    {}
+
+    UINT32 GetSize() { return (UINT32) Mask + 1; }
+
+    // Producer side, returns NULL if the ring is full.
+    AsyncLogRecord* Reserve()
+    {
+        UINT64 CurrHead = Head.load(std::memory_order_relaxed);
+        if (CurrHead - Tail.load(std::memory_order_acquire) > Mask) {
+            return nullptr;
+        }
+        return &Records[CurrHead & Mask];
+    }
+    // Publishes the reserved record, returning the number of queued records.
+    UINT64 Commit()
+    {
+        UINT64 NewHead = Head.load(std::memory_order_relaxed) + 1;
+        Head.store(NewHead, std::memory_order_release);
+        return NewHead - Tail.load(std::memory_order_relaxed);
+    }
+
+    // Consumer side.
+    UINT64 GetHead() { return Head.load(std::memory_order_acquire); }
+    UINT64 GetTail() { return Tail.load(std::memory_order_relaxed); }
+    AsyncLogRecord* Get(UINT64 Index) { return &Records[Index & Mask]; }
+    void Release(UINT64 NewTail)
+    {
+        Tail.store(NewTail, std::memory_order_release);
+    }
+};
+
+struct ThreadLogRing
+{
+    std::shared_ptr<AsyncLogRing> Ring;
+
+    ~ThreadLogRing()
+    {
+        if (Ring) {
+            Ring->Orphaned = true;
+        }
+    }
+};
+
+static thread_local ThreadLogRing CurrThreadRing;
+// Set by the log thread while passing a record to the logger.
+static thread_local UINT64 CurrMessageTimestamp = 0;
+
+// Serializes WnbdEnableAsyncLogging and WnbdDisableAsyncLogging calls.
+static std::mutex AsyncLogLock;
+static HANDLE AsyncLogThread = NULL;
+// Never closed, producers may still be using it after logging gets disabled.
+static HANDLE AsyncLogEvent = NULL;
+static std::atomic<bool> AsyncLogEnabled = false;
+static std::atomic<bool> AsyncLogStopping = false;
+static UINT32 AsyncLogRingSize = WNBD_DEFAULT_ASYNC_LOG_RING_SIZE;
+static UINT32 AsyncLogFlushIntervalMs = WNBD_DEFAULT_ASYNC_LOG_FLUSH_INTERVAL_MS;
+static std::atomic<UINT64> AsyncLogDropCount = 0;
+
+static std::mutex RingsLock;
+static std::vector<std::shared_ptr<AsyncLogRing>> Rings;
+
+static AsyncLogRing* GetThreadRing()
+{
+    if (CurrThreadRing.Ring) {
+        return CurrThreadRing.Ring.get();
+    }
+
+    try {
+        auto Ring = std::make_shared<AsyncLogRing>(AsyncLogRingSize);
+        std::unique_lock Lock{RingsLock};
+        Rings.push_back(Ring);
+        CurrThreadRing.Ring = Ring;
+    }
+    catch (...) {
+        return nullptr;
+    }
+    return CurrThreadRing.Ring.get();
+}
+
+enum AsyncLogArgSize
+{
+    ArgSizeChar,
+    ArgSizeShort,
+    ArgSizeInt,
+    ArgSizeLong,
+    ArgSizeLongLong,
+    ArgSizePtr,
+    ArgSizeLongDouble,
+};
+
+// printf conversion specification, e.g. "%-*.8llx".
+struct AsyncLogConversion
+{
+    // Flags, width and precision, passed through as is.
+    const char* Flags;
+    size_t FlagsLength;
+    BOOLEAN WidthArg;
+    BOOLEAN PrecisionArg;
+    const char* Width;
+    size_t WidthLength;
+    BOOLEAN HasPrecision;
+    const char* Precision;
+    size_t PrecisionLength;
+    AsyncLogArgSize Size;
+    char Type;
+};
+
+// Parses the conversion specification that follows a "%" character,
+// returning the position after it or NULL for unsupported conversions
+// (e.g. wide strings or "%n").
+static const char* ParseConversion(
+    const char* Pos,
+    AsyncLogConversion* Conv)
+{
+    *Conv = { 0 };
+
+    Conv->Flags = Pos;
+    while (*Pos && strchr("-+ #0", *Pos)) {
+        Pos++;
+    }
+    Conv->FlagsLength = Pos - Conv->Flags;
+
+    if (*Pos == '*') {
+        Conv->WidthArg = TRUE;
+        Pos++;
+    } else {
+        Conv->Width = Pos;
+        while (isdigit((unsigned char) *Pos)) {
+            Pos++;
+        }
+        Conv->WidthLength = Pos - Conv->Width;
+    }
+
+    if (*Pos == '.') {
+        Conv->HasPrecision = TRUE;
+        Pos++;
+        if (*Pos == '*') {
+            Conv->PrecisionArg = TRUE;
+            Pos++;
+        } else {
+            Conv->Precision = Pos;
+            while (isdigit((unsigned char) *Pos)) {
+                Pos++;
+            }
+            Conv->PrecisionLength = Pos - Conv->Precision;
+        }
+    }
+
+    Conv->Size = ArgSizeInt;
+    if (!strncmp(Pos, "hh", 2)) {
+        Conv->Size = ArgSizeChar;
+        Pos += 2;
+    } else if (*Pos == 'h') {
+        Conv->Size = ArgSizeShort;
+        Pos++;
+    } else if (!strncmp(Pos, "ll", 2) || !strncmp(Pos, "I64", 3)) {
+        Conv->Size = ArgSizeLongLong;
+        Pos += *Pos == 'I' ? 3 : 2;
+    } else if (!strncmp(Pos, "I32", 3)) {
+        Pos += 3;
+    } else if (*Pos == 'l') {
+        Conv->Size = ArgSizeLong;
+        Pos++;
+    } else if (*Pos == 'j') {
+        Conv->Size = ArgSizeLongLong;
+        Pos++;
+    } else if (*Pos == 'z' || *Pos == 't' || *Pos == 'I') {
+        Conv->Size = ArgSizePtr;
+        Pos++;
+    } else if (*Pos == 'L') {
+        Conv->Size = ArgSizeLongDouble;
+        Pos++;
+    }
+
+    if (!*Pos || !strchr("diouxXeEfFgGaAcps", *Pos)) {
+        return NULL;
+    }
+    Conv->Type = *Pos;
+
+    if (strchr("eEfFgGaA", Conv->Type)) {
+        // "l" has no effect on floating point conversions.
+        if (Conv->Size != ArgSizeInt && Conv->Size != ArgSizeLong &&
+                Conv->Size != ArgSizeLongDouble) {
+            return NULL;
+        }
+    } else if (Conv->Size == ArgSizeLongDouble) {
+        return NULL;
+    }
+    // Wide characters and strings.
+    if (strchr("cps", Conv->Type) && Conv->Size != ArgSizeInt) {
+        return NULL;
+    }
+    // The conversion gets rebuilt using a small buffer.
+    if (Conv->FlagsLength + Conv->WidthLength +
+            Conv->PrecisionLength > ASYNC_LOG_MAX_SPEC_LENGTH) {
+        return NULL;
+    }
+    return Pos + 1;
+}
+
+// Copies the arguments consumed by the specified printf format string.
+// Returns FALSE for unsupported format strings (e.g. using wide strings
+// or too many arguments), which have to be formatted right away.
+static BOOLEAN CaptureArgs(
+    AsyncLogRecord* Record,
+    const char* Format,
+    va_list Args)
+{
+    UINT32 ArgCount = 0;
+    size_t StringOffset = 0;
+
+    for (const char* Pos = Format; *Pos; Pos++) {
+        if (*Pos != '%') {
+            continue;
+        }
+        if (Pos[1] == '%') {
+            Pos++;
+            continue;
+        }
+
+        AsyncLogConversion Conv;
+        const char* End = ParseConversion(Pos + 1, &Conv);
+        if (!End) {
+            return FALSE;
+        }
+        Pos = End - 1;
+
+        UINT32 NeededArgs = 1 + Conv.WidthArg + Conv.PrecisionArg;
+        if (ArgCount + NeededArgs > ASYNC_LOG_MAX_ARGS) {
+            return FALSE;
+        }
+        if (Conv.WidthArg) {
+            Record->Args[ArgCount++].Int = va_arg(Args, int);
+        }
+        if (Conv.PrecisionArg) {
+            Record->Args[ArgCount++].Int = va_arg(Args, int);
+        }
+
+        AsyncLogArg* Arg = &Record->Args[ArgCount++];
+        switch (Conv.Type) {
+        case 'd':
+        case 'i':
+            switch (Conv.Size) {
+            case ArgSizeChar:
+                Arg->Int = (signed char) va_arg(Args, int);
+                break;
+            case ArgSizeShort:
+                Arg->Int = (short) va_arg(Args, int);
+                break;
+            case ArgSizeLong:
+                Arg->Int = va_arg(Args, long);
+                break;
+            case ArgSizeLongLong:
+                Arg->Int = va_arg(Args, long long);
+                break;
+            case ArgSizePtr:
+                Arg->Int = va_arg(Args, INT_PTR);
+                break;
+            default:
+                Arg->Int = va_arg(Args, int);
+                break;
+            }
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            switch (Conv.Size) {
+            case ArgSizeChar:
+                Arg->UInt = (unsigned char) va_arg(Args, unsigned int);
+                break;
+            case ArgSizeShort:
+                Arg->UInt = (unsigned short) va_arg(Args, unsigned int);
+                break;
+            case ArgSizeLong:
+                Arg->UInt = va_arg(Args, unsigned long);
+                break;
+            case ArgSizeLongLong:
+                Arg->UInt = va_arg(Args, unsigned long long);
+                break;
+            case ArgSizePtr:
+                Arg->UInt = va_arg(Args, UINT_PTR);
+                break;
+            default:
+                Arg->UInt = va_arg(Args, unsigned int);
+                break;
+            }
+            break;
+        case 'c':
+            Arg->Int = va_arg(Args, int);
+            break;
+        case 'p':
+            Arg->Ptr = va_arg(Args, const void*);
+            break;
+        case 's':
+            Arg->Ptr = va_arg(Args, const char*);
+            if (Arg->Ptr) {
+                // Long strings are truncated.
+                size_t Available = sizeof(Record->StringData) - StringOffset;
+                if (!Available) {
+                    return FALSE;
+                }
+                char* Copy = Record->StringData + StringOffset;
+                strncpy_s(Copy, Available, (const char*) Arg->Ptr, _TRUNCATE);
+                StringOffset += strlen(Copy) + 1;
+                Arg->Ptr = Copy;
+            }
+            break;
+        default:
+            if (Conv.Size == ArgSizeLongDouble) {
+                Arg->Float = (double) va_arg(Args, long double);
+            } else {
+                Arg->Float = va_arg(Args, double);
+            }
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+BOOLEAN AsyncLogMessage(
+    WnbdLogLevel LogLevel,
+    const char* FileName,
+    UINT32 Line,
+    const char* FunctionName,
+    const char* Format,
+    va_list Args)
+{
+    if (!AsyncLogEnabled.load(std::memory_order_relaxed)) {
+        return FALSE;
+    }
+
+    AsyncLogRing* Ring = GetThreadRing();
+    if (!Ring) {
+        return FALSE;
+    }
+
+    AsyncLogRecord* Record = Ring->Reserve();
+    if (!Record) {
+        AsyncLogDropCount++;
+        return TRUE;
+    }
+
+    FILETIME Now;
+    GetSystemTimePreciseAsFileTime(&Now);
+    Record->Timestamp = ((UINT64) Now.dwHighDateTime << 32) |
+                        Now.dwLowDateTime;
+    Record->LogLevel = LogLevel;
+    Record->FileName = FileName;
+    Record->Line = Line;
+    Record->FunctionName = FunctionName;
+    Record->Format = Format;
+
+    va_list ArgsCopy;
+    va_copy(ArgsCopy, Args);
+    BOOLEAN Captured = CaptureArgs(Record, Format, ArgsCopy);
+    va_end(ArgsCopy);
+    if (!Captured) {
+        vsnprintf_s(Record->StringData, sizeof(Record->StringData),
+                    _TRUNCATE, Format, Args);
+        Record->Format = "%s";
+        Record->Args[0].Ptr = Record->StringData;
+    }
+
+    // Avoid waking up the log thread for every single message.
+    if (Ring->Commit() == Ring->GetSize() / 2) {
+        SetEvent(AsyncLogEvent);
+    }
+    return TRUE;
+}
+
+VOID GetLogMessageTime(PSYSTEMTIME Time)
+{
+    if (!CurrMessageTimestamp) {
+        GetLocalTime(Time);
+        return;
+    }
+
+    FILETIME Utc, Local;
+    Utc.dwLowDateTime = (DWORD) CurrMessageTimestamp;
+    Utc.dwHighDateTime = (DWORD) (CurrMessageTimestamp >> 32);
+    if (!FileTimeToLocalFileTime(&Utc, &Local) ||
+            !FileTimeToSystemTime(&Local, Time)) {
+        GetLocalTime(Time);
+    }
+}
+
+// Formats the record using the captured arguments. Each conversion is
+// passed to the CRT separately, along with its typed argument.
+static void FormatRecord(
+    AsyncLogRecord* Record,
+    char* Buffer,
+    size_t BufferSize)
+{
+    size_t Offset = 0;
+    UINT32 ArgIdx = 0;
+
+    for (const char* Pos = Record->Format;
+            *Pos && Offset + 1 < BufferSize; Pos++) {
+        if (*Pos != '%' || Pos[1] == '%') {
+            Pos += *Pos == '%';
+            Buffer[Offset++] = *Pos;
+            continue;
+        }
+
+        AsyncLogConversion Conv;
+        const char* End = ParseConversion(Pos + 1, &Conv);
+        // Already validated when capturing the arguments.
+        if (!End) {
+            break;
+        }
+        Pos = End - 1;
+
+        // Rebuild the conversion, inlining the width and precision
+        // arguments and using explicit integer sizes.
+        char Spec[ASYNC_LOG_MAX_SPEC_LENGTH + 32];
+        int SpecLength = sprintf_s(
+            Spec, sizeof(Spec), "%%%.*s", (int) Conv.FlagsLength, Conv.Flags);
+        if (Conv.WidthArg) {
+            SpecLength += sprintf_s(
+                Spec + SpecLength, sizeof(Spec) - SpecLength,
+                "%d", (int) Record->Args[ArgIdx++].Int);
+        } else {
+            SpecLength += sprintf_s(
+                Spec + SpecLength, sizeof(Spec) - SpecLength,
+                "%.*s", (int) Conv.WidthLength, Conv.Width);
+        }
+        if (Conv.PrecisionArg) {
+            SpecLength += sprintf_s(
+                Spec + SpecLength, sizeof(Spec) - SpecLength,
+                ".%d", (int) Record->Args[ArgIdx++].Int);
+        } else if (Conv.HasPrecision) {
+            SpecLength += sprintf_s(
+                Spec + SpecLength, sizeof(Spec) - SpecLength,
+                ".%.*s", (int) Conv.PrecisionLength, Conv.Precision);
+        }
+        BOOLEAN IntType = !!strchr("diouxX", Conv.Type);
+        sprintf_s(Spec + SpecLength, sizeof(Spec) - SpecLength,
+                  "%s%c", IntType ? "ll" : "", Conv.Type);
+
+        char* Dest = Buffer + Offset;
+        size_t Available = BufferSize - Offset;
+        AsyncLogArg* Arg = &Record->Args[ArgIdx++];
+        int Written = -1;
+        switch (Conv.Type) {
+        case 'd':
+        case 'i':
+            Written = _snprintf_s(Dest, Available, _TRUNCATE,
+                                  Spec, (long long) Arg->Int);
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            Written = _snprintf_s(Dest, Available, _TRUNCATE,
+                                  Spec, (unsigned long long) Arg->UInt);
+            break;
+        case 'c':
+            Written = _snprintf_s(Dest, Available, _TRUNCATE,
+                                  Spec, (int) Arg->Int);
+            break;
+        case 'p':
+            Written = _snprintf_s(Dest, Available, _TRUNCATE,
+                                  Spec, Arg->Ptr);
+            break;
+        case 's':
+            Written = _snprintf_s(Dest, Available, _TRUNCATE,
+                                  Spec, (const char*) Arg->Ptr);
+            break;
+        default:
+            Written = _snprintf_s(Dest, Available, _TRUNCATE,
+                                  Spec, Arg->Float);
+            break;
+        }
+        if (Written < 0) {
+            // Truncated.
+            Offset = BufferSize - 1;
+            break;
+        }
+        Offset += Written;
+    }
+    Buffer[Offset] = '\0';
+}
+
+// Only called by the log thread, which is the only consumer of the log
+// rings. "Buffer" is owned by the log thread.
+static void DeliverRecord(
+    AsyncLogRecord* Record,
+    char* Buffer,
+    size_t BufferSize)
+{
+    LogMessageFunc Logger = WnbdCurrLogger;
+    if (!Logger) {
+        return;
+    }
+
+    FormatRecord(Record, Buffer, BufferSize);
+
+    CurrMessageTimestamp = Record->Timestamp;
+    Logger(Record->LogLevel, Buffer,
+           Record->FileName, Record->Line, Record->FunctionName);
+    CurrMessageTimestamp = 0;
+}
+
+// Single consumer, only called by the log thread.
+static void DrainRings(char* Buffer, size_t BufferSize)
+{
+    static UINT64 ReportedDropCount = 0;
+
+    std::vector<std::shared_ptr<AsyncLogRing>> CurrRings;
+    {
+        std::unique_lock Lock{RingsLock};
+        CurrRings = Rings;
+    }
+
+    std::vector<UINT64> Heads(CurrRings.size());
+    std::vector<AsyncLogRecord*> Pending;
+    for (size_t i = 0; i < CurrRings.size(); i++) {
+        Heads[i] = CurrRings[i]->GetHead();
+        for (UINT64 Idx = CurrRings[i]->GetTail(); Idx < Heads[i]; Idx++) {
+            Pending.push_back(CurrRings[i]->Get(Idx));
+        }
+    }
+
+    // Messages coming from different threads are ordered by timestamp.
+    std::stable_sort(
+        Pending.begin(), Pending.end(),
+        [](AsyncLogRecord* A, AsyncLogRecord* B) {
+            return A->Timestamp < B->Timestamp;
+        });
+    for (AsyncLogRecord* Record : Pending) {
+        DeliverRecord(Record, Buffer, BufferSize);
+    }
+
+    for (size_t i = 0; i < CurrRings.size(); i++) {
+        CurrRings[i]->Release(Heads[i]);
+    }
+
+    {
+        // Orphaned rings no longer receive messages.
+        std::unique_lock Lock{RingsLock};
+        Rings.erase(
+            std::remove_if(
+                Rings.begin(), Rings.end(),
+                [](const std::shared_ptr<AsyncLogRing>& Ring) {
+                    return Ring->Orphaned &&
+                        Ring->GetHead() == Ring->GetTail();
+                }),
+            Rings.end());
+    }
+
+    UINT64 DropCount = AsyncLogDropCount;
+    LogMessageFunc Logger = WnbdCurrLogger;
+    if (DropCount != ReportedDropCount && Logger) {
+        char Message[128];
+        sprintf_s(Message, sizeof(Message),
+                  "Dropped %llu log messages so far, the log ring size "
+                  "may be too small.", DropCount);
+        Logger(WnbdLogLevelWarning, Message, __FILE__, __LINE__,
+               __FUNCTION__);
+        ReportedDropCount = DropCount;
+    }
+}
+
+static DWORD WINAPI AsyncLogThreadRoutine(LPVOID)
+{
+    // Avoids heap allocations, longer messages are truncated.
+    char Buffer[WNBD_LOG_MESSAGE_MAX_SIZE];
+
+    while (true) {
+        WaitForSingleObject(AsyncLogEvent, AsyncLogFlushIntervalMs);
+
+        // Drain the rings once more after being requested to stop.
+        bool Stopping = AsyncLogStopping;
+        DrainRings(Buffer, sizeof(Buffer));
+        if (Stopping) {
+            break;
+        }
+    }
+    return 0;
+}
+
+DWORD WnbdEnableAsyncLogging(PWNBD_ASYNC_LOG_OPTIONS Options)
+{
+    UINT32 RingSize = Options && Options->RingSize ?
+        Options->RingSize : WNBD_DEFAULT_ASYNC_LOG_RING_SIZE;
+    UINT32 FlushIntervalMs = Options && Options->FlushIntervalMs ?
+        Options->FlushIntervalMs : WNBD_DEFAULT_ASYNC_LOG_FLUSH_INTERVAL_MS;
+
+    if (RingSize < ASYNC_LOG_MIN_RING_SIZE ||
+            RingSize > ASYNC_LOG_MAX_RING_SIZE ||
+            (RingSize & (RingSize - 1))) {
+        LogError("Invalid log ring size: %u. Expecting a power of two "
+                 "between %d and %d.",
+                 RingSize, ASYNC_LOG_MIN_RING_SIZE, ASYNC_LOG_MAX_RING_SIZE);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    std::unique_lock Lock{AsyncLogLock};
+    if (AsyncLogThread) {
+        return ERROR_ALREADY_EXISTS;
+    }
+
+    if (!AsyncLogEvent) {
+        AsyncLogEvent = CreateEventA(0, FALSE, FALSE, NULL);
+        if (!AsyncLogEvent) {
+            DWORD ErrorCode = GetLastError();
+            LogError("Could not create event. Error: %d.", ErrorCode);
+            return ErrorCode;
+        }
+    }
+
+    // Existing rings keep their size.
+    AsyncLogRingSize = RingSize;
+    AsyncLogFlushIntervalMs = FlushIntervalMs;
+    AsyncLogStopping = false;
+
+    AsyncLogThread = CreateThread(0, 0, AsyncLogThreadRoutine, NULL, 0, 0);
+    if (!AsyncLogThread) {
+        DWORD ErrorCode = GetLastError();
+        LogError("Could not start log thread. Error: %d.", ErrorCode);
+        return ErrorCode;
+    }
+
+    AsyncLogEnabled = true;
+    return 0;
+}
+
+VOID WnbdDisableAsyncLogging()
+{
+    std::unique_lock Lock{AsyncLogLock};
+    if (!AsyncLogThread) {
+        return;
+    }
+
+    AsyncLogEnabled = false;
+    AsyncLogStopping = true;
+    SetEvent(AsyncLogEvent);
+
+    WaitForSingleObject(AsyncLogThread, INFINITE);
+    CloseHandle(AsyncLogThread);
+    AsyncLogThread = NULL;
+}
+
+UINT64 WnbdGetAsyncLogDropCount()
+{
+    return AsyncLogDropCount;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <stdarg.h>
+
+#include "wnbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Queues the log message if asynchronous logging is enabled, deferring
+// the formatting and the logger call to a background thread. Returns
+// FALSE if asynchronous logging is disabled, in which case the message
+// must be logged synchronously.
+BOOLEAN AsyncLogMessage(
+    WnbdLogLevel LogLevel,
+    const char* FileName,
+    UINT32 Line,
+    const char* FunctionName,
+    const char* Format,
+    va_list Args);
+
+// Retrieves the time at which the message that's currently being passed
+// to the logger was emitted, which may differ from the current time when
+// using asynchronous logging.
+VOID GetLogMessageTime(PSYSTEMTIME Time);
+
+#ifdef __cplusplus
+}
+#endif
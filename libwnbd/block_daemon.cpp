@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "block_daemon.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+#define _NTSCSI_USER_MODE_
+#include <scsi.h>
+
+DWORD BlockDaemon::TryStart()
+{
+    WnbdProps.MaxUnmapDescCount = 1;
+    WnbdProps.Flags.PersistResSupported = 0;
+
+    if (!WnbdProps.BlockSize) {
+        WnbdProps.BlockSize = WNBD_DEFAULT_BLOCK_SIZE;
+    }
+    if (WnbdProps.BlockSize != 512) {
+        LogError("Invalid block size: %d. "
+                 "Only 512 is allowed for the time being.", WnbdProps.BlockSize);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (WnbdProps.BlockSize % Device->GetSectorSize()) {
+        LogError("The block size (%d) must be a multiple of the device "
+                 "sector size (%d).",
+                 WnbdProps.BlockSize, Device->GetSectorSize());
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    UINT64 DeviceSize = Device->GetSize();
+    if (DeviceSize % WnbdProps.BlockSize) {
+        LogWarning("The device size (%llu) is not a multiple of the block "
+                   "size (%d), the remaining bytes won't be used.",
+                   DeviceSize, WnbdProps.BlockSize);
+    }
+    WnbdProps.BlockCount = DeviceSize / WnbdProps.BlockSize;
+    if (!WnbdProps.BlockCount) {
+        LogError("Invalid device size: %llu.", DeviceSize);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    WnbdProps.Flags.FlushSupported = 1;
+    WnbdProps.Flags.FUASupported = 1;
+    WnbdProps.Flags.UnmapSupported = Device->IsUnmapSupported();
+
+    DWORD Err = 0;
+    if (OfflineResponse) {
+        Err = WnbdCreateOffline(
+            &WnbdProps,
+            (const PWNBD_INTERFACE) &wnbd::CoroInterface<BlockDaemon>::Interface,
+            this, OfflineResponse, OfflineResponseContext, &WnbdDisk);
+    } else {
+        Err = WnbdCreate(
+            &WnbdProps,
+            (const PWNBD_INTERFACE) &wnbd::CoroInterface<BlockDaemon>::Interface,
+            this, &WnbdDisk);
+    }
+    if (Err) {
+        return Err;
+    }
+
+    if (IoTraceOptions.Path[0]) {
+        Err = WnbdStartIoTrace(WnbdDisk, &IoTraceOptions);
+        if (Err) {
+            return Err;
+        }
+    }
+
+    if (OfflineResponse) {
+        LogInfo("Offline disk initialized successfully.");
+        return 0;
+    }
+
+    Err = WnbdStartDispatcherEx(WnbdDisk, &DispatcherOptions);
+    if (Err) {
+        return Err;
+    }
+
+    LogInfo("Mapping initialized successfully. Read-only: %d, "
+            "unmap enabled: %d.",
+            WnbdProps.Flags.ReadOnly, WnbdProps.Flags.UnmapSupported);
+    return 0;
+}
+
+DWORD BlockDaemon::Start()
+{
+    DWORD Retval = TryStart();
+    if (Retval) {
+        LogError("Daemon failed to initialize, attempting cleanup.");
+        Shutdown(true);
+        Wait();
+    }
+    return Retval;
+}
+
+DWORD BlockDaemon::Shutdown(bool HardRemove)
+{
+    std::unique_lock<std::mutex> Lock(ShutdownLock);
+
+    if (!Terminated && WnbdDisk) {
+        WNBD_REMOVE_OPTIONS RmOpt = { 0 };
+        RmOpt.Flags.HardRemove = HardRemove;
+        RmOpt.Flags.HardRemoveFallback = TRUE;
+        RmOpt.SoftRemoveTimeoutMs = WNBD_DEFAULT_RM_TIMEOUT_MS;
+        RmOpt.SoftRemoveRetryIntervalMs = WNBD_DEFAULT_RM_RETRY_INTERVAL_MS;
+        // The pending requests are completed before the driver sends
+        // the "Disconnect" event, unless a hard remove was requested.
+        DWORD Err = WnbdRemove(WnbdDisk, &RmOpt);
+        if (Err) {
+            if (Err == ERROR_FILE_NOT_FOUND) {
+                LogDebug("WNBD mapping already removed.");
+            } else {
+                LogError("Couldn't remove WNBD mapping. "
+                         "Error: %d. Error message: %s",
+                         Err, win32_strerror(Err).c_str());
+                return Err;
+            }
+        }
+    }
+    Terminated = true;
+
+    return 0;
+}
+
+DWORD BlockDaemon::Wait()
+{
+    DWORD Err = 0;
+    if (WnbdDisk && !OfflineResponse) {
+        LogInfo("Waiting for the WNBD dispatchers.");
+
+        Err = WnbdWaitDispatcher(WnbdDisk);
+        if (Err) {
+            LogError("Failed waiting for WNBD dispatchers to stop. "
+                     "Error: %d. Error message: %s",
+                     Err, win32_strerror(Err).c_str());
+        } else {
+            LogInfo("WNBD dispatchers stopped.");
+        }
+    }
+
+    return Err;
+}
+
+wnbd::Task<WNBD_STATUS> BlockDaemon::Read(
+    PVOID Buffer, UINT64 BlockAddress,
+    UINT32 BlockCount, BOOLEAN ForceUnitAccess)
+{
+    WNBD_STATUS Status = { 0 };
+    // Reads are served from the device, FUA doesn't require
+    // special handling.
+    DWORD Err = co_await Device->Read(
+        Buffer,
+        BlockAddress * WnbdProps.BlockSize,
+        BlockCount * WnbdProps.BlockSize);
+    if (Err) {
+        LogDebug("Read failed. Block address: %llu, block count: %d. "
+                 "Error: %d. Error message: %s",
+                 BlockAddress, BlockCount,
+                 Err, win32_strerror(Err).c_str());
+        WnbdSetSense(
+            &Status,
+            SCSI_SENSE_MEDIUM_ERROR,
+            SCSI_ADSENSE_UNRECOVERED_ERROR);
+    }
+    co_return Status;
+}
+
+wnbd::Task<WNBD_STATUS> BlockDaemon::Write(
+    PVOID Buffer, UINT64 BlockAddress,
+    UINT32 BlockCount, BOOLEAN ForceUnitAccess)
+{
+    WNBD_STATUS Status = { 0 };
+    DWORD Err = co_await Device->Write(
+        Buffer,
+        BlockAddress * WnbdProps.BlockSize,
+        BlockCount * WnbdProps.BlockSize,
+        ForceUnitAccess);
+    if (Err) {
+        LogDebug("Write failed. Block address: %llu, block count: %d. "
+                 "Error: %d. Error message: %s",
+                 BlockAddress, BlockCount,
+                 Err, win32_strerror(Err).c_str());
+        WnbdSetSense(
+            &Status,
+            SCSI_SENSE_MEDIUM_ERROR,
+            SCSI_ADSENSE_WRITE_ERROR);
+    }
+    co_return Status;
+}
+
+wnbd::Task<WNBD_STATUS> BlockDaemon::Flush(
+    UINT64 BlockAddress, UINT32 BlockCount)
+{
+    WNBD_STATUS Status = { 0 };
+    // The whole device is flushed.
+    DWORD Err = co_await Device->Flush();
+    if (Err) {
+        LogDebug("Flush failed. Error: %d. Error message: %s",
+                 Err, win32_strerror(Err).c_str());
+        WnbdSetSense(
+            &Status,
+            SCSI_SENSE_MEDIUM_ERROR,
+            SCSI_ADSENSE_WRITE_ERROR);
+    }
+    co_return Status;
+}
+
+wnbd::Task<WNBD_STATUS> BlockDaemon::Unmap(
+    PWNBD_UNMAP_DESCRIPTOR Descriptors, UINT32 Count)
+{
+    WNBD_STATUS Status = { 0 };
+    for (UINT32 Index = 0; Index < Count; Index++) {
+        DWORD Err = co_await Device->Unmap(
+            Descriptors[Index].BlockAddress * WnbdProps.BlockSize,
+            (UINT64) Descriptors[Index].BlockCount * WnbdProps.BlockSize);
+        if (Err) {
+            LogDebug("Unmap failed. Block address: %llu, block count: %d. "
+                     "Error: %d. Error message: %s",
+                     Descriptors[Index].BlockAddress,
+                     Descriptors[Index].BlockCount,
+                     Err, win32_strerror(Err).c_str());
+            WnbdSetSense(
+                &Status,
+                SCSI_SENSE_MEDIUM_ERROR,
+                SCSI_ADSENSE_WRITE_ERROR);
+            break;
+        }
+    }
+    co_return Status;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <memory>
+#include <mutex>
+
+#include "block_device.h"
+#include "wnbd.h"
+#include "wnbd_coro.h"
+
+// Exposes a BlockDevice through WNBD, used by the built-in backends
+// (e.g. WnbdRunFileDaemon). The IO callbacks are implemented as
+// coroutines, see wnbd::CoroInterface.
+class BlockDaemon
+{
+private:
+    WNBD_PROPERTIES WnbdProps = {0};
+    WNBD_DISPATCHER_OPTIONS DispatcherOptions = {0};
+    // IO tracing is enabled if a path is set.
+    WNBD_IO_TRACE_OPTIONS IoTraceOptions = {0};
+
+    std::unique_ptr<BlockDevice> Device;
+
+    std::mutex ShutdownLock;
+    bool Terminated = false;
+    PWNBD_DISK WnbdDisk = nullptr;
+
+    // Set when using an offline disk, see WnbdCreateOfflineFile.
+    OfflineResponseFunc OfflineResponse = nullptr;
+    PVOID OfflineResponseContext = nullptr;
+
+    DWORD TryStart();
+
+public:
+    BlockDaemon(
+        PWNBD_PROPERTIES Properties,
+        std::unique_ptr<BlockDevice> _Device,
+        PWNBD_DISPATCHER_OPTIONS _DispatcherOptions = nullptr,
+        PWNBD_IO_TRACE_OPTIONS _IoTraceOptions = nullptr)
+        : Device(std::move(_Device))
+    {
+        WnbdProps = *Properties;
+        if (_DispatcherOptions) {
+            DispatcherOptions = *_DispatcherOptions;
+        }
+        if (_IoTraceOptions) {
+            IoTraceOptions = *_IoTraceOptions;
+        }
+    }
+
+    ~BlockDaemon()
+    {
+        Shutdown();
+        Wait();
+
+        // Waits for the pending IO before closing the disk.
+        Device.reset();
+
+        if (WnbdDisk) {
+            WnbdClose(WnbdDisk);
+        }
+    }
+
+    // Must be called before starting the daemon. The disk won't be
+    // exposed through the WNBD driver, the requests being passed
+    // through WnbdSubmitRequest.
+    void SetOffline(OfflineResponseFunc ResponseFunc, PVOID ResponseContext)
+    {
+        OfflineResponse = ResponseFunc;
+        OfflineResponseContext = ResponseContext;
+    }
+
+    PWNBD_DISK GetDisk() { return WnbdDisk; }
+    BlockDevice* GetDevice() { return Device.get(); }
+
+    DWORD Start();
+    DWORD Wait();
+    DWORD Shutdown(bool HardRemove=false);
+
+    // WNBD IO entry points
+    wnbd::Task<WNBD_STATUS> Read(
+        PVOID Buffer, UINT64 BlockAddress,
+        UINT32 BlockCount, BOOLEAN ForceUnitAccess);
+    wnbd::Task<WNBD_STATUS> Write(
+        PVOID Buffer, UINT64 BlockAddress,
+        UINT32 BlockCount, BOOLEAN ForceUnitAccess);
+    wnbd::Task<WNBD_STATUS> Flush(
+        UINT64 BlockAddress, UINT32 BlockCount);
+    wnbd::Task<WNBD_STATUS> Unmap(
+        PWNBD_UNMAP_DESCRIPTOR Descriptors, UINT32 Count);
+};
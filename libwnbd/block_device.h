@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include "wnbd_coro.h"
+
+// Byte addressed storage used by the built-in backends (see BlockDaemon).
+//
+// Offsets and lengths are multiples of the disk block size, which in
+// turn must be a multiple of the device sector size. Operations return
+// a non-zero error code in case of failure.
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() {}
+
+    // The device size in bytes.
+    virtual UINT64 GetSize() = 0;
+    // The minimum IO alignment, in bytes.
+    virtual UINT32 GetSectorSize() = 0;
+    virtual bool IsUnmapSupported() = 0;
+
+    virtual wnbd::Task<DWORD> Read(
+        PVOID Buffer, UINT64 Offset, UINT32 Length) = 0;
+    virtual wnbd::Task<DWORD> Write(
+        PVOID Buffer, UINT64 Offset, UINT32 Length,
+        BOOLEAN ForceUnitAccess) = 0;
+    virtual wnbd::Task<DWORD> Flush() = 0;
+    virtual wnbd::Task<DWORD> Unmap(UINT64 Offset, UINT64 Length) = 0;
+};
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "buffer_pool.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+RequestBufferPool::~RequestBufferPool()
+{
+    for (PVOID Buffer : FreeBuffers) {
+        FreeNumaBuffer(Buffer);
+    }
+    FreeBuffers.clear();
+
+    // Leases that weren't released by the time the disk gets closed.
+    if (!Leases.empty()) {
+        LogWarning("Releasing %llu leased request buffers.",
+                   Leases.size());
+    }
+    for (auto& Lease : Leases) {
+        FreeNumaBuffer(Lease.second);
+    }
+    Leases.clear();
+}
+
+void RequestBufferPool::SetMaxCachedBuffers(size_t Count)
+{
+    std::unique_lock Lock{this->Lock};
+    MaxCachedBuffers = Count;
+}
+
+PVOID RequestBufferPool::Get()
+{
+    {
+        std::unique_lock Lock{this->Lock};
+        if (!FreeBuffers.empty()) {
+            PVOID Buffer = FreeBuffers.back();
+            FreeBuffers.pop_back();
+            return Buffer;
+        }
+    }
+
+    return AllocNumaBuffer(BufferSize, NumaNode);
+}
+
+void RequestBufferPool::Put(PVOID Buffer)
+{
+    if (!Buffer) {
+        return;
+    }
+
+    {
+        std::unique_lock Lock{this->Lock};
+        if (FreeBuffers.size() < MaxCachedBuffers) {
+            FreeBuffers.push_back(Buffer);
+            return;
+        }
+    }
+
+    FreeNumaBuffer(Buffer);
+}
+
+DWORD RequestBufferPool::Lease(UINT64 RequestHandle, PVOID Buffer)
+{
+    std::unique_lock Lock{this->Lock};
+    auto Ret = Leases.emplace(RequestHandle, Buffer);
+    if (!Ret.second) {
+        LogError("Request buffer already leased. Request handle: %llx.",
+                 RequestHandle);
+        return ERROR_ALREADY_EXISTS;
+    }
+    LeaseCount++;
+    return 0;
+}
+
+DWORD RequestBufferPool::Release(UINT64 RequestHandle)
+{
+    PVOID Buffer = nullptr;
+
+    {
+        std::unique_lock Lock{this->Lock};
+        auto LeaseIt = Leases.find(RequestHandle);
+        if (LeaseIt == Leases.end()) {
+            return ERROR_NOT_FOUND;
+        }
+
+        Buffer = LeaseIt->second;
+        Leases.erase(LeaseIt);
+        LeaseCount--;
+    }
+
+    Put(Buffer);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Per-disk pool of IO request buffers.
+//
+// The dispatcher threads retrieve their request buffers from this pool.
+// IO callbacks may lease the request buffer, taking ownership until the
+// request completes, in which case the dispatcher will pick a different
+// buffer for subsequent requests. This allows asynchronous backends to
+// avoid copying the request payload.
+class RequestBufferPool
+{
+private:
+    size_t BufferSize;
+    // Buffers are allocated on this NUMA node, unless set to
+    // NUMA_NO_PREFERRED_NODE.
+    DWORD NumaNode;
+    // The maximum number of idle buffers that we're going to keep around,
+    // extra buffers are released.
+    size_t MaxCachedBuffers;
+
+    std::mutex Lock;
+    std::vector<PVOID> FreeBuffers;
+    std::unordered_map<UINT64, PVOID> Leases;
+    // Allows skipping the lease map lookup when there are no leases.
+    std::atomic<size_t> LeaseCount = 0;
+
+public:
+    RequestBufferPool(
+        size_t _BufferSize,
+        size_t _MaxCachedBuffers,
+        DWORD _NumaNode = NUMA_NO_PREFERRED_NODE)
+        : BufferSize(_BufferSize)
+        , NumaNode(_NumaNode)
+        , MaxCachedBuffers(_MaxCachedBuffers)
+    {}
+    ~RequestBufferPool();
+
+    size_t GetBufferSize() { return BufferSize; }
+    void SetMaxCachedBuffers(size_t Count);
+
+    // Returns NULL if the buffer could not be allocated.
+    PVOID Get();
+    void Put(PVOID Buffer);
+
+    DWORD Lease(UINT64 RequestHandle, PVOID Buffer);
+    // Returns the buffer to the pool, if leased. Returns
+    // ERROR_NOT_FOUND otherwise.
+    DWORD Release(UINT64 RequestHandle);
+
+    bool HasLeases() {
+        return LeaseCount.load(std::memory_order_relaxed) != 0;
+    }
+};
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "cluster_codec.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+#pragma comment(lib, "Cabinet.lib")
+
+static DWORD GetAlgorithm(ClusterEncoding Encoding)
+{
+    return Encoding == ClusterEncoding::XpressHuffman ?
+        COMPRESS_ALGORITHM_XPRESS_HUFF : COMPRESS_ALGORITHM_XPRESS;
+}
+
+ClusterCodec::~ClusterCodec()
+{
+    for (COMPRESSOR_HANDLE Handle : Compressors) {
+        CloseCompressor(Handle);
+    }
+    for (auto& Handles : Decompressors) {
+        for (DECOMPRESSOR_HANDLE Handle : Handles) {
+            CloseDecompressor(Handle);
+        }
+    }
+}
+
+DWORD ClusterCodec::Initialize(WnbdCompressionCodec Codec, UINT32 _ClusterSize)
+{
+    switch (Codec) {
+    case WnbdCompressionFast:
+        Encoding = ClusterEncoding::Xpress;
+        break;
+    case WnbdCompressionHigh:
+        Encoding = ClusterEncoding::XpressHuffman;
+        break;
+    default:
+        LogError("Unsupported compression codec: %d.", Codec);
+        return ERROR_INVALID_PARAMETER;
+    }
+    ClusterSize = _ClusterSize;
+
+    // Fail early if the codec isn't available.
+    COMPRESSOR_HANDLE Compressor = GetCompressor();
+    if (!Compressor) {
+        return ERROR_NOT_SUPPORTED;
+    }
+    PutCompressor(Compressor);
+    return 0;
+}
+
+COMPRESSOR_HANDLE ClusterCodec::GetCompressor()
+{
+    {
+        std::unique_lock Guard{Lock};
+        if (!Compressors.empty()) {
+            COMPRESSOR_HANDLE Handle = Compressors.back();
+            Compressors.pop_back();
+            return Handle;
+        }
+    }
+
+    COMPRESSOR_HANDLE Handle = NULL;
+    if (!CreateCompressor(
+            GetAlgorithm(Encoding) | COMPRESS_RAW, NULL, &Handle)) {
+        DWORD Status = GetLastError();
+        LogError("Could not create compressor. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return NULL;
+    }
+    return Handle;
+}
+
+void ClusterCodec::PutCompressor(COMPRESSOR_HANDLE Handle)
+{
+    std::unique_lock Guard{Lock};
+    try {
+        Compressors.push_back(Handle);
+        return;
+    }
+    catch (const std::bad_alloc&) {
+    }
+    CloseCompressor(Handle);
+}
+
+DECOMPRESSOR_HANDLE ClusterCodec::GetDecompressor(ClusterEncoding Encoding)
+{
+    auto& Handles = Decompressors[(UINT8) Encoding];
+    {
+        std::unique_lock Guard{Lock};
+        if (!Handles.empty()) {
+            DECOMPRESSOR_HANDLE Handle = Handles.back();
+            Handles.pop_back();
+            return Handle;
+        }
+    }
+
+    DECOMPRESSOR_HANDLE Handle = NULL;
+    if (!CreateDecompressor(
+            GetAlgorithm(Encoding) | COMPRESS_RAW, NULL, &Handle)) {
+        DWORD Status = GetLastError();
+        LogError("Could not create decompressor. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return NULL;
+    }
+    return Handle;
+}
+
+void ClusterCodec::PutDecompressor(
+    ClusterEncoding Encoding, DECOMPRESSOR_HANDLE Handle)
+{
+    std::unique_lock Guard{Lock};
+    try {
+        Decompressors[(UINT8) Encoding].push_back(Handle);
+        return;
+    }
+    catch (const std::bad_alloc&) {
+    }
+    CloseDecompressor(Handle);
+}
+
+ClusterEncoding ClusterCodec::Encode(
+    const void* Cluster, PVOID Output, PUINT32 OutputLength)
+{
+    if (IsZeroBuffer(Cluster, ClusterSize)) {
+        *OutputLength = 0;
+        return ClusterEncoding::Zero;
+    }
+
+    COMPRESSOR_HANDLE Compressor = GetCompressor();
+    SIZE_T CompressedSize = 0;
+    // Fails with ERROR_INSUFFICIENT_BUFFER if the cluster doesn't
+    // compress well enough.
+    BOOL Compressed = Compressor && Compress(
+        Compressor, Cluster, ClusterSize, Output,
+        GetMaxCompressedSize(), &CompressedSize);
+    if (Compressor) {
+        PutCompressor(Compressor);
+    }
+
+    if (!Compressed) {
+        *OutputLength = ClusterSize;
+        return ClusterEncoding::Raw;
+    }
+    *OutputLength = (UINT32) CompressedSize;
+    return Encoding;
+}
+
+DWORD ClusterCodec::Decode(
+    ClusterEncoding StoredEncoding,
+    const void* Input, UINT32 InputLength, PVOID Cluster)
+{
+    if (StoredEncoding != ClusterEncoding::Xpress &&
+            StoredEncoding != ClusterEncoding::XpressHuffman) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    DECOMPRESSOR_HANDLE Decompressor = GetDecompressor(StoredEncoding);
+    if (!Decompressor) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    SIZE_T DecompressedSize = 0;
+    DWORD Status = 0;
+    if (!Decompress(
+            Decompressor, Input, InputLength, Cluster,
+            ClusterSize, &DecompressedSize)) {
+        Status = GetLastError();
+    } else if (DecompressedSize != ClusterSize) {
+        Status = ERROR_INVALID_DATA;
+    }
+    PutDecompressor(StoredEncoding, Decompressor);
+
+    if (Status) {
+        LogError("Could not decompress cluster. Compressed size: %d. "
+                 "Error: %d. Error message: %s",
+                 InputLength, Status, win32_strerror(Status).c_str());
+    }
+    return Status;
+}
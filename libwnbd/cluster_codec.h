@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <compressapi.h>
+
+#include <mutex>
+#include <vector>
+
+#include "wnbd.h"
+
+// The way a cluster is stored, recorded in the cluster index.
+enum class ClusterEncoding : UINT8
+{
+    // All-zero cluster, nothing is stored.
+    Zero = 0,
+    // Incompressible cluster, stored as is.
+    Raw = 1,
+    Xpress = 2,
+    XpressHuffman = 3,
+};
+
+// Compresses and decompresses fixed size clusters using the Windows
+// Compression API (raw XPRESS streams, without the block headers).
+//
+// Compressor handles may not be used concurrently, so idle handles are
+// pooled, new ones being created when the pool is empty. Clusters that
+// don't shrink by at least 1/8 are stored raw, which avoids the
+// decompression cost for data that barely compresses.
+class ClusterCodec
+{
+private:
+    UINT32 ClusterSize = 0;
+    ClusterEncoding Encoding = ClusterEncoding::Raw;
+
+    std::mutex Lock;
+    std::vector<COMPRESSOR_HANDLE> Compressors;
+    // Indexed by encoding, clusters may have been stored using another
+    // codec (e.g. compressed files reopened with different options).
+    std::vector<DECOMPRESSOR_HANDLE> Decompressors[4];
+
+    COMPRESSOR_HANDLE GetCompressor();
+    void PutCompressor(COMPRESSOR_HANDLE Handle);
+    DECOMPRESSOR_HANDLE GetDecompressor(ClusterEncoding Encoding);
+    void PutDecompressor(ClusterEncoding Encoding, DECOMPRESSOR_HANDLE Handle);
+
+public:
+    ~ClusterCodec();
+
+    DWORD Initialize(WnbdCompressionCodec Codec, UINT32 ClusterSize);
+
+    // The largest compressed size that's worth keeping.
+    UINT32 GetMaxCompressedSize() { return ClusterSize - ClusterSize / 8; }
+
+    // Encodes a whole cluster. Compressed data is placed in the output
+    // buffer, which must hold at least GetMaxCompressedSize() bytes,
+    // while raw clusters are left in the source buffer. The output
+    // length is 0 for zero clusters.
+    ClusterEncoding Encode(
+        const void* Cluster, PVOID Output, PUINT32 OutputLength);
+    // Expands a compressed cluster into a ClusterSize buffer.
+    DWORD Decode(
+        ClusterEncoding StoredEncoding,
+        const void* Input, UINT32 InputLength, PVOID Cluster);
+};
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "compressed_device.h"
+#include "wnbd_log.h"
+
+// The number of idle scratch buffers kept around.
+#define COMPRESSED_SCRATCH_BUFFERS 64
+
+// Scratch buffer retrieved from the pool when first used and returned
+// when going out of scope.
+class ScratchBuffer
+{
+private:
+    RequestBufferPool* Pool;
+    PBYTE Buffer = nullptr;
+
+public:
+    explicit ScratchBuffer(RequestBufferPool* _Pool) : Pool(_Pool) {}
+    ScratchBuffer(const ScratchBuffer&) = delete;
+    ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+    ~ScratchBuffer() { Pool->Put(Buffer); }
+
+    // Returns NULL if the buffer could not be allocated.
+    PBYTE Get()
+    {
+        if (!Buffer) {
+            Buffer = (PBYTE) Pool->Get();
+        }
+        return Buffer;
+    }
+};
+
+DWORD CompressedDevice::InitializeClusters(
+    UINT64 DeviceSize,
+    WnbdCompressionCodec CodecType,
+    UINT32 NewClusterSize,
+    UINT64 IndexAlignment)
+{
+    if (NewClusterSize < WNBD_MIN_COMPRESSION_CLUSTER_SIZE ||
+            NewClusterSize > WNBD_MAX_COMPRESSION_CLUSTER_SIZE ||
+            (NewClusterSize & (NewClusterSize - 1))) {
+        LogError("Invalid compression cluster size: %d. The cluster size "
+                 "must be a power of two between %d and %d.",
+                 NewClusterSize, WNBD_MIN_COMPRESSION_CLUSTER_SIZE,
+                 WNBD_MAX_COMPRESSION_CLUSTER_SIZE);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (!DeviceSize || DeviceSize % WNBD_DEFAULT_BLOCK_SIZE) {
+        LogError("Invalid compressed disk size: %llu. The size must be "
+                 "a multiple of %d.", DeviceSize, WNBD_DEFAULT_BLOCK_SIZE);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    DWORD Status = Codec.Initialize(CodecType, NewClusterSize);
+    if (Status) {
+        return Status;
+    }
+
+    Size = DeviceSize;
+    ClusterSize = NewClusterSize;
+    ClusterCount = (Size + ClusterSize - 1) / ClusterSize;
+    IndexCapacity = (ClusterCount + IndexAlignment - 1) /
+        IndexAlignment * IndexAlignment;
+    Index.reset(new (std::nothrow) std::atomic<UINT64>[IndexCapacity]());
+    if (!Index) {
+        LogError("Could not allocate the cluster index. "
+                 "Cluster count: %llu.", ClusterCount);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    ScratchBuffers.reset(new (std::nothrow) RequestBufferPool(
+        ClusterSize, COMPRESSED_SCRATCH_BUFFERS));
+    if (!ScratchBuffers) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    return 0;
+}
+
+void CompressedDevice::SetEntry(UINT64 Cluster, ClusterEntry Entry)
+{
+    ClusterEntry Previous = std::bit_cast<ClusterEntry>(
+        Index[Cluster].exchange(std::bit_cast<UINT64>(Entry)));
+
+    for (auto [Changed, Delta] : {
+            std::pair{Previous, (UINT64) -1}, std::pair{Entry, 1ULL}}) {
+        switch ((ClusterEncoding) Changed.Encoding) {
+        case ClusterEncoding::Zero:
+            continue;
+        case ClusterEncoding::Raw:
+            RawClusters += Delta;
+            break;
+        default:
+            CompressedClusters += Delta;
+            break;
+        }
+        StoredBytes += Delta * Changed.Length;
+    }
+}
+
+void CompressedDevice::CountEntries()
+{
+    UINT64 Raw = 0;
+    UINT64 Compressed = 0;
+    UINT64 Stored = 0;
+    for (UINT64 Cluster = 0; Cluster < ClusterCount; Cluster++) {
+        ClusterEntry Entry = GetEntry(Cluster);
+        switch ((ClusterEncoding) Entry.Encoding) {
+        case ClusterEncoding::Zero:
+            continue;
+        case ClusterEncoding::Raw:
+            Raw++;
+            break;
+        default:
+            Compressed++;
+            break;
+        }
+        Stored += Entry.Length;
+    }
+    RawClusters = Raw;
+    CompressedClusters = Compressed;
+    StoredBytes = Stored;
+}
+
+void CompressedDevice::GetStats(PWNBD_COMPRESSION_STATS Stats)
+{
+    *Stats = { 0 };
+    Stats->ClusterSize = ClusterSize;
+    Stats->ClusterCount = ClusterCount;
+    Stats->RawClusters = RawClusters;
+    Stats->CompressedClusters = CompressedClusters;
+    Stats->ZeroClusters =
+        ClusterCount - Stats->RawClusters - Stats->CompressedClusters;
+    Stats->StoredBytes = StoredBytes;
+}
+
+wnbd::Task<DWORD> CompressedDevice::LoadDecoded(
+    ClusterEntry Entry, PBYTE Cluster)
+{
+    switch ((ClusterEncoding) Entry.Encoding) {
+    case ClusterEncoding::Zero:
+        memset(Cluster, 0, ClusterSize);
+        co_return 0;
+    case ClusterEncoding::Raw:
+        co_return co_await LoadCluster(Entry, 0, ClusterSize, Cluster);
+    default:
+        break;
+    }
+
+    ScratchBuffer Compressed(ScratchBuffers.get());
+    if (!Compressed.Get()) {
+        co_return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    DWORD Status = co_await LoadCluster(
+        Entry, 0, (UINT32) Entry.Length, Compressed.Get());
+    if (Status) {
+        co_return Status;
+    }
+    co_return Codec.Decode(
+        (ClusterEncoding) Entry.Encoding, Compressed.Get(),
+        (UINT32) Entry.Length, Cluster);
+}
+
+wnbd::Task<DWORD> CompressedDevice::ReadCluster(
+    UINT64 Cluster, UINT32 ClusterOffset, UINT32 Length, PBYTE Buffer)
+{
+    IoSlots& Lock = ClusterLocks[Cluster % COMPRESSED_LOCK_STRIPES];
+    co_await Lock.Acquire();
+
+    ClusterEntry Entry = GetEntry(Cluster);
+    ScratchBuffer Decoded(ScratchBuffers.get());
+    DWORD Status = 0;
+    if (Entry.Encoding == (UINT64) ClusterEncoding::Zero) {
+        memset(Buffer, 0, Length);
+    } else if (Entry.Encoding == (UINT64) ClusterEncoding::Raw) {
+        Status = co_await LoadCluster(Entry, ClusterOffset, Length, Buffer);
+    } else if (Length == ClusterSize) {
+        // Decompress straight into the request buffer.
+        Status = co_await LoadDecoded(Entry, Buffer);
+    } else if (!Decoded.Get()) {
+        Status = ERROR_NOT_ENOUGH_MEMORY;
+    } else {
+        Status = co_await LoadDecoded(Entry, Decoded.Get());
+        if (!Status) {
+            memcpy(Buffer, Decoded.Get() + ClusterOffset, Length);
+        }
+    }
+
+    Lock.Release();
+    co_return Status;
+}
+
+wnbd::Task<DWORD> CompressedDevice::WriteCluster(
+    UINT64 Cluster, UINT32 ClusterOffset, UINT32 Length,
+    PBYTE Buffer, BOOLEAN ForceUnitAccess)
+{
+    IoSlots& Lock = ClusterLocks[Cluster % COMPRESSED_LOCK_STRIPES];
+    co_await Lock.Acquire();
+
+    ClusterEntry Entry = GetEntry(Cluster);
+    ScratchBuffer Merged(ScratchBuffers.get());
+    ScratchBuffer Encoded(ScratchBuffers.get());
+    PBYTE Data = Buffer;
+    DWORD Status = 0;
+    // The last cluster may be partially used, in which case it's
+    // always merged, the unused part remaining zeroed.
+    if (ClusterOffset || Length != ClusterSize) {
+        if (!Buffer && Entry.Encoding == (UINT64) ClusterEncoding::Zero) {
+            Lock.Release();
+            co_return 0;
+        }
+        if (!Merged.Get()) {
+            Status = ERROR_NOT_ENOUGH_MEMORY;
+        } else {
+            Status = co_await LoadDecoded(Entry, Merged.Get());
+        }
+        if (!Status) {
+            if (Buffer) {
+                memcpy(Merged.Get() + ClusterOffset, Buffer, Length);
+            } else {
+                memset(Merged.Get() + ClusterOffset, 0, Length);
+            }
+            Data = Merged.Get();
+        }
+    }
+
+    if (!Status) {
+        ClusterEncoding Encoding = ClusterEncoding::Zero;
+        UINT32 EncodedLength = 0;
+        if (!Data) {
+            // Unmapped cluster.
+        } else if (!Encoded.Get()) {
+            Status = ERROR_NOT_ENOUGH_MEMORY;
+        } else {
+            Encoding = Codec.Encode(Data, Encoded.Get(), &EncodedLength);
+            if (Encoding != ClusterEncoding::Raw) {
+                Data = Encoded.Get();
+            }
+        }
+        if (!Status) {
+            Status = co_await StoreCluster(
+                Cluster, Encoding, EncodedLength ? Data : nullptr,
+                EncodedLength, ForceUnitAccess);
+        }
+    }
+
+    Lock.Release();
+    co_return Status;
+}
+
+wnbd::Task<DWORD> CompressedDevice::Read(
+    PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    while (Length) {
+        UINT32 ClusterOffset = (UINT32) (Offset % ClusterSize);
+        UINT32 SliceLength = min(Length, ClusterSize - ClusterOffset);
+        DWORD Status = co_await ReadCluster(
+            Offset / ClusterSize, ClusterOffset, SliceLength,
+            (PBYTE) Buffer);
+        if (Status) {
+            co_return Status;
+        }
+        Buffer = (PBYTE) Buffer + SliceLength;
+        Offset += SliceLength;
+        Length -= SliceLength;
+    }
+    co_return 0;
+}
+
+wnbd::Task<DWORD> CompressedDevice::Write(
+    PVOID Buffer, UINT64 Offset, UINT32 Length,
+    BOOLEAN ForceUnitAccess)
+{
+    while (Length) {
+        UINT32 ClusterOffset = (UINT32) (Offset % ClusterSize);
+        UINT32 SliceLength = min(Length, ClusterSize - ClusterOffset);
+        DWORD Status = co_await WriteCluster(
+            Offset / ClusterSize, ClusterOffset, SliceLength,
+            (PBYTE) Buffer, ForceUnitAccess);
+        if (Status) {
+            co_return Status;
+        }
+        Buffer = (PBYTE) Buffer + SliceLength;
+        Offset += SliceLength;
+        Length -= SliceLength;
+    }
+    co_return 0;
+}
+
+wnbd::Task<DWORD> CompressedDevice::Unmap(UINT64 Offset, UINT64 Length)
+{
+    while (Length) {
+        UINT32 ClusterOffset = (UINT32) (Offset % ClusterSize);
+        UINT32 SliceLength = (UINT32) min(
+            Length, (UINT64) (ClusterSize - ClusterOffset));
+        DWORD Status = co_await WriteCluster(
+            Offset / ClusterSize, ClusterOffset, SliceLength,
+            nullptr, FALSE);
+        if (Status) {
+            co_return Status;
+        }
+        Offset += SliceLength;
+        Length -= SliceLength;
+    }
+    co_return 0;
+}
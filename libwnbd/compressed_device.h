@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <bit>
+#include <memory>
+
+#include "block_device.h"
+#include "buffer_pool.h"
+#include "cluster_codec.h"
+#include "io_engine.h"
+#include "wnbd.h"
+
+#define COMPRESSED_LOCK_STRIPES 256
+
+// Cluster index entry, 8 bytes per cluster.
+struct ClusterEntry
+{
+    // Backend specific location of the stored cluster.
+    UINT64 Location:43;
+    // The number of stored bytes, 0 for zero clusters.
+    UINT64 Length:19;
+    // ClusterEncoding
+    UINT64 Encoding:2;
+};
+static_assert(sizeof(ClusterEntry) == sizeof(UINT64));
+
+// Base class of the compressed RAM and file devices, see
+// WNBD_COMPRESSION_OPTIONS.
+//
+// The device is split into fixed size clusters, each of them being
+// compressed separately. The cluster index records the location, the
+// stored size and the encoding of each cluster. Zero clusters only
+// exist in the index, while clusters that don't compress well are
+// stored raw.
+//
+// Writes that don't cover whole clusters have to decompress the
+// existing data, merge it and compress the result, so each cluster
+// is protected by an asynchronous lock (striped). Readers hold the
+// lock as well, the storage used by a cluster being released as soon
+// as it gets rewritten.
+class CompressedDevice : public BlockDevice
+{
+private:
+    IoSlots ClusterLocks[COMPRESSED_LOCK_STRIPES];
+    // Cluster sized, page aligned scratch buffers.
+    std::unique_ptr<RequestBufferPool> ScratchBuffers;
+
+    std::atomic<UINT64> RawClusters = 0;
+    std::atomic<UINT64> CompressedClusters = 0;
+    std::atomic<UINT64> StoredBytes = 0;
+
+    // Retrieves the uncompressed cluster data.
+    wnbd::Task<DWORD> LoadDecoded(ClusterEntry Entry, PBYTE Cluster);
+    wnbd::Task<DWORD> ReadCluster(
+        UINT64 Cluster, UINT32 ClusterOffset, UINT32 Length, PBYTE Buffer);
+    // Zeroes the specified range if the buffer is NULL.
+    wnbd::Task<DWORD> WriteCluster(
+        UINT64 Cluster, UINT32 ClusterOffset, UINT32 Length,
+        PBYTE Buffer, BOOLEAN ForceUnitAccess);
+
+protected:
+    UINT64 Size = 0;
+    UINT32 ClusterSize = 0;
+    UINT64 ClusterCount = 0;
+    ClusterCodec Codec;
+    // Padded to IndexCapacity entries, which may exceed the cluster
+    // count.
+    std::unique_ptr<std::atomic<UINT64>[]> Index;
+    UINT64 IndexCapacity = 0;
+
+    // Validates the cluster size, sets up the codec and allocates the
+    // cluster index, initially holding zero clusters.
+    DWORD InitializeClusters(
+        UINT64 DeviceSize,
+        WnbdCompressionCodec CodecType,
+        UINT32 NewClusterSize,
+        UINT64 IndexAlignment = 1);
+
+    ClusterEntry GetEntry(UINT64 Cluster)
+    {
+        return std::bit_cast<ClusterEntry>(Index[Cluster].load());
+    }
+    // Updates the index and the stats.
+    void SetEntry(UINT64 Cluster, ClusterEntry Entry);
+    // Recomputes the stats after loading the index.
+    void CountEntries();
+
+    // Loads "Length" bytes of the stored cluster, starting at the
+    // specified offset. Compressed clusters are loaded as a whole and
+    // the buffer must be large enough to hold a whole cluster.
+    virtual wnbd::Task<DWORD> LoadCluster(
+        ClusterEntry Entry, UINT32 Offset, UINT32 Length, PBYTE Buffer) = 0;
+    // Stores the encoded cluster and updates the index entry, releasing
+    // the previous copy. Zero clusters don't have any data. Called with
+    // the cluster lock held.
+    virtual wnbd::Task<DWORD> StoreCluster(
+        UINT64 Cluster, ClusterEncoding Encoding,
+        PBYTE Data, UINT32 Length, BOOLEAN ForceUnitAccess) = 0;
+
+public:
+    UINT64 GetSize() override { return Size; }
+    UINT32 GetSectorSize() override { return WNBD_DEFAULT_BLOCK_SIZE; }
+    bool IsUnmapSupported() override { return true; }
+
+    void GetStats(PWNBD_COMPRESSION_STATS Stats);
+
+    wnbd::Task<DWORD> Read(
+        PVOID Buffer, UINT64 Offset, UINT32 Length) override;
+    wnbd::Task<DWORD> Write(
+        PVOID Buffer, UINT64 Offset, UINT32 Length,
+        BOOLEAN ForceUnitAccess) override;
+    wnbd::Task<DWORD> Unmap(UINT64 Offset, UINT64 Length) override;
+};
@@ -0,0 +1,498 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "compressed_file_device.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+#include <algorithm>
+#include <winioctl.h>
+
+#define ENTRIES_PER_PAGE (COMPRESSED_FILE_PAGE_SIZE / sizeof(UINT64))
+// Synchronous index IO unit, used when loading the image.
+#define INDEX_IO_CHUNK_SIZE (64 << 20)
+
+#define ROUND_UP(Value, Alignment) \
+    (((Value) + (Alignment) - 1) / (Alignment) * (Alignment))
+
+static inline UINT32 GetPageCount(UINT32 Length)
+{
+    return (Length + COMPRESSED_FILE_PAGE_SIZE - 1) /
+        COMPRESSED_FILE_PAGE_SIZE;
+}
+
+CompressedFileDevice::~CompressedFileDevice()
+{
+    // Waits for the pending IO.
+    File.reset();
+    if (!DirtyIndexPages.empty()) {
+        PersistIndex();
+    }
+}
+
+DWORD CompressedFileDevice::LoadMetadata(
+    PWNBD_COMPRESSION_OPTIONS Options,
+    BOOLEAN ReadOnly,
+    UINT64 CreateSize)
+{
+    bool Create = false;
+    HANDLE Handle = CreateFileA(
+        Path.c_str(), GENERIC_READ | (ReadOnly ? 0 : GENERIC_WRITE),
+        0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (Handle == INVALID_HANDLE_VALUE &&
+            GetLastError() == ERROR_FILE_NOT_FOUND &&
+            CreateSize && !ReadOnly) {
+        Create = true;
+        Handle = CreateFileA(
+            Path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+            CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    if (Handle == INVALID_HANDLE_VALUE) {
+        DWORD Status = GetLastError();
+        LogError("Could not open compressed image: %s. "
+                 "Error: %d. Error message: %s",
+                 Path.c_str(), Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    COMPRESSED_FILE_HEADER Header = { 0 };
+    DWORD Status = 0;
+    if (Create) {
+        Status = InitializeClusters(
+            CreateSize, Options->Codec,
+            Options->ClusterSize ?
+                Options->ClusterSize : WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE,
+            ENTRIES_PER_PAGE);
+        if (Status) {
+            goto Exit;
+        }
+        IndexOffset = COMPRESSED_FILE_PAGE_SIZE;
+        IndexSize = IndexCapacity * sizeof(UINT64);
+        DataOffset = IndexOffset + IndexSize;
+        LogInfo("Creating compressed image: %s. Size: %llu. "
+                "Cluster size: %d.", Path.c_str(), Size, ClusterSize);
+
+        DWORD BytesReturned = 0;
+        if (!DeviceIoControl(
+                Handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0,
+                &BytesReturned, NULL)) {
+            Status = GetLastError();
+            goto Exit;
+        }
+        // The index is zeroed, being part of a sparse range. The data
+        // area is large enough to hold all the clusters uncompressed,
+        // unless the free space gets fragmented.
+        FILE_END_OF_FILE_INFO EndOfFile = { 0 };
+        EndOfFile.EndOfFile.QuadPart = DataOffset + ClusterCount * ClusterSize;
+        if (!SetFileInformationByHandle(
+                Handle, FileEndOfFileInfo, &EndOfFile, sizeof(EndOfFile))) {
+            Status = GetLastError();
+            goto Exit;
+        }
+
+        Header.Magic = COMPRESSED_FILE_MAGIC;
+        Header.Version = COMPRESSED_FILE_VERSION;
+        Header.ClusterSize = ClusterSize;
+        Header.DiskSize = Size;
+        Header.IndexOffset = IndexOffset;
+        Header.IndexSize = IndexSize;
+        Header.DataOffset = DataOffset;
+        // The header is written last, so that interrupted
+        // initializations get detected.
+        Status = WriteFileExact(Handle, 0, &Header, sizeof(Header));
+        if (!Status && !FlushFileBuffers(Handle)) {
+            Status = GetLastError();
+        }
+        goto Exit;
+    }
+
+    Status = ReadFileExact(Handle, 0, &Header, sizeof(Header));
+    if (Status) {
+        goto Exit;
+    }
+    if (Header.Magic != COMPRESSED_FILE_MAGIC ||
+            Header.Version != COMPRESSED_FILE_VERSION) {
+        LogError("Invalid or incompatible compressed image: %s. "
+                 "Version: %d.", Path.c_str(), Header.Version);
+        Status = ERROR_FILE_CORRUPT;
+        goto Exit;
+    }
+    if (Options->ClusterSize && Header.ClusterSize != Options->ClusterSize) {
+        LogError("The compressed image uses a different cluster size: %s. "
+                 "Image cluster size: %d, requested cluster size: %d.",
+                 Path.c_str(), Header.ClusterSize, Options->ClusterSize);
+        Status = ERROR_INVALID_PARAMETER;
+        goto Exit;
+    }
+    Status = InitializeClusters(
+        Header.DiskSize, Options->Codec, Header.ClusterSize,
+        ENTRIES_PER_PAGE);
+    if (Status) {
+        goto Exit;
+    }
+    IndexOffset = COMPRESSED_FILE_PAGE_SIZE;
+    IndexSize = IndexCapacity * sizeof(UINT64);
+    DataOffset = IndexOffset + IndexSize;
+    if (Header.IndexOffset != IndexOffset ||
+            Header.IndexSize != IndexSize ||
+            Header.DataOffset != DataOffset) {
+        LogError("Invalid compressed image layout: %s.", Path.c_str());
+        Status = ERROR_FILE_CORRUPT;
+        goto Exit;
+    }
+
+    for (UINT64 Offset = 0; Offset < IndexSize && !Status;
+            Offset += INDEX_IO_CHUNK_SIZE) {
+        Status = ReadFileExact(
+            Handle, IndexOffset + Offset, (PBYTE) Index.get() + Offset,
+            (DWORD) min(IndexSize - Offset, INDEX_IO_CHUNK_SIZE));
+    }
+
+Exit:
+    if (Status) {
+        LogError("Could not load compressed image: %s. "
+                 "Error: %d. Error message: %s",
+                 Path.c_str(), Status, win32_strerror(Status).c_str());
+    }
+    CloseHandle(Handle);
+    return Status;
+}
+
+void CompressedFileDevice::FreeExtent(UINT64 Page, UINT32 PageCount)
+{
+    try {
+        FreeExtents[PageCount].push_back(Page);
+    }
+    catch (const std::bad_alloc&) {
+        // Leaked until the image gets reopened.
+        LogWarning("Could not release compressed image extent. "
+                   "Page: %llu. Page count: %d.", Page, PageCount);
+    }
+}
+
+void CompressedFileDevice::FreeRange(UINT64 Page, UINT64 PageCount)
+{
+    UINT32 MaxPageCount = (UINT32) FreeExtents.size() - 1;
+    while (PageCount) {
+        UINT32 ExtentPages = (UINT32) min(PageCount, MaxPageCount);
+        FreeExtent(Page, ExtentPages);
+        Page += ExtentPages;
+        PageCount -= ExtentPages;
+    }
+}
+
+UINT64 CompressedFileDevice::AllocateExtent(UINT32 PageCount)
+{
+    // Prefer exact matches, splitting larger extents otherwise.
+    for (UINT32 Count = PageCount; Count < FreeExtents.size(); Count++) {
+        auto& Extents = FreeExtents[Count];
+        if (!Extents.empty()) {
+            UINT64 Page = Extents.back();
+            Extents.pop_back();
+            if (Count > PageCount) {
+                FreeExtent(Page + PageCount, Count - PageCount);
+            }
+            return Page;
+        }
+    }
+
+    UINT64 Page = DataEnd;
+    DataEnd += PageCount;
+    return Page;
+}
+
+DWORD CompressedFileDevice::RebuildFreeExtents()
+{
+    try {
+        FreeExtents.assign(ClusterSize / COMPRESSED_FILE_PAGE_SIZE + 1, {});
+
+        std::vector<Extent> Used;
+        for (UINT64 Cluster = 0; Cluster < IndexCapacity; Cluster++) {
+            ClusterEntry Entry = GetEntry(Cluster);
+            bool Valid = false;
+            switch ((ClusterEncoding) Entry.Encoding) {
+            case ClusterEncoding::Zero:
+                Valid = !Entry.Length;
+                break;
+            case ClusterEncoding::Raw:
+                Valid = Entry.Length == ClusterSize;
+                break;
+            default:
+                Valid = Entry.Length &&
+                    Entry.Length <= Codec.GetMaxCompressedSize();
+                break;
+            }
+            if (!Valid || (Cluster >= ClusterCount && Entry.Length)) {
+                LogError("Invalid compressed image index entry: %s. "
+                         "Cluster: %llu. Encoding: %d. Length: %d.",
+                         Path.c_str(), Cluster, (UINT32) Entry.Encoding,
+                         (UINT32) Entry.Length);
+                return ERROR_FILE_CORRUPT;
+            }
+            if (Entry.Length) {
+                Used.push_back(Extent {
+                    Entry.Location, GetPageCount((UINT32) Entry.Length) });
+            }
+        }
+
+        std::sort(Used.begin(), Used.end(),
+            [](const Extent& A, const Extent& B) { return A.Page < B.Page; });
+        UINT64 NextPage = 0;
+        for (const Extent& Stored : Used) {
+            if (Stored.Page < NextPage) {
+                LogError("Overlapping compressed image extents: %s. "
+                         "Page: %llu.", Path.c_str(), Stored.Page);
+                return ERROR_FILE_CORRUPT;
+            }
+            FreeRange(NextPage, Stored.Page - NextPage);
+            NextPage = Stored.Page + Stored.PageCount;
+        }
+        DataEnd = NextPage;
+    }
+    catch (const std::bad_alloc&) {
+        LogError("Could not allocate compressed image free space map.");
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    return 0;
+}
+
+DWORD CompressedFileDevice::Open(
+    PWNBD_FILE_OPTIONS Options,
+    BOOLEAN ReadOnly,
+    UINT64 CreateSize)
+{
+    Path = std::string(Options->Path, strnlen(Options->Path, MAX_PATH));
+    if (Path.empty()) {
+        LogError("No file path specified.");
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (Path.starts_with("\\\\.\\")) {
+        LogError("Compression is not supported with block devices: %s.",
+                 Path.c_str());
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    DWORD Status = LoadMetadata(Options->Compression, ReadOnly, CreateSize);
+    if (Status) {
+        return Status;
+    }
+    Status = RebuildFreeExtents();
+    if (Status) {
+        return Status;
+    }
+    CountEntries();
+
+    PageBuffer.reset((PBYTE) _aligned_malloc(
+        COMPRESSED_FILE_PAGE_SIZE, COMPRESSED_FILE_PAGE_SIZE));
+    if (!PageBuffer) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    File.reset(new (std::nothrow) FileDevice());
+    if (!File) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    WNBD_FILE_OPTIONS FileOptions = *Options;
+    FileOptions.Compression = nullptr;
+    Status = File->Open(&FileOptions, ReadOnly, 0);
+    if (Status) {
+        return Status;
+    }
+
+    WNBD_COMPRESSION_STATS Stats;
+    GetStats(&Stats);
+    LogInfo("Opened compressed image: %s. Size: %llu. Cluster size: %d. "
+            "Stored clusters: %llu/%llu. Stored bytes: %llu.",
+            Path.c_str(), Size, ClusterSize,
+            Stats.RawClusters + Stats.CompressedClusters,
+            ClusterCount, Stats.StoredBytes);
+    return 0;
+}
+
+void CompressedFileDevice::FillPageBuffer(UINT64 IndexPage)
+{
+    PUINT64 PageEntries = (PUINT64) PageBuffer.get();
+    for (UINT64 Entry = 0; Entry < ENTRIES_PER_PAGE; Entry++) {
+        PageEntries[Entry] = Index[IndexPage * ENTRIES_PER_PAGE + Entry].load();
+    }
+}
+
+DWORD CompressedFileDevice::PersistIndex()
+{
+    HANDLE Handle = CreateFileA(
+        Path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD Status = 0;
+    if (Handle == INVALID_HANDLE_VALUE) {
+        Status = GetLastError();
+    } else {
+        for (UINT64 IndexPage : DirtyIndexPages) {
+            FillPageBuffer(IndexPage);
+            Status = WriteFileExact(
+                Handle, IndexOffset + IndexPage * COMPRESSED_FILE_PAGE_SIZE,
+                PageBuffer.get(), COMPRESSED_FILE_PAGE_SIZE);
+            if (Status) {
+                break;
+            }
+        }
+        if (!Status && !FlushFileBuffers(Handle)) {
+            Status = GetLastError();
+        }
+        CloseHandle(Handle);
+    }
+
+    if (Status) {
+        LogError("Could not persist compressed image index: %s. "
+                 "Error: %d. Error message: %s",
+                 Path.c_str(), Status, win32_strerror(Status).c_str());
+    }
+    return Status;
+}
+
+wnbd::Task<DWORD> CompressedFileDevice::WriteIndexPage(
+    UINT64 IndexPage, BOOLEAN ForceUnitAccess)
+{
+    co_await IndexLock.Acquire();
+
+    FillPageBuffer(IndexPage);
+    DWORD Status = 0;
+    if (ForceUnitAccess) {
+        // The page may also reference clusters stored by non FUA writes.
+        // Their data was written before updating the index, so flushing
+        // after copying the page makes all the referenced data durable.
+        Status = co_await File->Flush();
+    }
+    if (!Status) {
+        Status = co_await File->Write(
+            PageBuffer.get(),
+            IndexOffset + IndexPage * COMPRESSED_FILE_PAGE_SIZE,
+            COMPRESSED_FILE_PAGE_SIZE, ForceUnitAccess);
+    }
+
+    IndexLock.Release();
+    co_return Status;
+}
+
+wnbd::Task<DWORD> CompressedFileDevice::LoadCluster(
+    ClusterEntry Entry, UINT32 Offset, UINT32 Length, PBYTE Buffer)
+{
+    // Compressed clusters are read up to the end of the last page, for
+    // unbuffered IO purposes.
+    if (Entry.Encoding != (UINT64) ClusterEncoding::Raw) {
+        Length = ROUND_UP(Length, COMPRESSED_FILE_PAGE_SIZE);
+    }
+    co_return co_await File->Read(
+        Buffer,
+        DataOffset + Entry.Location * COMPRESSED_FILE_PAGE_SIZE + Offset,
+        Length);
+}
+
+wnbd::Task<DWORD> CompressedFileDevice::StoreCluster(
+    UINT64 Cluster, ClusterEncoding Encoding,
+    PBYTE Data, UINT32 Length, BOOLEAN ForceUnitAccess)
+{
+    ClusterEntry Entry = { 0 };
+    Entry.Encoding = (UINT64) Encoding;
+    UINT32 PageCount = GetPageCount(Length);
+    if (Length) {
+        {
+            std::unique_lock Guard{AllocLock};
+            Entry.Location = AllocateExtent(PageCount);
+        }
+        Entry.Length = Length;
+
+        // The data buffers span whole pages. FUA writes get flushed
+        // along with the index page, see WriteIndexPage.
+        DWORD Status = co_await File->Write(
+            Data, DataOffset + Entry.Location * COMPRESSED_FILE_PAGE_SIZE,
+            PageCount * COMPRESSED_FILE_PAGE_SIZE, FALSE);
+        if (Status) {
+            std::unique_lock Guard{AllocLock};
+            FreeExtent(Entry.Location, PageCount);
+            co_return Status;
+        }
+    }
+
+    UINT64 IndexPage = Cluster / ENTRIES_PER_PAGE;
+    ClusterEntry Previous = GetEntry(Cluster);
+    bool Tracked = false;
+    {
+        std::unique_lock Guard{AllocLock};
+        try {
+            DirtyIndexPages.insert(IndexPage);
+            if (Previous.Length) {
+                PendingExtents.push_back(Extent {
+                    Previous.Location,
+                    GetPageCount((UINT32) Previous.Length) });
+            }
+            Tracked = true;
+        }
+        catch (const std::bad_alloc&) {
+            if (Length) {
+                FreeExtent(Entry.Location, PageCount);
+            }
+        }
+        if (Tracked) {
+            SetEntry(Cluster, Entry);
+        }
+    }
+    if (!Tracked) {
+        co_return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if (ForceUnitAccess) {
+        co_return co_await WriteIndexPage(IndexPage, TRUE);
+    }
+    co_return 0;
+}
+
+wnbd::Task<DWORD> CompressedFileDevice::Flush()
+{
+    std::vector<UINT64> IndexPages;
+    std::vector<Extent> Released;
+    {
+        std::unique_lock Guard{AllocLock};
+        try {
+            IndexPages.assign(DirtyIndexPages.begin(), DirtyIndexPages.end());
+        }
+        catch (const std::bad_alloc&) {
+        }
+        if (IndexPages.size() != DirtyIndexPages.size()) {
+            co_return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        DirtyIndexPages.clear();
+        Released.swap(PendingExtents);
+    }
+
+    DWORD Status = 0;
+    for (UINT64 IndexPage : IndexPages) {
+        Status = co_await WriteIndexPage(IndexPage, FALSE);
+        if (Status) {
+            break;
+        }
+    }
+    if (!Status) {
+        Status = co_await File->Flush();
+    }
+
+    std::unique_lock Guard{AllocLock};
+    if (Status) {
+        // Retried by the next flush.
+        try {
+            DirtyIndexPages.insert(IndexPages.begin(), IndexPages.end());
+            PendingExtents.insert(
+                PendingExtents.end(), Released.begin(), Released.end());
+        }
+        catch (const std::bad_alloc&) {
+        }
+        co_return Status;
+    }
+    // The persisted index no longer references the released extents.
+    for (const Extent& Free : Released) {
+        FreeExtent(Free.Page, Free.PageCount);
+    }
+    co_return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "compressed_device.h"
+#include "file_device.h"
+
+// "WNBDCMP1"
+#define COMPRESSED_FILE_MAGIC 0x31504D4344424E57ULL
+#define COMPRESSED_FILE_VERSION 1
+// Header and index IO unit as well as the data allocation unit, large
+// enough for unbuffered IO on 4k sector disks.
+#define COMPRESSED_FILE_PAGE_SIZE 4096
+
+// Compressed image layout: header page, cluster index (padded to
+// COMPRESSED_FILE_PAGE_SIZE) and the data area. The index entries hold
+// the data area page at which each cluster is stored.
+typedef struct
+{
+    UINT64 Magic;
+    UINT32 Version;
+    UINT32 ClusterSize;
+    UINT64 DiskSize;
+    UINT64 IndexOffset;
+    UINT64 IndexSize;
+    UINT64 DataOffset;
+} COMPRESSED_FILE_HEADER, *PCOMPRESSED_FILE_HEADER;
+
+// Compressed image file, see WNBD_FILE_OPTIONS.Compression.
+//
+// Rewritten clusters are stored at a new location, so that the data
+// referenced by the persisted index never gets overwritten. The index
+// pages are written back when flushing. FUA writes flush the data area
+// and then persist their index page right away, so that the other
+// entries of that page only reference durable data as well. The space
+// used by the previous copy only gets reused after the next flush, once
+// the index no longer references it.
+//
+// Free extents are kept in lists based on their size (in pages) and are
+// not coalesced while the image is in use. The free space gets rebuilt
+// based on the index when opening the image.
+class CompressedFileDevice : public CompressedDevice
+{
+private:
+    struct Extent
+    {
+        UINT64 Page;
+        UINT32 PageCount;
+    };
+
+    std::string Path;
+    std::unique_ptr<FileDevice> File;
+    UINT64 IndexOffset = 0;
+    UINT64 IndexSize = 0;
+    UINT64 DataOffset = 0;
+
+    // Protects the allocator state and the dirty page set.
+    std::mutex AllocLock;
+    // Indexed by page count, up to a whole cluster.
+    std::vector<std::vector<UINT64>> FreeExtents;
+    // Released extents that are still referenced by the persisted index.
+    std::vector<Extent> PendingExtents;
+    // The end of the used data area, in pages.
+    UINT64 DataEnd = 0;
+    std::set<UINT64> DirtyIndexPages;
+
+    // Serializes index page writes, so that the persisted pages don't
+    // get overwritten by older copies.
+    IoSlots IndexLock;
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> PageBuffer{
+        nullptr, &_aligned_free};
+
+    // Reads or initializes the image header and loads the index.
+    DWORD LoadMetadata(
+        PWNBD_COMPRESSION_OPTIONS Options,
+        BOOLEAN ReadOnly,
+        UINT64 CreateSize);
+    DWORD RebuildFreeExtents();
+    // Writes back the dirty index pages when closing the image, using
+    // synchronous IO.
+    DWORD PersistIndex();
+
+    // Must be called with the allocator lock held.
+    UINT64 AllocateExtent(UINT32 PageCount);
+    void FreeExtent(UINT64 Page, UINT32 PageCount);
+    void FreeRange(UINT64 Page, UINT64 PageCount);
+
+    void FillPageBuffer(UINT64 IndexPage);
+    wnbd::Task<DWORD> WriteIndexPage(
+        UINT64 IndexPage, BOOLEAN ForceUnitAccess);
+
+protected:
+    wnbd::Task<DWORD> LoadCluster(
+        ClusterEntry Entry, UINT32 Offset, UINT32 Length,
+        PBYTE Buffer) override;
+    wnbd::Task<DWORD> StoreCluster(
+        UINT64 Cluster, ClusterEncoding Encoding,
+        PBYTE Data, UINT32 Length, BOOLEAN ForceUnitAccess) override;
+
+public:
+    ~CompressedFileDevice();
+
+    // Images that don't exist are created if CreateSize is not 0,
+    // otherwise the image header determines the disk size. Existing
+    // images keep their cluster size.
+    DWORD Open(
+        PWNBD_FILE_OPTIONS Options,
+        BOOLEAN ReadOnly,
+        UINT64 CreateSize);
+
+    wnbd::Task<DWORD> Flush() override;
+};
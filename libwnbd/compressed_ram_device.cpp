@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "compressed_ram_device.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+// Heap allocations are 16 bytes aligned, which allows storing 47 bit
+// addresses (the user mode address space limit) in the cluster index.
+#define RAM_LOCATION_SHIFT 4
+
+static inline PBYTE GetAddress(ClusterEntry Entry)
+{
+    return (PBYTE) ((UINT_PTR) Entry.Location << RAM_LOCATION_SHIFT);
+}
+
+CompressedRamDevice::~CompressedRamDevice()
+{
+    // Releases all the stored clusters.
+    if (Heap) {
+        HeapDestroy(Heap);
+    }
+}
+
+DWORD CompressedRamDevice::Initialize(
+    UINT64 DeviceSize, PWNBD_COMPRESSION_OPTIONS Options)
+{
+    DWORD Status = InitializeClusters(
+        DeviceSize, Options->Codec,
+        Options->ClusterSize ?
+            Options->ClusterSize : WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE);
+    if (Status) {
+        return Status;
+    }
+
+    Heap = HeapCreate(0, 0, 0);
+    if (!Heap) {
+        Status = GetLastError();
+        LogError("Could not create heap. Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    LogInfo("Initialized compressed RAM disk. Size: %llu. "
+            "Cluster size: %d. Codec: %d.",
+            Size, ClusterSize, Options->Codec);
+    return 0;
+}
+
+wnbd::Task<DWORD> CompressedRamDevice::LoadCluster(
+    ClusterEntry Entry, UINT32 Offset, UINT32 Length, PBYTE Buffer)
+{
+    memcpy(Buffer, GetAddress(Entry) + Offset, Length);
+    co_return 0;
+}
+
+wnbd::Task<DWORD> CompressedRamDevice::StoreCluster(
+    UINT64 Cluster, ClusterEncoding Encoding,
+    PBYTE Data, UINT32 Length, BOOLEAN ForceUnitAccess)
+{
+    ClusterEntry Entry = { 0 };
+    Entry.Encoding = (UINT64) Encoding;
+    if (Length) {
+        PBYTE Stored = (PBYTE) HeapAlloc(Heap, 0, Length);
+        if (!Stored) {
+            co_return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        memcpy(Stored, Data, Length);
+        Entry.Location = (UINT_PTR) Stored >> RAM_LOCATION_SHIFT;
+        Entry.Length = Length;
+    }
+
+    ClusterEntry Previous = GetEntry(Cluster);
+    SetEntry(Cluster, Entry);
+    if (Previous.Length) {
+        HeapFree(Heap, 0, GetAddress(Previous));
+    }
+    co_return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include "compressed_device.h"
+
+// Compressed in-memory device, see WnbdRunCompressedRamDaemon.
+//
+// Each stored cluster is a separate allocation of the exact stored size,
+// using a private heap. The index entries hold the allocation address.
+class CompressedRamDevice : public CompressedDevice
+{
+private:
+    HANDLE Heap = NULL;
+
+protected:
+    wnbd::Task<DWORD> LoadCluster(
+        ClusterEntry Entry, UINT32 Offset, UINT32 Length,
+        PBYTE Buffer) override;
+    wnbd::Task<DWORD> StoreCluster(
+        UINT64 Cluster, ClusterEncoding Encoding,
+        PBYTE Data, UINT32 Length, BOOLEAN ForceUnitAccess) override;
+
+public:
+    ~CompressedRamDevice();
+
+    DWORD Initialize(UINT64 DeviceSize, PWNBD_COMPRESSION_OPTIONS Options);
+
+    wnbd::Task<DWORD> Flush() override { co_return 0; }
+};
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "crc32c.h"
+
+#include <intrin.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+// Reversed Castagnoli polynomial.
+#define CRC32C_POLY 0x82F63B78
+
+// Stream lengths, 3 * 1360 + 16 = 4096 and 3 * 168 + 8 = 512.
+#define CRC32C_LONG_STREAM 1360
+#define CRC32C_SHORT_STREAM 168
+
+// Returns x^N mod P, bit reflected.
+static UINT64 XPowMod(UINT32 N)
+{
+    UINT32 Value = 0x80000000;
+    for (UINT32 Idx = 0; Idx < N; Idx++) {
+        Value = (Value >> 1) ^ (Value & 1 ? CRC32C_POLY : 0);
+    }
+    return Value;
+}
+
+// Constants used to append "Length" zero bytes to a partial checksum.
+// The carry-less product of the checksum and x^(8 * Length - 33) gets
+// reduced by the CRC32 instruction, which multiplies it by x^32. The
+// remaining power of x comes from the product of two reflected values.
+static UINT64 GetShiftConstant(UINT32 Length)
+{
+    return XPowMod(8 * Length - 33);
+}
+
+struct ShiftConstants
+{
+    UINT64 Long = GetShiftConstant(CRC32C_LONG_STREAM);
+    UINT64 Long2 = GetShiftConstant(CRC32C_LONG_STREAM * 2);
+    UINT64 Short = GetShiftConstant(CRC32C_SHORT_STREAM);
+    UINT64 Short2 = GetShiftConstant(CRC32C_SHORT_STREAM * 2);
+};
+
+static const ShiftConstants Constants;
+
+static UINT32 ShiftCrc(UINT32 Crc, UINT64 Constant)
+{
+    __m128i Product = _mm_clmulepi64_si128(
+        _mm_cvtsi32_si128((int) Crc), _mm_cvtsi64_si128(Constant), 0);
+    return (UINT32) _mm_crc32_u64(0, _mm_cvtsi128_si64(Product));
+}
+
+static UINT64 Load64(const BYTE* Data)
+{
+    UINT64 Value;
+    memcpy(&Value, Data, sizeof(Value));
+    return Value;
+}
+
+// Processes as many three stream blocks as possible.
+template <UINT32 StreamLength>
+static UINT32 ComputeStreams(
+    const BYTE*& Data, SIZE_T& Size, UINT32 Crc,
+    UINT64 Shift, UINT64 Shift2)
+{
+    while (Size >= StreamLength * 3) {
+        UINT64 Crc0 = Crc;
+        UINT64 Crc1 = 0;
+        UINT64 Crc2 = 0;
+        for (UINT32 Offset = 0; Offset < StreamLength; Offset += 8) {
+            Crc0 = _mm_crc32_u64(Crc0, Load64(Data + Offset));
+            Crc1 = _mm_crc32_u64(
+                Crc1, Load64(Data + StreamLength + Offset));
+            Crc2 = _mm_crc32_u64(
+                Crc2, Load64(Data + StreamLength * 2 + Offset));
+        }
+        Crc = ShiftCrc((UINT32) Crc0, Shift2) ^
+            ShiftCrc((UINT32) Crc1, Shift) ^ (UINT32) Crc2;
+        Data += StreamLength * 3;
+        Size -= StreamLength * 3;
+    }
+    return Crc;
+}
+
+bool Crc32c::IsSupported()
+{
+    int CpuInfo[4] = { 0 };
+    __cpuid(CpuInfo, 1);
+    // SSE4.2 and PCLMULQDQ
+    return (CpuInfo[2] & (1 << 20 | 1 << 1)) == (1 << 20 | 1 << 1);
+}
+
+UINT32 Crc32c::Compute(const void* Data, SIZE_T Size, UINT32 Crc)
+{
+    const BYTE* Bytes = (const BYTE*) Data;
+    Crc = ~Crc;
+
+    Crc = ComputeStreams<CRC32C_LONG_STREAM>(
+        Bytes, Size, Crc, Constants.Long, Constants.Long2);
+    Crc = ComputeStreams<CRC32C_SHORT_STREAM>(
+        Bytes, Size, Crc, Constants.Short, Constants.Short2);
+
+    UINT64 Crc64 = Crc;
+    for (; Size >= 8; Bytes += 8, Size -= 8) {
+        Crc64 = _mm_crc32_u64(Crc64, Load64(Bytes));
+    }
+    Crc = (UINT32) Crc64;
+    for (; Size; Bytes++, Size--) {
+        Crc = _mm_crc32_u8(Crc, *Bytes);
+    }
+    return ~Crc;
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+// CRC32C (Castagnoli), using the SSE4.2 CRC32 instruction.
+//
+// The CRC32 instruction has a 3 cycle latency but can be issued every
+// cycle, so larger buffers are split in three streams that are processed
+// at the same time. The partial checksums are then combined using
+// PCLMULQDQ. The stream lengths are chosen so that 512B and 4KB blocks
+// are almost entirely covered.
+class Crc32c
+{
+public:
+    // Checks for SSE4.2 and PCLMULQDQ support.
+    static bool IsSupported();
+
+    // Returns the standard CRC32C of the buffer. The previous checksum
+    // may be passed in order to continue the computation, in which case
+    // Compute(B, Compute(A)) matches the checksum of A followed by B.
+    static UINT32 Compute(const void* Data, SIZE_T Size, UINT32 Crc = 0);
+};
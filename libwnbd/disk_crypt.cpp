@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "disk_crypt.h"
+#include "wnbd_log.h"
+
+DWORD DiskCrypt::Initialize(PWNBD_DISK Disk, PWNBD_ENCRYPTION_OPTIONS Options)
+{
+    BlockSize = Disk->Properties.BlockSize;
+    DataUnitSize = Options->DataUnitSize ? Options->DataUnitSize : BlockSize;
+    if ((DataUnitSize != 512 && DataUnitSize != 4096) ||
+            !BlockSize || BlockSize % DataUnitSize) {
+        LogError("Invalid encryption data unit size: %d. Expecting 512 or "
+                 "4096, not exceeding the disk block size (%d).",
+                 DataUnitSize, BlockSize);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (Options->KeySize > WNBD_MAX_ENCRYPTION_KEY_SIZE) {
+        LogError("Invalid encryption key size: %d.", Options->KeySize);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    DWORD Status = Cipher.SetKey(Options->Key, Options->KeySize);
+    if (Status) {
+        return Status;
+    }
+
+    LogInfo("Disk encryption enabled. Cipher: AES-%d-XTS. "
+            "Data unit size: %d.", Options->KeySize * 4, DataUnitSize);
+    return 0;
+}
+
+void DiskCrypt::EncryptWrite(
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount)
+{
+    UINT32 UnitsPerBlock = BlockSize / DataUnitSize;
+    Cipher.Encrypt(
+        Buffer, DataUnitSize, BlockCount * UnitsPerBlock,
+        BlockAddress * UnitsPerBlock);
+}
+
+bool DiskCrypt::ReadFetched(PWNBD_IO_REQUEST Request)
+{
+    PendingRead Read = { 0 };
+    Read.DataUnit = Request->Cmd.Read.BlockAddress * (BlockSize / DataUnitSize);
+    Read.Length = Request->Cmd.Read.BlockCount * BlockSize;
+
+    PendingShard& Shard = GetShard(Request->RequestHandle);
+    try {
+        std::unique_lock ShardLock{Shard.Lock};
+        Shard.Reads[Request->RequestHandle] = Read;
+    }
+    catch (const std::bad_alloc&) {
+        return false;
+    }
+    return true;
+}
+
+void DiskCrypt::ReadCompleted(
+    PWNBD_IO_RESPONSE Response, PVOID Buffer, UINT32 BufferSize)
+{
+    PendingRead Read;
+    {
+        PendingShard& Shard = GetShard(Response->RequestHandle);
+        std::unique_lock ShardLock{Shard.Lock};
+        auto It = Shard.Reads.find(Response->RequestHandle);
+        if (It == Shard.Reads.end()) {
+            return;
+        }
+        Read = It->second;
+        Shard.Reads.erase(It);
+    }
+
+    if (Response->Status.ScsiStatus || !Buffer) {
+        return;
+    }
+    UINT32 Length = min(Read.Length, BufferSize);
+    Cipher.Decrypt(Buffer, DataUnitSize, Length / DataUnitSize, Read.DataUnit);
+}
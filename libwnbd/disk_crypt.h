@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <mutex>
+#include <unordered_map>
+
+#include "aes_xts.h"
+#include "wnbd.h"
+
+#define WNBD_CRYPT_PENDING_SHARDS 16
+
+// Disk encryption stage, see WnbdEnableEncryption.
+//
+// Write payloads are encrypted in place before being passed to the IO
+// callbacks, while read payloads are decrypted in place when sending
+// the response. The read location isn't part of the response, so it's
+// kept aside until then, using a map that's sharded by request handle.
+class DiskCrypt
+{
+private:
+    struct PendingRead
+    {
+        UINT64 DataUnit;
+        UINT32 Length;
+    };
+
+    struct PendingShard
+    {
+        std::mutex Lock;
+        std::unordered_map<UINT64, PendingRead> Reads;
+    };
+
+    AesXts Cipher;
+    UINT32 BlockSize = 0;
+    UINT32 DataUnitSize = 0;
+
+    PendingShard PendingShards[WNBD_CRYPT_PENDING_SHARDS];
+
+    PendingShard& GetShard(UINT64 RequestHandle) {
+        return PendingShards[RequestHandle % WNBD_CRYPT_PENDING_SHARDS];
+    }
+
+public:
+    DWORD Initialize(PWNBD_DISK Disk, PWNBD_ENCRYPTION_OPTIONS Options);
+
+    void EncryptWrite(PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount);
+    // Returns false if the request couldn't be tracked, in which case
+    // it must be rejected.
+    bool ReadFetched(PWNBD_IO_REQUEST Request);
+    void ReadCompleted(
+        PWNBD_IO_RESPONSE Response, PVOID Buffer, UINT32 BufferSize);
+};
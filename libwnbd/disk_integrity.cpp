@@ -0,0 +1,603 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "crc32c.h"
+#include "disk_integrity.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+#include <algorithm>
+#include <bit>
+
+#define _NTSCSI_USER_MODE_
+#include <scsi.h>
+
+#define INTEGRITY_VALID_WORDS (INTEGRITY_CHUNK_BLOCKS / 64)
+
+// Sidecar chunk record.
+struct SidecarChunk
+{
+    UINT64 Index;
+    UINT64 Valid[INTEGRITY_VALID_WORDS];
+    UINT32 Checksums[INTEGRITY_CHUNK_BLOCKS];
+};
+
+// Applies "Func" to the bitmap words covering the specified range,
+// passing the word and the range mask.
+template <typename WordFunc>
+static void ForEachWord(
+    UINT64* Bits, UINT32 First, UINT32 Count, WordFunc Func)
+{
+    while (Count) {
+        UINT32 Bit = First % 64;
+        UINT32 Span = min(Count, 64 - Bit);
+        UINT64 Mask = (Span == 64 ? ~0ULL : (1ULL << Span) - 1) << Bit;
+        Func(Bits[First / 64], Mask);
+        First += Span;
+        Count -= Span;
+    }
+}
+
+// Returns the number of bits that were previously set.
+static UINT64 ClearBits(UINT64* Bits, UINT32 First, UINT32 Count)
+{
+    UINT64 Cleared = 0;
+    ForEachWord(Bits, First, Count, [&](UINT64& Word, UINT64 Mask) {
+        Cleared += std::popcount(Word & Mask);
+        Word &= ~Mask;
+    });
+    return Cleared;
+}
+
+// Returns the number of bits that were previously cleared.
+static UINT64 SetBits(UINT64* Bits, UINT32 First, UINT32 Count)
+{
+    UINT64 Set = 0;
+    ForEachWord(Bits, First, Count, [&](UINT64& Word, UINT64 Mask) {
+        Set += std::popcount(~Word & Mask);
+        Word |= Mask;
+    });
+    return Set;
+}
+
+static UINT64 CountBits(const UINT64* Bits)
+{
+    UINT64 Count = 0;
+    for (UINT32 Idx = 0; Idx < INTEGRITY_VALID_WORDS; Idx++) {
+        Count += std::popcount(Bits[Idx]);
+    }
+    return Count;
+}
+
+DiskIntegrity::~DiskIntegrity()
+{
+    if (Sidecar != INVALID_HANDLE_VALUE) {
+        SaveSidecar();
+        CloseHandle(Sidecar);
+    }
+    for (UINT64 Idx = 0; Idx < ChunkCount; Idx++) {
+        delete Chunks[Idx].load();
+    }
+}
+
+DWORD DiskIntegrity::Initialize(
+    PWNBD_DISK Disk, PWNBD_INTEGRITY_OPTIONS Options)
+{
+    if (!Crc32c::IsSupported()) {
+        LogError("Integrity checks require a processor that supports "
+                 "SSE4.2 and PCLMULQDQ.");
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    BlockSize = Disk->Properties.BlockSize;
+    BlockCount = Disk->Properties.BlockCount;
+    if (!BlockSize || !BlockCount) {
+        LogError("Invalid disk geometry. Block size: %d, "
+                 "block count: %llu.", BlockSize, BlockCount);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    ChunkCount = (BlockCount + INTEGRITY_CHUNK_BLOCKS - 1) /
+        INTEGRITY_CHUNK_BLOCKS;
+    Chunks.reset(new (std::nothrow) std::atomic<Chunk*>[ChunkCount]());
+    if (!Chunks) {
+        LogError("Could not allocate the checksum map. "
+                 "Chunk count: %llu.", ChunkCount);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if (Options->SidecarPath[0]) {
+        DWORD Status = LoadSidecar(Options->SidecarPath);
+        if (Status) {
+            return Status;
+        }
+    }
+
+    LogInfo("Block integrity checks enabled. Block size: %d. "
+            "Sidecar file: %s. Known checksums: %llu.",
+            BlockSize, Options->SidecarPath[0] ?
+                Options->SidecarPath : "none",
+            TrackedBlocks.load());
+    return 0;
+}
+
+DiskIntegrity::Chunk* DiskIntegrity::GetChunk(UINT64 ChunkIndex, bool Allocate)
+{
+    Chunk* Current = Chunks[ChunkIndex].load();
+    if (Current || !Allocate) {
+        return Current;
+    }
+
+    Chunk* New = new (std::nothrow) Chunk();
+    if (!New) {
+        return nullptr;
+    }
+    if (!Chunks[ChunkIndex].compare_exchange_strong(Current, New)) {
+        delete New;
+        return Current;
+    }
+    return New;
+}
+
+bool DiskIntegrity::IsValidRange(UINT64 BlockAddress, UINT64 Count)
+{
+    return Count && BlockAddress < BlockCount &&
+        Count <= BlockCount - BlockAddress;
+}
+
+bool DiskIntegrity::TrackRequest(
+    UINT64 RequestHandle, PendingRequest&& Request)
+{
+    PendingShard& Shard = GetShard(RequestHandle);
+    try {
+        std::unique_lock ShardLock{Shard.Lock};
+        Shard.Requests[RequestHandle] = std::move(Request);
+    }
+    catch (const std::bad_alloc&) {
+        return false;
+    }
+    return true;
+}
+
+bool DiskIntegrity::TakeRequest(
+    UINT64 RequestHandle, PendingRequest* Request)
+{
+    PendingShard& Shard = GetShard(RequestHandle);
+    std::unique_lock ShardLock{Shard.Lock};
+    auto It = Shard.Requests.find(RequestHandle);
+    if (It == Shard.Requests.end()) {
+        return false;
+    }
+    *Request = std::move(It->second);
+    Shard.Requests.erase(It);
+    return true;
+}
+
+void DiskIntegrity::Invalidate(
+    UINT64 BlockAddress, UINT64 Count, const UINT64* WriteHandle)
+{
+    UINT64 Epoch = ++WriteEpoch;
+    while (Count) {
+        UINT64 ChunkIndex = BlockAddress / INTEGRITY_CHUNK_BLOCKS;
+        UINT32 FirstBlock = (UINT32) (BlockAddress % INTEGRITY_CHUNK_BLOCKS);
+        UINT32 ChunkBlocks = (UINT32) min(
+            Count, (UINT64) (INTEGRITY_CHUNK_BLOCKS - FirstBlock));
+
+        // Writes need the chunk in order to be tracked, which is used
+        // anyway once the write completes.
+        Chunk* Current = GetChunk(ChunkIndex, WriteHandle != nullptr);
+        if (Current) {
+            std::unique_lock Guard{GetChunkLock(ChunkIndex)};
+            TrackedBlocks -= ClearBits(
+                Current->Valid, FirstBlock, ChunkBlocks);
+            Current->Epoch = Epoch;
+
+            bool Conflict = false;
+            for (InFlightWrite& Write : Current->InFlight) {
+                if (Write.FirstBlock < FirstBlock + ChunkBlocks &&
+                        FirstBlock < Write.FirstBlock + Write.BlockCount) {
+                    Write.Conflict = true;
+                    Conflict = true;
+                }
+            }
+            if (WriteHandle) {
+                // Untracked writes don't update the checksums.
+                try {
+                    Current->InFlight.push_back(
+                        { *WriteHandle, FirstBlock, ChunkBlocks, Conflict });
+                }
+                catch (const std::bad_alloc&) {
+                }
+            }
+        }
+
+        BlockAddress += ChunkBlocks;
+        Count -= ChunkBlocks;
+    }
+}
+
+void DiskIntegrity::ReadFetched(PWNBD_IO_REQUEST Request)
+{
+    if (!IsValidRange(Request->Cmd.Read.BlockAddress,
+                      Request->Cmd.Read.BlockCount)) {
+        return;
+    }
+
+    PendingRequest Read;
+    Read.BlockAddress = Request->Cmd.Read.BlockAddress;
+    Read.BlockCount = Request->Cmd.Read.BlockCount;
+    Read.Epoch = WriteEpoch.load();
+    // Reads that can't be tracked aren't verified.
+    TrackRequest(Request->RequestHandle, std::move(Read));
+}
+
+void DiskIntegrity::ReadCompleted(
+    PWNBD_IO_RESPONSE Response, PVOID Buffer, UINT32 BufferSize)
+{
+    PendingRequest Read;
+    if (!TakeRequest(Response->RequestHandle, &Read)) {
+        return;
+    }
+    if (Response->Status.ScsiStatus || !Buffer) {
+        return;
+    }
+
+    UINT64 BlockAddress = Read.BlockAddress;
+    UINT32 Remaining = min(Read.BlockCount, BufferSize / BlockSize);
+    UINT32 TotalBlocks = Remaining;
+    const BYTE* Data = (const BYTE*) Buffer;
+    UINT64 Checked = 0;
+    UINT64 Errors = 0;
+    UINT64 FirstError = 0;
+    // The checksums are copied so that they can be verified without
+    // holding the chunk lock.
+    UINT64 Valid[INTEGRITY_VALID_WORDS];
+    UINT32 Checksums[INTEGRITY_CHUNK_BLOCKS];
+    while (Remaining) {
+        UINT64 ChunkIndex = BlockAddress / INTEGRITY_CHUNK_BLOCKS;
+        UINT32 FirstBlock = (UINT32) (BlockAddress % INTEGRITY_CHUNK_BLOCKS);
+        UINT32 ChunkBlocks = min(
+            Remaining, INTEGRITY_CHUNK_BLOCKS - FirstBlock);
+
+        bool Changed = true;
+        Chunk* Current = GetChunk(ChunkIndex, false);
+        if (Current) {
+            std::unique_lock Guard{GetChunkLock(ChunkIndex)};
+            // Skip chunks changed by writes that may have overlapped
+            // with this read.
+            if (Current->Epoch <= Read.Epoch) {
+                Changed = false;
+                memcpy(Valid, Current->Valid, sizeof(Valid));
+                memcpy(Checksums + FirstBlock,
+                       Current->Checksums + FirstBlock,
+                       ChunkBlocks * sizeof(UINT32));
+            }
+        }
+
+        for (UINT32 Idx = 0; !Changed && Idx < ChunkBlocks; Idx++) {
+            UINT32 Block = FirstBlock + Idx;
+            if (!(Valid[Block / 64] & (1ULL << (Block % 64)))) {
+                continue;
+            }
+            Checked++;
+            UINT32 Checksum = Crc32c::Compute(
+                Data + (SIZE_T) Idx * BlockSize, BlockSize);
+            if (Checksum != Checksums[Block] && !Errors++) {
+                FirstError = BlockAddress + Idx;
+            }
+        }
+
+        BlockAddress += ChunkBlocks;
+        Data += (SIZE_T) ChunkBlocks * BlockSize;
+        Remaining -= ChunkBlocks;
+    }
+
+    VerifiedBlocks += Checked - Errors;
+    UnverifiedBlocks += TotalBlocks - Checked;
+    if (Errors) {
+        ChecksumErrors += Errors;
+        LogError("Data integrity check failed. Request handle: %llu. "
+                 "Read: %llu~%u. Mismatching blocks: %llu, first: %llu.",
+                 Response->RequestHandle, Read.BlockAddress,
+                 Read.BlockCount, Errors, FirstError);
+        WnbdSetSenseEx(
+            &Response->Status,
+            SCSI_SENSE_MEDIUM_ERROR,
+            SCSI_ADSENSE_UNRECOVERED_ERROR,
+            FirstError);
+    }
+}
+
+void DiskIntegrity::WriteFetched(PWNBD_IO_REQUEST Request, PVOID Buffer)
+{
+    UINT64 BlockAddress = Request->Cmd.Write.BlockAddress;
+    UINT32 Count = Request->Cmd.Write.BlockCount;
+    if (!IsValidRange(BlockAddress, Count)) {
+        return;
+    }
+
+    Invalidate(BlockAddress, Count, &Request->RequestHandle);
+
+    // The request is tracked even if the checksums can't be computed,
+    // so that the in flight writes get cleaned up.
+    PendingRequest Write;
+    Write.BlockAddress = BlockAddress;
+    Write.BlockCount = Count;
+    try {
+        Write.Checksums.resize(Count);
+    }
+    catch (const std::bad_alloc&) {
+    }
+    for (UINT32 Idx = 0; Idx < Write.Checksums.size(); Idx++) {
+        Write.Checksums[Idx] = Crc32c::Compute(
+            (PBYTE) Buffer + (SIZE_T) Idx * BlockSize, BlockSize);
+    }
+
+    if (!TrackRequest(Request->RequestHandle, std::move(Write))) {
+        // The blocks are left without checksums.
+        PendingRequest Untracked;
+        Untracked.BlockAddress = BlockAddress;
+        Untracked.BlockCount = Count;
+        FinishWrite(Request->RequestHandle, Untracked, false);
+    }
+}
+
+void DiskIntegrity::WriteCompleted(PWNBD_IO_RESPONSE Response)
+{
+    PendingRequest Write;
+    if (TakeRequest(Response->RequestHandle, &Write)) {
+        FinishWrite(
+            Response->RequestHandle, Write, !Response->Status.ScsiStatus);
+    }
+}
+
+void DiskIntegrity::FinishWrite(
+    UINT64 RequestHandle, const PendingRequest& Write, bool Succeeded)
+{
+    bool Store = Succeeded && !Write.Checksums.empty();
+    UINT64 Epoch = ++WriteEpoch;
+    UINT64 BlockAddress = Write.BlockAddress;
+    UINT32 Remaining = Write.BlockCount;
+    const UINT32* Checksums = Write.Checksums.data();
+    while (Remaining) {
+        UINT64 ChunkIndex = BlockAddress / INTEGRITY_CHUNK_BLOCKS;
+        UINT32 FirstBlock = (UINT32) (BlockAddress % INTEGRITY_CHUNK_BLOCKS);
+        UINT32 ChunkBlocks = min(
+            Remaining, INTEGRITY_CHUNK_BLOCKS - FirstBlock);
+
+        // Allocated when the write was fetched.
+        Chunk* Current = GetChunk(ChunkIndex, false);
+        if (Current) {
+            std::unique_lock Guard{GetChunkLock(ChunkIndex)};
+            auto It = std::find_if(
+                Current->InFlight.begin(), Current->InFlight.end(),
+                [&](const InFlightWrite& InFlight) {
+                    return InFlight.RequestHandle == RequestHandle;
+                });
+            if (It != Current->InFlight.end()) {
+                bool Conflict = It->Conflict;
+                Current->InFlight.erase(It);
+                if (Store && !Conflict) {
+                    memcpy(Current->Checksums + FirstBlock, Checksums,
+                           ChunkBlocks * sizeof(UINT32));
+                    TrackedBlocks += SetBits(
+                        Current->Valid, FirstBlock, ChunkBlocks);
+                    Current->Epoch = Epoch;
+                }
+            }
+        }
+
+        BlockAddress += ChunkBlocks;
+        if (Checksums) {
+            Checksums += ChunkBlocks;
+        }
+        Remaining -= ChunkBlocks;
+    }
+}
+
+void DiskIntegrity::UnmapFetched(
+    PWNBD_UNMAP_DESCRIPTOR Descriptors, UINT32 Count)
+{
+    for (UINT32 Idx = 0; Idx < Count; Idx++) {
+        if (IsValidRange(Descriptors[Idx].BlockAddress,
+                         Descriptors[Idx].BlockCount)) {
+            Invalidate(
+                Descriptors[Idx].BlockAddress, Descriptors[Idx].BlockCount);
+        }
+    }
+}
+
+void DiskIntegrity::GetStats(PWNBD_INTEGRITY_STATS Stats)
+{
+    *Stats = { 0 };
+    Stats->VerifiedBlocks = VerifiedBlocks;
+    Stats->UnverifiedBlocks = UnverifiedBlocks;
+    Stats->ChecksumErrors = ChecksumErrors;
+    Stats->TrackedBlocks = TrackedBlocks;
+}
+
+DWORD DiskIntegrity::LoadSidecar(PCSTR Path)
+{
+    Sidecar = CreateFileA(
+        Path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (Sidecar == INVALID_HANDLE_VALUE) {
+        DWORD Status = GetLastError();
+        LogError("Could not open integrity sidecar file: %s. "
+                 "Error: %d. Error message: %s",
+                 Path, Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    LARGE_INTEGER FileSize = { 0 };
+    if (!GetFileSizeEx(Sidecar, &FileSize)) {
+        DWORD Status = GetLastError();
+        LogError("Could not retrieve integrity sidecar file size. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    INTEGRITY_SIDECAR_HEADER Header = { 0 };
+    if (FileSize.QuadPart) {
+        DWORD Status = ReadFileExact(Sidecar, 0, &Header, sizeof(Header));
+        if (Status && Status != ERROR_HANDLE_EOF) {
+            LogError("Could not read integrity sidecar file header. "
+                     "Error: %d. Error message: %s",
+                     Status, win32_strerror(Status).c_str());
+            return Status;
+        }
+        // Refuse to overwrite unrelated files.
+        if (Status || Header.Magic != INTEGRITY_SIDECAR_MAGIC ||
+                Header.Version != INTEGRITY_SIDECAR_VERSION) {
+            LogError("Invalid integrity sidecar file: %s.", Path);
+            return ERROR_INVALID_DATA;
+        }
+    }
+
+    if (!FileSize.QuadPart) {
+        // New sidecar file.
+    } else if (Header.BlockSize != BlockSize ||
+            Header.BlockCount != BlockCount) {
+        LogWarning("The disk geometry changed, discarding the checksums. "
+                   "Previous block size: %d, block count: %llu.",
+                   Header.BlockSize, Header.BlockCount);
+    } else if (!Header.Clean) {
+        LogWarning("The disk wasn't closed cleanly, "
+                   "discarding the checksums.");
+    } else {
+        std::unique_ptr<SidecarChunk> Record(
+            new (std::nothrow) SidecarChunk());
+        if (!Record) {
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+
+        bool Corrupted = false;
+        UINT32 Crc = 0;
+        for (UINT64 Idx = 0; Idx < Header.ChunkCount && !Corrupted; Idx++) {
+            DWORD Status = ReadFileExact(
+                Sidecar, sizeof(Header) + Idx * sizeof(SidecarChunk),
+                Record.get(), sizeof(SidecarChunk));
+            if (Status == ERROR_HANDLE_EOF) {
+                Corrupted = true;
+                break;
+            }
+            if (Status) {
+                LogError("Could not read integrity sidecar file. "
+                         "Error: %d. Error message: %s",
+                         Status, win32_strerror(Status).c_str());
+                return Status;
+            }
+            Crc = Crc32c::Compute(Record.get(), sizeof(SidecarChunk), Crc);
+
+            if (Record->Index >= ChunkCount || Chunks[Record->Index]) {
+                Corrupted = true;
+                break;
+            }
+            Chunk* Loaded = GetChunk(Record->Index, true);
+            if (!Loaded) {
+                return ERROR_NOT_ENOUGH_MEMORY;
+            }
+            memcpy(Loaded->Valid, Record->Valid, sizeof(Loaded->Valid));
+            memcpy(Loaded->Checksums, Record->Checksums,
+                   sizeof(Loaded->Checksums));
+            TrackedBlocks += CountBits(Loaded->Valid);
+        }
+
+        if (Corrupted || Crc != Header.ChunksCrc) {
+            LogWarning("Corrupted integrity sidecar file, "
+                       "discarding the checksums.");
+            for (UINT64 Idx = 0; Idx < ChunkCount; Idx++) {
+                delete Chunks[Idx].exchange(nullptr);
+            }
+            TrackedBlocks = 0;
+        }
+    }
+
+    // Mark the file as in use, the checksums being persisted when
+    // closing the disk.
+    Header = { 0 };
+    Header.Magic = INTEGRITY_SIDECAR_MAGIC;
+    Header.Version = INTEGRITY_SIDECAR_VERSION;
+    Header.BlockSize = BlockSize;
+    Header.BlockCount = BlockCount;
+    DWORD Status = WriteFileExact(Sidecar, 0, &Header, sizeof(Header));
+    if (!Status && !FlushFileBuffers(Sidecar)) {
+        Status = GetLastError();
+    }
+    if (Status) {
+        LogError("Could not write integrity sidecar file header. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+    }
+    return Status;
+}
+
+DWORD DiskIntegrity::SaveSidecar()
+{
+    std::unique_ptr<SidecarChunk> Record(new (std::nothrow) SidecarChunk());
+    if (!Record) {
+        LogError("Could not allocate memory.");
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    DWORD Status = 0;
+    UINT64 Saved = 0;
+    UINT32 Crc = 0;
+    for (UINT64 Idx = 0; Idx < ChunkCount && !Status; Idx++) {
+        Chunk* Current = Chunks[Idx].load();
+        if (!Current || !CountBits(Current->Valid)) {
+            continue;
+        }
+        Record->Index = Idx;
+        memcpy(Record->Valid, Current->Valid, sizeof(Record->Valid));
+        memcpy(Record->Checksums, Current->Checksums,
+               sizeof(Record->Checksums));
+        Crc = Crc32c::Compute(Record.get(), sizeof(SidecarChunk), Crc);
+        Status = WriteFileExact(
+            Sidecar,
+            sizeof(INTEGRITY_SIDECAR_HEADER) + Saved * sizeof(SidecarChunk),
+            Record.get(), sizeof(SidecarChunk));
+        Saved++;
+    }
+
+    LARGE_INTEGER End = { 0 };
+    End.QuadPart = sizeof(INTEGRITY_SIDECAR_HEADER) +
+        Saved * sizeof(SidecarChunk);
+    if (!Status && (!SetFilePointerEx(Sidecar, End, NULL, FILE_BEGIN) ||
+            !SetEndOfFile(Sidecar))) {
+        Status = GetLastError();
+    }
+    // The chunks must be persisted before marking the file as clean.
+    if (!Status && !FlushFileBuffers(Sidecar)) {
+        Status = GetLastError();
+    }
+
+    if (!Status) {
+        INTEGRITY_SIDECAR_HEADER Header = { 0 };
+        Header.Magic = INTEGRITY_SIDECAR_MAGIC;
+        Header.Version = INTEGRITY_SIDECAR_VERSION;
+        Header.BlockSize = BlockSize;
+        Header.BlockCount = BlockCount;
+        Header.ChunkCount = Saved;
+        Header.ChunksCrc = Crc;
+        Header.Clean = 1;
+        Status = WriteFileExact(Sidecar, 0, &Header, sizeof(Header));
+        if (!Status && !FlushFileBuffers(Sidecar)) {
+            Status = GetLastError();
+        }
+    }
+
+    if (Status) {
+        LogError("Could not save integrity sidecar file. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+    } else {
+        LogInfo("Saved integrity sidecar file. Known checksums: %llu.",
+                TrackedBlocks.load());
+    }
+    return Status;
+}
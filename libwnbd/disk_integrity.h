@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "wnbd.h"
+
+#define WNBD_INTEGRITY_PENDING_SHARDS 16
+#define INTEGRITY_LOCK_STRIPES 64
+// The number of blocks covered by a checksum chunk.
+#define INTEGRITY_CHUNK_BLOCKS 4096
+
+// "WNBDCRC1"
+#define INTEGRITY_SIDECAR_MAGIC 0x3143524344424E57ULL
+#define INTEGRITY_SIDECAR_VERSION 1
+
+// The sidecar file header, followed by the chunks that have known
+// checksums.
+typedef struct
+{
+    UINT64 Magic;
+    UINT32 Version;
+    UINT32 BlockSize;
+    UINT64 BlockCount;
+    UINT64 ChunkCount;
+    // CRC32C of the persisted chunks.
+    UINT32 ChunksCrc;
+    // Cleared while the disk is in use.
+    UINT32 Clean;
+} INTEGRITY_SIDECAR_HEADER, *PINTEGRITY_SIDECAR_HEADER;
+
+// Block integrity checks, see WnbdEnableIntegrity.
+//
+// The checksums are computed when the write requests are fetched but
+// only become valid once the writes complete successfully, the blocks
+// being skipped by reads in the meantime. Overlapping writes that are
+// in flight at the same time may complete in any order, in which case
+// the affected blocks are left without a checksum.
+//
+// Reads may also overlap with writes, so each chunk records the last
+// write epoch that changed it. Chunks changed after a read was fetched
+// aren't verified by that read.
+class DiskIntegrity
+{
+private:
+    struct InFlightWrite
+    {
+        UINT64 RequestHandle;
+        UINT32 FirstBlock;
+        UINT32 BlockCount;
+        // Set if another write or unmap request overlaps with this write.
+        bool Conflict;
+    };
+
+    // The checksums of INTEGRITY_CHUNK_BLOCKS consecutive blocks,
+    // allocated when first written.
+    struct Chunk
+    {
+        UINT64 Valid[INTEGRITY_CHUNK_BLOCKS / 64] = { 0 };
+        UINT32 Checksums[INTEGRITY_CHUNK_BLOCKS] = { 0 };
+        UINT64 Epoch = 0;
+        std::vector<InFlightWrite> InFlight;
+    };
+
+    struct PendingRequest
+    {
+        UINT64 BlockAddress = 0;
+        UINT32 BlockCount = 0;
+        // Reads only, the write epoch when the read was fetched.
+        UINT64 Epoch = 0;
+        // Writes only.
+        std::vector<UINT32> Checksums;
+    };
+
+    struct PendingShard
+    {
+        std::mutex Lock;
+        std::unordered_map<UINT64, PendingRequest> Requests;
+    };
+
+    UINT32 BlockSize = 0;
+    UINT64 BlockCount = 0;
+    UINT64 ChunkCount = 0;
+    std::unique_ptr<std::atomic<Chunk*>[]> Chunks;
+    std::mutex ChunkLocks[INTEGRITY_LOCK_STRIPES];
+    std::atomic<UINT64> WriteEpoch = 0;
+
+    PendingShard PendingShards[WNBD_INTEGRITY_PENDING_SHARDS];
+
+    HANDLE Sidecar = INVALID_HANDLE_VALUE;
+
+    std::atomic<UINT64> VerifiedBlocks = 0;
+    std::atomic<UINT64> UnverifiedBlocks = 0;
+    std::atomic<UINT64> ChecksumErrors = 0;
+    std::atomic<UINT64> TrackedBlocks = 0;
+
+    PendingShard& GetShard(UINT64 RequestHandle) {
+        return PendingShards[RequestHandle % WNBD_INTEGRITY_PENDING_SHARDS];
+    }
+    std::mutex& GetChunkLock(UINT64 ChunkIndex) {
+        return ChunkLocks[ChunkIndex % INTEGRITY_LOCK_STRIPES];
+    }
+
+    // Returns NULL if the chunk doesn't exist and either "Allocate" is
+    // false or the allocation fails.
+    Chunk* GetChunk(UINT64 ChunkIndex, bool Allocate);
+    bool IsValidRange(UINT64 BlockAddress, UINT64 Count);
+    bool TrackRequest(UINT64 RequestHandle, PendingRequest&& Request);
+    bool TakeRequest(UINT64 RequestHandle, PendingRequest* Request);
+
+    // Drops the checksums of the specified range, flagging the
+    // overlapping writes that are in flight. Also registers the
+    // specified write, if any.
+    void Invalidate(
+        UINT64 BlockAddress, UINT64 Count,
+        const UINT64* WriteHandle = nullptr);
+    // Removes the write from the in flight list, storing its checksums
+    // if it succeeded and didn't overlap with other requests.
+    void FinishWrite(
+        UINT64 RequestHandle, const PendingRequest& Write, bool Succeeded);
+
+    DWORD LoadSidecar(PCSTR Path);
+    DWORD SaveSidecar();
+
+public:
+    ~DiskIntegrity();
+
+    DWORD Initialize(PWNBD_DISK Disk, PWNBD_INTEGRITY_OPTIONS Options);
+
+    void ReadFetched(PWNBD_IO_REQUEST Request);
+    // Fails the response if the data doesn't match the checksums.
+    void ReadCompleted(
+        PWNBD_IO_RESPONSE Response, PVOID Buffer, UINT32 BufferSize);
+    // Must be called after the payload gets encrypted.
+    void WriteFetched(PWNBD_IO_REQUEST Request, PVOID Buffer);
+    void WriteCompleted(PWNBD_IO_RESPONSE Response);
+    void UnmapFetched(PWNBD_UNMAP_DESCRIPTOR Descriptors, UINT32 Count);
+
+    void GetStats(PWNBD_INTEGRITY_STATS Stats);
+};
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "dispatcher_scaler.h"
+#include "wnbd_log.h"
+
+double DispatcherScaler::GetUtilization(const DispatcherScalerSample& Sample)
+{
+    double AvailableUs = (double) Sample.IntervalUs * Sample.ThreadCount;
+    if (!AvailableUs) {
+        return 0;
+    }
+
+    // The wait time may slightly exceed the interval since it's
+    // only reported when the fetch returns.
+    double IdleRatio = min((double) Sample.FetchWaitUs / AvailableUs, 1.0);
+    return 1 - IdleRatio;
+}
+
+double DispatcherScaler::GetLatencyUs(const DispatcherScalerSample& Sample)
+{
+    if (!Sample.CompletedRequests) {
+        return 0;
+    }
+    return (double) Sample.InFlightRequests * Sample.IntervalUs /
+        Sample.CompletedRequests;
+}
+
+UINT32 DispatcherScaler::Update(const DispatcherScalerSample& Sample)
+{
+    UINT32 ThreadCount = Sample.ThreadCount;
+    double Utilization = GetUtilization(Sample);
+    double LatencyUs = GetLatencyUs(Sample);
+
+    if (GrowthHoldSamples) {
+        GrowthHoldSamples--;
+    }
+
+    if (EvaluatingGrowth) {
+        EvaluatingGrowth = false;
+        if (Sample.CompletedRequests <
+                PreGrowthCompleted * MinThroughputGain &&
+                LatencyUs >= PreGrowthLatencyUs * MaxLatencyIncrease) {
+            LogDebug("Dispatcher growth didn't improve throughput, the "
+                     "backend seems saturated. Reverting to %u threads.",
+                     PreGrowthThreads);
+            GrowthHoldSamples = GrowthHoldPeriodSamples;
+            SaturatedSamples = 0;
+            IdleSamples = 0;
+            return max(PreGrowthThreads, MinThreads);
+        }
+    }
+
+    bool Saturated = Utilization >= GrowUtilization ||
+        Sample.UnsubmittedRequests >= ThreadCount;
+    // Avoid shrinking if the remaining threads would be saturated.
+    bool Idle = Utilization <= ShrinkUtilization && ThreadCount > 1 &&
+        Utilization * ThreadCount / (ThreadCount - 1) < GrowUtilization;
+
+    if (Saturated) {
+        IdleSamples = 0;
+        SaturatedSamples++;
+        if (SaturatedSamples >= GrowSamples && !GrowthHoldSamples &&
+                ThreadCount < MaxThreads) {
+            SaturatedSamples = 0;
+
+            EvaluatingGrowth = true;
+            PreGrowthThreads = ThreadCount;
+            PreGrowthCompleted = Sample.CompletedRequests;
+            PreGrowthLatencyUs = LatencyUs;
+
+            // Grow by 25%, at least one thread.
+            UINT32 NewThreadCount = ThreadCount + max(1u, ThreadCount / 4);
+            return min(NewThreadCount, MaxThreads);
+        }
+    } else if (Idle) {
+        SaturatedSamples = 0;
+        IdleSamples++;
+        if (IdleSamples >= ShrinkSamples && ThreadCount > MinThreads) {
+            IdleSamples = 0;
+            return ThreadCount - 1;
+        }
+    } else {
+        SaturatedSamples = 0;
+        IdleSamples = 0;
+    }
+
+    return min(max(ThreadCount, MinThreads), MaxThreads);
+}
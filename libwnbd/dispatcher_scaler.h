@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+// Dispatcher activity measured over one sampling interval.
+struct DispatcherScalerSample
+{
+    UINT32 ThreadCount;
+    UINT64 IntervalUs;
+    // Total time spent by the dispatcher threads waiting for requests.
+    UINT64 FetchWaitUs;
+    // Requests completed during this interval.
+    UINT64 CompletedRequests;
+    // Requests that are being passed to the IO callbacks.
+    UINT64 UnsubmittedRequests;
+    // Requests that were received but not completed yet.
+    UINT64 InFlightRequests;
+};
+
+// Decides the number of dispatcher threads based on the measured
+// activity. It doesn't manage the threads itself, which makes it easy
+// to reason about and test.
+//
+// The pool grows when the threads are saturated, either spending little
+// time waiting for requests or being all busy passing requests to the
+// IO callbacks. Growth stops if it only increases the backend completion
+// latency without improving throughput, meaning that the backend is the
+// bottleneck. The pool shrinks when the threads are mostly idle.
+//
+// There's a gap between the grow and shrink utilization thresholds and
+// the conditions have to persist for a few consecutive samples (more for
+// shrinking) in order to avoid thrashing.
+class DispatcherScaler
+{
+private:
+    UINT32 MinThreads;
+    UINT32 MaxThreads;
+
+    UINT32 SaturatedSamples = 0;
+    UINT32 IdleSamples = 0;
+    // Remaining samples during which growth is disabled.
+    UINT32 GrowthHoldSamples = 0;
+
+    // Measurements taken before the last growth, allowing us to check
+    // if it helped.
+    bool EvaluatingGrowth = false;
+    UINT32 PreGrowthThreads = 0;
+    UINT64 PreGrowthCompleted = 0;
+    double PreGrowthLatencyUs = 0;
+
+public:
+    static constexpr double GrowUtilization = 0.85;
+    static constexpr double ShrinkUtilization = 0.35;
+    static constexpr UINT32 GrowSamples = 2;
+    static constexpr UINT32 ShrinkSamples = 25;
+    static constexpr UINT32 GrowthHoldPeriodSamples = 50;
+    // Growth is considered unhelpful if throughput increases by less
+    // than 5% while the backend latency increases by at least 20%.
+    static constexpr double MinThroughputGain = 1.05;
+    static constexpr double MaxLatencyIncrease = 1.2;
+
+    DispatcherScaler(UINT32 _MinThreads, UINT32 _MaxThreads)
+        : MinThreads(_MinThreads)
+        , MaxThreads(_MaxThreads)
+    {}
+
+    // Returns the recommended thread count.
+    UINT32 Update(const DispatcherScalerSample& Sample);
+
+    static double GetUtilization(const DispatcherScalerSample& Sample);
+    // Backend completion latency estimated using Little's law.
+    static double GetLatencyUs(const DispatcherScalerSample& Sample);
+};
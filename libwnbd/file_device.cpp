@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "file_device.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+#include <winioctl.h>
+
+// FSCTL_SET_ZERO_DATA requests are split so that the range length fits
+// the IO engine operations.
+#define ZERO_DATA_CHUNK_SIZE (1ULL << 30)
+
+// Issues a device control request on a handle opened using
+// FILE_FLAG_OVERLAPPED, waiting for it to complete. Only meant to be used
+// before the handle is associated with the IO completion port.
+static DWORD SyncDeviceIoControl(
+    HANDLE Handle, DWORD ControlCode,
+    PVOID InBuffer, DWORD InBufferSize,
+    PVOID OutBuffer, DWORD OutBufferSize)
+{
+    OVERLAPPED Overlapped = { 0 };
+    Overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent) {
+        return GetLastError();
+    }
+
+    DWORD Status = 0;
+    DWORD BytesReturned = 0;
+    if (!DeviceIoControl(
+            Handle, ControlCode, InBuffer, InBufferSize,
+            OutBuffer, OutBufferSize, NULL, &Overlapped) &&
+            GetLastError() != ERROR_IO_PENDING) {
+        Status = GetLastError();
+    } else if (!GetOverlappedResult(
+            Handle, &Overlapped, &BytesReturned, TRUE)) {
+        Status = GetLastError();
+    }
+
+    CloseHandle(Overlapped.hEvent);
+    return Status;
+}
+
+FileDevice::~FileDevice()
+{
+    // Waits for the pending operations.
+    Engine.reset();
+    CloseHandles();
+}
+
+DWORD FileDevice::OpenHandle(
+    DWORD DesiredAccess, DWORD Disposition,
+    DWORD Flags, PHANDLE Handle)
+{
+    *Handle = CreateFileA(
+        Path.c_str(), DesiredAccess,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        Disposition, Flags, NULL);
+    if (*Handle == INVALID_HANDLE_VALUE) {
+        DWORD Status = GetLastError();
+        LogError("Could not open %s. Error: %d. Error message: %s",
+                 Path.c_str(), Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+    return 0;
+}
+
+DWORD FileDevice::OpenHandles(BOOLEAN ReadOnly, BOOLEAN Buffered)
+{
+    DWORD Access = GENERIC_READ;
+    if (!ReadOnly) {
+        Access |= GENERIC_WRITE;
+    }
+    DWORD Flags = FILE_FLAG_OVERLAPPED;
+    if (!Buffered) {
+        Flags |= FILE_FLAG_NO_BUFFERING;
+    }
+
+    DWORD Status = OpenHandle(Access, OPEN_EXISTING, Flags, &File);
+    if (Status || ReadOnly) {
+        return Status;
+    }
+
+    // Used for FUA writes.
+    return OpenHandle(
+        Access, OPEN_EXISTING, Flags | FILE_FLAG_WRITE_THROUGH,
+        &WriteThroughFile);
+}
+
+void FileDevice::CloseHandles()
+{
+    if (WriteThroughFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(WriteThroughFile);
+        WriteThroughFile = INVALID_HANDLE_VALUE;
+    }
+    if (File != INVALID_HANDLE_VALUE) {
+        CloseHandle(File);
+        File = INVALID_HANDLE_VALUE;
+    }
+}
+
+DWORD FileDevice::CreateSparseFile(UINT64 FileSize)
+{
+    LogInfo("Creating sparse file: %s. Size: %llu.",
+            Path.c_str(), FileSize);
+
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = OpenHandle(
+        GENERIC_READ | GENERIC_WRITE, CREATE_NEW,
+        FILE_ATTRIBUTE_NORMAL, &Handle);
+    if (Status) {
+        return Status;
+    }
+
+    DWORD BytesReturned = 0;
+    FILE_END_OF_FILE_INFO EndOfFile = { 0 };
+    EndOfFile.EndOfFile.QuadPart = FileSize;
+    if (!DeviceIoControl(
+            Handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0,
+            &BytesReturned, NULL)) {
+        Status = GetLastError();
+        LogError("Could not mark file as sparse: %s. "
+                 "Error: %d. Error message: %s",
+                 Path.c_str(), Status, win32_strerror(Status).c_str());
+    } else if (!SetFileInformationByHandle(
+            Handle, FileEndOfFileInfo, &EndOfFile, sizeof(EndOfFile))) {
+        Status = GetLastError();
+        LogError("Could not set file size: %s. "
+                 "Error: %d. Error message: %s",
+                 Path.c_str(), Status, win32_strerror(Status).c_str());
+    }
+
+    CloseHandle(Handle);
+    if (Status) {
+        DeleteFileA(Path.c_str());
+    }
+    return Status;
+}
+
+DWORD FileDevice::RetrieveGeometry()
+{
+    if (IsBlockDevice) {
+        GET_LENGTH_INFORMATION LengthInfo = { 0 };
+        DWORD Status = SyncDeviceIoControl(
+            File, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0,
+            &LengthInfo, sizeof(LengthInfo));
+        if (Status) {
+            LogError("Could not retrieve device size: %s. "
+                     "Error: %d. Error message: %s",
+                     Path.c_str(), Status, win32_strerror(Status).c_str());
+            return Status;
+        }
+        Size = LengthInfo.Length.QuadPart;
+
+        DISK_GEOMETRY Geometry = { 0 };
+        Status = SyncDeviceIoControl(
+            File, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
+            &Geometry, sizeof(Geometry));
+        if (Status) {
+            LogWarning("Could not retrieve device geometry: %s. "
+                       "Error: %d. Error message: %s",
+                       Path.c_str(), Status, win32_strerror(Status).c_str());
+        } else {
+            SectorSize = Geometry.BytesPerSector;
+        }
+    } else {
+        LARGE_INTEGER FileSize = { 0 };
+        if (!GetFileSizeEx(File, &FileSize)) {
+            DWORD Status = GetLastError();
+            LogError("Could not retrieve file size: %s. "
+                     "Error: %d. Error message: %s",
+                     Path.c_str(), Status, win32_strerror(Status).c_str());
+            return Status;
+        }
+        Size = FileSize.QuadPart;
+
+        FILE_STORAGE_INFO StorageInfo = { 0 };
+        if (GetFileInformationByHandleEx(
+                File, FileStorageInfo, &StorageInfo, sizeof(StorageInfo))) {
+            SectorSize = StorageInfo.LogicalBytesPerSector;
+        }
+
+        // Hole punching is only effective for sparse files, otherwise
+        // FSCTL_SET_ZERO_DATA just writes zeroes.
+        FILE_BASIC_INFO BasicInfo = { 0 };
+        if (GetFileInformationByHandleEx(
+                File, FileBasicInfo, &BasicInfo, sizeof(BasicInfo))) {
+            UnmapSupported = !!(
+                BasicInfo.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE);
+        }
+    }
+
+    if (!SectorSize) {
+        SectorSize = WNBD_DEFAULT_BLOCK_SIZE;
+    }
+
+    LogDebug("Opened %s. Size: %llu. Sector size: %d. Unmap supported: %d.",
+             Path.c_str(), Size, SectorSize, UnmapSupported);
+    return 0;
+}
+
+DWORD FileDevice::Open(
+    PWNBD_FILE_OPTIONS Options,
+    BOOLEAN ReadOnly,
+    UINT64 CreateSize)
+{
+    Path = std::string(Options->Path, strnlen(Options->Path, MAX_PATH));
+    if (Path.empty()) {
+        LogError("No file path specified.");
+        return ERROR_INVALID_PARAMETER;
+    }
+    IsBlockDevice = Path.starts_with("\\\\.\\");
+
+    UINT32 QueueDepth = Options->QueueDepth ?
+        Options->QueueDepth : WNBD_DEFAULT_FILE_QUEUE_DEPTH;
+    UINT32 ThreadCount = Options->CompletionThreadCount ?
+        Options->CompletionThreadCount : WNBD_DEFAULT_FILE_COMPLETION_THREADS;
+    if (QueueDepth > WNBD_MAX_DISPATCHER_QUEUE_DEPTH ||
+            ThreadCount > WNBD_MAX_DISPATCHER_THREAD_COUNT) {
+        LogError("Invalid file queue depth or completion thread count. "
+                 "Queue depth: %d. Thread count: %d.",
+                 QueueDepth, ThreadCount);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    DWORD Status = 0;
+    if (!IsBlockDevice && CreateSize &&
+            GetFileAttributesA(Path.c_str()) == INVALID_FILE_ATTRIBUTES &&
+            GetLastError() == ERROR_FILE_NOT_FOUND) {
+        Status = CreateSparseFile(CreateSize);
+        if (Status) {
+            return Status;
+        }
+    }
+
+    BOOLEAN Buffered = Options->Flags.BufferedIo;
+    Status = OpenHandles(ReadOnly, Buffered);
+    if (Status) {
+        return Status;
+    }
+    Status = RetrieveGeometry();
+    if (Status) {
+        return Status;
+    }
+
+    if (WNBD_DEFAULT_BLOCK_SIZE % SectorSize) {
+        // Unbuffered IO requires sector aligned requests.
+        if (IsBlockDevice) {
+            LogError("Unsupported sector size: %d. Device: %s.",
+                     SectorSize, Path.c_str());
+            return ERROR_NOT_SUPPORTED;
+        }
+        if (!Buffered) {
+            LogWarning("The file sector size (%d) is larger than the disk "
+                       "block size, falling back to buffered IO. File: %s.",
+                       SectorSize, Path.c_str());
+            CloseHandles();
+            Buffered = TRUE;
+            Status = OpenHandles(ReadOnly, Buffered);
+            if (Status) {
+                return Status;
+            }
+        }
+    }
+
+    Unbuffered = !Buffered;
+
+    Engine.reset(new (std::nothrow) IocpEngine(QueueDepth));
+    if (!Engine) {
+        LogError("Could not allocate IO engine.");
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    Status = Engine->Initialize(ThreadCount);
+    if (!Status) {
+        Status = Engine->AddFile(File);
+    }
+    if (!Status && WriteThroughFile != INVALID_HANDLE_VALUE) {
+        Status = Engine->AddFile(WriteThroughFile);
+    }
+    if (Status) {
+        return Status;
+    }
+
+    LogInfo("Using %s. Buffered IO: %d. Queue depth: %d. "
+            "Completion threads: %d.",
+            Path.c_str(), Buffered, QueueDepth, ThreadCount);
+    return 0;
+}
+
+bool FileDevice::IsBufferAligned(PVOID Buffer)
+{
+    if (!Unbuffered || !((ULONG_PTR) Buffer % SectorSize)) {
+        return true;
+    }
+    LogError("Unbuffered IO requires sector aligned buffers. "
+             "Buffer: %p, sector size: %d, file: %s.",
+             Buffer, SectorSize, Path.c_str());
+    return false;
+}
+
+wnbd::Task<DWORD> FileDevice::Read(
+    PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    if (!IsBufferAligned(Buffer)) {
+        co_return ERROR_INVALID_PARAMETER;
+    }
+    co_return co_await Engine->Submit(
+        File, IoOperationType::Read, Buffer, Offset, Length);
+}
+
+wnbd::Task<DWORD> FileDevice::Write(
+    PVOID Buffer, UINT64 Offset, UINT32 Length,
+    BOOLEAN ForceUnitAccess)
+{
+    if (!IsBufferAligned(Buffer)) {
+        co_return ERROR_INVALID_PARAMETER;
+    }
+    HANDLE Handle = ForceUnitAccess ? WriteThroughFile : File;
+    co_return co_await Engine->Submit(
+        Handle, IoOperationType::Write, Buffer, Offset, Length);
+}
+
+wnbd::Task<DWORD> FileDevice::Flush()
+{
+    if (WriteThroughFile == INVALID_HANDLE_VALUE) {
+        // Read-only, nothing to flush.
+        co_return 0;
+    }
+    co_return co_await Engine->Submit(
+        File, IoOperationType::Flush, nullptr, 0, 0);
+}
+
+wnbd::Task<DWORD> FileDevice::Unmap(UINT64 Offset, UINT64 Length)
+{
+    if (!UnmapSupported) {
+        co_return ERROR_NOT_SUPPORTED;
+    }
+
+    while (Length) {
+        UINT32 ChunkLength = (UINT32) min(Length, ZERO_DATA_CHUNK_SIZE);
+        DWORD Status = co_await Engine->Submit(
+            File, IoOperationType::ZeroData, nullptr, Offset, ChunkLength);
+        if (Status) {
+            co_return Status;
+        }
+        Offset += ChunkLength;
+        Length -= ChunkLength;
+    }
+    co_return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <memory>
+#include <string>
+
+#include "block_device.h"
+#include "io_engine.h"
+#include "wnbd.h"
+
+// Exposes a raw image, sparse file or block device, see WnbdRunFileDaemon.
+//
+// Unbuffered overlapped IO is used by default, the completions being
+// handled by an IocpEngine. FUA writes go through a separate write-through
+// handle. Unmap requests punch holes in sparse files.
+//
+// Unbuffered IO requires sector aligned buffers. This relies on the
+// request buffers being page aligned, which is the case for the buffers
+// provided by RequestBufferPool. Devices stacked on top of a FileDevice
+// must allocate their own buffers accordingly (e.g. _aligned_malloc).
+// Misaligned buffers are rejected.
+class FileDevice : public BlockDevice
+{
+private:
+    std::string Path;
+    HANDLE File = INVALID_HANDLE_VALUE;
+    HANDLE WriteThroughFile = INVALID_HANDLE_VALUE;
+    std::unique_ptr<IocpEngine> Engine;
+
+    UINT64 Size = 0;
+    UINT32 SectorSize = 0;
+    bool IsBlockDevice = false;
+    bool UnmapSupported = false;
+    bool Unbuffered = false;
+
+    DWORD OpenHandle(
+        DWORD DesiredAccess, DWORD Disposition,
+        DWORD Flags, PHANDLE Handle);
+    DWORD OpenHandles(BOOLEAN ReadOnly, BOOLEAN Buffered);
+    void CloseHandles();
+    DWORD CreateSparseFile(UINT64 FileSize);
+    DWORD RetrieveGeometry();
+    bool IsBufferAligned(PVOID Buffer);
+
+public:
+    ~FileDevice();
+
+    // Files that don't exist are created as sparse files if CreateSize
+    // is not 0. Existing files keep their size.
+    DWORD Open(
+        PWNBD_FILE_OPTIONS Options,
+        BOOLEAN ReadOnly,
+        UINT64 CreateSize);
+
+    UINT64 GetSize() override { return Size; }
+    UINT32 GetSectorSize() override { return SectorSize; }
+    bool IsUnmapSupported() override { return UnmapSupported; }
+
+    wnbd::Task<DWORD> Read(
+        PVOID Buffer, UINT64 Offset, UINT32 Length) override;
+    wnbd::Task<DWORD> Write(
+        PVOID Buffer, UINT64 Offset, UINT32 Length,
+        BOOLEAN ForceUnitAccess) override;
+    wnbd::Task<DWORD> Flush() override;
+    wnbd::Task<DWORD> Unmap(UINT64 Offset, UINT64 Length) override;
+};
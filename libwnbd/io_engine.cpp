@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "io_engine.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+#include <winioctl.h>
+
+bool IoSlots::Awaiter::await_suspend(std::coroutine_handle<> Handle) noexcept
+{
+    std::unique_lock Lock{Slots->Lock};
+    if (Slots->Available) {
+        Slots->Available--;
+        return false;
+    }
+
+    Entry.Handle = Handle;
+    Entry.Next = nullptr;
+    if (Slots->Tail) {
+        Slots->Tail->Next = &Entry;
+    } else {
+        Slots->Head = &Entry;
+    }
+    Slots->Tail = &Entry;
+    return true;
+}
+
+void IoSlots::Release()
+{
+    Waiter* Next = nullptr;
+    {
+        std::unique_lock Lock{this->Lock};
+        Next = Head;
+        if (!Next) {
+            Available++;
+            return;
+        }
+        Head = Next->Next;
+        if (!Head) {
+            Tail = nullptr;
+        }
+    }
+
+    // The slot is handed over to the waiter.
+    Next->Handle.resume();
+}
+
+IocpEngine::~IocpEngine()
+{
+    Drain();
+
+    for (size_t i = 0; i < Threads.size(); i++) {
+        PostQueuedCompletionStatus(CompletionPort, 0, 0, NULL);
+    }
+    for (HANDLE Thread : Threads) {
+        WaitForSingleObject(Thread, INFINITE);
+        CloseHandle(Thread);
+    }
+
+    if (CompletionPort) {
+        CloseHandle(CompletionPort);
+    }
+}
+
+DWORD IocpEngine::Initialize(UINT32 ThreadCount)
+{
+    CompletionPort = CreateIoCompletionPort(
+        INVALID_HANDLE_VALUE, NULL, 0, ThreadCount);
+    if (!CompletionPort) {
+        DWORD Status = GetLastError();
+        LogError("Could not create completion port. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    for (UINT32 i = 0; i < ThreadCount; i++) {
+        HANDLE Thread = CreateThread(0, 0, CompletionThread, this, 0, 0);
+        if (!Thread) {
+            DWORD Status = GetLastError();
+            LogError("Could not start IO completion thread. "
+                     "Error: %d. Error message: %s",
+                     Status, win32_strerror(Status).c_str());
+            return Status;
+        }
+        Threads.push_back(Thread);
+    }
+
+    return 0;
+}
+
+DWORD IocpEngine::AddFile(HANDLE File)
+{
+    if (!CreateIoCompletionPort(File, CompletionPort, 0, 0)) {
+        DWORD Status = GetLastError();
+        LogError("Could not associate file with completion port. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    // Not critical, we don't use the file handle event.
+    SetFileCompletionNotificationModes(File, FILE_SKIP_SET_EVENT_ON_HANDLE);
+    return 0;
+}
+
+DWORD WINAPI IocpEngine::CompletionThread(LPVOID Context)
+{
+    return ((IocpEngine*) Context)->CompletionLoop();
+}
+
+DWORD IocpEngine::CompletionLoop()
+{
+    while (TRUE) {
+        DWORD BytesTransferred = 0;
+        ULONG_PTR CompletionKey = 0;
+        LPOVERLAPPED Overlapped = NULL;
+        BOOL Succeeded = GetQueuedCompletionStatus(
+            CompletionPort, &BytesTransferred, &CompletionKey,
+            &Overlapped, INFINITE);
+        if (!Overlapped) {
+            if (!Succeeded) {
+                DWORD Status = GetLastError();
+                LogError("Could not retrieve IO completion. "
+                         "Error: %d. Error message: %s",
+                         Status, win32_strerror(Status).c_str());
+                return Status;
+            }
+            // Stop request.
+            return 0;
+        }
+
+        // Failed submissions are posted using the error as completion key.
+        DWORD Status = Succeeded ? (DWORD) CompletionKey : GetLastError();
+        Operation* Op = CONTAINING_RECORD(Overlapped, Operation, Overlapped);
+        Op->BytesTransferred = BytesTransferred;
+        // Resumes the submitting coroutine, which may complete the
+        // WNBD request as well.
+        Op->Completion.Complete(Status);
+
+        if (--InFlight == 0) {
+            InFlight.notify_all();
+        }
+    }
+}
+
+VOID CALLBACK IocpEngine::FlushCallback(
+    PTP_CALLBACK_INSTANCE Instance, PVOID Context)
+{
+    Operation* Op = (Operation*) Context;
+    DWORD Status = 0;
+    if (!FlushFileBuffers(Op->File)) {
+        Status = GetLastError();
+    }
+
+    if (!PostQueuedCompletionStatus(
+            Op->Engine->CompletionPort, 0, Status, &Op->Overlapped)) {
+        // Not expected to happen, the operation would never complete.
+        LogError("Could not queue flush completion. Error: %d.",
+                 GetLastError());
+    }
+}
+
+wnbd::Task<DWORD> IocpEngine::Submit(
+    HANDLE File,
+    IoOperationType Type,
+    PVOID Buffer,
+    UINT64 Offset,
+    UINT32 Length)
+{
+    InFlight++;
+    co_await Slots.Acquire();
+
+    Operation Op;
+    Op.Overlapped.Offset = (DWORD) Offset;
+    Op.Overlapped.OffsetHigh = (DWORD) (Offset >> 32);
+
+    FILE_ZERO_DATA_INFORMATION ZeroData = { 0 };
+    BOOL Succeeded = FALSE;
+    switch (Type) {
+    case IoOperationType::Read:
+        Succeeded = ReadFile(File, Buffer, Length, NULL, &Op.Overlapped);
+        break;
+    case IoOperationType::Write:
+        Succeeded = WriteFile(File, Buffer, Length, NULL, &Op.Overlapped);
+        break;
+    case IoOperationType::ZeroData:
+        ZeroData.FileOffset.QuadPart = Offset;
+        ZeroData.BeyondFinalZero.QuadPart = Offset + Length;
+        Succeeded = DeviceIoControl(
+            File, FSCTL_SET_ZERO_DATA, &ZeroData, sizeof(ZeroData),
+            NULL, 0, NULL, &Op.Overlapped);
+        break;
+    case IoOperationType::Flush:
+        Op.Engine = this;
+        Op.File = File;
+        if (TrySubmitThreadpoolCallback(FlushCallback, &Op, NULL)) {
+            SetLastError(ERROR_IO_PENDING);
+        }
+        break;
+    }
+
+    // Completion packets are queued even if the operation completes
+    // synchronously, but not if it fails right away.
+    if (!Succeeded) {
+        DWORD Status = GetLastError();
+        if (Status != ERROR_IO_PENDING &&
+                !PostQueuedCompletionStatus(
+                    CompletionPort, 0, Status, &Op.Overlapped)) {
+            LogError("Could not queue IO completion. Error: %d.",
+                     GetLastError());
+            // The submission failed and we couldn't defer the completion,
+            // so the operation completes on this thread.
+            Slots.Release();
+            if (--InFlight == 0) {
+                InFlight.notify_all();
+            }
+            co_return Status;
+        }
+    }
+
+    DWORD Status = co_await Op.Completion;
+    Slots.Release();
+
+    if (!Status && (Type == IoOperationType::Read ||
+                    Type == IoOperationType::Write) &&
+            Op.BytesTransferred != Length) {
+        if (Type == IoOperationType::Read) {
+            // The file shrunk, reading zeroes past the end of the file.
+            memset((PBYTE) Buffer + Op.BytesTransferred, 0,
+                   Length - Op.BytesTransferred);
+        } else {
+            Status = ERROR_WRITE_FAULT;
+        }
+    }
+    if (Status == ERROR_HANDLE_EOF && Type == IoOperationType::Read) {
+        memset(Buffer, 0, Length);
+        Status = 0;
+    }
+    co_return Status;
+}
+
+void IocpEngine::Drain()
+{
+    UINT64 Pending;
+    while ((Pending = InFlight.load())) {
+        InFlight.wait(Pending);
+    }
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "wnbd_coro.h"
+
+enum class IoOperationType
+{
+    Read,
+    Write,
+    // Deallocates the specified range of sparse files, which then reads
+    // back as zeroes. The buffer is not used.
+    ZeroData,
+    // Flushes the file buffers. The buffer, offset and length are not
+    // used.
+    Flush,
+};
+
+// Asynchronous file IO used by the built-in backends. The interface
+// doesn't depend on the underlying mechanism, so engines based on other
+// asynchronous IO APIs may be plugged in.
+class IoEngine
+{
+public:
+    virtual ~IoEngine() {}
+
+    // Returns a non-zero error code in case of failure. The buffer must
+    // remain valid until the operation completes.
+    virtual wnbd::Task<DWORD> Submit(
+        HANDLE File,
+        IoOperationType Type,
+        PVOID Buffer,
+        UINT64 Offset,
+        UINT32 Length) = 0;
+};
+
+// Limits the number of operations submitted at a time. Waiters are
+// resumed in FIFO order, by the thread releasing the slot. Using a
+// single slot, it can serve as an asynchronous mutex.
+class IoSlots
+{
+private:
+    struct Waiter
+    {
+        std::coroutine_handle<> Handle;
+        Waiter* Next;
+    };
+
+    std::mutex Lock;
+    UINT32 Available;
+    Waiter* Head = nullptr;
+    Waiter* Tail = nullptr;
+
+public:
+    explicit IoSlots(UINT32 Count = 1) : Available(Count) {}
+
+    class Awaiter
+    {
+    public:
+        explicit Awaiter(IoSlots* _Slots) : Slots(_Slots) {}
+
+        bool await_ready() noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> Handle) noexcept;
+        void await_resume() noexcept {}
+
+    private:
+        IoSlots* Slots;
+        Waiter Entry = {};
+    };
+
+    Awaiter Acquire() { return Awaiter(this); }
+    void Release();
+};
+
+// Windows IO engine, using overlapped IO and an IO completion port.
+//
+// Each operation is submitted from its own coroutine frame, which holds
+// the OVERLAPPED structure. The completion threads resume the awaiting
+// coroutines, so the request completion (including the WNBD response)
+// is handled by those threads.
+//
+// All the files used with this engine must be registered using
+// AddFile.
+class IocpEngine : public IoEngine
+{
+private:
+    struct Operation
+    {
+        OVERLAPPED Overlapped = { 0 };
+        DWORD BytesTransferred = 0;
+        wnbd::Completion<DWORD> Completion;
+        // Used by flush operations.
+        IocpEngine* Engine = nullptr;
+        HANDLE File = INVALID_HANDLE_VALUE;
+    };
+
+    HANDLE CompletionPort = NULL;
+    std::vector<HANDLE> Threads;
+    IoSlots Slots;
+
+    // Operations that haven't completed yet, including the ones waiting
+    // for a slot.
+    std::atomic<UINT64> InFlight = 0;
+
+    DWORD CompletionLoop();
+    static DWORD WINAPI CompletionThread(LPVOID Context);
+    // There's no overlapped flush, so FlushFileBuffers is called from
+    // a thread pool worker, which then posts the completion.
+    static VOID CALLBACK FlushCallback(
+        PTP_CALLBACK_INSTANCE Instance, PVOID Context);
+
+public:
+    explicit IocpEngine(UINT32 QueueDepth) : Slots(QueueDepth) {}
+    // Waits for the pending operations.
+    ~IocpEngine();
+
+    DWORD Initialize(UINT32 ThreadCount);
+    // Associates the file with the engine completion port. The file
+    // must be opened using FILE_FLAG_OVERLAPPED.
+    DWORD AddFile(HANDLE File);
+
+    wnbd::Task<DWORD> Submit(
+        HANDLE File,
+        IoOperationType Type,
+        PVOID Buffer,
+        UINT64 Offset,
+        UINT32 Length) override;
+
+    // Blocks until the submitted operations complete.
+    void Drain();
+};
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "io_group.h"
+
+DetachedTask IoGroup::Run(
+    IoGroup* Group, wnbd::Task<DWORD> Operation)
+{
+    DWORD Status = 0;
+    try {
+        Status = co_await Operation;
+    }
+    catch (const std::bad_alloc&) {
+        Status = ERROR_NOT_ENOUGH_MEMORY;
+    }
+    // The group may go away as soon as the last operation completes.
+    Group->OnComplete(Status);
+}
+
+void IoGroup::OnComplete(DWORD Status)
+{
+    if (Status) {
+        DWORD Expected = 0;
+        FirstError.compare_exchange_strong(Expected, Status);
+    }
+    if (Pending.fetch_sub(1) == 1) {
+        Done.Complete(FirstError.load());
+    }
+}
+
+void IoGroup::Start(wnbd::Task<DWORD>&& Operation)
+{
+    Pending++;
+    try {
+        Run(this, std::move(Operation));
+    }
+    catch (const std::bad_alloc&) {
+        // The coroutine frame couldn't be allocated.
+        Pending--;
+        DWORD Expected = 0;
+        FirstError.compare_exchange_strong(
+            Expected, ERROR_NOT_ENOUGH_MEMORY);
+    }
+}
+
+wnbd::Task<DWORD> IoGroup::Wait()
+{
+    if (Pending.fetch_sub(1) == 1) {
+        co_return FirstError.load();
+    }
+    co_return co_await Done;
+}
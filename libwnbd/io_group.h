@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+
+#include "wnbd_coro.h"
+
+// Eagerly started coroutine, whose frame is released once done. The
+// coroutine must handle its own errors.
+struct DetachedTask
+{
+    struct promise_type : wnbd::PooledPromise
+    {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Runs BlockDevice operations concurrently, used by the composite
+// backends (e.g. StripeDevice). Unlike awaited tasks, the operations
+// are started right away, running until their first suspension point.
+// Wait resumes the caller once all of them complete.
+//
+// The group must be awaited before going out of scope.
+class IoGroup
+{
+private:
+    // The started operations plus one, released by Wait.
+    std::atomic<UINT32> Pending = 1;
+    std::atomic<DWORD> FirstError = 0;
+    wnbd::Completion<DWORD> Done;
+
+    static DetachedTask Run(IoGroup* Group, wnbd::Task<DWORD> Operation);
+    void OnComplete(DWORD Status);
+
+public:
+    void Start(wnbd::Task<DWORD>&& Operation);
+    // Returns the first error, if any.
+    wnbd::Task<DWORD> Wait();
+};
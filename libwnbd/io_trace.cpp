@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "io_trace.h"
+#include "wnbd_log.h"
+
+static inline UINT64 GetTraceTimestamp()
+{
+    LARGE_INTEGER Counter;
+    QueryPerformanceCounter(&Counter);
+    return Counter.QuadPart;
+}
+
+IoTrace::~IoTrace()
+{
+    Stop();
+}
+
+DWORD IoTrace::Start(PWNBD_DISK Disk, PWNBD_IO_TRACE_OPTIONS Options)
+{
+    if (!Options || !strnlen_s(Options->Path, sizeof(Options->Path))) {
+        LogError("No IO trace path specified.");
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    UINT64 FileSize = Options->MaxFileSize ?
+        Options->MaxFileSize : WNBD_DEFAULT_IO_TRACE_FILE_SIZE;
+    if (FileSize < WNBD_MIN_IO_TRACE_FILE_SIZE) {
+        LogError("The IO trace file size must be at least %llu bytes.",
+                 WNBD_MIN_IO_TRACE_FILE_SIZE);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    AcquireSRWLockExclusive(&Lock);
+    if (Active) {
+        ReleaseSRWLockExclusive(&Lock);
+        return ERROR_ALREADY_EXISTS;
+    }
+
+    Path = std::string(Options->Path, strnlen_s(Options->Path,
+                                                sizeof(Options->Path)));
+    MaxFileSize = FileSize;
+    MaxFileCount = Options->MaxFileCount ?
+        Options->MaxFileCount : WNBD_DEFAULT_IO_TRACE_FILE_COUNT;
+    BlockSize = Disk->Properties.BlockSize;
+    BlockCount = Disk->Properties.BlockCount;
+    InstanceName = Disk->Properties.InstanceName;
+
+    DWORD Status = OpenFile();
+    if (!Status) {
+        Active = true;
+        LogInfo("Started IO trace: %s.", Path.c_str());
+    }
+    ReleaseSRWLockExclusive(&Lock);
+    return Status;
+}
+
+void IoTrace::Stop()
+{
+    AcquireSRWLockExclusive(&Lock);
+    if (Active) {
+        Active = false;
+        CloseFile();
+        LogInfo("Stopped IO trace: %s.", Path.c_str());
+    }
+    ReleaseSRWLockExclusive(&Lock);
+
+    for (auto& Shard : PendingShards) {
+        std::unique_lock ShardLock{Shard.Lock};
+        Shard.Requests.clear();
+    }
+}
+
+void IoTrace::RequestFetched(PWNBD_IO_REQUEST Request, PVOID Buffer)
+{
+    WNBD_IO_TRACE_RECORD Record = { 0 };
+    Record.FetchTimestamp = GetTraceTimestamp();
+    Record.RequestHandle = Request->RequestHandle;
+    Record.RequestType = (UINT8) Request->RequestType;
+
+    switch (Request->RequestType) {
+    case WnbdReqTypeRead:
+        Record.BlockAddress = Request->Cmd.Read.BlockAddress;
+        Record.BlockCount = Request->Cmd.Read.BlockCount;
+        if (Request->Cmd.Read.ForceUnitAccess) {
+            Record.Flags |= WNBD_IO_TRACE_FLAG_FUA;
+        }
+        break;
+    case WnbdReqTypeWrite:
+        Record.BlockAddress = Request->Cmd.Write.BlockAddress;
+        Record.BlockCount = Request->Cmd.Write.BlockCount;
+        if (Request->Cmd.Write.ForceUnitAccess) {
+            Record.Flags |= WNBD_IO_TRACE_FLAG_FUA;
+        }
+        break;
+    case WnbdReqTypeFlush:
+        Record.BlockAddress = Request->Cmd.Flush.BlockAddress;
+        Record.BlockCount = Request->Cmd.Flush.BlockCount;
+        break;
+    case WnbdReqTypeUnmap:
+        if (Buffer && Request->Cmd.Unmap.Count) {
+            PWNBD_UNMAP_DESCRIPTOR Descriptor =
+                (PWNBD_UNMAP_DESCRIPTOR) Buffer;
+            Record.BlockAddress = Descriptor->BlockAddress;
+            Record.BlockCount = Descriptor->BlockCount;
+        }
+        break;
+    case WnbdReqTypeDisconnect:
+        // Not a real IO request, there's no response either.
+        return;
+    default:
+        break;
+    }
+
+    PendingShard& Shard = GetShard(Request->RequestHandle);
+    try {
+        std::unique_lock ShardLock{Shard.Lock};
+        Shard.Requests[Request->RequestHandle] = Record;
+    }
+    catch (const std::bad_alloc&) {
+        // The request won't be traced.
+    }
+}
+
+void IoTrace::RequestCompleted(PWNBD_IO_RESPONSE Response)
+{
+    WNBD_IO_TRACE_RECORD Record;
+
+    {
+        PendingShard& Shard = GetShard(Response->RequestHandle);
+        std::unique_lock ShardLock{Shard.Lock};
+        auto It = Shard.Requests.find(Response->RequestHandle);
+        if (It == Shard.Requests.end()) {
+            // Fetched before the trace was started.
+            return;
+        }
+        Record = It->second;
+        Shard.Requests.erase(It);
+    }
+
+    Record.CompleteTimestamp = GetTraceTimestamp();
+    Record.ScsiStatus = Response->Status.ScsiStatus;
+    Record.SenseKey = Response->Status.SenseKey;
+    Append(&Record);
+}
+
+void IoTrace::Append(PWNBD_IO_TRACE_RECORD Record)
+{
+    while (true) {
+        AcquireSRWLockShared(&Lock);
+        if (!Records) {
+            ReleaseSRWLockShared(&Lock);
+            return;
+        }
+        UINT64 Index = NextRecord++;
+        if (Index < Capacity) {
+            CommitRecord(Index, Record);
+            ReleaseSRWLockShared(&Lock);
+            return;
+        }
+        ReleaseSRWLockShared(&Lock);
+
+        AcquireSRWLockExclusive(&Lock);
+        // Another thread may have rotated the file in the meantime.
+        if (Records && NextRecord >= Capacity) {
+            DWORD Status = Rotate();
+            if (Status) {
+                LogError("Could not rotate IO trace file, stopping trace. "
+                         "Error: %d.", Status);
+                Active = false;
+                CloseFile();
+            }
+        }
+        ReleaseSRWLockExclusive(&Lock);
+    }
+}
+
+void IoTrace::CommitRecord(UINT64 Index, PWNBD_IO_TRACE_RECORD Record)
+{
+    // The request type is set last. If the process crashes, the records
+    // that were still being written have it unset and get skipped.
+    PWNBD_IO_TRACE_RECORD Slot = &Records[Index];
+    UINT8 RequestType = Record->RequestType;
+    Record->RequestType = WnbdReqTypeUnknown;
+    *Slot = *Record;
+    MemoryBarrier();
+    *(volatile UINT8*) &Slot->RequestType = RequestType;
+
+    // The header record count covers the highest committed record, so
+    // that the trace remains usable if the process crashes. The mapped
+    // pages are written back by the system in that case.
+    volatile LONG64* RecordCount = (volatile LONG64*) &Header->RecordCount;
+    LONG64 NewCount = (LONG64) Index + 1;
+    LONG64 CurrCount = *RecordCount;
+    while (CurrCount < NewCount) {
+        LONG64 PrevCount = InterlockedCompareExchange64(
+            RecordCount, NewCount, CurrCount);
+        if (PrevCount == CurrCount) {
+            break;
+        }
+        CurrCount = PrevCount;
+    }
+}
+
+DWORD IoTrace::OpenFile()
+{
+    DWORD Status = 0;
+    FILETIME Now;
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Size;
+    Size.QuadPart = MaxFileSize;
+
+    File = CreateFileA(
+        Path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+        NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (File == INVALID_HANDLE_VALUE) {
+        Status = GetLastError();
+        LogError("Could not open IO trace file: %s. Error: %d.",
+                 Path.c_str(), Status);
+        goto Exit;
+    }
+
+    // The file gets extended to the mapping size, unused records being
+    // zeroed out.
+    Mapping = CreateFileMappingA(
+        File, NULL, PAGE_READWRITE, Size.HighPart, Size.LowPart, NULL);
+    if (!Mapping) {
+        Status = GetLastError();
+        LogError("Could not map IO trace file: %s. Error: %d.",
+                 Path.c_str(), Status);
+        goto Exit;
+    }
+
+    Header = (PWNBD_IO_TRACE_HEADER) MapViewOfFile(
+        Mapping, FILE_MAP_WRITE, 0, 0, 0);
+    if (!Header) {
+        Status = GetLastError();
+        LogError("Could not map IO trace file view: %s. Error: %d.",
+                 Path.c_str(), Status);
+        goto Exit;
+    }
+
+    Records = (PWNBD_IO_TRACE_RECORD) (Header + 1);
+    Capacity = (MaxFileSize - sizeof(WNBD_IO_TRACE_HEADER)) /
+        sizeof(WNBD_IO_TRACE_RECORD);
+    NextRecord = 0;
+
+    QueryPerformanceFrequency(&Frequency);
+    GetSystemTimePreciseAsFileTime(&Now);
+    Header->Magic = WNBD_IO_TRACE_MAGIC;
+    Header->Version = WNBD_IO_TRACE_VERSION;
+    Header->HeaderSize = sizeof(WNBD_IO_TRACE_HEADER);
+    Header->RecordSize = sizeof(WNBD_IO_TRACE_RECORD);
+    Header->BlockSize = BlockSize;
+    Header->BlockCount = BlockCount;
+    Header->TimestampFrequency = Frequency.QuadPart;
+    Header->StartTimestamp = GetTraceTimestamp();
+    Header->StartTime = ((UINT64) Now.dwHighDateTime << 32) |
+                        Now.dwLowDateTime;
+    InstanceName.copy(Header->InstanceName,
+                      sizeof(Header->InstanceName) - 1);
+
+Exit:
+    if (Status) {
+        CloseFile();
+    }
+    return Status;
+}
+
+void IoTrace::CloseFile()
+{
+    UINT64 RecordCount = min(NextRecord.load(), Capacity);
+
+    if (Header) {
+        Header->RecordCount = RecordCount;
+        UnmapViewOfFile(Header);
+        Header = nullptr;
+        Records = nullptr;
+    }
+    if (Mapping) {
+        CloseHandle(Mapping);
+        Mapping = NULL;
+    }
+    if (File != INVALID_HANDLE_VALUE) {
+        // Drop the unused records.
+        LARGE_INTEGER Size;
+        Size.QuadPart = sizeof(WNBD_IO_TRACE_HEADER) +
+            RecordCount * sizeof(WNBD_IO_TRACE_RECORD);
+        if (!SetFilePointerEx(File, Size, NULL, FILE_BEGIN) ||
+                !SetEndOfFile(File)) {
+            LogWarning("Could not truncate IO trace file: %s. Error: %d.",
+                       Path.c_str(), GetLastError());
+        }
+        CloseHandle(File);
+        File = INVALID_HANDLE_VALUE;
+    }
+    Capacity = 0;
+    NextRecord = 0;
+}
+
+DWORD IoTrace::Rotate()
+{
+    CloseFile();
+
+    // <Path>.<N-1> -> <Path>.<N>, ..., <Path> -> <Path>.1
+    for (UINT32 Index = MaxFileCount; Index > 0; Index--) {
+        std::string Src = Index > 1 ?
+            Path + "." + std::to_string(Index - 1) : Path;
+        std::string Dst = Path + "." + std::to_string(Index);
+        if (!MoveFileExA(Src.c_str(), Dst.c_str(),
+                         MOVEFILE_REPLACE_EXISTING)) {
+            DWORD Status = GetLastError();
+            if (Status != ERROR_FILE_NOT_FOUND) {
+                LogWarning("Could not rename IO trace file %s to %s. "
+                           "Error: %d.", Src.c_str(), Dst.c_str(), Status);
+            }
+        }
+    }
+
+    return OpenFile();
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "wnbd.h"
+
+#define WNBD_IO_TRACE_PENDING_SHARDS 16
+
+// Binary IO trace writer, see WnbdStartIoTrace.
+//
+// Requests are recorded when completed. The fetch information is kept
+// aside until then, using a map that's sharded by request handle.
+//
+// Records are appended to a memory mapped trace file. Slots are reserved
+// atomically while holding the lock in shared mode, the exclusive mode
+// being used for opening, rotating and closing the file.
+class IoTrace
+{
+private:
+    struct PendingShard
+    {
+        std::mutex Lock;
+        std::unordered_map<UINT64, WNBD_IO_TRACE_RECORD> Requests;
+    };
+
+    std::atomic<bool> Active = false;
+    SRWLOCK Lock = SRWLOCK_INIT;
+
+    std::string Path;
+    UINT64 MaxFileSize = 0;
+    UINT32 MaxFileCount = 0;
+    UINT32 BlockSize = 0;
+    UINT64 BlockCount = 0;
+    std::string InstanceName;
+
+    HANDLE File = INVALID_HANDLE_VALUE;
+    HANDLE Mapping = NULL;
+    PWNBD_IO_TRACE_HEADER Header = nullptr;
+    PWNBD_IO_TRACE_RECORD Records = nullptr;
+    UINT64 Capacity = 0;
+    std::atomic<UINT64> NextRecord = 0;
+
+    PendingShard PendingShards[WNBD_IO_TRACE_PENDING_SHARDS];
+
+public:
+    ~IoTrace();
+
+    DWORD Start(PWNBD_DISK Disk, PWNBD_IO_TRACE_OPTIONS Options);
+    void Stop();
+
+    bool IsActive() { return Active.load(std::memory_order_relaxed); }
+
+    void RequestFetched(PWNBD_IO_REQUEST Request, PVOID Buffer);
+    void RequestCompleted(PWNBD_IO_RESPONSE Response);
+
+private:
+    PendingShard& GetShard(UINT64 RequestHandle) {
+        return PendingShards[RequestHandle % WNBD_IO_TRACE_PENDING_SHARDS];
+    }
+
+    void Append(PWNBD_IO_TRACE_RECORD Record);
+    // Must be called while holding the lock in shared mode.
+    void CommitRecord(UINT64 Index, PWNBD_IO_TRACE_RECORD Record);
+
+    // The following must be called while holding the lock
+    // in exclusive mode.
+    DWORD OpenFile();
+    void CloseFile();
+    DWORD Rotate();
+};
@@ -4,8 +4,24 @@
  * Licensed under LGPL-2.1 (see LICENSE)
  */
 
+#include "block_daemon.h"
+#include "buffer_pool.h"
+#include "compressed_file_device.h"
+#include "compressed_ram_device.h"
+#include "disk_crypt.h"
+#include "disk_integrity.h"
+#include "dispatcher_scaler.h"
+#include "file_device.h"
+#include "io_trace.h"
+#include "mirror_device.h"
 #include "nbd_daemon.h"
+#include "nbd_device.h"
+#include "overlay_device.h"
+#include "ram_device.h"
+#include "stripe_device.h"
+#include "usr_stats.h"
 #include "wnbd.h"
+#include "wnbd_fetch.h"
 #include "wnbd_log.h"
 #include "utils.h"
 #include "version.h"
@@ -13,12 +29,33 @@
 #include <windows.h>
 
 #include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <sstream>
 #include <iomanip>
+#include <mutex>
+#include <vector>
 
 #define _NTSCSI_USER_MODE_
 #include <scsi.h>
 
+// Dispatcher thread state, allowing IO callbacks to lease the
+// request buffer.
+struct DispatcherThreadState
+{
+    PWNBD_DISK Disk;
+    PVOID RequestBuffer;
+    BOOLEAN BufferLeased;
+};
+static thread_local DispatcherThreadState CurrDispatcherState = { 0 };
+
+static VOID WnbdFreeDispatcherContext(PWNBD_DISK Disk);
+VOID WnbdSignalStopped(PWNBD_DISK Disk);
+BOOLEAN WnbdIsRunning(PWNBD_DISK Disk);
+VOID WnbdHandleRequest(PWNBD_DISK Disk, PWNBD_IO_REQUEST Request,
+                       PVOID Buffer);
+
 DWORD WnbdCreate(
     const PWNBD_PROPERTIES Properties,
     const PWNBD_INTERFACE Interface,
@@ -27,16 +64,31 @@ DWORD WnbdCreate(
 {
     DWORD ErrorCode = ERROR_SUCCESS;
     PWNBD_DISK Disk = NULL;
+    UsrStatsShards* UsrStats = nullptr;
 
     Disk = (PWNBD_DISK) calloc(1, sizeof(WNBD_DISK));
     if (!Disk) {
         LogError("Failed to allocate %d bytes.", sizeof(WNBD_DISK));
         return ERROR_OUTOFMEMORY;
     }
+    InitializeSListHead(&Disk->CoroResponses);
 
     Disk->Context = Context;
     Disk->Interface = Interface;
     Disk->Properties = *Properties;
+
+    UsrStats = new (std::nothrow) UsrStatsShards();
+    if (!UsrStats) {
+        LogError("Could not allocate memory.");
+        ErrorCode = ERROR_OUTOFMEMORY;
+        goto Exit;
+    }
+    Disk->UsrStats = UsrStats;
+    ErrorCode = UsrStats->Initialize();
+    if (ErrorCode) {
+        goto Exit;
+    }
+
     ErrorCode = WnbdOpenAdapter(&Disk->Handle);
 
     LogDebug("Mapping device. Name=%s, Serial=%s, Owner=%s, "
@@ -55,13 +107,24 @@ DWORD WnbdCreate(
              Properties->Flags.UnmapAnchorSupported,
              Properties->MaxUnmapDescCount,
              Properties->Flags.UseUserspaceNbd);
+    LogDebug("QoS limits: ReadIops=%llu/%llu, WriteIops=%llu/%llu, "
+             "ReadBandwidth=%llu/%llu, WriteBandwidth=%llu/%llu.",
+             Properties->QosLimits.ReadIops.Rate,
+             Properties->QosLimits.ReadIops.Burst,
+             Properties->QosLimits.WriteIops.Rate,
+             Properties->QosLimits.WriteIops.Burst,
+             Properties->QosLimits.ReadBandwidth.Rate,
+             Properties->QosLimits.ReadBandwidth.Burst,
+             Properties->QosLimits.WriteBandwidth.Rate,
+             Properties->QosLimits.WriteBandwidth.Burst);
     if (Properties->Flags.UseKernelNbd || Properties->Flags.UseUserspaceNbd) {
         LogDebug("Nbd properties: Hostname=%s, Port=%u, ExportName=%s, "
-                 "SkipNegotiation=%u.",
+                 "SkipNegotiation=%u, DetectZeroes=%u.",
                  Properties->NbdProperties.Hostname,
                  Properties->NbdProperties.PortNumber,
                  Properties->NbdProperties.ExportName,
-                 Properties->NbdProperties.Flags.SkipNegotiation);
+                 Properties->NbdProperties.Flags.SkipNegotiation,
+                 Properties->NbdProperties.Flags.DetectZeroes);
     }
 
     if (ErrorCode) {
@@ -92,9 +155,124 @@ Exit:
     return ErrorCode;
 }
 
+DWORD WnbdCreateOffline(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_INTERFACE Interface,
+    PVOID Context,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk)
+{
+    DWORD ErrorCode = ERROR_SUCCESS;
+    PWNBD_DISK Disk = NULL;
+    UsrStatsShards* UsrStats = nullptr;
+
+    if (!ResponseFunc) {
+        LogError("No response function specified.");
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    Disk = (PWNBD_DISK) calloc(1, sizeof(WNBD_DISK));
+    if (!Disk) {
+        LogError("Failed to allocate %d bytes.", sizeof(WNBD_DISK));
+        return ERROR_OUTOFMEMORY;
+    }
+    InitializeSListHead(&Disk->CoroResponses);
+
+    Disk->Context = Context;
+    Disk->Interface = Interface;
+    Disk->Properties = *Properties;
+    Disk->OfflineResponse = ResponseFunc;
+    Disk->OfflineResponseContext = ResponseContext;
+
+    UsrStats = new (std::nothrow) UsrStatsShards();
+    if (!UsrStats) {
+        LogError("Could not allocate memory.");
+        ErrorCode = ERROR_OUTOFMEMORY;
+        goto Exit;
+    }
+    Disk->UsrStats = UsrStats;
+    ErrorCode = UsrStats->Initialize();
+    if (ErrorCode) {
+        goto Exit;
+    }
+
+    LogDebug("Created offline device. Name=%s, BC=%llu, BS=%lu.",
+             Properties->InstanceName,
+             Properties->BlockCount,
+             Properties->BlockSize);
+
+    // There's no dispatcher, requests are submitted by the caller.
+    Disk->Started = TRUE;
+    *PDisk = Disk;
+
+Exit:
+    if (ErrorCode) {
+        WnbdClose(Disk);
+    }
+
+    return ErrorCode;
+}
+
+DWORD WnbdSubmitRequest(
+    PWNBD_DISK Disk,
+    PWNBD_IO_REQUEST Request,
+    PVOID Buffer)
+{
+    if (!Disk || !Disk->OfflineResponse) {
+        LogError("Requests may only be submitted to offline disks.");
+        return ERROR_INVALID_FUNCTION;
+    }
+    if (!WnbdIsRunning(Disk)) {
+        return ERROR_PIPE_NOT_CONNECTED;
+    }
+
+    WnbdHandleRequest(Disk, Request, Buffer);
+    return 0;
+}
+
+DWORD WnbdCreateOfflineNbd(
+    const PWNBD_PROPERTIES Properties,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk)
+{
+    NbdDaemon* Daemon = new (std::nothrow) NbdDaemon(Properties);
+    if (!Daemon) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+
+    Daemon->SetOffline(ResponseFunc, ResponseContext);
+    DWORD Status = Daemon->Start();
+    if (Status) {
+        delete Daemon;
+        return Status;
+    }
+
+    *PDisk = Daemon->GetDisk();
+    return 0;
+}
+
+VOID WnbdCloseOfflineNbd(PWNBD_DISK Disk)
+{
+    if (Disk) {
+        // Closes the disk as well.
+        delete (NbdDaemon*) Disk->Context;
+    }
+}
+
 DWORD WnbdRunNbdDaemon(const PWNBD_PROPERTIES Properties)
 {
-    NbdDaemon Daemon(Properties);
+    return WnbdRunNbdDaemonEx(Properties, NULL, NULL);
+}
+
+DWORD WnbdRunNbdDaemonEx(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions)
+{
+    NbdDaemon Daemon(Properties, DispatcherOptions, IoTraceOptions);
     DWORD Status = Daemon.Start();
     if (Status) {
         return Status;
@@ -107,137 +285,661 @@ DWORD WnbdRunNbdDaemon(const PWNBD_PROPERTIES Properties)
     return Status;
 }
 
-DWORD PnpRemoveDevice(
-    DEVINST DiskDeviceInst,
-    DWORD TimeoutMs,
-    DWORD RetryIntervalMs)
+static DWORD GetDiskSize(const PWNBD_PROPERTIES Properties, PUINT64 DiskSize)
 {
-    DWORD Status = 0;
+    UINT32 BlockSize = Properties->BlockSize ?
+        Properties->BlockSize : WNBD_DEFAULT_BLOCK_SIZE;
+    if (Properties->BlockCount > ULLONG_MAX / BlockSize) {
+        LogError("Invalid block count: %llu.", Properties->BlockCount);
+        return ERROR_INVALID_PARAMETER;
+    }
+    *DiskSize = Properties->BlockCount * BlockSize;
+    return 0;
+}
 
-    LARGE_INTEGER StartTime, CurrTime, ElapsedMs, CounterFreq;
-    QueryPerformanceFrequency(&CounterFreq);
-    QueryPerformanceCounter(&StartTime);
+static DWORD OpenFileDevice(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_FILE_OPTIONS FileOptions,
+    std::unique_ptr<BlockDevice>& Device)
+{
+    UINT64 DiskSize = 0;
+    DWORD Status = GetDiskSize(Properties, &DiskSize);
+    if (Status) {
+        return Status;
+    }
 
-    BOOLEAN RemoveVetoed = FALSE;
-    BOOLEAN TimeLeft = TRUE;
-    WCHAR VetoName[MAX_PATH];
-    DWORD Attempt = 0;
+    if (FileOptions->Compression &&
+            FileOptions->Compression->Codec != WnbdCompressionNone) {
+        CompressedFileDevice* Image =
+            new (std::nothrow) CompressedFileDevice();
+        if (!Image) {
+            LogError("Could not allocate memory.");
+            return ERROR_OUTOFMEMORY;
+        }
+        Device.reset(Image);
+        return Image->Open(
+            FileOptions, Properties->Flags.ReadOnly, DiskSize);
+    }
 
-    LogInfo("Soft removing disk device.");
-    do {
-        PNP_VETO_TYPE VetoType = PNP_VetoTypeUnknown;
-        memset(VetoName, 0, sizeof(VetoName));
+    FileDevice* File = new (std::nothrow) FileDevice();
+    if (!File) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    Device.reset(File);
+    return File->Open(FileOptions, Properties->Flags.ReadOnly, DiskSize);
+}
 
-        // We're supposed to use CM_Query_And_Remove_SubTreeW when
-        // SurpriseRemovalOK is not set, otherwise we'd have to go
-        // with CM_Request_Device_EjectW.
-        LogDebug("Soft remove attempt: %d.", Attempt++);
-        DWORD CMStatus = CM_Query_And_Remove_SubTreeW(
-            DiskDeviceInst, &VetoType, VetoName, MAX_PATH, CM_REMOVE_NO_RESTART);
+static DWORD OpenRamDevice(
+    const PWNBD_PROPERTIES Properties,
+    std::unique_ptr<BlockDevice>& Device)
+{
+    UINT64 DiskSize = 0;
+    DWORD Status = GetDiskSize(Properties, &DiskSize);
+    if (Status) {
+        return Status;
+    }
 
-        QueryPerformanceCounter(&CurrTime);
-        ElapsedMs.QuadPart = CurrTime.QuadPart - StartTime.QuadPart;
-        ElapsedMs.QuadPart *= 1000;
-        ElapsedMs.QuadPart /= CounterFreq.QuadPart;
+    RamDevice* Ram = new (std::nothrow) RamDevice();
+    if (!Ram) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    Device.reset(Ram);
+    return Ram->Initialize(DiskSize);
+}
 
-        RemoveVetoed = CMStatus == CR_REMOVE_VETOED;
-        TimeLeft = !TimeoutMs || (TimeoutMs > ElapsedMs.QuadPart);
-        if (CMStatus) {
-            if (!RemoveVetoed){
-                Status = ERROR_REMOVE_FAILED;
-            }
-            else if (!TimeLeft) {
-                Status = ERROR_TIMEOUT;
-            }
+static DWORD OpenCompressedRamDevice(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_COMPRESSION_OPTIONS CompressionOptions,
+    std::unique_ptr<BlockDevice>& Device)
+{
+    UINT64 DiskSize = 0;
+    DWORD Status = GetDiskSize(Properties, &DiskSize);
+    if (Status) {
+        return Status;
+    }
+    if (!CompressionOptions) {
+        LogError("No compression options specified.");
+        return ERROR_INVALID_PARAMETER;
+    }
 
-            std::ostringstream TimeLeftSS;
-            if (!TimeoutMs) {
-                TimeLeftSS << "infinite";
-            } else {
-                TimeLeftSS << std::setprecision(2)
-                           << (TimeoutMs - ElapsedMs.QuadPart) / 1000.0
-                           << "s";
-            }
+    CompressedRamDevice* Ram = new (std::nothrow) CompressedRamDevice();
+    if (!Ram) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    Device.reset(Ram);
+    return Ram->Initialize(DiskSize, CompressionOptions);
+}
 
-            LogWarning(
-               "Could not remove device. CM status: %d, "
-               "veto type %d, veto name: %ls. "
-               "Time elapsed: %.2fs, time left: %s. "
-               "Check the Windows System event log (Kernel-PnP source) "
-               "for more information about the process that is holding "
-               "the disk.",
-               CMStatus, VetoType, VetoName,
-               ElapsedMs.QuadPart / 1000.0,
-               TimeLeftSS.str().c_str());
-        }
-        if (RemoveVetoed && TimeLeft) {
-            Sleep(RetryIntervalMs);
-        }
-    } while (RemoveVetoed && TimeLeft);
+// Connects to the specified NBD export, the other disk properties
+// being passed through.
+static DWORD OpenNbdDevice(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Connection,
+    std::unique_ptr<BlockDevice>& Device)
+{
+    NbdDevice* Nbd = new (std::nothrow) NbdDevice();
+    if (!Nbd) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    Device.reset(Nbd);
 
-    return Status;
+    WNBD_PROPERTIES NbdProperties = *Properties;
+    NbdProperties.NbdProperties = *Connection;
+    NbdProperties.Flags.UseUserspaceNbd = 1;
+    return Nbd->Open(&NbdProperties);
 }
 
-DWORD WnbdPnpRemoveDevice(
-    PWSTR PNPDeviceID,
-    DWORD TimeoutMs,
-    DWORD RetryIntervalMs)
+static DWORD OpenNbdMembers(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    std::vector<std::unique_ptr<BlockDevice>>& Devices)
 {
-    DEVINST DiskDeviceInst = 0;
-    DWORD CMStatus = CM_Locate_DevNode_ExW(
-        &DiskDeviceInst, PNPDeviceID,
-        CM_LOCATE_DEVNODE_NORMAL,
-        NULL);
-    if (CMStatus) {
-        LogInfo("Could not open device: %ls. CM status: %d.",
-                PNPDeviceID, CMStatus);
-        return ERROR_OPEN_FAILED;
+    if (!Members || !MemberCount || MemberCount > WNBD_MAX_NBD_MEMBERS) {
+        LogError("Invalid NBD member count: %d. Maximum supported: %d.",
+                 MemberCount, WNBD_MAX_NBD_MEMBERS);
+        return ERROR_INVALID_PARAMETER;
     }
 
-    return PnpRemoveDevice(DiskDeviceInst, TimeoutMs, RetryIntervalMs);
+    Devices.resize(MemberCount);
+    for (UINT32 Index = 0; Index < MemberCount; Index++) {
+        DWORD Status = OpenNbdDevice(
+            Properties, &Members[Index], Devices[Index]);
+        if (Status) {
+            return Status;
+        }
+    }
+    return 0;
 }
 
-DWORD WnbdResetAdapter()
+static DWORD OpenOverlayDevice(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_OVERLAY_OPTIONS OverlayOptions,
+    std::unique_ptr<BlockDevice>& Device)
 {
-    DEVINST DeviceInst = {0};
-    DWORD Status = WnbdGetAdapterDevInst(&DeviceInst);
+    std::unique_ptr<BlockDevice> Base;
+    DWORD Status = 0;
+    if (OverlayOptions->BasePath[0]) {
+        FileDevice* BaseFile = new (std::nothrow) FileDevice();
+        if (!BaseFile) {
+            LogError("Could not allocate memory.");
+            return ERROR_OUTOFMEMORY;
+        }
+        Base.reset(BaseFile);
+
+        // The system file cache is shared by the disks using this base.
+        WNBD_FILE_OPTIONS FileOptions = { 0 };
+        memcpy(FileOptions.Path, OverlayOptions->BasePath, MAX_PATH);
+        FileOptions.Flags.BufferedIo = 1;
+        Status = BaseFile->Open(&FileOptions, TRUE, 0);
+    } else {
+        WNBD_PROPERTIES BaseProperties = *Properties;
+        BaseProperties.Flags.ReadOnly = 1;
+        Status = OpenNbdDevice(
+            &BaseProperties, &Properties->NbdProperties, Base);
+    }
     if (Status) {
-        LogError("Could not retrieve adapter device instance handle. "
-                 "Status: %d.", Status);
         return Status;
     }
 
-    DWORD CMStatus = CM_Disable_DevNode(DeviceInst, CM_DISABLE_UI_NOT_OK);
-    if (CMStatus) {
-        if (CMStatus == CR_REMOVE_VETOED) {
-            LogWarning("Could not reset WNBD adapter. "
-                       "Device in use, operation vetoed.");
-            return ERROR_BUSY;
-        }
-        LogError("Could not reset WNBD adapter. CM status: %d.",
-                 CMStatus);
-        return ERROR_REMOVE_FAILED;
+    OverlayDevice* Overlay = new (std::nothrow) OverlayDevice();
+    if (!Overlay) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
     }
+    Device.reset(Overlay);
+    return Overlay->Open(std::move(Base), OverlayOptions);
+}
 
-    CMStatus = CM_Enable_DevNode(DeviceInst, 0);
-    if (CMStatus) {
-        LogError("Could not enable WNBD adapter. CM status: %d.",
-                 CMStatus);
-        return ERROR_NOT_READY;
+static DWORD OpenStripeDevice(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_STRIPE_OPTIONS StripeOptions,
+    std::unique_ptr<BlockDevice>& Device)
+{
+    std::vector<std::unique_ptr<BlockDevice>> MemberDevices;
+    DWORD Status = OpenNbdMembers(
+        Properties, Members, MemberCount, MemberDevices);
+    if (Status) {
+        return Status;
     }
 
-    return 0;
+    StripeDevice* Stripe = new (std::nothrow) StripeDevice();
+    if (!Stripe) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    Device.reset(Stripe);
+    return Stripe->Open(
+        std::move(MemberDevices),
+        StripeOptions ? StripeOptions->StripeSize : 0);
 }
 
-DWORD WnbdResetAdapterEx(
-    DWORD TimeoutMs,
-    DWORD RetryIntervalMs)
+static DWORD OpenMirrorDevice(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_MIRROR_OPTIONS MirrorOptions,
+    std::unique_ptr<BlockDevice>& Device)
 {
-    DWORD Status = 0;
+    std::vector<std::unique_ptr<BlockDevice>> Replicas;
+    DWORD Status = OpenNbdMembers(
+        Properties, Members, MemberCount, Replicas);
+    if (Status) {
+        return Status;
+    }
 
-    LARGE_INTEGER StartTime, CurrTime, ElapsedMs, CounterFreq;
-    QueryPerformanceFrequency(&CounterFreq);
-    QueryPerformanceCounter(&StartTime);
+    // Identifies the replicas in the mirror state file.
+    std::vector<std::string> ReplicaNames;
+    for (UINT32 Index = 0; Index < MemberCount; Index++) {
+        ReplicaNames.push_back(
+            std::string(Members[Index].Hostname) + ":" +
+            std::to_string(Members[Index].PortNumber) + "/" +
+            Members[Index].ExportName);
+    }
+
+    MirrorDevice* Mirror = new (std::nothrow) MirrorDevice();
+    if (!Mirror) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    Device.reset(Mirror);
+    return Mirror->Open(std::move(Replicas), ReplicaNames, MirrorOptions);
+}
+
+static DWORD CreateOfflineBlockDaemon(
+    const PWNBD_PROPERTIES Properties,
+    std::unique_ptr<BlockDevice> Device,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk)
+{
+    BlockDaemon* Daemon = new (std::nothrow) BlockDaemon(
+        Properties, std::move(Device));
+    if (!Daemon) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+
+    Daemon->SetOffline(ResponseFunc, ResponseContext);
+    DWORD Status = Daemon->Start();
+    if (Status) {
+        delete Daemon;
+        return Status;
+    }
+
+    *PDisk = Daemon->GetDisk();
+    return 0;
+}
+
+static VOID CloseOfflineBlockDaemon(PWNBD_DISK Disk)
+{
+    if (Disk) {
+        // Closes the disk as well.
+        delete (BlockDaemon*) Disk->Context;
+    }
+}
+
+static DWORD RunBlockDaemon(
+    const PWNBD_PROPERTIES Properties,
+    std::unique_ptr<BlockDevice> Device,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions)
+{
+    BlockDaemon Daemon(
+        Properties, std::move(Device), DispatcherOptions, IoTraceOptions);
+    DWORD Status = Daemon.Start();
+    if (Status) {
+        return Status;
+    }
+
+    LogInfo("Mapping created, running as a daemon. "
+            "Press CTRL-C to stop or use 'wnbd-client unmap'. ");
+    Status = Daemon.Wait();
+    LogDebug("Daemon exited. Status: %d.", Status);
+    return Status;
+}
+
+DWORD WnbdCreateOfflineFile(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_FILE_OPTIONS FileOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenFileDevice(Properties, FileOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return CreateOfflineBlockDaemon(
+        Properties, std::move(Device), ResponseFunc, ResponseContext, PDisk);
+}
+
+VOID WnbdCloseOfflineFile(PWNBD_DISK Disk)
+{
+    CloseOfflineBlockDaemon(Disk);
+}
+
+DWORD WnbdRunFileDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_FILE_OPTIONS FileOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenFileDevice(Properties, FileOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return RunBlockDaemon(
+        Properties, std::move(Device), DispatcherOptions, IoTraceOptions);
+}
+
+DWORD WnbdCreateOfflineRam(
+    const PWNBD_PROPERTIES Properties,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenRamDevice(Properties, Device);
+    if (Status) {
+        return Status;
+    }
+    return CreateOfflineBlockDaemon(
+        Properties, std::move(Device), ResponseFunc, ResponseContext, PDisk);
+}
+
+VOID WnbdCloseOfflineRam(PWNBD_DISK Disk)
+{
+    CloseOfflineBlockDaemon(Disk);
+}
+
+DWORD WnbdRunRamDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenRamDevice(Properties, Device);
+    if (Status) {
+        return Status;
+    }
+    return RunBlockDaemon(
+        Properties, std::move(Device), DispatcherOptions, IoTraceOptions);
+}
+
+DWORD WnbdCreateOfflineCompressedRam(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_COMPRESSION_OPTIONS CompressionOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenCompressedRamDevice(
+        Properties, CompressionOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return CreateOfflineBlockDaemon(
+        Properties, std::move(Device), ResponseFunc, ResponseContext, PDisk);
+}
+
+VOID WnbdCloseOfflineCompressedRam(PWNBD_DISK Disk)
+{
+    CloseOfflineBlockDaemon(Disk);
+}
+
+DWORD WnbdRunCompressedRamDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_COMPRESSION_OPTIONS CompressionOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenCompressedRamDevice(
+        Properties, CompressionOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return RunBlockDaemon(
+        Properties, std::move(Device), DispatcherOptions, IoTraceOptions);
+}
+
+DWORD WnbdGetCompressionStats(
+    PWNBD_DISK Disk,
+    PWNBD_COMPRESSION_STATS Stats)
+{
+    if (!Disk || !Disk->Context || !Stats) {
+        return ERROR_INVALID_PARAMETER;
+    }
+    CompressedDevice* Compressed = dynamic_cast<CompressedDevice*>(
+        ((BlockDaemon*) Disk->Context)->GetDevice());
+    if (!Compressed) {
+        return ERROR_NOT_SUPPORTED;
+    }
+    Compressed->GetStats(Stats);
+    return 0;
+}
+
+DWORD WnbdCreateOfflineOverlay(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_OVERLAY_OPTIONS OverlayOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenOverlayDevice(Properties, OverlayOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return CreateOfflineBlockDaemon(
+        Properties, std::move(Device), ResponseFunc, ResponseContext, PDisk);
+}
+
+VOID WnbdCloseOfflineOverlay(PWNBD_DISK Disk)
+{
+    CloseOfflineBlockDaemon(Disk);
+}
+
+DWORD WnbdRunOverlayDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PWNBD_OVERLAY_OPTIONS OverlayOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenOverlayDevice(Properties, OverlayOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return RunBlockDaemon(
+        Properties, std::move(Device), DispatcherOptions, IoTraceOptions);
+}
+
+DWORD WnbdCreateOfflineStripe(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_STRIPE_OPTIONS StripeOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenStripeDevice(
+        Properties, Members, MemberCount, StripeOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return CreateOfflineBlockDaemon(
+        Properties, std::move(Device), ResponseFunc, ResponseContext, PDisk);
+}
+
+VOID WnbdCloseOfflineStripe(PWNBD_DISK Disk)
+{
+    CloseOfflineBlockDaemon(Disk);
+}
+
+DWORD WnbdRunStripeDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_STRIPE_OPTIONS StripeOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenStripeDevice(
+        Properties, Members, MemberCount, StripeOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return RunBlockDaemon(
+        Properties, std::move(Device), DispatcherOptions, IoTraceOptions);
+}
+
+DWORD WnbdCreateOfflineMirror(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_MIRROR_OPTIONS MirrorOptions,
+    OfflineResponseFunc ResponseFunc,
+    PVOID ResponseContext,
+    PWNBD_DISK* PDisk)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenMirrorDevice(
+        Properties, Members, MemberCount, MirrorOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return CreateOfflineBlockDaemon(
+        Properties, std::move(Device), ResponseFunc, ResponseContext, PDisk);
+}
+
+VOID WnbdCloseOfflineMirror(PWNBD_DISK Disk)
+{
+    CloseOfflineBlockDaemon(Disk);
+}
+
+DWORD WnbdRunMirrorDaemon(
+    const PWNBD_PROPERTIES Properties,
+    const PNBD_CONNECTION_PROPERTIES Members,
+    UINT32 MemberCount,
+    const PWNBD_MIRROR_OPTIONS MirrorOptions,
+    const PWNBD_DISPATCHER_OPTIONS DispatcherOptions,
+    const PWNBD_IO_TRACE_OPTIONS IoTraceOptions)
+{
+    std::unique_ptr<BlockDevice> Device;
+    DWORD Status = OpenMirrorDevice(
+        Properties, Members, MemberCount, MirrorOptions, Device);
+    if (Status) {
+        return Status;
+    }
+    return RunBlockDaemon(
+        Properties, std::move(Device), DispatcherOptions, IoTraceOptions);
+}
+
+DWORD PnpRemoveDevice(
+    DEVINST DiskDeviceInst,
+    DWORD TimeoutMs,
+    DWORD RetryIntervalMs)
+{
+    DWORD Status = 0;
+
+    LARGE_INTEGER StartTime, CurrTime, ElapsedMs, CounterFreq;
+    QueryPerformanceFrequency(&CounterFreq);
+    QueryPerformanceCounter(&StartTime);
+
+    BOOLEAN RemoveVetoed = FALSE;
+    BOOLEAN TimeLeft = TRUE;
+    WCHAR VetoName[MAX_PATH];
+    DWORD Attempt = 0;
+
+    LogInfo("Soft removing disk device.");
+    do {
+        PNP_VETO_TYPE VetoType = PNP_VetoTypeUnknown;
+        memset(VetoName, 0, sizeof(VetoName));
+
+        // We're supposed to use CM_Query_And_Remove_SubTreeW when
+        // SurpriseRemovalOK is not set, otherwise we'd have to go
+        // with CM_Request_Device_EjectW.
+        LogDebug("Soft remove attempt: %d.", Attempt++);
+        DWORD CMStatus = CM_Query_And_Remove_SubTreeW(
+            DiskDeviceInst, &VetoType, VetoName, MAX_PATH, CM_REMOVE_NO_RESTART);
+
+        QueryPerformanceCounter(&CurrTime);
+        ElapsedMs.QuadPart = CurrTime.QuadPart - StartTime.QuadPart;
+        ElapsedMs.QuadPart *= 1000;
+        ElapsedMs.QuadPart /= CounterFreq.QuadPart;
+
+        RemoveVetoed = CMStatus == CR_REMOVE_VETOED;
+        TimeLeft = !TimeoutMs || (TimeoutMs > ElapsedMs.QuadPart);
+        if (CMStatus) {
+            if (!RemoveVetoed){
+                Status = ERROR_REMOVE_FAILED;
+            }
+            else if (!TimeLeft) {
+                Status = ERROR_TIMEOUT;
+            }
+
+            std::ostringstream TimeLeftSS;
+            if (!TimeoutMs) {
+                TimeLeftSS << "infinite";
+            } else {
+                TimeLeftSS << std::setprecision(2)
+                           << (TimeoutMs - ElapsedMs.QuadPart) / 1000.0
+                           << "s";
+            }
+
+            LogWarning(
+               "Could not remove device. CM status: %d, "
+               "veto type %d, veto name: %ls. "
+               "Time elapsed: %.2fs, time left: %s. "
+               "Check the Windows System event log (Kernel-PnP source) "
+               "for more information about the process that is holding "
+               "the disk.",
+               CMStatus, VetoType, VetoName,
+               ElapsedMs.QuadPart / 1000.0,
+               TimeLeftSS.str().c_str());
+        }
+        if (RemoveVetoed && TimeLeft) {
+            Sleep(RetryIntervalMs);
+        }
+    } while (RemoveVetoed && TimeLeft);
+
+    return Status;
+}
+
+DWORD WnbdPnpRemoveDevice(
+    PWSTR PNPDeviceID,
+    DWORD TimeoutMs,
+    DWORD RetryIntervalMs)
+{
+    DEVINST DiskDeviceInst = 0;
+    DWORD CMStatus = CM_Locate_DevNode_ExW(
+        &DiskDeviceInst, PNPDeviceID,
+        CM_LOCATE_DEVNODE_NORMAL,
+        NULL);
+    if (CMStatus) {
+        LogInfo("Could not open device: %ls. CM status: %d.",
+                PNPDeviceID, CMStatus);
+        return ERROR_OPEN_FAILED;
+    }
+
+    return PnpRemoveDevice(DiskDeviceInst, TimeoutMs, RetryIntervalMs);
+}
+
+DWORD WnbdResetAdapter()
+{
+    DEVINST DeviceInst = {0};
+    DWORD Status = WnbdGetAdapterDevInst(&DeviceInst);
+    if (Status) {
+        LogError("Could not retrieve adapter device instance handle. "
+                 "Status: %d.", Status);
+        return Status;
+    }
+
+    DWORD CMStatus = CM_Disable_DevNode(DeviceInst, CM_DISABLE_UI_NOT_OK);
+    if (CMStatus) {
+        if (CMStatus == CR_REMOVE_VETOED) {
+            LogWarning("Could not reset WNBD adapter. "
+                       "Device in use, operation vetoed.");
+            return ERROR_BUSY;
+        }
+        LogError("Could not reset WNBD adapter. CM status: %d.",
+                 CMStatus);
+        return ERROR_REMOVE_FAILED;
+    }
+
+    CMStatus = CM_Enable_DevNode(DeviceInst, 0);
+    if (CMStatus) {
+        LogError("Could not enable WNBD adapter. CM status: %d.",
+                 CMStatus);
+        return ERROR_NOT_READY;
+    }
+
+    return 0;
+}
+
+DWORD WnbdResetAdapterEx(
+    DWORD TimeoutMs,
+    DWORD RetryIntervalMs)
+{
+    DWORD Status = 0;
+
+    LARGE_INTEGER StartTime, CurrTime, ElapsedMs, CounterFreq;
+    QueryPerformanceFrequency(&CounterFreq);
+    QueryPerformanceCounter(&StartTime);
 
     BOOLEAN ResetVetoed = FALSE;
     BOOLEAN TimeLeft = TRUE;
@@ -286,6 +988,10 @@ DWORD WnbdRemove(
 
     LogInfo("Unmapping device %s.",
             Disk->Properties.InstanceName);
+    if (Disk->OfflineResponse) {
+        WnbdSignalStopped(Disk);
+        return 0;
+    }
     if (!Disk->Handle || Disk->Handle == INVALID_HANDLE_VALUE) {
         LogDebug("WNBD device already removed.");
         return 0;
@@ -470,7 +1176,9 @@ DWORD WnbdGetUserspaceStats(
         return ERROR_INVALID_PARAMETER;
     }
 
-    memcpy(Stats, &Disk->Stats, sizeof(WNBD_USR_STATS));
+    ((UsrStatsShards*) Disk->UsrStats)->Aggregate(Stats);
+    // Kept for backwards compatibility, see WNBD_DISK::Stats.
+    Disk->Stats = *Stats;
     return ERROR_SUCCESS;
 }
 
@@ -503,6 +1211,72 @@ DWORD WnbdGetDriverStats(
     return Status;
 }
 
+DWORD WnbdSetQosLimits(
+    const char* InstanceName,
+    PWNBD_QOS_LIMITS Limits)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenAdapter(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    Status = WnbdIoctlSetQosLimits(Handle, InstanceName, Limits, NULL);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
+DWORD WnbdGetLatencyStats(
+    const char* InstanceName,
+    PWNBD_LATENCY_STATS Stats)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenAdapter(&Handle);
+    if (Status) {
+        return ERROR_OPEN_FAILED;
+    }
+
+    Status = WnbdIoctlLatencyStats(Handle, InstanceName, Stats, NULL);
+
+    CloseHandle(Handle);
+    return Status;
+}
+
+UINT64 WnbdGetLatencyCount(const PWNBD_LATENCY_HISTOGRAM Histogram)
+{
+    UINT64 Count = 0;
+    for (UINT32 i = 0; i < WNBD_LATENCY_BUCKET_COUNT; i++) {
+        Count += Histogram->Buckets[i];
+    }
+    return Count;
+}
+
+UINT64 WnbdGetLatencyPercentile(
+    const PWNBD_LATENCY_HISTOGRAM Histogram,
+    DOUBLE Percentile)
+{
+    UINT64 Count = WnbdGetLatencyCount(Histogram);
+    if (!Count) {
+        return 0;
+    }
+
+    Percentile = min(max(Percentile, 0.0), 100.0);
+    // The number of requests that must have been accounted for.
+    UINT64 Target = max(1ULL, (UINT64) ceil(Count * Percentile / 100.0));
+    UINT64 Seen = 0;
+    for (UINT32 i = 0; i < WNBD_LATENCY_BUCKET_COUNT; i++) {
+        Seen += Histogram->Buckets[i];
+        if (Seen >= Target) {
+            if (i == WNBD_LATENCY_BUCKET_COUNT - 1) {
+                return WnbdLatencyBucketLowerBound(i);
+            }
+            return WnbdLatencyBucketLowerBound(i + 1) - 1;
+        }
+    }
+    return WnbdLatencyBucketLowerBound(WNBD_LATENCY_BUCKET_COUNT - 1);
+}
+
 DWORD WnbdGetLibVersion(PWNBD_VERSION Version)
 {
     if (!Version) {
@@ -655,6 +1429,26 @@ void WnbdClose(PWNBD_DISK Disk)
     if (Disk->DispatcherThreads)
         free(Disk->DispatcherThreads);
 
+    // The dispatcher returns its buffers to the pool.
+    if (Disk->DispatcherContext)
+        WnbdFreeDispatcherContext(Disk);
+
+    if (Disk->BufferPool)
+        delete (RequestBufferPool*) Disk->BufferPool;
+
+    if (Disk->UsrStats)
+        delete (UsrStatsShards*) Disk->UsrStats;
+
+    if (Disk->IoTrace)
+        delete (IoTrace*) Disk->IoTrace;
+
+    if (Disk->Crypt)
+        delete (DiskCrypt*) Disk->Crypt;
+
+    // Persists the checksums if a sidecar file is used.
+    if (Disk->Integrity)
+        delete (DiskIntegrity*) Disk->Integrity;
+
     free(Disk);
 }
 
@@ -764,6 +1558,191 @@ DWORD WnbdStopDispatcher(PWNBD_DISK Disk, PWNBD_REMOVE_OPTIONS RemoveOptions)
     return Ret;
 }
 
+DWORD WnbdLeaseRequestBuffer(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle,
+    PVOID Buffer)
+{
+    if (!Disk || !Disk->BufferPool) {
+        LogError("No device specified or the dispatcher wasn't started.");
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (!Buffer ||
+            CurrDispatcherState.Disk != Disk ||
+            CurrDispatcherState.RequestBuffer != Buffer ||
+            CurrDispatcherState.BufferLeased) {
+        LogError("Request buffers may only be leased by the IO callback "
+                 "that received them. Request handle: %llx.",
+                 RequestHandle);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    RequestBufferPool* Pool = (RequestBufferPool*) Disk->BufferPool;
+    DWORD Status = Pool->Lease(RequestHandle, Buffer);
+    if (!Status) {
+        CurrDispatcherState.BufferLeased = TRUE;
+    }
+    return Status;
+}
+
+DWORD WnbdReleaseRequestBuffer(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle)
+{
+    if (!Disk || !Disk->BufferPool) {
+        LogError("No device specified or the dispatcher wasn't started.");
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    RequestBufferPool* Pool = (RequestBufferPool*) Disk->BufferPool;
+    return Pool->Release(RequestHandle);
+}
+
+DWORD WnbdSetCompletionPort(
+    PWNBD_DISK Disk,
+    HANDLE CompletionPort,
+    ULONG_PTR CompletionKey)
+{
+    if (!Disk || !Disk->Handle || Disk->Handle == INVALID_HANDLE_VALUE) {
+        LogError("No device specified or the device wasn't opened.");
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (Disk->CompletionPort) {
+        LogError("The disk is already associated with a completion port.");
+        return ERROR_ALREADY_EXISTS;
+    }
+
+    if (!CreateIoCompletionPort(
+            Disk->Handle, CompletionPort, CompletionKey, 0)) {
+        DWORD Status = GetLastError();
+        LogError("Could not associate the disk with the completion port. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    // Requests that complete synchronously are handled by the caller
+    // right away, there's no point in queuing them.
+    if (!SetFileCompletionNotificationModes(
+            Disk->Handle, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS)) {
+        DWORD Status = GetLastError();
+        LogError("Could not set completion notification mode. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    Disk->CompletionPort = CompletionPort;
+    return 0;
+}
+
+static inline VOID ReleaseLeasedBuffer(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle)
+{
+    RequestBufferPool* Pool = (RequestBufferPool*) Disk->BufferPool;
+    if (Pool && Pool->HasLeases()) {
+        Pool->Release(RequestHandle);
+    }
+}
+
+DWORD WnbdStartIoTrace(
+    PWNBD_DISK Disk,
+    PWNBD_IO_TRACE_OPTIONS Options)
+{
+    IoTrace* Trace = (IoTrace*) Disk->IoTrace;
+    if (!Trace) {
+        IoTrace* NewTrace = new (std::nothrow) IoTrace();
+        if (!NewTrace) {
+            LogError("Could not allocate memory.");
+            return ERROR_OUTOFMEMORY;
+        }
+        Trace = (IoTrace*) InterlockedCompareExchangePointer(
+            &Disk->IoTrace, NewTrace, NULL);
+        if (Trace) {
+            // Concurrent WnbdStartIoTrace call.
+            delete NewTrace;
+        } else {
+            Trace = NewTrace;
+        }
+    }
+
+    return Trace->Start(Disk, Options);
+}
+
+VOID WnbdStopIoTrace(PWNBD_DISK Disk)
+{
+    // The trace object is released by WnbdClose, the dispatchers
+    // may still be using it.
+    IoTrace* Trace = (IoTrace*) Disk->IoTrace;
+    if (Trace) {
+        Trace->Stop();
+    }
+}
+
+DWORD WnbdEnableEncryption(
+    PWNBD_DISK Disk,
+    PWNBD_ENCRYPTION_OPTIONS Options)
+{
+    if (Disk->Crypt) {
+        LogError("Encryption already enabled.");
+        return ERROR_ALREADY_INITIALIZED;
+    }
+
+    DiskCrypt* Crypt = new (std::nothrow) DiskCrypt();
+    if (!Crypt) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    DWORD Status = Crypt->Initialize(Disk, Options);
+    if (Status) {
+        delete Crypt;
+        return Status;
+    }
+
+    Disk->Crypt = Crypt;
+    return 0;
+}
+
+DWORD WnbdEnableIntegrity(
+    PWNBD_DISK Disk,
+    PWNBD_INTEGRITY_OPTIONS Options)
+{
+    if (Disk->Integrity) {
+        LogError("Integrity checks already enabled.");
+        return ERROR_ALREADY_INITIALIZED;
+    }
+
+    DiskIntegrity* Integrity = new (std::nothrow) DiskIntegrity();
+    if (!Integrity) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    DWORD Status = Integrity->Initialize(Disk, Options);
+    if (Status) {
+        delete Integrity;
+        return Status;
+    }
+
+    Disk->Integrity = Integrity;
+    return 0;
+}
+
+DWORD WnbdGetIntegrityStats(
+    PWNBD_DISK Disk,
+    PWNBD_INTEGRITY_STATS Stats)
+{
+    if (!Disk || !Stats) {
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (!Disk->Integrity) {
+        return ERROR_NOT_SUPPORTED;
+    }
+    ((DiskIntegrity*) Disk->Integrity)->GetStats(Stats);
+    return 0;
+}
+
 void WnbdSetSenseEx(PWNBD_STATUS Status, UINT8 SenseKey, UINT8 Asc, UINT64 Info)
 {
     Status->ScsiStatus = SCSISTAT_CHECK_CONDITION;
@@ -802,38 +1781,70 @@ DWORD WnbdSendResponseEx(
         DataBuffer,
         DataBufferSize);
 
-    InterlockedIncrement64((PLONG64)&Disk->Stats.TotalReceivedReplies);
-    InterlockedDecrement64((PLONG64)&Disk->Stats.PendingSubmittedRequests);
+    // Verified before decrypting the data, also before tracing the
+    // request so that checksum errors get recorded.
+    DiskIntegrity* Integrity = (DiskIntegrity*) Disk->Integrity;
+    if (Integrity && Response->RequestType == WnbdReqTypeRead) {
+        Integrity->ReadCompleted(Response, DataBuffer, DataBufferSize);
+    } else if (Integrity && Response->RequestType == WnbdReqTypeWrite) {
+        Integrity->WriteCompleted(Response);
+    }
+
+    IoTrace* Trace = (IoTrace*) Disk->IoTrace;
+    if (Trace && Trace->IsActive()) {
+        Trace->RequestCompleted(Response);
+    }
+
+    DiskCrypt* Crypt = (DiskCrypt*) Disk->Crypt;
+    if (Crypt && Response->RequestType == WnbdReqTypeRead) {
+        Crypt->ReadCompleted(Response, DataBuffer, DataBufferSize);
+    }
+
+    PWNBD_USR_STATS Stats = ((UsrStatsShards*) Disk->UsrStats)->Local();
+    InterlockedIncrement64((PLONG64)&Stats->TotalReceivedReplies);
+    InterlockedDecrement64((PLONG64)&Stats->PendingSubmittedRequests);
 
     if (Response->Status.ScsiStatus) {
         switch(Response->RequestType) {
         case WnbdReqTypeRead:
-            InterlockedIncrement64((PLONG64)&Disk->Stats.ReadErrors);
+            InterlockedIncrement64((PLONG64)&Stats->ReadErrors);
             break;
         case WnbdReqTypeWrite:
-            InterlockedIncrement64((PLONG64)&Disk->Stats.WriteErrors);
+            InterlockedIncrement64((PLONG64)&Stats->WriteErrors);
             break;
         case WnbdReqTypeFlush:
-            InterlockedIncrement64((PLONG64)&Disk->Stats.FlushErrors);
+            InterlockedIncrement64((PLONG64)&Stats->FlushErrors);
             break;
         case WnbdReqTypeUnmap:
-            InterlockedIncrement64((PLONG64)&Disk->Stats.UnmapErrors);
+            InterlockedIncrement64((PLONG64)&Stats->UnmapErrors);
             break;
         case WnbdReqTypePersistResIn:
-            InterlockedIncrement64((PLONG64)&Disk->Stats.PersistResInErrors);
+            InterlockedIncrement64((PLONG64)&Stats->PersistResInErrors);
             break;
         case WnbdReqTypePersistResOut:
-            InterlockedIncrement64((PLONG64)&Disk->Stats.PersistResOutErrors);
+            InterlockedIncrement64((PLONG64)&Stats->PersistResOutErrors);
             break;
         }
     }
 
+    // Offline disk requests aren't cancelled by the driver, so the
+    // responses are passed on even after the disk gets stopped. The
+    // backends fail the pending requests this way when shutting down.
+    if (Disk->OfflineResponse) {
+        Disk->OfflineResponse(
+            Disk->OfflineResponseContext,
+            Response, DataBuffer, DataBufferSize);
+        ReleaseLeasedBuffer(Disk, Response->RequestHandle);
+        return 0;
+    }
+
     if (!WnbdIsRunning(Disk)) {
         LogDebug("Disk disconnected, cannot send response.");
+        ReleaseLeasedBuffer(Disk, Response->RequestHandle);
         return ERROR_PIPE_NOT_CONNECTED;
     }
 
-    InterlockedIncrement64((PLONG64)&Disk->Stats.PendingReplies);
+    InterlockedIncrement64((PLONG64)&Stats->PendingReplies);
     DWORD Status = WnbdIoctlSendResponse(
         Disk->Handle,
         Disk->ConnectionInfo.ConnectionId,
@@ -841,7 +1852,13 @@ DWORD WnbdSendResponseEx(
         DataBuffer,
         DataBufferSize,
         Overlapped);
-    InterlockedDecrement64((PLONG64)&Disk->Stats.PendingReplies);
+    InterlockedDecrement64((PLONG64)&Stats->PendingReplies);
+
+    // Pending overlapped responses may still be using the leased buffer,
+    // in which case the caller is responsible for releasing it.
+    if (Status != ERROR_IO_PENDING) {
+        ReleaseLeasedBuffer(Disk, Response->RequestHandle);
+    }
 
     return Status;
 }
@@ -860,9 +1877,18 @@ VOID WnbdHandleRequest(PWNBD_DISK Disk, PWNBD_IO_REQUEST Request,
 {
     UINT8 AdditionalSenseCode = 0;
     BOOLEAN IsValid = TRUE;
+    PWNBD_USR_STATS Stats = ((UsrStatsShards*) Disk->UsrStats)->Local();
+
+    InterlockedIncrement64((PLONG64)&Stats->TotalReceivedRequests);
+    InterlockedIncrement64((PLONG64)&Stats->UnsubmittedRequests);
+
+    IoTrace* Trace = (IoTrace*) Disk->IoTrace;
+    if (Trace && Trace->IsActive()) {
+        Trace->RequestFetched(Request, Buffer);
+    }
 
-    InterlockedIncrement64((PLONG64)&Disk->Stats.TotalReceivedRequests);
-    InterlockedIncrement64((PLONG64)&Disk->Stats.UnsubmittedRequests);
+    DiskCrypt* Crypt = (DiskCrypt*) Disk->Crypt;
+    DiskIntegrity* Integrity = (DiskIntegrity*) Disk->Integrity;
 
     switch (Request->RequestType) {
         case WnbdReqTypeDisconnect:
@@ -872,6 +1898,13 @@ VOID WnbdHandleRequest(PWNBD_DISK Disk, PWNBD_IO_REQUEST Request,
         case WnbdReqTypeRead:
             if (!Disk->Interface->Read)
                 goto Unsupported;
+            if (Crypt && !Crypt->ReadFetched(Request)) {
+                LogError("Could not track encrypted read request.");
+                goto Unsupported;
+            }
+            if (Integrity) {
+                Integrity->ReadFetched(Request);
+            }
             LogDebug("Dispatching READ @ 0x%llx~0x%x # %llx, FUA: %d.",
                      Request->Cmd.Read.BlockAddress,
                      Request->Cmd.Read.BlockCount,
@@ -885,13 +1918,22 @@ VOID WnbdHandleRequest(PWNBD_DISK Disk, PWNBD_IO_REQUEST Request,
                 Request->Cmd.Read.BlockCount,
                 Request->Cmd.Read.ForceUnitAccess);
 
-            InterlockedIncrement64((PLONG64)&Disk->Stats.TotalRWRequests);
-            InterlockedAdd64((PLONG64)&Disk->Stats.TotalReadBlocks,
+            InterlockedIncrement64((PLONG64)&Stats->TotalRWRequests);
+            InterlockedAdd64((PLONG64)&Stats->TotalReadBlocks,
                              Request->Cmd.Read.BlockCount);
             break;
         case WnbdReqTypeWrite:
             if (!Disk->Interface->Write)
                 goto Unsupported;
+            if (Crypt) {
+                Crypt->EncryptWrite(
+                    Buffer,
+                    Request->Cmd.Write.BlockAddress,
+                    Request->Cmd.Write.BlockCount);
+            }
+            if (Integrity) {
+                Integrity->WriteFetched(Request, Buffer);
+            }
             LogDebug("Dispatching WRITE @ 0x%llx~0x%x # %llx, FUA: %d." ,
                      Request->Cmd.Write.BlockAddress,
                      Request->Cmd.Write.BlockCount,
@@ -905,8 +1947,8 @@ VOID WnbdHandleRequest(PWNBD_DISK Disk, PWNBD_IO_REQUEST Request,
                 Request->Cmd.Write.BlockCount,
                 Request->Cmd.Write.ForceUnitAccess);
 
-            InterlockedIncrement64((PLONG64)&Disk->Stats.TotalRWRequests);
-            InterlockedAdd64((PLONG64)&Disk->Stats.TotalWrittenBlocks,
+            InterlockedIncrement64((PLONG64)&Stats->TotalRWRequests);
+            InterlockedAdd64((PLONG64)&Stats->TotalWrittenBlocks,
                              Request->Cmd.Write.BlockCount);
             break;
         case WnbdReqTypeFlush:
@@ -933,171 +1975,933 @@ VOID WnbdHandleRequest(PWNBD_DISK Disk, PWNBD_IO_REQUEST Request,
                 goto Unsupported;
             }
 
-            if (Disk->Properties.MaxUnmapDescCount < Request->Cmd.Unmap.Count)
-            {
-                LogDebug("Too many unmap descriptors: %d. Maximum supported: %d",
-                         Request->Cmd.Unmap.Count, Disk->Properties.MaxUnmapDescCount);
-                AdditionalSenseCode = SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST;
-                goto Unsupported;
-            }
+            if (Disk->Properties.MaxUnmapDescCount < Request->Cmd.Unmap.Count)
+            {
+                LogDebug("Too many unmap descriptors: %d. Maximum supported: %d",
+                         Request->Cmd.Unmap.Count, Disk->Properties.MaxUnmapDescCount);
+                AdditionalSenseCode = SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST;
+                goto Unsupported;
+            }
+
+            if (Integrity) {
+                Integrity->UnmapFetched(
+                    (PWNBD_UNMAP_DESCRIPTOR) Buffer,
+                    Request->Cmd.Unmap.Count);
+            }
+            LogDebug("Dispatching UNMAP # %llx.",
+                     Request->RequestHandle);
+            Disk->Interface->Unmap(
+                Disk,
+                Request->RequestHandle,
+                (PWNBD_UNMAP_DESCRIPTOR)Buffer,
+                Request->Cmd.Unmap.Count);
+            break;
+        case WnbdReqTypePersistResIn:
+            if (!Disk->Interface->PersistResIn ||
+                    !Disk->Properties.Flags.PersistResSupported)
+                goto Unsupported;
+            LogDebug("Dispatching PERSISTENT_RESERVE_IN(action=0x%x) "
+                        "allocLen=0x%x # %llx.",
+                     Request->Cmd.PersistResIn.ServiceAction,
+                     Request->Cmd.PersistResIn.AllocationLength,
+                     Request->RequestHandle);
+
+            Disk->Interface->PersistResIn(
+                Disk,
+                Request->RequestHandle,
+                Request->Cmd.PersistResIn.ServiceAction);
+            break;
+        case WnbdReqTypePersistResOut:
+            if (!Disk->Interface->PersistResOut ||
+                    !Disk->Properties.Flags.PersistResSupported)
+                goto Unsupported;
+            LogDebug("Dispatching PERSISTENT_RESERVE_OUT"
+                        "(action=0x%x, scope=0x%x, type=0x%x) "
+                        "paramListLen=0x%x # %llx.",
+                     Request->Cmd.PersistResOut.ServiceAction,
+                     Request->Cmd.PersistResOut.Scope,
+                     Request->Cmd.PersistResOut.Type,
+                     Request->Cmd.PersistResOut.ParameterListLength,
+                     Request->RequestHandle);
+            Disk->Interface->PersistResOut(
+                Disk,
+                Request->RequestHandle,
+                Request->Cmd.PersistResOut.ServiceAction,
+                Request->Cmd.PersistResOut.Scope,
+                Request->Cmd.PersistResOut.Type,
+                Buffer,
+                Request->Cmd.PersistResOut.ParameterListLength);
+            break;
+        default:
+        Unsupported:
+            LogDebug("Received unsupported command. "
+                     "Request type: %d, request handle: %llu.",
+                     Request->RequestType,
+                     Request->RequestHandle);
+            IsValid = FALSE;
+            if (!AdditionalSenseCode)
+                AdditionalSenseCode = SCSI_ADSENSE_ILLEGAL_COMMAND;
+
+            WNBD_IO_RESPONSE Response = { 0 };
+            Response.RequestType = Request->RequestType;
+            Response.RequestHandle = Request->RequestHandle;
+            WnbdSetSense(&Response.Status,
+                         SCSI_SENSE_ILLEGAL_REQUEST,
+                         AdditionalSenseCode);
+            // Avoid negative count
+            InterlockedIncrement64((PLONG64)&Stats->PendingSubmittedRequests);
+            DWORD Status = WnbdSendResponse(Disk, &Response, NULL, 0);
+            
+            if (Status == ERROR_NOT_FOUND) {
+                LogDebug("Unable to send response, device not found. Performing cleanup.");
+                WnbdSignalStopped(Disk);
+            }
+
+            break;
+    }
+
+    InterlockedDecrement64((PLONG64)&Stats->UnsubmittedRequests);
+    if (IsValid) {
+        InterlockedIncrement64((PLONG64)&Stats->TotalSubmittedRequests);
+        InterlockedIncrement64((PLONG64)&Stats->PendingSubmittedRequests);
+    } else {
+        InterlockedIncrement64((PLONG64)&Stats->InvalidRequests);
+    }
+}
+
+// Busy polling: keep fetching requests without blocking in the driver
+// until one becomes available or the poll budget is exhausted. This avoids
+// the dispatcher thread wakeup latency at the expense of CPU usage, which
+// is accounted in the userspace stats.
+static DWORD PollRequest(
+    PWNBD_DISK Disk,
+    PWNBD_IO_REQUEST Request,
+    PVOID Buffer)
+{
+    DWORD ErrorCode = 0;
+    UINT64 PollCount = 0;
+    auto PollStart = std::chrono::steady_clock::now();
+    auto PollDeadline = PollStart + std::chrono::microseconds(
+        Disk->PollBudgetUs);
+
+    do {
+        PollCount++;
+        ErrorCode = WnbdIoctlPollRequest(
+            Disk->Handle,
+            Disk->ConnectionInfo.ConnectionId,
+            Request,
+            Buffer,
+            WNBD_DEFAULT_MAX_TRANSFER_LENGTH,
+            NULL);
+        if (ErrorCode != ERROR_SEM_TIMEOUT) {
+            break;
+        }
+        YieldProcessor();
+    } while (std::chrono::steady_clock::now() < PollDeadline &&
+             WnbdIsRunning(Disk));
+
+    PWNBD_USR_STATS Stats = ((UsrStatsShards*) Disk->UsrStats)->Local();
+    InterlockedAdd64((PLONG64)&Stats->PollCount, PollCount);
+    InterlockedAdd64(
+        (PLONG64)&Stats->PollTimeUs,
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - PollStart).count());
+    if (!ErrorCode) {
+        InterlockedIncrement64((PLONG64)&Stats->PolledRequests);
+    }
+
+    return ErrorCode;
+}
+
+// Fetch the next request from the driver, waiting until one becomes
+// available.
+static DWORD FetchRequest(
+    PWNBD_DISK Disk,
+    PWNBD_IO_REQUEST Request,
+    PVOID Buffer,
+    LPOVERLAPPED Overlapped,
+    UINT32 TimeoutMs = 0)
+{
+    if (Disk->PollBudgetUs) {
+        DWORD ErrorCode = PollRequest(Disk, Request, Buffer);
+        if (ErrorCode != ERROR_SEM_TIMEOUT) {
+            return ErrorCode;
+        }
+        // The disk is idle, falling back to a blocking fetch.
+    }
+
+    HANDLE OverlappedEvent = (HANDLE)((ULONG_PTR)Overlapped->hEvent & ~1);
+    if (!ResetEvent(OverlappedEvent)) {
+        DWORD ErrorCode = GetLastError();
+        LogError("Could not reset event. Error: %d. Error message: %s",
+                 ErrorCode, win32_strerror(ErrorCode).c_str());
+        return ErrorCode;
+    }
+
+    DWORD ErrorCode = WnbdIoctlFetchRequestEx(
+        Disk->Handle,
+        Disk->ConnectionInfo.ConnectionId,
+        Request,
+        Buffer,
+        WNBD_DEFAULT_MAX_TRANSFER_LENGTH,
+        TimeoutMs,
+        Overlapped);
+
+    if (ErrorCode == ERROR_IO_PENDING) {
+        DWORD BytesReturned = 0;
+        if (!GetOverlappedResult(Disk->Handle, Overlapped,
+                                 &BytesReturned, TRUE)) {
+            ErrorCode = GetLastError();
+        }
+        else {
+            ErrorCode = 0;
+        }
+    }
+
+    return ErrorCode;
+}
+
+// Pass the request to the IO callbacks. If the request buffer gets
+// leased, it will be replaced with a different buffer from the pool,
+// which can be NULL if the allocation fails.
+static VOID DispatchRequest(
+    PWNBD_DISK Disk,
+    PWNBD_IO_REQUEST Request,
+    PVOID* Buffer)
+{
+    CurrDispatcherState = { Disk, *Buffer, FALSE };
+    WnbdHandleRequest(Disk, Request, *Buffer);
+    BOOLEAN BufferLeased = CurrDispatcherState.BufferLeased;
+    CurrDispatcherState = { 0 };
+
+    if (BufferLeased) {
+        // The IO callback took ownership of the buffer.
+        *Buffer = ((RequestBufferPool*) Disk->BufferPool)->Get();
+    }
+}
+
+static DWORD CreateFetchEvent(LPOVERLAPPED Overlapped, PHANDLE Event)
+{
+    HANDLE OverlappedEvent = CreateEventA(0, TRUE, TRUE, NULL);
+    if (!OverlappedEvent) {
+        DWORD ErrorCode = GetLastError();
+        LogError("Could not create event. Error: %d. Error message: %s",
+                 ErrorCode, win32_strerror(ErrorCode).c_str());
+        return ErrorCode;
+    }
+    // Fetched requests must not be queued if the disk handle is associated
+    // with a completion port, which is achieved by setting the low-order bit.
+    Overlapped->hEvent = (HANDLE)((ULONG_PTR)OverlappedEvent | 1);
+    *Event = OverlappedEvent;
+    return 0;
+}
+
+// Creates a dispatcher thread, applying the disk dispatcher affinity (if any)
+// before the thread gets to run. Returns NULL on failure, in which case
+// GetLastError may be used.
+static HANDLE CreateDispatcherThread(
+    PWNBD_DISK Disk,
+    LPTHREAD_START_ROUTINE ThreadRoutine)
+{
+    HANDLE Thread = CreateThread(
+        0, 0, ThreadRoutine, Disk, CREATE_SUSPENDED, 0);
+    if (!Thread) {
+        return NULL;
+    }
+
+    if (Disk->DispatcherAffinity.Mask &&
+            !SetThreadGroupAffinity(Thread, &Disk->DispatcherAffinity, NULL)) {
+        // Not critical, the thread can still be used.
+        DWORD ErrorCode = GetLastError();
+        LogWarning("Could not set dispatcher thread affinity. "
+                   "Error: %d. Error message: %s.",
+                   ErrorCode, win32_strerror(ErrorCode).c_str());
+    }
+
+    ResumeThread(Thread);
+    return Thread;
+}
+
+DWORD WnbdDispatcherLoop(PWNBD_DISK Disk)
+{
+    DWORD ErrorCode = 0;
+    WNBD_IO_REQUEST Request;
+    PVOID Buffer = NULL;
+    OVERLAPPED Overlapped = { 0 };
+    RequestBufferPool* Pool = (RequestBufferPool*) Disk->BufferPool;
+
+    HANDLE OverlappedEvent = NULL;
+    ErrorCode = CreateFetchEvent(&Overlapped, &OverlappedEvent);
+    if (ErrorCode) {
+        goto Exit;
+    }
+
+    Buffer = Pool->Get();
+    if (!Buffer) {
+        ErrorCode = ERROR_OUTOFMEMORY;
+        goto Exit;
+    }
+
+    while (WnbdIsRunning(Disk)) {
+        ErrorCode = FetchRequest(Disk, &Request, Buffer, &Overlapped);
+        if (ErrorCode) {
+            break;
+        }
+
+        DispatchRequest(Disk, &Request, &Buffer);
+        if (!Buffer) {
+            ErrorCode = ERROR_OUTOFMEMORY;
+            break;
+        }
+    }
+
+Exit:
+    WNBD_REMOVE_OPTIONS RemoveOptions = {0};
+    RemoveOptions.Flags.HardRemove = TRUE;
+    WnbdStopDispatcher(Disk, &RemoveOptions);
+
+    if (OverlappedEvent)
+        CloseHandle(OverlappedEvent);
+
+    if (Buffer)
+        Pool->Put(Buffer);
+
+    return ErrorCode;
+}
+
+// Internal dispatcher state, stored as WNBD_DISK.DispatcherContext.
+class DispatcherContext
+{
+public:
+    virtual ~DispatcherContext() {}
+};
+
+// Fetch slot, owning a request buffer. The fetch command receives the
+// request and must remain valid while the fetch request is pending.
+struct DispatcherSlot
+{
+    // Used for the overlapped fetch requests.
+    OVERLAPPED Overlapped;
+    WNBD_IOCTL_FETCH_REQ_COMMAND Command;
+    PVOID Buffer;
+    WNBD_FETCH_SLOT_STATE State;
+};
+
+// Each slot keeps an overlapped fetch request pending in the driver,
+// using an adapter handle that is associated with the dispatcher
+// completion port. The workers handle whichever fetch request completes
+// first and then rearm the slot, so a small worker pool can keep many
+// requests in flight as long as the IO callbacks don't block. The slot
+// state transitions are handled by wnbd_fetch.h.
+class CompletionPortDispatcher : public DispatcherContext
+{
+private:
+    PWNBD_DISK Disk;
+    // The disk handle may be associated with a different completion
+    // port (see WnbdSetCompletionPort), so we're using a separate one.
+    HANDLE FetchHandle = INVALID_HANDLE_VALUE;
+    HANDLE CompletionPort = NULL;
+    UINT32 WorkerCount;
+
+    // Not resized after initialization, the pending fetch requests
+    // reference the slots.
+    std::vector<DispatcherSlot> Slots;
+    std::mutex Lock;
+    WNBD_FETCH_RING Ring;
+
+    void Submit(DispatcherSlot* Slot);
+    void FetchCompleted(DispatcherSlot* Slot, BOOLEAN Success);
+    void HandleAction(WNBD_FETCH_ACTION Action);
+
+public:
+    CompletionPortDispatcher(
+        PWNBD_DISK _Disk,
+        UINT32 _WorkerCount)
+        : Disk(_Disk)
+        , WorkerCount(_WorkerCount)
+    {}
+    ~CompletionPortDispatcher();
+
+    DWORD Initialize(UINT32 QueueDepth);
+
+    // Arms the slots, the workers must be running.
+    void Start();
+    // Stops rearming the slots and cancels the pending fetch requests,
+    // the workers exit once all the slots are idle.
+    void Stop();
+    DWORD WorkerLoop();
+};
+
+CompletionPortDispatcher::~CompletionPortDispatcher()
+{
+    RequestBufferPool* Pool = (RequestBufferPool*) Disk->BufferPool;
+    for (auto& Slot : Slots) {
+        if (Slot.Buffer) {
+            Pool->Put(Slot.Buffer);
+        }
+    }
+
+    if (FetchHandle != INVALID_HANDLE_VALUE)
+        CloseHandle(FetchHandle);
+    if (CompletionPort)
+        CloseHandle(CompletionPort);
+}
+
+DWORD CompletionPortDispatcher::Initialize(UINT32 QueueDepth)
+{
+    // Limit the number of concurrently running workers.
+    CompletionPort = CreateIoCompletionPort(
+        INVALID_HANDLE_VALUE, NULL, 0, WorkerCount);
+    if (!CompletionPort) {
+        DWORD ErrorCode = GetLastError();
+        LogError("Could not create completion port. "
+                 "Error: %d. Error message: %s",
+                 ErrorCode, win32_strerror(ErrorCode).c_str());
+        return ErrorCode;
+    }
+
+    DWORD ErrorCode = WnbdOpenAdapter(&FetchHandle);
+    if (ErrorCode) {
+        return ErrorCode;
+    }
+    if (!CreateIoCompletionPort(FetchHandle, CompletionPort, 0, 0)) {
+        ErrorCode = GetLastError();
+        LogError("Could not associate the adapter with the completion port. "
+                 "Error: %d. Error message: %s",
+                 ErrorCode, win32_strerror(ErrorCode).c_str());
+        return ErrorCode;
+    }
+
+    // The slot buffers are allocated when arming the slots.
+    Slots.resize(QueueDepth);
+    for (auto& Slot : Slots) {
+        Slot = { 0 };
+        Slot.State = WnbdFetchSlotIdle;
+    }
+    WnbdFetchInitialize(&Ring, QueueDepth);
+
+    return 0;
+}
+
+void CompletionPortDispatcher::HandleAction(WNBD_FETCH_ACTION Action)
+{
+    switch (Action) {
+    case WnbdFetchActionCancel:
+        // The driver fails the remaining fetch requests when the disk
+        // gets removed, cancelling them is only needed on errors.
+        if (!CancelIoEx(FetchHandle, NULL) &&
+                GetLastError() != ERROR_NOT_FOUND) {
+            DWORD ErrorCode = GetLastError();
+            LogError("Could not cancel fetch requests. "
+                     "Error: %d. Error message: %s",
+                     ErrorCode, win32_strerror(ErrorCode).c_str());
+        }
+        break;
+    case WnbdFetchActionDrained:
+        // No more fetch requests can complete at this point.
+        LogDebug("Fetch requests drained, stopping dispatcher workers.");
+        for (UINT32 i = 0; i < WorkerCount; i++) {
+            if (!PostQueuedCompletionStatus(CompletionPort, 0, 0, NULL)) {
+                DWORD ErrorCode = GetLastError();
+                LogError("Could not stop dispatcher worker. "
+                         "Error: %d. Error message: %s",
+                         ErrorCode, win32_strerror(ErrorCode).c_str());
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void CompletionPortDispatcher::Submit(DispatcherSlot* Slot)
+{
+    RequestBufferPool* Pool = (RequestBufferPool*) Disk->BufferPool;
+    DWORD ErrorCode = 0;
+
+    if (!Slot->Buffer) {
+        Slot->Buffer = Pool->Get();
+    }
+    if (!Slot->Buffer) {
+        LogError("Could not allocate request buffer.");
+        ErrorCode = ERROR_OUTOFMEMORY;
+    } else {
+        Slot->Overlapped = { 0 };
+        ErrorCode = WnbdIoctlQueueFetchRequest(
+            FetchHandle,
+            Disk->ConnectionInfo.ConnectionId,
+            &Slot->Command,
+            Slot->Buffer,
+            WNBD_DEFAULT_MAX_TRANSFER_LENGTH,
+            &Slot->Overlapped);
+    }
+
+    // Completions are queued even if the request is fetched right away,
+    // unlike requests that fail immediately.
+    if (!ErrorCode || ErrorCode == ERROR_IO_PENDING) {
+        return;
+    }
+    FetchCompleted(Slot, FALSE);
+}
+
+void CompletionPortDispatcher::Start()
+{
+    for (auto& Slot : Slots) {
+        WNBD_FETCH_ACTION Action = WnbdFetchActionNone;
+        {
+            std::unique_lock Lock{this->Lock};
+            Action = WnbdFetchArm(&Ring, &Slot.State);
+        }
+        if (Action != WnbdFetchActionArm) {
+            break;
+        }
+        Submit(&Slot);
+    }
+}
+
+void CompletionPortDispatcher::Stop()
+{
+    WNBD_FETCH_ACTION Action = WnbdFetchActionNone;
+    {
+        std::unique_lock Lock{this->Lock};
+        Action = WnbdFetchStop(&Ring);
+    }
+
+    WNBD_REMOVE_OPTIONS RemoveOptions = {0};
+    RemoveOptions.Flags.HardRemove = TRUE;
+    WnbdStopDispatcher(Disk, &RemoveOptions);
+    HandleAction(Action);
+}
 
-            LogDebug("Dispatching UNMAP # %llx.",
-                     Request->RequestHandle);
-            Disk->Interface->Unmap(
-                Disk,
-                Request->RequestHandle,
-                (PWNBD_UNMAP_DESCRIPTOR)Buffer,
-                Request->Cmd.Unmap.Count);
-            break;
-        case WnbdReqTypePersistResIn:
-            if (!Disk->Interface->PersistResIn ||
-                    !Disk->Properties.Flags.PersistResSupported)
-                goto Unsupported;
-            LogDebug("Dispatching PERSISTENT_RESERVE_IN(action=0x%x) "
-                        "allocLen=0x%x # %llx.",
-                     Request->Cmd.PersistResIn.ServiceAction,
-                     Request->Cmd.PersistResIn.AllocationLength,
-                     Request->RequestHandle);
+void CompletionPortDispatcher::FetchCompleted(
+    DispatcherSlot* Slot,
+    BOOLEAN Success)
+{
+    WNBD_FETCH_ACTION Action = WnbdFetchActionNone;
+    {
+        std::unique_lock Lock{this->Lock};
+        Action = WnbdFetchCompleted(&Ring, &Slot->State, Success);
+    }
+    if (!Success) {
+        WNBD_REMOVE_OPTIONS RemoveOptions = {0};
+        RemoveOptions.Flags.HardRemove = TRUE;
+        WnbdStopDispatcher(Disk, &RemoveOptions);
+        HandleAction(Action);
+        return;
+    }
 
-            Disk->Interface->PersistResIn(
-                Disk,
-                Request->RequestHandle,
-                Request->Cmd.PersistResIn.ServiceAction);
-            break;
-        case WnbdReqTypePersistResOut:
-            if (!Disk->Interface->PersistResOut ||
-                    !Disk->Properties.Flags.PersistResSupported)
-                goto Unsupported;
-            LogDebug("Dispatching PERSISTENT_RESERVE_OUT"
-                        "(action=0x%x, scope=0x%x, type=0x%x) "
-                        "paramListLen=0x%x # %llx.",
-                     Request->Cmd.PersistResOut.ServiceAction,
-                     Request->Cmd.PersistResOut.Scope,
-                     Request->Cmd.PersistResOut.Type,
-                     Request->Cmd.PersistResOut.ParameterListLength,
-                     Request->RequestHandle);
-            Disk->Interface->PersistResOut(
-                Disk,
-                Request->RequestHandle,
-                Request->Cmd.PersistResOut.ServiceAction,
-                Request->Cmd.PersistResOut.Scope,
-                Request->Cmd.PersistResOut.Type,
-                Buffer,
-                Request->Cmd.PersistResOut.ParameterListLength);
+    PWNBD_IO_REQUEST Request = &Slot->Command.Request;
+    while (Action == WnbdFetchActionDispatch) {
+        BOOLEAN Disconnect = Request->RequestType == WnbdReqTypeDisconnect;
+        // A NULL buffer, in case of allocation failures, will be handled
+        // when rearming the slot.
+        DispatchRequest(Disk, Request, &Slot->Buffer);
+        if (Disconnect) {
+            // The driver will only send disconnect requests from now on.
+            Stop();
+        } else if (Disk->PollBudgetUs && Slot->Buffer &&
+                   !PollRequest(Disk, Request, Slot->Buffer)) {
+            // Busy polling, the slot remains in use.
+            continue;
+        }
+
+        std::unique_lock Lock{this->Lock};
+        Action = WnbdFetchDispatched(&Ring, &Slot->State);
+    }
+
+    if (Action == WnbdFetchActionArm) {
+        Submit(Slot);
+    } else {
+        HandleAction(Action);
+    }
+}
+
+DWORD CompletionPortDispatcher::WorkerLoop()
+{
+    while (TRUE) {
+        DWORD BytesTransferred = 0;
+        ULONG_PTR CompletionKey = 0;
+        LPOVERLAPPED Overlapped = NULL;
+        BOOL Success = GetQueuedCompletionStatus(
+            CompletionPort, &BytesTransferred, &CompletionKey,
+            &Overlapped, INFINITE);
+        if (!Overlapped) {
+            if (!Success) {
+                DWORD ErrorCode = GetLastError();
+                LogError("Could not retrieve queued request. "
+                         "Error: %d. Error message: %s",
+                         ErrorCode, win32_strerror(ErrorCode).c_str());
+                return ErrorCode;
+            }
+            // Stop request.
             break;
-        default:
-        Unsupported:
-            LogDebug("Received unsupported command. "
-                     "Request type: %d, request handle: %llu.",
-                     Request->RequestType,
-                     Request->RequestHandle);
-            IsValid = FALSE;
-            if (!AdditionalSenseCode)
-                AdditionalSenseCode = SCSI_ADSENSE_ILLEGAL_COMMAND;
+        }
 
-            WNBD_IO_RESPONSE Response = { 0 };
-            Response.RequestType = Request->RequestType;
-            Response.RequestHandle = Request->RequestHandle;
-            WnbdSetSense(&Response.Status,
-                         SCSI_SENSE_ILLEGAL_REQUEST,
-                         AdditionalSenseCode);
-            // Avoid negative count
-            InterlockedIncrement64((PLONG64)&Disk->Stats.PendingSubmittedRequests);
-            DWORD Status = WnbdSendResponse(Disk, &Response, NULL, 0);
-            
-            if (Status == ERROR_NOT_FOUND) {
-                LogDebug("Unable to send response, device not found. Performing cleanup.");
-                WnbdSignalStopped(Disk);
+        DispatcherSlot* Slot = CONTAINING_RECORD(
+            Overlapped, DispatcherSlot, Overlapped);
+        if (!Success) {
+            DWORD ErrorCode = GetLastError();
+            if (ErrorCode != ERROR_OPERATION_ABORTED) {
+                LogError("Could not fetch request. "
+                         "Error: %d. Error message: %s",
+                         ErrorCode, win32_strerror(ErrorCode).c_str());
             }
+        }
+        FetchCompleted(Slot, (BOOLEAN) Success);
+    }
 
-            break;
+    return 0;
+}
+
+// Elastic threaded dispatcher mode.
+//
+// A controller thread periodically samples the dispatcher activity and
+// adjusts the number of dispatcher threads using DispatcherScaler.
+// Dispatcher threads can't be interrupted while waiting for requests
+// in the driver, so they use a fetch timeout and retire themselves when
+// the pool has to shrink, returning their buffers.
+class ElasticDispatcher : public DispatcherContext
+{
+private:
+    PWNBD_DISK Disk;
+    DispatcherScaler Scaler;
+    UINT32 IntervalMs;
+
+    std::atomic<UINT32> TargetThreads;
+    std::atomic<UINT32> ActiveThreads = 0;
+    // Total time spent waiting for requests.
+    std::atomic<UINT64> FetchWaitUs = 0;
+
+    // Dispatcher thread handles, including the threads that exited but
+    // weren't reaped yet. Only used by the controller after starting.
+    std::vector<HANDLE> Threads;
+
+    BOOLEAN TryRetire();
+
+public:
+    ElasticDispatcher(
+        PWNBD_DISK _Disk,
+        UINT32 MinThreads,
+        UINT32 MaxThreads,
+        UINT32 _IntervalMs)
+        : Disk(_Disk)
+        , Scaler(MinThreads, MaxThreads)
+        , IntervalMs(_IntervalMs)
+        , TargetThreads(MinThreads)
+    {}
+    ~ElasticDispatcher();
+
+    DWORD StartThreads(UINT32 Count);
+    // Close the handles of the threads that exited.
+    void ReapThreads(BOOLEAN Wait);
+
+    DWORD ControllerLoop();
+    DWORD WorkerLoop();
+};
+
+ElasticDispatcher::~ElasticDispatcher()
+{
+    for (HANDLE Thread : Threads) {
+        CloseHandle(Thread);
     }
+}
 
-    InterlockedDecrement64((PLONG64)&Disk->Stats.UnsubmittedRequests);
-    if (IsValid) {
-        InterlockedIncrement64((PLONG64)&Disk->Stats.TotalSubmittedRequests);
-        InterlockedIncrement64((PLONG64)&Disk->Stats.PendingSubmittedRequests);
-    } else {
-        InterlockedIncrement64((PLONG64)&Disk->Stats.InvalidRequests);
+static DWORD WnbdElasticWorkerLoop(PWNBD_DISK Disk)
+{
+    return ((ElasticDispatcher*) Disk->DispatcherContext)->WorkerLoop();
+}
+
+static DWORD WnbdElasticControllerLoop(PWNBD_DISK Disk)
+{
+    return ((ElasticDispatcher*) Disk->DispatcherContext)->ControllerLoop();
+}
+
+DWORD ElasticDispatcher::StartThreads(UINT32 Count)
+{
+    UINT32 ThreadCount = ActiveThreads + Count;
+    if (ThreadCount > TargetThreads) {
+        TargetThreads = ThreadCount;
+    }
+
+    for (UINT32 i = 0; i < Count; i++) {
+        ActiveThreads++;
+        HANDLE Thread = CreateDispatcherThread(
+            Disk, (LPTHREAD_START_ROUTINE) WnbdElasticWorkerLoop);
+        if (!Thread) {
+            DWORD ErrorCode = GetLastError();
+            ActiveThreads--;
+            LogError("Could not start dispatcher thread. "
+                     "Error: %d. Error message: %s.",
+                     ErrorCode, win32_strerror(ErrorCode).c_str());
+            return ErrorCode;
+        }
+        Threads.push_back(Thread);
     }
+
+    return 0;
 }
 
-DWORD WnbdDispatcherLoop(PWNBD_DISK Disk)
+void ElasticDispatcher::ReapThreads(BOOLEAN Wait)
+{
+    auto ThreadIt = Threads.begin();
+    while (ThreadIt != Threads.end()) {
+        if (WaitForSingleObject(*ThreadIt, Wait ? INFINITE : 0) ==
+                WAIT_OBJECT_0) {
+            CloseHandle(*ThreadIt);
+            ThreadIt = Threads.erase(ThreadIt);
+        } else {
+            ThreadIt++;
+        }
+    }
+}
+
+BOOLEAN ElasticDispatcher::TryRetire()
+{
+    UINT32 Active = ActiveThreads;
+    while (Active > TargetThreads) {
+        if (ActiveThreads.compare_exchange_weak(Active, Active - 1)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+DWORD ElasticDispatcher::WorkerLoop()
 {
     DWORD ErrorCode = 0;
+    BOOLEAN Retired = FALSE;
     WNBD_IO_REQUEST Request;
-    DWORD BufferSize = WNBD_DEFAULT_MAX_TRANSFER_LENGTH;
     PVOID Buffer = NULL;
     OVERLAPPED Overlapped = { 0 };
+    RequestBufferPool* Pool = (RequestBufferPool*) Disk->BufferPool;
 
-    HANDLE OverlappedEvent = CreateEventA(0, TRUE, TRUE, NULL);
-    if (!OverlappedEvent) {
-        ErrorCode = GetLastError();
-        LogError("Could not create event. Error: %d. Error message: %s",
-                 ErrorCode, win32_strerror(ErrorCode).c_str());
+    HANDLE OverlappedEvent = NULL;
+    ErrorCode = CreateFetchEvent(&Overlapped, &OverlappedEvent);
+    if (ErrorCode) {
         goto Exit;
-        
     }
-    Overlapped.hEvent = OverlappedEvent;
 
-    Buffer = malloc(BufferSize);
+    Buffer = Pool->Get();
     if (!Buffer) {
-        LogError("Could not allocate %d bytes.", BufferSize);
         ErrorCode = ERROR_OUTOFMEMORY;
         goto Exit;
     }
 
     while (WnbdIsRunning(Disk)) {
-        if (!ResetEvent(OverlappedEvent)) {
-            ErrorCode = GetLastError();
-            LogError("Could not reset event. Error: %d. Error message: %s",
-                     ErrorCode, win32_strerror(ErrorCode).c_str());
+        if (TryRetire()) {
+            Retired = TRUE;
             break;
         }
 
-        ErrorCode = WnbdIoctlFetchRequest(
-            Disk->Handle,
-            Disk->ConnectionInfo.ConnectionId,
-            &Request,
-            Buffer,
-            BufferSize,
-            &Overlapped);
-
-        if (ErrorCode == ERROR_IO_PENDING) {
-            DWORD BytesReturned = 0;
-            if (!GetOverlappedResult(Disk->Handle, &Overlapped,
-                                     &BytesReturned, TRUE)) {
-                ErrorCode = GetLastError();
-            }
-            else {
-                ErrorCode = 0;
-            }
-        }
+        // The timeout allows idle threads to retire.
+        auto FetchStart = std::chrono::steady_clock::now();
+        ErrorCode = FetchRequest(
+            Disk, &Request, Buffer, &Overlapped, IntervalMs);
+        FetchWaitUs += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - FetchStart).count();
 
+        if (ErrorCode == ERROR_SEM_TIMEOUT) {
+            ErrorCode = 0;
+            continue;
+        }
         if (ErrorCode) {
             break;
         }
 
-        WnbdHandleRequest(Disk, &Request, Buffer);
+        DispatchRequest(Disk, &Request, &Buffer);
+        if (!Buffer) {
+            ErrorCode = ERROR_OUTOFMEMORY;
+            break;
+        }
     }
 
 Exit:
-    WNBD_REMOVE_OPTIONS RemoveOptions = {0};
-    RemoveOptions.Flags.HardRemove = TRUE;
-    WnbdStopDispatcher(Disk, &RemoveOptions);
+    if (!Retired) {
+        WNBD_REMOVE_OPTIONS RemoveOptions = {0};
+        RemoveOptions.Flags.HardRemove = TRUE;
+        WnbdStopDispatcher(Disk, &RemoveOptions);
+        ActiveThreads--;
+    } else {
+        LogDebug("Dispatcher thread retired.");
+    }
 
     if (OverlappedEvent)
         CloseHandle(OverlappedEvent);
 
     if (Buffer)
-        free(Buffer);
+        Pool->Put(Buffer);
 
     return ErrorCode;
 }
 
+DWORD ElasticDispatcher::ControllerLoop()
+{
+    WNBD_USR_STATS Stats = { 0 };
+    WnbdGetUserspaceStats(Disk, &Stats);
+    UINT64 LastReplies = Stats.TotalReceivedReplies;
+    UINT64 LastFetchWaitUs = FetchWaitUs;
+    auto LastSampleTime = std::chrono::steady_clock::now();
+
+    while (WnbdIsRunning(Disk) && ActiveThreads) {
+        Sleep(IntervalMs);
+        ReapThreads(FALSE);
+
+        auto SampleTime = std::chrono::steady_clock::now();
+        UINT64 TotalFetchWaitUs = FetchWaitUs;
+        WnbdGetUserspaceStats(Disk, &Stats);
+
+        // Threads that are about to retire aren't taken into account.
+        DispatcherScalerSample Sample = { 0 };
+        Sample.ThreadCount = TargetThreads;
+        Sample.IntervalUs = std::chrono::duration_cast<
+            std::chrono::microseconds>(SampleTime - LastSampleTime).count();
+        Sample.FetchWaitUs = TotalFetchWaitUs - LastFetchWaitUs;
+        Sample.CompletedRequests = Stats.TotalReceivedReplies - LastReplies;
+        // The counters are updated independently and may be
+        // temporarily negative.
+        Sample.UnsubmittedRequests = max(0, (INT64) Stats.UnsubmittedRequests);
+        Sample.InFlightRequests = max(
+            0, (INT64) Stats.UnsubmittedRequests +
+               (INT64) Stats.PendingSubmittedRequests);
+
+        LastSampleTime = SampleTime;
+        LastFetchWaitUs = TotalFetchWaitUs;
+        LastReplies = Stats.TotalReceivedReplies;
+
+        UINT32 ThreadCount = Scaler.Update(Sample);
+        if (ThreadCount == TargetThreads) {
+            continue;
+        }
+
+        LogDebug("Adjusting the dispatcher thread count: %u -> %u.",
+                 TargetThreads.load(), ThreadCount);
+        TargetThreads = ThreadCount;
+        if (ThreadCount > ActiveThreads) {
+            // We'll try again later if we can't start the threads.
+            StartThreads(ThreadCount - ActiveThreads);
+        }
+    }
+
+    // The disk is being removed, waiting for the remaining threads.
+    ReapThreads(TRUE);
+    return 0;
+}
+
+static VOID WnbdFreeDispatcherContext(PWNBD_DISK Disk)
+{
+    delete (DispatcherContext*) Disk->DispatcherContext;
+    Disk->DispatcherContext = NULL;
+}
+
+static DWORD WnbdCompletionPortWorkerLoop(PWNBD_DISK Disk)
+{
+    return ((CompletionPortDispatcher*) Disk->DispatcherContext)->WorkerLoop();
+}
+
+static DWORD StartDispatcherThread(
+    PWNBD_DISK Disk,
+    LPTHREAD_START_ROUTINE ThreadRoutine)
+{
+    HANDLE Thread = CreateDispatcherThread(Disk, ThreadRoutine);
+    if (!Thread)
+    {
+        DWORD ErrorCode = GetLastError();
+        LogError("Could not start dispatcher thread. "
+                 "Error: %d. Error message: %s.",
+                 ErrorCode, win32_strerror(ErrorCode).c_str());
+        return ErrorCode;
+    }
+    Disk->DispatcherThreads[Disk->DispatcherThreadsCount] = Thread;
+    Disk->DispatcherThreadsCount++;
+    return 0;
+}
+
+// Determines the dispatcher thread affinity and the NUMA node used for
+// request buffer allocations. The affinity mask is left empty if the
+// threads shouldn't be pinned.
+static DWORD GetDispatcherAffinity(
+    PWNBD_DISPATCHER_OPTIONS Options,
+    PGROUP_AFFINITY Affinity,
+    PDWORD NumaNode)
+{
+    DWORD ErrorCode = 0;
+    USHORT AffinityNode = 0;
+
+    *NumaNode = NUMA_NO_PREFERRED_NODE;
+    memset(Affinity, 0, sizeof(GROUP_AFFINITY));
+
+    if (Options->Flags.UseAffinity) {
+        if (Options->ProcessorGroup >= GetActiveProcessorGroupCount()) {
+            LogError("Invalid processor group: %u.", Options->ProcessorGroup);
+            return ERROR_INVALID_PARAMETER;
+        }
+        DWORD ProcessorCount = GetActiveProcessorCount(
+            (WORD) Options->ProcessorGroup);
+        UINT64 ValidMask = ProcessorCount >= 64 ?
+            MAXUINT64 : (1ULL << ProcessorCount) - 1;
+        if (!Options->AffinityMask || (Options->AffinityMask & ~ValidMask)) {
+            LogError("Invalid processor affinity mask: 0x%llx, "
+                     "processor group: %u.",
+                     Options->AffinityMask, Options->ProcessorGroup);
+            return ERROR_INVALID_PARAMETER;
+        }
+        Affinity->Group = (WORD) Options->ProcessorGroup;
+        Affinity->Mask = (KAFFINITY) Options->AffinityMask;
+    }
+
+    if (Options->Flags.UseNumaNode) {
+        if (Options->NumaNode > MAXUSHORT) {
+            LogError("Invalid NUMA node: %u.", Options->NumaNode);
+            return ERROR_INVALID_PARAMETER;
+        }
+        if (!Affinity->Mask) {
+            ErrorCode = GetNumaNodeAffinity(
+                (USHORT) Options->NumaNode, Affinity);
+            if (ErrorCode) {
+                return ErrorCode;
+            }
+        }
+        *NumaNode = Options->NumaNode;
+    } else if (Affinity->Mask) {
+        ErrorCode = GetAffinityNumaNode(Affinity, &AffinityNode);
+        if (ErrorCode) {
+            return ErrorCode;
+        }
+        *NumaNode = AffinityNode;
+    }
+
+    if (Affinity->Mask) {
+        LogDebug("Dispatcher affinity: group %d, mask 0x%llx, "
+                 "NUMA node: %d.",
+                 Affinity->Group, (UINT64) Affinity->Mask, *NumaNode);
+    }
+    return 0;
+}
+
 DWORD WnbdStartDispatcher(PWNBD_DISK Disk, DWORD ThreadCount)
+{
+    WNBD_DISPATCHER_OPTIONS Options = { 0 };
+    Options.Mode = WnbdDispatcherModeThreaded;
+    Options.ThreadCount = ThreadCount;
+    return WnbdStartDispatcherEx(Disk, &Options);
+}
+
+DWORD WnbdStartDispatcherEx(
+    PWNBD_DISK Disk,
+    PWNBD_DISPATCHER_OPTIONS Options)
 {
     DWORD ErrorCode = ERROR_SUCCESS;
+    UINT32 ThreadCount = Options->ThreadCount;
+    UINT32 QueueDepth = 0;
+    UINT32 MinThreadCount = 0;
+    UINT32 MaxThreadCount = 0;
+    UINT32 CachedBufferCount = 0;
+    UINT32 PollBudgetUs = 0;
+    CompletionPortDispatcher* IocpDispatcher = nullptr;
+    ElasticDispatcher* Elastic = nullptr;
+    GROUP_AFFINITY Affinity = { 0 };
+    DWORD NumaNode = NUMA_NO_PREFERRED_NODE;
+
     if (ThreadCount < WNBD_MIN_DISPATCHER_THREAD_COUNT ||
        ThreadCount > WNBD_MAX_DISPATCHER_THREAD_COUNT) {
         LogError("Invalid number of dispatcher threads: %u",
@@ -1105,34 +2909,168 @@ DWORD WnbdStartDispatcher(PWNBD_DISK Disk, DWORD ThreadCount)
         return ERROR_INVALID_PARAMETER;
     }
 
-    LogDebug("Starting dispatcher. Threads: %u", ThreadCount);
-    Disk->DispatcherThreads = (HANDLE*)malloc(sizeof(HANDLE) * ThreadCount);
+    switch (Options->Mode) {
+    case WnbdDispatcherModeThreaded:
+        if (!Options->Flags.Elastic) {
+            break;
+        }
+        MinThreadCount = Options->MinThreadCount ?
+            Options->MinThreadCount : WNBD_MIN_DISPATCHER_THREAD_COUNT;
+        MaxThreadCount = Options->MaxThreadCount ?
+            Options->MaxThreadCount : WNBD_MAX_DISPATCHER_THREAD_COUNT;
+        if (MinThreadCount < WNBD_MIN_DISPATCHER_THREAD_COUNT ||
+                MaxThreadCount > WNBD_MAX_DISPATCHER_THREAD_COUNT ||
+                ThreadCount < MinThreadCount ||
+                ThreadCount > MaxThreadCount) {
+            LogError("Invalid elastic dispatcher thread count bounds. "
+                     "Min: %u, max: %u, initial: %u.",
+                     MinThreadCount, MaxThreadCount, ThreadCount);
+            return ERROR_INVALID_PARAMETER;
+        }
+        break;
+    case WnbdDispatcherModeCompletionPort:
+        if (Options->Flags.Elastic) {
+            LogError("The completion port dispatcher mode doesn't "
+                     "support elastic thread pools.");
+            return ERROR_INVALID_PARAMETER;
+        }
+        QueueDepth = Options->QueueDepth ?
+            Options->QueueDepth : ThreadCount * 2;
+        if (QueueDepth > WNBD_MAX_DISPATCHER_QUEUE_DEPTH) {
+            LogError("Invalid dispatcher queue depth: %u", QueueDepth);
+            return ERROR_INVALID_PARAMETER;
+        }
+        break;
+    default:
+        LogError("Unsupported dispatcher mode: %d", Options->Mode);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (Options->Flags.BusyPoll) {
+        // Polling threads never look idle, which would prevent the
+        // elastic pool from shrinking.
+        if (Options->Flags.Elastic) {
+            LogError("Elastic dispatchers don't support busy polling.");
+            return ERROR_INVALID_PARAMETER;
+        }
+        PollBudgetUs = Options->PollBudgetUs ?
+            Options->PollBudgetUs : WNBD_DEFAULT_POLL_BUDGET_US;
+        if (PollBudgetUs > WNBD_MAX_POLL_BUDGET_US) {
+            LogError("Invalid poll budget: %u us. Maximum: %u us.",
+                     PollBudgetUs, WNBD_MAX_POLL_BUDGET_US);
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    ErrorCode = GetDispatcherAffinity(Options, &Affinity, &NumaNode);
+    if (ErrorCode) {
+        return ErrorCode;
+    }
+
+    if (Options->Encryption) {
+        ErrorCode = WnbdEnableEncryption(Disk, Options->Encryption);
+        if (ErrorCode) {
+            return ErrorCode;
+        }
+    }
+    if (Options->Integrity) {
+        ErrorCode = WnbdEnableIntegrity(Disk, Options->Integrity);
+        if (ErrorCode) {
+            return ErrorCode;
+        }
+    }
+
+    Disk->DispatcherAffinity = Affinity;
+    Disk->PollBudgetUs = PollBudgetUs;
+
+    LogDebug("Starting dispatcher. Mode: %d, threads: %u, "
+             "queue depth: %u, elastic: %d, poll budget: %u us",
+             Options->Mode, ThreadCount, QueueDepth,
+             Options->Flags.Elastic, PollBudgetUs);
+    // The elastic dispatcher manages its own threads, only the controller
+    // thread is stored here.
+    Disk->DispatcherThreads = (HANDLE*)malloc(
+        sizeof(HANDLE) * ThreadCount);
     if (!Disk->DispatcherThreads) {
         LogError("Could not allocate memory.");
         return ERROR_OUTOFMEMORY;
     }
 
+    // Each dispatcher thread or slot holds one buffer, we're caching a few
+    // more in order to replace the ones leased by the IO callbacks.
+    // Elastic dispatchers cache fewer buffers so that they get released
+    // when the pool shrinks.
+    CachedBufferCount = Options->Flags.Elastic ?
+        MinThreadCount * 2 : (ThreadCount + QueueDepth) * 2;
+    Disk->BufferPool = new (std::nothrow) RequestBufferPool(
+        WNBD_DEFAULT_MAX_TRANSFER_LENGTH, CachedBufferCount, NumaNode);
+    if (!Disk->BufferPool) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+
+    if (Options->Mode == WnbdDispatcherModeCompletionPort) {
+        IocpDispatcher = new (std::nothrow) CompletionPortDispatcher(
+            Disk, ThreadCount);
+        if (!IocpDispatcher) {
+            LogError("Could not allocate memory.");
+            return ERROR_OUTOFMEMORY;
+        }
+        Disk->DispatcherContext = IocpDispatcher;
+
+        ErrorCode = IocpDispatcher->Initialize(QueueDepth);
+        if (ErrorCode) {
+            return ErrorCode;
+        }
+    } else if (Options->Flags.Elastic) {
+        Elastic = new (std::nothrow) ElasticDispatcher(
+            Disk, MinThreadCount, MaxThreadCount,
+            Options->ElasticIntervalMs ?
+                Options->ElasticIntervalMs : WNBD_DEFAULT_ELASTIC_INTERVAL_MS);
+        if (!Elastic) {
+            LogError("Could not allocate memory.");
+            return ERROR_OUTOFMEMORY;
+        }
+        Disk->DispatcherContext = Elastic;
+    }
+
     Disk->Started = TRUE;
     Disk->DispatcherThreadsCount = 0;
 
-    for (DWORD i = 0; i < ThreadCount; i++)
-    {
-        HANDLE Thread = CreateThread(
-            0, 0, (LPTHREAD_START_ROUTINE )WnbdDispatcherLoop, Disk, 0, 0);
-        if (!Thread)
-        {
-            ErrorCode = GetLastError();
-            LogError("Could not start dispatcher thread. "
-                     "Error: %d. Error message: %s.",
-                     ErrorCode, win32_strerror(ErrorCode).c_str());
-            WNBD_REMOVE_OPTIONS RemoveOptions = {0};
-            RemoveOptions.Flags.HardRemove = TRUE;
-            WnbdStopDispatcher(Disk, &RemoveOptions);
-            WnbdWaitDispatcher(Disk);
-            break;
+    if (IocpDispatcher) {
+        // The workers handle the fetch completions, so they must be
+        // started first. They exit once the fetch requests are drained.
+        for (DWORD i = 0; i < ThreadCount && !ErrorCode; i++) {
+            ErrorCode = StartDispatcherThread(
+                Disk, (LPTHREAD_START_ROUTINE) WnbdCompletionPortWorkerLoop);
+        }
+        if (ErrorCode) {
+            IocpDispatcher->Stop();
+        } else {
+            IocpDispatcher->Start();
+        }
+    } else if (Elastic) {
+        ErrorCode = Elastic->StartThreads(ThreadCount);
+        if (!ErrorCode) {
+            ErrorCode = StartDispatcherThread(
+                Disk, (LPTHREAD_START_ROUTINE) WnbdElasticControllerLoop);
+        }
+    } else {
+        for (DWORD i = 0; i < ThreadCount && !ErrorCode; i++) {
+            ErrorCode = StartDispatcherThread(
+                Disk, (LPTHREAD_START_ROUTINE) WnbdDispatcherLoop);
+        }
+    }
+
+    if (ErrorCode) {
+        WNBD_REMOVE_OPTIONS RemoveOptions = {0};
+        RemoveOptions.Flags.HardRemove = TRUE;
+        WnbdStopDispatcher(Disk, &RemoveOptions);
+        WnbdWaitDispatcher(Disk);
+        if (Elastic && !Disk->DispatcherThreadsCount) {
+            // The controller couldn't be started.
+            Elastic->ReapThreads(TRUE);
         }
-        Disk->DispatcherThreads[Disk->DispatcherThreadsCount] = Thread;
-        Disk->DispatcherThreadsCount++;
     }
 
     return ErrorCode;
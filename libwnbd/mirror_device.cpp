@@ -0,0 +1,858 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "mirror_device.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+#include <chrono>
+
+// The latest read latency sample weighs 1/8 in the moving average.
+#define READ_LATENCY_EWMA_SHIFT 3
+#define MIRROR_BUFFER_ALIGNMENT 4096
+#define MIRROR_MAX_READ_ERRORS 3
+#define MIRROR_RESYNC_CHUNK_SIZE (1024 * 1024)
+
+static UINT64 HashReplicaName(const std::string& Name)
+{
+    // FNV-1a
+    UINT64 Hash = 0xcbf29ce484222325ULL;
+    for (char Char : Name) {
+        Hash = (Hash ^ (BYTE) Char) * 0x100000001b3ULL;
+    }
+    return Hash;
+}
+
+MirrorDevice::~MirrorDevice()
+{
+    // The replica operations may outlive the requests that were already
+    // acknowledged. Failed NBD connections complete their pending
+    // requests, so this is not expected to take long.
+    Closing = true;
+    if (InFlight) {
+        WaitForSingleObject(DrainEvent, INFINITE);
+    }
+    if (DrainEvent) {
+        CloseHandle(DrainEvent);
+    }
+
+    if (StateFile != INVALID_HANDLE_VALUE) {
+        // All the operations completed, so the replicas that are still
+        // part of the mirror are in sync.
+        RefreshState();
+        CloseHandle(StateFile);
+    }
+}
+
+DWORD MirrorDevice::Open(
+    std::vector<std::unique_ptr<BlockDevice>> Devices,
+    const std::vector<std::string>& ReplicaNames,
+    PWNBD_MIRROR_OPTIONS Options)
+{
+    if (Devices.size() < 2 || Devices.size() > WNBD_MAX_NBD_MEMBERS) {
+        LogError("Invalid mirror replica count: %d. "
+                 "Expecting between 2 and %d replicas.",
+                 (UINT32) Devices.size(), WNBD_MAX_NBD_MEMBERS);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (ReplicaNames.size() != Devices.size()) {
+        LogError("Invalid mirror replica name count: %d. Expecting: %d.",
+                 (UINT32) ReplicaNames.size(), (UINT32) Devices.size());
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (Options) {
+        WriteQuorum = Options->WriteQuorum;
+        ReadPolicy = Options->ReadPolicy;
+    }
+    if (WriteQuorum > Devices.size()) {
+        LogError("Invalid write quorum: %d. The mirror has %d replicas.",
+                 WriteQuorum, (UINT32) Devices.size());
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (ReadPolicy != WnbdMirrorReadLeastPending &&
+            ReadPolicy != WnbdMirrorReadLowestLatency) {
+        LogError("Invalid mirror read policy: %d.", ReadPolicy);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    DrainEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!DrainEvent) {
+        DWORD Status = GetLastError();
+        LogError("Could not create event. Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    // The smallest replica determines the usable size.
+    Size = ULLONG_MAX;
+    UnmapSupported = true;
+    for (auto& Device : Devices) {
+        Size = min(Size, Device->GetSize());
+        SectorSize = max(SectorSize, Device->GetSectorSize());
+        UnmapSupported &= Device->IsUnmapSupported();
+
+        std::unique_ptr<Replica> Target(new (std::nothrow) Replica());
+        if (!Target) {
+            LogError("Could not allocate mirror replica.");
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        Target->Device = std::move(Device);
+        Target->Index = (UINT32) Replicas.size();
+        Target->NameHash = HashReplicaName(ReplicaNames[Target->Index]);
+        Replicas.push_back(std::move(Target));
+    }
+
+    PCSTR StatePath = Options && Options->StatePath[0] ?
+        Options->StatePath : nullptr;
+    if (StatePath) {
+        DWORD Status = LoadState(StatePath);
+        if (!Status) {
+            Status = ResyncReplicas();
+        }
+        if (Status) {
+            return Status;
+        }
+    }
+
+    LogInfo("Using %d mirror replicas. Write quorum: %d. Read policy: %d. "
+            "Disk size: %llu. Unmap supported: %d. State file: %s.",
+            (UINT32) Replicas.size(), WriteQuorum, ReadPolicy,
+            Size, UnmapSupported, StatePath ? StatePath : "none");
+    return 0;
+}
+
+bool MirrorDevice::AcquireIo()
+{
+    InFlight++;
+    if (Closing) {
+        ReleaseIo();
+        return false;
+    }
+    return true;
+}
+
+void MirrorDevice::ReleaseIo()
+{
+    if (!--InFlight && Closing) {
+        SetEvent(DrainEvent);
+    }
+}
+
+DWORD MirrorDevice::LoadState(PCSTR Path)
+{
+    HANDLE File = CreateFileA(
+        Path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (File == INVALID_HANDLE_VALUE) {
+        DWORD Status = GetLastError();
+        LogError("Could not open mirror state file: %s. "
+                 "Error: %d. Error message: %s",
+                 Path, Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    // The file is only kept open (and updated) if valid.
+    DWORD Status = CheckState(File, Path);
+    if (Status) {
+        CloseHandle(File);
+        return Status;
+    }
+    StateFile = File;
+
+    std::unique_lock<std::mutex> Lock(StateLock);
+    return SaveState();
+}
+
+DWORD MirrorDevice::CheckState(HANDLE File, PCSTR Path)
+{
+    LARGE_INTEGER FileSize = { 0 };
+    if (!GetFileSizeEx(File, &FileSize)) {
+        DWORD Status = GetLastError();
+        LogError("Could not retrieve mirror state file size. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    if (FileSize.QuadPart) {
+        MIRROR_STATE State = { 0 };
+        DWORD Status = ReadFileExact(File, 0, &State, sizeof(State));
+        if (Status && Status != ERROR_HANDLE_EOF) {
+            LogError("Could not read mirror state file. "
+                     "Error: %d. Error message: %s",
+                     Status, win32_strerror(Status).c_str());
+            return Status;
+        }
+        // Refuse to overwrite unrelated files.
+        if (Status || State.Magic != MIRROR_STATE_MAGIC ||
+                State.Version != MIRROR_STATE_VERSION ||
+                State.ReplicaCount > WNBD_MAX_NBD_MEMBERS) {
+            LogError("Invalid mirror state file: %s.", Path);
+            return ERROR_INVALID_DATA;
+        }
+        if (State.DiskSize != Size) {
+            LogError("The mirror size changed. State file: %s. "
+                     "Previous size: %llu. Current size: %llu.",
+                     Path, State.DiskSize, Size);
+            return ERROR_INVALID_DATA;
+        }
+
+        // Replicas that are missing from the state file are stale.
+        Generation = State.Generation;
+        UINT32 InSync = 0;
+        for (auto& Target : Replicas) {
+            for (UINT32 Index = 0; Index < State.ReplicaCount; Index++) {
+                if (State.Replicas[Index].NameHash == Target->NameHash) {
+                    Target->Generation = State.Replicas[Index].Generation;
+                    break;
+                }
+            }
+            Target->OutOfSync = Target->Generation != Generation;
+            InSync += !Target->OutOfSync;
+            if (Target->OutOfSync) {
+                LogWarning("Mirror replica %d is out of sync. "
+                           "Replica generation: %llu. "
+                           "Mirror generation: %llu.",
+                           Target->Index, Target->Generation, Generation);
+            }
+        }
+        if (!InSync) {
+            LogError("None of the mirror replicas is in sync. "
+                     "State file: %s. Generation: %llu.", Path, Generation);
+            return ERROR_INVALID_DATA;
+        }
+    }
+    // New state files assume that the replicas are in sync.
+    return 0;
+}
+
+DWORD MirrorDevice::SaveState()
+{
+    MIRROR_STATE State = { 0 };
+    State.Magic = MIRROR_STATE_MAGIC;
+    State.Version = MIRROR_STATE_VERSION;
+    State.ReplicaCount = (UINT32) Replicas.size();
+    State.DiskSize = Size;
+    State.Generation = Generation + 1;
+
+    UINT32 InSync = 0;
+    for (auto& Target : Replicas) {
+        bool Stale = Target->Failed || Target->OutOfSync;
+        State.Replicas[Target->Index].NameHash = Target->NameHash;
+        State.Replicas[Target->Index].Generation = Stale ?
+            Target->Generation : State.Generation;
+        InSync += !Stale;
+    }
+    // The last replica that was in sync keeps the latest data.
+    if (!InSync) {
+        StateDirty = false;
+        return 0;
+    }
+
+    DWORD Status = WriteFileExact(StateFile, 0, &State, sizeof(State));
+    if (!Status && !FlushFileBuffers(StateFile)) {
+        Status = GetLastError();
+    }
+    if (Status) {
+        LogError("Could not save mirror state file. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        StateDirty = true;
+        return Status;
+    }
+
+    Generation = State.Generation;
+    for (auto& Target : Replicas) {
+        Target->Generation = State.Replicas[Target->Index].Generation;
+    }
+    StateDirty = false;
+    return 0;
+}
+
+DWORD MirrorDevice::SetOutOfSync(UINT32 ReplicaMask)
+{
+    if (StateFile == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+
+    bool Changed = StateDirty;
+    for (auto& Target : Replicas) {
+        Changed |= (ReplicaMask & (1U << Target->Index)) &&
+            !Target->OutOfSync;
+    }
+    if (!Changed) {
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> Lock(StateLock);
+    Changed = StateDirty;
+    for (auto& Target : Replicas) {
+        // Replicas that completed the lagging operations in the
+        // meantime are still in sync.
+        if ((ReplicaMask & (1U << Target->Index)) &&
+                !Target->OutOfSync && Target->LaggingCount) {
+            Target->OutOfSync = true;
+            Changed = true;
+        }
+    }
+    return Changed ? SaveState() : 0;
+}
+
+void MirrorDevice::RefreshState()
+{
+    if (StateFile == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> Lock(StateLock);
+    bool Changed = false;
+    for (auto& Target : Replicas) {
+        if (Target->OutOfSync && !Target->Failed && !Target->LaggingCount) {
+            Target->OutOfSync = false;
+            Changed = true;
+        }
+    }
+    if (Changed) {
+        SaveState();
+    }
+}
+
+DWORD MirrorDevice::ResyncReplicas()
+{
+    // LoadState ensures that at least one replica is in sync.
+    Replica* Source = nullptr;
+    for (auto& Target : Replicas) {
+        if (!Target->OutOfSync) {
+            Source = Target.get();
+            break;
+        }
+    }
+
+    HANDLE Done = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!Done) {
+        DWORD Status = GetLastError();
+        LogError("Could not create event. Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    DWORD Status = 0;
+    for (auto& Target : Replicas) {
+        if (!Target->OutOfSync) {
+            continue;
+        }
+
+        LogInfo("Resyncing mirror replica %d using replica %d. "
+                "Disk size: %llu.", Target->Index, Source->Index, Size);
+        DWORD CopyStatus = 0;
+        ResetEvent(Done);
+        try {
+            RunResync(Source, Target.get(), &CopyStatus, Done);
+        }
+        catch (const std::bad_alloc&) {
+            CopyStatus = ERROR_NOT_ENOUGH_MEMORY;
+            SetEvent(Done);
+        }
+        WaitForSingleObject(Done, INFINITE);
+
+        // The replica remains stale in the state file.
+        if (CopyStatus) {
+            LogError("Could not resync mirror replica %d.", Target->Index);
+            SetFailed(Target.get(), CopyStatus);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> Lock(StateLock);
+        Target->OutOfSync = false;
+        Status = SaveState();
+        if (Status) {
+            break;
+        }
+        LogInfo("Mirror replica %d resynced.", Target->Index);
+    }
+
+    CloseHandle(Done);
+    return Status;
+}
+
+wnbd::Task<DWORD> MirrorDevice::CopyReplica(Replica* Source, Replica* Target)
+{
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> Buffer(
+        (PBYTE) _aligned_malloc(
+            MIRROR_RESYNC_CHUNK_SIZE, MIRROR_BUFFER_ALIGNMENT),
+        &_aligned_free);
+    if (!Buffer) {
+        co_return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    UINT64 Offset = 0;
+    while (Offset < Size) {
+        UINT32 Length = (UINT32) min(
+            Size - Offset, (UINT64) MIRROR_RESYNC_CHUNK_SIZE);
+        DWORD Status = co_await Source->Device->Read(
+            Buffer.get(), Offset, Length);
+        if (Status) {
+            LogError("Could not read from mirror replica %d. "
+                     "Offset: %llu. Error: %d. Error message: %s",
+                     Source->Index, Offset, Status,
+                     win32_strerror(Status).c_str());
+            co_return Status;
+        }
+        Status = co_await Target->Device->Write(
+            Buffer.get(), Offset, Length, FALSE);
+        if (Status) {
+            co_return Status;
+        }
+        Offset += Length;
+    }
+    co_return co_await Target->Device->Flush();
+}
+
+DetachedTask MirrorDevice::RunResync(
+    Replica* Source, Replica* Target, DWORD* Status, HANDLE Done)
+{
+    try {
+        *Status = co_await CopyReplica(Source, Target);
+    }
+    catch (const std::bad_alloc&) {
+        *Status = ERROR_NOT_ENOUGH_MEMORY;
+    }
+    SetEvent(Done);
+}
+
+void MirrorDevice::SetFailed(Replica* Target, DWORD Status)
+{
+    if (Target->Failed.exchange(true)) {
+        return;
+    }
+
+    UINT32 Healthy = 0;
+    for (auto& Item : Replicas) {
+        Healthy += !Item->Failed;
+    }
+    LogError("Mirror replica %d failed, dropping it from the mirror. "
+             "Remaining replicas: %d. Error: %d. Error message: %s",
+             Target->Index, Healthy, Status, win32_strerror(Status).c_str());
+
+    // Persisted before acknowledging writes that the replica missed,
+    // failed updates being retried by SetOutOfSync.
+    if (StateFile != INVALID_HANDLE_VALUE) {
+        std::unique_lock<std::mutex> Lock(StateLock);
+        SaveState();
+    }
+}
+
+bool MirrorDevice::IsLagging(
+    Replica* Target, UINT64 Offset, UINT64 Length, UINT64 Sequence)
+{
+    for (ReplicaOp* Op = Target->LaggingHead; Op; Op = Op->LaggingNext) {
+        MirrorRequest* Request = Op->Request;
+        if (Request->Sequence < Sequence &&
+                Offset < Request->Offset + Request->Length &&
+                Request->Offset < Offset + Length) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MirrorDevice::CheckLagging(Replica* Target, UINT64 Offset, UINT64 Length)
+{
+    if (!Target->LaggingCount) {
+        return false;
+    }
+    std::unique_lock<std::mutex> Lock(Target->LaggingLock);
+    return IsLagging(Target, Offset, Length, ULLONG_MAX);
+}
+
+wnbd::Task<void> MirrorDevice::WaitLagging(
+    Replica* Target, UINT64 Offset, UINT64 Length, UINT64 Sequence)
+{
+    if (!Target->LaggingCount) {
+        co_return;
+    }
+
+    RangeWaiter Waiter;
+    Waiter.Offset = Offset;
+    Waiter.Length = Length;
+    Waiter.Sequence = Sequence;
+    {
+        std::unique_lock<std::mutex> Lock(Target->LaggingLock);
+        if (!IsLagging(Target, Offset, Length, Sequence)) {
+            co_return;
+        }
+        Waiter.Next = Target->WaitersHead;
+        Target->WaitersHead = &Waiter;
+    }
+    co_await Waiter.Ready;
+}
+
+UINT32 MirrorDevice::RegisterLagging(MirrorRequest* Request)
+{
+    UINT32 ReplicaMask = 0;
+    for (UINT32 Index = 0; Index < Request->Total; Index++) {
+        ReplicaOp* Op = &Request->Ops[Index];
+        Replica* Target = Op->Target;
+
+        std::unique_lock<std::mutex> Lock(Target->LaggingLock);
+        if (Op->Done) {
+            continue;
+        }
+        Op->IsLagging = true;
+        Op->LaggingPrev = nullptr;
+        Op->LaggingNext = Target->LaggingHead;
+        if (Target->LaggingHead) {
+            Target->LaggingHead->LaggingPrev = Op;
+        }
+        Target->LaggingHead = Op;
+        Target->LaggingCount++;
+        ReplicaMask |= 1U << Target->Index;
+    }
+    return ReplicaMask;
+}
+
+MirrorDevice::Replica* MirrorDevice::SelectReadReplica(
+    UINT64 Offset, UINT32 Length, UINT32 Exclude, bool* Lagging)
+{
+    Replica* Best = nullptr;
+    Replica* BestLagging = nullptr;
+    UINT64 BestScore = ULLONG_MAX;
+    UINT64 BestLaggingScore = ULLONG_MAX;
+
+    // Rotate the starting replica so that ties are spread evenly.
+    size_t Count = Replicas.size();
+    size_t Start = NextReadReplica++ % Count;
+    for (size_t Step = 0; Step < Count; Step++) {
+        Replica* Target = Replicas[(Start + Step) % Count].get();
+        if (Target->Failed || (Exclude & (1U << Target->Index))) {
+            continue;
+        }
+
+        UINT64 Score = Target->Outstanding;
+        if (ReadPolicy == WnbdMirrorReadLowestLatency) {
+            // Queued requests are expected to wait for the pending ones.
+            Score = (Target->ReadLatencyUs + 1) * (Score + 1);
+        }
+
+        // Replicas that didn't complete the acknowledged writes
+        // overlapping this range are only used as a last resort.
+        if (CheckLagging(Target, Offset, Length)) {
+            if (Score < BestLaggingScore) {
+                BestLagging = Target;
+                BestLaggingScore = Score;
+            }
+        } else if (Score < BestScore) {
+            Best = Target;
+            BestScore = Score;
+        }
+    }
+
+    *Lagging = !Best && BestLagging;
+    return Best ? Best : BestLagging;
+}
+
+wnbd::Task<DWORD> MirrorDevice::Read(
+    PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    DWORD Status = ERROR_NOT_READY;
+    // Failed reads are retried using the other replicas, each replica
+    // being tried once.
+    UINT32 Tried = 0;
+    while (AcquireIo()) {
+        bool Lagging = false;
+        Replica* Target = SelectReadReplica(Offset, Length, Tried, &Lagging);
+        if (!Target) {
+            LogDebug("No healthy mirror replica left to read from.");
+            ReleaseIo();
+            break;
+        }
+        Tried |= 1U << Target->Index;
+
+        Target->Outstanding++;
+        auto StartTime = std::chrono::steady_clock::now();
+        try {
+            if (Lagging) {
+                co_await WaitLagging(Target, Offset, Length, ULLONG_MAX);
+                StartTime = std::chrono::steady_clock::now();
+            }
+            Status = co_await Target->Device->Read(Buffer, Offset, Length);
+        }
+        catch (const std::bad_alloc&) {
+            Status = ERROR_NOT_ENOUGH_MEMORY;
+        }
+        Target->Outstanding--;
+
+        if (!Status) {
+            UINT64 LatencyUs = std::chrono::duration_cast<
+                std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - StartTime).count();
+            // Concurrent updates may lose samples, which is acceptable.
+            UINT64 Average = Target->ReadLatencyUs;
+            Target->ReadLatencyUs = Average ?
+                Average - (Average >> READ_LATENCY_EWMA_SHIFT) +
+                    (LatencyUs >> READ_LATENCY_EWMA_SHIFT) :
+                LatencyUs;
+            if (Target->ReadErrors) {
+                Target->ReadErrors = 0;
+            }
+            ReleaseIo();
+            co_return 0;
+        }
+
+        ReleaseIo();
+        if (Status == ERROR_NOT_ENOUGH_MEMORY) {
+            break;
+        }
+        // Transient read errors don't drop the replica right away.
+        UINT32 ReadErrors = ++Target->ReadErrors;
+        if (ReadErrors >= MIRROR_MAX_READ_ERRORS) {
+            SetFailed(Target, Status);
+        } else {
+            LogWarning("Mirror replica %d read failed, retrying using "
+                       "another replica. Consecutive errors: %d. "
+                       "Error: %d. Error message: %s",
+                       Target->Index, ReadErrors, Status,
+                       win32_strerror(Status).c_str());
+        }
+    }
+    co_return Status;
+}
+
+wnbd::Task<DWORD> MirrorDevice::SubmitOp(
+    Replica* Target, MirrorRequest* Request)
+{
+    if (Target->Failed) {
+        co_return ERROR_NOT_READY;
+    }
+
+    DWORD Status = 0;
+    Target->Outstanding++;
+    try {
+        switch (Request->Type) {
+        case OpType::Write:
+            Status = co_await Target->Device->Write(
+                Request->Buffer, Request->Offset,
+                (UINT32) Request->Length, Request->ForceUnitAccess);
+            break;
+        case OpType::Flush:
+            Status = co_await Target->Device->Flush();
+            break;
+        case OpType::Unmap:
+            Status = co_await Target->Device->Unmap(
+                Request->Offset, Request->Length);
+            break;
+        }
+    }
+    catch (const std::bad_alloc&) {
+        Status = ERROR_NOT_ENOUGH_MEMORY;
+    }
+    Target->Outstanding--;
+    co_return Status;
+}
+
+DetachedTask MirrorDevice::RunOp(ReplicaOp* Op)
+{
+    MirrorRequest* Request = Op->Request;
+    Replica* Target = Op->Target;
+
+    DWORD Status = 0;
+    try {
+        // Preserve the order of the overlapping operations that were
+        // acknowledged before this one. Flushes cover all of them.
+        if (Request->Type == OpType::Flush) {
+            co_await WaitLagging(Target, 0, ULLONG_MAX, Request->Sequence);
+        } else {
+            co_await WaitLagging(
+                Target, Request->Offset, Request->Length, Request->Sequence);
+        }
+        Status = co_await SubmitOp(Target, Request);
+    }
+    catch (const std::bad_alloc&) {
+        Status = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if (Status && Status != ERROR_NOT_ENOUGH_MEMORY) {
+        SetFailed(Target, Status);
+    }
+    CompleteOp(Op, Status);
+}
+
+void MirrorDevice::CompleteOp(ReplicaOp* Op, DWORD Status)
+{
+    MirrorRequest* Request = Op->Request;
+    Replica* Target = Op->Target;
+
+    RangeWaiter* Ready = nullptr;
+    {
+        std::unique_lock<std::mutex> Lock(Target->LaggingLock);
+        Op->Done = true;
+        if (Op->IsLagging) {
+            if (Op->LaggingPrev) {
+                Op->LaggingPrev->LaggingNext = Op->LaggingNext;
+            } else {
+                Target->LaggingHead = Op->LaggingNext;
+            }
+            if (Op->LaggingNext) {
+                Op->LaggingNext->LaggingPrev = Op->LaggingPrev;
+            }
+            Target->LaggingCount--;
+
+            RangeWaiter** Link = &Target->WaitersHead;
+            while (*Link) {
+                RangeWaiter* Waiter = *Link;
+                if (IsLagging(Target, Waiter->Offset,
+                              Waiter->Length, Waiter->Sequence)) {
+                    Link = &Waiter->Next;
+                } else {
+                    *Link = Waiter->Next;
+                    Waiter->Next = Ready;
+                    Ready = Waiter;
+                }
+            }
+        }
+    }
+    // The waiters are resumed inline, outside the lock. Their frames
+    // may be released as soon as they're resumed.
+    while (Ready) {
+        RangeWaiter* Next = Ready->Next;
+        Ready->Ready.Complete(0);
+        Ready = Next;
+    }
+
+    if (!Status) {
+        if (++Request->Succeeded == Request->AckCount &&
+                !Request->Signaled.exchange(true)) {
+            Request->Done.Complete(0);
+        }
+    } else {
+        DWORD Expected = 0;
+        Request->FirstError.compare_exchange_strong(Expected, Status);
+    }
+    if (++Request->Completed == Request->Total &&
+            !Request->Signaled.exchange(true)) {
+        Request->Done.Complete(
+            Request->Succeeded >= Request->MinSucceeded ?
+                0 : Request->FirstError.load());
+    }
+
+    ReleaseRequest(Request);
+    ReleaseIo();
+}
+
+void MirrorDevice::ReleaseRequest(MirrorRequest* Request)
+{
+    if (!--Request->RefCount) {
+        delete Request;
+    }
+}
+
+wnbd::Task<DWORD> MirrorDevice::Replicate(
+    OpType Type, PVOID Buffer, UINT64 Offset, UINT64 Length,
+    BOOLEAN ForceUnitAccess)
+{
+    if (!AcquireIo()) {
+        co_return ERROR_NOT_READY;
+    }
+
+    std::unique_ptr<MirrorRequest> Request(new (std::nothrow) MirrorRequest());
+    if (!Request) {
+        ReleaseIo();
+        co_return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    Request->Type = Type;
+    Request->Sequence = NextSequence++;
+    Request->Buffer = Buffer;
+    Request->Offset = Offset;
+    Request->Length = Length;
+    Request->ForceUnitAccess = ForceUnitAccess;
+    for (auto& Target : Replicas) {
+        if (!Target->Failed) {
+            ReplicaOp* Op = &Request->Ops[Request->Total++];
+            Op->Request = Request.get();
+            Op->Target = Target.get();
+        }
+    }
+
+    // Without a write quorum, all the healthy replicas are awaited and
+    // at least one of them must succeed.
+    Request->AckCount = WriteQuorum ? WriteQuorum : Request->Total;
+    Request->MinSucceeded = WriteQuorum ? WriteQuorum : 1;
+
+    DWORD Status = 0;
+    if (!Request->Total || Request->Total < WriteQuorum) {
+        LogDebug("Not enough healthy mirror replicas. Healthy: %d. "
+                 "Write quorum: %d.", Request->Total, WriteQuorum);
+        Status = ERROR_NOT_READY;
+    } else if (Buffer && Request->AckCount < Request->Total) {
+        // The request may be acknowledged before the slower replicas
+        // are done with the caller buffer.
+        Request->Data.reset((PBYTE) _aligned_malloc(
+            (size_t) Length, MIRROR_BUFFER_ALIGNMENT));
+        if (Request->Data) {
+            memcpy(Request->Data.get(), Buffer, (size_t) Length);
+            Request->Buffer = Request->Data.get();
+        } else {
+            Status = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+    if (Status) {
+        ReleaseIo();
+        co_return Status;
+    }
+
+    // One reference for each replica operation and one for this
+    // coroutine, the operations may complete after the acknowledgement.
+    MirrorRequest* Pending = Request.release();
+    Pending->RefCount = Pending->Total + 1;
+    for (UINT32 Index = 0; Index < Pending->Total; Index++) {
+        InFlight++;
+        try {
+            RunOp(&Pending->Ops[Index]);
+        }
+        catch (const std::bad_alloc&) {
+            CompleteOp(&Pending->Ops[Index], ERROR_NOT_ENOUGH_MEMORY);
+        }
+    }
+
+    Status = co_await Pending->Done;
+    UINT32 LaggingReplicas = 0;
+    if (!Status && Pending->AckCount < Pending->Total &&
+            Type != OpType::Flush) {
+        LaggingReplicas = RegisterLagging(Pending);
+    }
+    if (!Status) {
+        Status = SetOutOfSync(LaggingReplicas);
+    }
+    ReleaseRequest(Pending);
+    ReleaseIo();
+    co_return Status;
+}
+
+wnbd::Task<DWORD> MirrorDevice::Write(
+    PVOID Buffer, UINT64 Offset, UINT32 Length,
+    BOOLEAN ForceUnitAccess)
+{
+    co_return co_await Replicate(
+        OpType::Write, Buffer, Offset, Length, ForceUnitAccess);
+}
+
+wnbd::Task<DWORD> MirrorDevice::Flush()
+{
+    DWORD Status = co_await Replicate(OpType::Flush, nullptr, 0, 0, FALSE);
+    if (!Status) {
+        RefreshState();
+    }
+    co_return Status;
+}
+
+wnbd::Task<DWORD> MirrorDevice::Unmap(UINT64 Offset, UINT64 Length)
+{
+    if (!UnmapSupported) {
+        co_return ERROR_NOT_SUPPORTED;
+    }
+    co_return co_await Replicate(OpType::Unmap, nullptr, Offset, Length, FALSE);
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "block_device.h"
+#include "io_group.h"
+#include "wnbd.h"
+
+// "WNBDMIR1"
+#define MIRROR_STATE_MAGIC 0x3152494D44424E57ULL
+#define MIRROR_STATE_VERSION 1
+
+typedef struct
+{
+    // FNV-1a hash of the replica address, allowing the replicas to be
+    // passed in a different order.
+    UINT64 NameHash;
+    // The last generation the replica was in sync with.
+    UINT64 Generation;
+} MIRROR_STATE_REPLICA, *PMIRROR_STATE_REPLICA;
+
+// Mirror state file layout. The generation is increased whenever the
+// set of replicas that are in sync changes, the replicas whose
+// generation doesn't match being stale.
+typedef struct
+{
+    UINT64 Magic;
+    UINT32 Version;
+    UINT32 ReplicaCount;
+    UINT64 DiskSize;
+    UINT64 Generation;
+    MIRROR_STATE_REPLICA Replicas[WNBD_MAX_NBD_MEMBERS];
+} MIRROR_STATE, *PMIRROR_STATE;
+
+// Mirrors the data across multiple devices (RAID-1), see
+// WnbdRunMirrorDaemon.
+//
+// Writes, flushes and unmap requests are submitted to all the healthy
+// replicas, completing once all of them are done or once the write
+// quorum is reached. Reads are served by a single replica, picked based
+// on the read policy, failed reads being retried using the other
+// replicas. Replicas that fail a write, flush or unmap request or
+// MIRROR_MAX_READ_ERRORS consecutive reads are dropped from the mirror.
+//
+// Operations acknowledged before completing on all the replicas are
+// tracked per replica as "lagging" operations. Overlapping reads avoid
+// the lagging replicas while overlapping writes wait for the lagging
+// operations to complete, so that the replicas see the same write order.
+//
+// The optional state file records the replicas that may miss
+// acknowledged writes: dropped replicas and replicas with lagging
+// operations. It's updated before acknowledging such writes, lagging
+// replicas being marked as in sync again after flushes and when closing
+// the mirror. Stale replicas are resynced from a replica that is in
+// sync when opening the mirror. Writes that weren't acknowledged when
+// the mirror stopped may have only reached some of the replicas.
+class MirrorDevice : public BlockDevice
+{
+private:
+    enum class OpType
+    {
+        Write,
+        Flush,
+        Unmap,
+    };
+
+    struct Replica;
+    struct MirrorRequest;
+
+    struct ReplicaOp
+    {
+        MirrorRequest* Request = nullptr;
+        Replica* Target = nullptr;
+        // Protected by the replica lock.
+        bool Done = false;
+        bool IsLagging = false;
+        ReplicaOp* LaggingPrev = nullptr;
+        ReplicaOp* LaggingNext = nullptr;
+    };
+
+    // Reference counted, released once acknowledged and completed on
+    // all the replicas.
+    struct MirrorRequest
+    {
+        OpType Type = OpType::Write;
+        // Submission order, operations only wait for lagging operations
+        // submitted before them.
+        UINT64 Sequence = 0;
+        PVOID Buffer = nullptr;
+        UINT64 Offset = 0;
+        UINT64 Length = 0;
+        BOOLEAN ForceUnitAccess = FALSE;
+
+        UINT32 Total = 0;
+        // The number of successful operations needed for an early
+        // completion and the minimum number of successful operations.
+        UINT32 AckCount = 0;
+        UINT32 MinSucceeded = 0;
+
+        std::atomic<UINT32> RefCount = 0;
+        std::atomic<UINT32> Succeeded = 0;
+        std::atomic<UINT32> Completed = 0;
+        std::atomic<DWORD> FirstError = 0;
+        std::atomic<bool> Signaled = false;
+        wnbd::Completion<DWORD> Done;
+
+        // Copy of the write buffer, used when the request may complete
+        // before the replicas are done with the caller buffer.
+        std::unique_ptr<BYTE, decltype(&_aligned_free)> Data{
+            nullptr, &_aligned_free};
+        ReplicaOp Ops[WNBD_MAX_NBD_MEMBERS];
+    };
+
+    struct RangeWaiter
+    {
+        UINT64 Offset = 0;
+        UINT64 Length = 0;
+        UINT64 Sequence = 0;
+        wnbd::Completion<DWORD> Ready;
+        RangeWaiter* Next = nullptr;
+    };
+
+    struct Replica
+    {
+        std::unique_ptr<BlockDevice> Device;
+        UINT32 Index = 0;
+        UINT64 NameHash = 0;
+        std::atomic<bool> Failed = false;
+        // Set while the replica is recorded as stale in the state file,
+        // updated with the state lock held.
+        std::atomic<bool> OutOfSync = false;
+        // The last generation the replica was in sync with. Protected
+        // by the state lock.
+        UINT64 Generation = 0;
+        std::atomic<UINT32> Outstanding = 0;
+        // Consecutive read errors.
+        std::atomic<UINT32> ReadErrors = 0;
+        // Exponentially weighted moving average, in microseconds.
+        std::atomic<UINT64> ReadLatencyUs = 0;
+
+        std::mutex LaggingLock;
+        ReplicaOp* LaggingHead = nullptr;
+        RangeWaiter* WaitersHead = nullptr;
+        std::atomic<UINT32> LaggingCount = 0;
+    };
+
+    std::vector<std::unique_ptr<Replica>> Replicas;
+    UINT64 Size = 0;
+    UINT32 SectorSize = 0;
+    bool UnmapSupported = false;
+    UINT32 WriteQuorum = 0;
+    WnbdMirrorReadPolicy ReadPolicy = WnbdMirrorReadLeastPending;
+    std::atomic<UINT32> NextReadReplica = 0;
+    std::atomic<UINT64> NextSequence = 1;
+
+    // Operations referencing the replicas, drained before closing them.
+    // The drain event is set once the last operation completes.
+    std::atomic<UINT32> InFlight = 0;
+    std::atomic<bool> Closing = false;
+    HANDLE DrainEvent = NULL;
+
+    std::mutex StateLock;
+    HANDLE StateFile = INVALID_HANDLE_VALUE;
+    UINT64 Generation = 0;
+    // Set if the latest state couldn't be persisted.
+    std::atomic<bool> StateDirty = false;
+
+    bool AcquireIo();
+    void ReleaseIo();
+
+    DWORD LoadState(PCSTR Path);
+    // Validates the state file, flagging the stale replicas.
+    DWORD CheckState(HANDLE File, PCSTR Path);
+    // Records the replicas that are in sync using a new generation.
+    // Must be called with the state lock held.
+    DWORD SaveState();
+    // Persists the lagging replicas as stale, before acknowledging the
+    // writes they didn't complete. Also retries failed state updates.
+    DWORD SetOutOfSync(UINT32 ReplicaMask);
+    // Marks the replicas without lagging operations as in sync.
+    void RefreshState();
+    DWORD ResyncReplicas();
+    wnbd::Task<DWORD> CopyReplica(Replica* Source, Replica* Target);
+    DetachedTask RunResync(
+        Replica* Source, Replica* Target, DWORD* Status, HANDLE Done);
+
+    void SetFailed(Replica* Target, DWORD Status);
+    // Checks for lagging operations overlapping the specified range that
+    // were submitted before the specified sequence number. Must be called
+    // with the replica lock held.
+    bool IsLagging(
+        Replica* Target, UINT64 Offset, UINT64 Length, UINT64 Sequence);
+    bool CheckLagging(Replica* Target, UINT64 Offset, UINT64 Length);
+    wnbd::Task<void> WaitLagging(
+        Replica* Target, UINT64 Offset, UINT64 Length, UINT64 Sequence);
+    // Returns the mask of the replicas that got lagging operations.
+    UINT32 RegisterLagging(MirrorRequest* Request);
+
+    // Replicas included in the exclusion mask are skipped.
+    Replica* SelectReadReplica(
+        UINT64 Offset, UINT32 Length, UINT32 Exclude, bool* Lagging);
+
+    wnbd::Task<DWORD> SubmitOp(Replica* Target, MirrorRequest* Request);
+    DetachedTask RunOp(ReplicaOp* Op);
+    void CompleteOp(ReplicaOp* Op, DWORD Status);
+    void ReleaseRequest(MirrorRequest* Request);
+    wnbd::Task<DWORD> Replicate(
+        OpType Type, PVOID Buffer, UINT64 Offset, UINT64 Length,
+        BOOLEAN ForceUnitAccess);
+
+public:
+    ~MirrorDevice();
+
+    // The replica names identify the replicas in the state file.
+    DWORD Open(
+        std::vector<std::unique_ptr<BlockDevice>> Devices,
+        const std::vector<std::string>& ReplicaNames,
+        PWNBD_MIRROR_OPTIONS Options);
+
+    UINT64 GetSize() override { return Size; }
+    UINT32 GetSectorSize() override { return SectorSize; }
+    bool IsUnmapSupported() override { return UnmapSupported; }
+
+    wnbd::Task<DWORD> Read(
+        PVOID Buffer, UINT64 Offset, UINT32 Length) override;
+    wnbd::Task<DWORD> Write(
+        PVOID Buffer, UINT64 Offset, UINT32 Length,
+        BOOLEAN ForceUnitAccess) override;
+    wnbd::Task<DWORD> Flush() override;
+    wnbd::Task<DWORD> Unmap(UINT64 Offset, UINT64 Length) override;
+};
@@ -6,11 +6,21 @@
 
 #include "nbd_daemon.h"
 #include "nbd_protocol.h"
+#include "usr_stats.h"
 #include "utils.h"
 
+#include <chrono>
+
 #define _NTSCSI_USER_MODE_
 #include <scsi.h>
 
+// Zero detection granularity, aligned to the disk offset.
+#define NBD_ZERO_GRANULARITY 4096
+// Zeroed ranges within write requests are only sent separately if
+// they're at least this large, avoiding tiny NBD requests. Fully zeroed
+// writes are always converted.
+#define NBD_MIN_ZERO_RANGE (64 * 1024)
+
 DWORD SetTcpFlags(SOCKET Fd)
 {
     LogDebug("Setting TCP_NODELAY.");
@@ -180,6 +190,12 @@ DWORD NbdDaemon::TryStart()
     WnbdProps.Flags.UnmapSupported |= CHECK_NBD_SEND_TRIM(NbdFlags);
     WnbdProps.Flags.FlushSupported |= CHECK_NBD_SEND_FLUSH(NbdFlags);
     WnbdProps.Flags.FUASupported |= CHECK_NBD_SEND_FUA(NbdFlags);
+    if (WnbdProps.NbdProperties.Flags.DetectZeroes &&
+            !CHECK_NBD_SEND_WRITE_ZEROES(NbdFlags)) {
+        LogWarning("The NBD server doesn't support NBD_CMD_WRITE_ZEROES, "
+                   "zeroed writes will be sent as regular writes.");
+        WnbdProps.NbdProperties.Flags.DetectZeroes = 0;
+    }
 
     if (!WnbdProps.BlockCount ||
             WnbdProps.BlockCount > ULLONG_MAX / WnbdProps.BlockSize) {
@@ -190,29 +206,64 @@ DWORD NbdDaemon::TryStart()
     }
 
     LogInfo("Retrieved NBD flags: %d. Read-only: %d, TRIM enabled: %d, "
-            "FLUSH enabled: %d, FUA enabled: %d.",
+            "FLUSH enabled: %d, FUA enabled: %d, "
+            "zero detection enabled: %d.",
             NbdFlags,
             WnbdProps.Flags.ReadOnly,
             WnbdProps.Flags.UnmapSupported,
             WnbdProps.Flags.FlushSupported,
-            WnbdProps.Flags.FUASupported);
+            WnbdProps.Flags.FUASupported,
+            WnbdProps.NbdProperties.Flags.DetectZeroes);
 
     ReplyDispatcher = std::thread(&NbdDaemon::NbdReplyWorker, this);
 
-    Err = WnbdCreate(
-        &WnbdProps, (const PWNBD_INTERFACE) &WnbdInterface,
-        this, &WnbdDisk);
+    if (OfflineResponse) {
+        Err = WnbdCreateOffline(
+            &WnbdProps, (const PWNBD_INTERFACE) &WnbdInterface,
+            this, OfflineResponse, OfflineResponseContext, &WnbdDisk);
+    } else {
+        Err = WnbdCreate(
+            &WnbdProps, (const PWNBD_INTERFACE) &WnbdInterface,
+            this, &WnbdDisk);
+    }
     if (Err) {
         return Err;
     }
 
+    if (IoTraceOptions.Path[0]) {
+        Err = WnbdStartIoTrace(WnbdDisk, &IoTraceOptions);
+        if (Err) {
+            return Err;
+        }
+    }
+
+    if (OfflineResponse) {
+        LogInfo("Offline NBD disk initialized successfully.");
+        return 0;
+    }
+
     // We currently use a single NBD connection, which is why
     // we'll stick with a single WNBD worker thread.
-    Err = WnbdStartDispatcher(WnbdDisk, 1);
+    DispatcherOptions.Mode = WnbdDispatcherModeThreaded;
+    DispatcherOptions.ThreadCount = 1;
+    DispatcherOptions.Flags.Elastic = 0;
+    Err = WnbdStartDispatcherEx(WnbdDisk, &DispatcherOptions);
     if (Err) {
         return Err;
     }
 
+    // Keep the reply thread on the same processors as the dispatcher,
+    // avoiding cross node accesses when copying the NBD replies.
+    if (WnbdDisk->DispatcherAffinity.Mask &&
+            !SetThreadGroupAffinity(
+                ReplyDispatcher.native_handle(),
+                &WnbdDisk->DispatcherAffinity, NULL)) {
+        DWORD Status = GetLastError();
+        LogWarning("Could not set NBD reply thread affinity. "
+                   "Error: %d. Error message: %s.",
+                   Status, win32_strerror(Status).c_str());
+    }
+
     LogInfo("NBD mapping initialized successfully.");
     return 0;
 }
@@ -287,6 +338,66 @@ DWORD NbdDaemon::Wait()
     return Err;
 }
 
+UINT64 NbdDaemon::TrackRequest(
+    UINT64 RequestHandle,
+    WnbdRequestType RequestType,
+    UINT32 Length)
+{
+    std::unique_lock Lock{PendingRequestsLock};
+    UINT64 NbdHandle = NextNbdHandle++;
+    PendingRequests.emplace(std::make_pair(
+        NbdHandle,
+        PendingRequestInfo {
+            .RequestHandle = RequestHandle,
+            .RequestType = RequestType,
+            .Length = Length,
+        }
+    ));
+    return NbdHandle;
+}
+
+void NbdDaemon::FindZeroRanges(PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    WriteSegments.clear();
+    if (!WnbdProps.NbdProperties.Flags.DetectZeroes) {
+        WriteSegments.push_back({ 0, Length, false });
+        return;
+    }
+
+    PBYTE Data = (PBYTE) Buffer;
+    // The start of the pending data range and of the current zero range.
+    UINT32 DataStart = 0;
+    UINT32 ZeroStart = 0;
+    auto EndZeroRange = [&](UINT32 ZeroEnd) {
+        UINT32 ZeroLength = ZeroEnd - ZeroStart;
+        if (ZeroLength != Length && ZeroLength < NBD_MIN_ZERO_RANGE) {
+            return;
+        }
+        if (ZeroStart > DataStart) {
+            WriteSegments.push_back(
+                { DataStart, ZeroStart - DataStart, false });
+        }
+        WriteSegments.push_back({ ZeroStart, ZeroLength, true });
+        DataStart = ZeroEnd;
+    };
+
+    UINT32 Pos = 0;
+    while (Pos < Length) {
+        UINT32 GranuleLength = (UINT32) min(
+            (UINT64) (Length - Pos),
+            NBD_ZERO_GRANULARITY - (Offset + Pos) % NBD_ZERO_GRANULARITY);
+        if (!IsZeroBuffer(Data + Pos, GranuleLength)) {
+            EndZeroRange(Pos);
+            ZeroStart = Pos + GranuleLength;
+        }
+        Pos += GranuleLength;
+    }
+    EndZeroRange(Length);
+    if (DataStart < Length) {
+        WriteSegments.push_back({ DataStart, Length - DataStart, false });
+    }
+}
+
 void NbdDaemon::Read(
     PWNBD_DISK Disk,
     UINT64 RequestHandle,
@@ -299,30 +410,23 @@ void NbdDaemon::Read(
     WnbdGetUserContext(Disk, (PVOID*)&Handler);
     assert(Handler);
 
-    {
-        std::unique_lock Lock{Handler->PendingRequestsLock};
-        Handler->PendingRequests.emplace(std::make_pair(
-            RequestHandle,
-            PendingRequestInfo {
-                .RequestHandle = RequestHandle,
-                .RequestType = WnbdReqTypeRead,
-                .Length = BlockCount * Handler->WnbdProps.BlockSize,
-            }
-        ));
-    }
+    UINT64 NbdHandle = Handler->TrackRequest(
+        RequestHandle, WnbdReqTypeRead,
+        BlockCount * Handler->WnbdProps.BlockSize);
 
     // NBD doesn't currently support read FUA.
     DWORD Err = NbdRequest(
         Handler->Socket,
         BlockAddress * Handler->WnbdProps.BlockSize,
         BlockCount * Handler->WnbdProps.BlockSize,
-        RequestHandle,
+        NbdHandle,
         NBD_CMD_READ);
     if (Err) {
         // TODO: try resetting the connection instead.
         LogError("Couldn't submit read request. Closing connection.");
         Handler->Shutdown(true);
     }
+    Handler->CheckSubmitTerminated();
 }
 
 void NbdDaemon::Write(
@@ -342,32 +446,77 @@ void NbdDaemon::Write(
         NbdTransmissionFlags |= NBD_CMD_FLAG_FUA;
     }
 
+    UINT64 Offset = BlockAddress * Handler->WnbdProps.BlockSize;
+    UINT32 Length = BlockCount * Handler->WnbdProps.BlockSize;
+    Handler->FindZeroRanges(Buffer, Offset, Length);
+    std::vector<WriteSegment>& Segments = Handler->WriteSegments;
+    bool Split = Segments.size() > 1;
+
+    // All the NBD requests are tracked before being sent, so that the
+    // replies can't complete the write early.
+    UINT64 FirstNbdHandle = 0;
     {
         std::unique_lock Lock{Handler->PendingRequestsLock};
-        Handler->PendingRequests.emplace(std::make_pair(
-            RequestHandle,
-            PendingRequestInfo {
-                .RequestHandle = RequestHandle,
-                .RequestType = WnbdReqTypeWrite,
-                .Length = BlockCount * Handler->WnbdProps.BlockSize,
-            }
-        ));
+        FirstNbdHandle = Handler->NextNbdHandle;
+        Handler->NextNbdHandle += Segments.size();
+        if (Split) {
+            Handler->SplitWrites.emplace(std::make_pair(
+                RequestHandle,
+                SplitWriteInfo {
+                    .Remaining = (UINT32) Segments.size(),
+                    .Failed = false,
+                }
+            ));
+        }
+        for (size_t Idx = 0; Idx < Segments.size(); Idx++) {
+            Handler->PendingRequests.emplace(std::make_pair(
+                FirstNbdHandle + Idx,
+                PendingRequestInfo {
+                    .RequestHandle = RequestHandle,
+                    .RequestType = WnbdReqTypeWrite,
+                    .Length = Segments[Idx].Length,
+                    .Split = Split,
+                }
+            ));
+        }
     }
 
-    DWORD Err = NbdSendWrite(
-        Handler->Socket,
-        BlockAddress * Handler->WnbdProps.BlockSize,
-        BlockCount * Handler->WnbdProps.BlockSize,
-        Buffer,
-        &Handler->PreallocatedWBuff,
-        &Handler->PreallocatedWBuffSz,
-        RequestHandle,
-        NbdTransmissionFlags);
+    DWORD Err = 0;
+    UINT64 ZeroedBytes = 0;
+    for (size_t Idx = 0; Idx < Segments.size() && !Err; Idx++) {
+        WriteSegment& Segment = Segments[Idx];
+        if (Segment.Zero) {
+            Err = NbdSendWriteZeroes(
+                Handler->Socket,
+                Offset + Segment.Offset,
+                Segment.Length,
+                FirstNbdHandle + Idx,
+                NbdTransmissionFlags);
+            ZeroedBytes += Segment.Length;
+        } else {
+            Err = NbdSendWrite(
+                Handler->Socket,
+                Offset + Segment.Offset,
+                Segment.Length,
+                (PBYTE) Buffer + Segment.Offset,
+                &Handler->PreallocatedWBuff,
+                &Handler->PreallocatedWBuffSz,
+                FirstNbdHandle + Idx,
+                NbdTransmissionFlags);
+        }
+    }
+    if (ZeroedBytes) {
+        PWNBD_USR_STATS Stats = ((UsrStatsShards*) Disk->UsrStats)->Local();
+        InterlockedAdd64(
+            (PLONG64)&Stats->ZeroedWriteBlocks,
+            ZeroedBytes / Handler->WnbdProps.BlockSize);
+    }
     if (Err) {
         // TODO: try resetting the connection instead.
         LogError("Couldn't submit write request. Closing connection.");
         Handler->Shutdown(true);
     }
+    Handler->CheckSubmitTerminated();
 }
 
 void NbdDaemon::Flush(
@@ -380,29 +529,22 @@ void NbdDaemon::Flush(
     WnbdGetUserContext(Disk, (PVOID*)&Handler);
     assert(Handler);
 
-    {
-        std::unique_lock Lock{Handler->PendingRequestsLock};
-        Handler->PendingRequests.emplace(std::make_pair(
-            RequestHandle,
-            PendingRequestInfo {
-                .RequestHandle = RequestHandle,
-                .RequestType = WnbdReqTypeFlush,
-                .Length = BlockCount * Handler->WnbdProps.BlockSize,
-            }
-        ));
-    }
+    UINT64 NbdHandle = Handler->TrackRequest(
+        RequestHandle, WnbdReqTypeFlush,
+        BlockCount * Handler->WnbdProps.BlockSize);
 
     DWORD Err = NbdRequest(
         Handler->Socket,
         BlockAddress * Handler->WnbdProps.BlockSize,
         BlockCount * Handler->WnbdProps.BlockSize,
-        RequestHandle,
+        NbdHandle,
         NBD_CMD_FLUSH);
     if (Err) {
         // TODO: try resetting the connection instead.
         LogError("Couldn't submit flush request. Closing connection.");
         Handler->Shutdown(true);
     }
+    Handler->CheckSubmitTerminated();
 }
 
 void NbdDaemon::Unmap(
@@ -416,32 +558,89 @@ void NbdDaemon::Unmap(
     assert(Handler);
     assert(1 == Count);
 
-    {
-        std::unique_lock Lock{Handler->PendingRequestsLock};
-        Handler->PendingRequests.emplace(std::make_pair(
-            RequestHandle,
-            PendingRequestInfo {
-                .RequestHandle = RequestHandle,
-                .RequestType = WnbdReqTypeUnmap,
-                .Length = Descriptors[0].BlockCount * Handler->WnbdProps.BlockSize,
-            }
-        ));
-    }
+    UINT64 NbdHandle = Handler->TrackRequest(
+        RequestHandle, WnbdReqTypeUnmap,
+        Descriptors[0].BlockCount * Handler->WnbdProps.BlockSize);
 
     DWORD Err = NbdRequest(
         Handler->Socket,
         Descriptors[0].BlockAddress * Handler->WnbdProps.BlockSize,
         Descriptors[0].BlockCount * Handler->WnbdProps.BlockSize,
-        RequestHandle,
+        NbdHandle,
         NBD_CMD_TRIM);
     if (Err) {
         // TODO: try resetting the connection instead.
         LogError("Couldn't submit unmap request. Closing connection.");
         Handler->Shutdown(true);
     }
+    Handler->CheckSubmitTerminated();
 }
 
 void NbdDaemon::NbdReplyWorker()
+{
+    ProcessNbdReplies();
+
+    // Offline disk requests aren't cancelled by the driver, so the
+    // callers would otherwise wait indefinitely.
+    if (OfflineResponse) {
+        FailPendingRequests();
+    }
+}
+
+// Completes the pending requests of offline disks with an error once the
+// connection is closed.
+void NbdDaemon::FailPendingRequests()
+{
+    std::unordered_map<UINT64, PendingRequestInfo> Requests;
+    std::unordered_map<UINT64, SplitWriteInfo> Writes;
+    {
+        std::unique_lock Lock{PendingRequestsLock};
+        Requests.swap(PendingRequests);
+        Writes.swap(SplitWrites);
+    }
+
+    UINT32 Failed = 0;
+    auto FailRequest = [&](UINT64 RequestHandle, WnbdRequestType Type) {
+        WNBD_IO_RESPONSE Resp = { 0 };
+        Resp.RequestHandle = RequestHandle;
+        Resp.RequestType = Type;
+        WnbdSetSense(
+            &Resp.Status,
+            SCSI_SENSE_NOT_READY,
+            SCSI_ADSENSE_LUN_NOT_READY);
+        // Passed through the regular response path, which releases the
+        // per request state (e.g. encryption, integrity and trace) and
+        // updates the stats. Offline disks accept responses after
+        // being stopped.
+        WnbdSendResponse(WnbdDisk, &Resp, NULL, 0);
+        Failed++;
+    };
+
+    for (auto& [NbdHandle, Request] : Requests) {
+        // Split writes are only failed once, see below.
+        if (!Request.Split) {
+            FailRequest(Request.RequestHandle, Request.RequestType);
+        }
+    }
+    for (auto& [RequestHandle, Write] : Writes) {
+        FailRequest(RequestHandle, WnbdReqTypeWrite);
+    }
+    if (Failed) {
+        LogWarning("NBD connection closed, failed %d pending requests.",
+                   Failed);
+    }
+}
+
+// Requests submitted while the connection gets closed may be missed
+// by the reply thread.
+void NbdDaemon::CheckSubmitTerminated()
+{
+    if (OfflineResponse && Terminated) {
+        FailPendingRequests();
+    }
+}
+
+void NbdDaemon::ProcessNbdReplies()
 {
     // For performance reasons, we're reusing the overlapped structure
     // when submitting IO replies to WNBD.
@@ -468,6 +667,10 @@ void NbdDaemon::NbdReplyWorker()
             return;
         }
 
+        if (DispatcherOptions.Flags.BusyPoll) {
+            PollNbdReply();
+        }
+
         Err = ProcessNbdReply(&Overlapped);
         if (Err) {
             if (Err == ERROR_CANCELLED || Err == ERROR_GRACEFUL_DISCONNECT) {
@@ -482,6 +685,43 @@ void NbdDaemon::NbdReplyWorker()
     }
 }
 
+// Spin until reply data becomes available or the poll budget is
+// exhausted, avoiding the wakeup latency of the blocking socket read.
+void NbdDaemon::PollNbdReply()
+{
+    u_long Available = 0;
+    UINT64 PollCount = 0;
+    auto PollStart = std::chrono::steady_clock::now();
+    auto PollDeadline = PollStart + std::chrono::microseconds(
+        DispatcherOptions.PollBudgetUs ?
+            DispatcherOptions.PollBudgetUs : WNBD_DEFAULT_POLL_BUDGET_US);
+
+    do {
+        PollCount++;
+        if (ioctlsocket(Socket, FIONREAD, &Available) || Available) {
+            break;
+        }
+        YieldProcessor();
+    } while (std::chrono::steady_clock::now() < PollDeadline &&
+             !Terminated);
+
+    ReplyPollCount += PollCount;
+    ReplyPollTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - PollStart).count();
+    if (!Available) {
+        return;
+    }
+
+    // Replies are only received after the disk gets created, the counters
+    // collected until then are submitted along with the first reply.
+    PWNBD_USR_STATS Stats = ((UsrStatsShards*) WnbdDisk->UsrStats)->Local();
+    InterlockedAdd64((PLONG64)&Stats->PollCount, ReplyPollCount);
+    InterlockedAdd64((PLONG64)&Stats->PollTimeUs, ReplyPollTimeUs);
+    InterlockedIncrement64((PLONG64)&Stats->PolledRequests);
+    ReplyPollCount = 0;
+    ReplyPollTimeUs = 0;
+}
+
 DWORD NbdDaemon::ProcessNbdReply(LPOVERLAPPED Overlapped)
 {
     NBD_REPLY Reply = { 0 };
@@ -492,6 +732,7 @@ DWORD NbdDaemon::ProcessNbdReply(LPOVERLAPPED Overlapped)
     }
 
     PendingRequestInfo Request = { 0 };
+    bool Failed = !!Reply.Error;
 
     {
         std::unique_lock Lock{PendingRequestsLock};
@@ -504,12 +745,28 @@ DWORD NbdDaemon::ProcessNbdReply(LPOVERLAPPED Overlapped)
 
         Request = RequestIt->second;
         PendingRequests.erase(RequestIt);
+
+        if (Request.Split) {
+            auto WriteIt = SplitWrites.find(Request.RequestHandle);
+            if (WriteIt == SplitWrites.end()) {
+                LogError("Unknown split write request: %lld.",
+                         Request.RequestHandle);
+                return ERROR_INVALID_PARAMETER;
+            }
+            WriteIt->second.Failed |= Failed;
+            if (--WriteIt->second.Remaining) {
+                // Waiting for the other parts.
+                return 0;
+            }
+            Failed = WriteIt->second.Failed;
+            SplitWrites.erase(WriteIt);
+        }
     }
 
     PVOID DataBuffer = nullptr;
     UINT32 DataBufferSize = 0;    
 
-    if (!Reply.Error && Request.RequestType == WnbdReqTypeRead) {
+    if (!Failed && Request.RequestType == WnbdReqTypeRead) {
         // We shouldn't get requests larger than the maximum transfer
         // length.
         if (Request.Length > PreallocatedRBuffSz) {
@@ -529,9 +786,9 @@ DWORD NbdDaemon::ProcessNbdReply(LPOVERLAPPED Overlapped)
     }
 
     WNBD_IO_RESPONSE Resp = { 0 };
-    Resp.RequestHandle = Reply.Handle;
+    Resp.RequestHandle = Request.RequestHandle;
     Resp.RequestType = Request.RequestType;
-    if (Reply.Error) {
+    if (Failed) {
         // TODO: parse the actual error
         WnbdSetSense(
             &Resp.Status,
@@ -565,7 +822,7 @@ DWORD NbdDaemon::ProcessNbdReply(LPOVERLAPPED Overlapped)
         LogError("Couldn't send IO response. "
                  "Request id: %lld. "
                  "Error: %d. Error message: %s",
-                 Reply.Handle, Err, win32_strerror(Err).c_str());
+                 Request.RequestHandle, Err, win32_strerror(Err).c_str());
     }
 
     return Err;
@@ -14,6 +14,7 @@
 #include <unordered_map>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include "nbd_protocol.h"
 #include "wnbd_log.h"
@@ -24,6 +25,24 @@ struct PendingRequestInfo
     UINT64 RequestHandle;
     WnbdRequestType RequestType;
     UINT32 Length;
+    // Part of a write request that was split into multiple NBD requests,
+    // see NbdDaemon::SplitWrites.
+    bool Split;
+};
+
+// Write request range, sent either as data or as NBD_CMD_WRITE_ZEROES.
+struct WriteSegment
+{
+    UINT32 Offset;
+    UINT32 Length;
+    bool Zero;
+};
+
+struct SplitWriteInfo
+{
+    // The number of NBD replies that are still expected.
+    UINT32 Remaining;
+    bool Failed;
 };
 
 class NbdDaemon
@@ -46,15 +65,47 @@ private:
     // NBD replies provide limited information. We need to track
     // the request size on our own in order to know how large is
     // the data buffer that follows the reply header.
+    //
+    // The NBD request handles are assigned by us, write requests
+    // containing zeroed ranges being split into multiple NBD requests.
     std::unordered_map<UINT64, PendingRequestInfo> PendingRequests;
+    // Split writes, indexed by the WNBD request handle. The write
+    // completes once all the NBD replies are received.
+    std::unordered_map<UINT64, SplitWriteInfo> SplitWrites;
+    UINT64 NextNbdHandle = 0;
     std::mutex PendingRequestsLock;
+    // Reused for each write, the requests being submitted by one thread
+    // at a time (see the preallocated buffers).
+    std::vector<WriteSegment> WriteSegments;
 
     std::thread ReplyDispatcher;
+    // Reply thread busy polling counters, not submitted yet.
+    UINT64 ReplyPollCount = 0;
+    UINT64 ReplyPollTimeUs = 0;
+
+    // Only the affinity and busy polling options are used, NBD mappings
+    // have a single dispatcher thread.
+    WNBD_DISPATCHER_OPTIONS DispatcherOptions = {0};
+    // IO tracing is enabled if a path is set.
+    WNBD_IO_TRACE_OPTIONS IoTraceOptions = {0};
+
+    // Set when using an offline disk, see WnbdCreateOfflineNbd.
+    OfflineResponseFunc OfflineResponse = nullptr;
+    PVOID OfflineResponseContext = nullptr;
 
 public:
-    NbdDaemon(PWNBD_PROPERTIES Properties)
+    NbdDaemon(
+        PWNBD_PROPERTIES Properties,
+        PWNBD_DISPATCHER_OPTIONS _DispatcherOptions = nullptr,
+        PWNBD_IO_TRACE_OPTIONS _IoTraceOptions = nullptr)
     {
         WnbdProps = *Properties;
+        if (_DispatcherOptions) {
+            DispatcherOptions = *_DispatcherOptions;
+        }
+        if (_IoTraceOptions) {
+            IoTraceOptions = *_IoTraceOptions;
+        }
     }
 
     ~NbdDaemon()
@@ -80,6 +131,17 @@ public:
         }
     }
 
+    // Must be called before starting the daemon. The disk won't be
+    // exposed through the WNBD driver, the requests being passed
+    // through WnbdSubmitRequest.
+    void SetOffline(OfflineResponseFunc ResponseFunc, PVOID ResponseContext)
+    {
+        OfflineResponse = ResponseFunc;
+        OfflineResponseContext = ResponseContext;
+    }
+
+    PWNBD_DISK GetDisk() { return WnbdDisk; }
+
     DWORD Start();
     DWORD Wait();
     DWORD Shutdown(bool HardRemove=false);
@@ -91,7 +153,20 @@ private:
         uint32_t PortNumber);
     DWORD DisconnectNbd();
 
+    // Returns the NBD request handle.
+    UINT64 TrackRequest(
+        UINT64 RequestHandle,
+        WnbdRequestType RequestType,
+        UINT32 Length);
+    // Fills WriteSegments, separating the zeroed ranges of the write
+    // payload if "DetectZeroes" is set.
+    void FindZeroRanges(PVOID Buffer, UINT64 Offset, UINT32 Length);
+
     void NbdReplyWorker();
+    void ProcessNbdReplies();
+    void FailPendingRequests();
+    void CheckSubmitTerminated();
+    void PollNbdReply();
     DWORD ProcessNbdReply(LPOVERLAPPED Overlapped);
 
     // WNBD IO entry points
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "nbd_device.h"
+#include "wnbd_log.h"
+
+// NBD requests have 32 bit lengths, so large unmap requests are split.
+#define UNMAP_CHUNK_SIZE (1ULL << 30)
+
+NbdDevice::~NbdDevice()
+{
+    if (Disk) {
+        WnbdCloseOfflineNbd(Disk);
+    }
+}
+
+DWORD NbdDevice::Open(PWNBD_PROPERTIES Properties)
+{
+    DWORD Status = WnbdCreateOfflineNbd(Properties, OnResponse, this, &Disk);
+    if (Status) {
+        LogError("Could not open NBD export: %s.",
+                 Properties->NbdProperties.ExportName);
+    }
+    return Status;
+}
+
+VOID NbdDevice::OnResponse(
+    PVOID ResponseContext,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize)
+{
+    PendingRequest* Request = (PendingRequest*) Response->RequestHandle;
+
+    DWORD Status = 0;
+    if (Response->Status.ScsiStatus) {
+        Status = Response->RequestType == WnbdReqTypeRead ?
+            ERROR_READ_FAULT : ERROR_WRITE_FAULT;
+    } else if (Request->Buffer) {
+        if (!DataBuffer || DataBufferSize < Request->Length) {
+            Status = ERROR_READ_FAULT;
+        } else {
+            // The data buffer is only valid for the duration of the call.
+            memcpy(Request->Buffer, DataBuffer, Request->Length);
+        }
+    }
+
+    Request->Completion.Complete(Status);
+}
+
+wnbd::Task<DWORD> NbdDevice::Submit(PWNBD_IO_REQUEST Request, PVOID Buffer)
+{
+    PendingRequest Pending;
+    if (Request->RequestType == WnbdReqTypeRead) {
+        Pending.Buffer = Buffer;
+        Pending.Length = Request->Cmd.Read.BlockCount *
+                         Disk->Properties.BlockSize;
+    }
+    Request->RequestHandle = (UINT64) &Pending;
+
+    DWORD Status = 0;
+    {
+        std::unique_lock Lock{SubmitLock};
+        Status = WnbdSubmitRequest(Disk, Request, Buffer);
+    }
+    if (Status) {
+        co_return Status;
+    }
+    co_return co_await Pending.Completion;
+}
+
+wnbd::Task<DWORD> NbdDevice::Read(
+    PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    WNBD_IO_REQUEST Request = { 0 };
+    Request.RequestType = WnbdReqTypeRead;
+    Request.Cmd.Read.BlockAddress = Offset / Disk->Properties.BlockSize;
+    Request.Cmd.Read.BlockCount = Length / Disk->Properties.BlockSize;
+    co_return co_await Submit(&Request, Buffer);
+}
+
+wnbd::Task<DWORD> NbdDevice::Write(
+    PVOID Buffer, UINT64 Offset, UINT32 Length,
+    BOOLEAN ForceUnitAccess)
+{
+    WNBD_IO_REQUEST Request = { 0 };
+    Request.RequestType = WnbdReqTypeWrite;
+    Request.Cmd.Write.BlockAddress = Offset / Disk->Properties.BlockSize;
+    Request.Cmd.Write.BlockCount = Length / Disk->Properties.BlockSize;
+    Request.Cmd.Write.ForceUnitAccess = ForceUnitAccess;
+    co_return co_await Submit(&Request, Buffer);
+}
+
+wnbd::Task<DWORD> NbdDevice::Flush()
+{
+    if (!Disk->Properties.Flags.FlushSupported) {
+        // The server doesn't cache writes.
+        co_return 0;
+    }
+    WNBD_IO_REQUEST Request = { 0 };
+    Request.RequestType = WnbdReqTypeFlush;
+    co_return co_await Submit(&Request, nullptr);
+}
+
+wnbd::Task<DWORD> NbdDevice::Unmap(UINT64 Offset, UINT64 Length)
+{
+    if (!IsUnmapSupported()) {
+        co_return ERROR_NOT_SUPPORTED;
+    }
+
+    UINT32 BlockSize = Disk->Properties.BlockSize;
+    while (Length) {
+        UINT64 ChunkLength = min(Length, UNMAP_CHUNK_SIZE);
+        WNBD_UNMAP_DESCRIPTOR Descriptor = { 0 };
+        Descriptor.BlockAddress = Offset / BlockSize;
+        Descriptor.BlockCount = (UINT32) (ChunkLength / BlockSize);
+
+        WNBD_IO_REQUEST Request = { 0 };
+        Request.RequestType = WnbdReqTypeUnmap;
+        Request.Cmd.Unmap.Count = 1;
+        DWORD Status = co_await Submit(&Request, &Descriptor);
+        if (Status) {
+            co_return Status;
+        }
+        Offset += ChunkLength;
+        Length -= ChunkLength;
+    }
+    co_return 0;
+}
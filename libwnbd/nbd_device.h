@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <mutex>
+
+#include "block_device.h"
+#include "wnbd.h"
+
+// Exposes an NBD export as a BlockDevice, used as a building block by
+// other backends (e.g. as copy-on-write base or stripe member).
+//
+// The NBD client is an offline disk (see WnbdCreateOfflineNbd), the
+// responses being received by the NBD reply thread, which also resumes
+// the awaiting coroutines. WSAStartup must be called first.
+class NbdDevice : public BlockDevice
+{
+private:
+    PWNBD_DISK Disk = nullptr;
+    // The NBD client expects requests to be submitted from one thread
+    // at a time.
+    std::mutex SubmitLock;
+
+    struct PendingRequest
+    {
+        wnbd::Completion<DWORD> Completion;
+        // Read requests only.
+        PVOID Buffer = nullptr;
+        UINT32 Length = 0;
+    };
+
+    static VOID OnResponse(
+        PVOID ResponseContext,
+        PWNBD_IO_RESPONSE Response,
+        PVOID DataBuffer,
+        UINT32 DataBufferSize);
+
+    wnbd::Task<DWORD> Submit(PWNBD_IO_REQUEST Request, PVOID Buffer);
+
+public:
+    ~NbdDevice();
+
+    DWORD Open(PWNBD_PROPERTIES Properties);
+
+    UINT64 GetSize() override
+    {
+        return Disk->Properties.BlockCount * Disk->Properties.BlockSize;
+    }
+    UINT32 GetSectorSize() override { return Disk->Properties.BlockSize; }
+    bool IsUnmapSupported() override
+    {
+        return Disk->Properties.Flags.UnmapSupported;
+    }
+
+    wnbd::Task<DWORD> Read(
+        PVOID Buffer, UINT64 Offset, UINT32 Length) override;
+    wnbd::Task<DWORD> Write(
+        PVOID Buffer, UINT64 Offset, UINT32 Length,
+        BOOLEAN ForceUnitAccess) override;
+    wnbd::Task<DWORD> Flush() override;
+    wnbd::Task<DWORD> Unmap(UINT64 Offset, UINT64 Length) override;
+};
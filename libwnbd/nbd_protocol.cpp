@@ -474,6 +474,36 @@ DWORD NbdSendWrite(
     return Retval;
 }
 
+// The server may deallocate the zeroed range since NBD_CMD_FLAG_NO_HOLE
+// isn't set.
+_Use_decl_annotations_
+DWORD NbdSendWriteZeroes(
+    SOCKET Fd,
+    UINT64 Offset,
+    ULONG Length,
+    UINT64 Handle,
+    UINT32 NbdTransmissionFlags)
+{
+    if (INVALID_SOCKET == Fd) {
+        LogError("Invalid socket.");
+        return ERROR_INVALID_HANDLE;
+    }
+
+    NBD_REQUEST Request;
+    Request.Magic = native_to_big((ULONG) NBD_REQUEST_MAGIC);
+    Request.Type = native_to_big(
+        (ULONG) (NBD_CMD_WRITE_ZEROES | NbdTransmissionFlags));
+    Request.Length = native_to_big((ULONG) Length);
+    Request.From = native_to_big((UINT64) Offset);
+    Request.Handle = Handle;
+
+    DWORD Retval = SendExact(Fd, &Request, sizeof(NBD_REQUEST));
+    if (Retval) {
+        LogError("Couldn't submit NBD_CMD_WRITE_ZEROES.");
+    }
+    return Retval;
+}
+
 _Use_decl_annotations_
 DWORD NbdReadReply(SOCKET Fd, PNBD_REPLY Reply)
 {
@@ -507,6 +537,8 @@ const char* NbdRequestTypeStr(NbdRequestType RequestType) {
         return "NBD_CMD_FLUSH";
     case NBD_CMD_TRIM:
         return "NBD_CMD_TRIM";
+    case NBD_CMD_WRITE_ZEROES:
+        return "NBD_CMD_WRITE_ZEROES";
     default:
         return "UNKNOWN";
     }
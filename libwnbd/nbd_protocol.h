@@ -25,6 +25,7 @@
 #define NBD_FLAG_SEND_FUA   (1 << 3) /* send FUA (forced unit access) */
 /* there is a gap here to match userspace */
 #define NBD_FLAG_SEND_TRIM  (1 << 5) /* send trim/discard */
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6) /* send write zeroes */
 #define NBD_FLAG_CAN_MULTI_CONN (1 << 8) /* Server supports multiple connections per export. */
 
 /* values for cmd flags in the upper 16 bits of request type */
@@ -44,13 +45,16 @@ const UINT64 REPLY_MAGIC  = 0x3e889045565a9LL;
     CHECK_NBD_FLAG(nbd_flags, NBD_FLAG_SEND_TRIM)
 #define CHECK_NBD_SEND_FLUSH(nbd_flags) \
     CHECK_NBD_FLAG(nbd_flags, NBD_FLAG_SEND_FLUSH)
+#define CHECK_NBD_SEND_WRITE_ZEROES(nbd_flags) \
+    CHECK_NBD_FLAG(nbd_flags, NBD_FLAG_SEND_WRITE_ZEROES)
 
 typedef enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2, //DISCONNECT
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_WRITE_ZEROES = 6
 } NbdRequestType;
 
 __pragma(pack(push, 1))
@@ -128,6 +132,13 @@ DWORD NbdSendWrite(
     _In_ UINT64 Handle,
     _In_ UINT32 NbdTransmissionFlags);
 
+DWORD NbdSendWriteZeroes(
+    _In_ SOCKET Fd,
+    _In_ UINT64 Offset,
+    _In_ ULONG Length,
+    _In_ UINT64 Handle,
+    _In_ UINT32 NbdTransmissionFlags);
+
 DWORD NbdNegotiate(
     _In_ SOCKET Fd,
     _In_ PUINT64 Size,
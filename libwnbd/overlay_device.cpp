@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "file_device.h"
+#include "overlay_device.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+#include <intrin.h>
+#include <winioctl.h>
+
+#define ROUND_UP(Value, Alignment) \
+    (((Value) + (Alignment) - 1) / (Alignment) * (Alignment))
+
+DWORD OverlayDevice::SetClusterSize(UINT64 NewClusterSize)
+{
+    if (NewClusterSize < WNBD_MIN_OVERLAY_CLUSTER_SIZE ||
+            NewClusterSize > WNBD_MAX_OVERLAY_CLUSTER_SIZE ||
+            (NewClusterSize & (NewClusterSize - 1))) {
+        LogError("Invalid cluster size: %llu. The cluster size must "
+                 "be a power of two between %d and %d.",
+                 NewClusterSize, WNBD_MIN_OVERLAY_CLUSTER_SIZE,
+                 WNBD_MAX_OVERLAY_CLUSTER_SIZE);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    ClusterSize = NewClusterSize;
+    ClusterCount = (Size + ClusterSize - 1) / ClusterSize;
+    BitmapOffset = OVERLAY_PAGE_SIZE;
+    BitmapSize = ROUND_UP((ClusterCount + 7) / 8, OVERLAY_PAGE_SIZE);
+    DataOffset = ROUND_UP(BitmapOffset + BitmapSize, ClusterSize);
+
+    Bitmap.reset(new (std::nothrow) std::atomic<UINT64>[
+        BitmapSize / sizeof(UINT64)]());
+    if (!Bitmap) {
+        LogError("Could not allocate delta bitmap. Size: %llu.",
+                 BitmapSize);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    return 0;
+}
+
+// Reads or initializes the delta file header and loads the bitmap.
+// Synchronous IO is used, before the delta file gets opened by the
+// IO engine.
+DWORD OverlayDevice::LoadMetadata(UINT32 RequestedClusterSize)
+{
+    HANDLE File = CreateFileA(
+        DeltaPath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (File == INVALID_HANDLE_VALUE) {
+        DWORD Status = GetLastError();
+        LogError("Could not open delta file: %s. "
+                 "Error: %d. Error message: %s",
+                 DeltaPath.c_str(), Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+
+    OVERLAY_HEADER Header = { 0 };
+    LARGE_INTEGER FileSize = { 0 };
+    DWORD Status = 0;
+    if (!GetFileSizeEx(File, &FileSize)) {
+        Status = GetLastError();
+        goto Exit;
+    }
+
+    if (!FileSize.QuadPart) {
+        Status = SetClusterSize(RequestedClusterSize ?
+            RequestedClusterSize : WNBD_DEFAULT_OVERLAY_CLUSTER_SIZE);
+        if (Status) {
+            goto Exit;
+        }
+        LogInfo("Initializing delta file: %s. Cluster size: %llu.",
+                DeltaPath.c_str(), ClusterSize);
+
+        DWORD BytesReturned = 0;
+        if (!DeviceIoControl(
+                File, FSCTL_SET_SPARSE, NULL, 0, NULL, 0,
+                &BytesReturned, NULL)) {
+            Status = GetLastError();
+            goto Exit;
+        }
+
+        // The bitmap is zeroed, being part of a sparse range.
+        FILE_END_OF_FILE_INFO EndOfFile = { 0 };
+        EndOfFile.EndOfFile.QuadPart = DataOffset + Size;
+        if (!SetFileInformationByHandle(
+                File, FileEndOfFileInfo, &EndOfFile, sizeof(EndOfFile))) {
+            Status = GetLastError();
+            goto Exit;
+        }
+
+        Header.Magic = OVERLAY_MAGIC;
+        Header.Version = OVERLAY_VERSION;
+        Header.ClusterSize = (UINT32) ClusterSize;
+        Header.DiskSize = Size;
+        Header.BitmapOffset = BitmapOffset;
+        Header.BitmapSize = BitmapSize;
+        Header.DataOffset = DataOffset;
+        // The header is written last, so that interrupted
+        // initializations get detected.
+        Status = WriteFileExact(File, 0, &Header, sizeof(Header));
+        if (!Status && !FlushFileBuffers(File)) {
+            Status = GetLastError();
+        }
+        goto Exit;
+    }
+
+    Status = ReadFileExact(File, 0, &Header, sizeof(Header));
+    if (Status) {
+        goto Exit;
+    }
+    if (Header.Magic != OVERLAY_MAGIC ||
+            Header.Version != OVERLAY_VERSION) {
+        LogError("Invalid or incompatible delta file: %s. Version: %d.",
+                 DeltaPath.c_str(), Header.Version);
+        Status = ERROR_FILE_CORRUPT;
+        goto Exit;
+    }
+    // The existing delta file determines the cluster size.
+    if (Header.DiskSize != Size ||
+            (RequestedClusterSize &&
+             Header.ClusterSize != RequestedClusterSize)) {
+        LogError("The delta file doesn't match the base device: %s. "
+                 "Delta disk size: %llu, cluster size: %d. "
+                 "Base disk size: %llu, requested cluster size: %d.",
+                 DeltaPath.c_str(), Header.DiskSize, Header.ClusterSize,
+                 Size, RequestedClusterSize);
+        Status = ERROR_INVALID_PARAMETER;
+        goto Exit;
+    }
+    Status = SetClusterSize(Header.ClusterSize);
+    if (Status) {
+        goto Exit;
+    }
+    if (Header.BitmapOffset != BitmapOffset ||
+            Header.BitmapSize != BitmapSize ||
+            Header.DataOffset != DataOffset) {
+        LogError("Invalid delta file layout: %s.", DeltaPath.c_str());
+        Status = ERROR_FILE_CORRUPT;
+        goto Exit;
+    }
+
+    Status = ReadFileExact(
+        File, BitmapOffset, Bitmap.get(), (DWORD) BitmapSize);
+
+Exit:
+    if (Status) {
+        LogError("Could not load delta file: %s. "
+                 "Error: %d. Error message: %s",
+                 DeltaPath.c_str(), Status, win32_strerror(Status).c_str());
+    }
+    CloseHandle(File);
+    return Status;
+}
+
+DWORD OverlayDevice::Open(
+    std::unique_ptr<BlockDevice> BaseDevice,
+    PWNBD_OVERLAY_OPTIONS Options)
+{
+    Base = std::move(BaseDevice);
+    DeltaPath = std::string(
+        Options->DeltaPath, strnlen(Options->DeltaPath, MAX_PATH));
+    if (DeltaPath.empty()) {
+        LogError("No delta file specified.");
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (WNBD_DEFAULT_BLOCK_SIZE % Base->GetSectorSize()) {
+        LogError("Unsupported base device sector size: %d.",
+                 Base->GetSectorSize());
+        return ERROR_NOT_SUPPORTED;
+    }
+    // Partial sectors at the end of the base device aren't exposed.
+    Size = Base->GetSize() / WNBD_DEFAULT_BLOCK_SIZE *
+           WNBD_DEFAULT_BLOCK_SIZE;
+
+    DWORD Status = LoadMetadata(Options->ClusterSize);
+    if (Status) {
+        return Status;
+    }
+
+    BitmapPage.reset((PBYTE) _aligned_malloc(
+        OVERLAY_PAGE_SIZE, OVERLAY_PAGE_SIZE));
+    if (!BitmapPage) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    FileDevice* DeltaFile = new (std::nothrow) FileDevice();
+    if (!DeltaFile) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    Delta.reset(DeltaFile);
+    WNBD_FILE_OPTIONS FileOptions = { 0 };
+    DeltaPath.copy(FileOptions.Path, MAX_PATH - 1);
+    Status = DeltaFile->Open(&FileOptions, FALSE, 0);
+    if (Status) {
+        return Status;
+    }
+
+    UINT64 DirtyClusters = 0;
+    for (UINT64 Index = 0; Index < BitmapSize / sizeof(UINT64); Index++) {
+        DirtyClusters += __popcnt64(Bitmap[Index].load());
+    }
+    LogInfo("Opened delta file: %s. Cluster size: %llu. "
+            "Dirty clusters: %llu/%llu.",
+            DeltaPath.c_str(), ClusterSize, DirtyClusters, ClusterCount);
+    return 0;
+}
+
+UINT64 OverlayDevice::GetRunEnd(UINT64 Offset, UINT64 End, bool Dirty)
+{
+    UINT64 RunEnd = min(ROUND_UP(Offset + 1, ClusterSize), End);
+    while (RunEnd < End && IsDirty(RunEnd / ClusterSize) == Dirty) {
+        RunEnd = min(RunEnd + ClusterSize, End);
+    }
+    return RunEnd;
+}
+
+wnbd::Task<DWORD> OverlayDevice::MarkDirty(UINT64 Cluster)
+{
+    co_await BitmapLock.Acquire();
+
+    // The page image includes the new bit while the in-memory bitmap
+    // is only updated once the page is persisted. Readers would
+    // otherwise use the delta file cluster, which may get discarded
+    // after a crash if the bitmap write fails.
+    const UINT64 WordsPerPage = OVERLAY_PAGE_SIZE / sizeof(UINT64);
+    UINT64 Page = Cluster / 8 / OVERLAY_PAGE_SIZE;
+    PUINT64 PageWords = (PUINT64) BitmapPage.get();
+    for (UINT64 Index = 0; Index < WordsPerPage; Index++) {
+        PageWords[Index] = Bitmap[Page * WordsPerPage + Index].load();
+    }
+    PageWords[Cluster / 64 - Page * WordsPerPage] |= 1ULL << (Cluster % 64);
+
+    DWORD Status = co_await Delta->Write(
+        BitmapPage.get(), BitmapOffset + Page * OVERLAY_PAGE_SIZE,
+        OVERLAY_PAGE_SIZE, TRUE);
+    if (!Status) {
+        Bitmap[Cluster / 64].fetch_or(1ULL << (Cluster % 64));
+    }
+
+    BitmapLock.Release();
+    co_return Status;
+}
+
+wnbd::Task<DWORD> OverlayDevice::WriteCleanCluster(
+    UINT64 Cluster, UINT64 ClusterOffset,
+    PBYTE Buffer, UINT32 Length, BOOLEAN ForceUnitAccess)
+{
+    IoSlots& Lock = ClusterLocks[Cluster % OVERLAY_LOCK_STRIPES];
+    co_await Lock.Acquire();
+
+    UINT64 ClusterStart = Cluster * ClusterSize;
+    DWORD Status = 0;
+    if (IsDirty(Cluster)) {
+        // Copied by a concurrent write.
+        Status = co_await Delta->Write(
+            Buffer, DataOffset + ClusterStart + ClusterOffset,
+            Length, ForceUnitAccess);
+        Lock.Release();
+        co_return Status;
+    }
+
+    // The last cluster may be partially used.
+    UINT32 UsedSize = (UINT32) min(ClusterSize, Size - ClusterStart);
+    if (!ClusterOffset && Length == UsedSize) {
+        Status = co_await Delta->Write(
+            Buffer, DataOffset + ClusterStart, Length, TRUE);
+    } else {
+        std::unique_ptr<BYTE, decltype(&_aligned_free)> ClusterData(
+            (PBYTE) _aligned_malloc(ClusterSize, OVERLAY_PAGE_SIZE),
+            &_aligned_free);
+        if (!ClusterData) {
+            Status = ERROR_NOT_ENOUGH_MEMORY;
+        }
+        if (!Status) {
+            Status = co_await Base->Read(
+                ClusterData.get(), ClusterStart, UsedSize);
+        }
+        if (!Status) {
+            memcpy(ClusterData.get() + ClusterOffset, Buffer, Length);
+            Status = co_await Delta->Write(
+                ClusterData.get(), DataOffset + ClusterStart,
+                UsedSize, TRUE);
+        }
+    }
+    if (!Status) {
+        Status = co_await MarkDirty(Cluster);
+    }
+
+    Lock.Release();
+    co_return Status;
+}
+
+wnbd::Task<DWORD> OverlayDevice::Read(
+    PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    UINT64 End = Offset + Length;
+    while (Offset < End) {
+        bool Dirty = IsDirty(Offset / ClusterSize);
+        UINT64 RunEnd = GetRunEnd(Offset, End, Dirty);
+        UINT32 RunLength = (UINT32) (RunEnd - Offset);
+
+        DWORD Status = 0;
+        if (Dirty) {
+            Status = co_await Delta->Read(
+                Buffer, DataOffset + Offset, RunLength);
+        } else {
+            Status = co_await Base->Read(Buffer, Offset, RunLength);
+        }
+        if (Status) {
+            co_return Status;
+        }
+
+        Buffer = (PBYTE) Buffer + RunLength;
+        Offset = RunEnd;
+    }
+    co_return 0;
+}
+
+wnbd::Task<DWORD> OverlayDevice::Write(
+    PVOID Buffer, UINT64 Offset, UINT32 Length,
+    BOOLEAN ForceUnitAccess)
+{
+    UINT64 End = Offset + Length;
+    while (Offset < End) {
+        UINT64 Cluster = Offset / ClusterSize;
+        UINT64 RunEnd = 0;
+        DWORD Status = 0;
+        if (IsDirty(Cluster)) {
+            RunEnd = GetRunEnd(Offset, End, true);
+            Status = co_await Delta->Write(
+                Buffer, DataOffset + Offset,
+                (UINT32) (RunEnd - Offset), ForceUnitAccess);
+        } else {
+            RunEnd = min(ROUND_UP(Offset + 1, ClusterSize), End);
+            Status = co_await WriteCleanCluster(
+                Cluster, Offset % ClusterSize, (PBYTE) Buffer,
+                (UINT32) (RunEnd - Offset), ForceUnitAccess);
+        }
+        if (Status) {
+            co_return Status;
+        }
+
+        Buffer = (PBYTE) Buffer + (RunEnd - Offset);
+        Offset = RunEnd;
+    }
+    co_return 0;
+}
+
+wnbd::Task<DWORD> OverlayDevice::Flush()
+{
+    co_return co_await Delta->Flush();
+}
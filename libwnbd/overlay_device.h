@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "block_device.h"
+#include "io_engine.h"
+#include "wnbd.h"
+
+// "WNBDCOW1"
+#define OVERLAY_MAGIC 0x31574F4344424E57ULL
+#define OVERLAY_VERSION 1
+// Header and bitmap IO unit, large enough for unbuffered IO on
+// 4k sector disks.
+#define OVERLAY_PAGE_SIZE 4096
+#define OVERLAY_LOCK_STRIPES 64
+
+// Delta file layout: header page, cluster allocation bitmap (padded to
+// OVERLAY_PAGE_SIZE) and the cluster data, stored at the same offset
+// as in the base device (relative to DataOffset). The delta file is
+// sparse, so only the written clusters take up space.
+typedef struct
+{
+    UINT64 Magic;
+    UINT32 Version;
+    UINT32 ClusterSize;
+    UINT64 DiskSize;
+    UINT64 BitmapOffset;
+    UINT64 BitmapSize;
+    UINT64 DataOffset;
+} OVERLAY_HEADER, *POVERLAY_HEADER;
+
+// Copy-on-write device, see WnbdRunOverlayDaemon.
+//
+// Reads of clean clusters go to the read-only base device while dirty
+// clusters are served from the local delta file. The first write to a
+// cluster copies the rest of the cluster from the base (unless the
+// write covers it), writes it through to the delta file and then
+// persists the corresponding bitmap page, so that a cluster never gets
+// marked as dirty before its data reaches the disk.
+class OverlayDevice : public BlockDevice
+{
+private:
+    std::unique_ptr<BlockDevice> Base;
+    std::unique_ptr<BlockDevice> Delta;
+    std::string DeltaPath;
+
+    UINT64 Size = 0;
+    UINT64 ClusterSize = 0;
+    UINT64 ClusterCount = 0;
+    UINT64 BitmapOffset = 0;
+    UINT64 BitmapSize = 0;
+    UINT64 DataOffset = 0;
+
+    // One bit per cluster, set once the cluster data is stored in
+    // the delta file.
+    std::unique_ptr<std::atomic<UINT64>[]> Bitmap;
+
+    // Serializes bitmap updates, so that the persisted pages don't
+    // get overwritten by older copies.
+    IoSlots BitmapLock;
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> BitmapPage{
+        nullptr, &_aligned_free};
+    // Serializes the first writes to a cluster (copy-up).
+    IoSlots ClusterLocks[OVERLAY_LOCK_STRIPES];
+
+    // Computes the delta file layout and allocates the bitmap.
+    DWORD SetClusterSize(UINT64 NewClusterSize);
+    DWORD LoadMetadata(UINT32 RequestedClusterSize);
+
+    bool IsDirty(UINT64 Cluster)
+    {
+        return Bitmap[Cluster / 64].load() & (1ULL << (Cluster % 64));
+    }
+    // Returns the end of the range (exclusive) starting at Offset
+    // whose clusters share the dirty state of the first cluster.
+    UINT64 GetRunEnd(UINT64 Offset, UINT64 End, bool Dirty);
+
+    wnbd::Task<DWORD> MarkDirty(UINT64 Cluster);
+    wnbd::Task<DWORD> WriteCleanCluster(
+        UINT64 Cluster, UINT64 ClusterOffset,
+        PBYTE Buffer, UINT32 Length, BOOLEAN ForceUnitAccess);
+
+public:
+    // The base device must remain unchanged while being used as base.
+    DWORD Open(
+        std::unique_ptr<BlockDevice> BaseDevice,
+        PWNBD_OVERLAY_OPTIONS Options);
+
+    UINT64 GetSize() override { return Size; }
+    UINT32 GetSectorSize() override { return WNBD_DEFAULT_BLOCK_SIZE; }
+    // Unmapped ranges would have to read back as zeroes instead of
+    // exposing the base data.
+    bool IsUnmapSupported() override { return false; }
+
+    wnbd::Task<DWORD> Read(
+        PVOID Buffer, UINT64 Offset, UINT32 Length) override;
+    wnbd::Task<DWORD> Write(
+        PVOID Buffer, UINT64 Offset, UINT32 Length,
+        BOOLEAN ForceUnitAccess) override;
+    wnbd::Task<DWORD> Flush() override;
+    wnbd::Task<DWORD> Unmap(UINT64 Offset, UINT64 Length) override
+    {
+        co_return ERROR_NOT_SUPPORTED;
+    }
+};
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "ram_device.h"
+#include "utils.h"
+#include "wnbd_log.h"
+
+// Used when large pages aren't available. Physical pages are only
+// assigned when first touched, so the chunk size doesn't affect the
+// memory usage as much as in the large pages case.
+#define RAM_DEVICE_CHUNK_SIZE (2ULL << 20)
+
+RamDevice::~RamDevice()
+{
+    for (UINT64 Index = 0; Index < ChunkCount; Index++) {
+        FreeChunk(Chunks[Index].Data);
+    }
+}
+
+DWORD RamDevice::Initialize(UINT64 DeviceSize)
+{
+    if (!DeviceSize) {
+        LogError("The RAM disk size must be specified.");
+        return ERROR_INVALID_PARAMETER;
+    }
+    Size = DeviceSize;
+
+    SIZE_T LargePageSize = GetLargePageMinimum();
+    if (LargePageSize) {
+        DWORD Status = EnableLockMemoryPrivilege();
+        if (Status) {
+            LogInfo("Large pages unavailable, SeLockMemoryPrivilege "
+                    "couldn't be enabled. Error: %d. Error message: %s",
+                    Status, win32_strerror(Status).c_str());
+        } else {
+            LargePages = true;
+        }
+    }
+    ChunkSize = LargePages ? LargePageSize : RAM_DEVICE_CHUNK_SIZE;
+
+    ChunkCount = (Size + ChunkSize - 1) / ChunkSize;
+    Chunks.reset(new (std::nothrow) Chunk[ChunkCount]);
+    if (!Chunks) {
+        LogError("Could not allocate the RAM disk chunk table. "
+                 "Chunk count: %llu.", ChunkCount);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    LogInfo("Initialized RAM disk. Size: %llu. Chunk size: %llu. "
+            "Large pages: %d.", Size, ChunkSize, LargePages);
+    return 0;
+}
+
+PBYTE RamDevice::AllocateChunk()
+{
+    PBYTE Data = nullptr;
+    if (LargePages) {
+        Data = (PBYTE) VirtualAlloc(
+            NULL, ChunkSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+            PAGE_READWRITE);
+        if (!Data) {
+            // Most likely due to memory fragmentation.
+            LogDebug("Could not allocate large pages, using regular pages. "
+                     "Error: %d.", GetLastError());
+        }
+    }
+    if (!Data) {
+        Data = (PBYTE) VirtualAlloc(
+            NULL, ChunkSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+    if (!Data) {
+        DWORD Status = GetLastError();
+        LogError("Could not allocate RAM disk chunk. "
+                 "Error: %d. Error message: %s",
+                 Status, win32_strerror(Status).c_str());
+        return nullptr;
+    }
+
+    AllocatedChunks++;
+    return Data;
+}
+
+void RamDevice::FreeChunk(PBYTE Data)
+{
+    if (Data) {
+        VirtualFree(Data, 0, MEM_RELEASE);
+        AllocatedChunks--;
+    }
+}
+
+void RamDevice::ZeroChunkRange(Chunk& Chunk, UINT64 Offset, UINT64 Length)
+{
+    // The last chunk may be partially used.
+    UINT64 ChunkStart = (&Chunk - Chunks.get()) * ChunkSize;
+    UINT64 UsedSize = min(ChunkSize, Size - ChunkStart);
+    if (!Offset && Length == UsedSize) {
+        AcquireSRWLockExclusive(&Chunk.Lock);
+        FreeChunk(Chunk.Data);
+        Chunk.Data = nullptr;
+        ReleaseSRWLockExclusive(&Chunk.Lock);
+    } else {
+        // Unallocated chunks are already zeroed.
+        AcquireSRWLockShared(&Chunk.Lock);
+        if (Chunk.Data) {
+            memset(Chunk.Data + Offset, 0, Length);
+        }
+        ReleaseSRWLockShared(&Chunk.Lock);
+    }
+}
+
+wnbd::Task<DWORD> RamDevice::Read(
+    PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    co_return ForEachChunk(Offset, Length,
+        [Buffer](Chunk& Chunk, UINT64 ChunkOffset,
+                 UINT64 SliceLength, UINT64 RequestOffset) -> DWORD {
+            PBYTE Dest = (PBYTE) Buffer + RequestOffset;
+            AcquireSRWLockShared(&Chunk.Lock);
+            if (Chunk.Data) {
+                memcpy(Dest, Chunk.Data + ChunkOffset, SliceLength);
+            } else {
+                memset(Dest, 0, SliceLength);
+            }
+            ReleaseSRWLockShared(&Chunk.Lock);
+            return 0;
+        });
+}
+
+wnbd::Task<DWORD> RamDevice::Write(
+    PVOID Buffer, UINT64 Offset, UINT32 Length,
+    BOOLEAN ForceUnitAccess)
+{
+    co_return ForEachChunk(Offset, Length,
+        [this, Buffer](Chunk& Chunk, UINT64 ChunkOffset,
+                       UINT64 SliceLength, UINT64 RequestOffset) -> DWORD {
+            PBYTE Src = (PBYTE) Buffer + RequestOffset;
+            if (IsZeroBuffer(Src, SliceLength)) {
+                ZeroChunkRange(Chunk, ChunkOffset, SliceLength);
+                return 0;
+            }
+
+            // Concurrent writes to the same chunk only need the
+            // shared lock.
+            AcquireSRWLockShared(&Chunk.Lock);
+            if (Chunk.Data) {
+                memcpy(Chunk.Data + ChunkOffset, Src, SliceLength);
+                ReleaseSRWLockShared(&Chunk.Lock);
+                return 0;
+            }
+            ReleaseSRWLockShared(&Chunk.Lock);
+
+            AcquireSRWLockExclusive(&Chunk.Lock);
+            if (!Chunk.Data) {
+                Chunk.Data = AllocateChunk();
+            }
+            if (Chunk.Data) {
+                memcpy(Chunk.Data + ChunkOffset, Src, SliceLength);
+            }
+            DWORD Status = Chunk.Data ? 0 : ERROR_NOT_ENOUGH_MEMORY;
+            ReleaseSRWLockExclusive(&Chunk.Lock);
+            return Status;
+        });
+}
+
+wnbd::Task<DWORD> RamDevice::Unmap(UINT64 Offset, UINT64 Length)
+{
+    co_return ForEachChunk(Offset, Length,
+        [this](Chunk& Chunk, UINT64 ChunkOffset,
+               UINT64 SliceLength, UINT64 RequestOffset) -> DWORD {
+            ZeroChunkRange(Chunk, ChunkOffset, SliceLength);
+            return 0;
+        });
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <atomic>
+#include <memory>
+
+#include "block_device.h"
+#include "wnbd.h"
+
+// Sparse in-memory device, see WnbdRunRamDaemon.
+//
+// Memory is allocated in chunks when first written, using large pages
+// if possible. Unallocated chunks read back as zeroes. Zero writes and
+// unmap requests covering whole chunks release them.
+class RamDevice : public BlockDevice
+{
+private:
+    struct Chunk
+    {
+        // Held exclusively when allocating or releasing the chunk data.
+        SRWLOCK Lock = SRWLOCK_INIT;
+        PBYTE Data = nullptr;
+    };
+
+    UINT64 Size = 0;
+    UINT64 ChunkSize = 0;
+    UINT64 ChunkCount = 0;
+    std::unique_ptr<Chunk[]> Chunks;
+    bool LargePages = false;
+    std::atomic<UINT64> AllocatedChunks = 0;
+
+    PBYTE AllocateChunk();
+    void FreeChunk(PBYTE Data);
+    void ZeroChunkRange(Chunk& Chunk, UINT64 Offset, UINT64 Length);
+
+    // Invokes Func(Chunk, ChunkOffset, SliceLength, RequestOffset) for
+    // each chunk that overlaps the specified range.
+    template <typename Func>
+    DWORD ForEachChunk(UINT64 Offset, UINT64 Length, Func&& F)
+    {
+        UINT64 RequestOffset = 0;
+        while (Length) {
+            UINT64 ChunkOffset = Offset % ChunkSize;
+            UINT64 SliceLength = min(Length, ChunkSize - ChunkOffset);
+            DWORD Status = F(
+                Chunks[Offset / ChunkSize], ChunkOffset,
+                SliceLength, RequestOffset);
+            if (Status) {
+                return Status;
+            }
+            Offset += SliceLength;
+            Length -= SliceLength;
+            RequestOffset += SliceLength;
+        }
+        return 0;
+    }
+
+public:
+    ~RamDevice();
+
+    DWORD Initialize(UINT64 DeviceSize);
+
+    UINT64 GetSize() override { return Size; }
+    UINT32 GetSectorSize() override { return WNBD_DEFAULT_BLOCK_SIZE; }
+    bool IsUnmapSupported() override { return true; }
+
+    // The number of bytes currently allocated.
+    UINT64 GetAllocatedSize() { return AllocatedChunks * ChunkSize; }
+
+    wnbd::Task<DWORD> Read(
+        PVOID Buffer, UINT64 Offset, UINT32 Length) override;
+    wnbd::Task<DWORD> Write(
+        PVOID Buffer, UINT64 Offset, UINT32 Length,
+        BOOLEAN ForceUnitAccess) override;
+    wnbd::Task<DWORD> Flush() override { co_return 0; }
+    wnbd::Task<DWORD> Unmap(UINT64 Offset, UINT64 Length) override;
+};
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "io_group.h"
+#include "stripe_device.h"
+#include "wnbd_log.h"
+
+DWORD StripeDevice::Open(
+    std::vector<std::unique_ptr<BlockDevice>> Devices,
+    UINT32 RequestedStripeSize)
+{
+    Members = std::move(Devices);
+    if (Members.size() < 2 || Members.size() > WNBD_MAX_NBD_MEMBERS) {
+        LogError("Invalid stripe member count: %d. "
+                 "Expecting between 2 and %d members.",
+                 (UINT32) Members.size(), WNBD_MAX_NBD_MEMBERS);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    StripeSize = RequestedStripeSize ?
+        RequestedStripeSize : WNBD_DEFAULT_STRIPE_SIZE;
+    if (StripeSize < WNBD_MIN_STRIPE_SIZE ||
+            StripeSize > WNBD_MAX_STRIPE_SIZE ||
+            (StripeSize & (StripeSize - 1))) {
+        LogError("Invalid stripe size: %llu. The stripe size must "
+                 "be a power of two between %d and %d.",
+                 StripeSize, WNBD_MIN_STRIPE_SIZE, WNBD_MAX_STRIPE_SIZE);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    // The smallest member determines the usable size.
+    UINT64 MemberSize = ULLONG_MAX;
+    UnmapSupported = true;
+    for (auto& Member : Members) {
+        MemberSize = min(MemberSize, Member->GetSize());
+        SectorSize = max(SectorSize, Member->GetSectorSize());
+        UnmapSupported &= Member->IsUnmapSupported();
+    }
+    MemberSize = MemberSize / StripeSize * StripeSize;
+    Size = MemberSize * Members.size();
+    if (!Size) {
+        LogError("The stripe members are smaller than the stripe size: %llu.",
+                 StripeSize);
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    LogInfo("Using %d stripe members. Stripe size: %llu. "
+            "Disk size: %llu. Unmap supported: %d.",
+            (UINT32) Members.size(), StripeSize, Size, UnmapSupported);
+    return 0;
+}
+
+UINT64 StripeDevice::MapOffset(UINT64 Offset, size_t* Member)
+{
+    UINT64 Stripe = Offset / StripeSize;
+    *Member = Stripe % Members.size();
+    return Stripe / Members.size() * StripeSize + Offset % StripeSize;
+}
+
+UINT64 StripeDevice::GetMemberBound(UINT64 Offset, size_t Member)
+{
+    UINT64 RowSize = StripeSize * Members.size();
+    UINT64 Row = Offset / RowSize;
+    UINT64 RowOffset = Offset % RowSize;
+    size_t Column = RowOffset / StripeSize;
+    if (Column < Member) {
+        return Row * StripeSize;
+    }
+    if (Column == Member) {
+        return Row * StripeSize + RowOffset % StripeSize;
+    }
+    return (Row + 1) * StripeSize;
+}
+
+wnbd::Task<DWORD> StripeDevice::Read(
+    PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    size_t Member = 0;
+    UINT64 MemberOffset = MapOffset(Offset, &Member);
+    UINT32 ChunkLength = (UINT32) min(
+        Length, StripeSize - Offset % StripeSize);
+    if (ChunkLength == Length) {
+        co_return co_await Members[Member]->Read(
+            Buffer, MemberOffset, Length);
+    }
+
+    IoGroup Group;
+    while (Length) {
+        MemberOffset = MapOffset(Offset, &Member);
+        ChunkLength = (UINT32) min(Length, StripeSize - Offset % StripeSize);
+        Group.Start(Members[Member]->Read(Buffer, MemberOffset, ChunkLength));
+
+        Buffer = (PBYTE) Buffer + ChunkLength;
+        Offset += ChunkLength;
+        Length -= ChunkLength;
+    }
+    co_return co_await Group.Wait();
+}
+
+wnbd::Task<DWORD> StripeDevice::Write(
+    PVOID Buffer, UINT64 Offset, UINT32 Length,
+    BOOLEAN ForceUnitAccess)
+{
+    size_t Member = 0;
+    UINT64 MemberOffset = MapOffset(Offset, &Member);
+    UINT32 ChunkLength = (UINT32) min(
+        Length, StripeSize - Offset % StripeSize);
+    if (ChunkLength == Length) {
+        co_return co_await Members[Member]->Write(
+            Buffer, MemberOffset, Length, ForceUnitAccess);
+    }
+
+    IoGroup Group;
+    while (Length) {
+        MemberOffset = MapOffset(Offset, &Member);
+        ChunkLength = (UINT32) min(Length, StripeSize - Offset % StripeSize);
+        Group.Start(Members[Member]->Write(
+            Buffer, MemberOffset, ChunkLength, ForceUnitAccess));
+
+        Buffer = (PBYTE) Buffer + ChunkLength;
+        Offset += ChunkLength;
+        Length -= ChunkLength;
+    }
+    co_return co_await Group.Wait();
+}
+
+wnbd::Task<DWORD> StripeDevice::Flush()
+{
+    IoGroup Group;
+    for (auto& Member : Members) {
+        Group.Start(Member->Flush());
+    }
+    co_return co_await Group.Wait();
+}
+
+wnbd::Task<DWORD> StripeDevice::Unmap(UINT64 Offset, UINT64 Length)
+{
+    if (!UnmapSupported) {
+        co_return ERROR_NOT_SUPPORTED;
+    }
+
+    // The stripes covered by the range are contiguous on each member.
+    IoGroup Group;
+    for (size_t Member = 0; Member < Members.size(); Member++) {
+        UINT64 Start = GetMemberBound(Offset, Member);
+        UINT64 End = GetMemberBound(Offset + Length, Member);
+        if (End > Start) {
+            Group.Start(Members[Member]->Unmap(Start, End - Start));
+        }
+    }
+    co_return co_await Group.Wait();
+}
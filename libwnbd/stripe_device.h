@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <memory>
+#include <vector>
+
+#include "block_device.h"
+#include "wnbd.h"
+
+// Stripes the data across multiple devices (RAID-0), see
+// WnbdRunStripeDaemon.
+//
+// Stripe N is stored on member N % MemberCount, at offset
+// (N / MemberCount) * StripeSize. Requests spanning multiple stripes are
+// split, the parts being submitted concurrently.
+class StripeDevice : public BlockDevice
+{
+private:
+    std::vector<std::unique_ptr<BlockDevice>> Members;
+    UINT64 StripeSize = 0;
+    UINT64 Size = 0;
+    UINT32 SectorSize = 0;
+    bool UnmapSupported = false;
+
+    // Returns the member offset corresponding to the specified disk
+    // offset, which must not be the end of the disk.
+    UINT64 MapOffset(UINT64 Offset, size_t* Member);
+    // Returns the member offset corresponding to the first byte stored by
+    // the member at or after the specified disk offset.
+    UINT64 GetMemberBound(UINT64 Offset, size_t Member);
+
+public:
+    DWORD Open(
+        std::vector<std::unique_ptr<BlockDevice>> Devices,
+        UINT32 RequestedStripeSize);
+
+    UINT64 GetSize() override { return Size; }
+    UINT32 GetSectorSize() override { return SectorSize; }
+    bool IsUnmapSupported() override { return UnmapSupported; }
+
+    wnbd::Task<DWORD> Read(
+        PVOID Buffer, UINT64 Offset, UINT32 Length) override;
+    wnbd::Task<DWORD> Write(
+        PVOID Buffer, UINT64 Offset, UINT32 Length,
+        BOOLEAN ForceUnitAccess) override;
+    wnbd::Task<DWORD> Flush() override;
+    wnbd::Task<DWORD> Unmap(UINT64 Offset, UINT64 Length) override;
+};
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "usr_stats.h"
+#include "wnbd_log.h"
+
+#include <stddef.h>
+
+// The counters preceding the reserved field.
+#define USR_STATS_COUNTER_COUNT \
+    (offsetof(WNBD_USR_STATS, Reserved) / sizeof(UINT64))
+
+DWORD UsrStatsShards::Initialize()
+{
+    DWORD ProcessorCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    ProcessorCount = min(max(ProcessorCount, 1u), WNBD_MAX_STATS_SHARDS);
+
+    // Use a power of two so that we can mask the processor number.
+    ULONG ShardCount = 1;
+    while (ShardCount < ProcessorCount) {
+        ShardCount <<= 1;
+    }
+
+    Shards.reset(new (std::nothrow) Shard[ShardCount]());
+    if (!Shards) {
+        LogError("Could not allocate memory.");
+        return ERROR_OUTOFMEMORY;
+    }
+    ShardMask = ShardCount - 1;
+    return 0;
+}
+
+void UsrStatsShards::Aggregate(PWNBD_USR_STATS Stats)
+{
+    memset(Stats, 0, sizeof(WNBD_USR_STATS));
+
+    PUINT64 Totals = (PUINT64) Stats;
+    for (ULONG ShardIdx = 0; ShardIdx <= ShardMask; ShardIdx++) {
+        volatile UINT64* Counters = (volatile UINT64*) &Shards[ShardIdx].Stats;
+        for (size_t i = 0; i < USR_STATS_COUNTER_COUNT; i++) {
+            Totals[i] += Counters[i];
+        }
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <memory>
+
+#include "wnbd.h"
+
+#define WNBD_CACHE_LINE_SIZE 64
+// GetCurrentProcessorNumber returns the processor number within
+// the current processor group, which can't exceed 64.
+#define WNBD_MAX_STATS_SHARDS 64
+
+// Userspace IO counters, sharded per processor.
+//
+// The dispatcher and reply threads update a few counters for each IO
+// request. Using a single set of counters leads to cache line contention
+// as the number of threads increases, so each processor gets its own
+// cache line aligned counters. The shards are summed up when the stats
+// are retrieved.
+//
+// A thread may be preempted or migrated while updating the counters of
+// a given shard, so interlocked operations are still required. Those
+// are cheap as long as the cache line isn't shared with other processors.
+class UsrStatsShards
+{
+private:
+    struct alignas(WNBD_CACHE_LINE_SIZE) Shard
+    {
+        WNBD_USR_STATS Stats;
+    };
+
+    std::unique_ptr<Shard[]> Shards;
+    ULONG ShardMask = 0;
+
+public:
+    DWORD Initialize();
+
+    // Returns the counters of the current processor.
+    PWNBD_USR_STATS Local()
+    {
+        return &Shards[GetCurrentProcessorNumber() & ShardMask].Stats;
+    }
+
+    // Sums up the counters of all the shards. Counters such as
+    // "PendingReplies" may be incremented and decremented on different
+    // shards, only the aggregated value is meaningful.
+    void Aggregate(PWNBD_USR_STATS Stats);
+};
@@ -12,6 +12,8 @@
 #include <vector>
 
 #include <windows.h>
+#include <intrin.h>
+#include <immintrin.h>
 
 #include <boost/locale/encoding_utf.hpp>
 
@@ -138,3 +140,184 @@ bool EnsureWindowsVersionSupported()
     }
     return true;
 }
+
+PVOID AllocNumaBuffer(SIZE_T Size, DWORD NumaNode)
+{
+    PVOID Buffer = NULL;
+    if (NumaNode == NUMA_NO_PREFERRED_NODE) {
+        Buffer = VirtualAlloc(
+            NULL, Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    } else {
+        Buffer = VirtualAllocExNuma(
+            GetCurrentProcess(), NULL, Size, MEM_RESERVE | MEM_COMMIT,
+            PAGE_READWRITE, NumaNode);
+    }
+
+    if (!Buffer) {
+        DWORD Status = GetLastError();
+        LogError("Could not allocate %llu bytes on NUMA node %d. "
+                 "Error: %d. Error message: %s",
+                 Size, NumaNode, Status, win32_strerror(Status).c_str());
+    }
+    return Buffer;
+}
+
+void FreeNumaBuffer(PVOID Buffer)
+{
+    if (Buffer) {
+        VirtualFree(Buffer, 0, MEM_RELEASE);
+    }
+}
+
+DWORD GetNumaNodeAffinity(USHORT NumaNode, PGROUP_AFFINITY Affinity)
+{
+    if (!GetNumaNodeProcessorMaskEx(NumaNode, Affinity)) {
+        DWORD Status = GetLastError();
+        LogError("Could not retrieve the processors of NUMA node %d. "
+                 "Error: %d. Error message: %s",
+                 NumaNode, Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+    if (!Affinity->Mask) {
+        LogError("NUMA node %d has no processors.", NumaNode);
+        return ERROR_INVALID_PARAMETER;
+    }
+    return 0;
+}
+
+DWORD GetAffinityNumaNode(const GROUP_AFFINITY* Affinity, PUSHORT NumaNode)
+{
+    DWORD FirstProcessor = 0;
+    if (!BitScanForward64(&FirstProcessor, Affinity->Mask)) {
+        LogError("Empty processor affinity mask.");
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    PROCESSOR_NUMBER Processor = { 0 };
+    Processor.Group = Affinity->Group;
+    Processor.Number = (BYTE) FirstProcessor;
+    if (!GetNumaProcessorNodeEx(&Processor, NumaNode)) {
+        DWORD Status = GetLastError();
+        LogError("Could not retrieve the NUMA node of processor %d:%d. "
+                 "Error: %d. Error message: %s",
+                 Processor.Group, Processor.Number,
+                 Status, win32_strerror(Status).c_str());
+        return Status;
+    }
+    return 0;
+}
+
+DWORD EnableLockMemoryPrivilege()
+{
+    HANDLE Token = NULL;
+    if (!OpenProcessToken(
+            GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,
+            &Token)) {
+        return GetLastError();
+    }
+
+    DWORD Status = 0;
+    TOKEN_PRIVILEGES Privileges = { 0 };
+    Privileges.PrivilegeCount = 1;
+    Privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    if (!LookupPrivilegeValueA(
+            NULL, SE_LOCK_MEMORY_NAME, &Privileges.Privileges[0].Luid)) {
+        Status = GetLastError();
+    } else {
+        // Succeeds with ERROR_NOT_ALL_ASSIGNED if the privilege
+        // isn't held.
+        AdjustTokenPrivileges(Token, FALSE, &Privileges, 0, NULL, NULL);
+        Status = GetLastError();
+    }
+
+    CloseHandle(Token);
+    return Status;
+}
+
+bool IsAvx2Supported()
+{
+    int CpuInfo[4] = { 0 };
+    __cpuid(CpuInfo, 0);
+    if (CpuInfo[0] < 7) {
+        return false;
+    }
+
+    // OSXSAVE and AVX, then check that the OS saves the YMM registers.
+    __cpuid(CpuInfo, 1);
+    if ((CpuInfo[2] & (1 << 27 | 1 << 28)) != (1 << 27 | 1 << 28) ||
+            (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+
+    __cpuidex(CpuInfo, 7, 0);
+    return CpuInfo[1] & (1 << 5);
+}
+
+static bool IsZeroBufferAvx2(const BYTE* Buffer, SIZE_T Size)
+{
+    SIZE_T Offset = 0;
+    // Check 128B at a time, bailing out as soon as data is found.
+    for (; Offset + 128 <= Size; Offset += 128) {
+        const __m256i* Block = (const __m256i*) (Buffer + Offset);
+        __m256i Acc = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(Block),
+                            _mm256_loadu_si256(Block + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(Block + 2),
+                            _mm256_loadu_si256(Block + 3)));
+        if (!_mm256_testz_si256(Acc, Acc)) {
+            return false;
+        }
+    }
+    for (; Offset < Size; Offset++) {
+        if (Buffer[Offset]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IsZeroBuffer(const void* Buffer, SIZE_T Size)
+{
+    static const bool Avx2Supported = IsAvx2Supported();
+    const BYTE* Bytes = (const BYTE*) Buffer;
+    if (Avx2Supported) {
+        return IsZeroBufferAvx2(Bytes, Size);
+    }
+
+    SIZE_T Offset = 0;
+    for (; Offset + sizeof(UINT64) <= Size; Offset += sizeof(UINT64)) {
+        if (*(const UINT64*) (Bytes + Offset)) {
+            return false;
+        }
+    }
+    for (; Offset < Size; Offset++) {
+        if (Bytes[Offset]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+DWORD ReadFileExact(HANDLE File, UINT64 Offset, PVOID Buffer, DWORD Length)
+{
+    OVERLAPPED Overlapped = { 0 };
+    Overlapped.Offset = (DWORD) Offset;
+    Overlapped.OffsetHigh = (DWORD) (Offset >> 32);
+    DWORD BytesRead = 0;
+    if (!ReadFile(File, Buffer, Length, &BytesRead, &Overlapped)) {
+        return GetLastError();
+    }
+    return BytesRead == Length ? 0 : ERROR_HANDLE_EOF;
+}
+
+DWORD WriteFileExact(HANDLE File, UINT64 Offset, PVOID Buffer, DWORD Length)
+{
+    OVERLAPPED Overlapped = { 0 };
+    Overlapped.Offset = (DWORD) Offset;
+    Overlapped.OffsetHigh = (DWORD) (Offset >> 32);
+    DWORD BytesWritten = 0;
+    if (!WriteFile(File, Buffer, Length, &BytesWritten, &Overlapped)) {
+        return GetLastError();
+    }
+    return BytesWritten == Length ? 0 : ERROR_WRITE_FAULT;
+}
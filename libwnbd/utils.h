@@ -19,3 +19,29 @@ std::string guid_to_string(GUID guid);
 std::optional<_OSVERSIONINFOEXW> GetWinVersion();
 bool CheckWindowsVersion(DWORD Major, DWORD Minor, DWORD BuildNumber);
 bool EnsureWindowsVersionSupported();
+
+// Allocate memory on the specified NUMA node, using the default
+// placement if NumaNode is NUMA_NO_PREFERRED_NODE. The memory is
+// committed but physical pages are only assigned when first touched.
+// Returns NULL on failure. Use FreeNumaBuffer to release the memory.
+PVOID AllocNumaBuffer(SIZE_T Size, DWORD NumaNode);
+void FreeNumaBuffer(PVOID Buffer);
+
+// Retrieve the processors that belong to the specified NUMA node.
+DWORD GetNumaNodeAffinity(USHORT NumaNode, PGROUP_AFFINITY Affinity);
+// Retrieve the NUMA node of the first processor from the specified set.
+DWORD GetAffinityNumaNode(const GROUP_AFFINITY* Affinity, PUSHORT NumaNode);
+
+// Enable SeLockMemoryPrivilege, required for large page allocations.
+// The privilege must be assigned to the user.
+DWORD EnableLockMemoryPrivilege();
+
+// Checks that both the processor and the OS support AVX2.
+bool IsAvx2Supported();
+// Check if the buffer only contains zeroes, using AVX2 if available.
+bool IsZeroBuffer(const void* Buffer, SIZE_T Size);
+
+// Synchronous positional IO, failing if fewer bytes are transferred.
+// The file must not be opened using FILE_FLAG_OVERLAPPED.
+DWORD ReadFileExact(HANDLE File, UINT64 Offset, PVOID Buffer, DWORD Length);
+DWORD WriteFileExact(HANDLE File, UINT64 Offset, PVOID Buffer, DWORD Length);
@@ -835,6 +835,36 @@ Exit:
     return Status;
 }
 
+// Event used by synchronous IOCTLs, cached per thread in order to avoid
+// creating and closing a kernel event for every request.
+class ThreadIoctlEvent
+{
+private:
+    HANDLE Event = NULL;
+
+public:
+    ~ThreadIoctlEvent()
+    {
+        if (Event) {
+            CloseHandle(Event);
+        }
+    }
+
+    // Returns NULL if the event could not be created.
+    HANDLE Get()
+    {
+        if (!Event) {
+            // Manual reset event, as recommended by the GetOverlappedResult
+            // docs. The event is reset by DeviceIoControl before starting
+            // the operation, so it's safe to reuse it.
+            Event = CreateEventA(0, TRUE, FALSE, NULL);
+        }
+        return Event;
+    }
+};
+
+static thread_local ThreadIoctlEvent CachedIoctlEvent;
+
 DWORD WnbdDeviceIoControl(
     HANDLE hDevice,
     DWORD dwIoControlCode,
@@ -847,22 +877,26 @@ DWORD WnbdDeviceIoControl(
 {
     OVERLAPPED InternalOverlapped = { 0 };
     DWORD Status = ERROR_SUCCESS;
-    HANDLE TempEvent = NULL;
+    BOOLEAN InternalWait = FALSE;
 
     // DeviceIoControl can hang when FILE_FLAG_OVERLAPPED is used
     // without a valid overlapped structure. We're providing one and also
     // do the wait on behalf of the caller when lpOverlapped is NULL,
     // mimicking the Windows API.
     if (!lpOverlapped) {
-        TempEvent = CreateEventA(0, FALSE, FALSE, NULL);
-        if (!TempEvent) {
+        HANDLE Event = CachedIoctlEvent.Get();
+        if (!Event) {
             Status = GetLastError();
             LogError("Could not create event. Error: %d. Error message: %s",
                      Status, win32_strerror(Status).c_str());
             return Status;
         }
-        InternalOverlapped.hEvent = TempEvent;
+        // Setting the low-order bit prevents the completion from being
+        // queued if the handle is associated with a completion port
+        // (see WnbdSetCompletionPort).
+        InternalOverlapped.hEvent = (HANDLE)((ULONG_PTR)Event | 1);
         lpOverlapped = &InternalOverlapped;
+        InternalWait = TRUE;
     }
 
     BOOL DevStatus = DeviceIoControl(
@@ -870,7 +904,7 @@ DWORD WnbdDeviceIoControl(
         nOutBufferSize, lpBytesReturned, lpOverlapped);
     if (!DevStatus) {
         Status = GetLastError();
-        if (Status == ERROR_IO_PENDING && TempEvent) {
+        if (Status == ERROR_IO_PENDING && InternalWait) {
             // We might consider an alertable wait using GetOverlappedResultEx.
             if (!GetOverlappedResult(hDevice, lpOverlapped,
                                      lpBytesReturned, TRUE)) {
@@ -883,10 +917,6 @@ DWORD WnbdDeviceIoControl(
         }
     }
 
-    if (TempEvent) {
-        CloseHandle(TempEvent);
-    }
-
     return Status;
 }
 
@@ -983,6 +1013,21 @@ DWORD WnbdIoctlFetchRequest(
     PVOID DataBuffer,
     UINT32 DataBufferSize,
     LPOVERLAPPED Overlapped)
+{
+    return WnbdIoctlFetchRequestEx(
+        Adapter, ConnectionId, Request, DataBuffer, DataBufferSize,
+        0, Overlapped);
+}
+
+static DWORD FetchRequestCommand(
+    HANDLE Adapter,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IO_REQUEST Request,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    UINT32 TimeoutMs,
+    BOOLEAN NoWait,
+    LPOVERLAPPED Overlapped)
 {
     DWORD Status = ERROR_SUCCESS;
 
@@ -993,6 +1038,8 @@ DWORD WnbdIoctlFetchRequest(
     Command.ConnectionId = ConnectionId;
     Command.DataBuffer = DataBuffer;
     Command.DataBufferSize = DataBufferSize;
+    Command.TimeoutMs = TimeoutMs;
+    Command.NoWait = NoWait;
 
     Status = WnbdDeviceIoControl(
         Adapter, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
@@ -1000,7 +1047,8 @@ DWORD WnbdIoctlFetchRequest(
         &Command, sizeof(WNBD_IOCTL_FETCH_REQ_COMMAND),
         &BytesReturned, Overlapped);
 
-    if (Status && !(Status == ERROR_IO_PENDING && Overlapped)) {
+    if (Status && !(Status == ERROR_IO_PENDING && Overlapped) &&
+            !(Status == ERROR_SEM_TIMEOUT && (TimeoutMs || NoWait))) {
         LogWarning(
             "Could not fetch request. Error: %d. "
             "Buffer: %p, buffer size: %d, connection id: %llu. "
@@ -1015,6 +1063,70 @@ DWORD WnbdIoctlFetchRequest(
     return Status;
 }
 
+DWORD WnbdIoctlFetchRequestEx(
+    HANDLE Adapter,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IO_REQUEST Request,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    UINT32 TimeoutMs,
+    LPOVERLAPPED Overlapped)
+{
+    return FetchRequestCommand(
+        Adapter, ConnectionId, Request, DataBuffer, DataBufferSize,
+        TimeoutMs, FALSE, Overlapped);
+}
+
+DWORD WnbdIoctlPollRequest(
+    HANDLE Adapter,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IO_REQUEST Request,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    LPOVERLAPPED Overlapped)
+{
+    return FetchRequestCommand(
+        Adapter, ConnectionId, Request, DataBuffer, DataBufferSize,
+        0, TRUE, Overlapped);
+}
+
+DWORD WnbdIoctlQueueFetchRequest(
+    HANDLE Adapter,
+    WNBD_CONNECTION_ID ConnectionId,
+    PWNBD_IOCTL_FETCH_REQ_COMMAND Command,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize,
+    LPOVERLAPPED Overlapped)
+{
+    if (!Overlapped) {
+        LogError("Queued fetch requests require an overlapped structure.");
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    memset(Command, 0, sizeof(WNBD_IOCTL_FETCH_REQ_COMMAND));
+    Command->IoControlCode = IOCTL_WNBD_FETCH_REQ;
+    Command->ConnectionId = ConnectionId;
+    Command->DataBuffer = DataBuffer;
+    Command->DataBufferSize = DataBufferSize;
+    Command->Pendable = TRUE;
+
+    DWORD BytesReturned = 0;
+    DWORD Status = WnbdDeviceIoControl(
+        Adapter, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        Command, sizeof(WNBD_IOCTL_FETCH_REQ_COMMAND),
+        Command, sizeof(WNBD_IOCTL_FETCH_REQ_COMMAND),
+        &BytesReturned, Overlapped);
+    if (Status && Status != ERROR_IO_PENDING) {
+        LogWarning(
+            "Could not queue fetch request. Error: %d. "
+            "Buffer: %p, buffer size: %d, connection id: %llu. "
+            "Error message: %s",
+            Status, DataBuffer, DataBufferSize, ConnectionId,
+            win32_strerror(Status).c_str());
+    }
+    return Status;
+}
+
 DWORD WnbdIoctlSendResponse(
     HANDLE Adapter,
     WNBD_CONNECTION_ID ConnectionId,
@@ -1079,6 +1191,39 @@ DWORD WnbdIoctlSetDiskSize(
     return Status;
 }
 
+DWORD WnbdIoctlSetQosLimits(
+    HANDLE Adapter,
+    const char* InstanceName,
+    PWNBD_QOS_LIMITS Limits,
+    LPOVERLAPPED Overlapped)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    WNBD_IOCTL_SET_QOS_LIMITS_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_SET_QOS_LIMITS;
+    memcpy(Command.InstanceName, InstanceName, strlen(InstanceName));
+    Command.Limits = *Limits;
+
+    Status = WnbdDeviceIoControl(
+        Adapter, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command), NULL, 0,
+        &BytesReturned, Overlapped);
+
+    if (Status && !(Status == ERROR_IO_PENDING && Overlapped)) {
+        if (Status == ERROR_FILE_NOT_FOUND) {
+            LogInfo("Could not find the specified disk.");
+        }
+        else {
+            LogError("Could not set disk QoS limits. "
+                     "Error: %d. Error message: %s",
+                     Status, win32_strerror(Status).c_str());
+        }
+    }
+
+    return Status;
+}
+
 DWORD WnbdIoctlList(
     HANDLE Adapter,
     PWNBD_CONNECTION_LIST ConnectionList,
@@ -1132,6 +1277,38 @@ DWORD WnbdIoctlStats(
     return Status;
 }
 
+DWORD WnbdIoctlLatencyStats(
+    HANDLE Adapter,
+    const char* InstanceName,
+    PWNBD_LATENCY_STATS Stats,
+    LPOVERLAPPED Overlapped)
+{
+    DWORD Status = ERROR_SUCCESS;
+    DWORD BytesReturned = 0;
+
+    WNBD_IOCTL_LATENCY_STATS_COMMAND Command = { 0 };
+    Command.IoControlCode = IOCTL_WNBD_LATENCY_STATS;
+    memcpy(Command.InstanceName, InstanceName, strlen(InstanceName));
+
+    Status = WnbdDeviceIoControl(
+        Adapter, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Command, sizeof(Command),
+        Stats, sizeof(WNBD_LATENCY_STATS), &BytesReturned, Overlapped);
+
+    if (Status && !(Status == ERROR_IO_PENDING && Overlapped)) {
+        if (Status == ERROR_FILE_NOT_FOUND) {
+            LogInfo("Could not find the specified disk.");
+        }
+        else {
+            LogError("Could not get disk latency stats. "
+                     "Error: %d. Error message: %s",
+                     Status, win32_strerror(Status).c_str());
+        }
+    }
+
+    return Status;
+}
+
 DWORD WnbdIoctlShow(
     HANDLE Adapter,
     const char* InstanceName,
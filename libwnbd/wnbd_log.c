@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 
+#include "async_log.h"
 #include "wnbd_log.h"
 #include "wnbd.h"
 
@@ -17,14 +18,17 @@ VOID ConsoleLogger(
     const char* FunctionName)
 {
     SYSTEMTIME T;
-    GetLocalTime(&T);
+    GetLogMessageTime(&T);
     fprintf(stderr, "%02d:%02d:%02d.%03d libwnbd.dll!%s %s %s\n",
             T.wHour, T.wMinute, T.wSecond, T.wMilliseconds,
             FunctionName, WnbdLogLevelToStr(LogLevel), Message);
 }
 
-static LogMessageFunc WnbdCurrLogger = ConsoleLogger;
-static WnbdLogLevel WnbdCurrLogLevel = WnbdLogLevelWarning;
+LogMessageFunc WnbdCurrLogger = ConsoleLogger;
+WnbdLogLevel WnbdCurrLogLevel = WnbdLogLevelWarning;
+
+// Avoids heap allocations, longer messages are truncated.
+static __declspec(thread) char LogBuffer[WNBD_LOG_MESSAGE_MAX_SIZE];
 
 VOID LogMessage(WnbdLogLevel LogLevel,
                 const char* FileName, UINT32 Line, const char* FunctionName,
@@ -38,23 +42,15 @@ VOID LogMessage(WnbdLogLevel LogLevel,
 
     va_list Args;
     va_start(Args, Format);
-
-    size_t BufferLength = (size_t)_vscprintf(Format, Args) + 1;
-
-    // TODO: consider enforcing WNBD_LOG_MESSAGE_MAX_SIZE and using a fixed
-    // size buffer for performance reasons.
-    char* Buff = (char*) malloc(BufferLength);
-    if (!Buff) {
+    if (AsyncLogMessage(LogLevel, FileName, Line, FunctionName,
+                        Format, Args)) {
         va_end(Args);
         return;
     }
-
-    vsnprintf_s(Buff, BufferLength, BufferLength - 1, Format, Args);
+    vsnprintf_s(LogBuffer, sizeof(LogBuffer), _TRUNCATE, Format, Args);
     va_end(Args);
 
-    CurrLogger(LogLevel, Buff, FileName, Line, FunctionName);
-
-    free(Buff);
+    CurrLogger(LogLevel, LogBuffer, FileName, Line, FunctionName);
 }
 
 VOID WnbdSetLogger(LogMessageFunc Logger)
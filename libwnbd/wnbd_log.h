@@ -12,6 +12,21 @@
 extern "C" {
 #endif
 
+// Log messages that are more verbose than the following level are
+// removed at compile time, along with their arguments. Can be lowered
+// to WnbdLogLevelInfo in order to drop the per-IO debug messages.
+#ifndef WNBD_COMPILE_TIME_LOG_LEVEL
+#define WNBD_COMPILE_TIME_LOG_LEVEL WnbdLogLevelTrace
+#endif
+
+extern LogMessageFunc WnbdCurrLogger;
+extern WnbdLogLevel WnbdCurrLogLevel;
+
+static inline BOOLEAN LogLevelEnabled(WnbdLogLevel LogLevel)
+{
+    return WnbdCurrLogger && WnbdCurrLogLevel >= LogLevel;
+}
+
 VOID ConsoleLogger(
     WnbdLogLevel LogLevel,
     const char* Message,
@@ -19,6 +34,8 @@ VOID ConsoleLogger(
     UINT32 Line,
     const char* FunctionName);
 
+// Prefer the macros below, which check the log level before evaluating
+// the message arguments.
 VOID LogMessage(
     WnbdLogLevel LogLevel,
     const char* FileName,
@@ -26,24 +43,27 @@ VOID LogMessage(
     const char* FunctionName,
     const char* Format, ...);
 
+#define LogWithLevel(LogLevel, Format, ...) \
+    do { \
+        if ((LogLevel) <= WNBD_COMPILE_TIME_LOG_LEVEL && \
+                LogLevelEnabled(LogLevel)) { \
+            LogMessage(LogLevel, __FILE__, __LINE__, __FUNCTION__, \
+                       Format, __VA_ARGS__); \
+        } \
+    } while (0)
+
 #define LogCritical(Format, ...) \
-    LogMessage(WnbdLogLevelCritical, \
-               __FILE__, __LINE__, __FUNCTION__, Format, __VA_ARGS__)
+    LogWithLevel(WnbdLogLevelCritical, Format, __VA_ARGS__)
 #define LogError(Format, ...) \
-    LogMessage(WnbdLogLevelError, \
-               __FILE__, __LINE__, __FUNCTION__, Format, __VA_ARGS__)
+    LogWithLevel(WnbdLogLevelError, Format, __VA_ARGS__)
 #define LogWarning(Format, ...) \
-    LogMessage(WnbdLogLevelWarning, \
-               __FILE__, __LINE__, __FUNCTION__, Format, __VA_ARGS__)
+    LogWithLevel(WnbdLogLevelWarning, Format, __VA_ARGS__)
 #define LogInfo(Format, ...) \
-    LogMessage(WnbdLogLevelInfo, \
-               __FILE__, __LINE__, __FUNCTION__, Format, __VA_ARGS__)
+    LogWithLevel(WnbdLogLevelInfo, Format, __VA_ARGS__)
 #define LogDebug(Format, ...) \
-    LogMessage(WnbdLogLevelDebug, \
-               __FILE__, __LINE__, __FUNCTION__, Format, __VA_ARGS__)
+    LogWithLevel(WnbdLogLevelDebug, Format, __VA_ARGS__)
 #define LogTrace(Format, ...) \
-    LogMessage(WnbdLogLevelTrace, \
-               __FILE__, __LINE__, __FUNCTION__, Format, __VA_ARGS__)
+    LogWithLevel(WnbdLogLevelTrace, Format, __VA_ARGS__)
 
 #ifdef __cplusplus
 }
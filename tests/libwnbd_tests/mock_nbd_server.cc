@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "pch.h"
+
+#include <chrono>
+#include <utility>
+
+#include "mock_nbd_server.h"
+#include "utils.h"
+
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_REPLY_MAGIC 0x67446698
+#define NBD_CMD_FLAG_FUA (1 << 16)
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_TRIM 4
+
+#define NBD_EIO 5
+#define NBD_EINVAL 22
+
+#pragma pack(push, 1)
+typedef struct {
+    UINT32 Magic;
+    UINT32 Type;
+    UINT64 Handle;
+    UINT64 From;
+    UINT32 Length;
+} MOCK_NBD_REQUEST;
+
+typedef struct {
+    UINT32 Magic;
+    UINT32 Error;
+    UINT64 Handle;
+} MOCK_NBD_REPLY;
+#pragma pack(pop)
+
+static bool RecvExact(SOCKET Socket, PVOID Buffer, size_t Length)
+{
+    while (Length) {
+        int Received = recv(Socket, (char*) Buffer, (int) Length, 0);
+        if (Received <= 0) {
+            return false;
+        }
+        Buffer = (PBYTE) Buffer + Received;
+        Length -= Received;
+    }
+    return true;
+}
+
+static bool SendExact(SOCKET Socket, PVOID Buffer, size_t Length)
+{
+    while (Length) {
+        int Sent = send(Socket, (const char*) Buffer, (int) Length, 0);
+        if (Sent <= 0) {
+            return false;
+        }
+        Buffer = (PBYTE) Buffer + Sent;
+        Length -= Sent;
+    }
+    return true;
+}
+
+MockNbdServer::~MockNbdServer()
+{
+    Stop();
+}
+
+void MockNbdServer::Start()
+{
+    ListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    ASSERT_NE(INVALID_SOCKET, ListenSocket)
+        << "couldn't create socket: " << WinStrError(WSAGetLastError());
+
+    sockaddr_in Address = { 0 };
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int AddressLength = sizeof(Address);
+    ASSERT_FALSE(bind(ListenSocket, (sockaddr*) &Address, sizeof(Address)))
+        << "couldn't bind socket: " << WinStrError(WSAGetLastError());
+    ASSERT_FALSE(getsockname(
+        ListenSocket, (sockaddr*) &Address, &AddressLength))
+        << "couldn't retrieve socket address: "
+        << WinStrError(WSAGetLastError());
+    ASSERT_FALSE(listen(ListenSocket, 1))
+        << "couldn't listen: " << WinStrError(WSAGetLastError());
+    Port = ntohs(Address.sin_port);
+
+    ServerThread = std::thread(&MockNbdServer::Serve, this);
+}
+
+void MockNbdServer::Stop()
+{
+    SOCKET Socket = INVALID_SOCKET;
+    {
+        std::unique_lock Guard{Lock};
+        Stopping = true;
+        Socket = std::exchange(ClientSocket, INVALID_SOCKET);
+        Cond.notify_all();
+    }
+    // Unblocks the server thread.
+    if (ListenSocket != INVALID_SOCKET) {
+        closesocket(ListenSocket);
+        ListenSocket = INVALID_SOCKET;
+    }
+    if (Socket != INVALID_SOCKET) {
+        closesocket(Socket);
+    }
+    if (ServerThread.joinable()) {
+        ServerThread.join();
+    }
+}
+
+void MockNbdServer::GetConnectionProperties(
+    PNBD_CONNECTION_PROPERTIES Connection)
+{
+    *Connection = { 0 };
+    strncpy_s(Connection->Hostname, "127.0.0.1", _TRUNCATE);
+    Connection->PortNumber = Port;
+    Connection->Flags.SkipNegotiation = 1;
+}
+
+void MockNbdServer::FailRequests(WnbdRequestType RequestType, UINT32 Count)
+{
+    std::unique_lock Guard{Lock};
+    FailType = RequestType;
+    FailCount = Count;
+}
+
+void MockNbdServer::Pause()
+{
+    std::unique_lock Guard{Lock};
+    Paused = true;
+}
+
+void MockNbdServer::Resume()
+{
+    std::unique_lock Guard{Lock};
+    Paused = false;
+    Cond.notify_all();
+}
+
+bool MockNbdServer::WaitRequests(size_t Count, DWORD TimeoutMs)
+{
+    std::unique_lock Guard{Lock};
+    return Cond.wait_for(
+        Guard, std::chrono::milliseconds(TimeoutMs),
+        [&] { return Requests.size() >= Count; });
+}
+
+std::vector<MockNbdRequest> MockNbdServer::GetRequests()
+{
+    std::unique_lock Guard{Lock};
+    return Requests;
+}
+
+void MockNbdServer::ReadData(PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    std::unique_lock Guard{Lock};
+    memcpy(Buffer, Data.data() + Offset, Length);
+}
+
+void MockNbdServer::WriteData(PVOID Buffer, UINT64 Offset, UINT32 Length)
+{
+    std::unique_lock Guard{Lock};
+    memcpy(Data.data() + Offset, Buffer, Length);
+}
+
+void MockNbdServer::Serve()
+{
+    while (true) {
+        SOCKET Socket = accept(ListenSocket, NULL, NULL);
+        {
+            std::unique_lock Guard{Lock};
+            if (Socket == INVALID_SOCKET || Stopping) {
+                if (Socket != INVALID_SOCKET) {
+                    closesocket(Socket);
+                }
+                return;
+            }
+            ClientSocket = Socket;
+        }
+
+        BOOL NoDelay = TRUE;
+        setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY,
+                   (const char*) &NoDelay, sizeof(NoDelay));
+        while (HandleRequest(Socket)) {
+        }
+
+        // Unless already closed by Stop.
+        std::unique_lock Guard{Lock};
+        if (ClientSocket == Socket) {
+            ClientSocket = INVALID_SOCKET;
+            closesocket(Socket);
+        }
+    }
+}
+
+bool MockNbdServer::HandleRequest(SOCKET Socket)
+{
+    MOCK_NBD_REQUEST Request = { 0 };
+    if (!RecvExact(Socket, &Request, sizeof(Request)) ||
+            _byteswap_ulong(Request.Magic) != NBD_REQUEST_MAGIC) {
+        return false;
+    }
+
+    UINT32 Type = _byteswap_ulong(Request.Type);
+    MockNbdRequest Received = { WnbdReqTypeUnknown };
+    Received.Offset = _byteswap_uint64(Request.From);
+    Received.Length = _byteswap_ulong(Request.Length);
+    Received.ForceUnitAccess = !!(Type & NBD_CMD_FLAG_FUA);
+    switch (Type & 0xffff) {
+    case NBD_CMD_READ:
+        Received.RequestType = WnbdReqTypeRead;
+        break;
+    case NBD_CMD_WRITE:
+        Received.RequestType = WnbdReqTypeWrite;
+        break;
+    case NBD_CMD_FLUSH:
+        Received.RequestType = WnbdReqTypeFlush;
+        break;
+    case NBD_CMD_TRIM:
+        Received.RequestType = WnbdReqTypeUnmap;
+        break;
+    case NBD_CMD_DISC:
+    default:
+        return false;
+    }
+
+    std::vector<BYTE> Payload;
+    if (Received.RequestType == WnbdReqTypeWrite) {
+        Payload.resize(Received.Length);
+        if (!RecvExact(Socket, Payload.data(), Payload.size())) {
+            return false;
+        }
+    }
+
+    MOCK_NBD_REPLY Reply = { 0 };
+    Reply.Magic = _byteswap_ulong(NBD_REPLY_MAGIC);
+    Reply.Handle = Request.Handle;
+    {
+        std::unique_lock Guard{Lock};
+        Cond.wait(Guard, [&] { return !Paused || Stopping; });
+        if (Stopping) {
+            return false;
+        }
+
+        if (Received.RequestType != WnbdReqTypeFlush &&
+                Received.Offset + Received.Length > Data.size()) {
+            Received.Failed = true;
+            Reply.Error = _byteswap_ulong(NBD_EINVAL);
+        } else if (FailCount && FailType == Received.RequestType) {
+            FailCount--;
+            Received.Failed = true;
+            Reply.Error = _byteswap_ulong(NBD_EIO);
+        }
+
+        if (!Received.Failed) {
+            switch (Received.RequestType) {
+            case WnbdReqTypeRead:
+                Payload.assign(
+                    Data.begin() + Received.Offset,
+                    Data.begin() + Received.Offset + Received.Length);
+                break;
+            case WnbdReqTypeWrite:
+                memcpy(Data.data() + Received.Offset,
+                       Payload.data(), Received.Length);
+                break;
+            case WnbdReqTypeUnmap:
+                memset(Data.data() + Received.Offset, 0, Received.Length);
+                break;
+            }
+        }
+        Requests.push_back(Received);
+        Cond.notify_all();
+    }
+
+    if (!SendExact(Socket, &Reply, sizeof(Reply))) {
+        return false;
+    }
+    if (Received.RequestType == WnbdReqTypeRead && !Received.Failed) {
+        return SendExact(Socket, Payload.data(), Payload.size());
+    }
+    return true;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct MockNbdRequest
+{
+    WnbdRequestType RequestType;
+    UINT64 Offset;
+    UINT32 Length;
+    bool ForceUnitAccess;
+    bool Failed;
+};
+
+// In-memory NBD server, used as export by the tests covering the NBD
+// based backends (e.g. stripe and mirror disks).
+//
+// Only the transmission phase is implemented, so the clients must skip
+// the NBD negotiation, the export size and capabilities being passed
+// through the disk properties. Connections are accepted one at a time,
+// allowing the clients to reconnect, the requests being handled
+// sequentially.
+class MockNbdServer
+{
+public:
+    MockNbdServer(UINT64 Size) : Data((size_t) Size) {}
+    ~MockNbdServer();
+
+    // Listens on a random localhost port.
+    void Start();
+    void Stop();
+
+    void GetConnectionProperties(PNBD_CONNECTION_PROPERTIES Connection);
+
+    // The next "Count" requests of the specified type are failed.
+    void FailRequests(WnbdRequestType RequestType, UINT32 Count);
+    // Received requests aren't handled (or replied to) while paused.
+    void Pause();
+    void Resume();
+
+    // Waits for the specified number of requests to be handled.
+    bool WaitRequests(size_t Count, DWORD TimeoutMs = 10000);
+    std::vector<MockNbdRequest> GetRequests();
+
+    // Direct access to the export data.
+    void ReadData(PVOID Buffer, UINT64 Offset, UINT32 Length);
+    void WriteData(PVOID Buffer, UINT64 Offset, UINT32 Length);
+
+private:
+    std::vector<BYTE> Data;
+    SOCKET ListenSocket = INVALID_SOCKET;
+    SOCKET ClientSocket = INVALID_SOCKET;
+    UINT16 Port = 0;
+    std::thread ServerThread;
+
+    std::mutex Lock;
+    std::condition_variable Cond;
+    bool Paused = false;
+    bool Stopping = false;
+    WnbdRequestType FailType = WnbdReqTypeUnknown;
+    UINT32 FailCount = 0;
+    std::vector<MockNbdRequest> Requests;
+
+    void Serve();
+    // Returns false once the connection is closed.
+    bool HandleRequest(SOCKET Socket);
+};
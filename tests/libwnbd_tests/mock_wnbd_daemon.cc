@@ -29,7 +29,7 @@ void MockWnbdDaemon::Start()
 
     Started = true;
 
-    err = WnbdStartDispatcher(WnbdDisk, IO_REQ_WORKERS);
+    err = WnbdStartDispatcherEx(WnbdDisk, &DispatcherOptions);
     ASSERT_FALSE(err) << "WnbdStartDispatcher failed";
 
     if (!WnbdProps->Flags.ReadOnly) {
@@ -76,6 +76,14 @@ void MockWnbdDaemon::Read(
     ASSERT_TRUE(handler->WnbdProps->BlockSize * BlockCount
         <= WNBD_DEFAULT_MAX_TRANSFER_LENGTH);
 
+    if (handler->NullBackend) {
+        handler->SendIoResponse(
+            RequestHandle, WnbdReqTypeRead,
+            handler->MockStatus,
+            Buffer, handler->WnbdProps->BlockSize * BlockCount);
+        return;
+    }
+
     WnbdRequestType RequestType = WnbdReqTypeRead;
     WNBD_IO_REQUEST WnbdReq = { 0 };
     WnbdReq.RequestType = RequestType;
@@ -86,6 +94,11 @@ void MockWnbdDaemon::Read(
 
     handler->ReqLog.AddEntry(WnbdReq);
 
+    if (handler->LeaseBuffers) {
+        ASSERT_FALSE(WnbdLeaseRequestBuffer(Disk, RequestHandle, Buffer))
+            << "couldn't lease request buffer";
+    }
+
     if (Disk->Properties.BlockCount < BlockAddress + BlockCount) {
         // Overflow
         WnbdSetSense(
@@ -117,6 +130,13 @@ void MockWnbdDaemon::Write(
     ASSERT_TRUE(handler->WnbdProps->BlockSize * BlockCount
         <= WNBD_DEFAULT_MAX_TRANSFER_LENGTH);
 
+    if (handler->NullBackend) {
+        handler->SendIoResponse(
+            RequestHandle, WnbdReqTypeWrite,
+            handler->MockStatus, NULL, 0);
+        return;
+    }
+
     WnbdRequestType RequestType = WnbdReqTypeWrite;
     WNBD_IO_REQUEST WnbdReq = { 0 };
     WnbdReq.RequestType = RequestType;
@@ -127,6 +147,11 @@ void MockWnbdDaemon::Write(
 
     handler->ReqLog.AddEntry(WnbdReq, Buffer, BlockCount * handler->WnbdProps->BlockSize);
 
+    if (handler->LeaseBuffers) {
+        ASSERT_FALSE(WnbdLeaseRequestBuffer(Disk, RequestHandle, Buffer))
+            << "couldn't lease request buffer";
+    }
+
     WNBD_STATUS Status = handler->MockStatus;
 
     if (Disk->Properties.BlockCount < BlockAddress + BlockCount) {
@@ -38,6 +38,23 @@ public:
         MockStatus = Status;
     }
 
+    // Lease the read/write request buffers, which are released
+    // when sending the IO response.
+    void SetLeaseBuffers(bool _LeaseBuffers) {
+        LeaseBuffers = _LeaseBuffers;
+    }
+
+    // Complete read/write requests right away, without logging the
+    // requests or touching the data buffers. Used for benchmarks.
+    void SetNullBackend(bool _NullBackend) {
+        NullBackend = _NullBackend;
+    }
+
+    // Must be called before starting the daemon.
+    void SetDispatcherOptions(WNBD_DISPATCHER_OPTIONS& Options) {
+        DispatcherOptions = Options;
+    }
+
     RequestLog ReqLog;
 
 private:
@@ -47,6 +64,10 @@ private:
     PWNBD_DISK WnbdDisk = nullptr;
 
     WNBD_STATUS MockStatus = { 0 };
+    bool LeaseBuffers = false;
+    bool NullBackend = false;
+    WNBD_DISPATCHER_OPTIONS DispatcherOptions = {
+        WnbdDispatcherModeThreaded, IO_REQ_WORKERS };
 
     std::mutex ShutdownLock;
 
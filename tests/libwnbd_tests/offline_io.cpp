@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "pch.h"
+#include "offline_io.h"
+#include "utils.h"
+
+#include <chrono>
+#include <random>
+
+WNBD_IO_RESPONSE OfflineResponses::WaitResponse(UINT64 RequestHandle)
+{
+    WNBD_IO_RESPONSE Response = { 0 };
+    auto Find = [&] {
+        for (const WNBD_IO_RESPONSE& Received : Responses) {
+            if (Received.RequestHandle == RequestHandle) {
+                Response = Received;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::unique_lock Guard{Lock};
+    if (!Cond.wait_for(Guard, std::chrono::seconds(10), Find)) {
+        ADD_FAILURE() << "timed out waiting for response: "
+                      << RequestHandle;
+        Response.RequestHandle = RequestHandle;
+        Response.Status.ScsiStatus = SCSISTAT_CHECK_CONDITION;
+    }
+    return Response;
+}
+
+VOID RecordOfflineResponse(
+    PVOID ResponseContext,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize)
+{
+    OfflineResponses* Received = (OfflineResponses*) ResponseContext;
+    std::unique_lock Guard{Received->Lock};
+    Received->Responses.push_back(*Response);
+    Received->DataSizes.push_back(DataBuffer ? DataBufferSize : 0);
+    Received->Cond.notify_all();
+}
+
+void SubmitSequentialIo(
+    PWNBD_DISK Disk,
+    OfflineResponses* Received,
+    WnbdRequestType RequestType,
+    PBYTE Buffers,
+    UINT32 IoSize,
+    UINT32 QueueDepth,
+    UINT64 TotalSize)
+{
+    size_t RequestCount = (size_t) (TotalSize / IoSize);
+    for (size_t Idx = 0; Idx < RequestCount; Idx++) {
+        if (Idx >= QueueDepth) {
+            Received->WaitResponse(Idx - QueueDepth + 1);
+        }
+        WNBD_IO_REQUEST Request = { 0 };
+        Request.RequestHandle = Idx + 1;
+        Request.RequestType = RequestType;
+        // The read and write commands share the same layout.
+        Request.Cmd.Write.BlockAddress = Idx * IoSize / DefaultBlockSize;
+        Request.Cmd.Write.BlockCount = IoSize / DefaultBlockSize;
+        ASSERT_FALSE(WnbdSubmitRequest(
+            Disk, &Request, Buffers + (Idx % QueueDepth) * IoSize));
+    }
+    // The responses may be sent out of order.
+    for (size_t Idx = RequestCount > QueueDepth ?
+            RequestCount - QueueDepth : 0; Idx < RequestCount; Idx++) {
+        Received->WaitResponse(Idx + 1);
+    }
+
+    std::unique_lock Guard{Received->Lock};
+    for (const WNBD_IO_RESPONSE& Response : Received->Responses) {
+        EXPECT_FALSE(Response.Status.ScsiStatus)
+            << "request failed: " << Response.RequestHandle;
+    }
+    Received->Responses.clear();
+    Received->DataSizes.clear();
+}
+
+void FillCompressible(PBYTE Buffer, size_t Size, UINT32 Seed)
+{
+    std::minstd_rand Generator(Seed);
+    for (size_t Idx = 0; Idx < Size; Idx++) {
+        Buffer[Idx] = (BYTE) ('a' + Generator() % 16);
+    }
+}
+
+void FillRandom(PBYTE Buffer, size_t Size, UINT32 Seed)
+{
+    std::minstd_rand Generator(Seed);
+    for (size_t Idx = 0; Idx < Size; Idx++) {
+        Buffer[Idx] = (BYTE) (Generator() >> 8);
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// Helpers shared by the offline disk tests and benchmarks.
+
+// Responses of offline disks. Depending on the backend, the responses
+// may be sent by other threads (e.g. the IO completion threads).
+struct OfflineResponses
+{
+    std::mutex Lock;
+    std::condition_variable Cond;
+    std::vector<WNBD_IO_RESPONSE> Responses;
+    std::vector<UINT32> DataSizes;
+
+    // Returns a failed response on timeout.
+    WNBD_IO_RESPONSE WaitResponse(UINT64 RequestHandle);
+};
+
+// Offline response callback, the context must point to an
+// OfflineResponses instance.
+VOID RecordOfflineResponse(
+    PVOID ResponseContext,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize);
+
+// Submits sequential requests covering "TotalSize" bytes, keeping up
+// to "QueueDepth" requests in flight. Each slot has its own buffer.
+void SubmitSequentialIo(
+    PWNBD_DISK Disk,
+    OfflineResponses* Received,
+    WnbdRequestType RequestType,
+    PBYTE Buffers,
+    UINT32 IoSize,
+    UINT32 QueueDepth,
+    UINT64 TotalSize);
+
+// Text-like data, using a 16 letter alphabet, which roughly compresses
+// by half.
+void FillCompressible(PBYTE Buffer, size_t Size, UINT32 Seed);
+void FillRandom(PBYTE Buffer, size_t Size, UINT32 Seed);
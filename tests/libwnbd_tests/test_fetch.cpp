@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "pch.h"
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <wnbd_fetch.h>
+
+class TestFetch : public ::testing::Test
+{
+protected:
+    WNBD_FETCH_RING Ring = { 0 };
+    std::vector<WNBD_FETCH_SLOT_STATE> Slots;
+
+    void Initialize(UINT32 SlotCount)
+    {
+        WnbdFetchInitialize(&Ring, SlotCount);
+        Slots.assign(SlotCount, WnbdFetchSlotIdle);
+    }
+
+    UINT32 CountSlots(WNBD_FETCH_SLOT_STATE State)
+    {
+        UINT32 Count = 0;
+        for (auto SlotState : Slots) {
+            if (SlotState == State) {
+                Count++;
+            }
+        }
+        return Count;
+    }
+
+    void CheckCounters()
+    {
+        EXPECT_EQ(CountSlots(WnbdFetchSlotFetching), Ring.Fetching);
+        EXPECT_EQ(CountSlots(WnbdFetchSlotDispatching), Ring.Dispatching);
+        EXPECT_LE(Ring.Fetching + Ring.Dispatching, Ring.SlotCount);
+    }
+
+    void ArmAll()
+    {
+        for (auto& State : Slots) {
+            EXPECT_EQ(WnbdFetchActionArm, WnbdFetchArm(&Ring, &State));
+        }
+        CheckCounters();
+    }
+};
+
+TEST_F(TestFetch, ArmAndRearm)
+{
+    Initialize(4);
+    ArmAll();
+    EXPECT_EQ(4U, Ring.Fetching);
+
+    // Slots that are already in use aren't armed again.
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchArm(&Ring, &Slots[0]));
+
+    EXPECT_EQ(WnbdFetchActionDispatch,
+              WnbdFetchCompleted(&Ring, &Slots[1], TRUE));
+    EXPECT_EQ(WnbdFetchSlotDispatching, Slots[1]);
+    EXPECT_EQ(3U, Ring.Fetching);
+    EXPECT_EQ(1U, Ring.Dispatching);
+    CheckCounters();
+
+    // Unexpected transitions are ignored.
+    EXPECT_EQ(WnbdFetchActionNone,
+              WnbdFetchCompleted(&Ring, &Slots[1], TRUE));
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchDispatched(&Ring, &Slots[0]));
+    CheckCounters();
+
+    EXPECT_EQ(WnbdFetchActionArm, WnbdFetchDispatched(&Ring, &Slots[1]));
+    EXPECT_EQ(WnbdFetchSlotFetching, Slots[1]);
+    EXPECT_EQ(4U, Ring.Fetching);
+    EXPECT_EQ(0U, Ring.Dispatching);
+    CheckCounters();
+}
+
+TEST_F(TestFetch, StopCancelsPendingFetches)
+{
+    Initialize(3);
+    ArmAll();
+    EXPECT_EQ(WnbdFetchActionDispatch,
+              WnbdFetchCompleted(&Ring, &Slots[0], TRUE));
+
+    EXPECT_EQ(WnbdFetchActionCancel, WnbdFetchStop(&Ring));
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchStop(&Ring));
+
+    // Cancelled fetch requests.
+    EXPECT_EQ(WnbdFetchActionNone,
+              WnbdFetchCompleted(&Ring, &Slots[1], FALSE));
+    EXPECT_EQ(WnbdFetchSlotIdle, Slots[1]);
+    // Requests fetched before the cancellation are still dispatched.
+    EXPECT_EQ(WnbdFetchActionDispatch,
+              WnbdFetchCompleted(&Ring, &Slots[2], TRUE));
+    CheckCounters();
+
+    // The dispatched slots aren't rearmed, the last one drains the ring.
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchDispatched(&Ring, &Slots[0]));
+    EXPECT_EQ(WnbdFetchSlotIdle, Slots[0]);
+    EXPECT_EQ(WnbdFetchActionDrained, WnbdFetchDispatched(&Ring, &Slots[2]));
+    EXPECT_EQ(3U, CountSlots(WnbdFetchSlotIdle));
+    CheckCounters();
+
+    // Drained only once and the slots can't be armed again.
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchStop(&Ring));
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchArm(&Ring, &Slots[0]));
+    CheckCounters();
+}
+
+TEST_F(TestFetch, StopWhileDispatching)
+{
+    Initialize(2);
+    ArmAll();
+    EXPECT_EQ(WnbdFetchActionDispatch,
+              WnbdFetchCompleted(&Ring, &Slots[0], TRUE));
+    EXPECT_EQ(WnbdFetchActionDispatch,
+              WnbdFetchCompleted(&Ring, &Slots[1], TRUE));
+
+    // Nothing to cancel, waiting for the requests to be handled.
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchStop(&Ring));
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchDispatched(&Ring, &Slots[1]));
+    EXPECT_EQ(WnbdFetchActionDrained, WnbdFetchDispatched(&Ring, &Slots[0]));
+    CheckCounters();
+}
+
+TEST_F(TestFetch, StopWhileIdle)
+{
+    Initialize(2);
+    EXPECT_EQ(WnbdFetchActionDrained, WnbdFetchStop(&Ring));
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchArm(&Ring, &Slots[0]));
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchStop(&Ring));
+    CheckCounters();
+}
+
+TEST_F(TestFetch, FailureStopsRing)
+{
+    Initialize(3);
+    ArmAll();
+
+    // The first failure requests the other fetches to be cancelled.
+    EXPECT_EQ(WnbdFetchActionCancel,
+              WnbdFetchCompleted(&Ring, &Slots[2], FALSE));
+    EXPECT_TRUE(Ring.Stopping);
+    EXPECT_EQ(WnbdFetchActionNone,
+              WnbdFetchCompleted(&Ring, &Slots[0], FALSE));
+    EXPECT_EQ(WnbdFetchActionDrained,
+              WnbdFetchCompleted(&Ring, &Slots[1], FALSE));
+    CheckCounters();
+}
+
+TEST_F(TestFetch, PartialArmFailure)
+{
+    Initialize(3);
+    EXPECT_EQ(WnbdFetchActionArm, WnbdFetchArm(&Ring, &Slots[0]));
+    EXPECT_EQ(WnbdFetchActionArm, WnbdFetchArm(&Ring, &Slots[1]));
+
+    // Submitting the second fetch request failed right away.
+    EXPECT_EQ(WnbdFetchActionCancel,
+              WnbdFetchCompleted(&Ring, &Slots[1], FALSE));
+    // The remaining slots are left alone.
+    EXPECT_EQ(WnbdFetchActionNone, WnbdFetchArm(&Ring, &Slots[2]));
+    EXPECT_EQ(WnbdFetchActionDrained,
+              WnbdFetchCompleted(&Ring, &Slots[0], FALSE));
+    CheckCounters();
+}
+
+TEST_F(TestFetch, LastFetchFailureDrains)
+{
+    Initialize(1);
+    ArmAll();
+    // Nothing left to cancel.
+    EXPECT_EQ(WnbdFetchActionDrained,
+              WnbdFetchCompleted(&Ring, &Slots[0], FALSE));
+    CheckCounters();
+}
+
+// Simulated completion port dispatcher. The driver completes the pending
+// fetch requests in FIFO order as IO requests arrive, queuing the slots
+// to the completion port. Each worker retrieves a completion and keeps
+// the slot busy for "ServiceSteps" steps before rearming it.
+class TestFetchDispatcher : public TestFetch
+{
+protected:
+    static constexpr UINT64 DisconnectRequest = 0;
+
+    struct Worker
+    {
+        bool Busy = false;
+        UINT32 Slot = 0;
+        UINT32 RemainingSteps = 0;
+    };
+
+    struct Completion
+    {
+        UINT32 Slot;
+        bool Success;
+    };
+
+    std::vector<Worker> Workers;
+    UINT32 ServiceSteps = 1;
+
+    // Driver side.
+    std::deque<UINT32> PendingFetches;
+    std::deque<UINT64> Requests;
+    // Completion port.
+    std::deque<Completion> Completions;
+    // The request fetched using each slot.
+    std::vector<UINT64> SlotRequests;
+
+    std::vector<UINT64> HandledRequests;
+    UINT32 MaxBusyWorkers = 0;
+    UINT32 DrainedCount = 0;
+
+    void Start(UINT32 SlotCount, UINT32 WorkerCount, UINT32 _ServiceSteps)
+    {
+        Initialize(SlotCount);
+        Workers.resize(WorkerCount);
+        ServiceSteps = _ServiceSteps;
+        SlotRequests.assign(SlotCount, 0);
+
+        for (UINT32 Slot = 0; Slot < SlotCount; Slot++) {
+            ASSERT_EQ(WnbdFetchActionArm, WnbdFetchArm(&Ring, &Slots[Slot]));
+            PendingFetches.push_back(Slot);
+        }
+    }
+
+    void HandleAction(WNBD_FETCH_ACTION Action, UINT32 Slot)
+    {
+        switch (Action) {
+        case WnbdFetchActionArm:
+            PendingFetches.push_back(Slot);
+            break;
+        case WnbdFetchActionCancel:
+            while (!PendingFetches.empty()) {
+                Completions.push_back({ PendingFetches.front(), false });
+                PendingFetches.pop_front();
+            }
+            break;
+        case WnbdFetchActionDrained:
+            DrainedCount++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void CompleteFetches()
+    {
+        while (!PendingFetches.empty() && !Requests.empty()) {
+            UINT32 Slot = PendingFetches.front();
+            PendingFetches.pop_front();
+            SlotRequests[Slot] = Requests.front();
+            Requests.pop_front();
+            Completions.push_back({ Slot, true });
+        }
+    }
+
+    void Step()
+    {
+        CompleteFetches();
+
+        UINT32 BusyWorkers = 0;
+        for (auto& Worker : Workers) {
+            if (Worker.Busy) {
+                if (--Worker.RemainingSteps) {
+                    BusyWorkers++;
+                    continue;
+                }
+                Worker.Busy = false;
+
+                UINT64 Request = SlotRequests[Worker.Slot];
+                HandledRequests.push_back(Request);
+                if (Request == DisconnectRequest) {
+                    HandleAction(WnbdFetchStop(&Ring), Worker.Slot);
+                }
+                HandleAction(
+                    WnbdFetchDispatched(&Ring, &Slots[Worker.Slot]),
+                    Worker.Slot);
+            }
+
+            if (Completions.empty()) {
+                continue;
+            }
+            Completion Done = Completions.front();
+            Completions.pop_front();
+
+            WNBD_FETCH_ACTION Action = WnbdFetchCompleted(
+                &Ring, &Slots[Done.Slot], Done.Success);
+            if (Action == WnbdFetchActionDispatch) {
+                Worker.Busy = true;
+                Worker.Slot = Done.Slot;
+                Worker.RemainingSteps = ServiceSteps;
+                BusyWorkers++;
+            } else {
+                HandleAction(Action, Done.Slot);
+            }
+        }
+
+        MaxBusyWorkers = std::max(MaxBusyWorkers, BusyWorkers);
+        CheckCounters();
+    }
+
+    bool Idle()
+    {
+        for (auto& Worker : Workers) {
+            if (Worker.Busy) {
+                return false;
+            }
+        }
+        return Completions.empty();
+    }
+
+    void RunUntilIdle(UINT32 MaxSteps = 10000)
+    {
+        for (UINT32 i = 0; i < MaxSteps; i++) {
+            Step();
+            if (Idle() && (Requests.empty() || PendingFetches.empty())) {
+                return;
+            }
+        }
+        FAIL() << "the dispatcher didn't become idle";
+    }
+};
+
+TEST_F(TestFetchDispatcher, BurstAbsorbedBySlots)
+{
+    // Two workers, but the slots allow fetching the whole burst.
+    Start(16, 2, 4);
+    for (UINT64 Request = 1; Request <= 16; Request++) {
+        Requests.push_back(Request);
+    }
+
+    CompleteFetches();
+    EXPECT_TRUE(Requests.empty());
+    EXPECT_TRUE(PendingFetches.empty());
+    EXPECT_EQ(16U, Completions.size());
+
+    RunUntilIdle();
+    EXPECT_EQ(16U, HandledRequests.size());
+    EXPECT_EQ(2U, MaxBusyWorkers);
+    // All the slots were rearmed.
+    EXPECT_EQ(16U, Ring.Fetching);
+    EXPECT_EQ(16U, PendingFetches.size());
+    EXPECT_EQ(0U, DrainedCount);
+}
+
+TEST_F(TestFetchDispatcher, SlotsBoundInFlightRequests)
+{
+    // More workers than slots, the slot count limits the requests that
+    // are fetched or handled at a time.
+    Start(3, 8, 2);
+    for (UINT64 Request = 1; Request <= 100; Request++) {
+        Requests.push_back(Request);
+    }
+
+    RunUntilIdle();
+    EXPECT_EQ(100U, HandledRequests.size());
+    EXPECT_EQ(3U, MaxBusyWorkers);
+
+    // Each request is handled exactly once.
+    std::sort(HandledRequests.begin(), HandledRequests.end());
+    for (UINT64 Idx = 0; Idx < HandledRequests.size(); Idx++) {
+        EXPECT_EQ(Idx + 1, HandledRequests[Idx]);
+    }
+}
+
+TEST_F(TestFetchDispatcher, DisconnectDrainsSlots)
+{
+    Start(8, 3, 3);
+    for (UINT64 Request = 1; Request <= 20; Request++) {
+        Requests.push_back(Request);
+    }
+    Requests.push_back(DisconnectRequest);
+
+    RunUntilIdle();
+
+    // The requests that were fetched before stopping were handled, the
+    // remaining fetch requests got cancelled.
+    EXPECT_EQ(21U, HandledRequests.size());
+    EXPECT_TRUE(Ring.Stopping);
+    EXPECT_EQ(1U, DrainedCount);
+    EXPECT_TRUE(PendingFetches.empty());
+    EXPECT_EQ(8U, CountSlots(WnbdFetchSlotIdle));
+    CheckCounters();
+}
@@ -5,16 +5,34 @@
  */
 
 #include "pch.h"
+#include "mock_nbd_server.h"
 #include "mock_wnbd_daemon.h"
+#include "offline_io.h"
 #include "utils.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <utility>
+#include <vector>
+
 #include <ntddscsi.h>
 
+#include <wnbd_coro.h>
+
 void TestWrite(
     uint64_t BlockCount = DefaultBlockCount,
     uint32_t BlockSize = DefaultBlockSize,
     bool CacheEnabled = true,
-    bool UseFUA = false)
+    bool UseFUA = false,
+    bool LeaseBuffers = false,
+    WnbdDispatcherMode DispatcherMode = WnbdDispatcherModeThreaded,
+    bool ElasticDispatcher = false,
+    bool NumaAffinity = false,
+    bool BusyPoll = false)
 {
     WNBD_PROPERTIES WnbdProps = { 0 };
     GetNewWnbdProps(&WnbdProps);
@@ -28,6 +46,27 @@ void TestWrite(
     }
 
     MockWnbdDaemon WnbdDaemon(&WnbdProps);
+    WnbdDaemon.SetLeaseBuffers(LeaseBuffers);
+
+    WNBD_DISPATCHER_OPTIONS DispatcherOptions = { 0 };
+    DispatcherOptions.Mode = DispatcherMode;
+    DispatcherOptions.ThreadCount = IO_REQ_WORKERS;
+    if (ElasticDispatcher) {
+        DispatcherOptions.Flags.Elastic = 1;
+        DispatcherOptions.MinThreadCount = 1;
+        DispatcherOptions.MaxThreadCount = IO_REQ_WORKERS * 4;
+        // Reevaluate the thread count more often than usual.
+        DispatcherOptions.ElasticIntervalMs = 20;
+    }
+    if (NumaAffinity) {
+        // NUMA node 0 is always available.
+        DispatcherOptions.Flags.UseNumaNode = 1;
+        DispatcherOptions.NumaNode = 0;
+    }
+    if (BusyPoll) {
+        DispatcherOptions.Flags.BusyPoll = 1;
+    }
+    WnbdDaemon.SetDispatcherOptions(DispatcherOptions);
 
     WnbdDaemon.Start();
 
@@ -130,6 +169,10 @@ void TestWrite(
     ExpWnbdRequest = { 0 };
     ExpWnbdRequest.RequestType = WnbdReqTypeFlush;
     ASSERT_EQ(CacheEnabled, WnbdDaemon.ReqLog.HasEntry(ExpWnbdRequest));
+
+    WNBD_USR_STATS UserspaceStats = { 0 };
+    ASSERT_FALSE(WnbdGetUserspaceStats(WnbdDaemon.GetDisk(), &UserspaceStats));
+    ASSERT_EQ(BusyPoll, UserspaceStats.PollCount > 0);
 }
 
 TEST(TestWrite, CacheEnabled) {
@@ -167,6 +210,49 @@ TEST(TestWrite, FUACacheEnabled) {
         true, true);
 }
 
+TEST(TestWrite, LeasedBuffers) {
+    TestWrite(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, true);
+}
+
+TEST(TestWrite, CompletionPortDispatcher) {
+    TestWrite(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, false, WnbdDispatcherModeCompletionPort);
+}
+
+TEST(TestWrite, CompletionPortLeasedBuffers) {
+    TestWrite(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, true, WnbdDispatcherModeCompletionPort);
+}
+
+TEST(TestWrite, ElasticDispatcher) {
+    TestWrite(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, false, WnbdDispatcherModeThreaded, true);
+}
+
+TEST(TestWrite, NumaAffinity) {
+    TestWrite(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, false, WnbdDispatcherModeThreaded, false, true);
+}
+
+TEST(TestWrite, BusyPoll) {
+    TestWrite(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, false, WnbdDispatcherModeThreaded, false, false, true);
+}
+
+TEST(TestWrite, CompletionPortBusyPoll) {
+    TestWrite(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, false, WnbdDispatcherModeCompletionPort,
+        false, false, true);
+}
+
 TEST(TestWrite, WriteReadOnly) {
     WNBD_PROPERTIES WnbdProps = { 0 };
     GetNewWnbdProps(&WnbdProps);
@@ -221,7 +307,12 @@ TEST(TestWrite, WriteReadOnly) {
 void TestRead(
     uint64_t BlockCount = DefaultBlockCount,
     uint32_t BlockSize = DefaultBlockSize,
-    bool CacheEnabled = true)
+    bool CacheEnabled = true,
+    bool LeaseBuffers = false,
+    WnbdDispatcherMode DispatcherMode = WnbdDispatcherModeThreaded,
+    bool ElasticDispatcher = false,
+    bool NumaAffinity = false,
+    bool BusyPoll = false)
 {
     WNBD_PROPERTIES WnbdProps = { 0 };
     GetNewWnbdProps(&WnbdProps);
@@ -235,6 +326,27 @@ void TestRead(
     }
 
     MockWnbdDaemon WnbdDaemon(&WnbdProps);
+    WnbdDaemon.SetLeaseBuffers(LeaseBuffers);
+
+    WNBD_DISPATCHER_OPTIONS DispatcherOptions = { 0 };
+    DispatcherOptions.Mode = DispatcherMode;
+    DispatcherOptions.ThreadCount = IO_REQ_WORKERS;
+    if (ElasticDispatcher) {
+        DispatcherOptions.Flags.Elastic = 1;
+        DispatcherOptions.MinThreadCount = 1;
+        DispatcherOptions.MaxThreadCount = IO_REQ_WORKERS * 4;
+        // Reevaluate the thread count more often than usual.
+        DispatcherOptions.ElasticIntervalMs = 20;
+    }
+    if (NumaAffinity) {
+        // NUMA node 0 is always available.
+        DispatcherOptions.Flags.UseNumaNode = 1;
+        DispatcherOptions.NumaNode = 0;
+    }
+    if (BusyPoll) {
+        DispatcherOptions.Flags.BusyPoll = 1;
+    }
+    WnbdDaemon.SetDispatcherOptions(DispatcherOptions);
 
     WnbdDaemon.Start();
 
@@ -366,6 +478,36 @@ TEST(TestRead, Read2PBDisk) {
         DefaultBlockSize);
 }
 
+TEST(TestRead, LeasedBuffers) {
+    TestRead(
+        DefaultBlockCount, DefaultBlockSize,
+        true, true);
+}
+
+TEST(TestRead, CompletionPortDispatcher) {
+    TestRead(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, WnbdDispatcherModeCompletionPort);
+}
+
+TEST(TestRead, ElasticDispatcher) {
+    TestRead(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, WnbdDispatcherModeThreaded, true);
+}
+
+TEST(TestRead, NumaAffinity) {
+    TestRead(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, WnbdDispatcherModeThreaded, false, true);
+}
+
+TEST(TestRead, BusyPoll) {
+    TestRead(
+        DefaultBlockCount, DefaultBlockSize,
+        true, false, WnbdDispatcherModeThreaded, false, false, true);
+}
+
 TEST(TestIoStats, TestIoStats) {
     WNBD_PROPERTIES WnbdProps = { 0 };
     GetNewWnbdProps(&WnbdProps);
@@ -734,3 +876,2031 @@ TEST(TestScsiUnmap, TestUnmap) {
         (void*) &ExpectedUnmapDescriptor,
         sizeof(WNBD_UNMAP_DESCRIPTOR)));
 }
+
+TEST(TestCompletionPort, SyncRequestsNotQueued) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    MockWnbdDaemon WnbdDaemon(&WnbdProps);
+    WnbdDaemon.Start();
+
+    PWNBD_DISK WnbdDisk = WnbdDaemon.GetDisk();
+
+    HANDLE CompletionPort = CreateIoCompletionPort(
+        INVALID_HANDLE_VALUE, NULL, 0, 0);
+    ASSERT_TRUE(CompletionPort) << "couldn't create completion port";
+
+    DWORD Status = WnbdSetCompletionPort(WnbdDisk, CompletionPort, 1);
+    ASSERT_FALSE(Status) << "couldn't set completion port";
+    // A handle can only be associated with one completion port.
+    ASSERT_EQ(ERROR_ALREADY_EXISTS,
+              WnbdSetCompletionPort(WnbdDisk, CompletionPort, 1));
+
+    WNBD_IO_RESPONSE Response = { 0 };
+    Response.RequestType = WnbdReqTypeWrite;
+    Response.RequestHandle = (UINT64) -1;
+    Status = WnbdSendResponse(WnbdDisk, &Response, NULL, 0);
+    ASSERT_EQ(ERROR_NOT_FOUND, Status);
+
+    // Synchronous requests must not be queued.
+    DWORD BytesTransferred = 0;
+    ULONG_PTR CompletionKey = 0;
+    LPOVERLAPPED Overlapped = NULL;
+    ASSERT_FALSE(GetQueuedCompletionStatus(
+        CompletionPort, &BytesTransferred, &CompletionKey, &Overlapped, 0));
+    ASSERT_EQ(WAIT_TIMEOUT, GetLastError());
+
+    WnbdDaemon.Shutdown();
+    CloseHandle(CompletionPort);
+}
+
+TEST(TestLatencyStats, BucketBounds) {
+    UINT64 Values[] = {
+        0, 1, 7, 8, 9, 15, 16, 17, 100, 999, 1000, 123456,
+        (1ULL << 32) - 1 };
+    for (UINT64 Value : Values) {
+        UINT32 Index = WnbdLatencyBucketIndex(Value);
+        ASSERT_LT(Index, (UINT32) WNBD_LATENCY_BUCKET_COUNT);
+        EXPECT_LE(WnbdLatencyBucketLowerBound(Index), Value);
+        if (Index < WNBD_LATENCY_BUCKET_COUNT - 1) {
+            EXPECT_GT(WnbdLatencyBucketLowerBound(Index + 1), Value);
+        }
+    }
+    EXPECT_EQ((UINT32) WNBD_LATENCY_BUCKET_COUNT - 1,
+              WnbdLatencyBucketIndex(MAXUINT64));
+
+    WNBD_LATENCY_HISTOGRAM Histogram = { 0 };
+    EXPECT_EQ(0ULL, WnbdGetLatencyPercentile(&Histogram, 50));
+    // 90 requests completed in 5us, 10 requests completed in 1000us.
+    Histogram.Buckets[WnbdLatencyBucketIndex(5)] = 90;
+    Histogram.Buckets[WnbdLatencyBucketIndex(1000)] = 10;
+    EXPECT_EQ(100ULL, WnbdGetLatencyCount(&Histogram));
+    EXPECT_EQ(5ULL, WnbdGetLatencyPercentile(&Histogram, 50));
+    EXPECT_EQ(5ULL, WnbdGetLatencyPercentile(&Histogram, 90));
+    UINT64 P99 = WnbdGetLatencyPercentile(&Histogram, 99);
+    EXPECT_LE(1000ULL, P99);
+    EXPECT_GE(1000ULL + 1000 / WNBD_LATENCY_SUB_BUCKET_COUNT, P99);
+}
+
+TEST(TestLatencyStats, ReadWrite) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    MockWnbdDaemon WnbdDaemon(&WnbdProps);
+    WnbdDaemon.Start();
+
+    std::string DiskPath = GetDiskPath(WnbdProps.InstanceName);
+    HANDLE DiskHandle = CreateFileA(
+        DiskPath.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH,
+        NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, DiskHandle)
+        << "couldn't open disk: " << DiskPath
+        << ", error: " << WinStrError(GetLastError());
+    std::unique_ptr<void, decltype(&CloseHandle)> DiskHandleCloser(
+        DiskHandle, &CloseHandle);
+
+    const DWORD IoSize = 4096;
+    const int RequestCount = 16;
+    PBYTE Buffer = (PBYTE) VirtualAlloc(
+        NULL, IoSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT_TRUE(Buffer) << "couldn't allocate buffer";
+    auto FreeBuffer = [](PBYTE Buffer) {
+        VirtualFree(Buffer, 0, MEM_RELEASE);
+    };
+    std::unique_ptr<BYTE, decltype(FreeBuffer)> BufferReleaser(
+        Buffer, FreeBuffer);
+
+    for (int i = 0; i < RequestCount; i++) {
+        DWORD BytesTransferred = 0;
+        LARGE_INTEGER Offset = { 0 };
+        Offset.QuadPart = (LONGLONG) i * IoSize;
+        ASSERT_TRUE(SetFilePointerEx(DiskHandle, Offset, NULL, FILE_BEGIN));
+        ASSERT_TRUE(WriteFile(
+            DiskHandle, Buffer, IoSize, &BytesTransferred, NULL))
+            << "couldn't write to disk: " << WinStrError(GetLastError());
+        ASSERT_TRUE(SetFilePointerEx(DiskHandle, Offset, NULL, FILE_BEGIN));
+        ASSERT_TRUE(ReadFile(
+            DiskHandle, Buffer, IoSize, &BytesTransferred, NULL))
+            << "couldn't read from disk: " << WinStrError(GetLastError());
+    }
+
+    std::unique_ptr<WNBD_LATENCY_STATS> Stats(new WNBD_LATENCY_STATS());
+    DWORD Status = WnbdGetLatencyStats(WnbdProps.InstanceName, Stats.get());
+    ASSERT_FALSE(Status) << "couldn't retrieve latency stats";
+
+    // Other components may access the disk as well.
+    for (WnbdRequestType Type : { WnbdReqTypeRead, WnbdReqTypeWrite }) {
+        PWNBD_LATENCY_HISTOGRAM Histogram = &Stats->Histograms[Type];
+        EXPECT_LE((UINT64) RequestCount, WnbdGetLatencyCount(Histogram))
+            << WnbdRequestTypeToStr(Type);
+        EXPECT_LE(WnbdGetLatencyPercentile(Histogram, 50),
+                  WnbdGetLatencyPercentile(Histogram, 99));
+        EXPECT_LE(WnbdGetLatencyPercentile(Histogram, 99),
+                  WnbdGetLatencyPercentile(Histogram, 100));
+    }
+
+    WnbdDaemon.Shutdown();
+}
+
+TEST(TestQos, ThrottledReads) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+    WnbdProps.QosLimits.ReadIops.Rate = 20;
+    WnbdProps.QosLimits.ReadIops.Burst = 1;
+
+    MockWnbdDaemon WnbdDaemon(&WnbdProps);
+    WnbdDaemon.Start();
+
+    std::string DiskPath = GetDiskPath(WnbdProps.InstanceName);
+    HANDLE DiskHandle = CreateFileA(
+        DiskPath.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH,
+        NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, DiskHandle)
+        << "couldn't open disk: " << DiskPath
+        << ", error: " << WinStrError(GetLastError());
+    std::unique_ptr<void, decltype(&CloseHandle)> DiskHandleCloser(
+        DiskHandle, &CloseHandle);
+
+    const DWORD IoSize = 4096;
+    const int RequestCount = 10;
+    PBYTE Buffer = (PBYTE) VirtualAlloc(
+        NULL, IoSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT_TRUE(Buffer) << "couldn't allocate buffer";
+    auto FreeBuffer = [](PBYTE Buffer) {
+        VirtualFree(Buffer, 0, MEM_RELEASE);
+    };
+    std::unique_ptr<BYTE, decltype(FreeBuffer)> BufferReleaser(
+        Buffer, FreeBuffer);
+
+    auto ReadRequests = [&]() {
+        for (int i = 0; i < RequestCount; i++) {
+            DWORD BytesTransferred = 0;
+            LARGE_INTEGER Offset = { 0 };
+            Offset.QuadPart = (LONGLONG) i * IoSize;
+            ASSERT_TRUE(SetFilePointerEx(DiskHandle, Offset, NULL, FILE_BEGIN));
+            ASSERT_TRUE(ReadFile(
+                DiskHandle, Buffer, IoSize, &BytesTransferred, NULL))
+                << "couldn't read from disk: " << WinStrError(GetLastError());
+        }
+    };
+
+    auto Start = std::chrono::steady_clock::now();
+    ReadRequests();
+    auto ElapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - Start).count();
+    // 20 IOPS. Requests are admitted while the bucket isn't depleted,
+    // so the first two requests are submitted right away.
+    EXPECT_LE(350, ElapsedMs);
+
+    WNBD_DRV_STATS Stats = { 0 };
+    DWORD Status = WnbdGetDriverStats(WnbdProps.InstanceName, &Stats);
+    ASSERT_FALSE(Status) << "couldn't retrieve driver stats";
+    EXPECT_LE(RequestCount - 2, Stats.ThrottledIORequests);
+    EXPECT_LT(0, Stats.ThrottleWaitUs);
+
+    // Lift the limits at runtime.
+    WNBD_QOS_LIMITS Limits = { 0 };
+    Status = WnbdSetQosLimits(WnbdProps.InstanceName, &Limits);
+    ASSERT_FALSE(Status) << "couldn't set QoS limits";
+
+    WNBD_CONNECTION_INFO ConnInfo = { 0 };
+    Status = WnbdShow(WnbdProps.InstanceName, &ConnInfo);
+    ASSERT_FALSE(Status) << "couldn't retrieve connection info";
+    EXPECT_EQ(0ULL, ConnInfo.Properties.QosLimits.ReadIops.Rate);
+
+    ReadRequests();
+    Status = WnbdGetDriverStats(WnbdProps.InstanceName, &Stats);
+    ASSERT_FALSE(Status) << "couldn't retrieve driver stats";
+    INT64 ThrottledRequests = Stats.ThrottledIORequests;
+    ReadRequests();
+    Status = WnbdGetDriverStats(WnbdProps.InstanceName, &Stats);
+    ASSERT_FALSE(Status) << "couldn't retrieve driver stats";
+    EXPECT_EQ(ThrottledRequests, Stats.ThrottledIORequests);
+
+    // Invalid limits are rejected.
+    Limits.WriteBandwidth.Rate = WNBD_MAX_QOS_LIMIT + 1;
+    EXPECT_TRUE(WnbdSetQosLimits(WnbdProps.InstanceName, &Limits));
+
+    WnbdDaemon.Shutdown();
+}
+
+TEST(TestIoTrace, ReadWrite) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    MockWnbdDaemon WnbdDaemon(&WnbdProps);
+    WnbdDaemon.Start();
+
+    char TempDir[MAX_PATH] = { 0 };
+    ASSERT_TRUE(GetTempPathA(MAX_PATH, TempDir));
+    std::string TracePath = std::string(TempDir) +
+        WnbdProps.InstanceName + ".trace";
+
+    WNBD_IO_TRACE_OPTIONS TraceOptions = { 0 };
+    TracePath.copy(TraceOptions.Path, MAX_PATH - 1);
+    TraceOptions.MaxFileSize = WNBD_MIN_IO_TRACE_FILE_SIZE;
+    DWORD Status = WnbdStartIoTrace(WnbdDaemon.GetDisk(), &TraceOptions);
+    ASSERT_FALSE(Status) << "couldn't start IO trace: "
+                         << WinStrError(Status);
+    ASSERT_EQ(ERROR_ALREADY_EXISTS,
+              WnbdStartIoTrace(WnbdDaemon.GetDisk(), &TraceOptions));
+
+    std::string DiskPath = GetDiskPath(WnbdProps.InstanceName);
+    HANDLE DiskHandle = CreateFileA(
+        DiskPath.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_NO_BUFFERING,
+        NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, DiskHandle)
+        << "couldn't open disk: " << DiskPath
+        << ", error: " << WinStrError(GetLastError());
+    std::unique_ptr<void, decltype(&CloseHandle)> DiskHandleCloser(
+        DiskHandle, &CloseHandle);
+
+    UINT32 BufferSize = WnbdProps.BlockSize * 2;
+    std::unique_ptr<void, decltype(&_aligned_free)> Buffer(
+        _aligned_malloc(BufferSize, 4096), _aligned_free);
+    ASSERT_TRUE(Buffer.get()) << "couldn't allocate: " << BufferSize;
+    memset(Buffer.get(), WRITE_BYTE_CONTENT, BufferSize);
+
+    LARGE_INTEGER Offset;
+    Offset.QuadPart = 16 * WnbdProps.BlockSize;
+    ASSERT_TRUE(SetFilePointerEx(DiskHandle, Offset, NULL, FILE_BEGIN));
+    DWORD BytesTransferred = 0;
+    ASSERT_TRUE(WriteFile(
+        DiskHandle, Buffer.get(), BufferSize, &BytesTransferred, NULL));
+    ASSERT_TRUE(SetFilePointerEx(DiskHandle, Offset, NULL, FILE_BEGIN));
+    ASSERT_TRUE(ReadFile(
+        DiskHandle, Buffer.get(), BufferSize, &BytesTransferred, NULL));
+
+    // The record count is updated while tracing, so that the trace
+    // remains usable if the process crashes.
+    WNBD_IO_TRACE_HEADER Header = { 0 };
+    {
+        HANDLE ActiveTraceHandle = CreateFileA(
+            TracePath.c_str(), GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL, OPEN_EXISTING, 0, NULL);
+        ASSERT_NE(INVALID_HANDLE_VALUE, ActiveTraceHandle)
+            << "couldn't open trace file: " << TracePath
+            << ", error: " << WinStrError(GetLastError());
+        std::unique_ptr<void, decltype(&CloseHandle)> ActiveTraceCloser(
+            ActiveTraceHandle, &CloseHandle);
+        ASSERT_TRUE(ReadFile(
+            ActiveTraceHandle, &Header, sizeof(Header),
+            &BytesTransferred, NULL));
+        ASSERT_EQ(sizeof(Header), BytesTransferred);
+        EXPECT_LE(2ULL, Header.RecordCount);
+    }
+
+    WnbdStopIoTrace(WnbdDaemon.GetDisk());
+
+    HANDLE TraceHandle = CreateFileA(
+        TracePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, TraceHandle)
+        << "couldn't open trace file: " << TracePath
+        << ", error: " << WinStrError(GetLastError());
+    std::unique_ptr<void, decltype(&CloseHandle)> TraceHandleCloser(
+        TraceHandle, &CloseHandle);
+
+    Header = { 0 };
+    ASSERT_TRUE(ReadFile(
+        TraceHandle, &Header, sizeof(Header), &BytesTransferred, NULL));
+    ASSERT_EQ(sizeof(Header), BytesTransferred);
+    EXPECT_EQ(WNBD_IO_TRACE_MAGIC, Header.Magic);
+    EXPECT_EQ((UINT32) WNBD_IO_TRACE_VERSION, Header.Version);
+    EXPECT_EQ((UINT32) sizeof(WNBD_IO_TRACE_RECORD), Header.RecordSize);
+    EXPECT_EQ(WnbdProps.BlockSize, Header.BlockSize);
+    EXPECT_STREQ(WnbdProps.InstanceName, Header.InstanceName);
+    // Other components (e.g. the partition manager) may access
+    // the disk as well.
+    ASSERT_LE(2ULL, Header.RecordCount);
+
+    std::vector<WNBD_IO_TRACE_RECORD> Records(Header.RecordCount);
+    DWORD RecordsSize = (DWORD) (
+        Header.RecordCount * sizeof(WNBD_IO_TRACE_RECORD));
+    ASSERT_TRUE(ReadFile(
+        TraceHandle, Records.data(), RecordsSize, &BytesTransferred, NULL));
+    ASSERT_EQ(RecordsSize, BytesTransferred);
+
+    bool FoundWrite = false;
+    bool FoundRead = false;
+    for (auto& Record : Records) {
+        EXPECT_LE(Record.FetchTimestamp, Record.CompleteTimestamp);
+        if (Record.BlockAddress != 16 || Record.BlockCount != 2) {
+            continue;
+        }
+        EXPECT_FALSE(Record.ScsiStatus);
+        if (Record.RequestType == WnbdReqTypeWrite) {
+            FoundWrite = true;
+        } else if (Record.RequestType == WnbdReqTypeRead) {
+            // The read follows the write.
+            EXPECT_TRUE(FoundWrite);
+            FoundRead = true;
+        }
+    }
+    EXPECT_TRUE(FoundWrite);
+    EXPECT_TRUE(FoundRead);
+
+    WnbdDaemon.Shutdown();
+}
+
+// Submits a request to an offline disk and waits for its response. The
+// request handles are expected to be unique.
+static WNBD_IO_RESPONSE OfflineSubmitAndWait(
+    PWNBD_DISK Disk,
+    OfflineResponses* Received,
+    PWNBD_IO_REQUEST Request,
+    PVOID Buffer)
+{
+    DWORD Status = WnbdSubmitRequest(Disk, Request, Buffer);
+    if (Status) {
+        ADD_FAILURE() << "couldn't submit request: " << WinStrError(Status);
+        WNBD_IO_RESPONSE Response = { 0 };
+        Response.RequestHandle = Request->RequestHandle;
+        Response.Status.ScsiStatus = SCSISTAT_CHECK_CONDITION;
+        return Response;
+    }
+    return Received->WaitResponse(Request->RequestHandle);
+}
+
+static WNBD_IO_RESPONSE OfflineRead(
+    PWNBD_DISK Disk,
+    OfflineResponses* Received,
+    UINT64 RequestHandle,
+    UINT64 BlockAddress,
+    UINT32 BlockCount,
+    PVOID Buffer)
+{
+    WNBD_IO_REQUEST Request = { 0 };
+    Request.RequestHandle = RequestHandle;
+    Request.RequestType = WnbdReqTypeRead;
+    Request.Cmd.Read.BlockAddress = BlockAddress;
+    Request.Cmd.Read.BlockCount = BlockCount;
+    return OfflineSubmitAndWait(Disk, Received, &Request, Buffer);
+}
+
+static WNBD_IO_RESPONSE OfflineWrite(
+    PWNBD_DISK Disk,
+    OfflineResponses* Received,
+    UINT64 RequestHandle,
+    UINT64 BlockAddress,
+    UINT32 BlockCount,
+    PVOID Buffer,
+    BOOLEAN ForceUnitAccess = FALSE)
+{
+    WNBD_IO_REQUEST Request = { 0 };
+    Request.RequestHandle = RequestHandle;
+    Request.RequestType = WnbdReqTypeWrite;
+    Request.Cmd.Write.BlockAddress = BlockAddress;
+    Request.Cmd.Write.BlockCount = BlockCount;
+    Request.Cmd.Write.ForceUnitAccess = ForceUnitAccess;
+    return OfflineSubmitAndWait(Disk, Received, &Request, Buffer);
+}
+
+static WNBD_IO_RESPONSE OfflineFlush(
+    PWNBD_DISK Disk,
+    OfflineResponses* Received,
+    UINT64 RequestHandle)
+{
+    WNBD_IO_REQUEST Request = { 0 };
+    Request.RequestHandle = RequestHandle;
+    Request.RequestType = WnbdReqTypeFlush;
+    return OfflineSubmitAndWait(Disk, Received, &Request, nullptr);
+}
+
+static WNBD_IO_RESPONSE OfflineUnmap(
+    PWNBD_DISK Disk,
+    OfflineResponses* Received,
+    UINT64 RequestHandle,
+    UINT64 BlockAddress,
+    UINT32 BlockCount)
+{
+    WNBD_UNMAP_DESCRIPTOR Descriptor = { 0 };
+    Descriptor.BlockAddress = BlockAddress;
+    Descriptor.BlockCount = BlockCount;
+    WNBD_IO_REQUEST Request = { 0 };
+    Request.RequestHandle = RequestHandle;
+    Request.RequestType = WnbdReqTypeUnmap;
+    Request.Cmd.Unmap.Count = 1;
+    return OfflineSubmitAndWait(Disk, Received, &Request, &Descriptor);
+}
+
+// Offline disk read callback, filling the buffer with READ_BYTE_CONTENT.
+static void OfflineReadHandler(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle,
+    PVOID Buffer,
+    UINT64 BlockAddress,
+    UINT32 BlockCount,
+    BOOLEAN ForceUnitAccess)
+{
+    WNBD_IO_RESPONSE Response = { 0 };
+    Response.RequestHandle = RequestHandle;
+    Response.RequestType = WnbdReqTypeRead;
+    memset(Buffer, READ_BYTE_CONTENT, BlockCount * Disk->Properties.BlockSize);
+    WnbdSendResponse(Disk, &Response, Buffer,
+                     BlockCount * Disk->Properties.BlockSize);
+}
+
+TEST(TestOfflineDisk, SubmitRequests) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    // Only reads are supported by this interface.
+    WNBD_INTERFACE Interface = { 0 };
+    Interface.Read = OfflineReadHandler;
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOffline(
+        &WnbdProps, &Interface, nullptr,
+        RecordOfflineResponse, &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't create offline disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdClose)> DiskCloser(
+        Disk, &WnbdClose);
+
+    std::vector<BYTE> Buffer(WnbdProps.BlockSize * 2);
+    OfflineRead(Disk, &Received, 1, 0, 2, Buffer.data());
+    OfflineWrite(Disk, &Received, 2, 0, 1, Buffer.data());
+
+    ASSERT_EQ(2ULL, Received.Responses.size());
+    EXPECT_EQ(1ULL, Received.Responses[0].RequestHandle);
+    EXPECT_FALSE(Received.Responses[0].Status.ScsiStatus);
+    EXPECT_EQ(WnbdProps.BlockSize * 2, Received.DataSizes[0]);
+    EXPECT_EQ(READ_BYTE_CONTENT, Buffer[0]);
+    // Unsupported requests are rejected by libwnbd.
+    EXPECT_EQ(2ULL, Received.Responses[1].RequestHandle);
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION,
+              Received.Responses[1].Status.ScsiStatus);
+
+    WNBD_USR_STATS Stats = { 0 };
+    ASSERT_FALSE(WnbdGetUserspaceStats(Disk, &Stats));
+    EXPECT_EQ(2ULL, Stats.TotalReceivedRequests);
+    EXPECT_EQ(1ULL, Stats.InvalidRequests);
+
+    // Regular disks don't accept submitted requests.
+    WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+    MockWnbdDaemon WnbdDaemon(&WnbdProps);
+    WnbdDaemon.Start();
+    WNBD_IO_REQUEST Request = { 0 };
+    Request.RequestHandle = 3;
+    Request.RequestType = WnbdReqTypeRead;
+    Request.Cmd.Read.BlockCount = 1;
+    EXPECT_EQ(ERROR_INVALID_FUNCTION,
+              WnbdSubmitRequest(WnbdDaemon.GetDisk(), &Request,
+                                Buffer.data()));
+    WnbdDaemon.Shutdown();
+}
+
+// Reads complete synchronously while writes wait for the test
+// to complete them.
+class TestCoroBackend
+{
+public:
+    UINT32 BlockSize = 0;
+    std::vector<wnbd::Completion<WNBD_STATUS>*> PendingWrites;
+
+    wnbd::Task<WNBD_STATUS> Read(
+        PVOID Buffer, UINT64 BlockAddress,
+        UINT32 BlockCount, BOOLEAN ForceUnitAccess)
+    {
+        memset(Buffer, READ_BYTE_CONTENT, BlockCount * BlockSize);
+        co_return WNBD_STATUS{ 0 };
+    }
+
+    wnbd::Task<WNBD_STATUS> Write(
+        PVOID Buffer, UINT64 BlockAddress,
+        UINT32 BlockCount, BOOLEAN ForceUnitAccess)
+    {
+        wnbd::Completion<WNBD_STATUS> Completed;
+        PendingWrites.push_back(&Completed);
+        co_return co_await Completed;
+    }
+};
+
+TEST(TestCoroBackend, SyncAndAsyncRequests) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    TestCoroBackend Backend;
+    Backend.BlockSize = WnbdProps.BlockSize;
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOffline(
+        &WnbdProps,
+        (PWNBD_INTERFACE) &wnbd::CoroInterface<TestCoroBackend>::Interface,
+        &Backend, RecordOfflineResponse, &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't create offline disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdClose)> DiskCloser(
+        Disk, &WnbdClose);
+
+    // The backend doesn't implement flush and unmap.
+    EXPECT_FALSE(wnbd::CoroInterface<TestCoroBackend>::Interface.Flush);
+    EXPECT_FALSE(wnbd::CoroInterface<TestCoroBackend>::Interface.Unmap);
+
+    std::vector<BYTE> Buffer(WnbdProps.BlockSize);
+    OfflineRead(Disk, &Received, 1, 0, 1, Buffer.data());
+    ASSERT_EQ(1ULL, Received.Responses.size());
+    EXPECT_EQ(1ULL, Received.Responses[0].RequestHandle);
+    EXPECT_FALSE(Received.Responses[0].Status.ScsiStatus);
+    EXPECT_EQ(WnbdProps.BlockSize, Received.DataSizes[0]);
+    EXPECT_EQ(READ_BYTE_CONTENT, Buffer[0]);
+
+    // The writes are completed by the test, we can't wait for them.
+    for (UINT64 RequestHandle = 2; RequestHandle <= 3; RequestHandle++) {
+        WNBD_IO_REQUEST Request = { 0 };
+        Request.RequestHandle = RequestHandle;
+        Request.RequestType = WnbdReqTypeWrite;
+        Request.Cmd.Write.BlockCount = 1;
+        ASSERT_FALSE(WnbdSubmitRequest(Disk, &Request, Buffer.data()));
+    }
+    ASSERT_EQ(2ULL, Backend.PendingWrites.size());
+    EXPECT_EQ(1ULL, Received.Responses.size());
+
+    // Complete the writes out of order, the second one failing.
+    WNBD_STATUS WriteStatus = { 0 };
+    WnbdSetSense(&WriteStatus, SCSI_SENSE_MEDIUM_ERROR,
+                 SCSI_ADSENSE_WRITE_ERROR);
+    Backend.PendingWrites[1]->Complete(WriteStatus);
+    Backend.PendingWrites[0]->Complete(WNBD_STATUS{ 0 });
+
+    ASSERT_EQ(3ULL, Received.Responses.size());
+    EXPECT_EQ(3ULL, Received.Responses[1].RequestHandle);
+    EXPECT_EQ(WnbdReqTypeWrite, Received.Responses[1].RequestType);
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION,
+              Received.Responses[1].Status.ScsiStatus);
+    EXPECT_EQ(SCSI_SENSE_MEDIUM_ERROR, Received.Responses[1].Status.SenseKey);
+    EXPECT_EQ(2ULL, Received.Responses[2].RequestHandle);
+    EXPECT_FALSE(Received.Responses[2].Status.ScsiStatus);
+    // Write responses don't include data.
+    EXPECT_EQ(0U, Received.DataSizes[2]);
+}
+
+// Offline responses that invoke a hook after being recorded.
+struct HookedResponses : OfflineResponses
+{
+    std::function<void()> Hook;
+
+    static VOID Record(
+        PVOID ResponseContext,
+        PWNBD_IO_RESPONSE Response,
+        PVOID DataBuffer,
+        UINT32 DataBufferSize)
+    {
+        RecordOfflineResponse(
+            ResponseContext, Response, DataBuffer, DataBufferSize);
+        auto Received = (HookedResponses*) ResponseContext;
+        if (Received->Hook) {
+            std::exchange(Received->Hook, nullptr)();
+        }
+    }
+};
+
+// Asynchronous responses are queued per disk. A thread that's sending
+// the responses of a disk doesn't pick up the responses of other disks,
+// while the responses of the same disk get batched.
+TEST(TestCoroBackend, PerDiskResponseQueue) {
+    WNBD_PROPERTIES WnbdProps[2] = { 0 };
+    TestCoroBackend Backends[2];
+    HookedResponses Received[2];
+    std::vector<std::unique_ptr<WNBD_DISK, decltype(&WnbdClose)>> Disks;
+    std::vector<BYTE> Buffer;
+
+    for (int Idx = 0; Idx < 2; Idx++) {
+        GetNewWnbdProps(&WnbdProps[Idx]);
+        Backends[Idx].BlockSize = WnbdProps[Idx].BlockSize;
+
+        PWNBD_DISK Disk = nullptr;
+        DWORD Status = WnbdCreateOffline(
+            &WnbdProps[Idx],
+            (PWNBD_INTERFACE) &wnbd::CoroInterface<TestCoroBackend>::Interface,
+            &Backends[Idx], HookedResponses::Record, &Received[Idx], &Disk);
+        ASSERT_FALSE(Status) << "couldn't create offline disk: "
+                             << WinStrError(Status);
+        Disks.emplace_back(Disk, &WnbdClose);
+        Buffer.resize(WnbdProps[Idx].BlockSize);
+
+        for (UINT64 RequestHandle = 1; RequestHandle <= 2; RequestHandle++) {
+            WNBD_IO_REQUEST Request = { 0 };
+            Request.RequestHandle = RequestHandle;
+            Request.RequestType = WnbdReqTypeWrite;
+            Request.Cmd.Write.BlockCount = 1;
+            ASSERT_FALSE(WnbdSubmitRequest(Disk, &Request, Buffer.data()));
+        }
+        ASSERT_EQ(2ULL, Backends[Idx].PendingWrites.size());
+    }
+
+    // Completed while the first response of the first disk is being sent.
+    size_t FirstDiskResponses = 0;
+    size_t SecondDiskResponses = 0;
+    Received[0].Hook = [&] {
+        Backends[0].PendingWrites[1]->Complete(WNBD_STATUS{ 0 });
+        Backends[1].PendingWrites[0]->Complete(WNBD_STATUS{ 0 });
+        FirstDiskResponses = Received[0].Responses.size();
+        SecondDiskResponses = Received[1].Responses.size();
+    };
+    Backends[0].PendingWrites[0]->Complete(WNBD_STATUS{ 0 });
+
+    // Queued and sent once the first response was sent.
+    EXPECT_EQ(1ULL, FirstDiskResponses);
+    ASSERT_EQ(2ULL, Received[0].Responses.size());
+    EXPECT_EQ(1ULL, Received[0].Responses[0].RequestHandle);
+    EXPECT_EQ(2ULL, Received[0].Responses[1].RequestHandle);
+    // Sent right away, the other disk queue being idle.
+    EXPECT_EQ(1ULL, SecondDiskResponses);
+
+    Backends[1].PendingWrites[1]->Complete(WNBD_STATUS{ 0 });
+    EXPECT_EQ(2ULL, Received[1].Responses.size());
+}
+
+TEST(TestFileBackend, OfflineReadWriteUnmap) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    char TempDir[MAX_PATH] = { 0 };
+    ASSERT_TRUE(GetTempPathA(MAX_PATH, TempDir));
+    std::string FilePath = std::string(TempDir) +
+        WnbdProps.InstanceName + ".img";
+    DeleteFileA(FilePath.c_str());
+
+    // The file doesn't exist, so it's created as a sparse file.
+    WNBD_FILE_OPTIONS FileOptions = { 0 };
+    FilePath.copy(FileOptions.Path, MAX_PATH - 1);
+    FileOptions.QueueDepth = 4;
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOfflineFile(
+        &WnbdProps, &FileOptions, RecordOfflineResponse,
+        &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't create offline file disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineFile)> DiskCloser(
+        Disk, &WnbdCloseOfflineFile);
+
+    WIN32_FILE_ATTRIBUTE_DATA FileInfo = { 0 };
+    ASSERT_TRUE(GetFileAttributesExA(
+        FilePath.c_str(), GetFileExInfoStandard, &FileInfo));
+    EXPECT_TRUE(FileInfo.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE);
+    EXPECT_EQ(DefaultBlockCount * DefaultBlockSize,
+              ((UINT64) FileInfo.nFileSizeHigh << 32) |
+              FileInfo.nFileSizeLow);
+    EXPECT_TRUE(Disk->Properties.Flags.UnmapSupported);
+    EXPECT_TRUE(Disk->Properties.Flags.FlushSupported);
+
+    // Unbuffered IO requires sector aligned buffers.
+    UINT32 BlockCount = 8;
+    UINT32 BufferSize = BlockCount * WnbdProps.BlockSize;
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> WriteBuffer(
+        (PBYTE) _aligned_malloc(BufferSize, 4096), &_aligned_free);
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> ReadBuffer(
+        (PBYTE) _aligned_malloc(BufferSize, 4096), &_aligned_free);
+    ASSERT_TRUE(WriteBuffer && ReadBuffer);
+    memset(WriteBuffer.get(), WRITE_BYTE_CONTENT, BufferSize);
+
+    WNBD_IO_RESPONSE Response = OfflineWrite(
+        Disk, &Received, 1, 16, BlockCount, WriteBuffer.get(), TRUE);
+    EXPECT_EQ(1ULL, Response.RequestHandle);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    Response = OfflineRead(
+        Disk, &Received, 2, 16, BlockCount, ReadBuffer.get());
+    EXPECT_EQ(2ULL, Response.RequestHandle);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_FALSE(memcmp(WriteBuffer.get(), ReadBuffer.get(), BufferSize));
+
+    Response = OfflineFlush(Disk, &Received, 3);
+    EXPECT_EQ(3ULL, Response.RequestHandle);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    Response = OfflineUnmap(Disk, &Received, 4, 16, BlockCount);
+    EXPECT_EQ(4ULL, Response.RequestHandle);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    // Unmapped ranges read back as zeroes.
+    Response = OfflineRead(
+        Disk, &Received, 5, 16, BlockCount, ReadBuffer.get());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    std::vector<BYTE> Zeroes(BufferSize);
+    EXPECT_FALSE(memcmp(Zeroes.data(), ReadBuffer.get(), BufferSize));
+
+    DiskCloser.reset();
+    EXPECT_TRUE(DeleteFileA(FilePath.c_str()));
+}
+
+TEST(TestRamBackend, OfflineReadWriteUnmap) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOfflineRam(
+        &WnbdProps, RecordOfflineResponse, &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't create offline RAM disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineRam)> DiskCloser(
+        Disk, &WnbdCloseOfflineRam);
+    EXPECT_TRUE(Disk->Properties.Flags.UnmapSupported);
+
+    UINT32 BlockCount = 8;
+    UINT32 BufferSize = BlockCount * WnbdProps.BlockSize;
+    std::vector<BYTE> WriteBuffer(BufferSize, WRITE_BYTE_CONTENT);
+    std::vector<BYTE> ReadBuffer(BufferSize, READ_BYTE_CONTENT);
+    std::vector<BYTE> Zeroes(BufferSize);
+
+    // Untouched chunks read back as zeroes.
+    WNBD_IO_RESPONSE Response = OfflineRead(
+        Disk, &Received, 1, 0, BlockCount, ReadBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(Zeroes, ReadBuffer);
+
+    // Cross a chunk boundary, the chunk size being at least 2MB.
+    UINT64 BlockAddress = (2 << 20) / WnbdProps.BlockSize - BlockCount / 2;
+    Response = OfflineWrite(
+        Disk, &Received, 2, BlockAddress, BlockCount, WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    Response = OfflineRead(
+        Disk, &Received, 3, BlockAddress, BlockCount, ReadBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(WriteBuffer, ReadBuffer);
+
+    // Zero writes and unmap requests clear partially covered chunks.
+    Response = OfflineWrite(
+        Disk, &Received, 4, BlockAddress, BlockCount / 2, Zeroes.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    Response = OfflineUnmap(
+        Disk, &Received, 5, BlockAddress + BlockCount / 2, BlockCount / 2);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    Response = OfflineRead(
+        Disk, &Received, 6, BlockAddress, BlockCount, ReadBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(Zeroes, ReadBuffer);
+}
+
+TEST(TestOverlayBackend, OfflineCopyOnWrite) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    char TempDir[MAX_PATH] = { 0 };
+    ASSERT_TRUE(GetTempPathA(MAX_PATH, TempDir));
+    std::string BasePath = std::string(TempDir) +
+        WnbdProps.InstanceName + ".base.img";
+    std::string DeltaPath = std::string(TempDir) +
+        WnbdProps.InstanceName + ".cow";
+    DeleteFileA(DeltaPath.c_str());
+
+    UINT32 BaseSize = 1 << 20;
+    std::vector<BYTE> BaseData(BaseSize, READ_BYTE_CONTENT);
+    HANDLE BaseFile = CreateFileA(
+        BasePath.c_str(), GENERIC_WRITE, 0, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, BaseFile);
+    DWORD BytesWritten = 0;
+    BOOL Written = WriteFile(
+        BaseFile, BaseData.data(), BaseSize, &BytesWritten, NULL);
+    CloseHandle(BaseFile);
+    ASSERT_TRUE(Written);
+
+    WNBD_OVERLAY_OPTIONS OverlayOptions = { 0 };
+    BasePath.copy(OverlayOptions.BasePath, MAX_PATH - 1);
+    DeltaPath.copy(OverlayOptions.DeltaPath, MAX_PATH - 1);
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOfflineOverlay(
+        &WnbdProps, &OverlayOptions, RecordOfflineResponse,
+        &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't create offline overlay disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineOverlay)> DiskCloser(
+        Disk, &WnbdCloseOfflineOverlay);
+    EXPECT_EQ(BaseSize / WnbdProps.BlockSize, Disk->Properties.BlockCount);
+    EXPECT_FALSE(Disk->Properties.Flags.UnmapSupported);
+
+    // Partially cover two clusters, which have to be copied from the base.
+    UINT32 BlockCount = 8;
+    UINT64 BlockAddress =
+        WNBD_DEFAULT_OVERLAY_CLUSTER_SIZE / WnbdProps.BlockSize -
+        BlockCount / 2;
+    UINT32 BufferSize = BlockCount * WnbdProps.BlockSize;
+    UINT32 ReadBlockCount = BlockCount * 2;
+    UINT32 ReadBufferSize = ReadBlockCount * WnbdProps.BlockSize;
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> WriteBuffer(
+        (PBYTE) _aligned_malloc(BufferSize, 4096), &_aligned_free);
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> ReadBuffer(
+        (PBYTE) _aligned_malloc(ReadBufferSize, 4096), &_aligned_free);
+    ASSERT_TRUE(WriteBuffer && ReadBuffer);
+    memset(WriteBuffer.get(), WRITE_BYTE_CONTENT, BufferSize);
+
+    std::vector<BYTE> Expected(ReadBufferSize, READ_BYTE_CONTENT);
+    memset(Expected.data() + BufferSize / 2, WRITE_BYTE_CONTENT, BufferSize);
+
+    WNBD_IO_RESPONSE Response = OfflineWrite(
+        Disk, &Received, 1, BlockAddress, BlockCount, WriteBuffer.get());
+    EXPECT_EQ(1ULL, Response.RequestHandle);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    Response = OfflineRead(
+        Disk, &Received, 2, BlockAddress - BlockCount / 2, ReadBlockCount,
+        ReadBuffer.get());
+    EXPECT_EQ(2ULL, Response.RequestHandle);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_FALSE(memcmp(Expected.data(), ReadBuffer.get(), ReadBufferSize));
+
+    DiskCloser.reset();
+
+    // The base image is left untouched.
+    BaseFile = CreateFileA(
+        BasePath.c_str(), GENERIC_READ, 0, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, BaseFile);
+    std::vector<BYTE> BaseContent(BaseSize);
+    DWORD BytesRead = 0;
+    EXPECT_TRUE(ReadFile(
+        BaseFile, BaseContent.data(), BaseSize, &BytesRead, NULL));
+    CloseHandle(BaseFile);
+    EXPECT_EQ(BaseData, BaseContent);
+
+    // The allocation bitmap is persisted, the cluster size being
+    // retrieved from the delta file.
+    Status = WnbdCreateOfflineOverlay(
+        &WnbdProps, &OverlayOptions, RecordOfflineResponse,
+        &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't reopen offline overlay disk: "
+                         << WinStrError(Status);
+    DiskCloser.reset(Disk);
+
+    memset(ReadBuffer.get(), 0, ReadBufferSize);
+    Response = OfflineRead(
+        Disk, &Received, 3, BlockAddress - BlockCount / 2, ReadBlockCount,
+        ReadBuffer.get());
+    EXPECT_EQ(3ULL, Response.RequestHandle);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_FALSE(memcmp(Expected.data(), ReadBuffer.get(), ReadBufferSize));
+
+    DiskCloser.reset();
+    EXPECT_TRUE(DeleteFileA(DeltaPath.c_str()));
+    EXPECT_TRUE(DeleteFileA(BasePath.c_str()));
+}
+
+TEST(TestEncryption, OfflineFileKnownAnswer) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    char TempDir[MAX_PATH] = { 0 };
+    ASSERT_TRUE(GetTempPathA(MAX_PATH, TempDir));
+    std::string FilePath = std::string(TempDir) +
+        WnbdProps.InstanceName + ".img";
+    DeleteFileA(FilePath.c_str());
+
+    WNBD_FILE_OPTIONS FileOptions = { 0 };
+    FilePath.copy(FileOptions.Path, MAX_PATH - 1);
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOfflineFile(
+        &WnbdProps, &FileOptions, RecordOfflineResponse,
+        &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't create offline file disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineFile)> DiskCloser(
+        Disk, &WnbdCloseOfflineFile);
+
+    // IEEE 1619 test vector 1: AES-128-XTS, all-zero keys, data
+    // unit 0. Only the first two blocks of the data unit are covered
+    // by the vector, the tweak being updated in the same way.
+    WNBD_ENCRYPTION_OPTIONS EncryptionOptions = { 0 };
+    EncryptionOptions.KeySize = 32;
+    EncryptionOptions.DataUnitSize = 512;
+    Status = WnbdEnableEncryption(Disk, &EncryptionOptions);
+    ASSERT_FALSE(Status) << "couldn't enable encryption: "
+                         << WinStrError(Status);
+    const BYTE Expected[] = {
+        0x91, 0x7c, 0xf6, 0x9e, 0xbd, 0x68, 0xb2, 0xec,
+        0x9b, 0x9f, 0xe9, 0xa3, 0xea, 0xdd, 0xa6, 0x92,
+        0xcd, 0x43, 0xd2, 0xf5, 0x95, 0x98, 0xed, 0x85,
+        0x8c, 0x02, 0xc2, 0x65, 0x2f, 0xbf, 0x92, 0x2e,
+    };
+
+    UINT32 BlockCount = 8;
+    UINT32 BufferSize = BlockCount * WnbdProps.BlockSize;
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> WriteBuffer(
+        (PBYTE) _aligned_malloc(BufferSize, 4096), &_aligned_free);
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> ReadBuffer(
+        (PBYTE) _aligned_malloc(BufferSize, 4096), &_aligned_free);
+    ASSERT_TRUE(WriteBuffer && ReadBuffer);
+    memset(WriteBuffer.get(), 0, BufferSize);
+
+    WNBD_IO_RESPONSE Response = OfflineWrite(
+        Disk, &Received, 1, 0, BlockCount, WriteBuffer.get(), TRUE);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    // The write payload is encrypted in place.
+    EXPECT_FALSE(memcmp(Expected, WriteBuffer.get(), sizeof(Expected)));
+
+    Response = OfflineRead(
+        Disk, &Received, 2, 0, BlockCount, ReadBuffer.get());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    std::vector<BYTE> Zeroes(BufferSize);
+    EXPECT_FALSE(memcmp(Zeroes.data(), ReadBuffer.get(), BufferSize));
+
+    DiskCloser.reset();
+
+    // The file holds the ciphertext.
+    HANDLE File = CreateFileA(
+        FilePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, File);
+    BYTE FileData[sizeof(Expected)] = { 0 };
+    DWORD BytesRead = 0;
+    EXPECT_TRUE(ReadFile(File, FileData, sizeof(FileData), &BytesRead, NULL));
+    CloseHandle(File);
+    EXPECT_EQ(sizeof(FileData), BytesRead);
+    EXPECT_FALSE(memcmp(Expected, FileData, sizeof(Expected)));
+
+    EXPECT_TRUE(DeleteFileA(FilePath.c_str()));
+}
+
+TEST(TestCompression, OfflineRamReadWriteUnmap) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    WNBD_COMPRESSION_OPTIONS CompressionOptions = { 0 };
+    CompressionOptions.Codec = WnbdCompressionFast;
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOfflineCompressedRam(
+        &WnbdProps, &CompressionOptions, RecordOfflineResponse,
+        &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't create offline compressed RAM disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineCompressedRam)>
+        DiskCloser(Disk, &WnbdCloseOfflineCompressedRam);
+    EXPECT_TRUE(Disk->Properties.Flags.UnmapSupported);
+
+    WNBD_COMPRESSION_STATS Stats = { 0 };
+    ASSERT_FALSE(WnbdGetCompressionStats(Disk, &Stats));
+    EXPECT_EQ((UINT64) WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE,
+              Stats.ClusterSize);
+    UINT64 ClusterCount = Stats.ClusterCount;
+    EXPECT_EQ(DefaultBlockCount * DefaultBlockSize / Stats.ClusterSize,
+              ClusterCount);
+    EXPECT_EQ(ClusterCount, Stats.ZeroClusters);
+
+    // Partially cover two clusters, which get merged with the
+    // (zeroed) existing data.
+    UINT32 BlockCount = 8;
+    UINT64 BlockAddress =
+        WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE / WnbdProps.BlockSize -
+        BlockCount / 2;
+    UINT32 BufferSize = BlockCount * WnbdProps.BlockSize;
+    std::vector<BYTE> WriteBuffer(BufferSize);
+    std::vector<BYTE> ReadBuffer(BufferSize, READ_BYTE_CONTENT);
+    std::vector<BYTE> Zeroes(BufferSize);
+    FillCompressible(WriteBuffer.data(), BufferSize, 1);
+
+    WNBD_IO_RESPONSE Response = OfflineWrite(
+        Disk, &Received, 1, BlockAddress, BlockCount, WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    Response = OfflineRead(
+        Disk, &Received, 2, BlockAddress, BlockCount, ReadBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(WriteBuffer, ReadBuffer);
+
+    // Incompressible clusters are stored raw.
+    UINT32 ClusterBlocks =
+        WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE / WnbdProps.BlockSize;
+    std::vector<BYTE> RandomBuffer(WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE);
+    FillRandom(RandomBuffer.data(), RandomBuffer.size(), 2);
+    Response = OfflineWrite(
+        Disk, &Received, 3, ClusterBlocks * 4, ClusterBlocks,
+        RandomBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    ASSERT_FALSE(WnbdGetCompressionStats(Disk, &Stats));
+    EXPECT_EQ(2ULL, Stats.CompressedClusters);
+    EXPECT_EQ(1ULL, Stats.RawClusters);
+    EXPECT_EQ(ClusterCount - 3, Stats.ZeroClusters);
+    EXPECT_LT(Stats.StoredBytes, 3ULL * WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE);
+
+    // The partially written clusters become zero clusters again.
+    Response = OfflineUnmap(Disk, &Received, 4, BlockAddress, BlockCount);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    Response = OfflineRead(
+        Disk, &Received, 5, BlockAddress, BlockCount, ReadBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(Zeroes, ReadBuffer);
+
+    ASSERT_FALSE(WnbdGetCompressionStats(Disk, &Stats));
+    EXPECT_EQ(0ULL, Stats.CompressedClusters);
+    EXPECT_EQ(1ULL, Stats.RawClusters);
+    EXPECT_EQ(ClusterCount - 1, Stats.ZeroClusters);
+    EXPECT_EQ((UINT64) WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE,
+              Stats.StoredBytes);
+}
+
+TEST(TestCompression, OfflineFileReopen) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    char TempDir[MAX_PATH] = { 0 };
+    ASSERT_TRUE(GetTempPathA(MAX_PATH, TempDir));
+    std::string FilePath = std::string(TempDir) +
+        WnbdProps.InstanceName + ".wnbdc";
+    DeleteFileA(FilePath.c_str());
+
+    WNBD_COMPRESSION_OPTIONS CompressionOptions = { 0 };
+    CompressionOptions.Codec = WnbdCompressionHigh;
+    CompressionOptions.ClusterSize = 16384;
+    WNBD_FILE_OPTIONS FileOptions = { 0 };
+    FilePath.copy(FileOptions.Path, MAX_PATH - 1);
+    FileOptions.Compression = &CompressionOptions;
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOfflineFile(
+        &WnbdProps, &FileOptions, RecordOfflineResponse,
+        &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't create compressed file disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineFile)> DiskCloser(
+        Disk, &WnbdCloseOfflineFile);
+
+    UINT32 BlockCount = 256;
+    UINT32 BufferSize = BlockCount * WnbdProps.BlockSize;
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> WriteBuffer(
+        (PBYTE) _aligned_malloc(BufferSize, 4096), &_aligned_free);
+    std::unique_ptr<BYTE, decltype(&_aligned_free)> ReadBuffer(
+        (PBYTE) _aligned_malloc(BufferSize, 4096), &_aligned_free);
+    ASSERT_TRUE(WriteBuffer && ReadBuffer);
+    FillCompressible(WriteBuffer.get(), BufferSize, 3);
+
+    // Rewrite the same range, the previous copies being released
+    // by the flush.
+    for (UINT32 Idx = 0; Idx < 2; Idx++) {
+        WNBD_IO_RESPONSE Response = OfflineWrite(
+            Disk, &Received, Idx + 1, 8, BlockCount, WriteBuffer.get());
+        EXPECT_FALSE(Response.Status.ScsiStatus);
+    }
+
+    WNBD_IO_RESPONSE Response = OfflineFlush(Disk, &Received, 3);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    WNBD_COMPRESSION_STATS Stats = { 0 };
+    ASSERT_FALSE(WnbdGetCompressionStats(Disk, &Stats));
+    EXPECT_EQ(16384ULL, Stats.ClusterSize);
+    // 8 blocks into the first cluster, covering 9 clusters.
+    EXPECT_EQ(9ULL, Stats.CompressedClusters);
+    EXPECT_EQ(0ULL, Stats.RawClusters);
+    EXPECT_LT(Stats.StoredBytes, (UINT64) BufferSize);
+
+    DiskCloser.reset();
+
+    // The index is persisted, the cluster size being retrieved from
+    // the image header.
+    CompressionOptions.ClusterSize = 0;
+    Status = WnbdCreateOfflineFile(
+        &WnbdProps, &FileOptions, RecordOfflineResponse,
+        &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't reopen compressed file disk: "
+                         << WinStrError(Status);
+    DiskCloser.reset(Disk);
+
+    WNBD_COMPRESSION_STATS ReopenedStats = { 0 };
+    ASSERT_FALSE(WnbdGetCompressionStats(Disk, &ReopenedStats));
+    EXPECT_EQ(Stats.ClusterSize, ReopenedStats.ClusterSize);
+    EXPECT_EQ(Stats.CompressedClusters, ReopenedStats.CompressedClusters);
+    EXPECT_EQ(Stats.StoredBytes, ReopenedStats.StoredBytes);
+
+    Response = OfflineRead(
+        Disk, &Received, 4, 8, BlockCount, ReadBuffer.get());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_FALSE(memcmp(WriteBuffer.get(), ReadBuffer.get(), BufferSize));
+
+    DiskCloser.reset();
+    EXPECT_TRUE(DeleteFileA(FilePath.c_str()));
+}
+
+// FUA writes persist their index page, which may also reference
+// clusters stored by previous non FUA writes. The image copy taken
+// before closing the disk only sees the persisted index.
+TEST(TestCompression, OfflineFileFuaIndexPage) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    char TempDir[MAX_PATH] = { 0 };
+    ASSERT_TRUE(GetTempPathA(MAX_PATH, TempDir));
+    std::string FilePath = std::string(TempDir) +
+        WnbdProps.InstanceName + ".wnbdc";
+    std::string CopyPath = FilePath + ".copy";
+    DeleteFileA(FilePath.c_str());
+    DeleteFileA(CopyPath.c_str());
+
+    WNBD_COMPRESSION_OPTIONS CompressionOptions = { 0 };
+    CompressionOptions.Codec = WnbdCompressionFast;
+    CompressionOptions.ClusterSize = 16384;
+    WNBD_FILE_OPTIONS FileOptions = { 0 };
+    FilePath.copy(FileOptions.Path, MAX_PATH - 1);
+    FileOptions.Compression = &CompressionOptions;
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOfflineFile(
+        &WnbdProps, &FileOptions, RecordOfflineResponse,
+        &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't create compressed file disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineFile)> DiskCloser(
+        Disk, &WnbdCloseOfflineFile);
+
+    // One cluster per write, all of them sharing the first index page.
+    UINT32 BlockCount = 16384 / WnbdProps.BlockSize;
+    UINT32 BufferSize = BlockCount * WnbdProps.BlockSize;
+    auto AllocBuffer = [BufferSize]() {
+        return std::unique_ptr<BYTE, decltype(&_aligned_free)>(
+            (PBYTE) _aligned_malloc(BufferSize, 4096), &_aligned_free);
+    };
+    auto FirstBuffer = AllocBuffer();
+    auto SecondBuffer = AllocBuffer();
+    auto FuaBuffer = AllocBuffer();
+    auto ReadBuffer = AllocBuffer();
+    ASSERT_TRUE(FirstBuffer && SecondBuffer && FuaBuffer && ReadBuffer);
+    FillCompressible(FirstBuffer.get(), BufferSize, 5);
+    FillCompressible(SecondBuffer.get(), BufferSize, 6);
+    FillCompressible(FuaBuffer.get(), BufferSize, 7);
+
+    WNBD_IO_RESPONSE Response = OfflineWrite(
+        Disk, &Received, 1, 0, BlockCount, FirstBuffer.get());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    Response = OfflineFlush(Disk, &Received, 2);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    // Interleave a non FUA rewrite and a FUA write within the same
+    // index page. The latter persists both entries.
+    Response = OfflineWrite(
+        Disk, &Received, 3, 0, BlockCount, SecondBuffer.get());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    Response = OfflineWrite(
+        Disk, &Received, 4, BlockCount, BlockCount, FuaBuffer.get(), TRUE);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    // The first copy gets released by the flush, its space being reused
+    // by the following write, which isn't persisted by the index.
+    Response = OfflineFlush(Disk, &Received, 5);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    Response = OfflineWrite(
+        Disk, &Received, 6, BlockCount * 2, BlockCount, FirstBuffer.get());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    ASSERT_TRUE(CopyFileA(FilePath.c_str(), CopyPath.c_str(), FALSE));
+    DiskCloser.reset();
+
+    memset(FileOptions.Path, 0, sizeof(FileOptions.Path));
+    CopyPath.copy(FileOptions.Path, MAX_PATH - 1);
+    CompressionOptions.ClusterSize = 0;
+    Status = WnbdCreateOfflineFile(
+        &WnbdProps, &FileOptions, RecordOfflineResponse,
+        &Received, &Disk);
+    ASSERT_FALSE(Status) << "couldn't open compressed image copy: "
+                         << WinStrError(Status);
+    DiskCloser.reset(Disk);
+
+    Response = OfflineRead(
+        Disk, &Received, 7, 0, BlockCount, ReadBuffer.get());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_FALSE(memcmp(SecondBuffer.get(), ReadBuffer.get(), BufferSize));
+
+    Response = OfflineRead(
+        Disk, &Received, 8, BlockCount, BlockCount, ReadBuffer.get());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_FALSE(memcmp(FuaBuffer.get(), ReadBuffer.get(), BufferSize));
+
+    std::vector<BYTE> Zeroes(BufferSize, 0);
+    Response = OfflineRead(
+        Disk, &Received, 9, BlockCount * 2, BlockCount, ReadBuffer.get());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_FALSE(memcmp(Zeroes.data(), ReadBuffer.get(), BufferSize));
+
+    DiskCloser.reset();
+    EXPECT_TRUE(DeleteFileA(CopyPath.c_str()));
+    EXPECT_TRUE(DeleteFileA(FilePath.c_str()));
+}
+
+// Compressible data is stored using less memory, the Huffman variant
+// getting the better ratio. Incompressible clusters are stored as is.
+TEST(TestCompression, RamCompressionRatio) {
+    const UINT32 IoSize = 64 << 10;
+    const UINT32 QueueDepth = 4;
+    const UINT64 TotalSize = 8ULL << 20;
+
+    std::vector<BYTE> WriteBuffers((size_t) IoSize * QueueDepth);
+    std::vector<BYTE> ReadBuffers((size_t) IoSize * QueueDepth);
+
+    // Returns the compression stats after writing and reading back
+    // the data.
+    auto WriteAndRead = [&](
+            WnbdCompressionCodec Codec, PWNBD_COMPRESSION_STATS Stats) {
+        WNBD_PROPERTIES WnbdProps = { 0 };
+        GetNewWnbdProps(&WnbdProps);
+
+        WNBD_COMPRESSION_OPTIONS CompressionOptions = { 0 };
+        CompressionOptions.Codec = Codec;
+
+        OfflineResponses Received;
+        PWNBD_DISK Disk = nullptr;
+        DWORD Status = WnbdCreateOfflineCompressedRam(
+            &WnbdProps, &CompressionOptions, RecordOfflineResponse,
+            &Received, &Disk);
+        ASSERT_FALSE(Status) << "couldn't create offline compressed "
+                             << "RAM disk: " << WinStrError(Status);
+        std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineCompressedRam)>
+            DiskCloser(Disk, &WnbdCloseOfflineCompressedRam);
+
+        ASSERT_NO_FATAL_FAILURE(SubmitSequentialIo(
+            Disk, &Received, WnbdReqTypeWrite, WriteBuffers.data(),
+            IoSize, QueueDepth, TotalSize));
+        ASSERT_NO_FATAL_FAILURE(SubmitSequentialIo(
+            Disk, &Received, WnbdReqTypeRead, ReadBuffers.data(),
+            IoSize, QueueDepth, TotalSize));
+        EXPECT_EQ(WriteBuffers, ReadBuffers) << "codec: " << Codec;
+        ASSERT_FALSE(WnbdGetCompressionStats(Disk, Stats));
+    };
+
+    FillCompressible(WriteBuffers.data(), WriteBuffers.size(), 4);
+    WNBD_COMPRESSION_STATS FastStats = { 0 };
+    ASSERT_NO_FATAL_FAILURE(WriteAndRead(WnbdCompressionFast, &FastStats));
+    // The LZ only codec may not shrink the random letters enough, in which
+    // case the clusters are stored as is.
+    EXPECT_EQ(TotalSize / FastStats.ClusterSize,
+              FastStats.CompressedClusters + FastStats.RawClusters);
+    EXPECT_LE(FastStats.StoredBytes, TotalSize);
+
+    WNBD_COMPRESSION_STATS HighStats = { 0 };
+    ASSERT_NO_FATAL_FAILURE(WriteAndRead(WnbdCompressionHigh, &HighStats));
+    EXPECT_EQ(TotalSize / HighStats.ClusterSize,
+              HighStats.CompressedClusters);
+    // 16 letter alphabet, 4 bits per byte.
+    EXPECT_LE(HighStats.StoredBytes, TotalSize * 5 / 8);
+    EXPECT_LT(HighStats.StoredBytes, FastStats.StoredBytes);
+
+    FillRandom(WriteBuffers.data(), WriteBuffers.size(), 5);
+    WNBD_COMPRESSION_STATS RandomStats = { 0 };
+    ASSERT_NO_FATAL_FAILURE(WriteAndRead(WnbdCompressionHigh, &RandomStats));
+    EXPECT_EQ(TotalSize / RandomStats.ClusterSize, RandomStats.RawClusters);
+    EXPECT_EQ(0ULL, RandomStats.CompressedClusters);
+    EXPECT_EQ(TotalSize, RandomStats.StoredBytes);
+}
+
+// In-memory offline disk, optionally corrupting the second block
+// when reading it back.
+struct IntegrityTestStorage
+{
+    std::vector<BYTE> Data;
+    bool Corrupt = false;
+};
+
+static void IntegrityTestRead(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle,
+    PVOID Buffer,
+    UINT64 BlockAddress,
+    UINT32 BlockCount,
+    BOOLEAN ForceUnitAccess)
+{
+    IntegrityTestStorage* Storage = (IntegrityTestStorage*) Disk->Context;
+    UINT32 BlockSize = Disk->Properties.BlockSize;
+    memcpy(Buffer, Storage->Data.data() + BlockAddress * BlockSize,
+           BlockCount * BlockSize);
+    if (Storage->Corrupt && BlockAddress <= 1 &&
+            BlockAddress + BlockCount > 1) {
+        ((PBYTE) Buffer)[(1 - BlockAddress) * BlockSize] ^= 0x01;
+    }
+
+    WNBD_IO_RESPONSE Response = { 0 };
+    Response.RequestHandle = RequestHandle;
+    Response.RequestType = WnbdReqTypeRead;
+    WnbdSendResponse(Disk, &Response, Buffer, BlockCount * BlockSize);
+}
+
+static void IntegrityTestWrite(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle,
+    PVOID Buffer,
+    UINT64 BlockAddress,
+    UINT32 BlockCount,
+    BOOLEAN ForceUnitAccess)
+{
+    IntegrityTestStorage* Storage = (IntegrityTestStorage*) Disk->Context;
+    UINT32 BlockSize = Disk->Properties.BlockSize;
+    memcpy(Storage->Data.data() + BlockAddress * BlockSize, Buffer,
+           BlockCount * BlockSize);
+
+    WNBD_IO_RESPONSE Response = { 0 };
+    Response.RequestHandle = RequestHandle;
+    Response.RequestType = WnbdReqTypeWrite;
+    WnbdSendResponse(Disk, &Response, nullptr, 0);
+}
+
+static PWNBD_DISK CreateIntegrityTestDisk(
+    PWNBD_PROPERTIES WnbdProps,
+    PWNBD_INTERFACE Interface,
+    IntegrityTestStorage* Storage,
+    OfflineResponses* Received,
+    PCSTR SidecarPath)
+{
+    PWNBD_DISK Disk = nullptr;
+    DWORD Status = WnbdCreateOffline(
+        WnbdProps, Interface, Storage,
+        RecordOfflineResponse, Received, &Disk);
+    EXPECT_FALSE(Status) << "couldn't create offline disk: "
+                         << WinStrError(Status);
+    if (Status) {
+        return nullptr;
+    }
+
+    WNBD_INTEGRITY_OPTIONS IntegrityOptions = { 0 };
+    strncpy_s(IntegrityOptions.SidecarPath, SidecarPath, _TRUNCATE);
+    Status = WnbdEnableIntegrity(Disk, &IntegrityOptions);
+    EXPECT_FALSE(Status) << "couldn't enable integrity checks: "
+                         << WinStrError(Status);
+    if (Status) {
+        WnbdClose(Disk);
+        return nullptr;
+    }
+    return Disk;
+}
+
+TEST(TestIntegrity, OfflineDetectsCorruption) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+    WnbdProps.BlockCount = 64;
+
+    WNBD_INTERFACE Interface = { 0 };
+    Interface.Read = IntegrityTestRead;
+    Interface.Write = IntegrityTestWrite;
+    IntegrityTestStorage Storage;
+    Storage.Data.resize(WnbdProps.BlockCount * WnbdProps.BlockSize);
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = CreateIntegrityTestDisk(
+        &WnbdProps, &Interface, &Storage, &Received, "");
+    ASSERT_TRUE(Disk);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdClose)> DiskCloser(
+        Disk, &WnbdClose);
+
+    UINT32 BlockCount = 8;
+    UINT32 BufferSize = BlockCount * WnbdProps.BlockSize;
+    std::vector<BYTE> WriteBuffer(BufferSize);
+    std::vector<BYTE> ReadBuffer(BufferSize);
+    FillRandom(WriteBuffer.data(), BufferSize, 5);
+
+    // Blocks that weren't written yet can't be verified.
+    OfflineRead(Disk, &Received, 1, 0, BlockCount, ReadBuffer.data());
+    OfflineWrite(Disk, &Received, 2, 0, BlockCount, WriteBuffer.data());
+    OfflineRead(Disk, &Received, 3, 0, BlockCount, ReadBuffer.data());
+    ASSERT_EQ(3ULL, Received.Responses.size());
+    EXPECT_FALSE(Received.Responses[0].Status.ScsiStatus);
+    EXPECT_FALSE(Received.Responses[1].Status.ScsiStatus);
+    EXPECT_FALSE(Received.Responses[2].Status.ScsiStatus);
+    EXPECT_EQ(WriteBuffer, ReadBuffer);
+
+    WNBD_INTEGRITY_STATS Stats = { 0 };
+    ASSERT_FALSE(WnbdGetIntegrityStats(Disk, &Stats));
+    EXPECT_EQ((UINT64) BlockCount, Stats.TrackedBlocks);
+    EXPECT_EQ((UINT64) BlockCount, Stats.UnverifiedBlocks);
+    EXPECT_EQ((UINT64) BlockCount, Stats.VerifiedBlocks);
+    EXPECT_EQ(0ULL, Stats.ChecksumErrors);
+
+    // The corrupted block gets reported through the sense data.
+    Storage.Corrupt = true;
+    OfflineRead(Disk, &Received, 4, 0, BlockCount, ReadBuffer.data());
+    ASSERT_EQ(4ULL, Received.Responses.size());
+    WNBD_STATUS ReadStatus = Received.Responses[3].Status;
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION, ReadStatus.ScsiStatus);
+    EXPECT_EQ(SCSI_SENSE_MEDIUM_ERROR, ReadStatus.SenseKey);
+    EXPECT_TRUE(ReadStatus.InformationValid);
+    EXPECT_EQ(1ULL, ReadStatus.Information);
+
+    ASSERT_FALSE(WnbdGetIntegrityStats(Disk, &Stats));
+    EXPECT_EQ(1ULL, Stats.ChecksumErrors);
+    EXPECT_EQ(BlockCount * 2ULL - 1, Stats.VerifiedBlocks);
+
+    WNBD_USR_STATS UsrStats = { 0 };
+    ASSERT_FALSE(WnbdGetUserspaceStats(Disk, &UsrStats));
+    EXPECT_EQ(1ULL, UsrStats.ReadErrors);
+}
+
+TEST(TestIntegrity, SidecarFile) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+    WnbdProps.BlockCount = 64;
+
+    char TempDir[MAX_PATH] = { 0 };
+    ASSERT_TRUE(GetTempPathA(MAX_PATH, TempDir));
+    std::string SidecarPath = std::string(TempDir) +
+        WnbdProps.InstanceName + ".crc";
+    DeleteFileA(SidecarPath.c_str());
+
+    WNBD_INTERFACE Interface = { 0 };
+    Interface.Read = IntegrityTestRead;
+    Interface.Write = IntegrityTestWrite;
+    IntegrityTestStorage Storage;
+    Storage.Data.resize(WnbdProps.BlockCount * WnbdProps.BlockSize);
+
+    OfflineResponses Received;
+    PWNBD_DISK Disk = CreateIntegrityTestDisk(
+        &WnbdProps, &Interface, &Storage, &Received, SidecarPath.c_str());
+    ASSERT_TRUE(Disk);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdClose)> DiskCloser(
+        Disk, &WnbdClose);
+
+    UINT32 BlockCount = 8;
+    std::vector<BYTE> Buffer(BlockCount * WnbdProps.BlockSize);
+    FillRandom(Buffer.data(), Buffer.size(), 6);
+    OfflineWrite(Disk, &Received, 1, 0, BlockCount, Buffer.data());
+    ASSERT_EQ(1ULL, Received.Responses.size());
+    EXPECT_FALSE(Received.Responses[0].Status.ScsiStatus);
+
+    // The checksums are persisted when closing the disk.
+    DiskCloser.reset();
+    Disk = CreateIntegrityTestDisk(
+        &WnbdProps, &Interface, &Storage, &Received, SidecarPath.c_str());
+    ASSERT_TRUE(Disk);
+    DiskCloser.reset(Disk);
+
+    WNBD_INTEGRITY_STATS Stats = { 0 };
+    ASSERT_FALSE(WnbdGetIntegrityStats(Disk, &Stats));
+    EXPECT_EQ((UINT64) BlockCount, Stats.TrackedBlocks);
+
+    Storage.Corrupt = true;
+    OfflineRead(Disk, &Received, 2, 0, BlockCount, Buffer.data());
+    ASSERT_EQ(2ULL, Received.Responses.size());
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION,
+              Received.Responses[1].Status.ScsiStatus);
+
+    // The sidecar file is marked as in use while the disk is open, so
+    // the checksums are discarded if the disk isn't closed cleanly.
+    HANDLE Sidecar = CreateFileA(
+        SidecarPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    EXPECT_EQ(INVALID_HANDLE_VALUE, Sidecar);
+    if (Sidecar != INVALID_HANDLE_VALUE) {
+        CloseHandle(Sidecar);
+    }
+
+    DiskCloser.reset();
+    EXPECT_TRUE(DeleteFileA(SidecarPath.c_str()));
+}
+
+// Starts in-memory NBD exports, used as stripe or mirror members. The
+// member size is specified through the disk properties.
+static void StartNbdMembers(
+    PWNBD_PROPERTIES WnbdProps,
+    UINT32 MemberCount,
+    std::vector<std::unique_ptr<MockNbdServer>>& Servers,
+    std::vector<NBD_CONNECTION_PROPERTIES>& Members)
+{
+    // The NBD negotiation is skipped, so the export capabilities are
+    // passed through the disk properties.
+    WnbdProps->Flags.FlushSupported = 1;
+    WnbdProps->Flags.UnmapSupported = 1;
+
+    Members.resize(MemberCount);
+    for (UINT32 Index = 0; Index < MemberCount; Index++) {
+        Servers.push_back(std::make_unique<MockNbdServer>(
+            WnbdProps->BlockCount * WnbdProps->BlockSize));
+        ASSERT_NO_FATAL_FAILURE(Servers.back()->Start());
+        Servers.back()->GetConnectionProperties(&Members[Index]);
+    }
+}
+
+static size_t CountNbdRequests(
+    MockNbdServer* Server, WnbdRequestType RequestType)
+{
+    size_t Count = 0;
+    for (const MockNbdRequest& Request : Server->GetRequests()) {
+        Count += Request.RequestType == RequestType;
+    }
+    return Count;
+}
+
+class TestStripeBackend : public ::testing::Test
+{
+protected:
+    static const UINT32 MemberCount = 3;
+    static const UINT32 StripeSize = 4096;
+    static const UINT32 MemberSize = StripeSize * 16;
+
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    std::vector<std::unique_ptr<MockNbdServer>> Servers;
+    OfflineResponses Received;
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineStripe)> Disk{
+        nullptr, &WnbdCloseOfflineStripe};
+
+    void SetUp() override
+    {
+        GetNewWnbdProps(&WnbdProps);
+        WnbdProps.BlockCount = MemberSize / WnbdProps.BlockSize;
+
+        std::vector<NBD_CONNECTION_PROPERTIES> Members;
+        ASSERT_NO_FATAL_FAILURE(StartNbdMembers(
+            &WnbdProps, MemberCount, Servers, Members));
+
+        WNBD_STRIPE_OPTIONS StripeOptions = { 0 };
+        StripeOptions.StripeSize = StripeSize;
+        PWNBD_DISK StripeDisk = nullptr;
+        DWORD Status = WnbdCreateOfflineStripe(
+            &WnbdProps, Members.data(), MemberCount, &StripeOptions,
+            RecordOfflineResponse, &Received, &StripeDisk);
+        ASSERT_FALSE(Status) << "couldn't create offline stripe disk: "
+                             << WinStrError(Status);
+        Disk.reset(StripeDisk);
+        EXPECT_EQ((UINT64) MemberSize * MemberCount / WnbdProps.BlockSize,
+                  Disk->Properties.BlockCount);
+    }
+
+    // Fills the member with a byte that identifies it.
+    void FillMember(UINT32 Member)
+    {
+        std::vector<BYTE> Data(MemberSize, (BYTE) (0xa0 + Member));
+        Servers[Member]->WriteData(Data.data(), 0, MemberSize);
+    }
+};
+
+TEST_F(TestStripeBackend, CrossStripeBoundaries) {
+    // Start in the middle of the first stripe and end in the middle
+    // of the fifth one, which wraps around to the second member.
+    UINT64 Offset = StripeSize / 2;
+    UINT32 Length = StripeSize * 4;
+    std::vector<BYTE> WriteBuffer(Length);
+    FillRandom(WriteBuffer.data(), Length, 7);
+
+    UINT32 BlockSize = WnbdProps.BlockSize;
+    WNBD_IO_RESPONSE Response = OfflineWrite(
+        Disk.get(), &Received, 1, Offset / BlockSize, Length / BlockSize,
+        WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    // Stripe N is stored by member N % MemberCount, at offset
+    // (N / MemberCount) * StripeSize.
+    struct {
+        UINT32 Member;
+        UINT64 MemberOffset;
+        UINT32 Length;
+    } Expected[] = {
+        { 0, StripeSize / 2, StripeSize / 2 },
+        { 1, 0, StripeSize },
+        { 2, 0, StripeSize },
+        { 0, StripeSize, StripeSize },
+        { 1, StripeSize, StripeSize / 2 },
+    };
+    UINT32 BufferOffset = 0;
+    for (auto& Part : Expected) {
+        std::vector<BYTE> MemberData(Part.Length);
+        Servers[Part.Member]->ReadData(
+            MemberData.data(), Part.MemberOffset, Part.Length);
+        EXPECT_FALSE(memcmp(WriteBuffer.data() + BufferOffset,
+                            MemberData.data(), Part.Length))
+            << "unexpected data, member: " << Part.Member
+            << ", offset: " << Part.MemberOffset;
+        BufferOffset += Part.Length;
+    }
+    EXPECT_EQ(2U, CountNbdRequests(Servers[0].get(), WnbdReqTypeWrite));
+    EXPECT_EQ(2U, CountNbdRequests(Servers[1].get(), WnbdReqTypeWrite));
+    EXPECT_EQ(1U, CountNbdRequests(Servers[2].get(), WnbdReqTypeWrite));
+
+    std::vector<BYTE> ReadBuffer(Length);
+    Response = OfflineRead(
+        Disk.get(), &Received, 2, Offset / BlockSize, Length / BlockSize,
+        ReadBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(WriteBuffer, ReadBuffer);
+    EXPECT_EQ(2U, CountNbdRequests(Servers[0].get(), WnbdReqTypeRead));
+    EXPECT_EQ(2U, CountNbdRequests(Servers[1].get(), WnbdReqTypeRead));
+    EXPECT_EQ(1U, CountNbdRequests(Servers[2].get(), WnbdReqTypeRead));
+
+    // Requests within a single stripe go to one member.
+    Response = OfflineRead(
+        Disk.get(), &Received, 3, StripeSize * 2 / BlockSize,
+        StripeSize / BlockSize, ReadBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_FALSE(memcmp(WriteBuffer.data() + StripeSize * 3 / 2,
+                        ReadBuffer.data(), StripeSize));
+    EXPECT_EQ(2U, CountNbdRequests(Servers[2].get(), WnbdReqTypeRead));
+}
+
+TEST_F(TestStripeBackend, FlushAndUnmapFanOut) {
+    for (UINT32 Member = 0; Member < MemberCount; Member++) {
+        FillMember(Member);
+    }
+
+    WNBD_IO_RESPONSE Response = OfflineFlush(Disk.get(), &Received, 1);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    for (auto& Server : Servers) {
+        EXPECT_EQ(1U, CountNbdRequests(Server.get(), WnbdReqTypeFlush));
+    }
+
+    // Stripes 1 to 4, the ranges being contiguous on each member.
+    UINT32 BlockSize = WnbdProps.BlockSize;
+    Response = OfflineUnmap(
+        Disk.get(), &Received, 2, StripeSize / BlockSize,
+        StripeSize * 4 / BlockSize);
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    struct {
+        UINT64 Offset;
+        UINT32 Length;
+    } Expected[MemberCount] = {
+        { StripeSize, StripeSize },
+        { 0, StripeSize * 2 },
+        { 0, StripeSize },
+    };
+    for (UINT32 Member = 0; Member < MemberCount; Member++) {
+        std::vector<MockNbdRequest> Requests = Servers[Member]->GetRequests();
+        ASSERT_EQ(2U, Requests.size());
+        EXPECT_EQ(WnbdReqTypeUnmap, Requests[1].RequestType);
+        EXPECT_EQ(Expected[Member].Offset, Requests[1].Offset);
+        EXPECT_EQ(Expected[Member].Length, Requests[1].Length);
+
+        // The rest of the member data is left untouched.
+        std::vector<BYTE> MemberData(MemberSize);
+        Servers[Member]->ReadData(MemberData.data(), 0, MemberSize);
+        for (UINT32 Offset = 0; Offset < MemberSize; Offset += StripeSize) {
+            bool Unmapped = Offset >= Expected[Member].Offset &&
+                Offset < Expected[Member].Offset + Expected[Member].Length;
+            EXPECT_EQ(Unmapped ? 0U : 0xa0 + Member,
+                      (UINT32) MemberData[Offset])
+                << "member: " << Member << ", offset: " << Offset;
+        }
+    }
+}
+
+TEST_F(TestStripeBackend, MemberErrorPropagation) {
+    UINT32 BlockSize = WnbdProps.BlockSize;
+    UINT32 Length = StripeSize * MemberCount;
+    std::vector<BYTE> Buffer(Length, WRITE_BYTE_CONTENT);
+
+    // A single failed part fails the whole request, the other parts
+    // being waited for.
+    Servers[1]->FailRequests(WnbdReqTypeWrite, 1);
+    WNBD_IO_RESPONSE Response = OfflineWrite(
+        Disk.get(), &Received, 1, 0, Length / BlockSize, Buffer.data());
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION, Response.Status.ScsiStatus);
+    EXPECT_EQ(SCSI_SENSE_MEDIUM_ERROR, Response.Status.SenseKey);
+    for (auto& Server : Servers) {
+        EXPECT_EQ(1U, CountNbdRequests(Server.get(), WnbdReqTypeWrite));
+    }
+
+    Response = OfflineWrite(
+        Disk.get(), &Received, 2, 0, Length / BlockSize, Buffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    Servers[2]->FailRequests(WnbdReqTypeRead, 1);
+    Response = OfflineRead(
+        Disk.get(), &Received, 3, 0, Length / BlockSize, Buffer.data());
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION, Response.Status.ScsiStatus);
+
+    Servers[0]->FailRequests(WnbdReqTypeFlush, 1);
+    Response = OfflineFlush(Disk.get(), &Received, 4);
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION, Response.Status.ScsiStatus);
+    for (auto& Server : Servers) {
+        EXPECT_EQ(1U, CountNbdRequests(Server.get(), WnbdReqTypeFlush));
+    }
+
+    Servers[1]->FailRequests(WnbdReqTypeUnmap, 1);
+    Response = OfflineUnmap(
+        Disk.get(), &Received, 5, 0, Length / BlockSize);
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION, Response.Status.ScsiStatus);
+
+    WNBD_USR_STATS Stats = { 0 };
+    ASSERT_FALSE(WnbdGetUserspaceStats(Disk.get(), &Stats));
+    EXPECT_EQ(1ULL, Stats.ReadErrors);
+    EXPECT_EQ(1ULL, Stats.WriteErrors);
+    EXPECT_EQ(1ULL, Stats.FlushErrors);
+    EXPECT_EQ(1ULL, Stats.UnmapErrors);
+}
+
+// Offline NBD disk requests that are still pending when the connection
+// gets closed are failed through the regular response path.
+TEST(TestNbdBackend, PendingRequestsFailedOnDisconnect) {
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    GetNewWnbdProps(&WnbdProps);
+
+    std::vector<std::unique_ptr<MockNbdServer>> Servers;
+    std::vector<NBD_CONNECTION_PROPERTIES> Members;
+    ASSERT_NO_FATAL_FAILURE(StartNbdMembers(
+        &WnbdProps, 1, Servers, Members));
+    WnbdProps.NbdProperties = Members[0];
+
+    OfflineResponses Received;
+    PWNBD_DISK NbdDisk = nullptr;
+    DWORD Status = WnbdCreateOfflineNbd(
+        &WnbdProps, RecordOfflineResponse, &Received, &NbdDisk);
+    ASSERT_FALSE(Status) << "couldn't create offline NBD disk: "
+                         << WinStrError(Status);
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineNbd)> Disk{
+        NbdDisk, &WnbdCloseOfflineNbd};
+
+    std::vector<BYTE> Buffer(WnbdProps.BlockSize, WRITE_BYTE_CONTENT);
+    WNBD_IO_REQUEST Request = { 0 };
+    Request.RequestHandle = 1;
+    Request.RequestType = WnbdReqTypeWrite;
+    Request.Cmd.Write.BlockCount = 1;
+
+    // The request never gets a reply.
+    Servers[0]->Pause();
+    Status = WnbdSubmitRequest(Disk.get(), &Request, Buffer.data());
+    ASSERT_FALSE(Status) << "couldn't submit request: "
+                         << WinStrError(Status);
+    Servers[0]->Stop();
+
+    WNBD_IO_RESPONSE Response = Received.WaitResponse(1);
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION, Response.Status.ScsiStatus);
+    EXPECT_EQ(SCSI_SENSE_NOT_READY, Response.Status.SenseKey);
+
+    WNBD_USR_STATS Stats = { 0 };
+    ASSERT_FALSE(WnbdGetUserspaceStats(Disk.get(), &Stats));
+    EXPECT_EQ(1ULL, Stats.WriteErrors);
+    EXPECT_EQ(1ULL, Stats.TotalReceivedReplies);
+    EXPECT_EQ(0ULL, Stats.PendingSubmittedRequests);
+}
+
+class TestMirrorBackend : public ::testing::Test
+{
+protected:
+    static const UINT32 ReplicaSize = 64 * 1024;
+
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    WNBD_MIRROR_OPTIONS MirrorOptions = { 0 };
+    std::vector<std::unique_ptr<MockNbdServer>> Servers;
+    std::vector<NBD_CONNECTION_PROPERTIES> Replicas;
+    OfflineResponses Received;
+    UINT64 NextHandle = 1;
+    std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineMirror)> Disk{
+        nullptr, &WnbdCloseOfflineMirror};
+
+    void TearDown() override
+    {
+        // Paused replicas would prevent the mirror from closing.
+        for (auto& Server : Servers) {
+            Server->Resume();
+        }
+        Disk.reset();
+    }
+
+    void StartReplicas(UINT32 ReplicaCount)
+    {
+        GetNewWnbdProps(&WnbdProps);
+        WnbdProps.BlockCount = ReplicaSize / WnbdProps.BlockSize;
+        ASSERT_NO_FATAL_FAILURE(StartNbdMembers(
+            &WnbdProps, ReplicaCount, Servers, Replicas));
+    }
+
+    // Closes the previous mirror disk, if any. The replicas are reused.
+    void OpenMirror()
+    {
+        Disk.reset();
+
+        PWNBD_DISK MirrorDisk = nullptr;
+        DWORD Status = WnbdCreateOfflineMirror(
+            &WnbdProps, Replicas.data(), (UINT32) Replicas.size(),
+            &MirrorOptions, RecordOfflineResponse, &Received, &MirrorDisk);
+        ASSERT_FALSE(Status) << "couldn't create offline mirror disk: "
+                             << WinStrError(Status);
+        Disk.reset(MirrorDisk);
+        EXPECT_EQ(WnbdProps.BlockCount, Disk->Properties.BlockCount);
+    }
+
+    WNBD_IO_RESPONSE Read(UINT64 Offset, UINT32 Length, PVOID Buffer)
+    {
+        return OfflineRead(
+            Disk.get(), &Received, NextHandle++,
+            Offset / WnbdProps.BlockSize, Length / WnbdProps.BlockSize,
+            Buffer);
+    }
+
+    WNBD_IO_RESPONSE Write(UINT64 Offset, UINT32 Length, PVOID Buffer)
+    {
+        return OfflineWrite(
+            Disk.get(), &Received, NextHandle++,
+            Offset / WnbdProps.BlockSize, Length / WnbdProps.BlockSize,
+            Buffer);
+    }
+};
+
+static size_t CountFailedNbdRequests(
+    MockNbdServer* Server, WnbdRequestType RequestType)
+{
+    size_t Count = 0;
+    for (const MockNbdRequest& Request : Server->GetRequests()) {
+        Count += Request.RequestType == RequestType && Request.Failed;
+    }
+    return Count;
+}
+
+TEST_F(TestMirrorBackend, WriteQuorum) {
+    ASSERT_NO_FATAL_FAILURE(StartReplicas(3));
+    MirrorOptions.WriteQuorum = 2;
+    ASSERT_NO_FATAL_FAILURE(OpenMirror());
+
+    UINT32 Length = 8192;
+    std::vector<BYTE> WriteBuffer(Length);
+    FillRandom(WriteBuffer.data(), Length, 11);
+
+    // The write is acknowledged once two replicas complete it.
+    Servers[2]->Pause();
+    WNBD_IO_RESPONSE Response = Write(0, Length, WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    std::vector<BYTE> ReplicaData(Length);
+    for (UINT32 Index = 0; Index < 2; Index++) {
+        Servers[Index]->ReadData(ReplicaData.data(), 0, Length);
+        EXPECT_EQ(WriteBuffer, ReplicaData) << "replica: " << Index;
+    }
+    EXPECT_TRUE(Servers[2]->GetRequests().empty());
+
+    // The remaining replica catches up in the background.
+    Servers[2]->Resume();
+    ASSERT_TRUE(Servers[2]->WaitRequests(1));
+    Servers[2]->ReadData(ReplicaData.data(), 0, Length);
+    EXPECT_EQ(WriteBuffer, ReplicaData);
+
+    // The quorum can't be reached once two replicas fail.
+    Servers[1]->FailRequests(WnbdReqTypeWrite, 1);
+    Servers[2]->FailRequests(WnbdReqTypeWrite, 1);
+    Response = Write(0, Length, WriteBuffer.data());
+    EXPECT_EQ(SCSISTAT_CHECK_CONDITION, Response.Status.ScsiStatus);
+}
+
+TEST_F(TestMirrorBackend, LaggingReplicaWriteOrder) {
+    ASSERT_NO_FATAL_FAILURE(StartReplicas(3));
+    MirrorOptions.WriteQuorum = 2;
+    ASSERT_NO_FATAL_FAILURE(OpenMirror());
+
+    UINT32 Length = 8192;
+    std::vector<BYTE> First(Length);
+    std::vector<BYTE> Second(Length / 2);
+    FillRandom(First.data(), First.size(), 21);
+    FillRandom(Second.data(), Second.size(), 22);
+    std::vector<BYTE> Expected = First;
+    memcpy(Expected.data(), Second.data(), Second.size());
+
+    // Both writes are acknowledged while the last replica lags behind.
+    Servers[2]->Pause();
+    WNBD_IO_RESPONSE Response = Write(0, Length, First.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    Response = Write(0, Length / 2, Second.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    // Overlapping reads avoid the lagging replica.
+    std::vector<BYTE> ReadBuffer(Length);
+    Response = Read(0, Length, ReadBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(Expected, ReadBuffer);
+
+    // The lagging replica receives the overlapping writes in order.
+    Servers[2]->Resume();
+    ASSERT_TRUE(Servers[2]->WaitRequests(2));
+    std::vector<MockNbdRequest> Requests = Servers[2]->GetRequests();
+    ASSERT_EQ(2U, Requests.size());
+    EXPECT_EQ(WnbdReqTypeWrite, Requests[0].RequestType);
+    EXPECT_EQ(Length, Requests[0].Length);
+    EXPECT_EQ(WnbdReqTypeWrite, Requests[1].RequestType);
+    EXPECT_EQ(Length / 2, Requests[1].Length);
+
+    Servers[2]->ReadData(ReadBuffer.data(), 0, Length);
+    EXPECT_EQ(Expected, ReadBuffer);
+}
+
+TEST_F(TestMirrorBackend, ReadBalancing) {
+    ASSERT_NO_FATAL_FAILURE(StartReplicas(2));
+    ASSERT_NO_FATAL_FAILURE(OpenMirror());
+
+    UINT32 Length = 8192;
+    std::vector<BYTE> WriteBuffer(Length);
+    FillRandom(WriteBuffer.data(), Length, 31);
+    WNBD_IO_RESPONSE Response = Write(0, Length, WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    std::vector<BYTE> ReadBuffer(Length);
+    for (UINT32 Index = 0; Index < 4; Index++) {
+        Response = Read(0, Length, ReadBuffer.data());
+        EXPECT_FALSE(Response.Status.ScsiStatus);
+        EXPECT_EQ(WriteBuffer, ReadBuffer);
+    }
+
+    // Idle replicas take turns serving the reads.
+    EXPECT_EQ(2U, CountNbdRequests(Servers[0].get(), WnbdReqTypeRead));
+    EXPECT_EQ(2U, CountNbdRequests(Servers[1].get(), WnbdReqTypeRead));
+}
+
+TEST_F(TestMirrorBackend, ReadFailover) {
+    ASSERT_NO_FATAL_FAILURE(StartReplicas(2));
+    ASSERT_NO_FATAL_FAILURE(OpenMirror());
+
+    UINT32 Length = 8192;
+    std::vector<BYTE> WriteBuffer(Length);
+    FillRandom(WriteBuffer.data(), Length, 41);
+    WNBD_IO_RESPONSE Response = Write(0, Length, WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+
+    // The first read goes to the first replica and gets retried using
+    // the second one.
+    std::vector<BYTE> ReadBuffer(Length);
+    Servers[0]->FailRequests(WnbdReqTypeRead, 1);
+    Response = Read(0, Length, ReadBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(WriteBuffer, ReadBuffer);
+    EXPECT_EQ(1U, CountFailedNbdRequests(Servers[0].get(), WnbdReqTypeRead));
+    EXPECT_EQ(1U, CountNbdRequests(Servers[1].get(), WnbdReqTypeRead));
+
+    // A single read error doesn't drop the replica.
+    Response = Write(0, Length, WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(2U, CountNbdRequests(Servers[0].get(), WnbdReqTypeWrite));
+
+    // Three consecutive read errors do.
+    Servers[0]->FailRequests(WnbdReqTypeRead, 100);
+    for (UINT32 Index = 0; Index < 8; Index++) {
+        Response = Read(0, Length, ReadBuffer.data());
+        EXPECT_FALSE(Response.Status.ScsiStatus);
+        EXPECT_EQ(WriteBuffer, ReadBuffer);
+    }
+    EXPECT_EQ(3U, CountFailedNbdRequests(Servers[0].get(), WnbdReqTypeRead));
+    EXPECT_EQ(3U, CountNbdRequests(Servers[0].get(), WnbdReqTypeRead));
+
+    Response = Write(0, Length, WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(2U, CountNbdRequests(Servers[0].get(), WnbdReqTypeWrite));
+    EXPECT_EQ(3U, CountNbdRequests(Servers[1].get(), WnbdReqTypeWrite));
+}
+
+TEST_F(TestMirrorBackend, StaleReplicaResync) {
+    ASSERT_NO_FATAL_FAILURE(StartReplicas(2));
+
+    char TempDir[MAX_PATH] = { 0 };
+    ASSERT_TRUE(GetTempPathA(MAX_PATH, TempDir));
+    std::string StatePath = std::string(TempDir) +
+        WnbdProps.InstanceName + ".mirror";
+    DeleteFileA(StatePath.c_str());
+    StatePath.copy(MirrorOptions.StatePath, MAX_PATH - 1);
+    ASSERT_NO_FATAL_FAILURE(OpenMirror());
+
+    // The second replica misses the write and gets dropped.
+    std::vector<BYTE> WriteBuffer(ReplicaSize);
+    FillRandom(WriteBuffer.data(), ReplicaSize, 51);
+    Servers[1]->FailRequests(WnbdReqTypeWrite, 1);
+    WNBD_IO_RESPONSE Response = Write(0, ReplicaSize, WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    std::vector<BYTE> ReplicaData(ReplicaSize);
+    Servers[1]->ReadData(ReplicaData.data(), 0, ReplicaSize);
+    EXPECT_NE(WriteBuffer, ReplicaData);
+
+    // The state file marks it as stale, so it gets resynced before
+    // reopening the mirror.
+    ASSERT_NO_FATAL_FAILURE(OpenMirror());
+    Servers[1]->ReadData(ReplicaData.data(), 0, ReplicaSize);
+    EXPECT_EQ(WriteBuffer, ReplicaData);
+
+    // The replicas are in sync now.
+    size_t Writes = CountNbdRequests(Servers[1].get(), WnbdReqTypeWrite);
+    ASSERT_NO_FATAL_FAILURE(OpenMirror());
+    EXPECT_EQ(Writes, CountNbdRequests(Servers[1].get(), WnbdReqTypeWrite));
+
+    std::vector<BYTE> ReadBuffer(ReplicaSize);
+    for (UINT32 Index = 0; Index < 2; Index++) {
+        Response = Read(0, ReplicaSize, ReadBuffer.data());
+        EXPECT_FALSE(Response.Status.ScsiStatus);
+        EXPECT_EQ(WriteBuffer, ReadBuffer);
+    }
+    Response = Write(0, ReplicaSize, WriteBuffer.data());
+    EXPECT_FALSE(Response.Status.ScsiStatus);
+    EXPECT_EQ(Writes + 1,
+              CountNbdRequests(Servers[1].get(), WnbdReqTypeWrite));
+
+    Disk.reset();
+    EXPECT_TRUE(DeleteFileA(StatePath.c_str()));
+}
@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "pch.h"
+#include "options.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The tests below use WnbdEnableAsyncLogging with invalid ring sizes in
+// order to emit error messages, the ring size being included in the
+// message. Odd values above the minimum ring size are never valid.
+#define MIN_INVALID_RING_SIZE 17
+
+static UINT32 SeqToRingSize(UINT32 Seq)
+{
+    return MIN_INVALID_RING_SIZE + Seq * 2;
+}
+
+static void EmitMessage(UINT32 Seq)
+{
+    WNBD_ASYNC_LOG_OPTIONS Options = { 0 };
+    Options.RingSize = SeqToRingSize(Seq);
+    ASSERT_EQ(ERROR_INVALID_PARAMETER, WnbdEnableAsyncLogging(&Options));
+}
+
+// Collects the received messages, optionally blocking the logger while
+// it processes the first message.
+struct TestLogState
+{
+    std::mutex Lock;
+    std::condition_variable Cond;
+    std::vector<std::string> Messages;
+    std::vector<DWORD> LoggerThreads;
+    bool BlockLogger = false;
+    bool LoggerBlocked = false;
+};
+
+static TestLogState LogState;
+
+static VOID TestLogger(
+    WnbdLogLevel LogLevel,
+    const char* Message,
+    const char* FileName,
+    UINT32 Line,
+    const char* FunctionName)
+{
+    std::unique_lock Lock{LogState.Lock};
+    LogState.Messages.push_back(Message);
+    LogState.LoggerThreads.push_back(GetCurrentThreadId());
+
+    if (LogState.BlockLogger) {
+        LogState.LoggerBlocked = true;
+        LogState.Cond.notify_all();
+        LogState.Cond.wait(Lock, [] { return !LogState.BlockLogger; });
+    }
+}
+
+// Used after the tests complete, the default libwnbd console logger
+// isn't exported.
+static VOID StderrLogger(
+    WnbdLogLevel LogLevel,
+    const char* Message,
+    const char* FileName,
+    UINT32 Line,
+    const char* FunctionName)
+{
+    fprintf(stderr, "libwnbd.dll!%s %s %s\n",
+            FunctionName, WnbdLogLevelToStr(LogLevel), Message);
+}
+
+class TestLog : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        LogState.Messages.clear();
+        LogState.LoggerThreads.clear();
+        LogState.BlockLogger = false;
+        LogState.LoggerBlocked = false;
+
+        WnbdSetLogger(TestLogger);
+        WnbdSetLogLevel(WnbdLogLevelError);
+    }
+
+    void TearDown() override
+    {
+        {
+            std::unique_lock Lock{LogState.Lock};
+            LogState.BlockLogger = false;
+            LogState.Cond.notify_all();
+        }
+        WnbdDisableAsyncLogging();
+
+        WnbdSetLogger(StderrLogger);
+        WnbdSetLogLevel((WnbdLogLevel) GetOpt<DWORD>("log-level"));
+    }
+
+    void EnableAsyncLogging(UINT32 RingSize, UINT32 FlushIntervalMs)
+    {
+        WNBD_ASYNC_LOG_OPTIONS Options = { 0 };
+        Options.RingSize = RingSize;
+        Options.FlushIntervalMs = FlushIntervalMs;
+        ASSERT_FALSE(WnbdEnableAsyncLogging(&Options));
+    }
+
+    // Each thread gets its own log ring, using the ring size that was
+    // configured when the thread logged its first message. New threads
+    // are used so that the configured ring size is taken into account.
+    void EmitFromNewThread(UINT32 FirstSeq, UINT32 Count)
+    {
+        std::thread Thread([FirstSeq, Count] {
+            for (UINT32 Seq = FirstSeq; Seq < FirstSeq + Count; Seq++) {
+                EmitMessage(Seq);
+            }
+        });
+        Thread.join();
+    }
+
+    // Returns the sequence numbers of the received messages, ignoring
+    // the other messages (e.g. dropped message warnings).
+    std::vector<UINT32> GetReceivedSeq()
+    {
+        std::unique_lock Lock{LogState.Lock};
+        std::vector<UINT32> Received;
+        for (const std::string& Message : LogState.Messages) {
+            UINT32 RingSize = 0;
+            if (sscanf_s(Message.c_str(), "Invalid log ring size: %u.",
+                         &RingSize) == 1) {
+                Received.push_back((RingSize - MIN_INVALID_RING_SIZE) / 2);
+            }
+        }
+        return Received;
+    }
+
+    size_t CountMessages(const char* Substring)
+    {
+        std::unique_lock Lock{LogState.Lock};
+        size_t Count = 0;
+        for (const std::string& Message : LogState.Messages) {
+            if (Message.find(Substring) != std::string::npos) {
+                Count++;
+            }
+        }
+        return Count;
+    }
+};
+
+static std::vector<UINT32> SeqRange(UINT32 First, UINT32 Count)
+{
+    std::vector<UINT32> Seq;
+    for (UINT32 i = First; i < First + Count; i++) {
+        Seq.push_back(i);
+    }
+    return Seq;
+}
+
+TEST_F(TestLog, LevelFiltering)
+{
+    WnbdSetLogLevel(WnbdLogLevelCritical);
+    EmitMessage(0);
+    EXPECT_TRUE(GetReceivedSeq().empty());
+
+    WnbdSetLogLevel(WnbdLogLevelError);
+    EmitMessage(1);
+    EXPECT_EQ(SeqRange(1, 1), GetReceivedSeq());
+
+    // Passing NULL disables the logger.
+    WnbdSetLogger(NULL);
+    EmitMessage(2);
+    WnbdSetLogger(TestLogger);
+    EXPECT_EQ(SeqRange(1, 1), GetReceivedSeq());
+}
+
+TEST_F(TestLog, AsyncLevelFiltering)
+{
+    EnableAsyncLogging(16, 60000);
+    UINT64 DropCount = WnbdGetAsyncLogDropCount();
+
+    // Filtered messages must not be queued, so they can't fill the ring.
+    WnbdSetLogLevel(WnbdLogLevelCritical);
+    EmitFromNewThread(0, 100);
+    EXPECT_EQ(DropCount, WnbdGetAsyncLogDropCount());
+
+    WnbdSetLogLevel(WnbdLogLevelError);
+    EmitFromNewThread(100, 4);
+
+    WnbdDisableAsyncLogging();
+    EXPECT_EQ(SeqRange(100, 4), GetReceivedSeq());
+    EXPECT_EQ(DropCount, WnbdGetAsyncLogDropCount());
+}
+
+TEST_F(TestLog, AsyncOrdering)
+{
+    EnableAsyncLogging(1024, 60000);
+
+    // Messages coming from different threads are ordered by timestamp.
+    EmitFromNewThread(0, 100);
+    EmitFromNewThread(100, 100);
+    EmitFromNewThread(200, 100);
+
+    // Concurrent threads, only the per thread order is guaranteed.
+    const UINT32 ThreadCount = 4;
+    const UINT32 ThreadMessages = 200;
+    std::vector<std::thread> Threads;
+    for (UINT32 i = 0; i < ThreadCount; i++) {
+        Threads.emplace_back([this, i, ThreadMessages] {
+            EmitFromNewThread(1000 * (i + 1), ThreadMessages);
+        });
+    }
+    for (std::thread& Thread : Threads) {
+        Thread.join();
+    }
+
+    WnbdDisableAsyncLogging();
+
+    std::vector<UINT32> Received = GetReceivedSeq();
+    ASSERT_EQ(300 + ThreadCount * ThreadMessages, Received.size());
+    EXPECT_EQ(SeqRange(0, 300),
+              std::vector<UINT32>(Received.begin(), Received.begin() + 300));
+
+    std::vector<UINT32> NextSeq(ThreadCount);
+    for (UINT32 i = 0; i < ThreadCount; i++) {
+        NextSeq[i] = 1000 * (i + 1);
+    }
+    for (size_t i = 300; i < Received.size(); i++) {
+        UINT32 ThreadIdx = Received[i] / 1000 - 1;
+        ASSERT_LT(ThreadIdx, ThreadCount);
+        EXPECT_EQ(NextSeq[ThreadIdx]++, Received[i]);
+    }
+
+    // The logger is only called by the log thread.
+    std::unique_lock Lock{LogState.Lock};
+    for (DWORD ThreadId : LogState.LoggerThreads) {
+        EXPECT_EQ(LogState.LoggerThreads[0], ThreadId);
+        EXPECT_NE(GetCurrentThreadId(), ThreadId);
+    }
+}
+
+TEST_F(TestLog, AsyncFlushOnShutdown)
+{
+    // The flush interval is long enough for the messages to be flushed
+    // only when disabling asynchronous logging.
+    EnableAsyncLogging(1024, 60000);
+
+    EmitFromNewThread(0, 10);
+    EXPECT_TRUE(GetReceivedSeq().empty());
+
+    WnbdDisableAsyncLogging();
+    EXPECT_EQ(SeqRange(0, 10), GetReceivedSeq());
+
+    // Messages are logged synchronously afterwards.
+    EmitMessage(10);
+    EXPECT_EQ(SeqRange(0, 11), GetReceivedSeq());
+}
+
+TEST_F(TestLog, AsyncDropWhenRingFull)
+{
+    const UINT32 RingSize = 16;
+    const UINT32 ExtraMessages = 5;
+    EnableAsyncLogging(RingSize, 10);
+    UINT64 DropCount = WnbdGetAsyncLogDropCount();
+
+    {
+        std::unique_lock Lock{LogState.Lock};
+        LogState.BlockLogger = true;
+    }
+
+    std::thread Thread([&] {
+        EmitMessage(0);
+        {
+            // Wait for the log thread to pick up the first message. The
+            // ring slot is released only after the logger returns.
+            std::unique_lock Lock{LogState.Lock};
+            LogState.Cond.wait(Lock, [] { return LogState.LoggerBlocked; });
+        }
+        // The producer must not block while the ring is full.
+        for (UINT32 Seq = 1; Seq < RingSize + ExtraMessages; Seq++) {
+            EmitMessage(Seq);
+        }
+    });
+    Thread.join();
+
+    EXPECT_EQ(DropCount + ExtraMessages, WnbdGetAsyncLogDropCount());
+
+    {
+        std::unique_lock Lock{LogState.Lock};
+        LogState.BlockLogger = false;
+        LogState.Cond.notify_all();
+    }
+    WnbdDisableAsyncLogging();
+
+    // The messages that fit in the ring are delivered in order and the
+    // drops get reported.
+    EXPECT_EQ(SeqRange(0, RingSize), GetReceivedSeq());
+    EXPECT_EQ(1, CountMessages("Dropped"));
+}
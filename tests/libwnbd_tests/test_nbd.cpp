@@ -253,3 +253,82 @@ TEST(TestNbd, TestIO) {
 
     ASSERT_TRUE(FlushFileBuffers(DiskHandle));
 }
+
+TEST(TestNbd, TestDetectZeroes) {
+    if (!CheckNbdParamsProvided()) {
+        return;
+    }
+
+    // Zeroed ranges are sent as NBD_CMD_WRITE_ZEROES if supported by
+    // the server, the content being expected to remain the same.
+    WNBD_PROPERTIES WnbdProps = { 0 };
+    WnbdProps.NbdProperties.Flags.DetectZeroes = 1;
+    NbdMapping Mapping(&WnbdProps);
+
+    string DiskPath = GetDiskPath(WnbdProps.InstanceName);
+    HANDLE DiskHandle = CreateFileA(
+        DiskPath.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING |
+            FILE_FLAG_WRITE_THROUGH,
+        NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, DiskHandle)
+        << "couldn't open disk: " << DiskPath
+        << ", error: " << WinStrError(GetLastError());
+    unique_ptr<void, decltype(&CloseHandle)> DiskHandleCloser(
+        DiskHandle, &CloseHandle);
+
+    DWORD BufferSize = 1 << 20;
+    unique_ptr<void, decltype(&_aligned_free)> WriteBuffer(
+        _aligned_malloc(BufferSize, 4096), _aligned_free);
+    ASSERT_TRUE(WriteBuffer.get()) << "couldn't allocate: " << BufferSize;
+    unique_ptr<void, decltype(&_aligned_free)> ReadBuffer(
+        _aligned_malloc(BufferSize, 4096), _aligned_free);
+    ASSERT_TRUE(ReadBuffer.get()) << "couldn't allocate: " << BufferSize;
+
+    auto WriteAndVerify = [&](UINT64 DiskOffset) {
+        LARGE_INTEGER Offset = { 0 };
+        Offset.QuadPart = DiskOffset;
+        DWORD BytesWritten = 0;
+        ASSERT_TRUE(SetFilePointerEx(DiskHandle, Offset, NULL, FILE_BEGIN));
+        ASSERT_TRUE(WriteFile(
+            DiskHandle, WriteBuffer.get(), BufferSize, &BytesWritten, NULL));
+        ASSERT_EQ(BufferSize, BytesWritten);
+
+        DWORD BytesRead = 0;
+        memset(ReadBuffer.get(), 0xff, BufferSize);
+        ASSERT_TRUE(SetFilePointerEx(DiskHandle, Offset, NULL, FILE_BEGIN));
+        ASSERT_TRUE(ReadFile(
+            DiskHandle, ReadBuffer.get(), BufferSize, &BytesRead, NULL));
+        ASSERT_EQ(BufferSize, BytesRead);
+        ASSERT_FALSE(memcmp(ReadBuffer.get(), WriteBuffer.get(), BufferSize));
+    };
+
+    // 1. Data followed by zeroed ranges, some of them too small to be
+    // sent separately.
+    // ----------------------------------------------------------------
+    unsigned int Rand;
+    EXPECT_EQ(0, rand_s(&Rand));
+    memset(WriteBuffer.get(), Rand | 1, BufferSize);
+    memset((PBYTE) WriteBuffer.get() + (128 << 10), 0, 384 << 10);
+    memset((PBYTE) WriteBuffer.get() + (768 << 10), 0, 4096);
+    memset((PBYTE) WriteBuffer.get() + BufferSize - 512, 0, 512);
+    WriteAndVerify(0);
+
+    // 2. Overwrite the data using a fully zeroed write.
+    // --------------------------------------------------
+    memset(WriteBuffer.get(), 0, BufferSize);
+    WriteAndVerify(0);
+
+    // 3. Unaligned zeroed range.
+    // --------------------------
+    EXPECT_EQ(0, rand_s(&Rand));
+    memset(WriteBuffer.get(), Rand | 1, BufferSize);
+    memset((PBYTE) WriteBuffer.get() + 512, 0, 256 << 10);
+    WriteAndVerify(BufferSize + 512);
+
+    ASSERT_TRUE(FlushFileBuffers(DiskHandle));
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+// Benchmarks, which are too slow and too dependent on the host load to be
+// part of the unit test suite. They are disabled by default and may be
+// executed using:
+//
+//     libwnbd_tests.exe --gtest_also_run_disabled_tests --gtest_filter=*Perf*
+
+#include "pch.h"
+#include "mock_wnbd_daemon.h"
+#include "offline_io.h"
+#include "utils.h"
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Measures the IOCTL submission overhead, comparing the cached per-thread
+// event used for synchronous requests with an event created for each
+// request. Pings don't affect the disk state or the request accounting.
+TEST(TestIoctlPerf, DISABLED_Ping) {
+    HANDLE AdapterHandle = INVALID_HANDLE_VALUE;
+    DWORD Status = WnbdOpenAdapter(&AdapterHandle);
+    ASSERT_FALSE(Status) << "couldn't open adapter: " << WinStrError(Status);
+    std::unique_ptr<void, decltype(&CloseHandle)> AdapterCloser(
+        AdapterHandle, &CloseHandle);
+
+    const int Iterations = 100000;
+
+    auto Start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Iterations; i++) {
+        Status = WnbdIoctlPing(AdapterHandle, NULL);
+        ASSERT_FALSE(Status) << "ping failed: " << WinStrError(Status);
+    }
+    auto CachedDuration = std::chrono::steady_clock::now() - Start;
+
+    Start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Iterations; i++) {
+        OVERLAPPED Overlapped = { 0 };
+        Overlapped.hEvent = CreateEventA(0, TRUE, FALSE, NULL);
+        ASSERT_TRUE(Overlapped.hEvent) << "couldn't create event";
+
+        Status = WnbdIoctlPing(AdapterHandle, &Overlapped);
+        if (Status == ERROR_IO_PENDING) {
+            DWORD BytesReturned = 0;
+            Status = GetOverlappedResult(
+                AdapterHandle, &Overlapped, &BytesReturned, TRUE) ?
+                0 : GetLastError();
+        }
+        CloseHandle(Overlapped.hEvent);
+        ASSERT_FALSE(Status) << "ping failed: " << WinStrError(Status);
+    }
+    auto UncachedDuration = std::chrono::steady_clock::now() - Start;
+
+    auto CachedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        CachedDuration).count() / Iterations;
+    auto UncachedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        UncachedDuration).count() / Iterations;
+    std::cout << "IOCTL submission, cached event: "
+              << CachedNs << " ns/op, new event per request: "
+              << UncachedNs << " ns/op" << std::endl;
+    RecordProperty("CachedEventNsPerOp", (int) CachedNs);
+    RecordProperty("NewEventNsPerOp", (int) UncachedNs);
+}
+
+// Measures the read throughput against a backend that completes the
+// requests right away, exercising the dispatcher hot path (including the
+// userspace stats) with an increasing number of dispatcher threads.
+TEST(TestStatsPerf, DISABLED_DispatcherScaling) {
+    const DWORD ThreadCounts[] = { 1, 2, 4, 8, 16, 32 };
+    const auto Duration = std::chrono::seconds(2);
+    const DWORD IoSize = 4096;
+
+    for (DWORD ThreadCount : ThreadCounts) {
+        WNBD_PROPERTIES WnbdProps = { 0 };
+        GetNewWnbdProps(&WnbdProps);
+
+        MockWnbdDaemon WnbdDaemon(&WnbdProps);
+        WnbdDaemon.SetNullBackend(true);
+
+        WNBD_DISPATCHER_OPTIONS DispatcherOptions = { 0 };
+        DispatcherOptions.Mode = WnbdDispatcherModeThreaded;
+        DispatcherOptions.ThreadCount = ThreadCount;
+        WnbdDaemon.SetDispatcherOptions(DispatcherOptions);
+
+        WnbdDaemon.Start();
+
+        std::string DiskPath = GetDiskPath(WnbdProps.InstanceName);
+        HANDLE DiskHandle = CreateFileA(
+            DiskPath.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED,
+            NULL);
+        ASSERT_NE(INVALID_HANDLE_VALUE, DiskHandle)
+            << "couldn't open disk: " << DiskPath
+            << ", error: " << WinStrError(GetLastError());
+        std::unique_ptr<void, decltype(&CloseHandle)> DiskHandleCloser(
+            DiskHandle, &CloseHandle);
+
+        HANDLE CompletionPort = CreateIoCompletionPort(
+            DiskHandle, NULL, 0, 0);
+        ASSERT_TRUE(CompletionPort) << "couldn't create completion port";
+        std::unique_ptr<void, decltype(&CloseHandle)> CompletionPortCloser(
+            CompletionPort, &CloseHandle);
+
+        // Keep all the dispatcher threads busy.
+        DWORD QueueDepth = ThreadCount * 2;
+        std::vector<OVERLAPPED> Overlapped(QueueDepth);
+        PBYTE Buffers = (PBYTE) VirtualAlloc(
+            NULL, (SIZE_T) IoSize * QueueDepth,
+            MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        ASSERT_TRUE(Buffers) << "couldn't allocate read buffers";
+        auto FreeBuffers = [](PBYTE Buffers) {
+            VirtualFree(Buffers, 0, MEM_RELEASE);
+        };
+        std::unique_ptr<BYTE, decltype(FreeBuffers)> BuffersReleaser(
+            Buffers, FreeBuffers);
+
+        auto SubmitRead = [&](DWORD Idx) -> DWORD {
+            Overlapped[Idx] = { 0 };
+            if (!ReadFile(DiskHandle, Buffers + (SIZE_T) Idx * IoSize,
+                          IoSize, NULL, &Overlapped[Idx])) {
+                DWORD Status = GetLastError();
+                if (Status != ERROR_IO_PENDING) {
+                    return Status;
+                }
+            }
+            return 0;
+        };
+
+        UINT64 CompletedIo = 0;
+        DWORD PendingIo = 0;
+        auto Start = std::chrono::steady_clock::now();
+        auto Deadline = Start + Duration;
+        for (DWORD Idx = 0; Idx < QueueDepth; Idx++) {
+            DWORD Status = SubmitRead(Idx);
+            ASSERT_FALSE(Status)
+                << "couldn't submit read: " << WinStrError(Status);
+            PendingIo++;
+        }
+        while (PendingIo) {
+            DWORD BytesTransferred = 0;
+            ULONG_PTR CompletionKey = 0;
+            LPOVERLAPPED CompletedOverlapped = NULL;
+            BOOL Succeeded = GetQueuedCompletionStatus(
+                CompletionPort, &BytesTransferred, &CompletionKey,
+                &CompletedOverlapped, 30000);
+            ASSERT_TRUE(CompletedOverlapped) << "read request timed out";
+            ASSERT_TRUE(Succeeded)
+                << "read failed: " << WinStrError(GetLastError());
+            PendingIo--;
+            CompletedIo++;
+
+            if (std::chrono::steady_clock::now() < Deadline) {
+                DWORD Status = SubmitRead(
+                    (DWORD) (CompletedOverlapped - &Overlapped[0]));
+                ASSERT_FALSE(Status)
+                    << "couldn't submit read: " << WinStrError(Status);
+                PendingIo++;
+            }
+        }
+        auto ElapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - Start).count();
+
+        // Other components (e.g. the partition manager) may access
+        // the disk as well.
+        WNBD_USR_STATS Stats = { 0 };
+        ASSERT_FALSE(WnbdGetUserspaceStats(WnbdDaemon.GetDisk(), &Stats));
+        EXPECT_LE(CompletedIo, Stats.TotalReceivedReplies);
+        EXPECT_LE(CompletedIo, Stats.TotalRWRequests);
+        EXPECT_LE(CompletedIo * IoSize / WnbdProps.BlockSize,
+                  Stats.TotalReadBlocks);
+        EXPECT_FALSE(Stats.ReadErrors);
+
+        UINT64 Iops = ElapsedUs ? CompletedIo * 1000000 / ElapsedUs : 0;
+        std::cout << "Dispatcher threads: " << ThreadCount
+                  << ", IOPS: " << Iops << std::endl;
+        RecordProperty(
+            "IopsThreads" + std::to_string(ThreadCount), (int) Iops);
+
+        WnbdDaemon.Shutdown();
+    }
+}
+
+// Compares the sequential throughput of the plain RAM disk with the
+// compressed RAM disks, also reporting the compression ratio.
+TEST(TestCompressionPerf, DISABLED_RamThroughputAndRatio) {
+    const UINT32 IoSize = 64 << 10;
+    const UINT32 QueueDepth = 16;
+    const UINT64 TotalSize = 256ULL << 20;
+    const std::pair<const char*, WnbdCompressionCodec> Codecs[] = {
+        { "None", WnbdCompressionNone },
+        { "Fast", WnbdCompressionFast },
+        { "High", WnbdCompressionHigh },
+    };
+
+    std::vector<BYTE> WriteBuffers((size_t) IoSize * QueueDepth);
+    std::vector<BYTE> ReadBuffers((size_t) IoSize * QueueDepth);
+    FillCompressible(WriteBuffers.data(), WriteBuffers.size(), 4);
+
+    for (auto [Name, Codec] : Codecs) {
+        WNBD_PROPERTIES WnbdProps = { 0 };
+        GetNewWnbdProps(&WnbdProps);
+
+        WNBD_COMPRESSION_OPTIONS CompressionOptions = { 0 };
+        CompressionOptions.Codec = Codec;
+
+        OfflineResponses Received;
+        PWNBD_DISK Disk = nullptr;
+        DWORD Status = Codec == WnbdCompressionNone ?
+            WnbdCreateOfflineRam(
+                &WnbdProps, RecordOfflineResponse, &Received, &Disk) :
+            WnbdCreateOfflineCompressedRam(
+                &WnbdProps, &CompressionOptions,
+                RecordOfflineResponse, &Received, &Disk);
+        ASSERT_FALSE(Status) << "couldn't create offline RAM disk: "
+                             << WinStrError(Status);
+        std::unique_ptr<WNBD_DISK, decltype(&WnbdCloseOfflineRam)>
+            DiskCloser(Disk, Codec == WnbdCompressionNone ?
+                &WnbdCloseOfflineRam : &WnbdCloseOfflineCompressedRam);
+
+        auto Start = std::chrono::steady_clock::now();
+        SubmitSequentialIo(
+            Disk, &Received, WnbdReqTypeWrite, WriteBuffers.data(),
+            IoSize, QueueDepth, TotalSize);
+        auto WriteUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - Start).count();
+
+        Start = std::chrono::steady_clock::now();
+        SubmitSequentialIo(
+            Disk, &Received, WnbdReqTypeRead, ReadBuffers.data(),
+            IoSize, QueueDepth, TotalSize);
+        auto ReadUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - Start).count();
+        EXPECT_EQ(WriteBuffers, ReadBuffers);
+
+        // The stored size of the plain RAM disk matches the written data.
+        UINT64 StoredBytes = TotalSize;
+        WNBD_COMPRESSION_STATS Stats = { 0 };
+        Status = WnbdGetCompressionStats(Disk, &Stats);
+        if (Codec == WnbdCompressionNone) {
+            EXPECT_EQ(ERROR_NOT_SUPPORTED, Status);
+        } else {
+            ASSERT_FALSE(Status);
+            StoredBytes = Stats.StoredBytes;
+        }
+
+        UINT64 WriteMBps = WriteUs ? TotalSize / WriteUs : 0;
+        UINT64 ReadMBps = ReadUs ? TotalSize / ReadUs : 0;
+        double Ratio = StoredBytes ? (double) TotalSize / StoredBytes : 0;
+        std::cout << "Compression: " << Name
+                  << ", write MB/s: " << WriteMBps
+                  << ", read MB/s: " << ReadMBps
+                  << ", ratio: " << Ratio << std::endl;
+        RecordProperty(std::string("WriteMBps") + Name, (int) WriteMBps);
+        RecordProperty(std::string("ReadMBps") + Name, (int) ReadMBps);
+        RecordProperty(
+            std::string("RatioPercent") + Name, (int) (Ratio * 100));
+    }
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "pch.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include <wnbd_qdepth.h>
+
+// Simulated server, processing up to "Workers" requests in parallel,
+// the others waiting in a FIFO queue. The service time may vary by up
+// to "JitterPct" percent.
+class SimulatedServer
+{
+public:
+    UINT32 Workers;
+    UINT64 ServiceTimeUs;
+    UINT32 JitterPct;
+
+    SimulatedServer(
+            UINT32 _Workers, UINT64 _ServiceTimeUs, UINT32 _JitterPct = 0)
+        : Workers(_Workers)
+        , ServiceTimeUs(_ServiceTimeUs)
+        , JitterPct(_JitterPct)
+    {
+    }
+
+    // Returns the completion time.
+    UINT64 Submit(UINT64 Now)
+    {
+        while (WorkerFreeTimes.size() < Workers) {
+            WorkerFreeTimes.push(0);
+        }
+        // Reducing the number of workers takes effect gradually, as
+        // the busy workers finish their requests.
+        while (WorkerFreeTimes.size() > Workers) {
+            WorkerFreeTimes.pop();
+        }
+
+        UINT64 Duration = ServiceTimeUs;
+        if (JitterPct) {
+            UINT64 Jitter = ServiceTimeUs * JitterPct / 100;
+            Duration += std::uniform_int_distribution<UINT64>(
+                0, Jitter * 2)(Generator) - Jitter;
+        }
+
+        UINT64 Start = std::max(Now, WorkerFreeTimes.top());
+        WorkerFreeTimes.pop();
+        WorkerFreeTimes.push(Start + Duration);
+        return Start + Duration;
+    }
+
+private:
+    // Fixed seed, the results must be reproducible.
+    std::mt19937_64 Generator{ 1 };
+    std::priority_queue<
+        UINT64, std::vector<UINT64>, std::greater<UINT64>> WorkerFreeTimes;
+};
+
+class TestQdepth : public ::testing::Test
+{
+protected:
+    WNBD_QDEPTH_CONTROLLER Ctrl = { 0 };
+    UINT64 Now = 0;
+    UINT64 TotalCompleted = 0;
+
+    struct Completion
+    {
+        UINT64 CompletionTime;
+        UINT64 SubmitTime;
+        bool operator>(const Completion& Other) const {
+            return CompletionTime > Other.CompletionTime;
+        }
+    };
+    std::priority_queue<
+        Completion, std::vector<Completion>,
+        std::greater<Completion>> InFlight;
+
+    // Keeps the controller busy, submitting requests whenever allowed,
+    // with at most "MaxOutstanding" requests in flight. Returns the
+    // average limit, skipping the limit reductions caused by probing.
+    double Run(
+        SimulatedServer& Server, UINT64 Completions,
+        UINT32 MaxOutstanding = UINT32_MAX)
+    {
+        UINT64 LimitSum = 0;
+        UINT64 LimitSamples = 0;
+
+        for (UINT64 i = 0; i < Completions; i++) {
+            while (WnbdQdepthCanSubmit(&Ctrl) &&
+                    InFlight.size() < MaxOutstanding) {
+                WnbdQdepthSubmit(&Ctrl);
+                InFlight.push({ Server.Submit(Now), Now });
+            }
+
+            Completion Next = InFlight.top();
+            InFlight.pop();
+            Now = Next.CompletionTime;
+            WnbdQdepthComplete(&Ctrl, Now - Next.SubmitTime);
+            TotalCompleted++;
+
+            EXPECT_LE(Ctrl.MinLimit, Ctrl.Limit);
+            EXPECT_GE(Ctrl.MaxLimit, Ctrl.Limit);
+            EXPECT_EQ(InFlight.size(), Ctrl.InFlight);
+
+            if (Ctrl.State != WnbdQdepthStateProbeDrain &&
+                    Ctrl.State != WnbdQdepthStateProbe) {
+                LimitSum += Ctrl.Limit;
+                LimitSamples++;
+            }
+        }
+        return LimitSamples ? (double) LimitSum / LimitSamples : 0;
+    }
+};
+
+TEST_F(TestQdepth, Initialize)
+{
+    WnbdQdepthInitialize(&Ctrl, 0, 0);
+    EXPECT_EQ(1, Ctrl.MinLimit);
+    EXPECT_EQ(1, Ctrl.MaxLimit);
+    EXPECT_EQ(1, Ctrl.Limit);
+
+    WnbdQdepthInitialize(&Ctrl, 4, 255);
+    EXPECT_EQ(4, Ctrl.Limit);
+    EXPECT_EQ(WnbdQdepthStateSlowStart, Ctrl.State);
+
+    for (UINT32 i = 0; i < 4; i++) {
+        EXPECT_TRUE(WnbdQdepthCanSubmit(&Ctrl));
+        WnbdQdepthSubmit(&Ctrl);
+    }
+    EXPECT_FALSE(WnbdQdepthCanSubmit(&Ctrl));
+
+    // Requests without a reply release their slot without affecting
+    // the latency measurements.
+    WnbdQdepthComplete(&Ctrl, 0);
+    EXPECT_TRUE(WnbdQdepthCanSubmit(&Ctrl));
+    EXPECT_EQ(3, Ctrl.InFlight);
+    EXPECT_EQ(0, Ctrl.WindowSamples);
+}
+
+TEST_F(TestQdepth, GrowsWhenLatencyIsFlat)
+{
+    WnbdQdepthInitialize(&Ctrl, 4, 255);
+    SimulatedServer Server(1024, 1000);
+
+    // Slow start.
+    Run(Server, 500);
+    EXPECT_EQ(255, Ctrl.Limit);
+    EXPECT_EQ(WnbdQdepthStateSlowStart, Ctrl.State);
+
+    // Probing doesn't affect the limit if there's no queue.
+    Run(Server, 50000);
+    EXPECT_EQ(255, Ctrl.Limit);
+}
+
+TEST_F(TestQdepth, ConvergesToServerCapacity)
+{
+    WnbdQdepthInitialize(&Ctrl, 4, 1024);
+    SimulatedServer Server(32, 1000);
+
+    Run(Server, 20000);
+    double AverageLimit = Run(Server, 50000);
+    // The limit should settle slightly above the server concurrency,
+    // keeping a few requests queued. Latency increases within the
+    // tolerance margin are ignored.
+    EXPECT_LE(32, AverageLimit);
+    EXPECT_GE(32 * 1.1 + 12, AverageLimit);
+    EXPECT_LE(1000, Ctrl.MinLatencyUs);
+    EXPECT_GE(1100, Ctrl.MinLatencyUs);
+}
+
+TEST_F(TestQdepth, BacksOffWhenServerSaturates)
+{
+    WnbdQdepthInitialize(&Ctrl, 4, 1024);
+    SimulatedServer Server(128, 1000);
+
+    double AverageLimit = Run(Server, 50000);
+    EXPECT_LE(128, AverageLimit);
+
+    // The server may now handle fewer requests in parallel.
+    Server.Workers = 16;
+    Run(Server, 20000);
+    AverageLimit = Run(Server, 50000);
+    EXPECT_LE(16, AverageLimit);
+    EXPECT_GE(16 * 1.1 + 12, AverageLimit);
+
+    // The server recovers.
+    Server.Workers = 128;
+    Run(Server, 50000);
+    AverageLimit = Run(Server, 50000);
+    EXPECT_LE(128, AverageLimit);
+    EXPECT_GE(128 * 1.1 + 24, AverageLimit);
+}
+
+TEST_F(TestQdepth, ServerSlowdown)
+{
+    WnbdQdepthInitialize(&Ctrl, 4, 1024);
+    SimulatedServer Server(32, 1000);
+
+    Run(Server, 20000);
+
+    // Slower requests, without reducing the server concurrency. The
+    // no-load latency estimate has to be measured again, otherwise
+    // the server would be underutilized.
+    Server.ServiceTimeUs = 3000;
+    Run(Server, 20000);
+    double AverageLimit = Run(Server, 50000);
+    EXPECT_LE(32, AverageLimit);
+    EXPECT_GE(32 * 1.1 + 12, AverageLimit);
+    EXPECT_LE(3000, Ctrl.MinLatencyUs);
+    EXPECT_GE(3300, Ctrl.MinLatencyUs);
+}
+
+TEST_F(TestQdepth, ApplicationLimited)
+{
+    WnbdQdepthInitialize(&Ctrl, 4, 1024);
+    SimulatedServer Server(1024, 1000);
+
+    // The limit shouldn't keep growing unless it's being used. Doubling
+    // the limit during slow start may exceed twice the used slots.
+    Run(Server, 20000, 10);
+    EXPECT_GE(32, Ctrl.Limit);
+}
+
+TEST_F(TestQdepth, LatencyJitter)
+{
+    WnbdQdepthInitialize(&Ctrl, 4, 255);
+    SimulatedServer Server(1024, 1000, 50);
+
+    // Jitter alone shouldn't cause the limit to back off.
+    Run(Server, 20000);
+    double AverageLimit = Run(Server, 50000);
+    EXPECT_LE(255 * 0.9, AverageLimit);
+
+    Server.Workers = 32;
+    Run(Server, 20000);
+    AverageLimit = Run(Server, 50000);
+    EXPECT_LE(32 * 0.9, AverageLimit);
+    EXPECT_GE(32 * 1.1 + 12, AverageLimit);
+}
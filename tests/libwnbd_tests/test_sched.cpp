@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include "pch.h"
+
+#include <vector>
+
+#include <wnbd_sched.h>
+
+struct TestSchedEntry
+{
+    WNBD_SCHED_ENTRY Entry;
+    UINT32 Id;
+};
+
+class TestSched : public ::testing::Test
+{
+protected:
+    WNBD_SCHEDULER Sched = { 0 };
+    std::vector<TestSchedEntry> Entries;
+
+    void Initialize(UINT32 LatencyWeight, UINT32 BulkWeight, size_t MaxEntries)
+    {
+        UINT32 Weights[WNBD_SCHED_CLASS_COUNT] = { 0 };
+        Weights[WNBD_SCHED_CLASS_LATENCY] = LatencyWeight;
+        Weights[WNBD_SCHED_CLASS_BULK] = BulkWeight;
+        WnbdSchedInitialize(&Sched, Weights);
+
+        // Avoid reallocations, the scheduler keeps pointers to the entries.
+        Entries.reserve(MaxEntries);
+    }
+
+    TestSchedEntry* Insert(UINT32 Class, UINT32 PayloadSize)
+    {
+        EXPECT_LT(Entries.size(), Entries.capacity());
+
+        Entries.push_back({});
+        TestSchedEntry* Entry = &Entries.back();
+        Entry->Id = (UINT32) Entries.size() - 1;
+        WnbdSchedInsertTail(&Sched, &Entry->Entry, Class, PayloadSize);
+        return Entry;
+    }
+
+    TestSchedEntry* RemoveNext()
+    {
+        PWNBD_SCHED_ENTRY Entry = WnbdSchedRemoveNext(&Sched);
+        if (!Entry) {
+            return nullptr;
+        }
+        return CONTAINING_RECORD(Entry, TestSchedEntry, Entry);
+    }
+};
+
+TEST_F(TestSched, FifoPerClass)
+{
+    Initialize(1, 1, 8);
+    EXPECT_TRUE(WnbdSchedIsEmpty(&Sched));
+    EXPECT_EQ(nullptr, RemoveNext());
+
+    for (UINT32 i = 0; i < 4; i++) {
+        Insert(WNBD_SCHED_CLASS_BULK, 4096);
+    }
+    EXPECT_FALSE(WnbdSchedIsEmpty(&Sched));
+
+    for (UINT32 i = 0; i < 4; i++) {
+        TestSchedEntry* Entry = RemoveNext();
+        ASSERT_NE(nullptr, Entry);
+        EXPECT_EQ(i, Entry->Id);
+        EXPECT_EQ(WNBD_SCHED_CLASS_BULK, Entry->Entry.Class);
+    }
+    EXPECT_TRUE(WnbdSchedIsEmpty(&Sched));
+    EXPECT_EQ(nullptr, RemoveNext());
+}
+
+TEST_F(TestSched, InvalidClassIsBulk)
+{
+    Initialize(1, 1, 1);
+
+    TestSchedEntry* Entry = Insert(WNBD_SCHED_CLASS_COUNT + 1, 0);
+    EXPECT_EQ(WNBD_SCHED_CLASS_BULK, Entry->Entry.Class);
+    EXPECT_EQ(1, Sched.Queues[WNBD_SCHED_CLASS_BULK].Count);
+    EXPECT_EQ(WNBD_SCHED_REQUEST_COST, Entry->Entry.Cost);
+}
+
+TEST_F(TestSched, LatencyBeforeBulk)
+{
+    Initialize(4, 1, 64);
+
+    // A bulk backlog queued before the latency sensitive requests.
+    for (UINT32 i = 0; i < 32; i++) {
+        Insert(WNBD_SCHED_CLASS_BULK, 1024 * 1024);
+    }
+    // A flush, followed by small reads.
+    Insert(WNBD_SCHED_CLASS_LATENCY, 0);
+    for (UINT32 i = 0; i < 8; i++) {
+        Insert(WNBD_SCHED_CLASS_LATENCY, 4096);
+    }
+
+    // The latency class must be drained after at most one bulk request
+    // per round.
+    UINT32 BulkDispatched = 0;
+    UINT32 LatencyDispatched = 0;
+    while (LatencyDispatched < 9) {
+        TestSchedEntry* Entry = RemoveNext();
+        ASSERT_NE(nullptr, Entry);
+        if (Entry->Entry.Class == WNBD_SCHED_CLASS_LATENCY) {
+            EXPECT_EQ(32 + LatencyDispatched, Entry->Id);
+            LatencyDispatched++;
+        } else {
+            BulkDispatched++;
+        }
+    }
+    EXPECT_LE(BulkDispatched, 1);
+
+    // The bulk requests keep their order.
+    for (UINT32 i = BulkDispatched; i < 32; i++) {
+        TestSchedEntry* Entry = RemoveNext();
+        ASSERT_NE(nullptr, Entry);
+        EXPECT_EQ(i, Entry->Id);
+    }
+    EXPECT_TRUE(WnbdSchedIsEmpty(&Sched));
+}
+
+TEST_F(TestSched, WeightedShare)
+{
+    UINT32 LatencyWeight = 3;
+    UINT32 BulkWeight = 1;
+    UINT32 PayloadSize = 64 * 1024 - WNBD_SCHED_REQUEST_COST;
+    UINT32 RequestCount = 4000;
+    Initialize(LatencyWeight, BulkWeight, RequestCount * 2);
+
+    for (UINT32 i = 0; i < RequestCount; i++) {
+        Insert(WNBD_SCHED_CLASS_LATENCY, PayloadSize);
+        Insert(WNBD_SCHED_CLASS_BULK, PayloadSize);
+    }
+
+    // Both classes are backlogged, so the dispatched bytes must follow
+    // the class weights.
+    UINT64 DispatchedBytes[WNBD_SCHED_CLASS_COUNT] = { 0 };
+    for (UINT32 i = 0; i < RequestCount; i++) {
+        TestSchedEntry* Entry = RemoveNext();
+        ASSERT_NE(nullptr, Entry);
+        DispatchedBytes[Entry->Entry.Class] += Entry->Entry.Cost;
+    }
+
+    double Ratio = (double) DispatchedBytes[WNBD_SCHED_CLASS_LATENCY] /
+        DispatchedBytes[WNBD_SCHED_CLASS_BULK];
+    EXPECT_NEAR((double) LatencyWeight / BulkWeight, Ratio, 0.1);
+
+    // A single backlogged class gets the whole bandwidth.
+    UINT32 Remaining = RequestCount;
+    while (!WnbdSchedIsEmpty(&Sched)) {
+        ASSERT_NE(nullptr, RemoveNext());
+        Remaining--;
+    }
+    EXPECT_EQ(0, Remaining);
+}
+
+TEST_F(TestSched, LargeRequests)
+{
+    Initialize(1, 1, 4);
+
+    // Requests exceeding the quantum must still be dispatched, the
+    // deficit accumulating over multiple rounds.
+    Insert(WNBD_SCHED_CLASS_BULK, 16 * WNBD_SCHED_QUANTUM);
+    Insert(WNBD_SCHED_CLASS_BULK, 0xffffffff);
+    Insert(WNBD_SCHED_CLASS_LATENCY, 4096);
+
+    TestSchedEntry* Entry = RemoveNext();
+    ASSERT_NE(nullptr, Entry);
+    EXPECT_EQ(2, Entry->Id);
+
+    for (UINT32 i = 0; i < 2; i++) {
+        Entry = RemoveNext();
+        ASSERT_NE(nullptr, Entry);
+        EXPECT_EQ(i, Entry->Id);
+    }
+    EXPECT_EQ(nullptr, RemoveNext());
+}
+
+TEST_F(TestSched, Requeue)
+{
+    Initialize(1, 1, 8);
+
+    for (UINT32 i = 0; i < 4; i++) {
+        Insert(WNBD_SCHED_CLASS_LATENCY, 4096);
+    }
+
+    TestSchedEntry* Entry = RemoveNext();
+    ASSERT_NE(nullptr, Entry);
+    EXPECT_EQ(0, Entry->Id);
+    UINT64 Deficit = Sched.Queues[WNBD_SCHED_CLASS_LATENCY].Deficit;
+
+    // Requeued entries are dispatched first and get their cost refunded.
+    WnbdSchedInsertHead(&Sched, &Entry->Entry);
+    EXPECT_EQ(Deficit + Entry->Entry.Cost,
+              Sched.Queues[WNBD_SCHED_CLASS_LATENCY].Deficit);
+    EXPECT_EQ(4, Sched.Queues[WNBD_SCHED_CLASS_LATENCY].Count);
+
+    for (UINT32 i = 0; i < 4; i++) {
+        Entry = RemoveNext();
+        ASSERT_NE(nullptr, Entry);
+        EXPECT_EQ(i, Entry->Id);
+    }
+    EXPECT_TRUE(WnbdSchedIsEmpty(&Sched));
+
+    // Requeuing the only entry of an empty scheduler.
+    Entry = Insert(WNBD_SCHED_CLASS_BULK, 0);
+    EXPECT_EQ(Entry, RemoveNext());
+    WnbdSchedInsertHead(&Sched, &Entry->Entry);
+    EXPECT_FALSE(WnbdSchedIsEmpty(&Sched));
+    EXPECT_EQ(Entry, RemoveNext());
+    EXPECT_EQ(nullptr, RemoveNext());
+}
@@ -8,6 +8,7 @@
 
 #include "client.h"
 #include "cmd.h"
+#include "replay.h"
 #include "usage.h"
 #include "version.h"
 
@@ -49,7 +50,10 @@ T safe_get_param(const po::variables_map& vm, string name, T default_val = T())
 void Client::get_common_options(po::options_description &options)
 {
     options.add_options()
-        ("debug", po::bool_switch(), "Enable debug logging.");
+        ("debug", po::bool_switch(), "Enable debug logging.")
+        ("async-log", po::bool_switch(),
+         "Log messages from a background thread, keeping the logger "
+         "out of the IO path. Messages may be dropped under heavy load.");
 }
 
 void handle_common_options(po::variables_map &vm)
@@ -58,6 +62,14 @@ void handle_common_options(po::variables_map &vm)
 
     WnbdLogLevel log_level = debug ? WnbdLogLevelDebug : WnbdLogLevelInfo;
     WnbdSetLogLevel(log_level);
+
+    if (safe_get_param<bool>(vm, "async-log")) {
+        DWORD err = WnbdEnableAsyncLogging(NULL);
+        if (err) {
+            cerr << "Could not enable asynchronous logging. Error: "
+                 << err << endl;
+        }
+    }
 }
 
 DWORD Client::execute(int argc, const char** argv)
@@ -97,7 +109,10 @@ DWORD Client::execute(int argc, const char** argv)
         po::notify(vm);
 
         handle_common_options(vm);
-        return command->execute(vm);
+        DWORD err = command->execute(vm);
+        // Flush any pending log messages.
+        WnbdDisableAsyncLogging();
+        return err;
     }
     catch (po::required_option& e) {
         cerr << "wnbd-client: " << e.what() << endl;
@@ -161,6 +176,49 @@ DWORD execute_show(const po::variables_map &vm)
     return CmdShow(safe_get_param<string>(vm, "instance-name").c_str());
 }
 
+void get_qos_args(po::options_description &named_opts)
+{
+    named_opts.add_options()
+        ("read-iops", po::value<UINT64>()->default_value(0),
+            "Limit the number of read requests per second. "
+            "Default: 0 (unlimited).")
+        ("read-iops-burst", po::value<UINT64>()->default_value(0),
+            "The number of read requests that may be submitted at once "
+            "after the disk was idle. Defaults to the IOPS limit.")
+        ("write-iops", po::value<UINT64>()->default_value(0),
+            "Limit the number of write requests per second. "
+            "Default: 0 (unlimited).")
+        ("write-iops-burst", po::value<UINT64>()->default_value(0),
+            "The number of write requests that may be submitted at once "
+            "after the disk was idle. Defaults to the IOPS limit.")
+        ("read-bps", po::value<UINT64>()->default_value(0),
+            "Limit the number of bytes read per second. "
+            "Default: 0 (unlimited).")
+        ("read-bps-burst", po::value<UINT64>()->default_value(0),
+            "The number of bytes that may be read at once after the disk "
+            "was idle. Defaults to the bandwidth limit.")
+        ("write-bps", po::value<UINT64>()->default_value(0),
+            "Limit the number of bytes written per second. "
+            "Default: 0 (unlimited).")
+        ("write-bps-burst", po::value<UINT64>()->default_value(0),
+            "The number of bytes that may be written at once after the "
+            "disk was idle. Defaults to the bandwidth limit.");
+}
+
+WNBD_QOS_LIMITS get_qos_limits(const po::variables_map& vm)
+{
+    WNBD_QOS_LIMITS Limits = { 0 };
+    Limits.ReadIops.Rate = safe_get_param<UINT64>(vm, "read-iops");
+    Limits.ReadIops.Burst = safe_get_param<UINT64>(vm, "read-iops-burst");
+    Limits.WriteIops.Rate = safe_get_param<UINT64>(vm, "write-iops");
+    Limits.WriteIops.Burst = safe_get_param<UINT64>(vm, "write-iops-burst");
+    Limits.ReadBandwidth.Rate = safe_get_param<UINT64>(vm, "read-bps");
+    Limits.ReadBandwidth.Burst = safe_get_param<UINT64>(vm, "read-bps-burst");
+    Limits.WriteBandwidth.Rate = safe_get_param<UINT64>(vm, "write-bps");
+    Limits.WriteBandwidth.Burst = safe_get_param<UINT64>(vm, "write-bps-burst");
+    return Limits;
+}
+
 void get_map_args(
     po::positional_options_description &positonal_opts,
     po::options_description &named_opts)
@@ -169,7 +227,75 @@ void get_map_args(
                   .add("hostname", 1);
     named_opts.add_options()
         ("instance-name", po::value<string>()->required(), "Disk identifier.")
-        ("hostname", po::value<string>()->required(), "NBD server hostname.")
+        ("hostname", po::value<string>(), "NBD server hostname.")
+        ("file", po::value<string>(),
+            "Expose a local file or block device (e.g. \\\\.\\PhysicalDrive2) "
+            "instead of an NBD export. Missing files are created as sparse "
+            "files if the disk size is specified.")
+        ("queue-depth", po::value<UINT32>()->default_value(
+            WNBD_DEFAULT_FILE_QUEUE_DEPTH),
+            "The maximum number of pending file operations.")
+        ("buffered-io", po::bool_switch(),
+            "Use the system file cache when accessing the file.")
+        ("ram", po::bool_switch(),
+            "Expose a sparse in-memory disk, requires \"--disk-size\". "
+            "The data is discarded when the disk is removed.")
+        ("overlay", po::value<string>(),
+            "Local delta file receiving the writes, created if missing. "
+            "The NBD export or the file passed through \"--file\" is "
+            "used as read-only base image.")
+        ("cluster-size", po::value<UINT32>()->default_value(
+            WNBD_DEFAULT_OVERLAY_CLUSTER_SIZE),
+            "Overlay copy-on-write granularity, only used when creating "
+            "the delta file.")
+        ("stripe", po::value<vector<string>>()->composing(),
+            "Stripe the disk across multiple NBD exports, specified as "
+            "<hostname>[:<port>][/<export-name>]. Pass this option once "
+            "for each export. The port and export name default to the "
+            "\"--port\" and \"--export-name\" values.")
+        ("stripe-size", po::value<UINT32>()->default_value(
+            WNBD_DEFAULT_STRIPE_SIZE),
+            "The amount of data stored on an export before moving to "
+            "the next one.")
+        ("mirror", po::value<vector<string>>()->composing(),
+            "Mirror the disk across multiple NBD exports, specified the "
+            "same way as \"--stripe\" members. Pass this option once for "
+            "each export.")
+        ("write-quorum", po::value<UINT32>()->default_value(0),
+            "The number of mirror replicas that must complete a write "
+            "before it's acknowledged. By default, all the healthy "
+            "replicas are awaited.")
+        ("read-policy", po::value<string>()->default_value("least-pending"),
+            "Mirror read balancing policy: least-pending or latency.")
+        ("mirror-state", po::value<string>(),
+            "File tracking the mirror replicas that are out of sync, "
+            "created if missing. Stale replicas are resynced when "
+            "mapping the disk.")
+        ("encryption-key-file", po::value<string>(),
+            "Encrypt the disk using AES-XTS. The file contains the raw "
+            "key: 32 bytes for AES-128-XTS or 64 bytes for AES-256-XTS.")
+        ("encryption-data-unit", po::value<UINT32>()->default_value(0),
+            "The encryption data unit size, 512 or 4096. Defaults to the "
+            "disk block size.")
+        ("compression", po::value<string>()->default_value("none"),
+            "Compress the file or RAM disk data: none, fast or high. "
+            "Compressed files use a dedicated image format.")
+        ("compression-cluster-size", po::value<UINT32>()->default_value(
+            WNBD_DEFAULT_COMPRESSION_CLUSTER_SIZE),
+            "The compression unit size, a power of two between 4KB and "
+            "256KB. Only used when creating compressed images.")
+        ("integrity", po::bool_switch(),
+            "Detect silent data corruption using a CRC32C checksum for "
+            "each block, verified when reading the block back.")
+        ("integrity-sidecar", po::value<string>(),
+            "File persisting the checksums when the disk is removed. "
+            "Defaults to \"<file>.crc\" for file disks, otherwise the "
+            "checksums are only kept in memory.")
+        ("detect-zeroes", po::bool_switch(),
+            "Send the zeroed parts of NBD writes as NBD_CMD_WRITE_ZEROES "
+            "requests instead of transferring the data, allowing the "
+            "server to deallocate them. Ignored if not supported by the "
+            "server.")
         ("port", po::value<DWORD>()->default_value(10809),
             "NBD server port number. Default: 10809.")
         ("export-name", po::value<string>(),
@@ -179,14 +305,43 @@ void get_map_args(
             "This is useful for minimal NBD servers. If set, the disk size "
             "and block size must be provided.")
         ("disk-size", po::value<UINT64>(),
-            "The disk size. Ignored when using NBD handshake.")
+            "The disk size. Ignored when using NBD handshake or existing "
+            "files.")
         ("block-size", po::value<UINT32>(),
             "The block size. Ignored when using NBD handshake.")
-        ("read-only", po::bool_switch(), "Enable disk read-only mode.");
+        ("read-only", po::bool_switch(), "Enable disk read-only mode.")
+        ("numa-node", po::value<DWORD>(),
+            "Pin the IO threads to the processors of the specified NUMA "
+            "node, also allocating the IO buffers on this node.")
+        ("cpu-affinity", po::value<string>(),
+            "Pin the IO threads to the specified processor mask, e.g. 0xf0. "
+            "Takes precedence over the NUMA node processors.")
+        ("processor-group", po::value<UINT32>()->default_value(0),
+            "The processor group used along with \"--cpu-affinity\". "
+            "Default: 0.")
+        ("busy-poll", po::bool_switch(),
+            "Poll for IO requests and NBD replies instead of waiting to be "
+            "woken up, lowering the IO latency at the expense of CPU usage. "
+            "Meant for dedicated processors, see \"--cpu-affinity\".")
+        ("poll-budget-us", po::value<UINT32>()->default_value(
+            WNBD_DEFAULT_POLL_BUDGET_US),
+            "How long to poll before waiting, in microseconds.")
+        ("io-trace", po::value<string>(),
+            "Record the IO requests to the specified binary trace file. "
+            "Request payloads are not recorded.")
+        ("io-trace-file-size", po::value<UINT64>()->default_value(
+            WNBD_DEFAULT_IO_TRACE_FILE_SIZE >> 20),
+            "The maximum IO trace file size in MB, after which the file "
+            "gets rotated.")
+        ("io-trace-files", po::value<UINT32>()->default_value(
+            WNBD_DEFAULT_IO_TRACE_FILE_COUNT),
+            "The number of rotated IO trace files to keep.");
+    get_qos_args(named_opts);
 }
 
 DWORD execute_map(const po::variables_map& vm)
 {
+    WNBD_QOS_LIMITS QosLimits = get_qos_limits(vm);
     return CmdMap(
         safe_get_param<string>(vm, "instance-name").c_str(),
         safe_get_param<string>(vm, "hostname").c_str(),
@@ -195,7 +350,102 @@ DWORD execute_map(const po::variables_map& vm)
         safe_get_param<UINT64>(vm, "disk-size"),
         safe_get_param<UINT32>(vm, "block-size"),
         safe_get_param<bool>(vm, "skip-handshake"),
-        safe_get_param<bool>(vm, "read-only"));
+        safe_get_param<bool>(vm, "read-only"),
+        safe_get_param<DWORD>(vm, "numa-node", NUMA_NO_PREFERRED_NODE),
+        safe_get_param<string>(vm, "cpu-affinity").c_str(),
+        safe_get_param<UINT32>(vm, "processor-group"),
+        safe_get_param<bool>(vm, "busy-poll"),
+        safe_get_param<UINT32>(vm, "poll-budget-us"),
+        safe_get_param<string>(vm, "io-trace").c_str(),
+        safe_get_param<UINT64>(vm, "io-trace-file-size"),
+        safe_get_param<UINT32>(vm, "io-trace-files"),
+        safe_get_param<string>(vm, "file"),
+        safe_get_param<UINT32>(vm, "queue-depth"),
+        safe_get_param<bool>(vm, "buffered-io"),
+        safe_get_param<bool>(vm, "ram"),
+        safe_get_param<string>(vm, "overlay"),
+        safe_get_param<UINT32>(vm, "cluster-size"),
+        safe_get_param<vector<string>>(vm, "stripe"),
+        safe_get_param<UINT32>(vm, "stripe-size"),
+        safe_get_param<vector<string>>(vm, "mirror"),
+        safe_get_param<UINT32>(vm, "write-quorum"),
+        safe_get_param<string>(vm, "read-policy"),
+        safe_get_param<string>(vm, "mirror-state"),
+        safe_get_param<string>(vm, "encryption-key-file"),
+        safe_get_param<UINT32>(vm, "encryption-data-unit"),
+        safe_get_param<string>(vm, "compression"),
+        safe_get_param<UINT32>(vm, "compression-cluster-size"),
+        safe_get_param<bool>(vm, "integrity"),
+        safe_get_param<string>(vm, "integrity-sidecar"),
+        safe_get_param<bool>(vm, "detect-zeroes"),
+        &QosLimits);
+}
+
+void get_replay_args(
+    po::positional_options_description &positonal_opts,
+    po::options_description &named_opts)
+{
+    named_opts.add_options()
+        ("backend", po::value<string>()->default_value("null"),
+            "The backend that receives the requests: \"null\", which "
+            "completes requests right away, \"ram\", \"nbd\" or "
+            "\"file\". Default: null.")
+        ("hostname", po::value<string>(), "NBD server hostname.")
+        ("file", po::value<string>(),
+            "The file or block device used by the file backend.")
+        ("port", po::value<DWORD>()->default_value(10809),
+            "NBD server port number. Default: 10809.")
+        ("export-name", po::value<string>(), "NBD export name.")
+        ("trace", po::value<string>(),
+            "Replay the specified IO trace file, see \"map --io-trace\". "
+            "A synthetic workload is used otherwise.")
+        ("preserve-timing", po::bool_switch(),
+            "Submit the traced requests using the original timing instead "
+            "of replaying them as fast as possible.")
+        ("rw", po::value<string>()->default_value("randread"),
+            "Synthetic workload IO pattern: read, write, rw, randread, "
+            "randwrite or randrw. Default: randread.")
+        ("bs", po::value<UINT32>()->default_value(4096),
+            "Synthetic workload IO size in bytes. Default: 4096.")
+        ("rwmixread", po::value<UINT32>()->default_value(50),
+            "The percentage of reads used by mixed workloads. Default: 50.")
+        ("io-count", po::value<UINT64>()->default_value(0),
+            "Stop after submitting the specified number of requests.")
+        ("runtime", po::value<UINT32>()->default_value(0),
+            "Stop after the specified number of seconds.")
+        ("seed", po::value<UINT64>()->default_value(0),
+            "Synthetic workload random seed. Default: 0.")
+        ("iodepth", po::value<UINT32>()->default_value(32),
+            "The maximum number of requests in flight. Default: 32.")
+        ("disk-size", po::value<UINT64>(),
+            "The null and RAM backend disk size. Defaults to the traced "
+            "disk size.")
+        ("block-size", po::value<UINT32>(),
+            "The null and RAM backend block size. Defaults to the traced "
+            "block size or 512.");
+}
+
+DWORD execute_replay(const po::variables_map& vm)
+{
+    ReplayOptions Options;
+    Options.Backend = safe_get_param<string>(vm, "backend");
+    Options.HostName = safe_get_param<string>(vm, "hostname");
+    Options.PortNumber = safe_get_param<DWORD>(vm, "port");
+    Options.ExportName = safe_get_param<string>(vm, "export-name");
+    Options.FilePath = safe_get_param<string>(vm, "file");
+    Options.TracePath = safe_get_param<string>(vm, "trace");
+    Options.PreserveTiming = safe_get_param<bool>(vm, "preserve-timing");
+    Options.Pattern = safe_get_param<string>(vm, "rw");
+    Options.IoSize = safe_get_param<UINT32>(vm, "bs");
+    Options.ReadPercentage = safe_get_param<UINT32>(vm, "rwmixread");
+    Options.IoCount = safe_get_param<UINT64>(vm, "io-count");
+    Options.RuntimeSec = safe_get_param<UINT32>(vm, "runtime");
+    Options.Seed = safe_get_param<UINT64>(vm, "seed");
+    Options.QueueDepth = safe_get_param<UINT32>(vm, "iodepth");
+    Options.DiskSize = safe_get_param<UINT64>(vm, "disk-size");
+    Options.BlockSize = safe_get_param<UINT32>(vm, "block-size");
+
+    return CmdReplay(Options);
 }
 
 void get_unmap_args(
@@ -234,10 +484,29 @@ DWORD execute_unmap(const po::variables_map& vm)
         safe_get_param<DWORD>(vm, "soft-disconnect-retry-interval"));
 }
 
+void get_set_qos_args(
+    po::positional_options_description &positonal_opts,
+    po::options_description &named_opts)
+{
+    positonal_opts.add("instance-name", 1);
+    named_opts.add_options()
+        ("instance-name", po::value<string>()->required(), "Disk identifier.");
+    get_qos_args(named_opts);
+}
+
+DWORD execute_set_qos(const po::variables_map& vm)
+{
+    WNBD_QOS_LIMITS QosLimits = get_qos_limits(vm);
+    return CmdSetQos(
+        safe_get_param<string>(vm, "instance-name").c_str(),
+        &QosLimits);
+}
+
 DWORD execute_stats(const po::variables_map& vm)
 {
     return CmdStats(
-        safe_get_param<string>(vm, "instance-name").c_str());
+        safe_get_param<string>(vm, "instance-name").c_str(),
+        safe_get_param<bool>(vm, "latency"));
 }
 
 void get_stats_args(
@@ -246,7 +515,11 @@ void get_stats_args(
 {
     positonal_opts.add("instance-name", 1);
     named_opts.add_options()
-        ("instance-name", po::value<string>()->required(), "Disk identifier.");
+        ("instance-name", po::value<string>()->required(), "Disk identifier.")
+        ("latency", po::bool_switch(),
+            "Include request latency percentiles for each request type, "
+            "measured between the moment in which the request is fetched "
+            "and the moment in which the response is received.");
 }
 
 void get_list_opt_args(
@@ -383,9 +656,17 @@ Client::Command commands[] = {
     Client::Command(
         "unmap", {"rm"}, "Remove disk mapping.",
         execute_unmap, get_unmap_args),
+    Client::Command(
+        "replay", {}, "Replay an IO trace or a synthetic workload against "
+                      "a backend, without using the WNBD driver.",
+        execute_replay, get_replay_args),
     Client::Command(
         "stats", {}, "Get disk stats.",
         execute_stats, get_stats_args),
+    Client::Command(
+        "set-qos", {}, "Replace the disk QoS limits. Unspecified limits "
+                       "are removed.",
+        execute_set_qos, get_set_qos_args),
     Client::Command(
         "list-opt", {}, "List driver options.",
         execute_list_opt, get_list_opt_args),
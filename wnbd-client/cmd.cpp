@@ -12,6 +12,7 @@
 #include "cmd.h"
 #include "version.h"
 
+#include <fstream>
 #include <string>
 #include <locale>
 #include <sstream>
@@ -96,6 +97,74 @@ void PrintLastError()
     PrintFormattedError(GetLastError());
 }
 
+// Parses NBD export specs: <hostname>[:<port>][/<export-name>].
+static bool ParseNbdMember(
+    string Member,
+    DWORD DefaultPort,
+    string DefaultExportName,
+    BOOLEAN SkipNegotiation,
+    PNBD_CONNECTION_PROPERTIES Connection)
+{
+    string ExportName = DefaultExportName;
+    size_t Pos = Member.find('/');
+    if (Pos != string::npos) {
+        ExportName = Member.substr(Pos + 1);
+        Member = Member.substr(0, Pos);
+    }
+
+    DWORD PortNumber = DefaultPort;
+    Pos = Member.find(':');
+    if (Pos != string::npos) {
+        try {
+            PortNumber = stoul(Member.substr(Pos + 1));
+        } catch (...) {
+            return false;
+        }
+        Member = Member.substr(0, Pos);
+    }
+
+    if (Member.empty() || Member.length() >= WNBD_MAX_NAME_LENGTH ||
+            ExportName.empty() || ExportName.length() >= WNBD_MAX_NAME_LENGTH ||
+            !PortNumber || PortNumber > 65535) {
+        return false;
+    }
+
+    *Connection = { 0 };
+    Member.copy(Connection->Hostname, WNBD_MAX_NAME_LENGTH - 1);
+    ExportName.copy(Connection->ExportName, WNBD_MAX_NAME_LENGTH - 1);
+    Connection->PortNumber = PortNumber;
+    Connection->Flags.SkipNegotiation = SkipNegotiation;
+    return true;
+}
+
+// Loads a raw AES-XTS key.
+static bool LoadEncryptionKey(
+    string Path,
+    PWNBD_ENCRYPTION_OPTIONS Options)
+{
+    ifstream File(Path, ios::binary);
+    if (!File) {
+        cerr << "Could not open encryption key file: " << Path << endl;
+        return false;
+    }
+
+    // Read an extra byte in order to detect larger files.
+    BYTE Key[WNBD_MAX_ENCRYPTION_KEY_SIZE + 1] = { 0 };
+    File.read((char*) Key, sizeof(Key));
+    UINT32 KeySize = (UINT32) File.gcount();
+    if (KeySize != 32 && KeySize != 64) {
+        cerr << "Invalid encryption key size: " << KeySize << " bytes. "
+             << "Expecting 32 or 64 bytes." << endl;
+        SecureZeroMemory(Key, sizeof(Key));
+        return false;
+    }
+
+    memcpy(Options->Key, Key, KeySize);
+    Options->KeySize = KeySize;
+    SecureZeroMemory(Key, sizeof(Key));
+    return true;
+}
+
 DWORD CmdMap(
     string InstanceName,
     string HostName,
@@ -104,8 +173,83 @@ DWORD CmdMap(
     UINT64 DiskSize,
     UINT32 BlockSize,
     BOOLEAN SkipNegotiation,
-    BOOLEAN ReadOnly)
+    BOOLEAN ReadOnly,
+    DWORD NumaNode,
+    string CpuAffinity,
+    UINT32 ProcessorGroup,
+    BOOLEAN BusyPoll,
+    UINT32 PollBudgetUs,
+    string IoTracePath,
+    UINT64 IoTraceFileSizeMb,
+    UINT32 IoTraceFileCount,
+    string FilePath,
+    UINT32 FileQueueDepth,
+    BOOLEAN BufferedIo,
+    BOOLEAN RamDisk,
+    string OverlayPath,
+    UINT32 ClusterSize,
+    vector<string> StripeMembers,
+    UINT32 StripeSize,
+    vector<string> MirrorMembers,
+    UINT32 WriteQuorum,
+    string ReadPolicy,
+    string MirrorStatePath,
+    string EncryptionKeyFile,
+    UINT32 EncryptionDataUnit,
+    string Compression,
+    UINT32 CompressionClusterSize,
+    BOOLEAN Integrity,
+    string IntegritySidecar,
+    BOOLEAN DetectZeroes,
+    PWNBD_QOS_LIMITS QosLimits)
 {
+    if (!HostName.empty() + !FilePath.empty() + !!RamDisk +
+            !StripeMembers.empty() + !MirrorMembers.empty() != 1) {
+        cerr << "Either an NBD hostname, a file, a RAM disk, a list of "
+                "stripe members or a list of mirror replicas must be "
+                "specified." << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (RamDisk && !DiskSize) {
+        cerr << "The disk size must be provided when using a RAM disk."
+             << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (FilePath.length() >= MAX_PATH) {
+        cerr << "File path too long: " << FilePath << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (!OverlayPath.empty() &&
+            (RamDisk || !StripeMembers.empty() || !MirrorMembers.empty())) {
+        cerr << "Overlays require an NBD export or a file as base." << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (OverlayPath.length() >= MAX_PATH) {
+        cerr << "Overlay path too long: " << OverlayPath << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    WNBD_COMPRESSION_OPTIONS CompressionOptions = { 0 };
+    CompressionOptions.ClusterSize = CompressionClusterSize;
+    if (Compression == "none") {
+        CompressionOptions.Codec = WnbdCompressionNone;
+    } else if (Compression == "fast") {
+        CompressionOptions.Codec = WnbdCompressionFast;
+    } else if (Compression == "high") {
+        CompressionOptions.Codec = WnbdCompressionHigh;
+    } else {
+        cerr << "Invalid compression codec: " << Compression << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (CompressionOptions.Codec != WnbdCompressionNone &&
+            ((FilePath.empty() && !RamDisk) || !OverlayPath.empty())) {
+        cerr << "Compression requires a file or a RAM disk, "
+                "without an overlay." << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (HostName.empty() && DiskSize && !BlockSize) {
+        BlockSize = WNBD_DEFAULT_BLOCK_SIZE;
+    }
+
     if (!PortNumber) {
         cerr << "Missing NBD server port number." << endl;
         return ERROR_INVALID_PARAMETER;
@@ -126,10 +270,103 @@ DWORD CmdMap(
         cerr << "Missing instace name." << endl;
         return ERROR_INVALID_PARAMETER;
     }
-    if (HostName.empty()) {
-        cerr << "Missing NBD hostname." << endl;
+
+    WNBD_MIRROR_OPTIONS MirrorOptions = { 0 };
+    MirrorOptions.WriteQuorum = WriteQuorum;
+    if (ReadPolicy == "least-pending") {
+        MirrorOptions.ReadPolicy = WnbdMirrorReadLeastPending;
+    } else if (ReadPolicy == "latency") {
+        MirrorOptions.ReadPolicy = WnbdMirrorReadLowestLatency;
+    } else {
+        cerr << "Invalid mirror read policy: " << ReadPolicy << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (!MirrorStatePath.empty() && MirrorMembers.empty()) {
+        cerr << "The mirror state file requires mirror replicas." << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (MirrorStatePath.length() >= MAX_PATH) {
+        cerr << "Mirror state file path too long: "
+             << MirrorStatePath << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    MirrorStatePath.copy(MirrorOptions.StatePath, MAX_PATH - 1);
+
+    // Either stripe members or mirror replicas.
+    vector<string>& MemberNames = StripeMembers.empty() ?
+        MirrorMembers : StripeMembers;
+    vector<NBD_CONNECTION_PROPERTIES> Members(MemberNames.size());
+    for (size_t Index = 0; Index < MemberNames.size(); Index++) {
+        if (!ParseNbdMember(
+                MemberNames[Index], PortNumber, ExportName,
+                SkipNegotiation, &Members[Index])) {
+            cerr << "Invalid NBD export: " << MemberNames[Index] << endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+        Members[Index].Flags.DetectZeroes = DetectZeroes;
+    }
+    if (DetectZeroes && (!OverlayPath.empty() ||
+            (HostName.empty() && MemberNames.empty()))) {
+        cerr << "Zero detection requires writable NBD exports." << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    WNBD_DISPATCHER_OPTIONS DispatcherOptions = { 0 };
+    if (NumaNode != NUMA_NO_PREFERRED_NODE) {
+        DispatcherOptions.Flags.UseNumaNode = 1;
+        DispatcherOptions.NumaNode = NumaNode;
+    }
+    if (!CpuAffinity.empty()) {
+        try {
+            DispatcherOptions.AffinityMask = stoull(CpuAffinity, nullptr, 0);
+        } catch (...) {
+            cerr << "Invalid CPU affinity mask: " << CpuAffinity << endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+        DispatcherOptions.Flags.UseAffinity = 1;
+        DispatcherOptions.ProcessorGroup = ProcessorGroup;
+    }
+    DispatcherOptions.Flags.BusyPoll = BusyPoll;
+    DispatcherOptions.PollBudgetUs = PollBudgetUs;
+
+    WNBD_IO_TRACE_OPTIONS IoTraceOptions = { 0 };
+    if (IoTracePath.length() >= MAX_PATH) {
+        cerr << "IO trace path too long: " << IoTracePath << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    IoTracePath.copy(IoTraceOptions.Path, MAX_PATH - 1);
+    IoTraceOptions.MaxFileSize = IoTraceFileSizeMb << 20;
+    IoTraceOptions.MaxFileCount = IoTraceFileCount;
+
+    WNBD_ENCRYPTION_OPTIONS EncryptionOptions = { 0 };
+    if (!EncryptionKeyFile.empty()) {
+        if (!LoadEncryptionKey(EncryptionKeyFile, &EncryptionOptions)) {
+            return ERROR_INVALID_PARAMETER;
+        }
+        EncryptionOptions.DataUnitSize = EncryptionDataUnit;
+        DispatcherOptions.Encryption = &EncryptionOptions;
+    }
+
+    WNBD_INTEGRITY_OPTIONS IntegrityOptions = { 0 };
+    if (!IntegritySidecar.empty() && !Integrity) {
+        cerr << "The integrity sidecar file requires \"--integrity\"."
+             << endl;
         return ERROR_INVALID_PARAMETER;
     }
+    if (Integrity) {
+        // Block devices don't get a default sidecar file.
+        if (IntegritySidecar.empty() && !FilePath.empty() &&
+                !FilePath.starts_with("\\\\.\\")) {
+            IntegritySidecar = FilePath + ".crc";
+        }
+        if (IntegritySidecar.length() >= MAX_PATH) {
+            cerr << "Integrity sidecar path too long: "
+                 << IntegritySidecar << endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+        IntegritySidecar.copy(IntegrityOptions.SidecarPath, MAX_PATH - 1);
+        DispatcherOptions.Integrity = &IntegrityOptions;
+    }
 
     WNBD_PROPERTIES Props = { 0 };
 
@@ -142,9 +379,10 @@ DWORD CmdMap(
 
     Props.NbdProperties.PortNumber = PortNumber;
     Props.NbdProperties.Flags.SkipNegotiation = SkipNegotiation;
+    Props.NbdProperties.Flags.DetectZeroes = DetectZeroes;
 
-    Props.Flags.UseUserspaceNbd = TRUE;
     Props.Flags.ReadOnly = ReadOnly;
+    Props.QosLimits = *QosLimits;
 
     Props.Pid = _getpid();
     Props.BlockSize = BlockSize;
@@ -153,6 +391,36 @@ DWORD CmdMap(
     DaemonInstanceName = InstanceName;
     SetConsoleCtrlHandler(ConsoleHandlerRoutine, true);
 
+    WNBD_OVERLAY_OPTIONS OverlayOptions = { 0 };
+    OverlayPath.copy(OverlayOptions.DeltaPath, MAX_PATH - 1);
+    FilePath.copy(OverlayOptions.BasePath, MAX_PATH - 1);
+    OverlayOptions.ClusterSize = ClusterSize;
+    if (!OverlayPath.empty() && !FilePath.empty()) {
+        return WnbdRunOverlayDaemon(
+            &Props, &OverlayOptions, &DispatcherOptions, &IoTraceOptions);
+    }
+    if (!FilePath.empty()) {
+        WNBD_FILE_OPTIONS FileOptions = { 0 };
+        FilePath.copy(FileOptions.Path, MAX_PATH - 1);
+        FileOptions.Flags.BufferedIo = BufferedIo;
+        FileOptions.QueueDepth = FileQueueDepth;
+        if (CompressionOptions.Codec != WnbdCompressionNone) {
+            FileOptions.Compression = &CompressionOptions;
+        }
+        return WnbdRunFileDaemon(
+            &Props, &FileOptions, &DispatcherOptions, &IoTraceOptions);
+    }
+    if (RamDisk && CompressionOptions.Codec != WnbdCompressionNone) {
+        return WnbdRunCompressedRamDaemon(
+            &Props, &CompressionOptions, &DispatcherOptions,
+            &IoTraceOptions);
+    }
+    if (RamDisk) {
+        return WnbdRunRamDaemon(&Props, &DispatcherOptions, &IoTraceOptions);
+    }
+
+    Props.Flags.UseUserspaceNbd = TRUE;
+
     WSADATA WsaData;
     int Ret = WSAStartup(MAKEWORD(2, 2), &WsaData);
     if (Ret) {
@@ -162,7 +430,25 @@ DWORD CmdMap(
         return Ret;
     }
 
-    return WnbdRunNbdDaemon(&Props);
+    if (!MirrorMembers.empty()) {
+        return WnbdRunMirrorDaemon(
+            &Props, Members.data(), (UINT32) Members.size(), &MirrorOptions,
+            &DispatcherOptions, &IoTraceOptions);
+    }
+    if (!Members.empty()) {
+        WNBD_STRIPE_OPTIONS StripeOptions = { 0 };
+        StripeOptions.StripeSize = StripeSize;
+        return WnbdRunStripeDaemon(
+            &Props, Members.data(), (UINT32) Members.size(), &StripeOptions,
+            &DispatcherOptions, &IoTraceOptions);
+    }
+    if (!OverlayPath.empty()) {
+        // The NBD export is used as base.
+        return WnbdRunOverlayDaemon(
+            &Props, &OverlayOptions, &DispatcherOptions, &IoTraceOptions);
+    }
+
+    return WnbdRunNbdDaemonEx(&Props, &DispatcherOptions, &IoTraceOptions);
 }
 
 DWORD CmdUnmap(
@@ -183,7 +469,54 @@ DWORD CmdUnmap(
     return Status;
 }
 
-DWORD CmdStats(string InstanceName)
+void PrintLatencyHistograms(PWNBD_LATENCY_STATS Stats)
+{
+    cout << "Latency stats (microseconds)" << endl << left
+         << setw(24) << "RequestType"
+         << setw(12) << "Count"
+         << setw(10) << "Avg"
+         << setw(10) << "p50"
+         << setw(10) << "p90"
+         << setw(10) << "p99"
+         << setw(10) << "p999"
+         << setw(10) << "Max" << endl;
+    for (UINT32 Type = 0; Type < WNBD_LATENCY_REQ_TYPE_COUNT; Type++) {
+        PWNBD_LATENCY_HISTOGRAM Histogram = &Stats->Histograms[Type];
+        UINT64 Count = WnbdGetLatencyCount(Histogram);
+        if (!Count) {
+            continue;
+        }
+        cout << setw(24) << WnbdRequestTypeToStr((WnbdRequestType) Type)
+             << setw(12) << Count
+             << setw(10) << Histogram->TotalUs / Count
+             << setw(10) << WnbdGetLatencyPercentile(Histogram, 50)
+             << setw(10) << WnbdGetLatencyPercentile(Histogram, 90)
+             << setw(10) << WnbdGetLatencyPercentile(Histogram, 99)
+             << setw(10) << WnbdGetLatencyPercentile(Histogram, 99.9)
+             << setw(10) << WnbdGetLatencyPercentile(Histogram, 100)
+             << endl;
+    }
+    cout << endl;
+}
+
+DWORD PrintLatencyStats(string InstanceName)
+{
+    unique_ptr<WNBD_LATENCY_STATS> Stats(
+        new (nothrow) WNBD_LATENCY_STATS());
+    if (!Stats) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    DWORD Status = WnbdGetLatencyStats(InstanceName.c_str(), Stats.get());
+    if (Status) {
+        return Status;
+    }
+
+    PrintLatencyHistograms(Stats.get());
+    return 0;
+}
+
+DWORD CmdStats(string InstanceName, BOOLEAN Latency)
 {
     WNBD_DRV_STATS Stats = {0};
     DWORD Status = WnbdGetDriverStats(InstanceName.c_str(), &Stats);
@@ -209,11 +542,24 @@ DWORD CmdStats(string InstanceName)
                      << max(0, (int64_t) (TimeNow - Stats.LastSubmittedReqTimestamp / 10000)) << endl
          << setw(30) << "TimeSinceLastReplyMs" << " : "
                      << max(0, (int64_t) (TimeNow - Stats.LastReplyTimestamp / 10000)) << endl
+         << setw(30) << "ThrottledIORequests" << " : " << Stats.ThrottledIORequests << endl
+         << setw(30) << "ThrottleWaitMs" << " : " << Stats.ThrottleWaitUs / 1000 << endl
+         << setw(30) << "QueueDepthLimit" << " : " << Stats.QueueDepthLimit << endl
+         << setw(30) << "QueueDepthWaits" << " : " << Stats.QueueDepthWaits << endl
          << endl;
+
+    if (Latency) {
+        Status = PrintLatencyStats(InstanceName);
+    }
     return Status;
 }
 
 
+DWORD CmdSetQos(string InstanceName, PWNBD_QOS_LIMITS QosLimits)
+{
+    return WnbdSetQosLimits(InstanceName.c_str(), QosLimits);
+}
+
 DWORD GetIOLimits(
     const string& DiskPath,
     PDWORD LunMaxIoCount,
@@ -292,6 +638,18 @@ DWORD CmdShow(string InstanceName)
          << setw(25) << "MaxIOReqPerAdapter" << " : " << AdapterMaxIoCount << endl
          << endl;
 
+    PWNBD_QOS_LIMITS QosLimits = &ConnInfo.Properties.QosLimits;
+    cout << "QoS limits (rate / burst, 0 means unlimited)" << endl << left
+         << setw(25) << "ReadIops" << " : " << QosLimits->ReadIops.Rate
+                     << " / " << QosLimits->ReadIops.Burst << endl
+         << setw(25) << "WriteIops" << " : " << QosLimits->WriteIops.Rate
+                     << " / " << QosLimits->WriteIops.Burst << endl
+         << setw(25) << "ReadBytesPerSec" << " : " << QosLimits->ReadBandwidth.Rate
+                     << " / " << QosLimits->ReadBandwidth.Burst << endl
+         << setw(25) << "WriteBytesPerSec" << " : " << QosLimits->WriteBandwidth.Rate
+                     << " / " << QosLimits->WriteBandwidth.Burst << endl
+         << endl;
+
     if (ConnInfo.Properties.Flags.UseUserspaceNbd) {
         cout << "Nbd properties" << endl << left
              << setw(25) << "Hostname" << " : " << ConnInfo.Properties.NbdProperties.Hostname << endl
@@ -299,6 +657,8 @@ DWORD CmdShow(string InstanceName)
              << setw(25) << "ExportName" << " : " << ConnInfo.Properties.NbdProperties.ExportName << endl
              << setw(25) << "SkipNegotiation" << " : "
                          << ConnInfo.Properties.NbdProperties.Flags.SkipNegotiation << endl
+             << setw(25) << "DetectZeroes" << " : "
+                         << ConnInfo.Properties.NbdProperties.Flags.DetectZeroes << endl
              << endl;
     }
 
@@ -18,6 +18,7 @@
 #include <process.h>
 
 #include <string>
+#include <vector>
 
 #include <wnbd.h>
 
@@ -26,6 +27,13 @@
 void
 PrintSyntax();
 
+void
+PrintFormattedError(DWORD Error);
+
+// Prints the latency percentiles of each request type.
+void
+PrintLatencyHistograms(PWNBD_LATENCY_STATS Stats);
+
 DWORD
 CmdUnmap(
     std::string InstanceName,
@@ -35,7 +43,7 @@ CmdUnmap(
     DWORD SoftDisconnectRetryInterval);
 
 DWORD
-CmdStats(std::string InstanceName);
+CmdStats(std::string InstanceName, BOOLEAN Latency);
 
 DWORD
 CmdMap(
@@ -46,7 +54,38 @@ CmdMap(
     UINT64 DiskSize,
     UINT32 BlockSize,
     BOOLEAN MustNegotiate,
-    BOOLEAN ReadOnly);
+    BOOLEAN ReadOnly,
+    DWORD NumaNode,
+    std::string CpuAffinity,
+    UINT32 ProcessorGroup,
+    BOOLEAN BusyPoll,
+    UINT32 PollBudgetUs,
+    std::string IoTracePath,
+    UINT64 IoTraceFileSizeMb,
+    UINT32 IoTraceFileCount,
+    std::string FilePath,
+    UINT32 FileQueueDepth,
+    BOOLEAN BufferedIo,
+    BOOLEAN RamDisk,
+    std::string OverlayPath,
+    UINT32 ClusterSize,
+    std::vector<std::string> StripeMembers,
+    UINT32 StripeSize,
+    std::vector<std::string> MirrorMembers,
+    UINT32 WriteQuorum,
+    std::string ReadPolicy,
+    std::string MirrorStatePath,
+    std::string EncryptionKeyFile,
+    UINT32 EncryptionDataUnit,
+    std::string Compression,
+    UINT32 CompressionClusterSize,
+    BOOLEAN Integrity,
+    std::string IntegritySidecar,
+    BOOLEAN DetectZeroes,
+    PWNBD_QOS_LIMITS QosLimits);
+
+DWORD
+CmdSetQos(std::string InstanceName, PWNBD_QOS_LIMITS QosLimits);
 
 DWORD
 CmdList();
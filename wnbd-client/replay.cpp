@@ -0,0 +1,762 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#include <wnbd.h>
+
+#include "cmd.h"
+#include "replay.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+// The request handles embed the queue slot index.
+#define REPLAY_SLOT_BITS 16
+#define REPLAY_SLOT_MASK ((1ULL << REPLAY_SLOT_BITS) - 1)
+// Applies to pending requests as well as to waiting for a free slot.
+#define REPLAY_REQUEST_TIMEOUT_SEC 60
+
+static inline UINT64 GetTimestamp()
+{
+    LARGE_INTEGER Counter;
+    QueryPerformanceCounter(&Counter);
+    return Counter.QuadPart;
+}
+
+static inline UINT64 GetTimestampFrequency()
+{
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+    return Frequency.QuadPart;
+}
+
+struct ReplayRequest
+{
+    WNBD_IO_REQUEST Request;
+    // Unmap requests only.
+    WNBD_UNMAP_DESCRIPTOR UnmapDescriptor;
+    // Microseconds since the beginning of the replay, used when
+    // preserving the original timing.
+    UINT64 SubmitOffsetUs;
+};
+
+class RequestSource
+{
+public:
+    virtual ~RequestSource() {}
+    // Returns false once there are no more requests.
+    virtual bool Next(ReplayRequest* Request) = 0;
+};
+
+class TraceSource : public RequestSource
+{
+private:
+    vector<WNBD_IO_TRACE_RECORD> Records;
+    size_t Position = 0;
+    UINT64 FirstTimestamp = 0;
+
+public:
+    WNBD_IO_TRACE_HEADER Header = { 0 };
+
+    DWORD Load(string Path);
+    bool Next(ReplayRequest* Request) override;
+};
+
+DWORD TraceSource::Load(string Path)
+{
+    ifstream File(Path, ios::binary);
+    if (!File) {
+        cerr << "Could not open trace file: " << Path << endl;
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    File.read((char*) &Header, sizeof(Header));
+    if (!File || Header.Magic != WNBD_IO_TRACE_MAGIC ||
+            Header.Version != WNBD_IO_TRACE_VERSION ||
+            Header.HeaderSize < sizeof(Header) ||
+            Header.RecordSize != sizeof(WNBD_IO_TRACE_RECORD) ||
+            !Header.TimestampFrequency) {
+        cerr << "Invalid or unsupported trace file: " << Path << endl;
+        return ERROR_INVALID_DATA;
+    }
+
+    File.seekg(Header.HeaderSize);
+    WNBD_IO_TRACE_RECORD Record;
+    // Files written by older versions that weren't closed properly have
+    // the record count set to 0.
+    for (UINT64 Index = 0;
+            (!Header.RecordCount || Index < Header.RecordCount) &&
+            File.read((char*) &Record, sizeof(Record));
+            Index++) {
+        if (Record.RequestType != WnbdReqTypeUnknown) {
+            Records.push_back(Record);
+        }
+    }
+    if (Records.empty()) {
+        cerr << "The trace file doesn't contain any requests: "
+             << Path << endl;
+        return ERROR_NO_DATA;
+    }
+
+    // The records are stored in completion order.
+    stable_sort(
+        Records.begin(), Records.end(),
+        [](const WNBD_IO_TRACE_RECORD& A, const WNBD_IO_TRACE_RECORD& B) {
+            return A.FetchTimestamp < B.FetchTimestamp;
+        });
+    FirstTimestamp = Records[0].FetchTimestamp;
+    return 0;
+}
+
+bool TraceSource::Next(ReplayRequest* Request)
+{
+    while (Position < Records.size()) {
+        WNBD_IO_TRACE_RECORD& Record = Records[Position++];
+
+        *Request = { 0 };
+        Request->Request.RequestType = (WnbdRequestType) Record.RequestType;
+        Request->SubmitOffsetUs = (UINT64) (
+            (double) (Record.FetchTimestamp - FirstTimestamp) * 1000000 /
+            Header.TimestampFrequency);
+        BOOLEAN FUA = !!(Record.Flags & WNBD_IO_TRACE_FLAG_FUA);
+
+        switch (Record.RequestType) {
+        case WnbdReqTypeRead:
+            Request->Request.Cmd.Read.BlockAddress = Record.BlockAddress;
+            Request->Request.Cmd.Read.BlockCount = Record.BlockCount;
+            Request->Request.Cmd.Read.ForceUnitAccess = FUA;
+            return true;
+        case WnbdReqTypeWrite:
+            Request->Request.Cmd.Write.BlockAddress = Record.BlockAddress;
+            Request->Request.Cmd.Write.BlockCount = Record.BlockCount;
+            Request->Request.Cmd.Write.ForceUnitAccess = FUA;
+            return true;
+        case WnbdReqTypeFlush:
+            Request->Request.Cmd.Flush.BlockAddress = Record.BlockAddress;
+            Request->Request.Cmd.Flush.BlockCount = Record.BlockCount;
+            return true;
+        case WnbdReqTypeUnmap:
+            Request->Request.Cmd.Unmap.Count = 1;
+            Request->UnmapDescriptor.BlockAddress = Record.BlockAddress;
+            Request->UnmapDescriptor.BlockCount = Record.BlockCount;
+            return true;
+        default:
+            // Persistent reservations are not replayed.
+            break;
+        }
+    }
+    return false;
+}
+
+class SyntheticSource : public RequestSource
+{
+private:
+    bool Random = false;
+    UINT32 ReadPercentage = 0;
+    UINT32 IoBlocks = 0;
+    UINT64 IoSlots = 0;
+    UINT64 IoCount = 0;
+    UINT64 Deadline = 0;
+
+    UINT64 Submitted = 0;
+    UINT64 NextSlot = 0;
+    mt19937_64 Rng;
+
+public:
+    DWORD Initialize(
+        const ReplayOptions& Options,
+        UINT32 BlockSize,
+        UINT64 BlockCount);
+    bool Next(ReplayRequest* Request) override;
+};
+
+DWORD SyntheticSource::Initialize(
+    const ReplayOptions& Options,
+    UINT32 BlockSize,
+    UINT64 BlockCount)
+{
+    string Pattern = Options.Pattern;
+    if (Pattern.rfind("rand", 0) == 0) {
+        Random = true;
+        Pattern = Pattern.substr(4);
+    }
+    if (Pattern == "read") {
+        ReadPercentage = 100;
+    } else if (Pattern == "write") {
+        ReadPercentage = 0;
+    } else if (Pattern == "rw") {
+        ReadPercentage = Options.ReadPercentage;
+    } else {
+        cerr << "Invalid IO pattern: " << Options.Pattern << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (ReadPercentage > 100) {
+        cerr << "Invalid read percentage: " << ReadPercentage << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (!Options.IoSize || Options.IoSize % BlockSize ||
+            Options.IoSize > WNBD_DEFAULT_MAX_TRANSFER_LENGTH) {
+        cerr << "The IO size must be a multiple of the block size ("
+             << BlockSize << ") and cannot exceed "
+             << WNBD_DEFAULT_MAX_TRANSFER_LENGTH << " bytes." << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    IoBlocks = Options.IoSize / BlockSize;
+    IoSlots = BlockCount / IoBlocks;
+    if (!IoSlots) {
+        cerr << "The disk is smaller than the IO size." << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (!Options.IoCount && !Options.RuntimeSec) {
+        cerr << "The IO count or the runtime must be specified." << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    IoCount = Options.IoCount;
+    if (Options.RuntimeSec) {
+        Deadline = GetTimestamp() +
+            Options.RuntimeSec * GetTimestampFrequency();
+    }
+
+    Rng.seed(Options.Seed);
+    return 0;
+}
+
+bool SyntheticSource::Next(ReplayRequest* Request)
+{
+    if ((IoCount && Submitted >= IoCount) ||
+            (Deadline && GetTimestamp() >= Deadline)) {
+        return false;
+    }
+    Submitted++;
+
+    UINT64 Slot = NextSlot;
+    if (Random) {
+        Slot = Rng() % IoSlots;
+    } else {
+        NextSlot = (NextSlot + 1) % IoSlots;
+    }
+    bool Read = ReadPercentage == 100 ||
+        (ReadPercentage && Rng() % 100 < ReadPercentage);
+
+    *Request = { 0 };
+    if (Read) {
+        Request->Request.RequestType = WnbdReqTypeRead;
+        Request->Request.Cmd.Read.BlockAddress = Slot * IoBlocks;
+        Request->Request.Cmd.Read.BlockCount = IoBlocks;
+    } else {
+        Request->Request.RequestType = WnbdReqTypeWrite;
+        Request->Request.Cmd.Write.BlockAddress = Slot * IoBlocks;
+        Request->Request.Cmd.Write.BlockCount = IoBlocks;
+    }
+    return true;
+}
+
+struct ReplaySlot
+{
+    PVOID Buffer;
+    UINT64 StartTimestamp;
+    WnbdRequestType RequestType;
+    UINT32 Length;
+};
+
+// Submits requests to an offline disk, keeping up to "QueueDepth"
+// requests in flight. Requests are submitted by a single thread.
+class Replayer
+{
+private:
+    PWNBD_DISK Disk = nullptr;
+    bool NbdBackend = false;
+    bool FileBackend = false;
+    bool RamBackend = false;
+    UINT32 QueueDepth = 0;
+    UINT64 Frequency = GetTimestampFrequency();
+
+    vector<ReplaySlot> Slots;
+    UINT64 Sequence = 0;
+
+    // The following are protected by the lock.
+    mutex Lock;
+    condition_variable Cond;
+    vector<UINT32> FreeSlots;
+    unique_ptr<WNBD_LATENCY_STATS> Latency;
+    UINT64 Completed = 0;
+    UINT64 Errors = 0;
+    UINT64 BytesRead = 0;
+    UINT64 BytesWritten = 0;
+
+    UINT64 Skipped = 0;
+
+public:
+    ~Replayer();
+
+    DWORD Initialize(const ReplayOptions& Options);
+    DWORD Run(RequestSource& Source, bool PreserveTiming);
+    void PrintResults(double ElapsedSec);
+
+    UINT32 GetBlockSize() { return Disk->Properties.BlockSize; }
+    UINT64 GetBlockCount() { return Disk->Properties.BlockCount; }
+
+private:
+    bool AdjustRequest(ReplayRequest* Request);
+    void WaitUntil(UINT64 Timestamp);
+
+    static VOID OnResponse(
+        PVOID ResponseContext,
+        PWNBD_IO_RESPONSE Response,
+        PVOID DataBuffer,
+        UINT32 DataBufferSize);
+
+    // Null backend
+    static void NullRead(
+        PWNBD_DISK Disk,
+        UINT64 RequestHandle,
+        PVOID Buffer,
+        UINT64 BlockAddress,
+        UINT32 BlockCount,
+        BOOLEAN ForceUnitAccess);
+    static void NullWrite(
+        PWNBD_DISK Disk,
+        UINT64 RequestHandle,
+        PVOID Buffer,
+        UINT64 BlockAddress,
+        UINT32 BlockCount,
+        BOOLEAN ForceUnitAccess);
+    static void NullFlush(
+        PWNBD_DISK Disk,
+        UINT64 RequestHandle,
+        UINT64 BlockAddress,
+        UINT32 BlockCount);
+    static void NullUnmap(
+        PWNBD_DISK Disk,
+        UINT64 RequestHandle,
+        PWNBD_UNMAP_DESCRIPTOR Descriptors,
+        UINT32 Count);
+
+    static constexpr WNBD_INTERFACE NullInterface =
+    {
+        NullRead,
+        NullWrite,
+        NullFlush,
+        NullUnmap,
+    };
+};
+
+Replayer::~Replayer()
+{
+    if (Disk) {
+        if (NbdBackend) {
+            WnbdCloseOfflineNbd(Disk);
+        } else if (FileBackend) {
+            WnbdCloseOfflineFile(Disk);
+        } else if (RamBackend) {
+            WnbdCloseOfflineRam(Disk);
+        } else {
+            WnbdClose(Disk);
+        }
+    }
+    for (auto& Slot : Slots) {
+        _aligned_free(Slot.Buffer);
+    }
+}
+
+DWORD Replayer::Initialize(const ReplayOptions& Options)
+{
+    if (!Options.QueueDepth ||
+            Options.QueueDepth > WNBD_MAX_DISPATCHER_QUEUE_DEPTH) {
+        cerr << "Invalid queue depth: " << Options.QueueDepth
+             << ". Maximum queue depth: "
+             << WNBD_MAX_DISPATCHER_QUEUE_DEPTH << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    QueueDepth = Options.QueueDepth;
+
+    Latency.reset(new (nothrow) WNBD_LATENCY_STATS());
+    if (!Latency) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    for (UINT32 Index = 0; Index < QueueDepth; Index++) {
+        // Unbuffered file IO requires sector aligned buffers.
+        PVOID Buffer = _aligned_malloc(
+            WNBD_DEFAULT_MAX_TRANSFER_LENGTH, 4096);
+        if (!Buffer) {
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        Slots.push_back(ReplaySlot { Buffer });
+        FreeSlots.push_back(Index);
+    }
+
+    WNBD_PROPERTIES Props = { 0 };
+    string("wnbd-replay").copy(Props.InstanceName, WNBD_MAX_NAME_LENGTH);
+    string(WNBD_CLI_OWNER_NAME).copy(Props.Owner, WNBD_MAX_OWNER_LENGTH);
+    Props.BlockSize = Options.BlockSize;
+    Props.BlockCount = Options.BlockSize ?
+        Options.DiskSize / Options.BlockSize : 0;
+
+    DWORD Status = 0;
+    if (Options.Backend == "nbd") {
+        NbdBackend = true;
+        if (Options.HostName.empty() || !Options.PortNumber) {
+            cerr << "The NBD hostname and port are required." << endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+        Options.HostName.copy(Props.NbdProperties.Hostname,
+                              WNBD_MAX_NAME_LENGTH);
+        Options.ExportName.copy(Props.NbdProperties.ExportName,
+                                WNBD_MAX_NAME_LENGTH);
+        Props.NbdProperties.PortNumber = Options.PortNumber;
+        Props.Flags.UseUserspaceNbd = 1;
+
+        WSADATA WsaData;
+        int Ret = WSAStartup(MAKEWORD(2, 2), &WsaData);
+        if (Ret) {
+            cerr << "WSAStartup failed. ";
+            PrintFormattedError(Ret);
+            return Ret;
+        }
+        Status = WnbdCreateOfflineNbd(&Props, OnResponse, this, &Disk);
+    } else if (Options.Backend == "file") {
+        FileBackend = true;
+        if (Options.FilePath.empty() ||
+                Options.FilePath.length() >= MAX_PATH) {
+            cerr << "Missing or invalid file path." << endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+        WNBD_FILE_OPTIONS FileOptions = { 0 };
+        Options.FilePath.copy(FileOptions.Path, MAX_PATH - 1);
+        // The replay queue depth limits the pending file operations.
+        FileOptions.QueueDepth = QueueDepth;
+        Status = WnbdCreateOfflineFile(
+            &Props, &FileOptions, OnResponse, this, &Disk);
+    } else if (Options.Backend == "ram") {
+        RamBackend = true;
+        if (!Props.BlockCount) {
+            cerr << "The disk size and block size must be provided when "
+                    "using the RAM backend." << endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+        Status = WnbdCreateOfflineRam(&Props, OnResponse, this, &Disk);
+    } else if (Options.Backend == "null") {
+        if (!Props.BlockCount) {
+            cerr << "The disk size and block size must be provided when "
+                    "using the null backend." << endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+        Props.Flags.FlushSupported = 1;
+        Props.Flags.FUASupported = 1;
+        Props.Flags.UnmapSupported = 1;
+        Props.MaxUnmapDescCount = 1;
+        Status = WnbdCreateOffline(
+            &Props, (const PWNBD_INTERFACE) &NullInterface, this,
+            OnResponse, this, &Disk);
+    } else {
+        cerr << "Unknown backend: " << Options.Backend << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (Status) {
+        cerr << "Could not initialize the replay backend." << endl;
+        PrintFormattedError(Status);
+    }
+    return Status;
+}
+
+// Truncates requests that exceed the buffer size. Returns false for
+// requests that go past the end of the disk.
+bool Replayer::AdjustRequest(ReplayRequest* Request)
+{
+    UINT32 MaxBlocks = WNBD_DEFAULT_MAX_TRANSFER_LENGTH / GetBlockSize();
+    UINT64 BlockAddress = 0;
+    UINT32* BlockCount = nullptr;
+
+    switch (Request->Request.RequestType) {
+    case WnbdReqTypeRead:
+        BlockAddress = Request->Request.Cmd.Read.BlockAddress;
+        BlockCount = &Request->Request.Cmd.Read.BlockCount;
+        break;
+    case WnbdReqTypeWrite:
+        BlockAddress = Request->Request.Cmd.Write.BlockAddress;
+        BlockCount = &Request->Request.Cmd.Write.BlockCount;
+        break;
+    case WnbdReqTypeUnmap:
+        BlockAddress = Request->UnmapDescriptor.BlockAddress;
+        BlockCount = &Request->UnmapDescriptor.BlockCount;
+        break;
+    default:
+        return true;
+    }
+
+    if (Request->Request.RequestType != WnbdReqTypeUnmap) {
+        *BlockCount = min(*BlockCount, MaxBlocks);
+    }
+    return BlockAddress + *BlockCount <= GetBlockCount();
+}
+
+void Replayer::WaitUntil(UINT64 Timestamp)
+{
+    while (true) {
+        UINT64 Now = GetTimestamp();
+        if (Now >= Timestamp) {
+            return;
+        }
+        UINT64 RemainingMs = (Timestamp - Now) * 1000 / Frequency;
+        // Sleep may take longer than requested, spinning for
+        // the last couple of milliseconds.
+        if (RemainingMs > 2) {
+            Sleep((DWORD) (RemainingMs - 2));
+        } else {
+            YieldProcessor();
+        }
+    }
+}
+
+DWORD Replayer::Run(RequestSource& Source, bool PreserveTiming)
+{
+    DWORD Status = 0;
+    ReplayRequest Request;
+    UINT64 Start = GetTimestamp();
+    auto Timeout = chrono::seconds(REPLAY_REQUEST_TIMEOUT_SEC);
+
+    while (Source.Next(&Request)) {
+        if (!AdjustRequest(&Request)) {
+            Skipped++;
+            continue;
+        }
+        if (PreserveTiming) {
+            WaitUntil(Start + (UINT64) (
+                (double) Request.SubmitOffsetUs * Frequency / 1000000));
+        }
+
+        UINT32 SlotIndex = 0;
+        {
+            unique_lock Lock{this->Lock};
+            if (!Cond.wait_for(Lock, Timeout,
+                               [this] { return !FreeSlots.empty(); })) {
+                cerr << "Timed out waiting for IO requests to complete."
+                     << endl;
+                return ERROR_TIMEOUT;
+            }
+            SlotIndex = FreeSlots.back();
+            FreeSlots.pop_back();
+        }
+
+        ReplaySlot& Slot = Slots[SlotIndex];
+        Request.Request.RequestHandle =
+            (++Sequence << REPLAY_SLOT_BITS) | SlotIndex;
+        Slot.RequestType = Request.Request.RequestType;
+        Slot.Length = 0;
+        switch (Request.Request.RequestType) {
+        case WnbdReqTypeRead:
+            Slot.Length = Request.Request.Cmd.Read.BlockCount *
+                GetBlockSize();
+            break;
+        case WnbdReqTypeWrite:
+            Slot.Length = Request.Request.Cmd.Write.BlockCount *
+                GetBlockSize();
+            break;
+        case WnbdReqTypeUnmap:
+            memcpy(Slot.Buffer, &Request.UnmapDescriptor,
+                   sizeof(Request.UnmapDescriptor));
+            break;
+        }
+
+        Slot.StartTimestamp = GetTimestamp();
+        Status = WnbdSubmitRequest(Disk, &Request.Request, Slot.Buffer);
+        if (Status) {
+            cerr << "Could not submit request." << endl;
+            PrintFormattedError(Status);
+            return Status;
+        }
+    }
+
+    unique_lock Lock{this->Lock};
+    if (!Cond.wait_for(Lock, Timeout,
+                       [this] { return FreeSlots.size() == QueueDepth; })) {
+        cerr << "Timed out waiting for IO requests to complete." << endl;
+        return ERROR_TIMEOUT;
+    }
+    return 0;
+}
+
+VOID Replayer::OnResponse(
+    PVOID ResponseContext,
+    PWNBD_IO_RESPONSE Response,
+    PVOID DataBuffer,
+    UINT32 DataBufferSize)
+{
+    UINT64 Now = GetTimestamp();
+    Replayer* Handler = (Replayer*) ResponseContext;
+
+    UINT32 SlotIndex = (UINT32) (Response->RequestHandle & REPLAY_SLOT_MASK);
+    if (SlotIndex >= Handler->Slots.size()) {
+        cerr << "Received unexpected request handle: "
+             << Response->RequestHandle << endl;
+        return;
+    }
+
+    ReplaySlot& Slot = Handler->Slots[SlotIndex];
+    UINT64 LatencyUs = (Now - Slot.StartTimestamp) * 1000000 /
+        Handler->Frequency;
+
+    {
+        unique_lock Lock{Handler->Lock};
+        PWNBD_LATENCY_HISTOGRAM Histogram = &Handler->Latency->Histograms[
+            Slot.RequestType % WNBD_LATENCY_REQ_TYPE_COUNT];
+        Histogram->Buckets[WnbdLatencyBucketIndex(LatencyUs)]++;
+        Histogram->TotalUs += LatencyUs;
+
+        Handler->Completed++;
+        if (Response->Status.ScsiStatus) {
+            Handler->Errors++;
+        } else if (Slot.RequestType == WnbdReqTypeRead) {
+            Handler->BytesRead += Slot.Length;
+        } else if (Slot.RequestType == WnbdReqTypeWrite) {
+            Handler->BytesWritten += Slot.Length;
+        }
+        Handler->FreeSlots.push_back(SlotIndex);
+    }
+    Handler->Cond.notify_one();
+}
+
+void Replayer::PrintResults(double ElapsedSec)
+{
+    unique_lock Lock{this->Lock};
+    if (ElapsedSec <= 0) {
+        ElapsedSec = 1e-6;
+    }
+
+    cout << left << fixed << setprecision(2)
+         << setw(24) << "Completed requests" << " : " << Completed << endl
+         << setw(24) << "Errors" << " : " << Errors << endl
+         << setw(24) << "Skipped requests" << " : " << Skipped << endl
+         << setw(24) << "Elapsed seconds" << " : " << ElapsedSec << endl
+         << setw(24) << "IOPS" << " : " << Completed / ElapsedSec << endl
+         << setw(24) << "Read MB/s" << " : "
+         << BytesRead / ElapsedSec / (1 << 20) << endl
+         << setw(24) << "Write MB/s" << " : "
+         << BytesWritten / ElapsedSec / (1 << 20) << endl
+         << endl;
+    PrintLatencyHistograms(Latency.get());
+}
+
+void Replayer::NullRead(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle,
+    PVOID Buffer,
+    UINT64 BlockAddress,
+    UINT32 BlockCount,
+    BOOLEAN ForceUnitAccess)
+{
+    WNBD_IO_RESPONSE Response = { 0 };
+    Response.RequestHandle = RequestHandle;
+    Response.RequestType = WnbdReqTypeRead;
+    WnbdSendResponse(Disk, &Response, Buffer,
+                     BlockCount * Disk->Properties.BlockSize);
+}
+
+void Replayer::NullWrite(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle,
+    PVOID Buffer,
+    UINT64 BlockAddress,
+    UINT32 BlockCount,
+    BOOLEAN ForceUnitAccess)
+{
+    WNBD_IO_RESPONSE Response = { 0 };
+    Response.RequestHandle = RequestHandle;
+    Response.RequestType = WnbdReqTypeWrite;
+    WnbdSendResponse(Disk, &Response, NULL, 0);
+}
+
+void Replayer::NullFlush(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle,
+    UINT64 BlockAddress,
+    UINT32 BlockCount)
+{
+    WNBD_IO_RESPONSE Response = { 0 };
+    Response.RequestHandle = RequestHandle;
+    Response.RequestType = WnbdReqTypeFlush;
+    WnbdSendResponse(Disk, &Response, NULL, 0);
+}
+
+void Replayer::NullUnmap(
+    PWNBD_DISK Disk,
+    UINT64 RequestHandle,
+    PWNBD_UNMAP_DESCRIPTOR Descriptors,
+    UINT32 Count)
+{
+    WNBD_IO_RESPONSE Response = { 0 };
+    Response.RequestHandle = RequestHandle;
+    Response.RequestType = WnbdReqTypeUnmap;
+    WnbdSendResponse(Disk, &Response, NULL, 0);
+}
+
+DWORD CmdReplay(const ReplayOptions& Options)
+{
+    ReplayOptions CurrOptions = Options;
+    unique_ptr<TraceSource> Trace;
+    unique_ptr<SyntheticSource> Synthetic;
+    RequestSource* Source = nullptr;
+
+    DWORD Status = 0;
+    if (!CurrOptions.TracePath.empty()) {
+        Trace.reset(new TraceSource());
+        Status = Trace->Load(CurrOptions.TracePath);
+        if (Status) {
+            return Status;
+        }
+        // Unless specified, the null backend uses the traced disk geometry.
+        if (!CurrOptions.BlockSize) {
+            CurrOptions.BlockSize = Trace->Header.BlockSize;
+        }
+        if (!CurrOptions.DiskSize) {
+            CurrOptions.DiskSize =
+                Trace->Header.BlockCount * Trace->Header.BlockSize;
+        }
+        Source = Trace.get();
+    } else if (CurrOptions.PreserveTiming) {
+        cerr << "The original timing can only be preserved when "
+                "replaying trace files." << endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (!CurrOptions.BlockSize) {
+        CurrOptions.BlockSize = WNBD_DEFAULT_BLOCK_SIZE;
+    }
+
+    Replayer Replay;
+    Status = Replay.Initialize(CurrOptions);
+    if (Status) {
+        return Status;
+    }
+
+    if (!Source) {
+        Synthetic.reset(new SyntheticSource());
+        Status = Synthetic->Initialize(
+            CurrOptions, Replay.GetBlockSize(), Replay.GetBlockCount());
+        if (Status) {
+            return Status;
+        }
+        Source = Synthetic.get();
+    }
+
+    auto Start = chrono::steady_clock::now();
+    Status = Replay.Run(*Source, CurrOptions.PreserveTiming);
+    chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+
+    Replay.PrintResults(Elapsed.count());
+    return Status;
+}
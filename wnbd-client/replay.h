@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2023 Cloudbase Solutions
+ *
+ * Licensed under LGPL-2.1 (see LICENSE)
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include <string>
+
+// Replays binary IO traces (see WnbdStartIoTrace) or synthetic workloads
+// against libwnbd backends. Offline disks are used, so the WNBD driver
+// isn't involved.
+struct ReplayOptions
+{
+    // "null", "ram", "nbd" or "file". The null backend completes
+    // requests right away.
+    std::string Backend;
+    std::string HostName;
+    DWORD PortNumber = 0;
+    std::string ExportName;
+    // File backend only, see WnbdCreateOfflineFile.
+    std::string FilePath;
+
+    // Replays the specified trace file if set, otherwise a synthetic
+    // workload is generated.
+    std::string TracePath;
+    // Submit the traced requests using the original timing instead of
+    // replaying them as fast as the queue depth allows.
+    bool PreserveTiming = false;
+
+    // Synthetic workload: read, write, rw, randread, randwrite or randrw.
+    std::string Pattern;
+    UINT32 IoSize = 0;
+    // Mixed workloads only.
+    UINT32 ReadPercentage = 0;
+    // Stops after the specified number of requests or seconds,
+    // whichever comes first. 0 means unlimited.
+    UINT64 IoCount = 0;
+    UINT32 RuntimeSec = 0;
+    UINT64 Seed = 0;
+
+    // The null and RAM backend disk size. NBD disks use the export size while
+    // file disks use the file size, unless the file gets created.
+    UINT64 DiskSize = 0;
+    UINT32 BlockSize = 0;
+    UINT32 QueueDepth = 0;
+};
+
+DWORD CmdReplay(const ReplayOptions& Options);